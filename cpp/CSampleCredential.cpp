@@ -16,6 +16,13 @@
 #include <strsafe.h>
 #include "CSampleCredential.h"
 #include "guid.h"
+#include "accountcache.h"
+#include "backupcodes.h"
+#include "groupcache.h"
+#include "logonstatus.h"
+#include "otpdelivery.h"
+#include "totp.h"
+#include "warmstart.h"
 #include "utils.h"
 
 namespace
@@ -30,12 +37,24 @@ namespace
     }
 }
 
+const QITAB CSampleCredential::c_rgqit[] =
+{
+    QITABENT(CSampleCredential, ICredentialProviderCredential), // IID_ICredentialProviderCredential
+    QITABENT(CSampleCredential, ICredentialProviderCredential2), // IID_ICredentialProviderCredential2
+    QITABENT(CSampleCredential, ICredentialProviderCredentialWithFieldOptions), //IID_ICredentialProviderCredentialWithFieldOptions
+    {0},
+};
+
 CSampleCredential::CSampleCredential():
-    _cRef(1),
     _pCredProvCredentialEvents(nullptr),
     _pszUserSid(nullptr),
     _pszQualifiedUserName(nullptr),
     _fIsLocalUser(false),
+    _mfaFactor(MFA_FACTOR_NONE),
+    _fOtpChallengeSent(false),
+    _fOtpOffline(false),
+    _pPendingOtp(nullptr),
+    _pOtpSubmit(nullptr),
     _fChecked(false),
     _fShowControls(false),
     _dwComboIndex(0)
@@ -45,6 +64,7 @@ CSampleCredential::CSampleCredential():
     ZeroMemory(_rgCredProvFieldDescriptors, sizeof(_rgCredProvFieldDescriptors));
     ZeroMemory(_rgFieldStatePairs, sizeof(_rgFieldStatePairs));
     ZeroMemory(_rgFieldStrings, sizeof(_rgFieldStrings));
+    ZeroMemory(&_otpDelivery, sizeof(_otpDelivery));
 }
 
 CSampleCredential::~CSampleCredential()
@@ -54,6 +74,21 @@ CSampleCredential::~CSampleCredential()
         size_t lenPassword = wcslen(_rgFieldStrings[SFI_PASSWORD]);
         SecureZeroMemory(_rgFieldStrings[SFI_PASSWORD], lenPassword * sizeof(*_rgFieldStrings[SFI_PASSWORD]));
     }
+    if (_rgFieldStrings[SFI_OTP])
+    {
+        SecureZeroMemory(_rgFieldStrings[SFI_OTP], wcslen(_rgFieldStrings[SFI_OTP]) * sizeof(wchar_t));
+    }
+    CancelOtpDelivery(&_otpDelivery);
+    if (_pPendingOtp)
+    {
+        _pPendingOtp->Cancel();
+        _pPendingOtp->Release();
+    }
+    if (_pOtpSubmit)
+    {
+        _pOtpSubmit->Cancel();
+        _pOtpSubmit->Release();
+    }
     for (int i = 0; i < ARRAYSIZE(_rgFieldStrings); i++)
     {
         CoTaskMemFree(_rgFieldStrings[i]);
@@ -65,12 +100,12 @@ CSampleCredential::~CSampleCredential()
 }
 
 
-// Initializes one credential with the field information passed in.
-// Set the value of the SFI_LARGE_TEXT field to pwzUsername.
+// Initializes one credential with the field information passed in. pUser is the prefetched
+// identity of the user the tile is bound to, or nullptr for the empty CredUI tile.
 HRESULT CSampleCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
                                       _In_ CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR const *rgcpfd,
                                       _In_ FIELD_STATE_PAIR const *rgfsp,
-                                      _In_ ICredentialProviderUser *pcpUser)
+                                      _In_opt_ const USER_METADATA *pUser)
 {
     HRESULT hr = S_OK;
     _cpus = cpus;
@@ -107,20 +142,22 @@ HRESULT CSampleCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
         hr = SHStrDupW(L"", &_rgFieldStrings[SFI_PASSWORD]);
     }
     if (SUCCEEDED(hr))
+    {
+        hr = SHStrDupW(L"", &_rgFieldStrings[SFI_OTP]);
+    }
+    if (SUCCEEDED(hr))
     {
         hr = SHStrDupW(L"Submit", &_rgFieldStrings[SFI_SUBMIT_BUTTON]);
     }
 
-    if (SUCCEEDED(hr) && pcpUser != nullptr)
+    if (SUCCEEDED(hr) && pUser != nullptr)
     {
-        GUID guidProvider;
-        pcpUser->GetProviderID(&guidProvider);
-        _fIsLocalUser = (guidProvider == Identity_LocalUserProvider);
+        _fIsLocalUser = (pUser->guidProvider == Identity_LocalUserProvider);
 
-        hr = pcpUser->GetStringValue(PKEY_Identity_QualifiedUserName, &_pszQualifiedUserName);
+        hr = SHStrDupW(pUser->pszQualifiedUserName, &_pszQualifiedUserName);
         if (SUCCEEDED(hr))
         {
-            hr = pcpUser->GetSid(&_pszUserSid);
+            hr = SHStrDupW(pUser->pszSid, &_pszUserSid);
         }
     }
     else if (SUCCEEDED(hr))
@@ -132,6 +169,381 @@ HRESULT CSampleCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
     return hr;
 }
 
+// Prepares a pooled credential for another usage scenario cycle. The descriptors, the bound user
+// and the static field strings stay as they are; only what the user typed is wiped.
+HRESULT CSampleCredential::ResetForReuse()
+{
+    HRESULT hr = _ResetOtp();
+    if (_rgFieldStrings[SFI_PASSWORD] == nullptr || *_rgFieldStrings[SFI_PASSWORD] != L'\0')
+    {
+        if (_rgFieldStrings[SFI_PASSWORD])
+        {
+            size_t lenPassword = wcslen(_rgFieldStrings[SFI_PASSWORD]);
+            SecureZeroMemory(_rgFieldStrings[SFI_PASSWORD], lenPassword * sizeof(*_rgFieldStrings[SFI_PASSWORD]));
+            CoTaskMemFree(_rgFieldStrings[SFI_PASSWORD]);
+        }
+        hr = SHStrDupW(L"", &_rgFieldStrings[SFI_PASSWORD]);
+    }
+    return hr;
+}
+
+// Prefills the tile with credentials the provider received through SetSerialization, such as
+// the ones an RDP client sent. GetSerialization packs them like typed credentials.
+HRESULT CSampleCredential::SetRemoteCredentials(_In_ PCWSTR pszUserName, _In_ PCWSTR pszPassword)
+{
+    HRESULT hr = SetStringValue(SFI_USERNAME, pszUserName);
+    if (SUCCEEDED(hr))
+    {
+        hr = ResetForReuse();
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = SetStringValue(SFI_PASSWORD, pszPassword);
+    }
+    return hr;
+}
+
+// Records the second factor the MFA policy requires of the bound user. Set on every enumeration,
+// since a pooled credential may have outlived a policy update.
+void CSampleCredential::SetMfaFactor(MFA_FACTOR mfaFactor)
+{
+    _mfaFactor = mfaFactor;
+}
+
+// Whether the push approval this tile is waiting for has come in, or the gateway has answered the
+// last submit, so the provider can submit it again without the user doing anything more.
+bool CSampleCredential::IsSecondFactorReady() const
+{
+    return (_pOtpSubmit != nullptr && _pOtpSubmit->IsDone()) ||
+           (_fOtpChallengeSent && GetOtpDeliveryApproval(&_otpDelivery) == S_OK);
+}
+
+// Decides the second factor again at submit. The tile may have been built before the user's
+// groups were known, and a typed (CredUI) or remote (RDP) user name has no tile decision at all.
+// This runs on the UI thread, so it only reads the account and group caches; a miss queues the
+// lookup and the decision fails closed. A user whose groups are not known yet is held to the
+// strongest factor their own entry, any group or the default could impose, and one whose SID is
+// not known to the strongest in the whole index; a policy that cannot be loaded requires at least
+// an OTP. The user's SID comes back as well when it is known.
+HRESULT CSampleCredential::_DecideMfaAtSubmit(_In_ PCWSTR pszUserName, _Out_ MFA_FACTOR *pmfaFactor, _Outptr_result_maybenull_ PWSTR *ppszUserSid)
+{
+    *pmfaFactor = MFA_FACTOR_NONE;
+    *ppszUserSid = nullptr;
+    CMfaPolicyIndex *pMfaPolicy;
+    HRESULT hrPolicy = GetMfaPolicyIndex(&pMfaPolicy);
+    if (hrPolicy == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) || hrPolicy == HRESULT_FROM_WIN32(ERROR_PATH_NOT_FOUND))
+    {
+        // No policy has been deployed.
+        return S_OK;
+    }
+    if (FAILED(hrPolicy))
+    {
+        // A policy that is there but cannot be read, or is not owned by SYSTEM or Administrators,
+        // must not turn MFA off.
+        *pmfaFactor = MFA_FACTOR_OTP;
+        return S_OK;
+    }
+
+    PWSTR pszSid = nullptr;
+    HRESULT hr;
+    if (pszUserName == _pszQualifiedUserName && _pszUserSid != nullptr && *_pszUserSid != L'\0')
+    {
+        hr = SHStrDupW(_pszUserSid, &pszSid);
+    }
+    else
+    {
+        hr = GetSidForAccountName(pszUserName, false, &pszSid);
+    }
+
+    if (hr == S_OK)
+    {
+        ULONGLONG rgullGroupHashes[c_cMaxCachedGroups];
+        DWORD cGroups = 0;
+        bool fGroupsKnown = (GetUserGroupHashes(pszSid, false, rgullGroupHashes, ARRAYSIZE(rgullGroupHashes), &cGroups) == S_OK);
+        *pmfaFactor = pMfaPolicy->DecideForSidString(pszSid, fGroupsKnown ? rgullGroupHashes : nullptr, cGroups);
+        *ppszUserSid = pszSid;
+    }
+    else
+    {
+        // A name that cannot be resolved, or is not cached yet, could be anybody in the index.
+        *pmfaFactor = pMfaPolicy->StrongestFactor();
+    }
+    pMfaPolicy->Release();
+    return S_OK;
+}
+
+// Runs the second factor for GetSerialization. Returns S_OK once it is satisfied or not required,
+// and S_FALSE while the tile waits for the user, with the status text to show.
+//
+// Codes normally come from a gateway challenge. Users with an app seed provisioned to this machine
+// enter their app code here instead when their factor is TOTP, or for any factor once the
+// gateway cannot be reached; that code is checked locally. A backup code is accepted in place
+// of any other code.
+//
+// Nothing here waits on the gateway: sending the challenge and checking the answer run on the
+// thread pool (see COtpSubmit) while the status says so, and the provider submits the tile again
+// once the result is in.
+HRESULT CSampleCredential::_CheckSecondFactor(_In_ PCWSTR pszUserName,
+                                              _Outptr_result_maybenull_ PWSTR *ppwszStatusText,
+                                              _Out_ CREDENTIAL_PROVIDER_STATUS_ICON *pcpsiStatusIcon)
+{
+    *ppwszStatusText = nullptr;
+    *pcpsiStatusIcon = CPSI_NONE;
+
+    bool fAnswered = false;
+    bool fDelivered = false;
+    HRESULT hrSubmit = S_OK;
+    if (_pOtpSubmit != nullptr)
+    {
+        if (!_pOtpSubmit->IsDone())
+        {
+            LoadStatusString(_pOtpSubmit->IsAnswer() ? IDS_OTP_CHECKING_CODE : IDS_OTP_SENDING_CODE, ppwszStatusText);
+            return S_FALSE;
+        }
+        hrSubmit = _pOtpSubmit->TakeResult(&_otpDelivery);
+        fAnswered = _pOtpSubmit->IsAnswer();
+        fDelivered = !fAnswered;
+        _pOtpSubmit->Release();
+        _pOtpSubmit = nullptr;
+    }
+
+    MFA_FACTOR mfaFactor;
+    PWSTR pszSid;
+    HRESULT hr = _DecideMfaAtSubmit(pszUserName, &mfaFactor, &pszSid);
+    if (FAILED(hr) || mfaFactor == MFA_FACTOR_NONE)
+    {
+        CoTaskMemFree(pszSid);
+        return hr;
+    }
+    bool fLocalSeed = (pszSid != nullptr && HasLocalTotpSeed(pszSid) == S_OK);
+    bool fOfflineCodes = fLocalSeed || (pszSid != nullptr && HasBackupCodes() == S_OK);
+    UINT idsOffline = fLocalSeed ? IDS_OTP_ENTER_OFFLINE_CODE : IDS_OTP_ENTER_BACKUP_CODE;
+
+    // A challenge only answers for the user it went to. The user name can still be edited on the
+    // CredUI and remote tiles, and a code sent to one user must not log on another.
+    if (_fOtpChallengeSent && !IsOtpDeliveryFor(&_otpDelivery, pszUserName, pszSid))
+    {
+        CoTaskMemFree(pszSid);
+        _ResetOtp();
+        LogHr(L"[OTP] challenge was sent to another user", E_ACCESSDENIED);
+        return E_ACCESSDENIED;
+    }
+
+    UINT idsStatus;
+    PCWSTR pszCode = _rgFieldStrings[SFI_OTP];
+    bool fCode = (pszCode != nullptr && *pszCode != L'\0');
+    bool fPush = (_fOtpChallengeSent && (_otpDelivery.dwChannels & OTP_CHANNEL_PUSH));
+    if (fAnswered || ((_fOtpChallengeSent || _fOtpOffline) && (fCode || fPush)))
+    {
+        // Every channel the challenge went out on is checked; a push approval needs no code.
+        if (fAnswered)
+        {
+            hr = hrSubmit;
+        }
+        else if (!_fOtpOffline)
+        {
+            hr = COtpSubmit::StartAnswer(&_otpDelivery, pszUserName, pszSid, pszCode, &_pOtpSubmit);
+            if (SUCCEEDED(hr))
+            {
+                CoTaskMemFree(pszSid);
+                LoadStatusString(IDS_OTP_CHECKING_CODE, ppwszStatusText);
+                return S_FALSE;
+            }
+        }
+        else
+        {
+            hr = fLocalSeed ? VerifyLocalTotpCode(pszSid, pszCode) : E_ACCESSDENIED;
+        }
+        if (hr != S_OK && fCode && pszSid != nullptr && ConsumeBackupCode(pszSid, pszCode) == S_OK)
+        {
+            hr = S_OK;
+        }
+        if (hr == S_OK)
+        {
+            CoTaskMemFree(pszSid);
+            return _ResetOtp();
+        }
+        _ClearOtpCode();
+        if (hr == E_PENDING)
+        {
+            idsStatus = IDS_OTP_ENTER_CODE;
+        }
+        else if (hr == E_ACCESSDENIED)
+        {
+            idsStatus = IDS_OTP_WRONG_CODE;
+        }
+        else if (hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT))
+        {
+            _fOtpChallengeSent = false;
+            idsStatus = IDS_OTP_CODE_EXPIRED;
+        }
+        else if (!_fOtpOffline && fOfflineCodes)
+        {
+            CancelOtpDelivery(&_otpDelivery);
+            _fOtpChallengeSent = false;
+            _fOtpOffline = true;
+            idsStatus = idsOffline;
+        }
+        else
+        {
+            idsStatus = IDS_OTP_GATEWAY_UNAVAILABLE;
+        }
+    }
+    else
+    {
+        idsStatus = (mfaFactor == MFA_FACTOR_TOTP) ? IDS_OTP_ENTER_APP_CODE : IDS_OTP_ENTER_CODE;
+    }
+
+    if (!fDelivered && !_fOtpChallengeSent && !_fOtpOffline && mfaFactor == MFA_FACTOR_TOTP && fLocalSeed)
+    {
+        // App codes this machine can check need no gateway.
+        _fOtpOffline = true;
+    }
+    if (fDelivered || (!_fOtpChallengeSent && !_fOtpOffline))
+    {
+        if (!fDelivered)
+        {
+            // The challenge delivered while the password was typed is taken over if it still fits.
+            CPendingOtpChallenge *pPending = _pPendingOtp;
+            _pPendingOtp = nullptr;
+            if (pPending != nullptr && !pPending->IsFor(pszUserName, mfaFactor))
+            {
+                pPending->Cancel();
+                pPending->Release();
+                pPending = nullptr;
+            }
+            hr = COtpSubmit::StartDelivery(&_otpDelivery, pszUserName, pszSid, OtpChannelsForFactor(mfaFactor), pPending, &_pOtpSubmit);
+            if (SUCCEEDED(hr))
+            {
+                // An expired code says a new one is on its way.
+                CoTaskMemFree(pszSid);
+                LoadStatusString((idsStatus == IDS_OTP_CODE_EXPIRED) ? idsStatus : IDS_OTP_SENDING_CODE, ppwszStatusText);
+                return S_FALSE;
+            }
+        }
+        else
+        {
+            hr = hrSubmit;
+        }
+        _fOtpChallengeSent = SUCCEEDED(hr);
+        if (FAILED(hr))
+        {
+            _fOtpOffline = fOfflineCodes;
+            idsStatus = fOfflineCodes ? idsOffline : IDS_OTP_GATEWAY_UNAVAILABLE;
+        }
+    }
+    if (_fOtpChallengeSent || _fOtpOffline)
+    {
+        _ShowOtpField();
+    }
+    CoTaskMemFree(pszSid);
+
+    if (idsStatus == IDS_OTP_ENTER_CODE && _fOtpChallengeSent)
+    {
+        if (_otpDelivery.dwChannels == OTP_CHANNEL_PUSH)
+        {
+            idsStatus = IDS_OTP_APPROVE_PUSH;
+        }
+        else if (_otpDelivery.dwChannels & OTP_CHANNEL_PUSH)
+        {
+            idsStatus = IDS_OTP_APPROVE_OR_ENTER_CODE;
+        }
+        else if (_otpDelivery.dwChannels & OTP_CHANNEL_EMAIL)
+        {
+            idsStatus = IDS_OTP_ENTER_CODE_ANY_CHANNEL;
+        }
+    }
+    LoadStatusString(idsStatus, ppwszStatusText);
+    *pcpsiStatusIcon = (idsStatus == IDS_OTP_ENTER_CODE || idsStatus == IDS_OTP_ENTER_APP_CODE || idsStatus == IDS_OTP_APPROVE_PUSH ||
+                        idsStatus == IDS_OTP_APPROVE_OR_ENTER_CODE || idsStatus == IDS_OTP_ENTER_CODE_ANY_CHANNEL) ? CPSI_NONE : CPSI_WARNING;
+    return S_FALSE;
+}
+
+// Delivers the bound user's challenge in the background, once per selection. Push approvals are
+// left for the submit: they must not reach the device before the password does. App codes this
+// machine can check itself need no challenge at all.
+void CSampleCredential::_StartSpeculativeOtp()
+{
+    if (_pPendingOtp == nullptr && _pOtpSubmit == nullptr && !_fOtpChallengeSent && !_fOtpOffline &&
+        CPendingOtpChallenge::SpeculativeChannels(_mfaFactor) != 0 &&
+        _pszQualifiedUserName != nullptr && *_pszQualifiedUserName != L'\0' &&
+        !(_mfaFactor == MFA_FACTOR_TOTP && _pszUserSid != nullptr && HasLocalTotpSeed(_pszUserSid) == S_OK))
+    {
+        HRESULT hr = CPendingOtpChallenge::Start(_pszQualifiedUserName, _pszUserSid, _mfaFactor, &_pPendingOtp);
+        if (FAILED(hr))
+        {
+            LogHr(L"[OTP] speculative challenge not started", hr);
+        }
+    }
+}
+
+// Shows the OTP field with focus and moves the submit button next to it.
+void CSampleCredential::_ShowOtpField()
+{
+    _rgFieldStatePairs[SFI_OTP].cpfs = CPFS_DISPLAY_IN_SELECTED_TILE;
+    _rgFieldStatePairs[SFI_OTP].cpfis = CPFIS_FOCUSED;
+    if (_pCredProvCredentialEvents)
+    {
+        _pCredProvCredentialEvents->BeginFieldUpdates();
+        _pCredProvCredentialEvents->SetFieldState(this, SFI_OTP, CPFS_DISPLAY_IN_SELECTED_TILE);
+        _pCredProvCredentialEvents->SetFieldInteractiveState(this, SFI_OTP, CPFIS_FOCUSED);
+        _pCredProvCredentialEvents->SetFieldSubmitButton(this, SFI_SUBMIT_BUTTON, SFI_OTP);
+        _pCredProvCredentialEvents->EndFieldUpdates();
+    }
+}
+
+// Wipes the code the user typed.
+HRESULT CSampleCredential::_ClearOtpCode()
+{
+    HRESULT hr = S_OK;
+    if (_rgFieldStrings[SFI_OTP] == nullptr || *_rgFieldStrings[SFI_OTP] != L'\0')
+    {
+        if (_rgFieldStrings[SFI_OTP])
+        {
+            SecureZeroMemory(_rgFieldStrings[SFI_OTP], wcslen(_rgFieldStrings[SFI_OTP]) * sizeof(wchar_t));
+            CoTaskMemFree(_rgFieldStrings[SFI_OTP]);
+        }
+        hr = SHStrDupW(L"", &_rgFieldStrings[SFI_OTP]);
+        if (SUCCEEDED(hr) && _pCredProvCredentialEvents)
+        {
+            _pCredProvCredentialEvents->SetFieldString(this, SFI_OTP, _rgFieldStrings[SFI_OTP]);
+        }
+    }
+    return hr;
+}
+
+// Forgets the challenge, sent or still pending, and the code, and hides the OTP field until the
+// next code is sent.
+HRESULT CSampleCredential::_ResetOtp()
+{
+    bool fWasShown = (_rgFieldStatePairs[SFI_OTP].cpfs != CPFS_HIDDEN);
+    if (_pPendingOtp)
+    {
+        _pPendingOtp->Cancel();
+        _pPendingOtp->Release();
+        _pPendingOtp = nullptr;
+    }
+    if (_pOtpSubmit)
+    {
+        _pOtpSubmit->Cancel();
+        _pOtpSubmit->Release();
+        _pOtpSubmit = nullptr;
+    }
+    _fOtpChallengeSent = false;
+    _fOtpOffline = false;
+    CancelOtpDelivery(&_otpDelivery);
+    _rgFieldStatePairs[SFI_OTP].cpfs = CPFS_HIDDEN;
+    _rgFieldStatePairs[SFI_OTP].cpfis = CPFIS_NONE;
+    if (fWasShown && _pCredProvCredentialEvents)
+    {
+        _pCredProvCredentialEvents->BeginFieldUpdates();
+        _pCredProvCredentialEvents->SetFieldState(this, SFI_OTP, CPFS_HIDDEN);
+        _pCredProvCredentialEvents->SetFieldSubmitButton(this, SFI_SUBMIT_BUTTON, SFI_PASSWORD);
+        _pCredProvCredentialEvents->EndFieldUpdates();
+    }
+    return _ClearOtpCode();
+}
+
 // LogonUI calls this in order to give us a callback in case we need to notify it of anything.
 HRESULT CSampleCredential::Advise(_In_ ICredentialProviderCredentialEvents *pcpce)
 {
@@ -162,15 +574,19 @@ HRESULT CSampleCredential::UnAdvise()
 HRESULT CSampleCredential::SetSelected(_Out_ BOOL *pbAutoLogon)
 {
     *pbAutoLogon = FALSE;
+    if (_mfaFactor != MFA_FACTOR_NONE)
+    {
+        PrewarmOtpConnection();
+    }
     return S_OK;
 }
 
 // Similarly to SetSelected, LogonUI calls this when your tile was selected
 // and now no longer is. The most common thing to do here (which we do below)
-// is to clear out the password field.
+// is to clear out the password field, and with it any second factor in progress.
 HRESULT CSampleCredential::SetDeselected()
 {
-    HRESULT hr = S_OK;
+    HRESULT hr = _ResetOtp();
     if (_rgFieldStrings[SFI_PASSWORD])
     {
         size_t lenPassword = wcslen(_rgFieldStrings[SFI_PASSWORD]);
@@ -292,6 +708,29 @@ HRESULT CSampleCredential::SetStringValue(DWORD dwFieldID, _In_ PCWSTR pwz)
         CPFT_PASSWORD_TEXT == _rgCredProvFieldDescriptors[dwFieldID].cpft))
     {
         PWSTR *ppwszStored = &_rgFieldStrings[dwFieldID];
+
+        // A second factor in progress belongs to the user it was started for.
+        if (dwFieldID == SFI_USERNAME && (*ppwszStored == nullptr || wcscmp(*ppwszStored, pwz) != 0))
+        {
+            _ResetOtp();
+        }
+
+        // Moving on to the password means a typed user name is complete, so start resolving
+        // its SID now rather than at submit.
+        if (dwFieldID == SFI_PASSWORD && *pwz != L'\0' && (*ppwszStored == nullptr || **ppwszStored == L'\0') &&
+            (_pszUserSid == nullptr || *_pszUserSid == L'\0') &&
+            _rgFieldStrings[SFI_USERNAME] != nullptr && *_rgFieldStrings[SFI_USERNAME] != L'\0')
+        {
+            PrimeAccountName(_rgFieldStrings[SFI_USERNAME]);
+        }
+
+        // The first password character on a tile with a second factor sends the code, so it is
+        // already on the phone by the time the password is submitted.
+        if (dwFieldID == SFI_PASSWORD && *pwz != L'\0' && (*ppwszStored == nullptr || **ppwszStored == L'\0'))
+        {
+            _StartSpeculativeOtp();
+        }
+
         CoTaskMemFree(*ppwszStored);
         hr = SHStrDupW(pwz, ppwszStored);
     }
@@ -403,6 +842,17 @@ HRESULT CSampleCredential::GetSerialization(
             return hr;
         }
 
+        //
+        // 1b) Second factor. Until it is satisfied the tile stays up with the OTP field and a
+        //     status message; remote credentials go through here like typed ones.
+        //
+        hr = _CheckSecondFactor(pszUserNameForSerialization, ppwszOptionalStatusText, pcpsiOptionalStatusIcon);
+        if (hr != S_OK)
+        {
+            LogHr(L"[CREDENTIAL] GetSerialization waiting for second factor", hr);
+            return SUCCEEDED(hr) ? S_OK : hr;
+        }
+
         //
         // 2) Protect/copy the password (your existing helper)
         //
@@ -488,10 +938,10 @@ HRESULT CSampleCredential::GetSerialization(
         // 7) Retrieve the Negotiate auth package and finish filling serialization
         //
         ULONG ulAuthPackage = 0;
-        hr = RetrieveNegotiateAuthPackage(&ulAuthPackage);
+        hr = RetrieveCachedNegotiateAuthPackage(&ulAuthPackage);
         if (FAILED(hr))
         {
-            LogHr(L"GetSerialization: RetrieveNegotiateAuthPackage failed", hr);
+            LogHr(L"GetSerialization: RetrieveCachedNegotiateAuthPackage failed", hr);
 
             CoTaskMemFree(pcpcs->rgbSerialization);
             pcpcs->rgbSerialization = nullptr;
@@ -526,24 +976,9 @@ HRESULT CSampleCredential::GetSerialization(
 }
 
 
-struct REPORT_RESULT_STATUS_INFO
-{
-    NTSTATUS ntsStatus;
-    NTSTATUS ntsSubstatus;
-    PWSTR     pwzMessage;
-    CREDENTIAL_PROVIDER_STATUS_ICON cpsi;
-};
-
-static const REPORT_RESULT_STATUS_INFO s_rgLogonStatusInfo[] =
-{
-    { STATUS_LOGON_FAILURE, STATUS_SUCCESS, L"Incorrect password or username.", CPSI_ERROR, },
-    { STATUS_ACCOUNT_RESTRICTION, STATUS_ACCOUNT_DISABLED, L"The account is disabled.", CPSI_WARNING },
-};
-
 // ReportResult is completely optional.  Its purpose is to allow a credential to customize the string
-// and the icon displayed in the case of a logon failure.  For example, we have chosen to
-// customize the error shown in the case of bad username/password and in the case of the account
-// being disabled.
+// and the icon displayed in the case of a logon failure.  The messages for the known logon
+// NTSTATUS codes live in the string table and are resolved by LookupLogonStatusInfo.
 HRESULT CSampleCredential::ReportResult(NTSTATUS ntsStatus,
                                         NTSTATUS ntsSubstatus,
                                         _Outptr_result_maybenull_ PWSTR *ppwszOptionalStatusText,
@@ -552,25 +987,7 @@ HRESULT CSampleCredential::ReportResult(NTSTATUS ntsStatus,
     *ppwszOptionalStatusText = nullptr;
     *pcpsiOptionalStatusIcon = CPSI_NONE;
 
-    DWORD dwStatusInfo = (DWORD)-1;
-
-    // Look for a match on status and substatus.
-    for (DWORD i = 0; i < ARRAYSIZE(s_rgLogonStatusInfo); i++)
-    {
-        if (s_rgLogonStatusInfo[i].ntsStatus == ntsStatus && s_rgLogonStatusInfo[i].ntsSubstatus == ntsSubstatus)
-        {
-            dwStatusInfo = i;
-            break;
-        }
-    }
-
-    if ((DWORD)-1 != dwStatusInfo)
-    {
-        if (SUCCEEDED(SHStrDupW(s_rgLogonStatusInfo[dwStatusInfo].pwzMessage, ppwszOptionalStatusText)))
-        {
-            *pcpsiOptionalStatusIcon = s_rgLogonStatusInfo[dwStatusInfo].cpsi;
-        }
-    }
+    LookupLogonStatusInfo(ntsStatus, ntsSubstatus, ppwszOptionalStatusText, pcpsiOptionalStatusIcon);
 
     // If we failed the logon, try to erase the password field.
     if (FAILED(HRESULT_FROM_NT(ntsStatus)))
@@ -584,6 +1001,10 @@ HRESULT CSampleCredential::ReportResult(NTSTATUS ntsStatus,
     else
     {
         WriteLogMessage(L"[CREDENTIAL] ReportResult success/continue");
+        if (ntsStatus == STATUS_SUCCESS)
+        {
+            RefreshWarmStartAsync((_pszUserSid != nullptr) ? _pszUserSid : L"", _mfaFactor);
+        }
     }
 
     // Since nullptr is a valid value for *ppwszOptionalStatusText and *pcpsiOptionalStatusIcon
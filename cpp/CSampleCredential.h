@@ -19,41 +19,22 @@
 #include <strsafe.h>
 #include <shlguid.h>
 #include <propkey.h>
+#include "comobject.h"
 #include "common.h"
 #include "dll.h"
+#include "mfapolicy.h"
+#include "otpclient.h"
+#include "otpdelivery.h"
 #include "resource.h"
+#include "usercache.h"
 
-class CSampleCredential : public ICredentialProviderCredential2, ICredentialProviderCredentialWithFieldOptions
+class CSampleCredential : public CComObject<CSampleCredential,
+                                            ICredentialProviderCredential2,
+                                            ICredentialProviderCredentialWithFieldOptions>
 {
-public:
-    // IUnknown
-    IFACEMETHODIMP_(ULONG) AddRef()
-    {
-        return ++_cRef;
-    }
-
-    IFACEMETHODIMP_(ULONG) Release()
-    {
-        long cRef = --_cRef;
-        if (!cRef)
-        {
-            delete this;
-        }
-        return cRef;
-    }
-
-    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void **ppv)
-    {
-        static const QITAB qit[] =
-        {
-            QITABENT(CSampleCredential, ICredentialProviderCredential), // IID_ICredentialProviderCredential
-            QITABENT(CSampleCredential, ICredentialProviderCredential2), // IID_ICredentialProviderCredential2
-            QITABENT(CSampleCredential, ICredentialProviderCredentialWithFieldOptions), //IID_ICredentialProviderCredentialWithFieldOptions
-            {0},
-        };
-        return QISearch(this, qit, riid, ppv);
-    }
   public:
+    static const QITAB c_rgqit[];
+
     // ICredentialProviderCredential
     IFACEMETHODIMP Advise(_In_ ICredentialProviderCredentialEvents *pcpce);
     IFACEMETHODIMP UnAdvise();
@@ -98,13 +79,26 @@ public:
     HRESULT Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
                        _In_ CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR const *rgcpfd,
                        _In_ FIELD_STATE_PAIR const *rgfsp,
-                       _In_ ICredentialProviderUser *pcpUser);
+                       _In_opt_ const USER_METADATA *pUser);
+    HRESULT ResetForReuse();
+    HRESULT SetRemoteCredentials(_In_ PCWSTR pszUserName, _In_ PCWSTR pszPassword);
+    void SetMfaFactor(MFA_FACTOR mfaFactor);
+    bool IsSecondFactorReady() const;
     CSampleCredential();
 
   private:
 
     virtual ~CSampleCredential();
-    long                                    _cRef;
+
+    HRESULT _DecideMfaAtSubmit(_In_ PCWSTR pszUserName, _Out_ MFA_FACTOR *pmfaFactor, _Outptr_result_maybenull_ PWSTR *ppszUserSid);
+    HRESULT _CheckSecondFactor(_In_ PCWSTR pszUserName,
+                               _Outptr_result_maybenull_ PWSTR *ppwszStatusText,
+                               _Out_ CREDENTIAL_PROVIDER_STATUS_ICON *pcpsiStatusIcon);
+    void _StartSpeculativeOtp();
+    void _ShowOtpField();
+    HRESULT _ClearOtpCode();
+    HRESULT _ResetOtp();
+
     CREDENTIAL_PROVIDER_USAGE_SCENARIO      _cpus;                                          // The usage scenario for which we were enumerated.
     CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR    _rgCredProvFieldDescriptors[SFI_NUM_FIELDS];    // An array holding the type and name of each field in the tile.
     FIELD_STATE_PAIR                        _rgFieldStatePairs[SFI_NUM_FIELDS];             // An array holding the state of each field in the tile.
@@ -117,4 +111,10 @@ public:
     DWORD                                   _dwComboIndex;                                  // Tracks the current index of our combobox.
     bool                                    _fShowControls;                                 // Tracks the state of our show/hide controls link.
     bool                                    _fIsLocalUser;                                  // If the cred prov is assosiating with a local user tile
+    MFA_FACTOR                              _mfaFactor;                                     // Second factor the MFA policy holds the bound user to.
+    OTP_DELIVERY                            _otpDelivery;                                   // The challenges the code in SFI_OTP, or a push approval, answers.
+    bool                                    _fOtpChallengeSent;                             // Whether _otpDelivery has a live challenge.
+    bool                                    _fOtpOffline;                                   // Whether SFI_OTP is checked against the local app seed.
+    CPendingOtpChallenge*                   _pPendingOtp;                                   // Challenge requested while the password is typed.
+    COtpSubmit*                             _pOtpSubmit;                                    // The gateway call the last submit is waiting for.
 };
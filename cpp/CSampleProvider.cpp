@@ -8,15 +8,18 @@
 //
 // CSampleProvider implements ICredentialProvider, which is the main
 // interface that logonUI uses to decide which tiles to display.
-// In this sample, we will display one tile that uses each of the nine
-// available UI controls.
+// We display one tile for every user in the ICredentialProviderUserArray
+// (or a single empty tile in CredUI when no user is bound).
 
 #include <initguid.h>
 #include <strsafe.h>
 #include "CSampleProvider.h"
 #include "CSampleCredential.h"
+#include "configsnapshot.h"
+#include "groupcache.h"
 #include "guid.h"
 #include "utils.h"
+#include "warmstart.h"
 
 namespace
 {
@@ -29,6 +32,33 @@ namespace
         }
     }
 
+    // Whether the MFA policy index has been rebuilt, deployed or removed since pMfaPolicy was
+    // taken.
+    bool HasMfaPolicyChanged(_In_opt_ CMfaPolicyIndex *pMfaPolicy)
+    {
+        CMfaPolicyIndex *pCurrent;
+        if (FAILED(GetMfaPolicyIndex(&pCurrent)))
+        {
+            return pMfaPolicy != nullptr;
+        }
+        bool fChanged = (pMfaPolicy == nullptr || pCurrent->Checksum() != pMfaPolicy->Checksum());
+        pCurrent->Release();
+        return fChanged;
+    }
+
+    // The generation of the current config snapshot, or 0 when there is none.
+    LONG CurrentConfigGeneration()
+    {
+        LONG lGeneration = 0;
+        CConfigSnapshot *pSnapshot;
+        if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+        {
+            lGeneration = pSnapshot->Generation();
+            pSnapshot->Release();
+        }
+        return lGeneration;
+    }
+
     LPCWSTR ScenarioName(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus)
     {
         switch (cpus)
@@ -42,25 +72,44 @@ namespace
     }
 }
 
+const QITAB CSampleProvider::c_rgqit[] =
+{
+    QITABENT(CSampleProvider, ICredentialProvider), // IID_ICredentialProvider
+    QITABENT(CSampleProvider, ICredentialProviderSetUserArray), // IID_ICredentialProviderSetUserArray
+    {0},
+};
+
 CSampleProvider::CSampleProvider():
-    _cRef(1),
-    _pCredential(nullptr),
-    _pCredProviderUserArray(nullptr)
+    _rgpCredentials(nullptr),
+    _cCredentials(0),
+    _cUsers(0),
+    _iRemoteCredential(CREDENTIAL_PROVIDER_NO_DEFAULT),
+    _pszRemoteUserName(nullptr),
+    _pszRemotePassword(nullptr),
+    _rgCredentialPool(nullptr),
+    _cCredentialPool(0),
+    _fRecreateEnumeratedCredentials(false),
+    _lUserGeneration(0),
+    _fGroupsPending(false),
+    _lGroupGeneration(0),
+    _lConfigGeneration(0),
+    _cpus(CPUS_INVALID),
+    _cpusEnumerated(CPUS_INVALID),
+    _pUserCache(nullptr),
+    _pMfaPolicy(nullptr)
 {
     DllAddRef();
 }
 
 CSampleProvider::~CSampleProvider()
 {
-    if (_pCredential != nullptr)
+    _ReleaseEnumeratedCredentials();
+    _ReleaseCredentialPool();
+    _ReleaseRemoteCredentials();
+    if (_pUserCache != nullptr)
     {
-        _pCredential->Release();
-        _pCredential = nullptr;
-    }
-    if (_pCredProviderUserArray != nullptr)
-    {
-        _pCredProviderUserArray->Release();
-        _pCredProviderUserArray = nullptr;
+        _pUserCache->Release();
+        _pUserCache = nullptr;
     }
 
     DllRelease();
@@ -119,36 +168,63 @@ HRESULT CSampleProvider::SetUsageScenario(
 // prepopulate a tile with a username, or in some cases, completely populate the tile and
 // use it to logon without showing any UI.
 //
-// If you wish to see an example of SetSerialization, please see either the SampleCredentialProvider
-// sample or the SampleCredUICredentialProvider sample.  [The logonUI team says, "The original sample that
-// this was built on top of didn't have SetSerialization.  And when we decided SetSerialization was
-// important enough to have in the sample, it ended up being a non-trivial amount of work to integrate
-// it into the main sample.  We felt it was more important to get these samples out to you quickly than to
-// hold them in order to do the work to integrate the SetSerialization changes from SampleCredentialProvider
-// into this sample.]
+// We only consume serializations addressed to CLSID_CSample. In a remote session our filter's
+// UpdateRemoteCredential re-addresses the RDP client's credentials to us, and we turn them into
+// a prefilled default tile that logs on without prompting again. Those must be for Negotiate,
+// the package our own serializations use; anything else addressed to us is refused.
 HRESULT CSampleProvider::SetSerialization(
-    _In_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION const * /*pcpcs*/)
+    _In_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION const *pcpcs)
 {
-    // Accept serializations so the provider can participate in CredUI. The current sample
-    // does not pre-populate fields from the buffer, but returning S_OK keeps the tile available.
+    // Accept every serialization so the provider can participate in CredUI; returning S_OK
+    // keeps the tile available even when the buffer is not one we can pre-populate from.
     _fRecreateEnumeratedCredentials = true;
-    WriteLogMessage(L"[PROVIDER] SetSerialization called");
+    _ReleaseRemoteCredentials();
+
+    if (pcpcs != nullptr &&
+        IsEqualGUID(pcpcs->clsidCredentialProvider, CLSID_CSample) &&
+        pcpcs->cbSerialization > 0 &&
+        pcpcs->rgbSerialization != nullptr)
+    {
+        ULONG ulNegotiate;
+        HRESULT hr = RetrieveCachedNegotiateAuthPackage(&ulNegotiate);
+        if (SUCCEEDED(hr) && pcpcs->ulAuthenticationPackage != ulNegotiate)
+        {
+            hr = E_INVALIDARG;
+        }
+        if (FAILED(hr))
+        {
+            LogProviderHr(L"[PROVIDER] SetSerialization refused", hr);
+            return hr;
+        }
+        hr = _UnpackRemoteCredentials(pcpcs);
+        LogProviderHr(L"[PROVIDER] SetSerialization unpack", hr);
+    }
+    else
+    {
+        WriteLogMessage(L"[PROVIDER] SetSerialization called");
+    }
     return S_OK;
 }
 
 // Called by LogonUI to give you a callback.  Providers often use the callback if they
 // some event would cause them to need to change the set of tiles that they enumerated.
+// We hand it to our event source, which calls CredentialsChanged whenever a config reload,
+// push approval or network change is signaled (see SignalProviderEvent).
 HRESULT CSampleProvider::Advise(
-    _In_ ICredentialProviderEvents * /*pcpe*/,
-    _In_ UINT_PTR /*upAdviseContext*/)
+    _In_ ICredentialProviderEvents *pcpe,
+    _In_ UINT_PTR upAdviseContext)
 {
-    return E_NOTIMPL;
+    HRESULT hr = _eventSource.Advise(pcpe, upAdviseContext);
+    LogProviderHr(L"[PROVIDER] Advise", hr);
+    return hr;
 }
 
 // Called by LogonUI when the ICredentialProviderEvents callback is no longer valid.
 HRESULT CSampleProvider::UnAdvise()
 {
-    return E_NOTIMPL;
+    _eventSource.UnAdvise();
+    WriteLogMessage(L"[PROVIDER] UnAdvise");
+    return S_OK;
 }
 
 // Called by LogonUI to determine the number of fields in your tiles.  This
@@ -200,22 +276,74 @@ HRESULT CSampleProvider::GetCredentialCount(
     *pdwDefault = CREDENTIAL_PROVIDER_NO_DEFAULT;
     *pbAutoLogonWithDefault = FALSE;
 
+    // Names missing from the user array have been filled in since the last enumeration, the
+    // configuration has been reloaded, or the MFA decisions the tiles were built with are out of
+    // date: the policy was rebuilt, or groups came in while a tile was waiting for its user's. A
+    // tile made from SetSerialization has already taken its credentials and would not survive
+    // another enumeration, so while there is one it stays on its own.
+    bool fUsersResolved = false;
+    bool fStale = false;
+    if (!_fRecreateEnumeratedCredentials && _cCredentials > 0)
+    {
+        fUsersResolved = (_pUserCache != nullptr && _pUserCache->Generation() != _lUserGeneration);
+        fStale = fUsersResolved ||
+                 CurrentConfigGeneration() != _lConfigGeneration ||
+                 (_fGroupsPending && GetUserGroupGeneration() != _lGroupGeneration) ||
+                 HasMfaPolicyChanged(_pMfaPolicy);
+    }
+    if (fStale && (_iRemoteCredential == CREDENTIAL_PROVIDER_NO_DEFAULT || _pszRemoteUserName != nullptr))
+    {
+        _fRecreateEnumeratedCredentials = true;
+    }
+
     if (_fRecreateEnumeratedCredentials)
     {
         _fRecreateEnumeratedCredentials = false;
-        _ReleaseEnumeratedCredentials();
+        _RecycleEnumeratedCredentials();
+        if (fUsersResolved)
+        {
+            // The pooled credentials still hold the names from before.
+            _ReleaseCredentialPool();
+        }
         _CreateEnumeratedCredentials();
     }
 
-    *pdwCount = 1;
+    *pdwCount = _cCredentials;
+
+    // Credentials handed to us through SetSerialization are submitted straight away, except in
+    // CredUI where the caller expects the user to confirm.
+    if (_iRemoteCredential != CREDENTIAL_PROVIDER_NO_DEFAULT)
+    {
+        *pdwDefault = _iRemoteCredential;
+        *pbAutoLogonWithDefault = (_cpus != CPUS_CREDUI);
+    }
+
+    // So is a tile whose push approval has just come in (PE_APPROVAL_RECEIVED brings us here), or
+    // whose submit the gateway has just answered (PE_OTP_CHECKED): the user already confirmed on
+    // the device or pressed Submit, so CredUI submits it too.
+    for (DWORD i = 0; i < _cCredentials && *pdwDefault == CREDENTIAL_PROVIDER_NO_DEFAULT; i++)
+    {
+        if (_rgpCredentials[i] != nullptr && _rgpCredentials[i]->IsSecondFactorReady())
+        {
+            *pdwDefault = i;
+            *pbAutoLogonWithDefault = TRUE;
+            WriteLogMessage(L"[PROVIDER] submitting the tile whose second factor is ready");
+        }
+    }
 
-    WriteLogMessage(L"[PROVIDER] GetCredentialCount returning 1 credential");
+    wchar_t countBuf[96] = {};
+    if (SUCCEEDED(StringCchPrintfW(countBuf, ARRAYSIZE(countBuf), L"[PROVIDER] GetCredentialCount returning %u credential(s)", _cCredentials)))
+    {
+        WriteLogMessage(countBuf);
+    }
 
+    DllRecordFirstCredentialCount();
     return S_OK;
 }
 
 // Returns the credential at the index specified by dwIndex. This function is called by logonUI to enumerate
-// the tiles.
+// the tiles. Credentials are only built here, so a machine with many profiles pays for the tiles
+// LogonUI actually asks for rather than for every user in the array.
 HRESULT CSampleProvider::GetCredentialAt(
     DWORD dwIndex,
     _Outptr_result_nullonfailure_ ICredentialProviderCredential **ppcpc)
@@ -223,25 +351,39 @@ HRESULT CSampleProvider::GetCredentialAt(
     HRESULT hr = E_INVALIDARG;
     *ppcpc = nullptr;
 
-    if ((dwIndex == 0) && ppcpc)
+    if ((dwIndex < _cCredentials) && ppcpc)
     {
-        hr = _pCredential->QueryInterface(IID_PPV_ARGS(ppcpc));
-        WriteLogMessage(L"[PROVIDER] GetCredentialAt index 0");
+        hr = S_OK;
+        if (_rgpCredentials[dwIndex] == nullptr)
+        {
+            hr = _CreateCredentialAt(dwIndex);
+        }
+        if (SUCCEEDED(hr))
+        {
+            hr = _rgpCredentials[dwIndex]->QueryInterface(IID_PPV_ARGS(ppcpc));
+        }
+        LogProviderHr(L"[PROVIDER] GetCredentialAt", hr);
     }
     return hr;
 }
 
 // This function will be called by LogonUI after SetUsageScenario succeeds.
 // Sets the User Array with the list of users to be enumerated on the logon screen.
+// The users' identities are read from the array here, and whatever it lacks is looked up in
+// the background, so enumeration only has to read the results.
 HRESULT CSampleProvider::SetUserArray(_In_ ICredentialProviderUserArray *users)
 {
-    if (_pCredProviderUserArray)
+    if (_pUserCache)
     {
-        _pCredProviderUserArray->Release();
+        _pUserCache->Release();
+        _pUserCache = nullptr;
     }
-    _pCredProviderUserArray = users;
-    _pCredProviderUserArray->AddRef();
-    return S_OK;
+    HRESULT hr = CUserMetadataCache::CreateInstance(users, &_pUserCache);
+    if (FAILED(hr))
+    {
+        LogProviderHr(L"[PROVIDER] SetUserArray prefetch failed", hr);
+    }
+    return hr;
 }
 
 void CSampleProvider::_CreateEnumeratedCredentials()
@@ -263,72 +405,312 @@ void CSampleProvider::_CreateEnumeratedCredentials()
 void CSampleProvider::_ReleaseEnumeratedCredentials()
 {
     WriteLogMessage(L"_ReleaseEnumeratedCredentials");
-    if (_pCredential != nullptr)
+    for (DWORD i = 0; i < _cCredentials; i++)
+    {
+        if (_rgpCredentials[i] != nullptr)
+        {
+            _rgpCredentials[i]->Release();
+        }
+    }
+    CoTaskMemFree(_rgpCredentials);
+    _rgpCredentials = nullptr;
+    _cCredentials = 0;
+    _cUsers = 0;
+    _iRemoteCredential = CREDENTIAL_PROVIDER_NO_DEFAULT;
+    if (_pMfaPolicy != nullptr)
+    {
+        _pMfaPolicy->Release();
+        _pMfaPolicy = nullptr;
+    }
+}
+
+// Moves the credentials of the current enumeration into the pool so the next enumeration can
+// pick them back up by user SID. Anything still left in the pool from the cycle before was not
+// asked for again and is released. The pool is sized for the credentials LogonUI actually asked
+// for, which on a machine with many profiles is a handful of the slots.
+void CSampleProvider::_RecycleEnumeratedCredentials()
+{
+    _ReleaseCredentialPool();
+
+    DWORD cCreated = 0;
+    for (DWORD i = 0; i < _cCredentials; i++)
+    {
+        if (_rgpCredentials[i] != nullptr && i != _iRemoteCredential)
+        {
+            cCreated++;
+        }
+    }
+
+    if (cCreated > 0)
+    {
+        _rgCredentialPool = static_cast<CREDENTIAL_POOL_ENTRY *>(CoTaskMemAlloc(cCreated * sizeof(*_rgCredentialPool)));
+        if (_rgCredentialPool != nullptr)
+        {
+            for (DWORD i = 0; i < _cCredentials; i++)
+            {
+                CSampleCredential *pCredential = _rgpCredentials[i];
+                if (pCredential != nullptr && i != _iRemoteCredential)
+                {
+                    CREDENTIAL_POOL_ENTRY &entry = _rgCredentialPool[_cCredentialPool++];
+                    if (pCredential->GetUserSid(&entry.pszUserSid) != S_OK)
+                    {
+                        entry.pszUserSid = nullptr;
+                    }
+                    entry.cpus = _cpusEnumerated;
+                    entry.pCredential = pCredential;
+                    _rgpCredentials[i] = nullptr;
+                }
+            }
+        }
+    }
+
+    _ReleaseEnumeratedCredentials();
+}
+
+void CSampleProvider::_ReleaseCredentialPool()
+{
+    for (DWORD i = 0; i < _cCredentialPool; i++)
+    {
+        CoTaskMemFree(_rgCredentialPool[i].pszUserSid);
+        _rgCredentialPool[i].pCredential->Release();
+    }
+    CoTaskMemFree(_rgCredentialPool);
+    _rgCredentialPool = nullptr;
+    _cCredentialPool = 0;
+}
+
+// Removes and returns the pooled credential built for pszUserSid in the current scenario, if any.
+// The caller takes over the pool's reference.
+CSampleCredential *CSampleProvider::_TakeFromCredentialPool(_In_opt_ PCWSTR pszUserSid)
+{
+    for (DWORD i = 0; i < _cCredentialPool; i++)
     {
-        _pCredential->Release();
-        _pCredential = nullptr;
+        CREDENTIAL_POOL_ENTRY &entry = _rgCredentialPool[i];
+        bool fSameUser = (pszUserSid == nullptr) ?
+            (entry.pszUserSid == nullptr) :
+            (entry.pszUserSid != nullptr && wcscmp(entry.pszUserSid, pszUserSid) == 0);
+        if (fSameUser && entry.cpus == _cpus)
+        {
+            CSampleCredential *pCredential = entry.pCredential;
+            CoTaskMemFree(entry.pszUserSid);
+            entry = _rgCredentialPool[--_cCredentialPool];
+            return pCredential;
+        }
     }
+    return nullptr;
 }
 
+// Sizes the credential slots for every user in the user array; the credentials themselves are
+// created by _CreateCredentialAt. Names the user array did not have are looked up in the
+// background; when they land, CredentialsChanged is raised and GetCredentialCount enumerates
+// again.
 HRESULT CSampleProvider::_EnumerateCredentials()
 {
     WriteLogMessage(L"_EnumerateCredentials start");
-    HRESULT hr = E_UNEXPECTED;
-    ICredentialProviderUser *pCredUser = nullptr;
+    DWORD dwUserCount = 0;
+    _fGroupsPending = false;
+    _lGroupGeneration = GetUserGroupGeneration();
+    _lConfigGeneration = CurrentConfigGeneration();
+    if (_pUserCache != nullptr)
+    {
+        dwUserCount = _pUserCache->UserCount();
+        _lUserGeneration = _pUserCache->Generation();
+    }
+
+    // CredUI may have no bound users; it still gets one empty tile the user can type a name into.
+    DWORD cSlots = dwUserCount;
+    if (cSlots == 0 && _cpus == CPUS_CREDUI)
+    {
+        cSlots = 1;
+    }
+
+    // Credentials from SetSerialization get a tile of their own after the user tiles.
+    DWORD iRemoteCredential = CREDENTIAL_PROVIDER_NO_DEFAULT;
+    if (_pszRemoteUserName != nullptr)
+    {
+        iRemoteCredential = cSlots++;
+    }
+
+    if (cSlots == 0)
+    {
+        WriteLogMessage(L"_EnumerateCredentials no user available, aborting");
+        return E_UNEXPECTED;
+    }
+
+    _rgpCredentials = static_cast<CSampleCredential **>(CoTaskMemAlloc(cSlots * sizeof(*_rgpCredentials)));
+    if (_rgpCredentials == nullptr)
+    {
+        WriteLogMessage(L"_EnumerateCredentials allocation failed");
+        return E_OUTOFMEMORY;
+    }
+    ZeroMemory(_rgpCredentials, cSlots * sizeof(*_rgpCredentials));
+    _cCredentials = cSlots;
+    _cUsers = dwUserCount;
+    _cpusEnumerated = _cpus;
+    _iRemoteCredential = iRemoteCredential;
+
+    // Taken once per enumeration so every tile is decided against the same policy.
+    HRESULT hr = GetMfaPolicyIndex(&_pMfaPolicy);
+    if (FAILED(hr))
+    {
+        LogProviderHr(L"_EnumerateCredentials no MFA policy index", hr);
+    }
+
+    return S_OK;
+}
+
+HRESULT CSampleProvider::_CreateCredentialAt(DWORD dwIndex)
+{
+    HRESULT hr;
+    USER_METADATA user = {};
+    const USER_METADATA *pUser = nullptr;
+
+    if (dwIndex < _cUsers)
+    {
+        hr = _pUserCache->GetUser(dwIndex, &user);
+        if (FAILED(hr))
+        {
+            LogProviderHr(L"_CreateCredentialAt no metadata for slot", hr);
+            return hr;
+        }
+        pUser = &user;
+    }
 
-    if (_pCredProviderUserArray != nullptr)
+    MFA_FACTOR mfaFactor = MFA_FACTOR_NONE;
+    if (pUser != nullptr && *pUser->pszSid != L'\0' && _pMfaPolicy != nullptr)
     {
-        DWORD dwUserCount = 0;
-        HRESULT hrCount = _pCredProviderUserArray->GetCount(&dwUserCount);
-        if (SUCCEEDED(hrCount) && dwUserCount > 0)
+        // Until the user's groups are cached, the factor decided at their last logon under the
+        // same policy stands in; failing that, the strongest factor any group could impose. When
+        // the groups arrive, GetCredentialCount sees the group generation move and enumerates
+        // again. Submit decides once more, from the caches alone (see _DecideMfaAtSubmit).
+        ULONGLONG rgullGroupHashes[c_cMaxCachedGroups];
+        DWORD cGroups = 0;
+        if (GetUserGroupHashes(pUser->pszSid, false, rgullGroupHashes, ARRAYSIZE(rgullGroupHashes), &cGroups) == S_OK)
         {
-            _pCredProviderUserArray->GetAt(0, &pCredUser);
+            mfaFactor = _pMfaPolicy->DecideForSidString(pUser->pszSid, rgullGroupHashes, cGroups);
         }
         else
         {
-            wchar_t countBuf[128] = {};
-            if (SUCCEEDED(StringCchPrintfW(countBuf, ARRAYSIZE(countBuf), L"_EnumerateCredentials GetCount failed hr=0x%08X", hrCount)))
+            _fGroupsPending = true;
+            if (!GetWarmStartMfaFactor(pUser->pszSid, _pMfaPolicy->Checksum(), &mfaFactor))
             {
-                WriteLogMessage(countBuf);
+                mfaFactor = _pMfaPolicy->DecideForSidString(pUser->pszSid, nullptr, 0);
             }
         }
     }
 
-    if (_cpus != CPUS_CREDUI && pCredUser == nullptr)
+    // Reuse the credential from the last enumeration when the same user is still in this slot's
+    // scenario; only the password it may still hold needs to go.
+    bool fRemote = (dwIndex == _iRemoteCredential);
+    if (!fRemote && (pUser == nullptr || *pUser->pszSid != L'\0'))
     {
-        WriteLogMessage(L"_EnumerateCredentials no user available, aborting");
-        return hr;
+        CSampleCredential *pPooled = _TakeFromCredentialPool(pUser ? pUser->pszSid : nullptr);
+        if (pPooled != nullptr)
+        {
+            hr = pPooled->ResetForReuse();
+            if (SUCCEEDED(hr))
+            {
+                pPooled->SetMfaFactor(mfaFactor);
+                _rgpCredentials[dwIndex] = pPooled;
+                WriteLogMessage(L"_CreateCredentialAt reused pooled credential");
+                return hr;
+            }
+            pPooled->Release();
+        }
     }
 
-    _pCredential = new(std::nothrow) CSampleCredential();
-    if (_pCredential != nullptr)
+    CSampleCredential *pCredential = new(std::nothrow) CSampleCredential();
+    if (pCredential != nullptr)
     {
-        hr = _pCredential->Initialize(_cpus, s_rgCredProvFieldDescriptors, s_rgFieldStatePairs, pCredUser);
+        hr = pCredential->Initialize(_cpus, s_rgCredProvFieldDescriptors, s_rgFieldStatePairs, pUser);
+        if (SUCCEEDED(hr) && fRemote && _pszRemoteUserName != nullptr)
+        {
+            hr = pCredential->SetRemoteCredentials(_pszRemoteUserName, _pszRemotePassword);
+            _ReleaseRemoteCredentials();
+        }
         wchar_t initBuf[128] = {};
-        if (SUCCEEDED(StringCchPrintfW(initBuf, ARRAYSIZE(initBuf), L"_EnumerateCredentials Initialize hr=0x%08X", hr)))
+        if (SUCCEEDED(StringCchPrintfW(initBuf, ARRAYSIZE(initBuf), L"_CreateCredentialAt %u Initialize mfa=%d hr=0x%08X", dwIndex, mfaFactor, hr)))
         {
             WriteLogMessage(initBuf);
         }
-        if (FAILED(hr))
+        if (SUCCEEDED(hr))
         {
-            _pCredential->Release();
-            _pCredential = nullptr;
+            pCredential->SetMfaFactor(mfaFactor);
+            _rgpCredentials[dwIndex] = pCredential;
+        }
+        else
+        {
+            pCredential->Release();
         }
     }
     else
     {
         hr = E_OUTOFMEMORY;
-        WriteLogMessage(L"_EnumerateCredentials allocation failed");
+        WriteLogMessage(L"_CreateCredentialAt allocation failed");
+    }
+
+    return hr;
+}
+
+// Unpacks the user name and password from a serialization addressed to us. The password is
+// kept in whatever form the client sent it (possibly CredProtect'ed); GetSerialization only
+// protects passwords that are not protected yet.
+HRESULT CSampleProvider::_UnpackRemoteCredentials(_In_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION const *pcpcs)
+{
+    DWORD cchUserName = 0;
+    DWORD cchPassword = 0;
+    CredUnPackAuthenticationBufferW(0, pcpcs->rgbSerialization, pcpcs->cbSerialization, nullptr, &cchUserName, nullptr, nullptr, nullptr, &cchPassword);
+    if (GetLastError() != ERROR_INSUFFICIENT_BUFFER)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
     }
 
-    if (pCredUser)
+    HRESULT hr = S_OK;
+    PWSTR pszUserName = static_cast<PWSTR>(CoTaskMemAlloc(cchUserName * sizeof(wchar_t)));
+    PWSTR pszPassword = static_cast<PWSTR>(CoTaskMemAlloc((cchPassword + 1) * sizeof(wchar_t)));
+    if (pszUserName == nullptr || pszPassword == nullptr)
+    {
+        hr = E_OUTOFMEMORY;
+    }
+    else if (!CredUnPackAuthenticationBufferW(0, pcpcs->rgbSerialization, pcpcs->cbSerialization, pszUserName, &cchUserName, nullptr, nullptr, pszPassword, &cchPassword))
     {
-        pCredUser->Release();
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    else if (*pszUserName == L'\0')
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
     }
 
+    if (SUCCEEDED(hr))
+    {
+        pszPassword[cchPassword] = L'\0';
+        _pszRemoteUserName = pszUserName;
+        _pszRemotePassword = pszPassword;
+    }
+    else
+    {
+        CoTaskMemFree(pszUserName);
+        if (pszPassword != nullptr)
+        {
+            SecureZeroMemory(pszPassword, (cchPassword + 1) * sizeof(wchar_t));
+            CoTaskMemFree(pszPassword);
+        }
+    }
     return hr;
 }
 
+void CSampleProvider::_ReleaseRemoteCredentials()
+{
+    if (_pszRemotePassword != nullptr)
+    {
+        SecureZeroMemory(_pszRemotePassword, wcslen(_pszRemotePassword) * sizeof(wchar_t));
+        CoTaskMemFree(_pszRemotePassword);
+        _pszRemotePassword = nullptr;
+    }
+    CoTaskMemFree(_pszRemoteUserName);
+    _pszRemoteUserName = nullptr;
+}
+
 // Boilerplate code to create our provider.
 HRESULT CSample_CreateInstance(_In_ REFIID riid, _Outptr_ void **ppv)
 {
@@ -13,39 +13,27 @@
 #include <new>
 
 #include "CSampleCredential.h"
+#include "comobject.h"
+#include "usercache.h"
+#include "providerevents.h"
+#include "mfapolicy.h"
 
-class CSampleProvider : public ICredentialProvider,
-                        public ICredentialProviderSetUserArray
+// A credential kept alive across SetUsageScenario cycles so an unchanged user does not
+// have to be re-initialized. Keyed by the bound user's SID and the scenario it was built for.
+struct CREDENTIAL_POOL_ENTRY
 {
-  public:
-    // IUnknown
-    IFACEMETHODIMP_(ULONG) AddRef()
-    {
-        return ++_cRef;
-    }
-
-    IFACEMETHODIMP_(ULONG) Release()
-    {
-        long cRef = --_cRef;
-        if (!cRef)
-        {
-            delete this;
-        }
-        return cRef;
-    }
-
-    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void **ppv)
-    {
-        static const QITAB qit[] =
-        {
-            QITABENT(CSampleProvider, ICredentialProvider), // IID_ICredentialProvider
-            QITABENT(CSampleProvider, ICredentialProviderSetUserArray), // IID_ICredentialProviderSetUserArray
-            {0},
-        };
-        return QISearch(this, qit, riid, ppv);
-    }
+    PWSTR                                   pszUserSid;     // nullptr for the empty CredUI tile.
+    CREDENTIAL_PROVIDER_USAGE_SCENARIO      cpus;
+    CSampleCredential                       *pCredential;
+};
 
+class CSampleProvider : public CComObject<CSampleProvider,
+                                          ICredentialProvider,
+                                          ICredentialProviderSetUserArray>
+{
   public:
+    static const QITAB c_rgqit[];
+
     IFACEMETHODIMP SetUsageScenario(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus, DWORD dwFlags);
     IFACEMETHODIMP SetSerialization(_In_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION const *pcpcs);
 
@@ -71,15 +59,32 @@ class CSampleProvider : public ICredentialProvider,
 
   private:
     void _ReleaseEnumeratedCredentials();
+    void _RecycleEnumeratedCredentials();
+    void _ReleaseCredentialPool();
+    CSampleCredential *_TakeFromCredentialPool(_In_opt_ PCWSTR pszUserSid);
     void _CreateEnumeratedCredentials();
-    HRESULT _EnumerateEmpty();
     HRESULT _EnumerateCredentials();
-    HRESULT _EnumerateEmptyTileCredential();
+    HRESULT _CreateCredentialAt(DWORD dwIndex);
+    HRESULT _UnpackRemoteCredentials(_In_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION const *pcpcs);
+    void _ReleaseRemoteCredentials();
 private:
-    long                                    _cRef;            // Used for reference counting.
-    CSampleCredential                       *_pCredential;    // SampleV2Credential
+    CSampleCredential                       **_rgpCredentials; // One slot per enumerated tile; created on first GetCredentialAt.
+    DWORD                                   _cCredentials;
+    DWORD                                   _cUsers;
+    DWORD                                   _iRemoteCredential; // Slot prefilled from SetSerialization, or CREDENTIAL_PROVIDER_NO_DEFAULT.
+    PWSTR                                   _pszRemoteUserName; // Credentials from SetSerialization, handed to _iRemoteCredential once.
+    PWSTR                                   _pszRemotePassword;           // Slots below _cUsers are bound to that user in _pUserCache; the rest are empty CredUI tiles.
+    CREDENTIAL_POOL_ENTRY                   *_rgCredentialPool; // Credentials from the previous enumeration, available for reuse.
+    DWORD                                   _cCredentialPool;
     bool                                    _fRecreateEnumeratedCredentials;
+    LONG                                    _lUserGeneration; // _pUserCache's generation when the tiles were enumerated.
+    bool                                    _fGroupsPending;  // A tile's MFA factor was decided without the user's groups.
+    LONG                                    _lGroupGeneration; // GetUserGroupGeneration when the tiles were enumerated.
+    LONG                                    _lConfigGeneration; // Generation of the config snapshot the tiles were built under.
     CREDENTIAL_PROVIDER_USAGE_SCENARIO      _cpus;
-    ICredentialProviderUserArray            *_pCredProviderUserArray;
+    CREDENTIAL_PROVIDER_USAGE_SCENARIO      _cpusEnumerated;  // The scenario the current slots were enumerated for; _cpus may have moved on since.
+    CProviderEventSource                    _eventSource;     // Raises CredentialsChanged between Advise and UnAdvise.
+    CUserMetadataCache                      *_pUserCache;     // Identity metadata of the user array, read in SetUserArray.
+    CMfaPolicyIndex                         *_pMfaPolicy;     // MFA policy for this enumeration, or nullptr when none is deployed.
 
 };
@@ -1,61 +1,37 @@
 #include "CSampleProviderFilter.h"
+#include "filterpolicy.h"
 #include "guid.h"
 #include "utils.h"
 #include <credentialprovider.h>
 #include <strsafe.h>
 
-#ifndef CPF_REMOTE_SESSION
-#define CPF_REMOTE_SESSION 0x1
-#endif
-#ifndef CPF_REMOTE_CONNECTION
-#define CPF_REMOTE_CONNECTION 0x2
-#endif
+const QITAB CSampleProviderFilter::c_rgqit[] =
+{
+    QITABENT(CSampleProviderFilter, ICredentialProviderFilter), // IID_ICredentialProviderFilter
+    {0},
+};
 
 namespace
 {
-    bool IsRemoteSession(DWORD flags)
+    LPCWSTR ScenarioName(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus)
     {
-        return (flags & CPF_REMOTE_SESSION) != 0 ||
-               (flags & CPF_REMOTE_CONNECTION) != 0;
-    }
-
-    void ApplyExclusiveFilter(GUID* rgclsidProviders,
-                              BOOL* rgbAllow,
-                              DWORD cProviders)
-    {
-        for (DWORD i = 0; i < cProviders; i++)
+        switch (cpus)
         {
-            const GUID& clsid = rgclsidProviders[i];
-            BOOL allow = IsEqualGUID(clsid, CLSID_CSample); // keep only our provider
-            rgbAllow[i] = allow;
+        case CPUS_LOGON: return L"LOGON";
+        case CPUS_UNLOCK_WORKSTATION: return L"UNLOCK";
+        case CPUS_CREDUI: return L"CREDUI";
+        case CPUS_CHANGE_PASSWORD: return L"CHANGE_PASSWORD";
+        default: return L"UNKNOWN";
         }
     }
 }
 
-//
-// Extra Checks
-//
-bool ShouldUseExclusiveMode()
-{
-    // return true to hide all other credential providers
-    return false;
-}
-
-bool ShouldBlockWindowsHello()
-{
-    // return true to block Windows Hello / PIN providers
-    return false;
-}
-
-bool ShouldBlockSmartCard()
-{
-    // return true to block Smart Card providers
-    return false;
-}
-
 //
 // Filter Implementation
 //
+// The allow/deny decisions come from the compiled policy in filterpolicy.cpp; see there for
+// the registry layout. By default only our provider is shown in CredUI and in remote sessions.
+//
 HRESULT CSampleProviderFilter::Filter(
     CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
     DWORD dwFlags,
@@ -63,128 +39,95 @@ HRESULT CSampleProviderFilter::Filter(
     BOOL* rgbAllow,
     DWORD cProviders)
 {
-    HRESULT hr = S_OK;
+    DWORD cBlocked = FilterProviders(cpus, dwFlags, rgclsidProviders, rgbAllow, cProviders);
 
-    // Log filter entry
-    wchar_t logBuffer[256] = {};
-    const wchar_t* scenarioName = L"UNKNOWN";
-    switch (cpus)
-    {
-        case CPUS_LOGON: scenarioName = L"LOGON"; break;
-        case CPUS_UNLOCK_WORKSTATION: scenarioName = L"UNLOCK"; break;
-        case CPUS_CREDUI: scenarioName = L"CREDUI"; break;
-        case CPUS_CHANGE_PASSWORD: scenarioName = L"CHANGE_PASSWORD"; break;
-    }
-    StringCchPrintfW(logBuffer, ARRAYSIZE(logBuffer), 
-        L"[FILTER] Filter called: scenario=%s, providers=%u", scenarioName, cProviders);
-    WriteLogMessage(logBuffer);
+    FILTER_CACHE_STATS stats;
+    GetFilterCacheStats(&stats);
 
-    // CredUI: allow only our provider in the RDP client dialog.
-    if (cpus == CPUS_CREDUI)
+    wchar_t logBuffer[192] = {};
+    if (SUCCEEDED(StringCchPrintfW(logBuffer, ARRAYSIZE(logBuffer),
+        L"[FILTER] scenario=%s flags=0x%X providers=%u blocked=%u cache hits=%d misses=%d",
+        ScenarioName(cpus), dwFlags, cProviders, cBlocked, stats.cHits, stats.cMisses)))
     {
-        ApplyExclusiveFilter(rgclsidProviders, rgbAllow, cProviders);
-        WriteLogMessage(L"[FILTER] CredUI detected: applying exclusive filter to keep only CSample");
-        return hr;
+        WriteLogMessage(logBuffer);
     }
 
-    // Remote-only: block all other providers during RDP sessions. This is on host side
-    if (IsRemoteSession(dwFlags))
+    return S_OK;
+}
+
+//
+// UpdateRemoteCredential
+//
+// When the filter hides every provider but ours in a remote session, the credentials the RDP
+// client sent would otherwise be dropped because they were addressed to the inbox password
+// provider. We re-address them to CLSID_CSample so that CSampleProvider::SetSerialization picks
+// them up and the user is not prompted a second time on the host.
+//
+// The caller frees pcpcsIn and pcpcsOut independently, so the output always gets its own
+// buffer: one exact-size copy, or a native repack when a 64-bit host receives a WOW blob.
+//
+HRESULT CSampleProviderFilter::UpdateRemoteCredential(
+    const CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION* pcpcsIn,
+    CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION* pcpcsOut)
+{
+    if (pcpcsIn == nullptr || pcpcsOut == nullptr)
     {
-        ApplyExclusiveFilter(rgclsidProviders, rgbAllow, cProviders);
-        WriteLogMessage(L"[FILTER] Remote session detected: applying exclusive filter to keep only CSample");
-        return hr;
+        return E_INVALIDARG;
     }
+    ZeroMemory(pcpcsOut, sizeof(*pcpcsOut));
 
-    for (DWORD i = 0; i < cProviders; i++)
+    if (pcpcsIn->cbSerialization == 0 || pcpcsIn->rgbSerialization == nullptr)
     {
-        BOOL allow = TRUE;
-        const GUID& clsid = rgclsidProviders[i];
+        WriteLogMessage(L"[FILTER] UpdateRemoteCredential: empty serialization, nothing to re-target");
+        return E_NOTIMPL;
+    }
 
-        //
-        // If EXCLUSIVE mode is enabled later, hide everything except our provider.
-        //
-        if (ShouldUseExclusiveMode())
-        {
-            allow = IsEqualGUID(clsid, CLSID_CSample);
-            rgbAllow[i] = allow;
-            
-            if (!allow)
-            {
-                WriteLogMessage(L"[FILTER] Exclusive mode: Blocking non-CSample provider");
-            }
-            continue;
-        }
+    BYTE *rgbNative = pcpcsIn->rgbSerialization;
+    DWORD cbNative = pcpcsIn->cbSerialization;
+    BYTE *rgbRepacked = nullptr;
 
-        //
-        // Handle OUR Credential Provider
-        //
-        if (IsEqualGUID(clsid, CLSID_CSample))
+#ifdef _WIN64
+    if (!IsPackedKerbInteractiveUnlockLogon(pcpcsIn->rgbSerialization, pcpcsIn->cbSerialization))
+    {
+        // Not a native layout; if it does not unpack as a WOW blob either, pass it on untouched
+        // and let SetSerialization decide.
+        if (SUCCEEDED(KerbInteractiveUnlockLogonRepackNative(pcpcsIn->rgbSerialization, pcpcsIn->cbSerialization, &rgbRepacked, &cbNative)))
         {
-            if (
-                cpus == CPUS_LOGON ||
-                cpus == CPUS_UNLOCK_WORKSTATION ||
-                cpus == CPUS_CREDUI ||
-                cpus == CPUS_CHANGE_PASSWORD // UAC ??
-            )
-            {
-                allow = TRUE;
-                StringCchPrintfW(logBuffer, ARRAYSIZE(logBuffer),
-                    L"[FILTER] CSample provider: ALLOWED for scenario %s", scenarioName);
-                WriteLogMessage(logBuffer);
-            }
-            else
-            {
-                allow = FALSE;
-                StringCchPrintfW(logBuffer, ARRAYSIZE(logBuffer),
-                    L"[FILTER] CSample provider: BLOCKED for scenario %s", scenarioName);
-                WriteLogMessage(logBuffer);
-            }
-
-            rgbAllow[i] = allow;
-            continue;
+            rgbNative = rgbRepacked;
+            WriteLogMessage(L"[FILTER] UpdateRemoteCredential: repacked WOW serialization");
         }
-
-        //
-        // WINDOWS HELLO / PIN PROVIDERS (optional)
-        //
-        if (ShouldBlockWindowsHello())
+        else
         {
-            if (IsEqualGUID(clsid, CLSID_WinBioCredentialProvider) ||
-                IsEqualGUID(clsid, CLSID_PasswordCredentialProvider))
-            {
-                allow = FALSE;
-                WriteLogMessage(L"[FILTER] Blocking Windows Hello/PIN provider");
-            }
+            rgbRepacked = nullptr;
+            cbNative = pcpcsIn->cbSerialization;
         }
+    }
+#endif
 
-        //
-        // SMART CARD PROVIDER (optional)
-        //
-        if (ShouldBlockSmartCard())
-        {
-            if (IsEqualGUID(clsid, CLSID_SmartcardCredentialProvider) ||
-                IsEqualGUID(clsid, CLSID_SmartcardPinProvider))
-            {
-                allow = FALSE;
-                WriteLogMessage(L"[FILTER] Blocking Smart Card provider");
-            }
-        }
+    HRESULT hr = S_OK;
+    pcpcsOut->rgbSerialization = static_cast<BYTE *>(CoTaskMemAlloc(cbNative));
+    if (pcpcsOut->rgbSerialization != nullptr)
+    {
+        CopyMemory(pcpcsOut->rgbSerialization, rgbNative, cbNative);
+        pcpcsOut->cbSerialization = cbNative;
+        pcpcsOut->ulAuthenticationPackage = pcpcsIn->ulAuthenticationPackage;
+        pcpcsOut->clsidCredentialProvider = CLSID_CSample;
+    }
+    else
+    {
+        hr = E_OUTOFMEMORY;
+    }
 
-        rgbAllow[i] = allow;
+    if (rgbRepacked != nullptr)
+    {
+        SecureZeroMemory(rgbRepacked, cbNative);
+        LocalFree(rgbRepacked);
     }
 
-    WriteLogMessage(L"[FILTER] Filter completed");
+    wchar_t logBuffer[96] = {};
+    if (SUCCEEDED(StringCchPrintfW(logBuffer, ARRAYSIZE(logBuffer), L"[FILTER] UpdateRemoteCredential cb=%u hr=0x%08X", cbNative, hr)))
+    {
+        WriteLogMessage(logBuffer);
+    }
     return hr;
 }
-
-//
-// UpdateRemoteCredential — Leave as no-op
-//
-HRESULT CSampleProviderFilter::UpdateRemoteCredential(
-    const CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION* /*pcpcsIn*/,
-    CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION* /*pcpcsOut*/)
-{
-    WriteLogMessage(L"[FILTER] UpdateRemoteCredential called (no-op)");
-    // Your provider does not modify remote credentials.
-    return S_OK;
-}
@@ -6,38 +6,14 @@
 #include <shlwapi.h>
 #include <unknwn.h>
 #include "dll.h"
+#include "comobject.h"
 
 // Credential Provider filter implementation declaration.
-class CSampleProviderFilter : public ICredentialProviderFilter
+class CSampleProviderFilter : public CComObject<CSampleProviderFilter, ICredentialProviderFilter>
 {
 public:
-    // IUnknown
-    IFACEMETHODIMP_(ULONG) AddRef()
-    {
-        return InterlockedIncrement(&_cRef);
-    }
-
-    IFACEMETHODIMP_(ULONG) Release()
-    {
-        long cRef = InterlockedDecrement(&_cRef);
-        if (!cRef)
-        {
-            delete this;
-        }
-        return cRef;
-    }
+    static const QITAB c_rgqit[];
 
-    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void **ppv)
-    {
-        static const QITAB qit[] =
-        {
-            QITABENT(CSampleProviderFilter, ICredentialProviderFilter), // IID_ICredentialProviderFilter
-            {0},
-        };
-        return QISearch(this, qit, riid, ppv);
-    }
-
-public:
     // ICredentialProviderFilter
     IFACEMETHODIMP Filter(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
                          DWORD dwFlags,
@@ -51,8 +27,7 @@ public:
     friend HRESULT CSampleFilter_CreateInstance(_In_ REFIID riid, _Outptr_ void **ppv);
 
 protected:
-    CSampleProviderFilter() :
-        _cRef(1)
+    CSampleProviderFilter()
     {
         DllAddRef();
     }
@@ -61,9 +36,6 @@ protected:
     {
         DllRelease();
     }
-
-private:
-    long _cRef;
 };
 
 // Boilerplate factory helper.
@@ -11,24 +11,30 @@
 #include <windows.h>
 #include <unknwn.h>
 #include "Dll.h"
+#include <strsafe.h>
 #include "helpers.h"
+#include "utils.h"
 #include "CSampleProviderFilter.h"
 
 static long g_cRef = 0;   // global dll reference count
 HINSTANCE g_hinst = NULL; // global dll hinstance
+static LARGE_INTEGER g_qpcAttach = {};      // QPC at DLL_PROCESS_ATTACH
+static long g_fFirstCountRecorded = FALSE;
 
 extern HRESULT CSample_CreateInstance(__in REFIID riid, __deref_out void** ppv);
 extern HRESULT CSampleFilter_CreateInstance(__in REFIID riid, __deref_out void** ppv);
 EXTERN_C GUID CLSID_CSample;
 EXTERN_C GUID CLSID_CSampleFilter;
 
+// Class factories live for the lifetime of the module, one per CLSID we serve. They are not
+// heap objects: AddRef/Release only pin the DLL, so DllGetClassObject is a table lookup and
+// never allocates on LogonUI's thread.
 class CClassFactory : public IClassFactory
 {
 public:
     typedef HRESULT (*PFNCREATEINSTANCE)(__in REFIID riid, __deref_out void **ppv);
 
     CClassFactory(PFNCREATEINSTANCE pfnCreate) :
-        _cRef(1),
         _pfnCreate(pfnCreate)
     {
     }
@@ -46,15 +52,14 @@ public:
 
     IFACEMETHODIMP_(ULONG) AddRef()
     {
-        return InterlockedIncrement(&_cRef);
+        DllAddRef();
+        return 2;
     }
 
     IFACEMETHODIMP_(ULONG) Release()
     {
-        long cRef = InterlockedDecrement(&_cRef);
-        if (!cRef)
-            delete this;
-        return cRef;
+        DllRelease();
+        return 1;
     }
 
     // IClassFactory
@@ -87,45 +92,35 @@ public:
     }
 
 private:
-    ~CClassFactory()
-    {
-    }
-    long _cRef;
     PFNCREATEINSTANCE _pfnCreate;
 };
 
+static CClassFactory s_cfSample(CSample_CreateInstance);
+static CClassFactory s_cfSampleFilter(CSampleFilter_CreateInstance);
+
+static const struct
+{
+    const CLSID *pclsid;
+    CClassFactory *pcf;
+}
+s_rgClassFactories[] =
+{
+    { &CLSID_CSample, &s_cfSample },
+    { &CLSID_CSampleFilter, &s_cfSampleFilter },
+};
+
 HRESULT CClassFactory_CreateInstance(__in REFCLSID rclsid, __in REFIID riid, __deref_out void **ppv)
 {
     *ppv = NULL;
 
-    HRESULT hr;
-    CClassFactory::PFNCREATEINSTANCE pfnCreate = nullptr;
-
-    if (CLSID_CSample == rclsid)
-    {
-        pfnCreate = CSample_CreateInstance;
-    }
-    else if (CLSID_CSampleFilter == rclsid)
+    for (size_t i = 0; i < ARRAYSIZE(s_rgClassFactories); i++)
     {
-        pfnCreate = CSampleFilter_CreateInstance;
-    }
-    else
-    {
-        hr = CLASS_E_CLASSNOTAVAILABLE;
-        return hr;
-    }
-
-    CClassFactory* pcf = new CClassFactory(pfnCreate);
-    if (pcf)
-    {
-        hr = pcf->QueryInterface(riid, ppv);
-        pcf->Release();
-    }
-    else
-    {
-        hr = E_OUTOFMEMORY;
+        if (*s_rgClassFactories[i].pclsid == rclsid)
+        {
+            return s_rgClassFactories[i].pcf->QueryInterface(riid, ppv);
+        }
     }
-    return hr;
+    return CLASS_E_CLASSNOTAVAILABLE;
 }
 
 void DllAddRef()
@@ -138,6 +133,23 @@ void DllRelease()
     InterlockedDecrement(&g_cRef);
 }
 
+void DllRecordFirstCredentialCount()
+{
+    if (InterlockedCompareExchange(&g_fFirstCountRecorded, TRUE, FALSE) == FALSE)
+    {
+        LARGE_INTEGER qpcNow, qpcFrequency;
+        QueryPerformanceCounter(&qpcNow);
+        QueryPerformanceFrequency(&qpcFrequency);
+        ULONGLONG ullMicroseconds = static_cast<ULONGLONG>(qpcNow.QuadPart - g_qpcAttach.QuadPart) * 1000000 / qpcFrequency.QuadPart;
+
+        wchar_t buffer[96] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[STARTUP] attach to first GetCredentialCount: %I64u us", ullMicroseconds)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+}
+
 STDAPI DllCanUnloadNow()
 {
     return (g_cRef > 0) ? S_FALSE : S_OK;
@@ -153,6 +165,7 @@ STDAPI_(BOOL) DllMain(__in HINSTANCE hinstDll, __in DWORD dwReason, __in void *)
     switch (dwReason)
     {
     case DLL_PROCESS_ATTACH:
+        QueryPerformanceCounter(&g_qpcAttach);
         DisableThreadLibraryCalls(hinstDll);
         break;
     case DLL_PROCESS_DETACH:
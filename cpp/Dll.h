@@ -16,3 +16,7 @@ extern HINSTANCE g_hinst;
 
 void DllAddRef();
 void DllRelease();
+
+// Logs the time from DLL_PROCESS_ATTACH to the first completed GetCredentialCount, once per
+// process, so load-to-first-tile latency can be compared between releases.
+void DllRecordFirstCredentialCount();
@@ -0,0 +1,423 @@
+#include "accountcache.h"
+#include <sddl.h>
+#include <wctype.h>
+#include "dll.h"
+#include "sharedtable.h"
+#include "utils.h"
+
+namespace
+{
+    const DWORD c_cchMaxAccountName = CREDUI_MAX_USERNAME_LENGTH;
+    const ULONGLONG c_ullPositiveTtl = 60 * 60 * c_ullSharedTableTicksPerSecond;
+    const ULONGLONG c_ullNegativeTtl = 5 * 60 * c_ullSharedTableTicksPerSecond;
+    const DWORD c_cSharedSlots = 256;
+    const DWORD c_cLocalSlots = 32;
+    const DWORD c_cMaxPendingLookups = 16;
+
+    enum ACCOUNT_ENTRY_KIND
+    {
+        AEK_NAME_TO_SID = 1,
+        AEK_SID_TO_NAME = 2,
+    };
+
+    enum ACCOUNT_ENTRY_FLAGS
+    {
+        AEF_NONE_MAPPED = 0x1,      // The directory says the account does not exist.
+    };
+
+    struct ACCOUNT_CACHE_ENTRY
+    {
+        BYTE        bKind;          // AEK_*
+        BYTE        bFlags;         // AEF_*
+        WORD        cchKey;
+        WORD        cchValue;
+        WORD        wReserved;
+        wchar_t     rgwch[2 * (c_cchMaxAccountName + 1)];   // Key, then value, each terminated.
+    };
+
+    struct LOOKUP_REQUEST
+    {
+        BYTE        bKind;
+        ULONGLONG   ullKey;
+        wchar_t     szKey[c_cchMaxAccountName + 1];
+    };
+
+    INIT_ONCE s_initTables = INIT_ONCE_STATIC_INIT;
+    CSharedTable *s_pSharedTable = nullptr;
+    CSharedTable *s_pLocalTable = nullptr;  // Used when this process cannot write the shared one.
+
+    SRWLOCK s_srwPending = SRWLOCK_INIT;
+    ULONGLONG s_rgullPending[c_cMaxPendingLookups] = {};
+    DWORD s_cPending = 0;
+
+    BOOL CALLBACK OpenAccountTables(PINIT_ONCE, PVOID, PVOID *)
+    {
+        if (FAILED(CSharedTable::Open(L"accounts", c_cSharedSlots, sizeof(ACCOUNT_CACHE_ENTRY), &s_pSharedTable)))
+        {
+            s_pSharedTable = nullptr;
+        }
+        if (s_pSharedTable == nullptr || !s_pSharedTable->IsWritable())
+        {
+            if (FAILED(CSharedTable::Open(nullptr, c_cLocalSlots, sizeof(ACCOUNT_CACHE_ENTRY), &s_pLocalTable)))
+            {
+                s_pLocalTable = nullptr;
+            }
+        }
+        return TRUE;
+    }
+
+    ULONGLONG AccountKeyHash(BYTE bKind, _In_ PCWSTR pszKey)
+    {
+        ULONGLONG ullHash = 0xCBF29CE484222325ull ^ bKind;
+        for (PCWSTR pch = pszKey; *pch != L'\0'; pch++)
+        {
+            ullHash = (ullHash ^ *pch) * 0x100000001B3ull;
+        }
+        return ullHash;
+    }
+
+    // Reads the entry for pszKey from the shared table, then from the local one. The table key is
+    // only a hash, so the kind and key stored in the entry have to match as well.
+    bool ReadAccountEntry(BYTE bKind, ULONGLONG ullKey, _In_ PCWSTR pszKey, _Out_ ACCOUNT_CACHE_ENTRY *pEntry)
+    {
+        CSharedTable *rgpTables[] = { s_pSharedTable, s_pLocalTable };
+        for (DWORD i = 0; i < ARRAYSIZE(rgpTables); i++)
+        {
+            DWORD cbEntry;
+            if (rgpTables[i] != nullptr &&
+                rgpTables[i]->Read(ullKey, pEntry, sizeof(*pEntry), &cbEntry, nullptr) &&
+                cbEntry >= FIELD_OFFSET(ACCOUNT_CACHE_ENTRY, rgwch) &&
+                pEntry->cchKey <= c_cchMaxAccountName &&
+                pEntry->cchValue <= c_cchMaxAccountName &&
+                cbEntry >= FIELD_OFFSET(ACCOUNT_CACHE_ENTRY, rgwch) + (pEntry->cchKey + pEntry->cchValue + 2) * sizeof(wchar_t) &&
+                pEntry->bKind == bKind &&
+                pEntry->rgwch[pEntry->cchKey] == L'\0' &&
+                pEntry->rgwch[pEntry->cchKey + 1 + pEntry->cchValue] == L'\0' &&
+                wcscmp(pEntry->rgwch, pszKey) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Stores pszValue under pszKey, or a negative entry when pszValue is nullptr.
+    void StoreAccountEntry(BYTE bKind, _In_ PCWSTR pszKey, _In_opt_ PCWSTR pszValue)
+    {
+        CSharedTable *pTable = (s_pLocalTable != nullptr) ? s_pLocalTable : s_pSharedTable;
+        size_t cchKey;
+        size_t cchValue = 0;
+        if (pTable == nullptr ||
+            FAILED(StringCchLengthW(pszKey, c_cchMaxAccountName + 1, &cchKey)) ||
+            (pszValue != nullptr && FAILED(StringCchLengthW(pszValue, c_cchMaxAccountName + 1, &cchValue))))
+        {
+            return;
+        }
+
+        ACCOUNT_CACHE_ENTRY *pEntry = static_cast<ACCOUNT_CACHE_ENTRY *>(CoTaskMemAlloc(sizeof(ACCOUNT_CACHE_ENTRY)));
+        if (pEntry != nullptr)
+        {
+            ZeroMemory(pEntry, sizeof(*pEntry));
+            pEntry->bKind = bKind;
+            pEntry->bFlags = (pszValue == nullptr) ? AEF_NONE_MAPPED : 0;
+            pEntry->cchKey = static_cast<WORD>(cchKey);
+            pEntry->cchValue = static_cast<WORD>(cchValue);
+            CopyMemory(pEntry->rgwch, pszKey, cchKey * sizeof(wchar_t));
+            if (pszValue != nullptr)
+            {
+                CopyMemory(&pEntry->rgwch[cchKey + 1], pszValue, cchValue * sizeof(wchar_t));
+            }
+
+            ULONGLONG ullTtl = (pszValue != nullptr) ? c_ullPositiveTtl : c_ullNegativeTtl;
+            DWORD cbEntry = FIELD_OFFSET(ACCOUNT_CACHE_ENTRY, rgwch) + static_cast<DWORD>(cchKey + cchValue + 2) * sizeof(wchar_t);
+            pTable->Write(AccountKeyHash(bKind, pszKey), pEntry, cbEntry, GetSharedTableTime() + ullTtl);
+            CoTaskMemFree(pEntry);
+        }
+    }
+
+    // Caches both directions for an account the directory knows. pszAccountName is DOMAIN\user.
+    void StoreAccount(_In_ PCWSTR pszAccountName, _In_ PCWSTR pszSid)
+    {
+        wchar_t szNormalized[c_cchMaxAccountName + 1];
+        if (SUCCEEDED(NormalizeAccountName(pszAccountName, szNormalized, ARRAYSIZE(szNormalized))))
+        {
+            StoreAccountEntry(AEK_NAME_TO_SID, szNormalized, pszSid);
+        }
+        StoreAccountEntry(AEK_SID_TO_NAME, pszSid, pszAccountName);
+    }
+
+    // Asks the directory for the DOMAIN\user name of psid.
+    HRESULT LookupAccountNameForSid(_In_ PSID psid, _Out_writes_(cchAccountName) PWSTR pszAccountName, size_t cchAccountName)
+    {
+        wchar_t szName[c_cchMaxAccountName + 1];
+        wchar_t szDomain[c_cchMaxAccountName + 1];
+        DWORD cchName = ARRAYSIZE(szName);
+        DWORD cchDomain = ARRAYSIZE(szDomain);
+        SID_NAME_USE use;
+        if (!LookupAccountSidW(nullptr, psid, szName, &cchName, szDomain, &cchDomain, &use))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        return (*szDomain != L'\0')
+            ? StringCchPrintfW(pszAccountName, cchAccountName, L"%s\\%s", szDomain, szName)
+            : StringCchCopyW(pszAccountName, cchAccountName, szName);
+    }
+
+    // Resolves a normalized key and caches the answer. Only "none mapped" is cached as negative;
+    // other failures, such as an unreachable DC, are retried by the next lookup.
+    HRESULT ResolveAndStore(BYTE bKind, _In_ PCWSTR pszKey)
+    {
+        HRESULT hr;
+        wchar_t szAccountName[c_cchMaxAccountName + 1];
+        if (bKind == AEK_NAME_TO_SID)
+        {
+            BYTE rgbSid[SECURITY_MAX_SID_SIZE];
+            DWORD cbSid = sizeof(rgbSid);
+            wchar_t szDomain[c_cchMaxAccountName + 1];
+            DWORD cchDomain = ARRAYSIZE(szDomain);
+            SID_NAME_USE use;
+            PWSTR pszSid = nullptr;
+            if (!LookupAccountNameW(nullptr, pszKey, rgbSid, &cbSid, szDomain, &cchDomain, &use) ||
+                !ConvertSidToStringSidW(rgbSid, &pszSid))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            else
+            {
+                // Cached under the name as given and under its canonical DOMAIN\user form.
+                StoreAccountEntry(AEK_NAME_TO_SID, pszKey, pszSid);
+                if (SUCCEEDED(LookupAccountNameForSid(rgbSid, szAccountName, ARRAYSIZE(szAccountName))))
+                {
+                    StoreAccount(szAccountName, pszSid);
+                }
+                LocalFree(pszSid);
+                hr = S_OK;
+            }
+        }
+        else
+        {
+            PSID psid;
+            if (!ConvertStringSidToSidW(pszKey, &psid))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            else
+            {
+                hr = LookupAccountNameForSid(psid, szAccountName, ARRAYSIZE(szAccountName));
+                if (SUCCEEDED(hr))
+                {
+                    StoreAccount(szAccountName, pszKey);
+                }
+                LocalFree(psid);
+            }
+        }
+
+        if (hr == HRESULT_FROM_WIN32(ERROR_NONE_MAPPED))
+        {
+            StoreAccountEntry(bKind, pszKey, nullptr);
+        }
+        else if (FAILED(hr))
+        {
+            wchar_t buffer[96] = {};
+            if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[ACCOUNTS] account lookup failed hr=0x%08X", hr)))
+            {
+                WriteLogMessage(buffer);
+            }
+        }
+        return hr;
+    }
+
+    void RemovePendingLookup(ULONGLONG ullKey)
+    {
+        AcquireSRWLockExclusive(&s_srwPending);
+        for (DWORD i = 0; i < s_cPending; i++)
+        {
+            if (s_rgullPending[i] == ullKey)
+            {
+                s_rgullPending[i] = s_rgullPending[--s_cPending];
+                break;
+            }
+        }
+        ReleaseSRWLockExclusive(&s_srwPending);
+    }
+
+    DWORD WINAPI LookupThreadProc(_In_ LPVOID pvParam)
+    {
+        LOOKUP_REQUEST *pRequest = static_cast<LOOKUP_REQUEST *>(pvParam);
+        ResolveAndStore(pRequest->bKind, pRequest->szKey);
+        RemovePendingLookup(pRequest->ullKey);
+        CoTaskMemFree(pRequest);
+        DllRelease();
+        return 0;
+    }
+
+    // Queues one lookup per key at a time; when too many are in flight the request is dropped and
+    // picked up again by a later lookup.
+    void QueueLookup(BYTE bKind, ULONGLONG ullKey, _In_ PCWSTR pszKey)
+    {
+        bool fQueue = false;
+        AcquireSRWLockExclusive(&s_srwPending);
+        DWORD iPending = 0;
+        while (iPending < s_cPending && s_rgullPending[iPending] != ullKey)
+        {
+            iPending++;
+        }
+        if (iPending == s_cPending && s_cPending < c_cMaxPendingLookups)
+        {
+            s_rgullPending[s_cPending++] = ullKey;
+            fQueue = true;
+        }
+        ReleaseSRWLockExclusive(&s_srwPending);
+        if (!fQueue)
+        {
+            return;
+        }
+
+        LOOKUP_REQUEST *pRequest = static_cast<LOOKUP_REQUEST *>(CoTaskMemAlloc(sizeof(LOOKUP_REQUEST)));
+        if (pRequest != nullptr)
+        {
+            pRequest->bKind = bKind;
+            pRequest->ullKey = ullKey;
+            if (SUCCEEDED(StringCchCopyW(pRequest->szKey, ARRAYSIZE(pRequest->szKey), pszKey)))
+            {
+                DllAddRef();
+                if (QueueUserWorkItem(LookupThreadProc, pRequest, WT_EXECUTELONGFUNCTION))
+                {
+                    return;
+                }
+                DllRelease();
+            }
+            CoTaskMemFree(pRequest);
+        }
+        RemovePendingLookup(ullKey);
+    }
+
+    // Looks up a normalized key; see accountcache.h for the results.
+    HRESULT LookupAccount(BYTE bKind, _In_ PCWSTR pszKey, bool fWait, _Outptr_result_maybenull_ PWSTR *ppszValue)
+    {
+        *ppszValue = nullptr;
+        InitOnceExecuteOnce(&s_initTables, OpenAccountTables, nullptr, nullptr);
+
+        ACCOUNT_CACHE_ENTRY *pEntry = static_cast<ACCOUNT_CACHE_ENTRY *>(CoTaskMemAlloc(sizeof(ACCOUNT_CACHE_ENTRY)));
+        if (pEntry == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        HRESULT hr = S_FALSE;
+        ULONGLONG ullKey = AccountKeyHash(bKind, pszKey);
+        bool fCached = ReadAccountEntry(bKind, ullKey, pszKey, pEntry);
+        if (!fCached && fWait)
+        {
+            hr = ResolveAndStore(bKind, pszKey);
+            fCached = ReadAccountEntry(bKind, ullKey, pszKey, pEntry);
+        }
+        else if (!fCached)
+        {
+            QueueLookup(bKind, ullKey, pszKey);
+        }
+
+        if (fCached)
+        {
+            hr = (pEntry->bFlags & AEF_NONE_MAPPED)
+                ? HRESULT_FROM_WIN32(ERROR_NONE_MAPPED)
+                : SHStrDupW(&pEntry->rgwch[pEntry->cchKey + 1], ppszValue);
+        }
+        else if (SUCCEEDED(hr))
+        {
+            // Resolved, but the answer could not be cached; the caller retries later.
+            hr = S_FALSE;
+        }
+        CoTaskMemFree(pEntry);
+        return hr;
+    }
+}
+
+HRESULT NormalizeAccountName(_In_ PCWSTR pszAccountName, _Out_writes_(cchNormalized) PWSTR pszNormalized, size_t cchNormalized)
+{
+    *pszNormalized = L'\0';
+    while (iswspace(*pszAccountName))
+    {
+        pszAccountName++;
+    }
+    size_t cchName = wcslen(pszAccountName);
+    while (cchName > 0 && iswspace(pszAccountName[cchName - 1]))
+    {
+        cchName--;
+    }
+    if (cchName == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    // .\user names an account of this computer.
+    HRESULT hr = S_OK;
+    size_t ichName = 0;
+    if (cchName > 2 && pszAccountName[0] == L'.' && pszAccountName[1] == L'\\')
+    {
+        wchar_t szComputer[MAX_COMPUTERNAME_LENGTH + 1];
+        DWORD cchComputer = ARRAYSIZE(szComputer);
+        hr = GetComputerNameW(szComputer, &cchComputer) ? StringCchCopyW(pszNormalized, cchNormalized, szComputer) : HRESULT_FROM_WIN32(GetLastError());
+        ichName = 1;
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = StringCchCatNW(pszNormalized, cchNormalized, pszAccountName + ichName, cchName - ichName);
+    }
+    if (SUCCEEDED(hr))
+    {
+        // Account names compare without regard to case, by the invariant upper-case table.
+        int cch = static_cast<int>(wcslen(pszNormalized));
+        if (LCMapStringEx(LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE, pszNormalized, cch, pszNormalized, cch, nullptr, nullptr, 0) == 0)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    if (FAILED(hr))
+    {
+        *pszNormalized = L'\0';
+    }
+    return hr;
+}
+
+HRESULT GetSidForAccountName(_In_ PCWSTR pszAccountName, bool fWait, _Outptr_result_maybenull_ PWSTR *ppszSid)
+{
+    *ppszSid = nullptr;
+    wchar_t szNormalized[c_cchMaxAccountName + 1];
+    HRESULT hr = NormalizeAccountName(pszAccountName, szNormalized, ARRAYSIZE(szNormalized));
+    if (SUCCEEDED(hr))
+    {
+        hr = LookupAccount(AEK_NAME_TO_SID, szNormalized, fWait, ppszSid);
+    }
+    return hr;
+}
+
+HRESULT GetAccountNameForSid(_In_ PCWSTR pszSid, bool fWait, _Outptr_result_maybenull_ PWSTR *ppszAccountName)
+{
+    *ppszAccountName = nullptr;
+
+    // Round-trip the SID so every spelling of it shares one key.
+    PSID psid;
+    if (!ConvertStringSidToSidW(pszSid, &psid))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    PWSTR pszCanonicalSid;
+    HRESULT hr = ConvertSidToStringSidW(psid, &pszCanonicalSid) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+    LocalFree(psid);
+    if (SUCCEEDED(hr))
+    {
+        hr = LookupAccount(AEK_SID_TO_NAME, pszCanonicalSid, fWait, ppszAccountName);
+        LocalFree(pszCanonicalSid);
+    }
+    return hr;
+}
+
+void PrimeAccountName(_In_ PCWSTR pszAccountName)
+{
+    PWSTR pszSid;
+    if (GetSidForAccountName(pszAccountName, false, &pszSid) == S_OK)
+    {
+        CoTaskMemFree(pszSid);
+    }
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include "helpers.h"
+
+// Account name and SID cache.
+//
+// Names reach us as DOMAIN\user, .\user, bare user names and UPNs, and turning one into a SID
+// (or back) is LookupAccountName/LookupAccountSid, which can take seconds against a slow DC.
+// Answers are cached both ways in a CSharedTable shared by every process that hosts us, keyed
+// by the normalized name or SID. Unknown accounts are cached as well, for a shorter time.
+//
+// Lookups return S_OK with the answer, HRESULT_FROM_WIN32(ERROR_NONE_MAPPED) when the account is
+// known not to exist, or S_FALSE with nullptr when the answer is not cached. On S_FALSE the
+// lookup has been queued to the thread pool, unless fWait asked for it on the calling thread.
+// Never pass fWait from the UI thread.
+
+// Trims, expands .\user to the local computer name and upper-cases pszAccountName into the
+// form the cache is keyed by.
+HRESULT NormalizeAccountName(_In_ PCWSTR pszAccountName, _Out_writes_(cchNormalized) PWSTR pszNormalized, size_t cchNormalized);
+
+HRESULT GetSidForAccountName(_In_ PCWSTR pszAccountName, bool fWait, _Outptr_result_maybenull_ PWSTR *ppszSid);
+
+// The account name comes back as DOMAIN\user.
+HRESULT GetAccountNameForSid(_In_ PCWSTR pszSid, bool fWait, _Outptr_result_maybenull_ PWSTR *ppszAccountName);
+
+// Starts resolving pszAccountName in the background if it is not cached yet.
+void PrimeAccountName(_In_ PCWSTR pszAccountName);
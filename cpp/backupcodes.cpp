@@ -0,0 +1,519 @@
+#include "backupcodes.h"
+#include <bcrypt.h>
+#include <sddl.h>
+#include <wincrypt.h>
+#include <string>
+#include <vector>
+#include "utils.h"
+
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#endif
+
+namespace
+{
+    const wchar_t c_szBackupCodesFile[] = L"C:\\ProgramData\\sqcp\\Protected\\backupcodes.bin";
+    // Where imports wrote the table before it was moved out of reach of users.
+    const wchar_t c_szLegacyBackupCodesFile[] = L"C:\\ProgramData\\sqcp\\backupcodes.bin";
+    const char c_szPepperEntropy[] = "sqcp-backup-pepper";
+
+    const DWORD c_dwBackupCodesMagic = 0x43425153;  // "SQBC"
+    const DWORD c_dwBackupCodesVersion = 1;
+    const DWORD c_cIterations = 10000;
+    const DWORD c_cbSalt = 16;
+    const DWORD c_cbPepper = 32;
+    const DWORD c_cbMaxSealedPepper = 448;
+    const DWORD c_cEntriesPerBucket = 4;
+    const DWORD c_cProbeBuckets = 2;
+    const DWORD c_cMinBuckets = 16;
+    const DWORD c_cMaxBuckets = 1 << 20;
+    const DWORD c_cchMaxCode = 32;
+    const DWORD c_cbMaxSource = 16 * 1024 * 1024;
+    const ULONGLONG c_ullEmpty = 0;
+    const ULONGLONG c_ullTombstone = ~0ull;
+
+    struct BACKUP_CODES_HEADER
+    {
+        DWORD       dwMagic;
+        DWORD       dwVersion;
+        DWORD       cBuckets;                               // Power of two.
+        DWORD       cIterations;
+        DWORD       cbSealedPepper;
+        DWORD       rgdwReserved[3];
+        BYTE        rgbSalt[c_cbSalt];
+        BYTE        rgbSealedPepper[c_cbMaxSealedPepper];
+    };
+    static_assert(sizeof(BACKUP_CODES_HEADER) % 64 == 0, "buckets must start on a cache line");
+
+    // ullTag holds c_ullEmpty, c_ullTombstone or the first half of a code's hash.
+    struct BACKUP_CODE_ENTRY
+    {
+        ULONGLONG   ullTag;
+        ULONGLONG   ullCheck;
+    };
+
+    struct BACKUP_CODE_BUCKET
+    {
+        BACKUP_CODE_ENTRY   rgEntries[c_cEntriesPerBucket];
+    };
+    static_assert(sizeof(BACKUP_CODE_BUCKET) == 64, "a bucket is one cache line");
+
+    INIT_ONCE s_initPrf = INIT_ONCE_STATIC_INIT;
+    BCRYPT_ALG_HANDLE s_hPrf = nullptr;
+
+    BOOL CALLBACK OpenPrf(PINIT_ONCE, PVOID, PVOID *)
+    {
+        return NT_SUCCESS(BCryptOpenAlgorithmProvider(&s_hPrf, BCRYPT_SHA256_ALGORITHM, nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG));
+    }
+
+    // Strips spaces and dashes and upper-cases pszCode into the ASCII the hash is taken over.
+    HRESULT NormalizeCode(_In_ PCWSTR pszCode, _Out_writes_(cchMax) char *pszNormalized, DWORD cchMax, _Out_ DWORD *pcch)
+    {
+        *pcch = 0;
+        for (; *pszCode != L'\0'; pszCode++)
+        {
+            wchar_t ch = *pszCode;
+            if (ch == L' ' || ch == L'-')
+            {
+                continue;
+            }
+            if (ch >= L'a' && ch <= L'z')
+            {
+                ch = static_cast<wchar_t>(ch - L'a' + L'A');
+            }
+            if (!((ch >= L'A' && ch <= L'Z') || (ch >= L'0' && ch <= L'9')) || *pcch + 1 >= cchMax)
+            {
+                return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            }
+            pszNormalized[(*pcch)++] = static_cast<char>(ch);
+        }
+        pszNormalized[*pcch] = '\0';
+        return (*pcch > 0) ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    // PBKDF2-HMAC-SHA256 of the code, salted with the file salt and the SID and peppered.
+    HRESULT DeriveEntry(_In_ const BACKUP_CODES_HEADER *pHeader, _In_reads_bytes_(c_cbPepper) const BYTE *pbPepper,
+                        _In_ PCWSTR pszUserSid, _In_ PCWSTR pszCode, _Out_ BACKUP_CODE_ENTRY *pEntry)
+    {
+        ZeroMemory(pEntry, sizeof(*pEntry));
+        if (!InitOnceExecuteOnce(&s_initPrf, OpenPrf, nullptr, nullptr))
+        {
+            return E_UNEXPECTED;
+        }
+
+        char szCode[c_cchMaxCode + 1];
+        DWORD cchCode;
+        HRESULT hr = NormalizeCode(pszCode, szCode, ARRAYSIZE(szCode), &cchCode);
+
+        BYTE rgbSalt[c_cbSalt + SECURITY_MAX_SID_STRING_CHARACTERS * sizeof(wchar_t) + c_cbPepper];
+        DWORD cbSalt = 0;
+        size_t cchSid = 0;
+        if (SUCCEEDED(hr))
+        {
+            hr = StringCchLengthW(pszUserSid, SECURITY_MAX_SID_STRING_CHARACTERS, &cchSid);
+        }
+        if (SUCCEEDED(hr))
+        {
+            CopyMemory(rgbSalt, pHeader->rgbSalt, c_cbSalt);
+            cbSalt = c_cbSalt;
+            for (size_t i = 0; i < cchSid; i++)
+            {
+                wchar_t ch = (pszUserSid[i] >= L'a' && pszUserSid[i] <= L'z') ? static_cast<wchar_t>(pszUserSid[i] - L'a' + L'A') : pszUserSid[i];
+                rgbSalt[cbSalt++] = static_cast<BYTE>(ch);
+                rgbSalt[cbSalt++] = static_cast<BYTE>(ch >> 8);
+            }
+            CopyMemory(rgbSalt + cbSalt, pbPepper, c_cbPepper);
+            cbSalt += c_cbPepper;
+
+            NTSTATUS status = BCryptDeriveKeyPBKDF2(s_hPrf, reinterpret_cast<PUCHAR>(szCode), cchCode, rgbSalt, cbSalt,
+                                                    pHeader->cIterations, reinterpret_cast<PUCHAR>(pEntry), sizeof(*pEntry), 0);
+            hr = NT_SUCCESS(status) ? S_OK : HRESULT_FROM_NT(status);
+        }
+        if (SUCCEEDED(hr) && (pEntry->ullTag == c_ullEmpty || pEntry->ullTag == c_ullTombstone))
+        {
+            pEntry->ullTag = 1;
+        }
+
+        SecureZeroMemory(szCode, sizeof(szCode));
+        SecureZeroMemory(rgbSalt, sizeof(rgbSalt));
+        return hr;
+    }
+
+    HRESULT UnsealPepper(_In_ const BACKUP_CODES_HEADER *pHeader, _Out_writes_bytes_(c_cbPepper) BYTE *pbPepper)
+    {
+        DATA_BLOB blobSealed = { pHeader->cbSealedPepper, const_cast<BYTE *>(pHeader->rgbSealedPepper) };
+        DATA_BLOB blobEntropy = { sizeof(c_szPepperEntropy), reinterpret_cast<BYTE *>(const_cast<char *>(c_szPepperEntropy)) };
+        DATA_BLOB blobPepper = {};
+        if (!CryptUnprotectData(&blobSealed, nullptr, &blobEntropy, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &blobPepper))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        HRESULT hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        if (blobPepper.cbData == c_cbPepper)
+        {
+            CopyMemory(pbPepper, blobPepper.pbData, c_cbPepper);
+            hr = S_OK;
+        }
+        SecureZeroMemory(blobPepper.pbData, blobPepper.cbData);
+        LocalFree(blobPepper.pbData);
+        return hr;
+    }
+
+    bool IsValidTable(_In_reads_bytes_(cbView) const BYTE *pbView, DWORD cbView)
+    {
+        const BACKUP_CODES_HEADER *pHeader = reinterpret_cast<const BACKUP_CODES_HEADER *>(pbView);
+        return cbView >= sizeof(*pHeader) &&
+               pHeader->dwMagic == c_dwBackupCodesMagic &&
+               pHeader->dwVersion == c_dwBackupCodesVersion &&
+               pHeader->cBuckets >= c_cMinBuckets && pHeader->cBuckets <= c_cMaxBuckets &&
+               (pHeader->cBuckets & (pHeader->cBuckets - 1)) == 0 &&
+               pHeader->cIterations > 0 &&
+               pHeader->cbSealedPepper > 0 && pHeader->cbSealedPepper <= c_cbMaxSealedPepper &&
+               cbView == sizeof(*pHeader) + pHeader->cBuckets * sizeof(BACKUP_CODE_BUCKET);
+    }
+
+    // Places entry in the first free slot of its probe sequence; false when all are taken.
+    bool InsertEntry(_Inout_updates_(cBuckets) BACKUP_CODE_BUCKET *rgBuckets, DWORD cBuckets, _In_ const BACKUP_CODE_ENTRY &entry)
+    {
+        DWORD iBucket = static_cast<DWORD>(entry.ullCheck) & (cBuckets - 1);
+        for (DWORD iProbe = 0; iProbe < c_cProbeBuckets; iProbe++)
+        {
+            BACKUP_CODE_BUCKET &bucket = rgBuckets[(iBucket + iProbe) & (cBuckets - 1)];
+            for (DWORD iEntry = 0; iEntry < c_cEntriesPerBucket; iEntry++)
+            {
+                if (bucket.rgEntries[iEntry].ullTag == c_ullEmpty)
+                {
+                    bucket.rgEntries[iEntry] = entry;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Sizes the table for a load of at most one half, growing it until every entry fits its
+    // probe sequence.
+    HRESULT BuildTableImage(_In_ const BACKUP_CODES_HEADER &header, _In_ const std::vector<BACKUP_CODE_ENTRY> &entries, _Out_ std::vector<BYTE> *pImage)
+    {
+        DWORD cBuckets = c_cMinBuckets;
+        while (cBuckets * c_cEntriesPerBucket < entries.size() * 2)
+        {
+            cBuckets *= 2;
+        }
+
+        for (; cBuckets <= c_cMaxBuckets; cBuckets *= 2)
+        {
+            pImage->assign(sizeof(header) + cBuckets * sizeof(BACKUP_CODE_BUCKET), 0);
+            BACKUP_CODES_HEADER *pHeader = reinterpret_cast<BACKUP_CODES_HEADER *>(pImage->data());
+            *pHeader = header;
+            pHeader->cBuckets = cBuckets;
+            BACKUP_CODE_BUCKET *rgBuckets = reinterpret_cast<BACKUP_CODE_BUCKET *>(pImage->data() + sizeof(header));
+
+            bool fPlaced = true;
+            for (size_t i = 0; i < entries.size() && fPlaced; i++)
+            {
+                fPlaced = InsertEntry(rgBuckets, cBuckets, entries[i]);
+            }
+            if (fPlaced)
+            {
+                return S_OK;
+            }
+        }
+        return HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+    }
+
+    HRESULT ReadSourceText(_In_ PCWSTR pszPath, _Out_ std::wstring *pText)
+    {
+        pText->clear();
+        HANDLE hFile = CreateFileW(pszPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        HRESULT hr = S_OK;
+        LARGE_INTEGER liSize = {};
+        std::vector<char> bytes;
+        if (!GetFileSizeEx(hFile, &liSize) || liSize.QuadPart > c_cbMaxSource)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+        }
+        else if (liSize.QuadPart > 0)
+        {
+            bytes.resize(static_cast<size_t>(liSize.QuadPart));
+            DWORD cbRead = 0;
+            if (!ReadFile(hFile, bytes.data(), static_cast<DWORD>(bytes.size()), &cbRead, nullptr) || cbRead != bytes.size())
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+        }
+        CloseHandle(hFile);
+
+        if (SUCCEEDED(hr) && !bytes.empty())
+        {
+            size_t ibText = (bytes.size() >= 3 && memcmp(bytes.data(), "\xEF\xBB\xBF", 3) == 0) ? 3 : 0;
+            int cbText = static_cast<int>(bytes.size() - ibText);
+            int cchText = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, bytes.data() + ibText, cbText, nullptr, 0);
+            if (cchText > 0)
+            {
+                pText->resize(cchText);
+                MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, bytes.data() + ibText, cbText, &(*pText)[0], cchText);
+            }
+            else if (cbText > 0)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+            }
+        }
+        SecureZeroMemory(bytes.data(), bytes.size());
+        return hr;
+    }
+
+    void LogImportError(DWORD iLine, _In_ PCWSTR pszMessage)
+    {
+        wchar_t buffer[160] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[BACKUPCODES] line %u: %s", iLine, pszMessage)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+
+    // Hashes every code in the source into entries.
+    HRESULT ParseSource(_In_ const BACKUP_CODES_HEADER &header, _In_reads_bytes_(c_cbPepper) const BYTE *pbPepper,
+                        _Inout_ std::wstring *pText, _Out_ std::vector<BACKUP_CODE_ENTRY> *pEntries, _Out_ DWORD *pcUsers)
+    {
+        pEntries->clear();
+        *pcUsers = 0;
+
+        HRESULT hr = S_OK;
+        DWORD iLine = 0;
+        PWSTR pszLineContext = nullptr;
+        for (PWSTR pszLine = wcstok_s(&(*pText)[0], L"\n", &pszLineContext);
+             pszLine != nullptr && SUCCEEDED(hr);
+             pszLine = wcstok_s(nullptr, L"\n", &pszLineContext))
+        {
+            iLine++;
+            PWSTR pszComment = wcschr(pszLine, L'#');
+            if (pszComment != nullptr)
+            {
+                *pszComment = L'\0';
+            }
+
+            PWSTR pszContext = nullptr;
+            PWSTR pszSid = wcstok_s(pszLine, L" \t\r", &pszContext);
+            if (pszSid == nullptr)
+            {
+                continue;
+            }
+
+            PSID psid;
+            if (!ConvertStringSidToSidW(pszSid, &psid))
+            {
+                LogImportError(iLine, L"invalid SID");
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_SID);
+                break;
+            }
+            LocalFree(psid);
+
+            DWORD cCodes = 0;
+            for (PWSTR pszCode = wcstok_s(nullptr, L" \t\r", &pszContext);
+                 pszCode != nullptr && SUCCEEDED(hr);
+                 pszCode = wcstok_s(nullptr, L" \t\r", &pszContext))
+            {
+                BACKUP_CODE_ENTRY entry;
+                hr = DeriveEntry(&header, pbPepper, pszSid, pszCode, &entry);
+                if (SUCCEEDED(hr))
+                {
+                    pEntries->push_back(entry);
+                    cCodes++;
+                }
+                else
+                {
+                    LogImportError(iLine, L"codes are up to 32 letters and digits");
+                }
+            }
+            if (SUCCEEDED(hr) && cCodes == 0)
+            {
+                LogImportError(iLine, L"expected '<SID> <code> [<code> ...]'");
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            }
+            (*pcUsers)++;
+        }
+        return hr;
+    }
+}
+
+HRESULT HasBackupCodes()
+{
+    return (GetFileAttributesW(c_szBackupCodesFile) != INVALID_FILE_ATTRIBUTES) ? S_OK : S_FALSE;
+}
+
+HRESULT ConsumeBackupCode(_In_ PCWSTR pszUserSid, _In_ PCWSTR pszCode)
+{
+    if (*pszUserSid == L'\0')
+    {
+        return E_ACCESSDENIED;
+    }
+
+    BYTE *pbView;
+    DWORD cbView;
+    HANDLE hFile;
+    HRESULT hr = MapTrustedFileForUpdate(c_szBackupCodesFile, sizeof(BACKUP_CODES_HEADER) + c_cMaxBuckets * sizeof(BACKUP_CODE_BUCKET), &pbView, &cbView, &hFile);
+    if (FAILED(hr))
+    {
+        return (hr == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND)) ? E_ACCESSDENIED : hr;
+    }
+
+    BYTE rgbPepper[c_cbPepper];
+    BACKUP_CODE_ENTRY probe = {};
+    const BACKUP_CODES_HEADER *pHeader = reinterpret_cast<const BACKUP_CODES_HEADER *>(pbView);
+    hr = IsValidTable(pbView, cbView) ? UnsealPepper(pHeader, rgbPepper) : HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    if (SUCCEEDED(hr))
+    {
+        hr = DeriveEntry(pHeader, rgbPepper, pszUserSid, pszCode, &probe);
+        if (hr == HRESULT_FROM_WIN32(ERROR_INVALID_DATA))
+        {
+            // Not shaped like a backup code at all.
+            hr = E_ACCESSDENIED;
+        }
+    }
+    SecureZeroMemory(rgbPepper, sizeof(rgbPepper));
+
+    if (SUCCEEDED(hr))
+    {
+        // Every entry in the probe sequence is compared, and the first match picked with masks.
+        BACKUP_CODE_BUCKET *rgBuckets = reinterpret_cast<BACKUP_CODE_BUCKET *>(pbView + sizeof(*pHeader));
+        DWORD iBucket = static_cast<DWORD>(probe.ullCheck) & (pHeader->cBuckets - 1);
+        ULONG_PTR uMatch = 0;
+        DWORD dwFound = 0;
+        for (DWORD iProbe = 0; iProbe < c_cProbeBuckets; iProbe++)
+        {
+            BACKUP_CODE_BUCKET *pBucket = &rgBuckets[(iBucket + iProbe) & (pHeader->cBuckets - 1)];
+            for (DWORD iEntry = 0; iEntry < c_cEntriesPerBucket; iEntry++)
+            {
+                BACKUP_CODE_ENTRY *pEntry = &pBucket->rgEntries[iEntry];
+                ULONGLONG ullTag = static_cast<ULONGLONG>(ReadAcquire64(reinterpret_cast<volatile LONG64 *>(&pEntry->ullTag)));
+                ULONGLONG ullDiff = (ullTag ^ probe.ullTag) | (pEntry->ullCheck ^ probe.ullCheck);
+                DWORD dwEqual = static_cast<DWORD>(((ullDiff | (0 - ullDiff)) >> 63) - 1);
+                DWORD dwFirst = dwEqual & ~dwFound;
+                uMatch |= reinterpret_cast<ULONG_PTR>(pEntry) & static_cast<ULONG_PTR>(static_cast<LONG_PTR>(static_cast<LONG>(dwFirst)));
+                dwFound |= dwEqual;
+            }
+        }
+
+        // Only one process can swap the tag out, so a code is accepted at most once; the
+        // tombstone is on disk before the caller lets the logon through.
+        BACKUP_CODE_ENTRY *pMatch = reinterpret_cast<BACKUP_CODE_ENTRY *>(uMatch);
+        if (pMatch != nullptr &&
+            InterlockedCompareExchange64(reinterpret_cast<volatile LONG64 *>(&pMatch->ullTag), static_cast<LONG64>(c_ullTombstone), static_cast<LONG64>(probe.ullTag)) == static_cast<LONG64>(probe.ullTag))
+        {
+            hr = (FlushViewOfFile(pMatch, sizeof(*pMatch)) && FlushFileBuffers(hFile)) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+        }
+        else
+        {
+            hr = E_ACCESSDENIED;
+        }
+    }
+    SecureZeroMemory(&probe, sizeof(probe));
+
+    UnmapViewOfFile(pbView);
+    CloseHandle(hFile);
+
+    wchar_t buffer[128] = {};
+    if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[BACKUPCODES] code consumed hr=0x%08X", hr)))
+    {
+        WriteLogMessage(buffer);
+    }
+    return hr;
+}
+
+EXTERN_C void CALLBACK ImportBackupCodesW(HWND /*hwnd*/, HINSTANCE /*hinst*/, LPWSTR pszCmdLine, int /*nCmdShow*/)
+{
+    // rundll32 passes the rest of its command line; accept the path with or without quotes.
+    PWSTR pszSource = pszCmdLine;
+    while (*pszSource == L' ' || *pszSource == L'"')
+    {
+        pszSource++;
+    }
+    size_t cchSource = wcslen(pszSource);
+    while (cchSource > 0 && (pszSource[cchSource - 1] == L' ' || pszSource[cchSource - 1] == L'"'))
+    {
+        pszSource[--cchSource] = L'\0';
+    }
+
+    BACKUP_CODES_HEADER header = {};
+    header.dwMagic = c_dwBackupCodesMagic;
+    header.dwVersion = c_dwBackupCodesVersion;
+    header.cIterations = c_cIterations;
+
+    // A fresh salt and pepper per import.
+    BYTE rgbPepper[c_cbPepper];
+    HRESULT hr = S_OK;
+    if (!NT_SUCCESS(BCryptGenRandom(nullptr, header.rgbSalt, sizeof(header.rgbSalt), BCRYPT_USE_SYSTEM_PREFERRED_RNG)) ||
+        !NT_SUCCESS(BCryptGenRandom(nullptr, rgbPepper, sizeof(rgbPepper), BCRYPT_USE_SYSTEM_PREFERRED_RNG)))
+    {
+        hr = E_FAIL;
+    }
+
+    DATA_BLOB blobPepper = { sizeof(rgbPepper), rgbPepper };
+    DATA_BLOB blobEntropy = { sizeof(c_szPepperEntropy), reinterpret_cast<BYTE *>(const_cast<char *>(c_szPepperEntropy)) };
+    DATA_BLOB blobSealed = {};
+    if (SUCCEEDED(hr) &&
+        !CryptProtectData(&blobPepper, nullptr, &blobEntropy, nullptr, nullptr, CRYPTPROTECT_LOCAL_MACHINE | CRYPTPROTECT_UI_FORBIDDEN, &blobSealed))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (SUCCEEDED(hr))
+    {
+        if (blobSealed.cbData <= sizeof(header.rgbSealedPepper))
+        {
+            CopyMemory(header.rgbSealedPepper, blobSealed.pbData, blobSealed.cbData);
+            header.cbSealedPepper = blobSealed.cbData;
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+    }
+    LocalFree(blobSealed.pbData);
+
+    std::wstring text;
+    std::vector<BACKUP_CODE_ENTRY> entries;
+    std::vector<BYTE> image;
+    DWORD cUsers = 0;
+    if (SUCCEEDED(hr))
+    {
+        hr = ReadSourceText(pszSource, &text);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = ParseSource(header, rgbPepper, &text, &entries, &cUsers);
+    }
+    SecureZeroMemory(rgbPepper, sizeof(rgbPepper));
+    SecureZeroMemory(&text[0], text.size() * sizeof(wchar_t));
+    if (SUCCEEDED(hr))
+    {
+        hr = BuildTableImage(header, entries, &image);
+    }
+    PSECURITY_DESCRIPTOR psd = nullptr;
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateSystemOnlySecurityDescriptor(&psd);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = ReplaceFileContents(c_szBackupCodesFile, image.data(), static_cast<DWORD>(image.size()), psd);
+    }
+    if (SUCCEEDED(hr) && !DeleteFileW(c_szLegacyBackupCodesFile) && GetLastError() != ERROR_FILE_NOT_FOUND)
+    {
+        // The old table still holds codes users can attack offline; the import has not done its job.
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    LocalFree(psd);
+
+    wchar_t buffer[160] = {};
+    if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[BACKUPCODES] import from %s: %u user(s), %u code(s), %u byte(s) hr=0x%08X",
+                                   pszSource, cUsers, static_cast<DWORD>(entries.size()), static_cast<DWORD>(image.size()), hr)))
+    {
+        WriteLogMessage(buffer);
+    }
+}
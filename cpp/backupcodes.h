@@ -0,0 +1,36 @@
+#pragma once
+
+#include "helpers.h"
+
+// Offline backup codes.
+//
+// SendQuick pre-issues a batch of single-use backup codes per user, which ImportBackupCodesW
+// compiles into C:\ProgramData\sqcp\Protected\backupcodes.bin. The file holds no codes: each
+// entry is a PBKDF2-HMAC-SHA256 of the code, salted with a per-file salt and the user's SID and
+// peppered with a random key sealed by machine DPAPI, so a copy of the disk does not give the
+// codes away. Any local account can unseal the pepper, though, so the file and its directory are
+// readable by SYSTEM and Administrators only; CredUI in a user's session sees no backup codes.
+//
+// Entries sit in an open-addressing table of 64-byte buckets, one cache line each, four entries
+// to a bucket. A code can only live in its home bucket or the next one, so a lookup reads two
+// cache lines and compares all eight entries without an early exit. The file is mapped
+// read-write; a code is consumed by swapping its entry for a tombstone with a single
+// compare-exchange, which is flushed to disk before the logon is allowed to proceed.
+
+// Returns S_OK when a backup code table has been deployed and S_FALSE when not.
+HRESULT HasBackupCodes();
+
+// Returns S_OK and consumes pszCode when it is one of pszUserSid's unused backup codes, and
+// E_ACCESSDENIED when it is not.
+HRESULT ConsumeBackupCode(_In_ PCWSTR pszUserSid, _In_ PCWSTR pszCode);
+
+// rundll32 entry point: rundll32 SampleV2CredentialProvider.dll,ImportBackupCodes <source>
+//
+// The source is a UTF-8 text file with one line per user; '#' starts a comment:
+//
+//  <SID> <code> [<code> ...]
+//
+// Codes are compared without spaces or dashes and ignoring case. Importing replaces the whole
+// table, so the source lists every user's current batch. Delete the source once it has been
+// imported. Results go to the log.
+EXTERN_C void CALLBACK ImportBackupCodesW(HWND hwnd, HINSTANCE hinst, LPWSTR pszCmdLine, int nCmdShow);
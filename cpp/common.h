@@ -23,8 +23,9 @@ enum SAMPLE_FIELD_ID
     SFI_LARGE_TEXT        = 2,
     SFI_USERNAME          = 3,
     SFI_PASSWORD          = 4,
-    SFI_SUBMIT_BUTTON     = 5,
-    SFI_NUM_FIELDS        = 6,  // Note: if new fields are added, keep NUM_FIELDS last.  This is used as a count of the number of fields
+    SFI_OTP               = 5,
+    SFI_SUBMIT_BUTTON     = 6,
+    SFI_NUM_FIELDS        = 7,  // Note: if new fields are added, keep NUM_FIELDS last.  This is used as a count of the number of fields
 };
 
 // The first value indicates when the tile is displayed (selected, not selected)
@@ -49,6 +50,7 @@ static const FIELD_STATE_PAIR s_rgFieldStatePairs[] =
     { CPFS_DISPLAY_IN_BOTH,            CPFIS_NONE    },    // SFI_LARGE_TEXT
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_FOCUSED },    // SFI_USERNAME
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_FOCUSED },    // SFI_PASSWORD
+    { CPFS_HIDDEN,                     CPFIS_NONE    },    // SFI_OTP: shown once a code has been sent
     { CPFS_DISPLAY_IN_SELECTED_TILE,   CPFIS_NONE    },    // SFI_SUBMIT_BUTTON
 };
 
@@ -63,6 +65,7 @@ static const CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR s_rgCredProvFieldDescriptors[]
     { SFI_LARGE_TEXT,        CPFT_LARGE_TEXT,    L"Sample Credential Provider"                                 },
     { SFI_USERNAME,          CPFT_EDIT_TEXT,     L"Username"                                                    },
     { SFI_PASSWORD,          CPFT_PASSWORD_TEXT, L"Password text"                                              },
+    { SFI_OTP,               CPFT_PASSWORD_TEXT, L"One-time code"                                              },
     { SFI_SUBMIT_BUTTON,     CPFT_SUBMIT_BUTTON, L"Submit"                                                     },
     // { SFI_HIDECONTROLS_LINK, CPFT_COMMAND_LINK,  L"Hide additional controls"                                   },
     // { SFI_FULLNAME_TEXT,     CPFT_SMALL_TEXT,    L"Full name: "                                                },
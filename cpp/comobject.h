@@ -0,0 +1,53 @@
+#pragma once
+
+#include <windows.h>
+#include <unknwn.h>
+
+#pragma warning(push)
+#pragma warning(disable: 4995)
+#include <shlwapi.h>
+#pragma warning(pop)
+
+// IUnknown implementation shared by our COM classes.
+//
+// TDerived inherits its interfaces through this template and lists them in a public
+// "static const QITAB c_rgqit[]" built with QITABENT, so the interface table is laid out by
+// the compiler rather than assembled at run time. Reference counting is interlocked, which
+// lets objects be handed to the worker threads used for prefetch and event delivery.
+template <class TDerived, class... TInterfaces>
+class CComObject : public TInterfaces...
+{
+public:
+    IFACEMETHODIMP_(ULONG) AddRef()
+    {
+        return InterlockedIncrement(&_cRef);
+    }
+
+    IFACEMETHODIMP_(ULONG) Release()
+    {
+        long cRef = InterlockedDecrement(&_cRef);
+        if (!cRef)
+        {
+            delete this;
+        }
+        return cRef;
+    }
+
+    IFACEMETHODIMP QueryInterface(_In_ REFIID riid, _COM_Outptr_ void **ppv)
+    {
+        return QISearch(static_cast<TDerived *>(this), TDerived::c_rgqit, riid, ppv);
+    }
+
+protected:
+    CComObject() :
+        _cRef(1)
+    {
+    }
+
+    virtual ~CComObject()
+    {
+    }
+
+private:
+    long _cRef;
+};
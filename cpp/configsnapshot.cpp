@@ -0,0 +1,646 @@
+#include "configsnapshot.h"
+#include <stdlib.h>
+#include <new>
+#include "dll.h"
+#include "guid.h"
+#include "providerevents.h"
+#include "utils.h"
+
+#ifndef REG_NOTIFY_THREAD_AGNOSTIC
+#define REG_NOTIFY_THREAD_AGNOSTIC 0x10000000L
+#endif
+
+// The only section of fixed size. Settings that are absent from the registry are flagged
+// in dwPresent rather than given a value here, so defaults stay with the code that uses them.
+struct CONFIG_SETTINGS
+{
+    DWORD   dwPresent;                  // CSP_* bits.
+    DWORD   dwFilterExclusiveSlots;
+    DWORD   dwOtpTimeoutMs;
+    DWORD   dwOtpHedgePercentile;
+    DWORD   dwOtpChannels;
+};
+
+namespace
+{
+    const wchar_t c_szConfigKey[] = L"SOFTWARE\\sqcp";
+    const wchar_t c_szFilterKey[] = L"SOFTWARE\\sqcp\\Filter";
+    const wchar_t c_szFilterRulesKey[] = L"SOFTWARE\\sqcp\\Filter\\Rules";
+    const wchar_t c_szOtpKey[] = L"SOFTWARE\\sqcp\\Otp";
+    const wchar_t c_szExclusiveSlots[] = L"ExclusiveSlots";
+    const wchar_t c_szOtpServers[] = L"Servers";
+    const wchar_t c_szOtpTimeoutMs[] = L"TimeoutMs";
+    const wchar_t c_szOtpHedgePercentile[] = L"HedgePercentile";
+    const wchar_t c_szOtpChannels[] = L"Channels";
+
+    // Every key the snapshot is compiled from. Their newest last-write time stamps the file.
+    PCWSTR const c_rgpszSourceKeys[] = { c_szConfigKey, c_szFilterKey, c_szFilterRulesKey, c_szOtpKey };
+
+    const wchar_t c_szSnapshotFile[] = L"C:\\ProgramData\\sqcp\\config.bin";
+
+    const DWORD c_dwSnapshotMagic = 0x46435153;     // "SQCF"
+    const WORD c_wSnapshotVersion = 4;
+    const DWORD c_cbMaxSnapshot = 16 * 1024 * 1024;
+    const DWORD c_cMaxOtpServers = 16;
+
+    enum CONFIG_SETTINGS_PRESENT
+    {
+        CSP_FILTER_EXCLUSIVE_SLOTS = 0x1,
+        CSP_OTP_TIMEOUT            = 0x2,
+        CSP_OTP_HEDGE_PERCENTILE   = 0x4,
+        CSP_OTP_CHANNELS           = 0x8,
+    };
+
+    enum CONFIG_SECTION_ID
+    {
+        CSID_SETTINGS       = 1,
+        CSID_FILTER_RULES   = 2,
+        CSID_OTP_SERVERS    = 3,
+    };
+
+    struct CONFIG_SNAPSHOT_HEADER
+    {
+        DWORD       dwMagic;
+        WORD        wVersion;
+        WORD        cSections;
+        DWORD       cbFile;
+        DWORD       dwChecksum;         // FNV-1a over every byte after the header.
+        ULONGLONG   ullSourceStamp;     // Newest last-write time of c_rgpszSourceKeys.
+    };
+
+    struct CONFIG_SECTION
+    {
+        DWORD   dwId;                   // CSID_*
+        DWORD   ibData;                 // From the start of the file, 8-byte aligned.
+        DWORD   cbData;
+        DWORD   cItems;
+    };
+
+    struct RULE_ALIAS
+    {
+        PCWSTR      pszName;
+        const GUID  *rgclsid[2];
+    };
+
+    const RULE_ALIAS c_rgRuleAliases[] =
+    {
+        { L"WindowsHello", { &CLSID_WinBioCredentialProvider, &CLSID_PasswordCredentialProvider } },
+        { L"SmartCard",    { &CLSID_SmartcardCredentialProvider, &CLSID_SmartcardPinProvider } },
+    };
+
+    SRWLOCK s_srwReload = SRWLOCK_INIT;        // Serializes reloads so generations are swapped in order.
+    SRWLOCK s_srwSnapshot = SRWLOCK_INIT;
+    CConfigSnapshot *s_pSnapshot = nullptr;
+    LONG s_lGeneration = 0;
+    INIT_ONCE s_initSnapshot = INIT_ONCE_STATIC_INIT;
+
+    HKEY s_hkWatch = nullptr;
+    HANDLE s_hWatchEvent = nullptr;
+    HANDLE s_hWatchWait = nullptr;
+
+    DWORD AlignSection(DWORD cb)
+    {
+        return (cb + 7) & ~7u;
+    }
+
+    DWORD SnapshotChecksum(_In_reads_bytes_(cb) const BYTE *pb, DWORD cb)
+    {
+        DWORD dwHash = 0x811C9DC5;
+        for (DWORD i = 0; i < cb; i++)
+        {
+            dwHash = (dwHash ^ pb[i]) * 0x01000193;
+        }
+        return dwHash;
+    }
+
+    int __cdecl CompareFilterRule(const void *pv1, const void *pv2)
+    {
+        return memcmp(&static_cast<const CONFIG_FILTER_RULE *>(pv1)->clsid, &static_cast<const CONFIG_FILTER_RULE *>(pv2)->clsid, sizeof(GUID));
+    }
+
+    ULONGLONG ReadSourceStamp()
+    {
+        ULONGLONG ullStamp = 0;
+        for (DWORD i = 0; i < ARRAYSIZE(c_rgpszSourceKeys); i++)
+        {
+            HKEY hk;
+            if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, c_rgpszSourceKeys[i], 0, KEY_QUERY_VALUE, &hk) == ERROR_SUCCESS)
+            {
+                FILETIME ftLastWrite = {};
+                if (RegQueryInfoKeyW(hk, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, &ftLastWrite) == ERROR_SUCCESS)
+                {
+                    ULONGLONG ullLastWrite = (static_cast<ULONGLONG>(ftLastWrite.dwHighDateTime) << 32) | ftLastWrite.dwLowDateTime;
+                    if (ullLastWrite > ullStamp)
+                    {
+                        ullStamp = ullLastWrite;
+                    }
+                }
+                RegCloseKey(hk);
+            }
+        }
+        return ullStamp;
+    }
+
+    // Appends the rule(s) named by pszName; duplicates are merged after sorting.
+    void AddFilterRule(_In_ PCWSTR pszName, DWORD dwDenySlots, _Inout_ CONFIG_FILTER_RULE *rgRules, _Inout_ DWORD *pcRules, DWORD cMaxRules)
+    {
+        for (DWORD i = 0; i < ARRAYSIZE(c_rgRuleAliases); i++)
+        {
+            if (_wcsicmp(pszName, c_rgRuleAliases[i].pszName) == 0)
+            {
+                for (DWORD j = 0; j < ARRAYSIZE(c_rgRuleAliases[i].rgclsid) && *pcRules < cMaxRules; j++)
+                {
+                    rgRules[*pcRules].clsid = *c_rgRuleAliases[i].rgclsid[j];
+                    rgRules[(*pcRules)++].dwDenySlots = dwDenySlots;
+                }
+                return;
+            }
+        }
+
+        GUID clsid;
+        if (*pcRules < cMaxRules && SUCCEEDED(CLSIDFromString(pszName, &clsid)))
+        {
+            rgRules[*pcRules].clsid = clsid;
+            rgRules[(*pcRules)++].dwDenySlots = dwDenySlots;
+        }
+    }
+
+    // Reads Filter\Rules into a sorted, duplicate-free CoTaskMem array.
+    HRESULT ReadFilterRules(_Outptr_result_buffer_maybenull_(*pcRules) CONFIG_FILTER_RULE **prgRules, _Out_ DWORD *pcRules)
+    {
+        *prgRules = nullptr;
+        *pcRules = 0;
+
+        HKEY hkRules;
+        if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, c_szFilterRulesKey, 0, KEY_QUERY_VALUE, &hkRules) != ERROR_SUCCESS)
+        {
+            return S_OK;
+        }
+
+        HRESULT hr = S_OK;
+        DWORD cValues = 0;
+        LONG lResult = RegQueryInfoKeyW(hkRules, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, &cValues, nullptr, nullptr, nullptr, nullptr);
+        if (lResult == ERROR_SUCCESS && cValues > 0)
+        {
+            // An alias can expand to two rules.
+            DWORD cMaxRules = cValues * 2;
+            CONFIG_FILTER_RULE *rgRules = static_cast<CONFIG_FILTER_RULE *>(CoTaskMemAlloc(cMaxRules * sizeof(*rgRules)));
+            if (rgRules != nullptr)
+            {
+                DWORD cRules = 0;
+                for (DWORD i = 0; i < cValues; i++)
+                {
+                    wchar_t szName[64];
+                    DWORD cchName = ARRAYSIZE(szName);
+                    DWORD dwType = 0;
+                    DWORD dwDeny = 0;
+                    DWORD cbDeny = sizeof(dwDeny);
+                    if (RegEnumValueW(hkRules, i, szName, &cchName, nullptr, &dwType, reinterpret_cast<BYTE *>(&dwDeny), &cbDeny) == ERROR_SUCCESS &&
+                        dwType == REG_DWORD)
+                    {
+                        AddFilterRule(szName, dwDeny, rgRules, &cRules, cMaxRules);
+                    }
+                }
+
+                qsort(rgRules, cRules, sizeof(*rgRules), CompareFilterRule);
+                DWORD cUnique = 0;
+                for (DWORD i = 0; i < cRules; i++)
+                {
+                    if (cUnique > 0 && CompareFilterRule(&rgRules[cUnique - 1], &rgRules[i]) == 0)
+                    {
+                        rgRules[cUnique - 1].dwDenySlots |= rgRules[i].dwDenySlots;
+                    }
+                    else
+                    {
+                        rgRules[cUnique++] = rgRules[i];
+                    }
+                }
+
+                *prgRules = rgRules;
+                *pcRules = cUnique;
+            }
+            else
+            {
+                hr = E_OUTOFMEMORY;
+            }
+        }
+        RegCloseKey(hkRules);
+        return hr;
+    }
+
+    // Reads Otp\Servers into a CoTaskMem array, skipping URLs too long to store.
+    HRESULT ReadOtpServers(_Outptr_result_buffer_maybenull_(*pcServers) CONFIG_OTP_SERVER **prgServers, _Out_ DWORD *pcServers)
+    {
+        *prgServers = nullptr;
+        *pcServers = 0;
+
+        DWORD cbServers = 0;
+        if (RegGetValueW(HKEY_LOCAL_MACHINE, c_szOtpKey, c_szOtpServers, RRF_RT_REG_MULTI_SZ, nullptr, nullptr, &cbServers) != ERROR_SUCCESS)
+        {
+            return S_OK;
+        }
+
+        PWSTR pszServers = static_cast<PWSTR>(CoTaskMemAlloc(cbServers));
+        CONFIG_OTP_SERVER *rgServers = static_cast<CONFIG_OTP_SERVER *>(CoTaskMemAlloc(c_cMaxOtpServers * sizeof(*rgServers)));
+        HRESULT hr = (pszServers != nullptr && rgServers != nullptr) ? S_OK : E_OUTOFMEMORY;
+        if (SUCCEEDED(hr))
+        {
+            ZeroMemory(rgServers, c_cMaxOtpServers * sizeof(*rgServers));
+            LONG lResult = RegGetValueW(HKEY_LOCAL_MACHINE, c_szOtpKey, c_szOtpServers, RRF_RT_REG_MULTI_SZ, nullptr, pszServers, &cbServers);
+            DWORD cServers = 0;
+            for (PCWSTR psz = pszServers; lResult == ERROR_SUCCESS && *psz != L'\0' && cServers < c_cMaxOtpServers; psz += wcslen(psz) + 1)
+            {
+                if (SUCCEEDED(StringCchCopyW(rgServers[cServers].szUrl, ARRAYSIZE(rgServers[cServers].szUrl), psz)))
+                {
+                    cServers++;
+                }
+            }
+            *prgServers = rgServers;
+            *pcServers = cServers;
+            rgServers = nullptr;
+        }
+        CoTaskMemFree(pszServers);
+        CoTaskMemFree(rgServers);
+        return hr;
+    }
+
+    // Reads the source keys and lays them out as a complete snapshot image in CoTaskMem.
+    HRESULT CompileSnapshot(ULONGLONG ullSourceStamp, _Outptr_result_bytebuffer_(*pcbImage) BYTE **ppbImage, _Out_ DWORD *pcbImage)
+    {
+        *ppbImage = nullptr;
+        *pcbImage = 0;
+
+        CONFIG_SETTINGS settings = {};
+        DWORD dwExclusive = 0;
+        DWORD cbData = sizeof(dwExclusive);
+        if (RegGetValueW(HKEY_LOCAL_MACHINE, c_szFilterKey, c_szExclusiveSlots, RRF_RT_REG_DWORD, nullptr, &dwExclusive, &cbData) == ERROR_SUCCESS)
+        {
+            settings.dwPresent |= CSP_FILTER_EXCLUSIVE_SLOTS;
+            settings.dwFilterExclusiveSlots = dwExclusive;
+        }
+        DWORD dwOtpTimeoutMs = 0;
+        cbData = sizeof(dwOtpTimeoutMs);
+        if (RegGetValueW(HKEY_LOCAL_MACHINE, c_szOtpKey, c_szOtpTimeoutMs, RRF_RT_REG_DWORD, nullptr, &dwOtpTimeoutMs, &cbData) == ERROR_SUCCESS)
+        {
+            settings.dwPresent |= CSP_OTP_TIMEOUT;
+            settings.dwOtpTimeoutMs = dwOtpTimeoutMs;
+        }
+        DWORD dwOtpHedgePercentile = 0;
+        cbData = sizeof(dwOtpHedgePercentile);
+        if (RegGetValueW(HKEY_LOCAL_MACHINE, c_szOtpKey, c_szOtpHedgePercentile, RRF_RT_REG_DWORD, nullptr, &dwOtpHedgePercentile, &cbData) == ERROR_SUCCESS)
+        {
+            settings.dwPresent |= CSP_OTP_HEDGE_PERCENTILE;
+            settings.dwOtpHedgePercentile = dwOtpHedgePercentile;
+        }
+        DWORD dwOtpChannels = 0;
+        cbData = sizeof(dwOtpChannels);
+        if (RegGetValueW(HKEY_LOCAL_MACHINE, c_szOtpKey, c_szOtpChannels, RRF_RT_REG_DWORD, nullptr, &dwOtpChannels, &cbData) == ERROR_SUCCESS)
+        {
+            settings.dwPresent |= CSP_OTP_CHANNELS;
+            settings.dwOtpChannels = dwOtpChannels;
+        }
+
+        CONFIG_FILTER_RULE *rgRules = nullptr;
+        DWORD cRules = 0;
+        CONFIG_OTP_SERVER *rgServers = nullptr;
+        DWORD cServers = 0;
+        HRESULT hr = ReadFilterRules(&rgRules, &cRules);
+        if (SUCCEEDED(hr))
+        {
+            hr = ReadOtpServers(&rgServers, &cServers);
+        }
+        if (SUCCEEDED(hr))
+        {
+            const WORD cSections = 3;
+            DWORD ibSettings = AlignSection(sizeof(CONFIG_SNAPSHOT_HEADER) + cSections * sizeof(CONFIG_SECTION));
+            DWORD ibRules = AlignSection(ibSettings + sizeof(settings));
+            DWORD ibServers = AlignSection(ibRules + cRules * sizeof(*rgRules));
+            DWORD cbImage = AlignSection(ibServers + cServers * sizeof(*rgServers));
+
+            BYTE *pbImage = static_cast<BYTE *>(CoTaskMemAlloc(cbImage));
+            if (pbImage != nullptr)
+            {
+                ZeroMemory(pbImage, cbImage);
+                CONFIG_SNAPSHOT_HEADER *pHeader = reinterpret_cast<CONFIG_SNAPSHOT_HEADER *>(pbImage);
+                CONFIG_SECTION *rgSections = reinterpret_cast<CONFIG_SECTION *>(pHeader + 1);
+                rgSections[0] = { CSID_SETTINGS, ibSettings, sizeof(settings), 1 };
+                rgSections[1] = { CSID_FILTER_RULES, ibRules, cRules * static_cast<DWORD>(sizeof(*rgRules)), cRules };
+                rgSections[2] = { CSID_OTP_SERVERS, ibServers, cServers * static_cast<DWORD>(sizeof(*rgServers)), cServers };
+                CopyMemory(pbImage + ibSettings, &settings, sizeof(settings));
+                if (cRules > 0)
+                {
+                    CopyMemory(pbImage + ibRules, rgRules, cRules * sizeof(*rgRules));
+                }
+                if (cServers > 0)
+                {
+                    CopyMemory(pbImage + ibServers, rgServers, cServers * sizeof(*rgServers));
+                }
+
+                pHeader->dwMagic = c_dwSnapshotMagic;
+                pHeader->wVersion = c_wSnapshotVersion;
+                pHeader->cSections = cSections;
+                pHeader->cbFile = cbImage;
+                pHeader->ullSourceStamp = ullSourceStamp;
+                pHeader->dwChecksum = SnapshotChecksum(pbImage + sizeof(*pHeader), cbImage - sizeof(*pHeader));
+
+                *ppbImage = pbImage;
+                *pcbImage = cbImage;
+            }
+            else
+            {
+                hr = E_OUTOFMEMORY;
+            }
+        }
+        CoTaskMemFree(rgRules);
+        CoTaskMemFree(rgServers);
+        return hr;
+    }
+
+    // Checks everything the readers rely on, so a torn or hand-edited file is never used.
+    bool IsValidSnapshot(_In_reads_bytes_(cbImage) const BYTE *pbImage, DWORD cbImage, ULONGLONG ullSourceStamp)
+    {
+        if (cbImage < sizeof(CONFIG_SNAPSHOT_HEADER))
+        {
+            return false;
+        }
+        const CONFIG_SNAPSHOT_HEADER *pHeader = reinterpret_cast<const CONFIG_SNAPSHOT_HEADER *>(pbImage);
+        if (pHeader->dwMagic != c_dwSnapshotMagic ||
+            pHeader->wVersion != c_wSnapshotVersion ||
+            pHeader->cbFile != cbImage ||
+            pHeader->ullSourceStamp != ullSourceStamp ||
+            sizeof(*pHeader) + pHeader->cSections * sizeof(CONFIG_SECTION) > cbImage)
+        {
+            return false;
+        }
+
+        const CONFIG_SECTION *rgSections = reinterpret_cast<const CONFIG_SECTION *>(pHeader + 1);
+        for (WORD i = 0; i < pHeader->cSections; i++)
+        {
+            const CONFIG_SECTION &section = rgSections[i];
+            if ((section.ibData & 7) != 0 || section.ibData > cbImage || section.cbData > cbImage - section.ibData)
+            {
+                return false;
+            }
+            if ((section.dwId == CSID_SETTINGS && section.cbData < sizeof(CONFIG_SETTINGS)) ||
+                (section.dwId == CSID_FILTER_RULES && section.cbData != section.cItems * sizeof(CONFIG_FILTER_RULE)) ||
+                (section.dwId == CSID_OTP_SERVERS && section.cbData != section.cItems * sizeof(CONFIG_OTP_SERVER)))
+            {
+                return false;
+            }
+        }
+        return pHeader->dwChecksum == SnapshotChecksum(pbImage + sizeof(*pHeader), cbImage - sizeof(*pHeader));
+    }
+
+    HRESULT MapSnapshotFile(ULONGLONG ullSourceStamp, _Outptr_result_bytebuffer_(*pcbImage) const BYTE **ppbImage, _Out_ DWORD *pcbImage)
+    {
+        // config.bin decides what the filter hides, so a file planted by a user is never read.
+        HRESULT hr = MapTrustedFile(c_szSnapshotFile, c_cbMaxSnapshot, ppbImage, pcbImage);
+        if (SUCCEEDED(hr) && !IsValidSnapshot(*ppbImage, *pcbImage, ullSourceStamp))
+        {
+            UnmapViewOfFile(*ppbImage);
+            *ppbImage = nullptr;
+            *pcbImage = 0;
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+        return hr;
+    }
+
+    void ArmConfigWatch()
+    {
+        LONG lResult = RegNotifyChangeKeyValue(s_hkWatch, TRUE, REG_NOTIFY_CHANGE_NAME | REG_NOTIFY_CHANGE_LAST_SET | REG_NOTIFY_THREAD_AGNOSTIC, s_hWatchEvent, TRUE);
+        if (lResult != ERROR_SUCCESS)
+        {
+            wchar_t buffer[96] = {};
+            if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[CONFIG] RegNotifyChangeKeyValue failed: %d", lResult)))
+            {
+                WriteLogMessage(buffer);
+            }
+        }
+    }
+
+    VOID CALLBACK OnConfigKeyChanged(PVOID, BOOLEAN)
+    {
+        // Re-arm first so a change made while we reload is not missed.
+        ArmConfigWatch();
+        ReloadConfigSnapshot();
+        SignalProviderEvent(PE_CONFIG_CHANGED);
+    }
+
+    // The registry wait outlives any one provider, so the module is pinned once it is
+    // registered: the callback can then never run after we are unloaded.
+    void StartConfigWatch()
+    {
+        HMODULE hmodSelf;
+        if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, c_szConfigKey, 0, KEY_NOTIFY, &s_hkWatch) != ERROR_SUCCESS)
+        {
+            WriteLogMessage(L"[CONFIG] configuration key not found; changes need a restart to apply");
+            s_hkWatch = nullptr;
+        }
+        else if ((s_hWatchEvent = CreateEventW(nullptr, FALSE, FALSE, nullptr)) == nullptr ||
+                 !GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_PIN,
+                                     reinterpret_cast<LPCWSTR>(&OnConfigKeyChanged), &hmodSelf))
+        {
+            WriteLogMessage(L"[CONFIG] unable to start configuration watch");
+        }
+        else
+        {
+            ArmConfigWatch();
+            if (!RegisterWaitForSingleObject(&s_hWatchWait, s_hWatchEvent, OnConfigKeyChanged, nullptr, INFINITE, WT_EXECUTEDEFAULT))
+            {
+                WriteLogMessage(L"[CONFIG] unable to register configuration watch");
+            }
+        }
+    }
+
+    BOOL CALLBACK LoadInitialSnapshot(PINIT_ONCE, PVOID, PVOID *)
+    {
+        ReloadConfigSnapshot();
+        StartConfigWatch();
+        return TRUE;
+    }
+}
+
+CConfigSnapshot::CConfigSnapshot(LONG lGeneration, _In_ const BYTE *pbImage, bool fMapped) :
+    _cRef(1),
+    _lGeneration(lGeneration),
+    _pbImage(pbImage),
+    _fMapped(fMapped),
+    _pSettings(nullptr),
+    _rgFilterRules(nullptr),
+    _cFilterRules(0),
+    _rgOtpServers(nullptr),
+    _cOtpServers(0)
+{
+    // The image has been validated, so section offsets and sizes can be used as they are.
+    const CONFIG_SNAPSHOT_HEADER *pHeader = reinterpret_cast<const CONFIG_SNAPSHOT_HEADER *>(pbImage);
+    const CONFIG_SECTION *rgSections = reinterpret_cast<const CONFIG_SECTION *>(pHeader + 1);
+    for (WORD i = 0; i < pHeader->cSections; i++)
+    {
+        switch (rgSections[i].dwId)
+        {
+        case CSID_SETTINGS:
+            _pSettings = reinterpret_cast<const CONFIG_SETTINGS *>(pbImage + rgSections[i].ibData);
+            break;
+        case CSID_FILTER_RULES:
+            _rgFilterRules = reinterpret_cast<const CONFIG_FILTER_RULE *>(pbImage + rgSections[i].ibData);
+            _cFilterRules = rgSections[i].cItems;
+            break;
+        case CSID_OTP_SERVERS:
+            _rgOtpServers = reinterpret_cast<const CONFIG_OTP_SERVER *>(pbImage + rgSections[i].ibData);
+            _cOtpServers = rgSections[i].cItems;
+            break;
+        }
+    }
+}
+
+CConfigSnapshot::~CConfigSnapshot()
+{
+    if (_fMapped)
+    {
+        UnmapViewOfFile(_pbImage);
+    }
+    else
+    {
+        CoTaskMemFree(const_cast<BYTE *>(_pbImage));
+    }
+}
+
+ULONG CConfigSnapshot::AddRef()
+{
+    return InterlockedIncrement(&_cRef);
+}
+
+ULONG CConfigSnapshot::Release()
+{
+    long cRef = InterlockedDecrement(&_cRef);
+    if (!cRef)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+DWORD CConfigSnapshot::FilterExclusiveSlots(DWORD dwDefault) const
+{
+    return (_pSettings != nullptr && (_pSettings->dwPresent & CSP_FILTER_EXCLUSIVE_SLOTS)) ? _pSettings->dwFilterExclusiveSlots : dwDefault;
+}
+
+const CONFIG_FILTER_RULE *CConfigSnapshot::FilterRules(_Out_ DWORD *pcRules) const
+{
+    *pcRules = _cFilterRules;
+    return _rgFilterRules;
+}
+
+DWORD CConfigSnapshot::OtpTimeout(DWORD dwDefault) const
+{
+    return (_pSettings != nullptr && (_pSettings->dwPresent & CSP_OTP_TIMEOUT)) ? _pSettings->dwOtpTimeoutMs : dwDefault;
+}
+
+DWORD CConfigSnapshot::OtpHedgePercentile(DWORD dwDefault) const
+{
+    return (_pSettings != nullptr && (_pSettings->dwPresent & CSP_OTP_HEDGE_PERCENTILE)) ? _pSettings->dwOtpHedgePercentile : dwDefault;
+}
+
+DWORD CConfigSnapshot::OtpChannels(DWORD dwDefault) const
+{
+    return (_pSettings != nullptr && (_pSettings->dwPresent & CSP_OTP_CHANNELS)) ? _pSettings->dwOtpChannels : dwDefault;
+}
+
+const CONFIG_OTP_SERVER *CConfigSnapshot::OtpServers(_Out_ DWORD *pcServers) const
+{
+    *pcServers = _cOtpServers;
+    return _rgOtpServers;
+}
+
+HRESULT CConfigSnapshot::Load(LONG lGeneration, _Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    *ppSnapshot = nullptr;
+
+    ULONGLONG ullSourceStamp = ReadSourceStamp();
+    const BYTE *pbImage;
+    DWORD cbImage;
+    bool fMapped = true;
+    HRESULT hr = MapSnapshotFile(ullSourceStamp, &pbImage, &cbImage);
+    if (FAILED(hr))
+    {
+        BYTE *pbCompiled;
+        hr = CompileSnapshot(ullSourceStamp, &pbCompiled, &cbImage);
+        if (SUCCEEDED(hr))
+        {
+            // Processes that cannot write the file (CredUI in a user session) keep the
+            // compiled image in memory.
+            if (SUCCEEDED(ReplaceFileContents(c_szSnapshotFile, pbCompiled, cbImage)) && SUCCEEDED(MapSnapshotFile(ullSourceStamp, &pbImage, &cbImage)))
+            {
+                CoTaskMemFree(pbCompiled);
+            }
+            else
+            {
+                pbImage = pbCompiled;
+                fMapped = false;
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *ppSnapshot = new (std::nothrow) CConfigSnapshot(lGeneration, pbImage, fMapped);
+        if (*ppSnapshot == nullptr)
+        {
+            if (fMapped)
+            {
+                UnmapViewOfFile(pbImage);
+            }
+            else
+            {
+                CoTaskMemFree(const_cast<BYTE *>(pbImage));
+            }
+            hr = E_OUTOFMEMORY;
+        }
+    }
+    return hr;
+}
+
+HRESULT GetConfigSnapshot(_Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    InitOnceExecuteOnce(&s_initSnapshot, LoadInitialSnapshot, nullptr, nullptr);
+
+    AcquireSRWLockShared(&s_srwSnapshot);
+    *ppSnapshot = s_pSnapshot;
+    if (s_pSnapshot != nullptr)
+    {
+        s_pSnapshot->AddRef();
+    }
+    ReleaseSRWLockShared(&s_srwSnapshot);
+    return (*ppSnapshot != nullptr) ? S_OK : E_UNEXPECTED;
+}
+
+LONG ReloadConfigSnapshot()
+{
+    AcquireSRWLockExclusive(&s_srwReload);
+    LONG lGeneration = InterlockedIncrement(&s_lGeneration);
+    CConfigSnapshot *pSnapshot;
+    DWORD cRules = 0;
+    HRESULT hr = CConfigSnapshot::Load(lGeneration, &pSnapshot);
+    if (SUCCEEDED(hr))
+    {
+        pSnapshot->FilterRules(&cRules);
+
+        AcquireSRWLockExclusive(&s_srwSnapshot);
+        CConfigSnapshot *pOld = s_pSnapshot;
+        s_pSnapshot = pSnapshot;
+        ReleaseSRWLockExclusive(&s_srwSnapshot);
+
+        if (pOld != nullptr)
+        {
+            pOld->Release();
+        }
+    }
+    ReleaseSRWLockExclusive(&s_srwReload);
+
+    wchar_t buffer[128] = {};
+    if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[CONFIG] generation %d: %u filter rule(s) hr=0x%08X", lGeneration, cRules, hr)))
+    {
+        WriteLogMessage(buffer);
+    }
+    return lGeneration;
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "helpers.h"
+
+// Compiled configuration.
+//
+// The settings under HKLM\SOFTWARE\sqcp are compiled into C:\ProgramData\sqcp\config.bin, a
+// flat file made of a header, a section table and sections already laid out the way they are
+// read. Every process that hosts us maps that file read-only, so loading config costs one
+// validation pass, not a registry walk. The file is stamped with the last-write times of its
+// source keys. The first process that finds the file stale or missing recompiles it and
+// renames the new file over the old one. If the file cannot be written, that process keeps the
+// compiled image in memory instead.
+//
+// A registry change notification recompiles the file and swaps in a new snapshot. Callers that
+// still hold the old snapshot keep its mapping until they release it.
+
+// One compiled filter rule. Rules are stored sorted by clsid in memcmp order.
+struct CONFIG_FILTER_RULE
+{
+    GUID    clsid;
+    DWORD   dwDenySlots;
+};
+
+// One SendQuick gateway, as listed in Otp\Servers, in the order configured.
+const DWORD c_cchMaxOtpServerUrl = 256;
+
+struct CONFIG_OTP_SERVER
+{
+    wchar_t szUrl[c_cchMaxOtpServerUrl];
+};
+
+struct CONFIG_SETTINGS;
+
+class CConfigSnapshot
+{
+public:
+    ULONG AddRef();
+    ULONG Release();
+
+    // Increments every time this process swaps in a new snapshot.
+    LONG Generation() const
+    {
+        return _lGeneration;
+    }
+
+    // Filter\ExclusiveSlots, or dwDefault when the value is not set.
+    DWORD FilterExclusiveSlots(DWORD dwDefault) const;
+
+    const CONFIG_FILTER_RULE *FilterRules(_Out_ DWORD *pcRules) const;
+
+    // Otp\TimeoutMs, or dwDefault when the value is not set.
+    DWORD OtpTimeout(DWORD dwDefault) const;
+
+    // Otp\HedgePercentile, or dwDefault when the value is not set.
+    DWORD OtpHedgePercentile(DWORD dwDefault) const;
+
+    // Otp\Channels (OTP_CHANNEL_* bits), or dwDefault when the value is not set.
+    DWORD OtpChannels(DWORD dwDefault) const;
+
+    const CONFIG_OTP_SERVER *OtpServers(_Out_ DWORD *pcServers) const;
+
+    // Maps config.bin if it is current, recompiling it first if not. Only used by
+    // ReloadConfigSnapshot.
+    static HRESULT Load(LONG lGeneration, _Outptr_ CConfigSnapshot **ppSnapshot);
+
+private:
+    CConfigSnapshot(LONG lGeneration, _In_ const BYTE *pbImage, bool fMapped);
+    ~CConfigSnapshot();
+
+    long                        _cRef;
+    LONG                        _lGeneration;
+    const BYTE                  *_pbImage;      // Mapped view of config.bin, or a CoTaskMem copy.
+    bool                        _fMapped;
+    const CONFIG_SETTINGS       *_pSettings;
+    const CONFIG_FILTER_RULE    *_rgFilterRules;
+    DWORD                       _cFilterRules;
+    const CONFIG_OTP_SERVER     *_rgOtpServers;
+    DWORD                       _cOtpServers;
+};
+
+// Returns a reference on the current snapshot, loading it on first use. The first call also
+// starts watching the registry for changes.
+HRESULT GetConfigSnapshot(_Outptr_ CConfigSnapshot **ppSnapshot);
+
+// Recompiles from the registry if the file is stale, swaps in the result and returns the new
+// generation. Also called from the registry change notification.
+LONG ReloadConfigSnapshot();
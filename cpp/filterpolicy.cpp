@@ -0,0 +1,257 @@
+#include "filterpolicy.h"
+#include "configsnapshot.h"
+#include "guid.h"
+
+#ifndef CPF_REMOTE_SESSION
+#define CPF_REMOTE_SESSION 0x1
+#endif
+#ifndef CPF_REMOTE_CONNECTION
+#define CPF_REMOTE_CONNECTION 0x2
+#endif
+
+namespace
+{
+    // Slot bits are (scenario index * 2) + remote.
+    enum FILTER_SCENARIO_INDEX
+    {
+        FSI_LOGON = 0,
+        FSI_UNLOCK = 1,
+        FSI_CHANGE_PASSWORD = 2,
+        FSI_CREDUI = 3,
+    };
+
+    constexpr BYTE SlotBit(FILTER_SCENARIO_INDEX fsi, bool fRemote)
+    {
+        return static_cast<BYTE>(1u << (fsi * 2 + (fRemote ? 1 : 0)));
+    }
+
+    // Matches the behavior before the policy was configurable: only our provider in CredUI and
+    // in any remote session.
+    constexpr BYTE c_bDefaultExclusiveSlots =
+        SlotBit(FSI_CREDUI, false) | SlotBit(FSI_CREDUI, true) |
+        SlotBit(FSI_LOGON, true) | SlotBit(FSI_UNLOCK, true) | SlotBit(FSI_CHANGE_PASSWORD, true);
+
+    const CONFIG_FILTER_RULE *FindFilterRule(_In_reads_(cRules) const CONFIG_FILTER_RULE *rgRules, DWORD cRules, const GUID &clsid)
+    {
+        DWORD iLow = 0;
+        DWORD iHigh = cRules;
+        while (iLow < iHigh)
+        {
+            DWORD iMid = iLow + (iHigh - iLow) / 2;
+            int iCompare = memcmp(&rgRules[iMid].clsid, &clsid, sizeof(GUID));
+            if (iCompare == 0)
+            {
+                return &rgRules[iMid];
+            }
+            if (iCompare < 0)
+            {
+                iLow = iMid + 1;
+            }
+            else
+            {
+                iHigh = iMid;
+            }
+        }
+        return nullptr;
+    }
+
+    BYTE FilterDecisionSlot(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus, DWORD dwFlags)
+    {
+        bool fRemote = (dwFlags & (CPF_REMOTE_SESSION | CPF_REMOTE_CONNECTION)) != 0;
+        switch (cpus)
+        {
+        case CPUS_LOGON: return SlotBit(FSI_LOGON, fRemote);
+        case CPUS_UNLOCK_WORKSTATION: return SlotBit(FSI_UNLOCK, fRemote);
+        case CPUS_CHANGE_PASSWORD: return SlotBit(FSI_CHANGE_PASSWORD, fRemote);
+        case CPUS_CREDUI: return SlotBit(FSI_CREDUI, fRemote);
+        default: return 0;
+        }
+    }
+
+    // pSnapshot may be null when no configuration could be loaded; the defaults apply then.
+    DWORD ApplyFilterPolicy(_In_opt_ const CConfigSnapshot *pSnapshot,
+                            BYTE bSlot,
+                            _In_reads_(cProviders) const GUID *rgclsidProviders,
+                            _Out_writes_(cProviders) BOOL *rgbAllow,
+                            DWORD cProviders)
+    {
+        DWORD cBlocked = 0;
+        DWORD cRules = 0;
+        const CONFIG_FILTER_RULE *rgRules = nullptr;
+        DWORD dwExclusiveSlots = c_bDefaultExclusiveSlots;
+        if (pSnapshot != nullptr)
+        {
+            rgRules = pSnapshot->FilterRules(&cRules);
+            dwExclusiveSlots = pSnapshot->FilterExclusiveSlots(c_bDefaultExclusiveSlots);
+        }
+        bool fExclusive = (dwExclusiveSlots & bSlot) != 0;
+        for (DWORD i = 0; i < cProviders; i++)
+        {
+            const GUID &clsid = rgclsidProviders[i];
+            BOOL fAllow = TRUE;
+
+            // Our own provider is shown exactly in the scenarios the policy covers.
+            if (IsEqualGUID(clsid, CLSID_CSample))
+            {
+                fAllow = (bSlot != 0);
+            }
+            else if (bSlot != 0)
+            {
+                if (fExclusive)
+                {
+                    fAllow = FALSE;
+                }
+                else if (cRules > 0)
+                {
+                    const CONFIG_FILTER_RULE *pRule = FindFilterRule(rgRules, cRules, clsid);
+                    fAllow = (pRule == nullptr) || (pRule->dwDenySlots & bSlot) == 0;
+                }
+            }
+
+            rgbAllow[i] = fAllow;
+            cBlocked += fAllow ? 0 : 1;
+        }
+        return cBlocked;
+    }
+
+    // Memoized FilterProviders results. The fingerprint is an FNV-1a hash over the scenario, the
+    // flags and the provider CLSIDs in the order LogonUI passed them, since rgbAllow is positional.
+    // The CLSID list itself is kept to rule out fingerprint collisions.
+    const DWORD c_cFilterCacheEntries = 8;
+
+    struct FILTER_CACHE_ENTRY
+    {
+        ULONGLONG   ullFingerprint;
+        LONG        lGeneration;
+        DWORD       cProviders;
+        DWORD       cBlocked;
+        GUID        *rgclsid;
+        BOOL        *rgbAllow;
+    };
+
+    SRWLOCK s_srwFilterCache = SRWLOCK_INIT;
+    FILTER_CACHE_ENTRY s_rgFilterCache[c_cFilterCacheEntries] = {};
+    DWORD s_iNextFilterCacheEntry = 0;
+    LONG s_cFilterCacheHits = 0;
+    LONG s_cFilterCacheMisses = 0;
+
+    ULONGLONG FnvHash(ULONGLONG ullHash, _In_reads_bytes_(cb) const void *pv, size_t cb)
+    {
+        const BYTE *pb = static_cast<const BYTE *>(pv);
+        for (size_t i = 0; i < cb; i++)
+        {
+            ullHash = (ullHash ^ pb[i]) * 0x100000001B3ull;
+        }
+        return ullHash;
+    }
+
+    ULONGLONG FilterFingerprint(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus, DWORD dwFlags, _In_reads_(cProviders) const GUID *rgclsid, DWORD cProviders)
+    {
+        ULONGLONG ullHash = 0xCBF29CE484222325ull;
+        ullHash = FnvHash(ullHash, &cpus, sizeof(cpus));
+        ullHash = FnvHash(ullHash, &dwFlags, sizeof(dwFlags));
+        return FnvHash(ullHash, rgclsid, cProviders * sizeof(*rgclsid));
+    }
+
+    bool LookupFilterCache(ULONGLONG ullFingerprint, LONG lGeneration,
+                           _In_reads_(cProviders) const GUID *rgclsid,
+                           _Out_writes_(cProviders) BOOL *rgbAllow,
+                           DWORD cProviders,
+                           _Out_ DWORD *pcBlocked)
+    {
+        bool fHit = false;
+        AcquireSRWLockShared(&s_srwFilterCache);
+        for (DWORD i = 0; i < c_cFilterCacheEntries && !fHit; i++)
+        {
+            const FILTER_CACHE_ENTRY &entry = s_rgFilterCache[i];
+            if (entry.rgbAllow != nullptr &&
+                entry.ullFingerprint == ullFingerprint &&
+                entry.lGeneration == lGeneration &&
+                entry.cProviders == cProviders &&
+                memcmp(entry.rgclsid, rgclsid, cProviders * sizeof(*rgclsid)) == 0)
+            {
+                CopyMemory(rgbAllow, entry.rgbAllow, cProviders * sizeof(*rgbAllow));
+                *pcBlocked = entry.cBlocked;
+                fHit = true;
+            }
+        }
+        ReleaseSRWLockShared(&s_srwFilterCache);
+        return fHit;
+    }
+
+    void InsertFilterCache(ULONGLONG ullFingerprint, LONG lGeneration,
+                           _In_reads_(cProviders) const GUID *rgclsid,
+                           _In_reads_(cProviders) const BOOL *rgbAllow,
+                           DWORD cProviders,
+                           DWORD cBlocked)
+    {
+        GUID *rgclsidCopy = static_cast<GUID *>(CoTaskMemAlloc(cProviders * sizeof(*rgclsidCopy)));
+        BOOL *rgbAllowCopy = static_cast<BOOL *>(CoTaskMemAlloc(cProviders * sizeof(*rgbAllowCopy)));
+        if (rgclsidCopy == nullptr || rgbAllowCopy == nullptr)
+        {
+            CoTaskMemFree(rgclsidCopy);
+            CoTaskMemFree(rgbAllowCopy);
+            return;
+        }
+        CopyMemory(rgclsidCopy, rgclsid, cProviders * sizeof(*rgclsid));
+        CopyMemory(rgbAllowCopy, rgbAllow, cProviders * sizeof(*rgbAllow));
+
+        AcquireSRWLockExclusive(&s_srwFilterCache);
+        FILTER_CACHE_ENTRY &entry = s_rgFilterCache[s_iNextFilterCacheEntry];
+        s_iNextFilterCacheEntry = (s_iNextFilterCacheEntry + 1) % c_cFilterCacheEntries;
+        GUID *rgclsidOld = entry.rgclsid;
+        BOOL *rgbAllowOld = entry.rgbAllow;
+        entry.ullFingerprint = ullFingerprint;
+        entry.lGeneration = lGeneration;
+        entry.cProviders = cProviders;
+        entry.cBlocked = cBlocked;
+        entry.rgclsid = rgclsidCopy;
+        entry.rgbAllow = rgbAllowCopy;
+        ReleaseSRWLockExclusive(&s_srwFilterCache);
+
+        CoTaskMemFree(rgclsidOld);
+        CoTaskMemFree(rgbAllowOld);
+    }
+}
+
+DWORD FilterProviders(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
+                      DWORD dwFlags,
+                      _In_reads_(cProviders) const GUID *rgclsidProviders,
+                      _Out_writes_(cProviders) BOOL *rgbAllow,
+                      DWORD cProviders)
+{
+    CConfigSnapshot *pSnapshot;
+    if (FAILED(GetConfigSnapshot(&pSnapshot)))
+    {
+        pSnapshot = nullptr;
+    }
+
+    DWORD cBlocked = 0;
+    LONG lGeneration = (pSnapshot != nullptr) ? pSnapshot->Generation() : 0;
+    ULONGLONG ullFingerprint = FilterFingerprint(cpus, dwFlags, rgclsidProviders, cProviders);
+    if (LookupFilterCache(ullFingerprint, lGeneration, rgclsidProviders, rgbAllow, cProviders, &cBlocked))
+    {
+        InterlockedIncrement(&s_cFilterCacheHits);
+    }
+    else
+    {
+        InterlockedIncrement(&s_cFilterCacheMisses);
+        cBlocked = ApplyFilterPolicy(pSnapshot, FilterDecisionSlot(cpus, dwFlags), rgclsidProviders, rgbAllow, cProviders);
+        if (cProviders > 0)
+        {
+            InsertFilterCache(ullFingerprint, lGeneration, rgclsidProviders, rgbAllow, cProviders, cBlocked);
+        }
+    }
+
+    if (pSnapshot != nullptr)
+    {
+        pSnapshot->Release();
+    }
+    return cBlocked;
+}
+
+void GetFilterCacheStats(_Out_ FILTER_CACHE_STATS *pStats)
+{
+    pStats->cHits = InterlockedCompareExchange(&s_cFilterCacheHits, 0, 0);
+    pStats->cMisses = InterlockedCompareExchange(&s_cFilterCacheMisses, 0, 0);
+}
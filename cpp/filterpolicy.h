@@ -0,0 +1,35 @@
+#pragma once
+
+#include "helpers.h"
+
+// Provider filter policy.
+//
+// Rules come from HKLM\SOFTWARE\sqcp\Filter by way of the configuration snapshot (see
+// configsnapshot.h), which holds them as a table of provider CLSIDs sorted by GUID, each
+// carrying a bitmap of the decision slots in which that provider is denied.
+// A decision slot is one (usage scenario, remote) pair, see FilterDecisionSlot. Filter() then
+// needs one slot computation per call and one table lookup per provider.
+//
+//  Filter\ExclusiveSlots   REG_DWORD   Slots in which every provider but ours is hidden.
+//  Filter\Rules\<CLSID>    REG_DWORD   Slots in which that provider is hidden. The value names
+//                                      "WindowsHello" and "SmartCard" expand to the inbox
+//                                      providers of that kind.
+
+// Fills rgbAllow for the given providers and returns the number of providers that were blocked.
+// Providers are allowed by default. LogonUI and CredUI repeat the same call every time their
+// screen comes up, so results are memoized by (cpus, dwFlags, provider list) until the
+// configuration changes.
+DWORD FilterProviders(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
+                      DWORD dwFlags,
+                      _In_reads_(cProviders) const GUID *rgclsidProviders,
+                      _Out_writes_(cProviders) BOOL *rgbAllow,
+                      DWORD cProviders);
+
+struct FILTER_CACHE_STATS
+{
+    LONG cHits;
+    LONG cMisses;
+};
+
+void GetFilterCacheStats(_Out_ FILTER_CACHE_STATS *pStats);
+
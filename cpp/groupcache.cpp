@@ -0,0 +1,321 @@
+#include "groupcache.h"
+#include <authz.h>
+#include <sddl.h>
+#include <stdlib.h>
+#include "dll.h"
+#include "mfapolicy.h"
+#include "providerevents.h"
+#include "sharedtable.h"
+#include "utils.h"
+
+namespace
+{
+    const ULONGLONG c_ullPositiveTtl = 30 * 60 * c_ullSharedTableTicksPerSecond;
+    const ULONGLONG c_ullNegativeTtl = 2 * 60 * c_ullSharedTableTicksPerSecond;
+    const DWORD c_cSharedSlots = 512;
+    const DWORD c_cLocalSlots = 64;
+    const DWORD c_cMaxPendingResolves = 16;
+
+    enum GROUP_CACHE_FLAGS
+    {
+        GCF_UNRESOLVED  = 0x1,      // Expansion failed or overflowed c_cMaxCachedGroups.
+    };
+
+    struct GROUP_CACHE_ENTRY
+    {
+        BYTE        rgbUserSid[SECURITY_MAX_SID_SIZE];
+        BYTE        cbUserSid;
+        BYTE        bFlags;         // GCF_*
+        WORD        wReserved;
+        ULONGLONG   ullRefreshAfter;
+        DWORD       cGroups;
+        DWORD       dwReserved;
+        ULONGLONG   rgullGroupHashes[c_cMaxCachedGroups];   // Sorted; only cGroups are stored.
+    };
+
+    struct RESOLVE_REQUEST
+    {
+        BYTE        rgbUserSid[SECURITY_MAX_SID_SIZE];
+        ULONGLONG   ullKey;
+        bool        fHadGroups;     // The user's groups were cached, not only a failure.
+    };
+
+    INIT_ONCE s_initTables = INIT_ONCE_STATIC_INIT;
+    CSharedTable *s_pSharedTable = nullptr;
+    CSharedTable *s_pLocalTable = nullptr;  // Used when this process cannot write the shared one.
+
+    PFN_RESOLVE_USER_GROUPS volatile s_pfnResolve = nullptr;
+
+    SRWLOCK s_srwPending = SRWLOCK_INIT;
+    ULONGLONG s_rgullPending[c_cMaxPendingResolves] = {};
+    DWORD s_cPending = 0;
+
+    volatile LONG s_lGeneration = 0;
+
+    BOOL CALLBACK OpenGroupTables(PINIT_ONCE, PVOID, PVOID *)
+    {
+        if (FAILED(CSharedTable::Open(L"groups", c_cSharedSlots, sizeof(GROUP_CACHE_ENTRY), &s_pSharedTable)))
+        {
+            s_pSharedTable = nullptr;
+        }
+        if (s_pSharedTable == nullptr || !s_pSharedTable->IsWritable())
+        {
+            if (FAILED(CSharedTable::Open(nullptr, c_cLocalSlots, sizeof(GROUP_CACHE_ENTRY), &s_pLocalTable)))
+            {
+                s_pLocalTable = nullptr;
+            }
+        }
+        return TRUE;
+    }
+
+    CSharedTable *WritableGroupTable()
+    {
+        return (s_pLocalTable != nullptr) ? s_pLocalTable : s_pSharedTable;
+    }
+
+    int __cdecl CompareGroupHash(const void *pv1, const void *pv2)
+    {
+        ULONGLONG ull1 = *static_cast<const ULONGLONG *>(pv1);
+        ULONGLONG ull2 = *static_cast<const ULONGLONG *>(pv2);
+        return (ull1 < ull2) ? -1 : (ull1 > ull2) ? 1 : 0;
+    }
+
+    HRESULT ResolveGroupsWithAuthz(_In_ PSID psidUser,
+                                   _Out_writes_to_(cMax, *pcGroups) ULONGLONG *rgullGroupHashes,
+                                   DWORD cMax,
+                                   _Out_ DWORD *pcGroups)
+    {
+        *pcGroups = 0;
+
+        AUTHZ_RESOURCE_MANAGER_HANDLE hResourceManager;
+        if (!AuthzInitializeResourceManager(AUTHZ_RM_FLAG_NO_AUDIT, nullptr, nullptr, nullptr, nullptr, &hResourceManager))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        HRESULT hr = S_OK;
+        AUTHZ_CLIENT_CONTEXT_HANDLE hContext;
+        LUID luid = {};
+        if (AuthzInitializeContextFromSid(0, psidUser, hResourceManager, nullptr, luid, nullptr, &hContext))
+        {
+            DWORD cbGroups = 0;
+            AuthzGetInformationFromContext(hContext, AuthzContextInfoGroupsSids, 0, &cbGroups, nullptr);
+            TOKEN_GROUPS *ptg = static_cast<TOKEN_GROUPS *>(CoTaskMemAlloc(cbGroups));
+            if (ptg == nullptr)
+            {
+                hr = E_OUTOFMEMORY;
+            }
+            else if (!AuthzGetInformationFromContext(hContext, AuthzContextInfoGroupsSids, cbGroups, &cbGroups, ptg))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            else if (ptg->GroupCount > cMax)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+            }
+            else
+            {
+                for (DWORD i = 0; i < ptg->GroupCount; i++)
+                {
+                    rgullGroupHashes[i] = HashSid(ptg->Groups[i].Sid);
+                }
+                *pcGroups = ptg->GroupCount;
+            }
+            CoTaskMemFree(ptg);
+            AuthzFreeContext(hContext);
+        }
+        else
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        AuthzFreeResourceManager(hResourceManager);
+        return hr;
+    }
+
+    // Reads the entry for psidUser from the shared table, then from the local one. The key is
+    // only a hash, so the SID stored in the entry has to match as well.
+    bool ReadGroupEntry(ULONGLONG ullKey, _In_ PSID psidUser, _Out_ GROUP_CACHE_ENTRY *pEntry)
+    {
+        CSharedTable *rgpTables[] = { s_pSharedTable, s_pLocalTable };
+        DWORD cbUserSid = GetLengthSid(psidUser);
+        for (DWORD i = 0; i < ARRAYSIZE(rgpTables); i++)
+        {
+            DWORD cbEntry;
+            if (rgpTables[i] != nullptr &&
+                rgpTables[i]->Read(ullKey, pEntry, sizeof(*pEntry), &cbEntry, nullptr) &&
+                cbEntry >= FIELD_OFFSET(GROUP_CACHE_ENTRY, rgullGroupHashes) &&
+                pEntry->cGroups <= c_cMaxCachedGroups &&
+                cbEntry >= FIELD_OFFSET(GROUP_CACHE_ENTRY, rgullGroupHashes) + pEntry->cGroups * sizeof(ULONGLONG) &&
+                pEntry->cbUserSid == cbUserSid &&
+                memcmp(pEntry->rgbUserSid, psidUser, cbUserSid) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Expands the groups of psidUser and stores the result, positive or negative.
+    HRESULT ResolveAndStore(ULONGLONG ullKey, _In_ PSID psidUser)
+    {
+        GROUP_CACHE_ENTRY *pEntry = static_cast<GROUP_CACHE_ENTRY *>(CoTaskMemAlloc(sizeof(GROUP_CACHE_ENTRY)));
+        if (pEntry == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+        ZeroMemory(pEntry, FIELD_OFFSET(GROUP_CACHE_ENTRY, rgullGroupHashes));
+
+        PFN_RESOLVE_USER_GROUPS pfnResolve = s_pfnResolve;
+        DWORD cGroups = 0;
+        HRESULT hr = (pfnResolve != nullptr ? pfnResolve : ResolveGroupsWithAuthz)(psidUser, pEntry->rgullGroupHashes, c_cMaxCachedGroups, &cGroups);
+
+        ULONGLONG ullNow = GetSharedTableTime();
+        ULONGLONG ullTtl = SUCCEEDED(hr) ? c_ullPositiveTtl : c_ullNegativeTtl;
+        DWORD cbUserSid = GetLengthSid(psidUser);
+        CopyMemory(pEntry->rgbUserSid, psidUser, cbUserSid);
+        pEntry->cbUserSid = static_cast<BYTE>(cbUserSid);
+        pEntry->bFlags = SUCCEEDED(hr) ? 0 : GCF_UNRESOLVED;
+        pEntry->cGroups = SUCCEEDED(hr) ? cGroups : 0;
+        pEntry->ullRefreshAfter = ullNow + ullTtl * 3 / 4;
+        qsort(pEntry->rgullGroupHashes, pEntry->cGroups, sizeof(ULONGLONG), CompareGroupHash);
+
+        CSharedTable *pTable = WritableGroupTable();
+        if (pTable != nullptr)
+        {
+            pTable->Write(ullKey, pEntry, FIELD_OFFSET(GROUP_CACHE_ENTRY, rgullGroupHashes) + pEntry->cGroups * sizeof(ULONGLONG), ullNow + ullTtl);
+        }
+        CoTaskMemFree(pEntry);
+
+        wchar_t buffer[96] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[GROUPS] expanded %u group(s) hr=0x%08X", cGroups, hr)))
+        {
+            WriteLogMessage(buffer);
+        }
+        return hr;
+    }
+
+    void RemovePendingResolve(ULONGLONG ullKey)
+    {
+        AcquireSRWLockExclusive(&s_srwPending);
+        for (DWORD i = 0; i < s_cPending; i++)
+        {
+            if (s_rgullPending[i] == ullKey)
+            {
+                s_rgullPending[i] = s_rgullPending[--s_cPending];
+                break;
+            }
+        }
+        ReleaseSRWLockExclusive(&s_srwPending);
+    }
+
+    DWORD WINAPI ResolveThreadProc(_In_ LPVOID pvParam)
+    {
+        RESOLVE_REQUEST *pRequest = static_cast<RESOLVE_REQUEST *>(pvParam);
+        HRESULT hr = ResolveAndStore(pRequest->ullKey, pRequest->rgbUserSid);
+        RemovePendingResolve(pRequest->ullKey);
+        if (SUCCEEDED(hr) && !pRequest->fHadGroups)
+        {
+            InterlockedIncrement(&s_lGeneration);
+            SignalProviderEvent(PE_CONFIG_CHANGED);
+        }
+        CoTaskMemFree(pRequest);
+        DllRelease();
+        return 0;
+    }
+
+    // Queues one expansion per user at a time; when too many are in flight the request is
+    // dropped and picked up again by a later lookup.
+    void QueueResolve(ULONGLONG ullKey, _In_ PSID psidUser, bool fHadGroups)
+    {
+        bool fQueue = false;
+        AcquireSRWLockExclusive(&s_srwPending);
+        DWORD iPending = 0;
+        while (iPending < s_cPending && s_rgullPending[iPending] != ullKey)
+        {
+            iPending++;
+        }
+        if (iPending == s_cPending && s_cPending < c_cMaxPendingResolves)
+        {
+            s_rgullPending[s_cPending++] = ullKey;
+            fQueue = true;
+        }
+        ReleaseSRWLockExclusive(&s_srwPending);
+        if (!fQueue)
+        {
+            return;
+        }
+
+        RESOLVE_REQUEST *pRequest = static_cast<RESOLVE_REQUEST *>(CoTaskMemAlloc(sizeof(RESOLVE_REQUEST)));
+        if (pRequest != nullptr)
+        {
+            CopyMemory(pRequest->rgbUserSid, psidUser, GetLengthSid(psidUser));
+            pRequest->ullKey = ullKey;
+            pRequest->fHadGroups = fHadGroups;
+            DllAddRef();
+            if (QueueUserWorkItem(ResolveThreadProc, pRequest, WT_EXECUTELONGFUNCTION))
+            {
+                return;
+            }
+            DllRelease();
+            CoTaskMemFree(pRequest);
+        }
+        RemovePendingResolve(ullKey);
+    }
+}
+
+LONG GetUserGroupGeneration()
+{
+    return s_lGeneration;
+}
+
+void SetUserGroupResolver(_In_opt_ PFN_RESOLVE_USER_GROUPS pfnResolve)
+{
+    s_pfnResolve = pfnResolve;
+}
+
+HRESULT GetUserGroupHashes(_In_ PCWSTR pszUserSid,
+                           bool fWait,
+                           _Out_writes_to_(cMax, *pcGroups) ULONGLONG *rgullGroupHashes,
+                           DWORD cMax,
+                           _Out_ DWORD *pcGroups)
+{
+    *pcGroups = 0;
+    InitOnceExecuteOnce(&s_initTables, OpenGroupTables, nullptr, nullptr);
+
+    PSID psidUser;
+    if (!ConvertStringSidToSidW(pszUserSid, &psidUser))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = S_FALSE;
+    GROUP_CACHE_ENTRY *pEntry = static_cast<GROUP_CACHE_ENTRY *>(CoTaskMemAlloc(sizeof(GROUP_CACHE_ENTRY)));
+    if (pEntry == nullptr)
+    {
+        hr = E_OUTOFMEMORY;
+    }
+    else
+    {
+        ULONGLONG ullKey = HashSid(psidUser);
+        bool fCached = ReadGroupEntry(ullKey, psidUser, pEntry);
+        if (!fCached && fWait)
+        {
+            ResolveAndStore(ullKey, psidUser);
+            fCached = ReadGroupEntry(ullKey, psidUser, pEntry);
+        }
+        else if (!fCached || pEntry->ullRefreshAfter <= GetSharedTableTime())
+        {
+            QueueResolve(ullKey, psidUser, fCached && !(pEntry->bFlags & GCF_UNRESOLVED));
+        }
+
+        if (fCached && !(pEntry->bFlags & GCF_UNRESOLVED) && pEntry->cGroups <= cMax)
+        {
+            CopyMemory(rgullGroupHashes, pEntry->rgullGroupHashes, pEntry->cGroups * sizeof(ULONGLONG));
+            *pcGroups = pEntry->cGroups;
+            hr = S_OK;
+        }
+        CoTaskMemFree(pEntry);
+    }
+    LocalFree(psidUser);
+    return hr;
+}
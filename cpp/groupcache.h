@@ -0,0 +1,38 @@
+#pragma once
+
+#include "helpers.h"
+
+// Most groups kept per user. A user in more groups than this is cached as unresolved, so a
+// truncated list can never drop the group that puts them under MFA.
+const DWORD c_cMaxCachedGroups = 480;
+
+// Expands the groups of psidUser, nested and domain-local included, into HashSid values.
+// The default resolver asks the directory through Authz; tests can install a fake.
+typedef HRESULT (*PFN_RESOLVE_USER_GROUPS)(_In_ PSID psidUser,
+                                           _Out_writes_to_(cMax, *pcGroups) ULONGLONG *rgullGroupHashes,
+                                           DWORD cMax,
+                                           _Out_ DWORD *pcGroups);
+
+// nullptr restores the default resolver.
+void SetUserGroupResolver(_In_opt_ PFN_RESOLVE_USER_GROUPS pfnResolve);
+
+// Group membership cache.
+//
+// Expanding nested groups is a directory round trip. Results are therefore cached per user SID
+// in a CSharedTable that LogonUI, CredUI and consent share: the sorted group hashes, refreshed
+// in the background once they are three quarters through their lifetime. Failed expansions are
+// cached as well, for a shorter time.
+//
+// Returns S_OK with the user's sorted group hashes when they are known. Otherwise returns
+// S_FALSE with no groups and queues an expansion on the thread pool; fWait instead expands on
+// the calling thread. Once a queued expansion finds the groups of a user that had none cached,
+// only a failure or nothing at all, it moves GetUserGroupGeneration on and signals
+// PE_CONFIG_CHANGED so tiles built without the groups are rebuilt.
+HRESULT GetUserGroupHashes(_In_ PCWSTR pszUserSid,
+                           bool fWait,
+                           _Out_writes_to_(cMax, *pcGroups) ULONGLONG *rgullGroupHashes,
+                           DWORD cMax,
+                           _Out_ DWORD *pcGroups);
+
+// Increments every time this process learns the groups of a user it had none cached for.
+LONG GetUserGroupGeneration();
@@ -0,0 +1,53 @@
+#include "hedgedelay.h"
+
+void AddLatencySample(_Inout_ LATENCY_RING *pRing, DWORD dwLatencyMs)
+{
+    pRing->rgdwSamples[pRing->iNext] = dwLatencyMs;
+    pRing->iNext = (pRing->iNext + 1) % c_cLatencySamples;
+    if (pRing->cSamples < c_cLatencySamples)
+    {
+        pRing->cSamples++;
+    }
+}
+
+DWORD SortLatencySamples(_In_ const LATENCY_RING *pRing, _Out_writes_(c_cLatencySamples) DWORD *rgdwSorted)
+{
+    DWORD cSamples = min(pRing->cSamples, c_cLatencySamples);
+    for (DWORD i = 0; i < cSamples; i++)
+    {
+        DWORD dwSample = pRing->rgdwSamples[i];
+        DWORD j = i;
+        for (; j > 0 && rgdwSorted[j - 1] > dwSample; j--)
+        {
+            rgdwSorted[j] = rgdwSorted[j - 1];
+        }
+        rgdwSorted[j] = dwSample;
+    }
+    return cSamples;
+}
+
+DWORD ComputeHedgeDelayMs(_In_reads_(cSamples) const DWORD *rgdwSorted, DWORD cSamples, DWORD dwPercentile)
+{
+    if (cSamples < c_cMinLatencySamples)
+    {
+        return c_dwDefaultHedgeDelayMs;
+    }
+    DWORD dwDelayMs = rgdwSorted[(cSamples - 1) * ((dwPercentile < 100) ? dwPercentile : 100) / 100];
+    return (dwDelayMs > c_dwMinHedgeDelayMs) ? dwDelayMs : c_dwMinHedgeDelayMs;
+}
+
+DWORD EstimateHedgeSavedMs(_In_reads_(cSamples) const DWORD *rgdwSorted, DWORD cSamples, DWORD dwDelayMs, DWORD dwWinMs)
+{
+    ULONGLONG ullTail = 0;
+    DWORD cTail = 0;
+    for (DWORD i = 0; i < cSamples; i++)
+    {
+        if (rgdwSorted[i] > dwDelayMs)
+        {
+            ullTail += rgdwSorted[i];
+            cTail++;
+        }
+    }
+    DWORD dwTailMs = (cTail > 0) ? static_cast<DWORD>(ullTail / cTail) : 0;
+    return (dwTailMs > dwWinMs) ? dwTailMs - dwWinMs : 0;
+}
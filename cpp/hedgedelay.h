@@ -0,0 +1,40 @@
+#pragma once
+
+#include <windows.h>
+
+// When to hedge a code verification to a second gateway.
+//
+// The round trips of recent verifications are kept in a small ring. The hedge delay is a
+// configured percentile of them, so a verification is only hedged when the primary is slower
+// than it usually is; until enough have been seen a fixed delay is used. otpclient.cpp keeps the
+// ring behind a lock and does the sending; the arithmetic here touches nothing else, so it also
+// builds outside the provider: see tests/hedgedelay_test.cpp, which replays the latency
+// distributions in tests/hedgedelay through it.
+
+const DWORD c_cLatencySamples = 64;
+const DWORD c_cMinLatencySamples = 8;
+const DWORD c_dwDefaultHedgeDelayMs = 500;
+const DWORD c_dwMinHedgeDelayMs = 20;
+
+// The last c_cLatencySamples round trips, the oldest overwritten first. Zero-initialize.
+struct LATENCY_RING
+{
+    DWORD   rgdwSamples[c_cLatencySamples];
+    DWORD   cSamples;
+    DWORD   iNext;
+};
+
+void AddLatencySample(_Inout_ LATENCY_RING *pRing, DWORD dwLatencyMs);
+
+// Copies pRing's samples into rgdwSorted, in ascending order, and returns how many there are.
+// 64 of them sort faster than a lock around the ring is taken.
+DWORD SortLatencySamples(_In_ const LATENCY_RING *pRing, _Out_writes_(c_cLatencySamples) DWORD *rgdwSorted);
+
+// How long to give the primary gateway before hedging: the dwPercentile-th percentile (0 to 100)
+// of the cSamples sorted round trips, but no less than c_dwMinHedgeDelayMs, or
+// c_dwDefaultHedgeDelayMs while fewer than c_cMinLatencySamples have been seen.
+DWORD ComputeHedgeDelayMs(_In_reads_(cSamples) const DWORD *rgdwSorted, DWORD cSamples, DWORD dwPercentile);
+
+// What a hedge that answered after dwWinMs saved: the mean of the sorted round trips slower than
+// dwDelayMs, which is what the primary would likely have taken, less dwWinMs.
+DWORD EstimateHedgeSavedMs(_In_reads_(cSamples) const DWORD *rgdwSorted, DWORD cSamples, DWORD dwDelayMs, DWORD dwWinMs);
@@ -509,6 +509,64 @@ HRESULT ProtectIfNecessaryAndCopyPassword(
     return hr;
 }
 
+//
+// Checks one packed UNICODE_STRING: Length is whole WCHARs and fits in MaximumLength, and the
+// Buffer is either 0 for an empty string or a WCHAR-aligned offset past the header whose
+// MaximumLength bytes fall inside the blob. The range is compared without adding to the offset,
+// which comes from the caller and could wrap.
+//
+static bool _IsPackedStringInRange(
+    USHORT Length,
+    USHORT MaximumLength,
+    ULONG_PTR ulOffset,
+    DWORD cbHeader,
+    DWORD cb
+    )
+{
+    if (Length > MaximumLength || (Length % sizeof(wchar_t)) != 0)
+    {
+        return false;
+    }
+    if (ulOffset == 0)
+    {
+        return Length == 0;
+    }
+    return ulOffset >= cbHeader &&
+           (ulOffset % sizeof(wchar_t)) == 0 &&
+           ulOffset <= cb &&
+           MaximumLength <= cb - ulOffset;
+}
+
+//
+// Checks whether rgb holds a KERB_INTERACTIVE_UNLOCK_LOGON packed with this process's pointer size,
+// i.e. every string Buffer is an offset whose range falls inside the blob. A blob packed by a
+// 32 bit process fails this check on a 64 bit host because its UNICODE_STRINGs are narrower.
+//
+bool IsPackedKerbInteractiveUnlockLogon(
+    _In_reads_bytes_(cb) const BYTE *rgb,
+    DWORD cb
+    )
+{
+    KERB_INTERACTIVE_UNLOCK_LOGON kiul;
+    if (cb < sizeof(kiul))
+    {
+        return false;
+    }
+
+    // The blob need not be aligned; look at a copy of the header.
+    CopyMemory(&kiul, rgb, sizeof(kiul));
+    const KERB_INTERACTIVE_LOGON &kil = kiul.Logon;
+    const UNICODE_STRING *rgus[] = { &kil.LogonDomainName, &kil.UserName, &kil.Password };
+    for (DWORD i = 0; i < ARRAYSIZE(rgus); i++)
+    {
+        if (!_IsPackedStringInRange(rgus[i]->Length, rgus[i]->MaximumLength, (ULONG_PTR)rgus[i]->Buffer, sizeof(kiul), cb))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
 //
 // Unpack a KERB_INTERACTIVE_UNLOCK_LOGON *in place*.  That is, reset the Buffers from being offsets to
 // being real pointers.  This means, of course, that passing the resultant struct across any sort of
@@ -525,9 +583,8 @@ void KerbInteractiveUnlockLogonUnpackInPlace(
 
         // Sanity check: if the range described by each (Buffer + MaximumSize) falls within the total bytecount,
         // we can be pretty confident that the Buffers are actually offsets and that this is a packed credential.
-        if (((ULONG_PTR)pkil->LogonDomainName.Buffer + pkil->LogonDomainName.MaximumLength <= cb) &&
-            ((ULONG_PTR)pkil->UserName.Buffer + pkil->UserName.MaximumLength <= cb) &&
-            ((ULONG_PTR)pkil->Password.Buffer + pkil->Password.MaximumLength <= cb))
+        // The check must not add the two, as a crafted offset would wrap.
+        if (IsPackedKerbInteractiveUnlockLogon((const BYTE *)pkiul, cb))
         {
             pkil->LogonDomainName.Buffer = pkil->LogonDomainName.Buffer
                 ? (PWSTR)((BYTE*)pkiul + (ULONG_PTR)pkil->LogonDomainName.Buffer)
@@ -544,6 +601,26 @@ void KerbInteractiveUnlockLogonUnpackInPlace(
     }
 }
 
+//
+// KERB_INTERACTIVE_UNLOCK_LOGON as a 32 bit process packs it: every Buffer is a 32 bit offset.
+//
+struct UNICODE_STRING_WOW
+{
+    USHORT Length;
+    USHORT MaximumLength;
+    ULONG Buffer;
+};
+
+struct KERB_INTERACTIVE_UNLOCK_LOGON_WOW
+{
+    ULONG MessageType;
+    UNICODE_STRING_WOW LogonDomainName;
+    UNICODE_STRING_WOW UserName;
+    UNICODE_STRING_WOW Password;
+    ULONG LogonIdLowPart;
+    LONG LogonIdHighPart;
+};
+
 //
 // Use the CredPackAuthenticationBuffer and CredUnpackAuthenticationBuffer to convert a 32 bit WOW
 // cred blob into a 64 bit native blob by unpacking it and immediately repacking it.
@@ -564,6 +641,23 @@ HRESULT KerbInteractiveUnlockLogonRepackNative(
     *prgbNative = nullptr;
     *pcbNative = 0;
 
+    // The blob comes from the caller of SetSerialization; check its offsets the same way before
+    // handing it on.
+    KERB_INTERACTIVE_UNLOCK_LOGON_WOW kiulWow;
+    if (cbWow < sizeof(kiulWow))
+    {
+        return E_INVALIDARG;
+    }
+    CopyMemory(&kiulWow, rgbWow, sizeof(kiulWow));
+    const UNICODE_STRING_WOW *rgusWow[] = { &kiulWow.LogonDomainName, &kiulWow.UserName, &kiulWow.Password };
+    for (DWORD i = 0; i < ARRAYSIZE(rgusWow); i++)
+    {
+        if (!_IsPackedStringInRange(rgusWow[i]->Length, rgusWow[i]->MaximumLength, rgusWow[i]->Buffer, sizeof(kiulWow), cbWow))
+        {
+            return E_INVALIDARG;
+        }
+    }
+
     // Unpack the 32 bit KERB structure
     CredUnPackAuthenticationBufferW(CRED_PACK_WOW_BUFFER, rgbWow, cbWow, pszDomainUsername, &cchDomainUsername, nullptr, nullptr, pszPassword, &cchPassword);
     if (ERROR_INSUFFICIENT_BUFFER == GetLastError())
@@ -580,7 +674,7 @@ HRESULT KerbInteractiveUnlockLogonRepackNative(
                 }
                 else
                 {
-                    hr = GetLastError();
+                    hr = HRESULT_FROM_WIN32(GetLastError());
                 }
             }
         }
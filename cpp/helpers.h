@@ -87,6 +87,12 @@ HRESULT KerbInteractiveUnlockLogonRepackNative(
     _Out_ DWORD *pcbNative
     );
 
+//returns true if rgb looks like a KERB_INTERACTIVE_UNLOCK_LOGON packed for this process's bitness
+bool IsPackedKerbInteractiveUnlockLogon(
+    _In_reads_bytes_(cb) const BYTE *rgb,
+    DWORD cb
+    );
+
 void KerbInteractiveUnlockLogonUnpackInPlace(
     _Inout_updates_bytes_(cb) KERB_INTERACTIVE_UNLOCK_LOGON *pkiul,
     DWORD cb
@@ -0,0 +1,195 @@
+#ifndef WIN32_NO_STATUS
+#include <ntstatus.h>
+#define WIN32_NO_STATUS
+#endif
+#include "logonstatus.h"
+#include "dll.h"
+#include "resource.h"
+
+namespace
+{
+    struct LOGON_STATUS_INFO
+    {
+        NTSTATUS ntsStatus;
+        NTSTATUS ntsSubstatus;
+        UINT     idsMessage;
+        CREDENTIAL_PROVIDER_STATUS_ICON cpsi;
+    };
+
+    // Substatus STATUS_SUCCESS rows act as the fallback for any substatus of that status.
+    constexpr LOGON_STATUS_INFO c_rgLogonStatusInfo[] =
+    {
+        { STATUS_LOGON_FAILURE,                 STATUS_SUCCESS,              IDS_LOGON_BAD_CREDENTIALS,       CPSI_ERROR   },
+        { STATUS_LOGON_FAILURE,                 STATUS_WRONG_PASSWORD,       IDS_LOGON_BAD_CREDENTIALS,       CPSI_ERROR   },
+        { STATUS_LOGON_FAILURE,                 STATUS_NO_SUCH_USER,         IDS_LOGON_BAD_CREDENTIALS,       CPSI_ERROR   },
+        { STATUS_ACCOUNT_RESTRICTION,           STATUS_SUCCESS,              IDS_LOGON_ACCOUNT_RESTRICTED,    CPSI_WARNING },
+        { STATUS_ACCOUNT_RESTRICTION,           STATUS_ACCOUNT_DISABLED,     IDS_LOGON_ACCOUNT_DISABLED,      CPSI_WARNING },
+        { STATUS_ACCOUNT_RESTRICTION,           STATUS_ACCOUNT_EXPIRED,      IDS_LOGON_ACCOUNT_EXPIRED,       CPSI_WARNING },
+        { STATUS_ACCOUNT_RESTRICTION,           STATUS_INVALID_LOGON_HOURS,  IDS_LOGON_INVALID_LOGON_HOURS,   CPSI_WARNING },
+        { STATUS_ACCOUNT_RESTRICTION,           STATUS_INVALID_WORKSTATION,  IDS_LOGON_INVALID_WORKSTATION,   CPSI_WARNING },
+        { STATUS_ACCOUNT_RESTRICTION,           STATUS_PASSWORD_EXPIRED,     IDS_LOGON_PASSWORD_EXPIRED,      CPSI_WARNING },
+        { STATUS_ACCOUNT_RESTRICTION,           STATUS_PASSWORD_MUST_CHANGE, IDS_LOGON_PASSWORD_MUST_CHANGE,  CPSI_WARNING },
+        { STATUS_ACCOUNT_DISABLED,              STATUS_SUCCESS,              IDS_LOGON_ACCOUNT_DISABLED,      CPSI_WARNING },
+        { STATUS_ACCOUNT_EXPIRED,               STATUS_SUCCESS,              IDS_LOGON_ACCOUNT_EXPIRED,       CPSI_WARNING },
+        { STATUS_ACCOUNT_LOCKED_OUT,            STATUS_SUCCESS,              IDS_LOGON_ACCOUNT_LOCKED_OUT,    CPSI_ERROR   },
+        { STATUS_PASSWORD_EXPIRED,              STATUS_SUCCESS,              IDS_LOGON_PASSWORD_EXPIRED,      CPSI_WARNING },
+        { STATUS_PASSWORD_MUST_CHANGE,          STATUS_SUCCESS,              IDS_LOGON_PASSWORD_MUST_CHANGE,  CPSI_WARNING },
+        { STATUS_INVALID_LOGON_HOURS,           STATUS_SUCCESS,              IDS_LOGON_INVALID_LOGON_HOURS,   CPSI_WARNING },
+        { STATUS_INVALID_WORKSTATION,           STATUS_SUCCESS,              IDS_LOGON_INVALID_WORKSTATION,   CPSI_WARNING },
+        { STATUS_NO_LOGON_SERVERS,              STATUS_SUCCESS,              IDS_LOGON_NO_LOGON_SERVERS,      CPSI_ERROR   },
+        { STATUS_LOGON_TYPE_NOT_GRANTED,        STATUS_SUCCESS,              IDS_LOGON_TYPE_NOT_GRANTED,      CPSI_WARNING },
+        { STATUS_TIME_DIFFERENCE_AT_DC,         STATUS_SUCCESS,              IDS_LOGON_TIME_DIFFERENCE,       CPSI_ERROR   },
+        { STATUS_TRUSTED_RELATIONSHIP_FAILURE,  STATUS_SUCCESS,              IDS_LOGON_TRUST_FAILURE,         CPSI_ERROR   },
+        { STATUS_TRUSTED_DOMAIN_FAILURE,        STATUS_SUCCESS,              IDS_LOGON_TRUST_FAILURE,         CPSI_ERROR   },
+        { STATUS_NETLOGON_NOT_STARTED,          STATUS_SUCCESS,              IDS_LOGON_NO_LOGON_SERVERS,      CPSI_ERROR   },
+        { STATUS_DOMAIN_CONTROLLER_NOT_FOUND,   STATUS_SUCCESS,              IDS_LOGON_NO_LOGON_SERVERS,      CPSI_ERROR   },
+        { STATUS_DOWNGRADE_DETECTED,            STATUS_SUCCESS,              IDS_LOGON_DOWNGRADE_DETECTED,    CPSI_ERROR   },
+        { STATUS_AUTHENTICATION_FIREWALL_FAILED, STATUS_SUCCESS,             IDS_LOGON_FIREWALL_FAILED,       CPSI_ERROR   },
+    };
+
+    // The table is indexed by a seeded multiplicative hash of (status, substatus). The seed was
+    // picked so that every row lands in its own bucket; if a new row trips the static_assert
+    // below, search for a new seed rather than adding probing.
+    constexpr DWORD c_cStatusBucketBits = 6;
+    constexpr DWORD c_cStatusBuckets = 1u << c_cStatusBucketBits;
+    constexpr DWORD c_dwStatusHashSeed = 0x1C5;
+    constexpr BYTE c_bNoStatusInfo = 0xFF;
+
+    static_assert(ARRAYSIZE(c_rgLogonStatusInfo) < c_bNoStatusInfo, "status table index must fit in a BYTE");
+
+    constexpr DWORD StatusHash(NTSTATUS ntsStatus, NTSTATUS ntsSubstatus)
+    {
+        return (((static_cast<DWORD>(ntsStatus) * 0x9E3779B1u) ^
+                 (static_cast<DWORD>(ntsSubstatus) * 0x85EBCA6Bu) ^
+                 c_dwStatusHashSeed) * 0xC2B2AE35u) >> (32 - c_cStatusBucketBits);
+    }
+
+    struct STATUS_BUCKETS
+    {
+        BYTE rgIndex[c_cStatusBuckets];
+        DWORD cCollisions;
+    };
+
+    constexpr STATUS_BUCKETS BuildStatusBuckets()
+    {
+        STATUS_BUCKETS buckets = {};
+        for (DWORD i = 0; i < c_cStatusBuckets; i++)
+        {
+            buckets.rgIndex[i] = c_bNoStatusInfo;
+        }
+        for (DWORD i = 0; i < ARRAYSIZE(c_rgLogonStatusInfo); i++)
+        {
+            DWORD dwBucket = StatusHash(c_rgLogonStatusInfo[i].ntsStatus, c_rgLogonStatusInfo[i].ntsSubstatus);
+            if (buckets.rgIndex[dwBucket] != c_bNoStatusInfo)
+            {
+                buckets.cCollisions++;
+            }
+            buckets.rgIndex[dwBucket] = static_cast<BYTE>(i);
+        }
+        return buckets;
+    }
+
+    constexpr STATUS_BUCKETS c_statusBuckets = BuildStatusBuckets();
+    static_assert(c_statusBuckets.cCollisions == 0, "logon status hash collision; pick a new c_dwStatusHashSeed");
+
+    // Localized messages, resolved once per process. LoadStringW with a zero-length buffer hands
+    // back a pointer into the read-only resource section, so nothing is copied until ReportResult.
+    struct STATUS_MESSAGE
+    {
+        PCWSTR pwz;
+        int    cch;
+    };
+
+    STATUS_MESSAGE s_rgStatusMessages[IDS_LOGON_STATUS_LAST - IDS_LOGON_STATUS_FIRST + 1] = {};
+    INIT_ONCE s_initStatusMessages = INIT_ONCE_STATIC_INIT;
+
+    BOOL CALLBACK LoadStatusMessages(PINIT_ONCE, PVOID, PVOID *)
+    {
+        for (UINT i = 0; i < ARRAYSIZE(s_rgStatusMessages); i++)
+        {
+            PCWSTR pwz = nullptr;
+            int cch = LoadStringW(HINST_THISDLL, IDS_LOGON_STATUS_FIRST + i, reinterpret_cast<PWSTR>(&pwz), 0);
+            if (cch > 0)
+            {
+                s_rgStatusMessages[i].pwz = pwz;
+                s_rgStatusMessages[i].cch = cch;
+            }
+        }
+        return TRUE;
+    }
+
+    // Resource strings are not null-terminated; hand the caller a terminated CoTaskMem copy.
+    HRESULT CopyResourceString(_In_reads_(cch) PCWSTR pwz, int cch, _Outptr_result_nullonfailure_ PWSTR *ppwsz)
+    {
+        *ppwsz = static_cast<PWSTR>(CoTaskMemAlloc((cch + 1) * sizeof(wchar_t)));
+        if (*ppwsz == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+        CopyMemory(*ppwsz, pwz, cch * sizeof(wchar_t));
+        (*ppwsz)[cch] = L'\0';
+        return S_OK;
+    }
+
+    const LOGON_STATUS_INFO *FindLogonStatusInfo(NTSTATUS ntsStatus, NTSTATUS ntsSubstatus)
+    {
+        const LOGON_STATUS_INFO *pInfo = nullptr;
+        BYTE bIndex = c_statusBuckets.rgIndex[StatusHash(ntsStatus, ntsSubstatus)];
+        if (bIndex != c_bNoStatusInfo &&
+            c_rgLogonStatusInfo[bIndex].ntsStatus == ntsStatus &&
+            c_rgLogonStatusInfo[bIndex].ntsSubstatus == ntsSubstatus)
+        {
+            pInfo = &c_rgLogonStatusInfo[bIndex];
+        }
+        return pInfo;
+    }
+}
+
+HRESULT LookupLogonStatusInfo(
+    NTSTATUS ntsStatus,
+    NTSTATUS ntsSubstatus,
+    _Outptr_result_maybenull_ PWSTR *ppwszMessage,
+    _Out_ CREDENTIAL_PROVIDER_STATUS_ICON *pcpsi
+    )
+{
+    *ppwszMessage = nullptr;
+    *pcpsi = CPSI_NONE;
+
+    // Exact (status, substatus) first, then the status-only row.
+    const LOGON_STATUS_INFO *pInfo = FindLogonStatusInfo(ntsStatus, ntsSubstatus);
+    if (pInfo == nullptr && ntsSubstatus != STATUS_SUCCESS)
+    {
+        pInfo = FindLogonStatusInfo(ntsStatus, STATUS_SUCCESS);
+    }
+    if (pInfo == nullptr)
+    {
+        return S_FALSE;
+    }
+
+    InitOnceExecuteOnce(&s_initStatusMessages, LoadStatusMessages, nullptr, nullptr);
+
+    const STATUS_MESSAGE &message = s_rgStatusMessages[pInfo->idsMessage - IDS_LOGON_STATUS_FIRST];
+    if (message.pwz == nullptr)
+    {
+        return S_FALSE;
+    }
+
+    HRESULT hr = CopyResourceString(message.pwz, message.cch, ppwszMessage);
+    if (SUCCEEDED(hr))
+    {
+        *pcpsi = pInfo->cpsi;
+    }
+    return hr;
+}
+
+HRESULT LoadStatusString(UINT ids, _Outptr_result_nullonfailure_ PWSTR *ppwszMessage)
+{
+    *ppwszMessage = nullptr;
+    PCWSTR pwz = nullptr;
+    int cch = LoadStringW(HINST_THISDLL, ids, reinterpret_cast<PWSTR>(&pwz), 0);
+    if (cch <= 0)
+    {
+        return HRESULT_FROM_WIN32(ERROR_RESOURCE_NAME_NOT_FOUND);
+    }
+    return CopyResourceString(pwz, cch, ppwszMessage);
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "helpers.h"
+
+// Maps a logon (status, substatus) pair reported to ICredentialProviderCredential::ReportResult
+// to the message and icon we show on the tile. On a match *ppwszMessage receives a
+// CoTaskMemAlloc'd copy of the localized text; otherwise S_FALSE is returned and the
+// out params are left empty.
+HRESULT LookupLogonStatusInfo(
+    NTSTATUS ntsStatus,
+    NTSTATUS ntsSubstatus,
+    _Outptr_result_maybenull_ PWSTR *ppwszMessage,
+    _Out_ CREDENTIAL_PROVIDER_STATUS_ICON *pcpsi
+    );
+
+// Returns a CoTaskMemAlloc'd copy of string resource ids, for status text the tile shows
+// outside ReportResult.
+HRESULT LoadStatusString(UINT ids, _Outptr_result_nullonfailure_ PWSTR *ppwszMessage);
@@ -0,0 +1,783 @@
+#include "mfapolicy.h"
+#include <sddl.h>
+#include <new>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "dll.h"
+#include "utils.h"
+
+struct MFA_INDEX_HEADER
+{
+    DWORD   dwMagic;
+    WORD    wVersion;
+    BYTE    bDefaultFactor;
+    BYTE    bReserved;
+    DWORD   cbFile;
+    DWORD   dwChecksum;         // FNV-1a over the whole file, this field taken as zero.
+    DWORD   cUsers;
+    DWORD   cBuckets;
+    DWORD   cSlots;
+    DWORD   cGroups;
+    DWORD   ibDisplacements;    // DWORD[cBuckets]
+    DWORD   ibSlots;            // DWORD[cSlots]: index into the user table, or c_iEmptySlot.
+    DWORD   ibUsers;            // MFA_USER_ENTRY[cUsers], sorted by SID.
+    DWORD   ibSids;             // Binary SIDs the user entries point into.
+    DWORD   cbSids;
+    DWORD   ibGroups;           // MFA_GROUP_ENTRY[cGroups], sorted by ullSidHash.
+};
+
+namespace
+{
+    const wchar_t c_szIndexFile[] = L"C:\\ProgramData\\sqcp\\mfapolicy.bin";
+
+    const DWORD c_dwIndexMagic = 0x504D5153;        // "SQMP"
+    const WORD c_wIndexVersion = 2;
+    const DWORD c_cbMaxIndex = 64 * 1024 * 1024;
+    const DWORD c_iEmptySlot = 0xFFFFFFFF;
+    const BYTE c_bNoEntry = 0xFF;
+    const DWORD c_cMaxDisplacement = 1 << 20;
+
+    struct MFA_USER_ENTRY
+    {
+        DWORD   ibSid;              // From ibSids.
+        BYTE    cbSid;
+        BYTE    bFactor;            // MFA_FACTOR
+        WORD    wReserved;
+    };
+
+    struct MFA_GROUP_ENTRY
+    {
+        ULONGLONG   ullSidHash;
+        DWORD       dwOrder;        // Line order in the source; lower wins.
+        BYTE        bFactor;
+        BYTE        rgbReserved[3];
+    };
+
+    SRWLOCK s_srwIndex = SRWLOCK_INIT;
+    CMfaPolicyIndex *s_pIndex = nullptr;
+    FILETIME s_ftIndexWrite = {};
+
+    ULONGLONG MixHash(ULONGLONG x)
+    {
+        x ^= x >> 30;
+        x *= 0xBF58476D1CE4E5B9ull;
+        x ^= x >> 27;
+        x *= 0x94D049BB133111EBull;
+        return x ^ (x >> 31);
+    }
+
+    ULONGLONG SidHash(_In_reads_bytes_(cb) const BYTE *pb, DWORD cb)
+    {
+        ULONGLONG ullHash = 0xCBF29CE484222325ull;
+        for (DWORD i = 0; i < cb; i++)
+        {
+            ullHash = (ullHash ^ pb[i]) * 0x100000001B3ull;
+        }
+        return MixHash(ullHash);
+    }
+
+    // The bucket uses the high half of the hash and the slot a remix of the whole hash with the
+    // bucket's displacement, so keys that share a bucket still spread over the slots.
+    DWORD BucketOf(ULONGLONG ullHash, DWORD cBuckets)
+    {
+        return static_cast<DWORD>((ullHash >> 32) % cBuckets);
+    }
+
+    DWORD SlotOf(ULONGLONG ullHash, DWORD dwDisplacement, DWORD cSlots)
+    {
+        return static_cast<DWORD>(MixHash(ullHash ^ (dwDisplacement * 0x9E3779B97F4A7C15ull)) % cSlots);
+    }
+
+    DWORD FnvHash(DWORD dwHash, _In_reads_bytes_(cb) const void *pv, size_t cb)
+    {
+        const BYTE *pb = static_cast<const BYTE *>(pv);
+        for (size_t i = 0; i < cb; i++)
+        {
+            dwHash = (dwHash ^ pb[i]) * 0x01000193;
+        }
+        return dwHash;
+    }
+
+    // The header is covered too: Checksum() has to change when only the default factor does,
+    // or the provider and the warm start keep factors decided under the old default.
+    DWORD IndexChecksum(_In_reads_bytes_(cb) const BYTE *pb, DWORD cb)
+    {
+        MFA_INDEX_HEADER header;
+        CopyMemory(&header, pb, sizeof(header));
+        header.dwChecksum = 0;
+        return FnvHash(FnvHash(0x811C9DC5, &header, sizeof(header)), pb + sizeof(header), cb - sizeof(header));
+    }
+
+    bool IsRangeInside(DWORD ib, ULONGLONG cb, DWORD cbFile, DWORD cbAlign)
+    {
+        return (ib % cbAlign) == 0 && ib <= cbFile && cb <= cbFile - ib;
+    }
+
+    // Bounds-checks every offset the lookups follow, so they can run without checks of their own.
+    bool IsValidIndex(_In_reads_bytes_(cb) const BYTE *pb, DWORD cb)
+    {
+        if (cb < sizeof(MFA_INDEX_HEADER))
+        {
+            return false;
+        }
+        const MFA_INDEX_HEADER *pHeader = reinterpret_cast<const MFA_INDEX_HEADER *>(pb);
+        if (pHeader->dwMagic != c_dwIndexMagic ||
+            pHeader->wVersion != c_wIndexVersion ||
+            pHeader->cbFile != cb ||
+            (pHeader->cUsers > 0 && (pHeader->cBuckets == 0 || pHeader->cSlots < pHeader->cUsers)) ||
+            !IsRangeInside(pHeader->ibDisplacements, pHeader->cBuckets * 4ull, cb, 4) ||
+            !IsRangeInside(pHeader->ibSlots, pHeader->cSlots * 4ull, cb, 4) ||
+            !IsRangeInside(pHeader->ibUsers, pHeader->cUsers * static_cast<ULONGLONG>(sizeof(MFA_USER_ENTRY)), cb, 4) ||
+            !IsRangeInside(pHeader->ibSids, pHeader->cbSids, cb, 1) ||
+            !IsRangeInside(pHeader->ibGroups, pHeader->cGroups * static_cast<ULONGLONG>(sizeof(MFA_GROUP_ENTRY)), cb, 8) ||
+            pHeader->dwChecksum != IndexChecksum(pb, cb))
+        {
+            return false;
+        }
+
+        const DWORD *rgSlots = reinterpret_cast<const DWORD *>(pb + pHeader->ibSlots);
+        for (DWORD i = 0; i < pHeader->cSlots; i++)
+        {
+            if (rgSlots[i] != c_iEmptySlot && rgSlots[i] >= pHeader->cUsers)
+            {
+                return false;
+            }
+        }
+        const MFA_USER_ENTRY *rgUsers = reinterpret_cast<const MFA_USER_ENTRY *>(pb + pHeader->ibUsers);
+        for (DWORD i = 0; i < pHeader->cUsers; i++)
+        {
+            if (rgUsers[i].ibSid > pHeader->cbSids || rgUsers[i].cbSid > pHeader->cbSids - rgUsers[i].ibSid)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    BYTE FactorFromPolicy(DWORD dwFactor)
+    {
+        return (dwFactor <= MFA_FACTOR_PUSH) ? static_cast<BYTE>(dwFactor) : static_cast<BYTE>(MFA_FACTOR_NONE);
+    }
+
+    MFA_FACTOR StrongerFactor(MFA_FACTOR mfaFactor, BYTE bFactor)
+    {
+        MFA_FACTOR mfaOther = static_cast<MFA_FACTOR>(FactorFromPolicy(bFactor));
+        return (mfaOther > mfaFactor) ? mfaOther : mfaFactor;
+    }
+
+    // Builder.
+
+    struct SOURCE_USER
+    {
+        std::vector<BYTE>   sid;
+        BYTE                bFactor;
+    };
+
+    void LogBuildError(DWORD iLine, _In_ PCWSTR pszMessage)
+    {
+        wchar_t buffer[160] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[MFAPOLICY] line %u: %s", iLine, pszMessage)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+
+    bool ParsePolicy(_In_ PCWSTR pszPolicy, _Out_ BYTE *pbFactor)
+    {
+        static const struct
+        {
+            PCWSTR      pszName;
+            MFA_FACTOR  factor;
+        }
+        c_rgPolicies[] =
+        {
+            { L"exempt",    MFA_FACTOR_NONE },
+            { L"otp",       MFA_FACTOR_OTP },
+            { L"totp",      MFA_FACTOR_TOTP },
+            { L"push",      MFA_FACTOR_PUSH },
+        };
+        for (DWORD i = 0; i < ARRAYSIZE(c_rgPolicies); i++)
+        {
+            if (_wcsicmp(pszPolicy, c_rgPolicies[i].pszName) == 0)
+            {
+                *pbFactor = static_cast<BYTE>(c_rgPolicies[i].factor);
+                return true;
+            }
+        }
+        *pbFactor = c_bNoEntry;
+        return false;
+    }
+
+    HRESULT ReadSourceFile(_In_ PCWSTR pszPath, _Out_ std::wstring *pText)
+    {
+        HANDLE hFile = CreateFileW(pszPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        HRESULT hr = S_OK;
+        LARGE_INTEGER liSize = {};
+        if (!GetFileSizeEx(hFile, &liSize) || liSize.QuadPart > c_cbMaxIndex)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+        }
+        std::vector<char> bytes;
+        if (SUCCEEDED(hr) && liSize.QuadPart > 0)
+        {
+            bytes.resize(static_cast<size_t>(liSize.QuadPart));
+            DWORD cbRead = 0;
+            if (!ReadFile(hFile, bytes.data(), static_cast<DWORD>(bytes.size()), &cbRead, nullptr) || cbRead != bytes.size())
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+        }
+        CloseHandle(hFile);
+
+        pText->clear();
+        if (SUCCEEDED(hr) && !bytes.empty())
+        {
+            size_t ibText = (bytes.size() >= 3 && memcmp(bytes.data(), "\xEF\xBB\xBF", 3) == 0) ? 3 : 0;
+            int cbText = static_cast<int>(bytes.size() - ibText);
+            int cchText = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, bytes.data() + ibText, cbText, nullptr, 0);
+            if (cchText > 0)
+            {
+                pText->resize(cchText);
+                MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, bytes.data() + ibText, cbText, &(*pText)[0], cchText);
+            }
+            else if (cbText > 0)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION);
+            }
+        }
+        return hr;
+    }
+
+    HRESULT ParseSource(_In_ const std::wstring &text,
+                        _Out_ BYTE *pbDefaultFactor,
+                        _Out_ std::vector<SOURCE_USER> *pUsers,
+                        _Out_ std::vector<MFA_GROUP_ENTRY> *pGroups)
+    {
+        *pbDefaultFactor = MFA_FACTOR_NONE;
+        pUsers->clear();
+        pGroups->clear();
+
+        HRESULT hr = S_OK;
+        DWORD iLine = 0;
+        size_t ichLine = 0;
+        while (SUCCEEDED(hr) && ichLine < text.size())
+        {
+            size_t ichEnd = text.find(L'\n', ichLine);
+            if (ichEnd == std::wstring::npos)
+            {
+                ichEnd = text.size();
+            }
+            std::wstring line = text.substr(ichLine, ichEnd - ichLine);
+            ichLine = ichEnd + 1;
+            iLine++;
+
+            size_t ichComment = line.find(L'#');
+            if (ichComment != std::wstring::npos)
+            {
+                line.resize(ichComment);
+            }
+
+            PWSTR rgpszTokens[4] = {};
+            DWORD cTokens = 0;
+            PWSTR pszContext = nullptr;
+            for (PWSTR pszToken = wcstok_s(&line[0], L" \t\r", &pszContext);
+                 pszToken != nullptr;
+                 pszToken = wcstok_s(nullptr, L" \t\r", &pszContext))
+            {
+                if (cTokens == ARRAYSIZE(rgpszTokens))
+                {
+                    break;
+                }
+                rgpszTokens[cTokens++] = pszToken;
+            }
+            if (cTokens == 0)
+            {
+                continue;
+            }
+
+            BYTE bFactor;
+            if (cTokens == 2 && _wcsicmp(rgpszTokens[0], L"default") == 0 && ParsePolicy(rgpszTokens[1], &bFactor))
+            {
+                *pbDefaultFactor = bFactor;
+            }
+            else if (cTokens == 3 && ParsePolicy(rgpszTokens[2], &bFactor) &&
+                     (_wcsicmp(rgpszTokens[0], L"user") == 0 || _wcsicmp(rgpszTokens[0], L"group") == 0))
+            {
+                PSID psid;
+                if (ConvertStringSidToSidW(rgpszTokens[1], &psid))
+                {
+                    const BYTE *pbSid = static_cast<const BYTE *>(psid);
+                    DWORD cbSid = GetLengthSid(psid);
+                    if (_wcsicmp(rgpszTokens[0], L"user") == 0)
+                    {
+                        SOURCE_USER user;
+                        user.sid.assign(pbSid, pbSid + cbSid);
+                        user.bFactor = bFactor;
+                        pUsers->push_back(user);
+                    }
+                    else
+                    {
+                        MFA_GROUP_ENTRY group = {};
+                        group.ullSidHash = SidHash(pbSid, cbSid);
+                        group.dwOrder = iLine;
+                        group.bFactor = bFactor;
+                        pGroups->push_back(group);
+                    }
+                    LocalFree(psid);
+                }
+                else
+                {
+                    LogBuildError(iLine, L"invalid SID");
+                    hr = HRESULT_FROM_WIN32(ERROR_INVALID_SID);
+                }
+            }
+            else
+            {
+                LogBuildError(iLine, L"expected 'default <policy>', 'user <SID> <policy>' or 'group <SID> <policy>'");
+                hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+            }
+        }
+        return hr;
+    }
+
+    // Hash-and-displace: buckets are placed largest first, each with the first displacement
+    // that sends all of its keys to free slots.
+    HRESULT BuildPerfectHash(_In_ const std::vector<ULONGLONG> &hashes,
+                             DWORD cBuckets,
+                             DWORD cSlots,
+                             _Out_ std::vector<DWORD> *pDisplacements,
+                             _Out_ std::vector<DWORD> *pSlots)
+    {
+        std::vector<std::vector<DWORD>> buckets(cBuckets);
+        for (DWORD i = 0; i < hashes.size(); i++)
+        {
+            buckets[BucketOf(hashes[i], cBuckets)].push_back(i);
+        }
+        std::vector<DWORD> order(cBuckets);
+        for (DWORD i = 0; i < cBuckets; i++)
+        {
+            order[i] = i;
+        }
+        std::stable_sort(order.begin(), order.end(), [&buckets](DWORD a, DWORD b) { return buckets[a].size() > buckets[b].size(); });
+
+        pDisplacements->assign(cBuckets, 0);
+        pSlots->assign(cSlots, c_iEmptySlot);
+        std::vector<DWORD> taken;
+        for (DWORD iBucket : order)
+        {
+            const std::vector<DWORD> &bucket = buckets[iBucket];
+            if (bucket.empty())
+            {
+                break;
+            }
+
+            bool fPlaced = false;
+            for (DWORD dwDisplacement = 0; !fPlaced && dwDisplacement < c_cMaxDisplacement; dwDisplacement++)
+            {
+                taken.clear();
+                fPlaced = true;
+                for (DWORD iKey : bucket)
+                {
+                    DWORD iSlot = SlotOf(hashes[iKey], dwDisplacement, cSlots);
+                    if ((*pSlots)[iSlot] != c_iEmptySlot || std::find(taken.begin(), taken.end(), iSlot) != taken.end())
+                    {
+                        fPlaced = false;
+                        break;
+                    }
+                    taken.push_back(iSlot);
+                }
+                if (fPlaced)
+                {
+                    for (size_t i = 0; i < bucket.size(); i++)
+                    {
+                        (*pSlots)[taken[i]] = bucket[i];
+                    }
+                    (*pDisplacements)[iBucket] = dwDisplacement;
+                }
+            }
+            if (!fPlaced)
+            {
+                return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+            }
+        }
+        return S_OK;
+    }
+
+    DWORD AlignUp(size_t cb, DWORD cbAlign)
+    {
+        return static_cast<DWORD>((cb + cbAlign - 1) & ~static_cast<size_t>(cbAlign - 1));
+    }
+
+    HRESULT BuildIndexImage(BYTE bDefaultFactor,
+                            _Inout_ std::vector<SOURCE_USER> *pUsers,
+                            _Inout_ std::vector<MFA_GROUP_ENTRY> *pGroups,
+                            _Out_ std::vector<BYTE> *pImage)
+    {
+        std::vector<SOURCE_USER> &users = *pUsers;
+        std::vector<MFA_GROUP_ENTRY> &groups = *pGroups;
+
+        std::sort(users.begin(), users.end(), [](const SOURCE_USER &a, const SOURCE_USER &b) { return a.sid < b.sid; });
+        for (size_t i = 1; i < users.size(); i++)
+        {
+            if (users[i].sid == users[i - 1].sid)
+            {
+                WriteLogMessage(L"[MFAPOLICY] duplicate user SID in source");
+                return HRESULT_FROM_WIN32(ERROR_DUP_NAME);
+            }
+        }
+        std::sort(groups.begin(), groups.end(), [](const MFA_GROUP_ENTRY &a, const MFA_GROUP_ENTRY &b) { return a.ullSidHash < b.ullSidHash; });
+        for (size_t i = 1; i < groups.size(); i++)
+        {
+            if (groups[i].ullSidHash == groups[i - 1].ullSidHash)
+            {
+                LogBuildError(groups[i].dwOrder, L"duplicate group SID");
+                return HRESULT_FROM_WIN32(ERROR_DUP_NAME);
+            }
+        }
+
+        DWORD cUsers = static_cast<DWORD>(users.size());
+        std::vector<ULONGLONG> hashes(cUsers);
+        size_t cbSids = 0;
+        for (DWORD i = 0; i < cUsers; i++)
+        {
+            hashes[i] = SidHash(users[i].sid.data(), static_cast<DWORD>(users[i].sid.size()));
+            cbSids += users[i].sid.size();
+        }
+
+        // Grow the slot table until every bucket finds a displacement; the first attempt at
+        // 1.25 slots per key practically always succeeds.
+        DWORD cBuckets = (cUsers > 0) ? (cUsers + 3) / 4 : 0;
+        DWORD cSlots = (cUsers > 0) ? cUsers + cUsers / 4 + 1 : 0;
+        std::vector<DWORD> displacements;
+        std::vector<DWORD> slots;
+        HRESULT hr = S_OK;
+        if (cUsers > 0)
+        {
+            for (DWORD iAttempt = 0; iAttempt < 4; iAttempt++)
+            {
+                hr = BuildPerfectHash(hashes, cBuckets, cSlots, &displacements, &slots);
+                if (SUCCEEDED(hr))
+                {
+                    break;
+                }
+                cSlots += cSlots / 2;
+            }
+        }
+        if (FAILED(hr))
+        {
+            WriteLogMessage(L"[MFAPOLICY] unable to build the perfect hash");
+            return hr;
+        }
+
+        MFA_INDEX_HEADER header = {};
+        header.dwMagic = c_dwIndexMagic;
+        header.wVersion = c_wIndexVersion;
+        header.bDefaultFactor = bDefaultFactor;
+        header.cUsers = cUsers;
+        header.cBuckets = cBuckets;
+        header.cSlots = cSlots;
+        header.cGroups = static_cast<DWORD>(groups.size());
+        header.ibDisplacements = AlignUp(sizeof(header), 8);
+        header.ibSlots = AlignUp(header.ibDisplacements + cBuckets * sizeof(DWORD), 8);
+        header.ibUsers = AlignUp(header.ibSlots + cSlots * sizeof(DWORD), 8);
+        header.ibSids = AlignUp(header.ibUsers + cUsers * sizeof(MFA_USER_ENTRY), 8);
+        header.cbSids = static_cast<DWORD>(cbSids);
+        header.ibGroups = AlignUp(header.ibSids + cbSids, 8);
+        header.cbFile = AlignUp(header.ibGroups + groups.size() * sizeof(MFA_GROUP_ENTRY), 8);
+
+        std::vector<BYTE> &image = *pImage;
+        image.assign(header.cbFile, 0);
+        if (cBuckets > 0)
+        {
+            CopyMemory(&image[header.ibDisplacements], displacements.data(), cBuckets * sizeof(DWORD));
+        }
+        if (cSlots > 0)
+        {
+            CopyMemory(&image[header.ibSlots], slots.data(), cSlots * sizeof(DWORD));
+        }
+        DWORD ibSid = 0;
+        for (DWORD i = 0; i < cUsers; i++)
+        {
+            MFA_USER_ENTRY entry = {};
+            entry.ibSid = ibSid;
+            entry.cbSid = static_cast<BYTE>(users[i].sid.size());
+            entry.bFactor = users[i].bFactor;
+            CopyMemory(&image[header.ibUsers + i * sizeof(entry)], &entry, sizeof(entry));
+            CopyMemory(&image[header.ibSids + ibSid], users[i].sid.data(), entry.cbSid);
+            ibSid += entry.cbSid;
+        }
+        if (!groups.empty())
+        {
+            CopyMemory(&image[header.ibGroups], groups.data(), groups.size() * sizeof(MFA_GROUP_ENTRY));
+        }
+        CopyMemory(image.data(), &header, sizeof(header));
+        header.dwChecksum = IndexChecksum(image.data(), header.cbFile);
+        CopyMemory(image.data(), &header, sizeof(header));
+        return S_OK;
+    }
+}
+
+ULONGLONG HashSid(_In_ PSID psid)
+{
+    return SidHash(static_cast<const BYTE *>(psid), GetLengthSid(psid));
+}
+
+CMfaPolicyIndex::CMfaPolicyIndex(_In_ const BYTE *pbView, DWORD cbView) :
+    _cRef(1),
+    _pbView(pbView),
+    _cbView(cbView),
+    _pHeader(reinterpret_cast<const MFA_INDEX_HEADER *>(pbView)),
+    _mfaStrongestGroup(MFA_FACTOR_NONE),
+    _mfaStrongest(MFA_FACTOR_NONE)
+{
+    DllAddRef();
+
+    // Worked out once here, so a decision made without the user's groups or SID costs no more
+    // than one made with them.
+    _mfaStrongestGroup = StrongerFactor(MFA_FACTOR_NONE, _pHeader->bDefaultFactor);
+    const MFA_GROUP_ENTRY *rgGroups = reinterpret_cast<const MFA_GROUP_ENTRY *>(_pbView + _pHeader->ibGroups);
+    for (DWORD i = 0; i < _pHeader->cGroups; i++)
+    {
+        _mfaStrongestGroup = StrongerFactor(_mfaStrongestGroup, rgGroups[i].bFactor);
+    }
+    _mfaStrongest = _mfaStrongestGroup;
+    const MFA_USER_ENTRY *rgUsers = reinterpret_cast<const MFA_USER_ENTRY *>(_pbView + _pHeader->ibUsers);
+    for (DWORD i = 0; i < _pHeader->cUsers; i++)
+    {
+        _mfaStrongest = StrongerFactor(_mfaStrongest, rgUsers[i].bFactor);
+    }
+}
+
+CMfaPolicyIndex::~CMfaPolicyIndex()
+{
+    UnmapViewOfFile(_pbView);
+    DllRelease();
+}
+
+ULONG CMfaPolicyIndex::AddRef()
+{
+    return InterlockedIncrement(&_cRef);
+}
+
+ULONG CMfaPolicyIndex::Release()
+{
+    long cRef = InterlockedDecrement(&_cRef);
+    if (!cRef)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+BYTE CMfaPolicyIndex::_LookupUser(_In_ PSID psidUser) const
+{
+    if (_pHeader->cUsers == 0 || !IsValidSid(psidUser))
+    {
+        return c_bNoEntry;
+    }
+
+    const BYTE *pbSid = static_cast<const BYTE *>(psidUser);
+    DWORD cbSid = GetLengthSid(psidUser);
+    ULONGLONG ullHash = HashSid(psidUser);
+    const DWORD *rgDisplacements = reinterpret_cast<const DWORD *>(_pbView + _pHeader->ibDisplacements);
+    const DWORD *rgSlots = reinterpret_cast<const DWORD *>(_pbView + _pHeader->ibSlots);
+    DWORD iUser = rgSlots[SlotOf(ullHash, rgDisplacements[BucketOf(ullHash, _pHeader->cBuckets)], _pHeader->cSlots)];
+    if (iUser == c_iEmptySlot)
+    {
+        return c_bNoEntry;
+    }
+
+    // The perfect hash only covers SIDs in the index, so the slot still has to be confirmed.
+    const MFA_USER_ENTRY &entry = reinterpret_cast<const MFA_USER_ENTRY *>(_pbView + _pHeader->ibUsers)[iUser];
+    if (entry.cbSid != cbSid || memcmp(_pbView + _pHeader->ibSids + entry.ibSid, pbSid, cbSid) != 0)
+    {
+        return c_bNoEntry;
+    }
+    return entry.bFactor;
+}
+
+BYTE CMfaPolicyIndex::_LookupGroups(_In_reads_(cGroups) const ULONGLONG *rgullGroupHashes, DWORD cGroups) const
+{
+    const MFA_GROUP_ENTRY *rgEntries = reinterpret_cast<const MFA_GROUP_ENTRY *>(_pbView + _pHeader->ibGroups);
+    const MFA_GROUP_ENTRY *pBest = nullptr;
+    for (DWORD i = 0; i < cGroups && _pHeader->cGroups > 0; i++)
+    {
+        ULONGLONG ullHash = rgullGroupHashes[i];
+        DWORD iLow = 0;
+        DWORD iHigh = _pHeader->cGroups;
+        while (iLow < iHigh)
+        {
+            DWORD iMid = iLow + (iHigh - iLow) / 2;
+            if (rgEntries[iMid].ullSidHash < ullHash)
+            {
+                iLow = iMid + 1;
+            }
+            else
+            {
+                iHigh = iMid;
+            }
+        }
+        if (iLow < _pHeader->cGroups && rgEntries[iLow].ullSidHash == ullHash &&
+            (pBest == nullptr || rgEntries[iLow].dwOrder < pBest->dwOrder))
+        {
+            pBest = &rgEntries[iLow];
+        }
+    }
+    return (pBest != nullptr) ? pBest->bFactor : c_bNoEntry;
+}
+
+MFA_FACTOR CMfaPolicyIndex::Decide(_In_ PSID psidUser, _In_reads_opt_(cGroups) const ULONGLONG *rgullGroupHashes, DWORD cGroups) const
+{
+    BYTE bFactor = _LookupUser(psidUser);
+    if (bFactor == c_bNoEntry && rgullGroupHashes == nullptr)
+    {
+        return _mfaStrongestGroup;
+    }
+    if (bFactor == c_bNoEntry)
+    {
+        bFactor = _LookupGroups(rgullGroupHashes, cGroups);
+    }
+    if (bFactor == c_bNoEntry)
+    {
+        bFactor = _pHeader->bDefaultFactor;
+    }
+    return static_cast<MFA_FACTOR>(FactorFromPolicy(bFactor));
+}
+
+MFA_FACTOR CMfaPolicyIndex::DecideForSidString(_In_ PCWSTR pszUserSid, _In_reads_opt_(cGroups) const ULONGLONG *rgullGroupHashes, DWORD cGroups) const
+{
+    PSID psidUser;
+    if (!ConvertStringSidToSidW(pszUserSid, &psidUser))
+    {
+        return _mfaStrongest;
+    }
+    MFA_FACTOR factor = Decide(psidUser, rgullGroupHashes, cGroups);
+    LocalFree(psidUser);
+    return factor;
+}
+
+MFA_FACTOR CMfaPolicyIndex::StrongestFactor() const
+{
+    return _mfaStrongest;
+}
+
+DWORD CMfaPolicyIndex::Checksum() const
+{
+    return _pHeader->dwChecksum;
+}
+
+HRESULT CMfaPolicyIndex::Load(_Outptr_ CMfaPolicyIndex **ppIndex)
+{
+    *ppIndex = nullptr;
+
+    const BYTE *pbView;
+    DWORD cbView;
+    HRESULT hr = MapTrustedFile(c_szIndexFile, c_cbMaxIndex, &pbView, &cbView);
+    if (SUCCEEDED(hr))
+    {
+        if (!IsValidIndex(pbView, cbView))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+        else
+        {
+            *ppIndex = new (std::nothrow) CMfaPolicyIndex(pbView, cbView);
+            hr = (*ppIndex != nullptr) ? S_OK : E_OUTOFMEMORY;
+        }
+        if (FAILED(hr))
+        {
+            UnmapViewOfFile(pbView);
+        }
+    }
+    return hr;
+}
+
+HRESULT GetMfaPolicyIndex(_Outptr_ CMfaPolicyIndex **ppIndex)
+{
+    *ppIndex = nullptr;
+
+    WIN32_FILE_ATTRIBUTE_DATA fad;
+    if (!GetFileAttributesExW(c_szIndexFile, GetFileExInfoStandard, &fad))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+    AcquireSRWLockExclusive(&s_srwIndex);
+    if (s_pIndex == nullptr || CompareFileTime(&fad.ftLastWriteTime, &s_ftIndexWrite) != 0)
+    {
+        // A rebuilt file that fails to load leaves the previous index in place.
+        CMfaPolicyIndex *pIndex;
+        hr = CMfaPolicyIndex::Load(&pIndex);
+        if (SUCCEEDED(hr))
+        {
+            if (s_pIndex != nullptr)
+            {
+                s_pIndex->Release();
+            }
+            s_pIndex = pIndex;
+            s_ftIndexWrite = fad.ftLastWriteTime;
+        }
+
+        wchar_t buffer[96] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[MFAPOLICY] load index hr=0x%08X", hr)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+    if (s_pIndex != nullptr)
+    {
+        s_pIndex->AddRef();
+        *ppIndex = s_pIndex;
+        hr = S_OK;
+    }
+    ReleaseSRWLockExclusive(&s_srwIndex);
+    return hr;
+}
+
+EXTERN_C void CALLBACK BuildMfaPolicyIndexW(HWND /*hwnd*/, HINSTANCE /*hinst*/, LPWSTR pszCmdLine, int /*nCmdShow*/)
+{
+    // rundll32 passes the rest of its command line; accept the path with or without quotes.
+    PWSTR pszSource = pszCmdLine;
+    while (*pszSource == L' ' || *pszSource == L'"')
+    {
+        pszSource++;
+    }
+    size_t cchSource = wcslen(pszSource);
+    while (cchSource > 0 && (pszSource[cchSource - 1] == L' ' || pszSource[cchSource - 1] == L'"'))
+    {
+        pszSource[--cchSource] = L'\0';
+    }
+
+    std::wstring text;
+    BYTE bDefaultFactor = MFA_FACTOR_NONE;
+    std::vector<SOURCE_USER> users;
+    std::vector<MFA_GROUP_ENTRY> groups;
+    std::vector<BYTE> image;
+    HRESULT hr = ReadSourceFile(pszSource, &text);
+    if (SUCCEEDED(hr))
+    {
+        hr = ParseSource(text, &bDefaultFactor, &users, &groups);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = BuildIndexImage(bDefaultFactor, &users, &groups, &image);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = ReplaceFileContents(c_szIndexFile, image.data(), static_cast<DWORD>(image.size()));
+    }
+
+    wchar_t buffer[160] = {};
+    if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[MFAPOLICY] build from %s: %u user(s), %u group(s), %u byte(s) hr=0x%08X",
+                                   pszSource, static_cast<DWORD>(users.size()), static_cast<DWORD>(groups.size()), static_cast<DWORD>(image.size()), hr)))
+    {
+        WriteLogMessage(buffer);
+    }
+}
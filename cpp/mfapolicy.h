@@ -0,0 +1,87 @@
+#pragma once
+
+#include "helpers.h"
+
+// The second factor a user is held to.
+enum MFA_FACTOR
+{
+    MFA_FACTOR_NONE     = 0,    // Exempt, or no policy covers the user.
+    MFA_FACTOR_OTP      = 1,    // One-time code sent by the server.
+    MFA_FACTOR_TOTP     = 2,    // Code from an enrolled authenticator app.
+    MFA_FACTOR_PUSH     = 3,    // Approval on a registered device.
+};
+
+struct MFA_INDEX_HEADER;
+
+// Per-user MFA policy index.
+//
+// The policy names tens of thousands of SIDs (service and break-glass exemptions, per-user
+// overrides) plus the AD groups MFA applies to. BuildMfaPolicyIndexW compiles that list into
+// C:\ProgramData\sqcp\mfapolicy.bin, which is mapped read-only:
+//
+//  - user SIDs, stored as binary SIDs sorted by value, with a hash-and-displace perfect hash in
+//    front: one bucket read, one slot read and one SID compare per lookup;
+//  - a group table keyed by the 64-bit hash of the group SID, sorted for binary search, where
+//    each group keeps its position in the source list as its precedence.
+//
+// A user's own entry wins. Otherwise the matching group that came first in the source list
+// decides, and the index default applies when nothing matches. Whatever is not known yet is
+// assumed to impose the strongest factor it could, in MFA_FACTOR order.
+class CMfaPolicyIndex
+{
+public:
+    ULONG AddRef();
+    ULONG Release();
+
+    // rgullGroupHashes holds HashSid of each group the user is a member of, or nullptr when
+    // the membership is not known; without an entry of their own, the user is then held to the
+    // strongest of the default and every group's factor.
+    MFA_FACTOR Decide(_In_ PSID psidUser, _In_reads_opt_(cGroups) const ULONGLONG *rgullGroupHashes, DWORD cGroups) const;
+
+    // Same as Decide, for the string SIDs that LogonUI hands us. A string that is not a SID gets
+    // StrongestFactor.
+    MFA_FACTOR DecideForSidString(_In_ PCWSTR pszUserSid, _In_reads_opt_(cGroups) const ULONGLONG *rgullGroupHashes, DWORD cGroups) const;
+
+    // The strongest factor any entry in the index imposes, users included: what a user whose SID
+    // is not known yet is held to.
+    MFA_FACTOR StrongestFactor() const;
+
+    // Checksum of the whole index file; it changes whenever a rebuild changes the policy.
+    DWORD Checksum() const;
+
+    // Maps and validates the index file. Only used by GetMfaPolicyIndex.
+    static HRESULT Load(_Outptr_ CMfaPolicyIndex **ppIndex);
+
+private:
+    CMfaPolicyIndex(_In_ const BYTE *pbView, DWORD cbView);
+    ~CMfaPolicyIndex();
+
+    BYTE _LookupUser(_In_ PSID psidUser) const;
+    BYTE _LookupGroups(_In_reads_(cGroups) const ULONGLONG *rgullGroupHashes, DWORD cGroups) const;
+
+    long                            _cRef;
+    const BYTE                      *_pbView;
+    DWORD                           _cbView;
+    const MFA_INDEX_HEADER          *_pHeader;
+    MFA_FACTOR                      _mfaStrongestGroup;     // Of the default and every group.
+    MFA_FACTOR                      _mfaStrongest;          // Of those and every user.
+};
+
+// 64-bit hash of a binary SID. Group entries in the index and the group membership cache are
+// both keyed by it.
+ULONGLONG HashSid(_In_ PSID psid);
+
+// Returns a reference on the current index, remapping it when the file was rebuilt since the
+// last call. Fails when no index has been deployed.
+HRESULT GetMfaPolicyIndex(_Outptr_ CMfaPolicyIndex **ppIndex);
+
+// rundll32 entry point: rundll32 SampleV2CredentialProvider.dll,BuildMfaPolicyIndex <source>
+//
+// The source is a UTF-8 text file with one entry per line; '#' starts a comment:
+//
+//  default <policy>            Applies when no other entry matches (exempt when omitted).
+//  user <SID> <policy>         Per-user entry, e.g. a break-glass account set to exempt.
+//  group <SID> <policy>        Group entry; earlier lines take precedence.
+//
+// where <policy> is one of exempt, otp, totp or push. Results go to the log.
+EXTERN_C void CALLBACK BuildMfaPolicyIndexW(HWND hwnd, HINSTANCE hinst, LPWSTR pszCmdLine, int nCmdShow);
@@ -0,0 +1,1236 @@
+#include "otpclient.h"
+#include <ctype.h>
+#include <new>
+#include <winhttp.h>
+#include "dll.h"
+#include "hedgedelay.h"
+#include "otpdelivery.h"
+#include "otpresponse.h"
+#include "providerevents.h"
+#include "serverselect.h"
+#include "utils.h"
+
+#ifndef WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL
+#define WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL 133
+#define WINHTTP_PROTOCOL_FLAG_HTTP2 0x1
+#endif
+
+namespace
+{
+    const wchar_t c_szOtpKey[] = L"SOFTWARE\\sqcp\\Otp";
+    const wchar_t c_szApiKey[] = L"ApiKey";
+    const wchar_t c_szRequestPath[] = L"/otp/request";
+    const wchar_t c_szVerifyPath[] = L"/otp/verify";
+    const wchar_t c_szStatusPath[] = L"/otp/status";
+    const wchar_t c_szCancelPath[] = L"/otp/cancel";
+    const wchar_t c_szWaitPath[] = L"/otp/wait";
+    const wchar_t c_szApprovalHold[] = L"25";          // Seconds the gateway may hold /otp/wait open.
+
+    const DWORD c_cchMaxHostName = 256;
+    const DWORD c_dwDefaultTimeoutMs = 5000;
+    const DWORD c_cMaxConnsPerServer = 4;
+    const DWORD c_cMaxConnections = 16;
+    const DWORD c_cbMaxRequest = 2048;
+    const DWORD c_cbMaxResponse = 4096;
+    const DWORD c_cMaxAttempts = 3;
+    const DWORD c_cMaxWatchedApprovals = 16;
+    const DWORD c_dwApprovalHoldMs = 25000;
+    const DWORD c_dwApprovalRetryMs = 2000;
+    const ULONGLONG c_ullTicksPerSecond = 10000000ull;
+    const ULONGLONG c_ullPrewarmInterval = 30 * c_ullTicksPerSecond;
+
+    // One connect handle per gateway URL. WinHTTP pools the sockets underneath it per session.
+    struct OTP_CONNECTION
+    {
+        wchar_t         szUrl[c_cchMaxOtpServerUrl];
+        HINTERNET       hConnect;
+        bool            fSecure;
+        wchar_t         szBasePath[c_cchMaxOtpServerUrl];
+    };
+
+    INIT_ONCE s_initSession = INIT_ONCE_STATIC_INIT;
+    HINTERNET s_hSession = nullptr;
+    wchar_t s_szHeaders[384] = {};
+
+    SRWLOCK s_srwConnections = SRWLOCK_INIT;
+    OTP_CONNECTION s_rgConnections[c_cMaxConnections] = {};
+    DWORD s_cConnections = 0;
+
+    volatile LONGLONG s_llLastPrewarm = 0;
+
+    // Recent verification round trips, which set the hedge delay.
+    SRWLOCK s_srwVerifySamples = SRWLOCK_INIT;
+    LATENCY_RING s_verifySamples = {};
+
+    volatile LONG s_cVerifies = 0;
+    volatile LONG s_cHedged = 0;
+    volatile LONG s_cHedgeWins = 0;
+    volatile LONGLONG s_llHedgeSavedMs = 0;
+
+    // A push approval the watcher is waiting on. Empty slots have no challenge ID.
+    struct OTP_WATCHED_APPROVAL
+    {
+        wchar_t     szChallengeId[c_cchMaxChallengeId];
+        ULONGLONG   ullExpires;
+        HRESULT     hr;                 // E_PENDING until the gateway answers.
+    };
+
+    SRWLOCK s_srwApprovals = SRWLOCK_INIT;
+    OTP_WATCHED_APPROVAL s_rgApprovals[c_cMaxWatchedApprovals] = {};
+    bool s_fApprovalWatcherRunning = false;
+
+    ULONGLONG CurrentTime()
+    {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        return (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    }
+
+    ULONGLONG StartQpc()
+    {
+        LARGE_INTEGER li;
+        QueryPerformanceCounter(&li);
+        return static_cast<ULONGLONG>(li.QuadPart);
+    }
+
+    DWORD ElapsedMs(ULONGLONG ullStartQpc)
+    {
+        LARGE_INTEGER liFrequency;
+        QueryPerformanceFrequency(&liFrequency);
+        return static_cast<DWORD>((StartQpc() - ullStartQpc) * 1000 / static_cast<ULONGLONG>(liFrequency.QuadPart));
+    }
+
+    void LogOtpHr(_In_z_ LPCWSTR context, HRESULT hr, ULONGLONG ullStartQpc)
+    {
+        wchar_t buffer[128] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[OTP] %s hr=0x%08X %u ms", context, hr, ElapsedMs(ullStartQpc))))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+
+    HRESULT ProbeOtpServer(_In_ PCWSTR pszUrl, _Out_ DWORD *pdwLatencyMs);
+
+    BOOL CALLBACK OpenSession(PINIT_ONCE, PVOID, PVOID *)
+    {
+        s_hSession = WinHttpOpen(L"sqcp/1.0", WINHTTP_ACCESS_TYPE_DEFAULT_PROXY, WINHTTP_NO_PROXY_NAME, WINHTTP_NO_PROXY_BYPASS, 0);
+        if (s_hSession == nullptr)
+        {
+            LogOtpHr(L"WinHttpOpen failed", HRESULT_FROM_WIN32(GetLastError()), StartQpc());
+            return TRUE;
+        }
+
+        SetOtpServerProbe(ProbeOtpServer);
+
+        DWORD dwMaxConns = c_cMaxConnsPerServer;
+        WinHttpSetOption(s_hSession, WINHTTP_OPTION_MAX_CONNS_PER_SERVER, &dwMaxConns, sizeof(dwMaxConns));
+        // HTTP/2 where the OS and gateway support it; older systems reject the option.
+        DWORD dwProtocols = WINHTTP_PROTOCOL_FLAG_HTTP2;
+        WinHttpSetOption(s_hSession, WINHTTP_OPTION_ENABLE_HTTP_PROTOCOL, &dwProtocols, sizeof(dwProtocols));
+
+        wchar_t szApiKey[256] = {};
+        DWORD cbApiKey = sizeof(szApiKey);
+        StringCchCopyW(s_szHeaders, ARRAYSIZE(s_szHeaders), L"Content-Type: application/x-www-form-urlencoded\r\n");
+        if (RegGetValueW(HKEY_LOCAL_MACHINE, c_szOtpKey, c_szApiKey, RRF_RT_REG_SZ, nullptr, szApiKey, &cbApiKey) == ERROR_SUCCESS &&
+            *szApiKey != L'\0')
+        {
+            StringCchCatW(s_szHeaders, ARRAYSIZE(s_szHeaders), L"X-Api-Key: ");
+            StringCchCatW(s_szHeaders, ARRAYSIZE(s_szHeaders), szApiKey);
+            StringCchCatW(s_szHeaders, ARRAYSIZE(s_szHeaders), L"\r\n");
+        }
+        SecureZeroMemory(szApiKey, sizeof(szApiKey));
+        return TRUE;
+    }
+
+    // Returns the connection for pszUrl, connecting on first use. Connections live as long as the
+    // process, so the returned pointer stays valid without holding the lock.
+    HRESULT GetOtpConnection(_In_ PCWSTR pszUrl, _Outptr_ const OTP_CONNECTION **ppConnection)
+    {
+        *ppConnection = nullptr;
+        InitOnceExecuteOnce(&s_initSession, OpenSession, nullptr, nullptr);
+        if (s_hSession == nullptr)
+        {
+            return HRESULT_FROM_WIN32(ERROR_WINHTTP_NOT_INITIALIZED);
+        }
+
+        AcquireSRWLockShared(&s_srwConnections);
+        for (DWORD i = 0; i < s_cConnections && *ppConnection == nullptr; i++)
+        {
+            if (wcscmp(s_rgConnections[i].szUrl, pszUrl) == 0)
+            {
+                *ppConnection = &s_rgConnections[i];
+            }
+        }
+        ReleaseSRWLockShared(&s_srwConnections);
+        if (*ppConnection != nullptr)
+        {
+            return S_OK;
+        }
+
+        wchar_t szHost[c_cchMaxHostName] = {};
+        OTP_CONNECTION connection = {};
+        URL_COMPONENTS components = { sizeof(components) };
+        components.lpszHostName = szHost;
+        components.dwHostNameLength = ARRAYSIZE(szHost);
+        components.lpszUrlPath = connection.szBasePath;
+        components.dwUrlPathLength = ARRAYSIZE(connection.szBasePath);
+        if (!WinHttpCrackUrl(pszUrl, 0, 0, &components))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        size_t cchBasePath = wcslen(connection.szBasePath);
+        while (cchBasePath > 0 && connection.szBasePath[cchBasePath - 1] == L'/')
+        {
+            connection.szBasePath[--cchBasePath] = L'\0';
+        }
+        connection.fSecure = (components.nScheme == INTERNET_SCHEME_HTTPS);
+        HRESULT hr = StringCchCopyW(connection.szUrl, ARRAYSIZE(connection.szUrl), pszUrl);
+
+        AcquireSRWLockExclusive(&s_srwConnections);
+        for (DWORD i = 0; SUCCEEDED(hr) && i < s_cConnections && *ppConnection == nullptr; i++)
+        {
+            if (wcscmp(s_rgConnections[i].szUrl, pszUrl) == 0)
+            {
+                *ppConnection = &s_rgConnections[i];
+            }
+        }
+        if (SUCCEEDED(hr) && *ppConnection == nullptr)
+        {
+            if (s_cConnections == ARRAYSIZE(s_rgConnections))
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_TOO_MANY_OPEN_FILES);
+            }
+            else if ((connection.hConnect = WinHttpConnect(s_hSession, szHost, components.nPort, 0)) == nullptr)
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            else
+            {
+                s_rgConnections[s_cConnections] = connection;
+                *ppConnection = &s_rgConnections[s_cConnections++];
+            }
+        }
+        ReleaseSRWLockExclusive(&s_srwConnections);
+        return hr;
+    }
+
+    // Lets another thread abort a request in flight. The request handle is published here while
+    // the request runs; closing it makes the blocked WinHTTP call return at once.
+    struct OTP_REQUEST_CANCEL
+    {
+        HINTERNET volatile  hRequest;
+        volatile LONG       fCancelled;
+    };
+
+    // Whoever takes the handle out closes it, so it is closed exactly once.
+    void CloseRequestHandle(_Inout_ HINTERNET volatile *phRequest)
+    {
+        HINTERNET hRequest = static_cast<HINTERNET>(InterlockedExchangePointer(phRequest, nullptr));
+        if (hRequest != nullptr)
+        {
+            WinHttpCloseHandle(hRequest);
+        }
+    }
+
+    void CancelOtpRequest(_Inout_ OTP_REQUEST_CANCEL *pCancel)
+    {
+        InterlockedExchange(&pCancel->fCancelled, TRUE);
+        CloseRequestHandle(&pCancel->hRequest);
+    }
+
+    // Sends one request on a pooled connection and reads the whole response, so the socket goes
+    // back to the pool. pszVerb "HEAD" sends no body and expects none. A request cancelled through
+    // pCancel fails with HRESULT_FROM_WIN32(ERROR_WINHTTP_OPERATION_CANCELLED). A request the
+    // gateway holds open passes how long to wait for the response in dwReceiveTimeoutMs; 0 uses
+    // Otp\TimeoutMs like every other step.
+    HRESULT SendOtpRequest(_In_ PCWSTR pszUrl,
+                           _In_ PCWSTR pszVerb,
+                           _In_ PCWSTR pszPath,
+                           _In_reads_bytes_opt_(cbBody) const char *pszBody,
+                           DWORD cbBody,
+                           _Out_writes_bytes_to_(cbResponse, *pcbResponse) char *pszResponse,
+                           DWORD cbResponse,
+                           _Out_ DWORD *pcbResponse,
+                           _Inout_opt_ OTP_REQUEST_CANCEL *pCancel,
+                           DWORD dwReceiveTimeoutMs)
+    {
+        *pcbResponse = 0;
+        const OTP_CONNECTION *pConnection;
+        HRESULT hr = GetOtpConnection(pszUrl, &pConnection);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        wchar_t szPath[2 * c_cchMaxOtpServerUrl];
+        hr = StringCchPrintfW(szPath, ARRAYSIZE(szPath), L"%s%s", pConnection->szBasePath, pszPath);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        DWORD dwTimeoutMs = c_dwDefaultTimeoutMs;
+        CConfigSnapshot *pSnapshot;
+        if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+        {
+            dwTimeoutMs = pSnapshot->OtpTimeout(c_dwDefaultTimeoutMs);
+            pSnapshot->Release();
+        }
+
+        HINTERNET hRequest = WinHttpOpenRequest(pConnection->hConnect, pszVerb, szPath, nullptr, WINHTTP_NO_REFERER, WINHTTP_DEFAULT_ACCEPT_TYPES,
+                                                pConnection->fSecure ? WINHTTP_FLAG_SECURE : 0);
+        if (hRequest == nullptr)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        OTP_REQUEST_CANCEL cancelNone = {};
+        if (pCancel == nullptr)
+        {
+            pCancel = &cancelNone;
+        }
+        InterlockedExchangePointer(&pCancel->hRequest, hRequest);
+        if (pCancel->fCancelled)
+        {
+            CloseRequestHandle(&pCancel->hRequest);
+            return HRESULT_FROM_WIN32(ERROR_WINHTTP_OPERATION_CANCELLED);
+        }
+
+        DWORD dwStatusCode = 0;
+        DWORD cbStatusCode = sizeof(dwStatusCode);
+        if (!WinHttpSetTimeouts(hRequest, dwTimeoutMs, dwTimeoutMs, dwTimeoutMs, (dwReceiveTimeoutMs != 0) ? dwReceiveTimeoutMs : dwTimeoutMs) ||
+            !WinHttpSendRequest(hRequest, s_szHeaders, static_cast<DWORD>(-1L), const_cast<char *>(pszBody), cbBody, cbBody, 0) ||
+            !WinHttpReceiveResponse(hRequest, nullptr) ||
+            !WinHttpQueryHeaders(hRequest, WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER, WINHTTP_HEADER_NAME_BY_INDEX,
+                                 &dwStatusCode, &cbStatusCode, WINHTTP_NO_HEADER_INDEX))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else if (dwStatusCode >= HTTP_STATUS_SERVER_ERROR)
+        {
+            hr = HTTP_E_STATUS_SERVER_ERROR;
+        }
+        else if (dwStatusCode != HTTP_STATUS_OK)
+        {
+            hr = HTTP_E_STATUS_UNEXPECTED;
+        }
+
+        // Read to the end even past a full buffer, or the connection cannot be reused.
+        DWORD cbRead = 0;
+        while (SUCCEEDED(hr))
+        {
+            char rgchDiscard[256];
+            char *pchInto = (cbRead < cbResponse) ? pszResponse + cbRead : rgchDiscard;
+            DWORD cbInto = (cbRead < cbResponse) ? cbResponse - cbRead : sizeof(rgchDiscard);
+            DWORD cbChunk = 0;
+            if (!WinHttpReadData(hRequest, pchInto, cbInto, &cbChunk))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+            else if (cbChunk == 0)
+            {
+                break;
+            }
+            else if (pchInto == rgchDiscard)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+            }
+            else
+            {
+                cbRead += cbChunk;
+            }
+        }
+        if (pCancel->fCancelled)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_WINHTTP_OPERATION_CANCELLED);
+        }
+        if (SUCCEEDED(hr))
+        {
+            *pcbResponse = cbRead;
+        }
+        else
+        {
+            SecureZeroMemory(pszResponse, cbResponse);
+        }
+        CloseRequestHandle(&pCancel->hRequest);
+        return hr;
+    }
+
+    // Appends name=value to a form body, UTF-8 and percent-encoded.
+    HRESULT AppendFormField(_Inout_updates_z_(cchBody) char *pszBody, size_t cchBody, _In_ PCSTR pszName, _In_ PCWSTR pszValue)
+    {
+        char szUtf8[c_cbMaxRequest / 3];
+        int cbUtf8 = WideCharToMultiByte(CP_UTF8, WC_ERR_INVALID_CHARS, pszValue, -1, szUtf8, sizeof(szUtf8), nullptr, nullptr);
+        if (cbUtf8 == 0)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        size_t cchUsed = strlen(pszBody);
+        HRESULT hr = StringCchPrintfA(pszBody + cchUsed, cchBody - cchUsed, "%s%s=", (cchUsed > 0) ? "&" : "", pszName);
+        for (int i = 0; SUCCEEDED(hr) && szUtf8[i] != '\0'; i++)
+        {
+            unsigned char ch = static_cast<unsigned char>(szUtf8[i]);
+            cchUsed = strlen(pszBody);
+            if (isalnum(ch) || ch == '-' || ch == '.' || ch == '_' || ch == '~')
+            {
+                hr = StringCchPrintfA(pszBody + cchUsed, cchBody - cchUsed, "%c", ch);
+            }
+            else
+            {
+                hr = StringCchPrintfA(pszBody + cchUsed, cchBody - cchUsed, "%%%02X", ch);
+            }
+        }
+        SecureZeroMemory(szUtf8, sizeof(szUtf8));
+        return hr;
+    }
+
+    // Parses the gateway's answer and maps its status. Refusals and unknown statuses are logged
+    // with the gateway's message, when it gave one.
+    HRESULT ReadResponse(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Out_ OTP_RESPONSE *pResponse)
+    {
+        HRESULT hr = ParseOtpResponse(pchBody, cbBody, pResponse);
+        if (SUCCEEDED(hr))
+        {
+            hr = OtpResponseStatus(pResponse);
+        }
+        if (FAILED(hr) && hr != E_PENDING && (pResponse->dwFields & ORF_MESSAGE))
+        {
+            wchar_t szMessage[c_cchMaxResponseMessage];
+            wchar_t buffer[c_cchMaxResponseMessage + 64] = {};
+            if (MultiByteToWideChar(CP_UTF8, 0, pResponse->szMessage, -1, szMessage, ARRAYSIZE(szMessage)) != 0 &&
+                SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[OTP] gateway said hr=0x%08X: %s", hr, szMessage)))
+            {
+                WriteLogMessage(buffer);
+            }
+        }
+        return hr;
+    }
+
+    // Whether the gateway itself answered. Anything else, server errors included, counts against
+    // it in the gateway selection.
+    bool IsGatewayAnswer(HRESULT hr)
+    {
+        return SUCCEEDED(hr) || hr == HTTP_E_STATUS_UNEXPECTED || hr == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+    }
+
+    // SendOtpRequest, with its outcome fed to the gateway selection. A request we cancelled says
+    // nothing about the gateway and is reported as having no result.
+    HRESULT SendAndReport(_In_ PCWSTR pszUrl,
+                          _In_ PCWSTR pszPath,
+                          _In_reads_bytes_(cbBody) const char *pszBody,
+                          DWORD cbBody,
+                          _Out_writes_bytes_to_(cbResponse, *pcbResponse) char *pszResponse,
+                          DWORD cbResponse,
+                          _Out_ DWORD *pcbResponse,
+                          _Inout_opt_ OTP_REQUEST_CANCEL *pCancel)
+    {
+        ULONGLONG ullStart = StartQpc();
+        HRESULT hr = SendOtpRequest(pszUrl, L"POST", pszPath, pszBody, cbBody, pszResponse, cbResponse, pcbResponse, pCancel, 0);
+        if (hr != HRESULT_FROM_WIN32(ERROR_WINHTTP_OPERATION_CANCELLED))
+        {
+            ReportOtpServerResult(pszUrl, IsGatewayAnswer(hr), ElapsedMs(ullStart));
+        }
+        else
+        {
+            ReportOtpServerNoResult(pszUrl);
+        }
+        return hr;
+    }
+
+    // The prober's check: any answer, even an error status, leaves a connected socket in the pool.
+    HRESULT ProbeOtpServer(_In_ PCWSTR pszUrl, _Out_ DWORD *pdwLatencyMs)
+    {
+        ULONGLONG ullStart = StartQpc();
+        char szResponse[64];
+        DWORD cbResponse;
+        HRESULT hr = SendOtpRequest(pszUrl, L"HEAD", L"/", nullptr, 0, szResponse, sizeof(szResponse), &cbResponse, nullptr, 0);
+        *pdwLatencyMs = ElapsedMs(ullStart);
+        return IsGatewayAnswer(hr) ? S_OK : hr;
+    }
+
+    void RecordVerifySample(DWORD dwLatencyMs)
+    {
+        AcquireSRWLockExclusive(&s_srwVerifySamples);
+        AddLatencySample(&s_verifySamples, dwLatencyMs);
+        ReleaseSRWLockExclusive(&s_srwVerifySamples);
+    }
+
+    // Copies the recent samples out, sorted.
+    DWORD SortedVerifySamples(_Out_writes_(c_cLatencySamples) DWORD *rgdwSamples)
+    {
+        AcquireSRWLockShared(&s_srwVerifySamples);
+        LATENCY_RING ring = s_verifySamples;
+        ReleaseSRWLockShared(&s_srwVerifySamples);
+        return SortLatencySamples(&ring, rgdwSamples);
+    }
+
+    // A verification sent to one gateway on the thread pool.
+    struct OTP_VERIFY_LEG
+    {
+        wchar_t             szUrl[c_cchMaxOtpServerUrl];
+        OTP_REQUEST_CANCEL  cancel;
+        HANDLE              hDone;
+        HRESULT             hr;
+        struct OTP_HEDGE    *pHedge;
+    };
+
+    // The shared state of a hedged verification. The caller and every running leg hold a
+    // reference, so a leg left running after the caller has its answer still has somewhere to
+    // write.
+    struct OTP_HEDGE
+    {
+        volatile long   cRef;
+        char            szBody[c_cbMaxRequest];
+        DWORD           cbBody;
+        OTP_VERIFY_LEG  rgLegs[2];
+    };
+
+    void ReleaseHedge(_In_ OTP_HEDGE *pHedge)
+    {
+        if (InterlockedDecrement(&pHedge->cRef) == 0)
+        {
+            for (DWORD i = 0; i < ARRAYSIZE(pHedge->rgLegs); i++)
+            {
+                if (pHedge->rgLegs[i].hDone != nullptr)
+                {
+                    CloseHandle(pHedge->rgLegs[i].hDone);
+                }
+            }
+            SecureZeroMemory(pHedge->szBody, sizeof(pHedge->szBody));
+            delete pHedge;
+        }
+    }
+
+    // Posts the verification to pszUrl and maps the answer.
+    HRESULT SendVerify(_In_ PCWSTR pszUrl, _In_reads_bytes_(cbBody) const char *pszBody, DWORD cbBody, _Inout_opt_ OTP_REQUEST_CANCEL *pCancel)
+    {
+        char szResponse[c_cbMaxResponse];
+        DWORD cbResponse = 0;
+        HRESULT hr = SendAndReport(pszUrl, c_szVerifyPath, pszBody, cbBody, szResponse, sizeof(szResponse), &cbResponse, pCancel);
+        if (SUCCEEDED(hr))
+        {
+            OTP_RESPONSE response;
+            hr = ReadResponse(szResponse, cbResponse, &response);
+            SecureZeroMemory(&response, sizeof(response));
+        }
+        SecureZeroMemory(szResponse, sizeof(szResponse));
+        return hr;
+    }
+
+    DWORD WINAPI VerifyLegThreadProc(_In_ LPVOID lpParameter)
+    {
+        OTP_VERIFY_LEG *pLeg = static_cast<OTP_VERIFY_LEG *>(lpParameter);
+        OTP_HEDGE *pHedge = pLeg->pHedge;
+        pLeg->hr = SendVerify(pLeg->szUrl, pHedge->szBody, pHedge->cbBody, &pLeg->cancel);
+        SetEvent(pLeg->hDone);
+        ReleaseHedge(pHedge);
+        DllRelease();
+        return 0;
+    }
+
+    HRESULT StartVerifyLeg(_In_ OTP_HEDGE *pHedge, DWORD iLeg, _In_ PCWSTR pszUrl)
+    {
+        OTP_VERIFY_LEG *pLeg = &pHedge->rgLegs[iLeg];
+        pLeg->pHedge = pHedge;
+        pLeg->hr = E_PENDING;
+        HRESULT hr = StringCchCopyW(pLeg->szUrl, ARRAYSIZE(pLeg->szUrl), pszUrl);
+        if (SUCCEEDED(hr))
+        {
+            pLeg->hDone = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+            hr = (pLeg->hDone != nullptr) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+        }
+        if (SUCCEEDED(hr))
+        {
+            InterlockedIncrement(&pHedge->cRef);
+            DllAddRef();
+            if (!QueueUserWorkItem(VerifyLegThreadProc, pLeg, WT_EXECUTELONGFUNCTION))
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+                DllRelease();
+                InterlockedDecrement(&pHedge->cRef);
+            }
+        }
+        return hr;
+    }
+
+    // An answer that settles the verification no matter what the other gateway says.
+    bool IsVerifyAnswer(HRESULT hr)
+    {
+        return hr == S_OK || hr == E_ACCESSDENIED || hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+
+    // Verifies on pszPrimaryUrl and, when it has not answered within the hedge delay (or has
+    // failed outright), sends the same verification to the next best gateway. An acceptance from
+    // either ends it at once. A denial waits for the other leg, since the code may have been
+    // accepted, and so consumed, there first.
+    HRESULT VerifyHedged(_In_ PCWSTR pszPrimaryUrl, _In_reads_bytes_(cbBody) const char *pszBody, DWORD cbBody, DWORD dwPercentile, DWORD dwTimeoutMs)
+    {
+        OTP_HEDGE *pHedge = new (std::nothrow) OTP_HEDGE();
+        if (pHedge == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+        pHedge->cRef = 1;
+        CopyMemory(pHedge->szBody, pszBody, cbBody);
+        pHedge->cbBody = cbBody;
+
+        ULONGLONG ullStart = StartQpc();
+        DWORD rgdwSamples[c_cLatencySamples];
+        DWORD cSamples = SortedVerifySamples(rgdwSamples);
+        DWORD dwDelayMs = ComputeHedgeDelayMs(rgdwSamples, cSamples, dwPercentile);
+        DWORD dwBudgetMs = 4 * dwTimeoutMs;
+        DWORD cLegs = 0;
+        HRESULT hr = StartVerifyLeg(pHedge, 0, pszPrimaryUrl);
+        if (SUCCEEDED(hr))
+        {
+            cLegs = 1;
+        }
+
+        DWORD iWinner = 0;
+        while (SUCCEEDED(hr))
+        {
+            // Look at what has come back so far.
+            HANDLE rghPending[ARRAYSIZE(pHedge->rgLegs)];
+            DWORD cPending = 0;
+            bool fAccepted = false;
+            for (DWORD i = 0; i < cLegs; i++)
+            {
+                if (WaitForSingleObject(pHedge->rgLegs[i].hDone, 0) != WAIT_OBJECT_0)
+                {
+                    rghPending[cPending++] = pHedge->rgLegs[i].hDone;
+                }
+                else if (pHedge->rgLegs[i].hr == S_OK)
+                {
+                    iWinner = i;
+                    fAccepted = true;
+                }
+            }
+            if (fAccepted)
+            {
+                break;
+            }
+
+            DWORD dwElapsedMs = ElapsedMs(ullStart);
+            bool fHedgeNow = (cLegs == 1) && ((cPending == 0) ? !IsVerifyAnswer(pHedge->rgLegs[0].hr) : dwElapsedMs >= dwDelayMs);
+            if (fHedgeNow)
+            {
+                PCWSTR rgpszExclude[] = { pszPrimaryUrl };
+                wchar_t szUrl[c_cchMaxOtpServerUrl];
+                if (SUCCEEDED(SelectOtpServer(rgpszExclude, ARRAYSIZE(rgpszExclude), szUrl, ARRAYSIZE(szUrl))))
+                {
+                    if (SUCCEEDED(StartVerifyLeg(pHedge, 1, szUrl)))
+                    {
+                        cLegs = 2;
+                        InterlockedIncrement(&s_cHedged);
+                        continue;
+                    }
+                    ReportOtpServerNoResult(szUrl);
+                }
+                dwDelayMs = INFINITE;
+            }
+
+            if (cPending == 0)
+            {
+                // Every leg has finished without an acceptance: prefer a gateway's answer.
+                iWinner = (cLegs > 1 && !IsVerifyAnswer(pHedge->rgLegs[0].hr) && IsVerifyAnswer(pHedge->rgLegs[1].hr)) ? 1 : 0;
+                break;
+            }
+            if (dwElapsedMs >= dwBudgetMs)
+            {
+                hr = HRESULT_FROM_WIN32(ERROR_WINHTTP_TIMEOUT);
+                break;
+            }
+            DWORD dwWaitMs = dwBudgetMs - dwElapsedMs;
+            if (cLegs == 1 && dwDelayMs != INFINITE && dwDelayMs - dwElapsedMs < dwWaitMs)
+            {
+                dwWaitMs = dwDelayMs - dwElapsedMs;
+            }
+            WaitForMultipleObjects(cPending, rghPending, FALSE, dwWaitMs);
+        }
+
+        DWORD dwElapsedMs = ElapsedMs(ullStart);
+        if (SUCCEEDED(hr))
+        {
+            hr = pHedge->rgLegs[iWinner].hr;
+        }
+        if (cLegs > 1 && iWinner == 1 && hr == S_OK)
+        {
+            // The primary was still out; how long it had taken is a floor on its round trip.
+            RecordVerifySample(dwElapsedMs);
+            InterlockedIncrement(&s_cHedgeWins);
+            InterlockedExchangeAdd64(&s_llHedgeSavedMs, EstimateHedgeSavedMs(rgdwSamples, cSamples, dwDelayMs, dwElapsedMs));
+        }
+        else if (IsVerifyAnswer(hr))
+        {
+            RecordVerifySample(dwElapsedMs);
+        }
+        for (DWORD i = 0; i < cLegs; i++)
+        {
+            CancelOtpRequest(&pHedge->rgLegs[i].cancel);
+        }
+        ReleaseHedge(pHedge);
+
+        if (cLegs > 1)
+        {
+            wchar_t buffer[160] = {};
+            if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[OTP] hedged after %u ms, %s won; %ld of %ld verifications hedged, %ld won, %lld ms saved",
+                                           dwDelayMs, (iWinner == 1) ? L"hedge" : L"primary", s_cHedged, s_cVerifies, s_cHedgeWins, s_llHedgeSavedMs)))
+            {
+                WriteLogMessage(buffer);
+            }
+        }
+        return hr;
+    }
+
+    // Posts challenge=<id> to pszPath on the gateway that issued pChallenge and maps the answer.
+    HRESULT PostChallenge(_In_ const OTP_CHALLENGE *pChallenge, _In_ PCWSTR pszPath)
+    {
+        char szBody[c_cbMaxRequest] = {};
+        char szResponse[c_cbMaxResponse];
+        DWORD cbResponse = 0;
+        HRESULT hr = AppendFormField(szBody, ARRAYSIZE(szBody), "challenge", pChallenge->szChallengeId);
+        if (SUCCEEDED(hr))
+        {
+            hr = SendAndReport(pChallenge->szServerUrl, pszPath, szBody, static_cast<DWORD>(strlen(szBody)), szResponse, sizeof(szResponse), &cbResponse, nullptr);
+        }
+        if (SUCCEEDED(hr))
+        {
+            OTP_RESPONSE response;
+            hr = ReadResponse(szResponse, cbResponse, &response);
+            SecureZeroMemory(&response, sizeof(response));
+        }
+        SecureZeroMemory(szBody, sizeof(szBody));
+        SecureZeroMemory(szResponse, sizeof(szResponse));
+        return hr;
+    }
+
+    // The one /otp/wait in flight. Watching or unwatching an approval cancels it, and the watcher
+    // sends it again for the new set.
+    OTP_REQUEST_CANCEL s_approvalPoll = {};
+
+    // Records the gateway's answer for one watched approval. Returns whether it was watched.
+    bool SetWatchedApproval(_In_ PCWSTR pszChallengeId, HRESULT hr)
+    {
+        bool fFound = false;
+        AcquireSRWLockExclusive(&s_srwApprovals);
+        for (DWORD i = 0; i < ARRAYSIZE(s_rgApprovals) && !fFound; i++)
+        {
+            if (*s_rgApprovals[i].szChallengeId != L'\0' && wcscmp(s_rgApprovals[i].szChallengeId, pszChallengeId) == 0)
+            {
+                s_rgApprovals[i].hr = hr;
+                fFound = true;
+            }
+        }
+        ReleaseSRWLockExclusive(&s_srwApprovals);
+        return fFound;
+    }
+
+    // Long-polls for every approval still pending, all in one request, until none is left. The
+    // gateways share challenge state, so whichever one serverselect picks can answer for all of
+    // them.
+    DWORD WINAPI ApprovalWatcherThreadProc(_In_ LPVOID)
+    {
+        for (;;)
+        {
+            char szBody[c_cbMaxRequest] = {};
+            DWORD cWatched = 0;
+            ULONGLONG ullNow = CurrentTime();
+            HRESULT hr = S_OK;
+            AcquireSRWLockExclusive(&s_srwApprovals);
+            for (DWORD i = 0; i < ARRAYSIZE(s_rgApprovals) && SUCCEEDED(hr); i++)
+            {
+                if (*s_rgApprovals[i].szChallengeId != L'\0' && s_rgApprovals[i].hr == E_PENDING && ullNow < s_rgApprovals[i].ullExpires)
+                {
+                    hr = AppendFormField(szBody, ARRAYSIZE(szBody), "challenge", s_rgApprovals[i].szChallengeId);
+                    cWatched++;
+                }
+            }
+            if (cWatched == 0 || FAILED(hr))
+            {
+                s_fApprovalWatcherRunning = false;
+            }
+            s_approvalPoll.fCancelled = FALSE;
+            ReleaseSRWLockExclusive(&s_srwApprovals);
+            if (cWatched == 0 || FAILED(hr))
+            {
+                break;
+            }
+
+            ULONGLONG ullStart = StartQpc();
+            char szResponse[c_cbMaxResponse];
+            DWORD cbResponse = 0;
+            wchar_t szUrl[c_cchMaxOtpServerUrl];
+            hr = AppendFormField(szBody, ARRAYSIZE(szBody), "hold", c_szApprovalHold);
+            if (SUCCEEDED(hr))
+            {
+                hr = SelectOtpServer(nullptr, 0, szUrl, ARRAYSIZE(szUrl));
+            }
+            if (SUCCEEDED(hr))
+            {
+                DWORD dwTimeoutMs = c_dwDefaultTimeoutMs;
+                CConfigSnapshot *pSnapshot;
+                if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+                {
+                    dwTimeoutMs = pSnapshot->OtpTimeout(c_dwDefaultTimeoutMs);
+                    pSnapshot->Release();
+                }
+                hr = SendOtpRequest(szUrl, L"POST", c_szWaitPath, szBody, static_cast<DWORD>(strlen(szBody)), szResponse, sizeof(szResponse), &cbResponse,
+                                    &s_approvalPoll, c_dwApprovalHoldMs + dwTimeoutMs);
+                // How long the gateway held the request says nothing about its latency; only a
+                // failure is worth reporting, and anything else still ends a trial.
+                if (hr != HRESULT_FROM_WIN32(ERROR_WINHTTP_OPERATION_CANCELLED) && !IsGatewayAnswer(hr))
+                {
+                    ReportOtpServerResult(szUrl, false, ElapsedMs(ullStart));
+                }
+                else
+                {
+                    ReportOtpServerNoResult(szUrl);
+                }
+                if (hr == HRESULT_FROM_WIN32(ERROR_WINHTTP_OPERATION_CANCELLED))
+                {
+                    continue;
+                }
+            }
+
+            OTP_RESPONSE response = {};
+            wchar_t wszChallengeId[c_cchMaxChallengeId];
+            if (SUCCEEDED(hr))
+            {
+                hr = ReadResponse(szResponse, cbResponse, &response);
+            }
+            if (hr != E_PENDING &&
+                (SUCCEEDED(hr) || hr == E_ACCESSDENIED || hr == HRESULT_FROM_WIN32(ERROR_TIMEOUT)) &&
+                (response.dwFields & ORF_CHALLENGE) &&
+                MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, response.szChallengeId, -1, wszChallengeId, ARRAYSIZE(wszChallengeId)) != 0 &&
+                SetWatchedApproval(wszChallengeId, hr))
+            {
+                LogOtpHr(L"push answered", hr, ullStart);
+                if (hr == S_OK)
+                {
+                    SignalProviderEvent(PE_APPROVAL_RECEIVED);
+                }
+            }
+            else if (hr == E_PENDING ? ElapsedMs(ullStart) < c_dwApprovalRetryMs : FAILED(hr))
+            {
+                // The gateway is down or does not hold requests; the submit still checks /otp/status.
+                LogOtpHr(L"push watch failed", hr, ullStart);
+                Sleep(c_dwApprovalRetryMs);
+            }
+            SecureZeroMemory(&response, sizeof(response));
+            SecureZeroMemory(szResponse, sizeof(szResponse));
+        }
+        DllRelease();
+        return 0;
+    }
+
+    DWORD WINAPI PrewarmThreadProc(_In_ LPVOID)
+    {
+        wchar_t szUrl[c_cchMaxOtpServerUrl];
+        if (SUCCEEDED(SelectOtpServer(nullptr, 0, szUrl, ARRAYSIZE(szUrl))))
+        {
+            ULONGLONG ullStart = StartQpc();
+            DWORD dwLatencyMs;
+            HRESULT hr = ProbeOtpServer(szUrl, &dwLatencyMs);
+            ReportOtpServerResult(szUrl, SUCCEEDED(hr), dwLatencyMs);
+            LogOtpHr(L"prewarm", hr, ullStart);
+        }
+        DllRelease();
+        return 0;
+    }
+}
+
+HRESULT RequestOtpChallenge(_In_ PCWSTR pszUserName, _In_ PCWSTR pszChannel, _Out_ OTP_CHALLENGE *pChallenge)
+{
+    ZeroMemory(pChallenge, sizeof(*pChallenge));
+    ULONGLONG ullStart = StartQpc();
+
+    char szBody[c_cbMaxRequest] = {};
+    char szResponse[c_cbMaxResponse];
+    DWORD cbResponse = 0;
+    HRESULT hr = AppendFormField(szBody, ARRAYSIZE(szBody), "user", pszUserName);
+    if (SUCCEEDED(hr))
+    {
+        hr = AppendFormField(szBody, ARRAYSIZE(szBody), "channel", pszChannel);
+    }
+
+    // Fail over to the next best gateway when one does not answer. Ejected gateways are not
+    // tried at all, so this ends quickly once none is left.
+    wchar_t rgszTried[c_cMaxAttempts][c_cchMaxOtpServerUrl];
+    PCWSTR rgpszTried[c_cMaxAttempts];
+    for (DWORD cTried = 0; SUCCEEDED(hr); cTried++)
+    {
+        hr = SelectOtpServer(rgpszTried, cTried, pChallenge->szServerUrl, ARRAYSIZE(pChallenge->szServerUrl));
+        if (SUCCEEDED(hr))
+        {
+            hr = SendAndReport(pChallenge->szServerUrl, c_szRequestPath, szBody, static_cast<DWORD>(strlen(szBody)), szResponse, sizeof(szResponse), &cbResponse, nullptr);
+            if (!IsGatewayAnswer(hr) && cTried + 1 < c_cMaxAttempts)
+            {
+                StringCchCopyW(rgszTried[cTried], ARRAYSIZE(rgszTried[cTried]), pChallenge->szServerUrl);
+                rgpszTried[cTried] = rgszTried[cTried];
+                hr = S_OK;
+                continue;
+            }
+        }
+        break;
+    }
+    OTP_RESPONSE response = {};
+    if (SUCCEEDED(hr))
+    {
+        hr = ReadResponse(szResponse, cbResponse, &response);
+    }
+    if (SUCCEEDED(hr))
+    {
+        if (!(response.dwFields & ORF_CHALLENGE) ||
+            MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, response.szChallengeId, -1, pChallenge->szChallengeId, ARRAYSIZE(pChallenge->szChallengeId)) == 0)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+        else
+        {
+            ULONGLONG ullExpirySeconds = (response.ullExpirySeconds > 0) ? response.ullExpirySeconds : 300;
+            pChallenge->ullExpires = CurrentTime() + ullExpirySeconds * c_ullTicksPerSecond;
+        }
+    }
+
+    SecureZeroMemory(&response, sizeof(response));
+    SecureZeroMemory(szResponse, sizeof(szResponse));
+    SecureZeroMemory(szBody, sizeof(szBody));
+    LogOtpHr(L"challenge requested", hr, ullStart);
+    return hr;
+}
+
+HRESULT VerifyOtpCode(_In_ const OTP_CHALLENGE *pChallenge, _In_ PCWSTR pszCode)
+{
+    if (CurrentTime() >= pChallenge->ullExpires)
+    {
+        return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+    ULONGLONG ullStart = StartQpc();
+
+    DWORD dwPercentile = 0;
+    DWORD dwTimeoutMs = c_dwDefaultTimeoutMs;
+    CConfigSnapshot *pSnapshot;
+    if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+    {
+        dwPercentile = pSnapshot->OtpHedgePercentile(0);
+        dwTimeoutMs = pSnapshot->OtpTimeout(c_dwDefaultTimeoutMs);
+        pSnapshot->Release();
+    }
+
+    char szBody[c_cbMaxRequest] = {};
+    HRESULT hr = AppendFormField(szBody, ARRAYSIZE(szBody), "challenge", pChallenge->szChallengeId);
+    if (SUCCEEDED(hr))
+    {
+        hr = AppendFormField(szBody, ARRAYSIZE(szBody), "code", pszCode);
+    }
+    if (SUCCEEDED(hr))
+    {
+        InterlockedIncrement(&s_cVerifies);
+        if (dwPercentile > 0 && dwPercentile < 100)
+        {
+            hr = VerifyHedged(pChallenge->szServerUrl, szBody, static_cast<DWORD>(strlen(szBody)), dwPercentile, dwTimeoutMs);
+        }
+        else
+        {
+            hr = SendVerify(pChallenge->szServerUrl, szBody, static_cast<DWORD>(strlen(szBody)), nullptr);
+            if (IsVerifyAnswer(hr))
+            {
+                RecordVerifySample(ElapsedMs(ullStart));
+            }
+        }
+    }
+
+    SecureZeroMemory(szBody, sizeof(szBody));
+    LogOtpHr(L"code verified", hr, ullStart);
+    return hr;
+}
+
+HRESULT CheckOtpApproval(_In_ const OTP_CHALLENGE *pChallenge)
+{
+    if (CurrentTime() >= pChallenge->ullExpires)
+    {
+        return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+    return PostChallenge(pChallenge, c_szStatusPath);
+}
+
+HRESULT CancelOtpChallenge(_In_ const OTP_CHALLENGE *pChallenge)
+{
+    ULONGLONG ullStart = StartQpc();
+    HRESULT hr = PostChallenge(pChallenge, c_szCancelPath);
+    LogOtpHr(L"challenge cancelled", hr, ullStart);
+    return hr;
+}
+
+HRESULT WatchOtpApproval(_In_ const OTP_CHALLENGE *pChallenge)
+{
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_TOO_MANY_OPEN_FILES);
+    bool fAdded = false;
+    bool fStart = false;
+    ULONGLONG ullNow = CurrentTime();
+    AcquireSRWLockExclusive(&s_srwApprovals);
+    DWORD iFree = ARRAYSIZE(s_rgApprovals);
+    for (DWORD i = 0; i < ARRAYSIZE(s_rgApprovals) && FAILED(hr); i++)
+    {
+        if (wcscmp(s_rgApprovals[i].szChallengeId, pChallenge->szChallengeId) == 0)
+        {
+            hr = S_OK;
+        }
+        else if (iFree == ARRAYSIZE(s_rgApprovals) && (*s_rgApprovals[i].szChallengeId == L'\0' || ullNow >= s_rgApprovals[i].ullExpires))
+        {
+            iFree = i;
+        }
+    }
+    if (FAILED(hr) && iFree < ARRAYSIZE(s_rgApprovals))
+    {
+        hr = StringCchCopyW(s_rgApprovals[iFree].szChallengeId, ARRAYSIZE(s_rgApprovals[iFree].szChallengeId), pChallenge->szChallengeId);
+        s_rgApprovals[iFree].ullExpires = pChallenge->ullExpires;
+        s_rgApprovals[iFree].hr = E_PENDING;
+        fAdded = SUCCEEDED(hr);
+        fStart = fAdded && !s_fApprovalWatcherRunning;
+        s_fApprovalWatcherRunning = s_fApprovalWatcherRunning || fStart;
+        s_approvalPoll.fCancelled = TRUE;
+    }
+    ReleaseSRWLockExclusive(&s_srwApprovals);
+
+    // Restart the poll in flight so it covers the new challenge too.
+    if (fAdded)
+    {
+        CloseRequestHandle(&s_approvalPoll.hRequest);
+    }
+    if (fStart)
+    {
+        DllAddRef();
+        if (!QueueUserWorkItem(ApprovalWatcherThreadProc, nullptr, WT_EXECUTELONGFUNCTION))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            DllRelease();
+            AcquireSRWLockExclusive(&s_srwApprovals);
+            s_fApprovalWatcherRunning = false;
+            ReleaseSRWLockExclusive(&s_srwApprovals);
+        }
+    }
+    return hr;
+}
+
+void UnwatchOtpApproval(_In_ const OTP_CHALLENGE *pChallenge)
+{
+    bool fFound = false;
+    AcquireSRWLockExclusive(&s_srwApprovals);
+    for (DWORD i = 0; i < ARRAYSIZE(s_rgApprovals) && !fFound; i++)
+    {
+        if (*s_rgApprovals[i].szChallengeId != L'\0' && wcscmp(s_rgApprovals[i].szChallengeId, pChallenge->szChallengeId) == 0)
+        {
+            fFound = true;
+            if (s_rgApprovals[i].hr == E_PENDING)
+            {
+                s_approvalPoll.fCancelled = TRUE;
+            }
+            SecureZeroMemory(&s_rgApprovals[i], sizeof(s_rgApprovals[i]));
+        }
+    }
+    ReleaseSRWLockExclusive(&s_srwApprovals);
+    if (fFound)
+    {
+        CloseRequestHandle(&s_approvalPoll.hRequest);
+    }
+}
+
+HRESULT GetWatchedOtpApproval(_In_ const OTP_CHALLENGE *pChallenge)
+{
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    AcquireSRWLockShared(&s_srwApprovals);
+    for (DWORD i = 0; i < ARRAYSIZE(s_rgApprovals) && hr == HRESULT_FROM_WIN32(ERROR_NOT_FOUND); i++)
+    {
+        if (*s_rgApprovals[i].szChallengeId != L'\0' && wcscmp(s_rgApprovals[i].szChallengeId, pChallenge->szChallengeId) == 0)
+        {
+            hr = s_rgApprovals[i].hr;
+        }
+    }
+    ReleaseSRWLockShared(&s_srwApprovals);
+    if (hr == E_PENDING && CurrentTime() >= pChallenge->ullExpires)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+    return hr;
+}
+
+void GetOtpHedgeCounters(_Out_ OTP_HEDGE_COUNTERS *pCounters)
+{
+    pCounters->cVerifies = static_cast<DWORD>(s_cVerifies);
+    pCounters->cHedged = static_cast<DWORD>(s_cHedged);
+    pCounters->cHedgeWins = static_cast<DWORD>(s_cHedgeWins);
+    pCounters->ullSavedMs = static_cast<ULONGLONG>(InterlockedCompareExchange64(&s_llHedgeSavedMs, 0, 0));
+}
+
+void PrewarmOtpConnection()
+{
+    // One prewarm per interval is plenty; the pool keeps the socket alive in between.
+    LONGLONG llNow = static_cast<LONGLONG>(CurrentTime());
+    LONGLONG llLast = s_llLastPrewarm;
+    if (llNow - llLast < static_cast<LONGLONG>(c_ullPrewarmInterval) ||
+        InterlockedCompareExchange64(&s_llLastPrewarm, llNow, llLast) != llLast)
+    {
+        return;
+    }
+
+    DllAddRef();
+    if (!QueueUserWorkItem(PrewarmThreadProc, nullptr, WT_EXECUTELONGFUNCTION))
+    {
+        DllRelease();
+    }
+}
+
+CPendingOtpChallenge::CPendingOtpChallenge(MFA_FACTOR mfaFactor) :
+    _cRef(1),
+    _fCancelled(FALSE),
+    _fClaimed(FALSE),
+    _hDone(nullptr),
+    _pszUserName(nullptr),
+    _pszUserSid(nullptr),
+    _mfaFactor(mfaFactor),
+    _hr(E_PENDING)
+{
+    DllAddRef();
+    ZeroMemory(&_delivery, sizeof(_delivery));
+}
+
+CPendingOtpChallenge::~CPendingOtpChallenge()
+{
+    SecureZeroMemory(&_delivery, sizeof(_delivery));
+    if (_hDone != nullptr)
+    {
+        CloseHandle(_hDone);
+    }
+    CoTaskMemFree(_pszUserName);
+    CoTaskMemFree(_pszUserSid);
+    DllRelease();
+}
+
+HRESULT CPendingOtpChallenge::Start(_In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid, MFA_FACTOR mfaFactor, _Outptr_ CPendingOtpChallenge **ppPending)
+{
+    *ppPending = nullptr;
+    if (SpeculativeChannels(mfaFactor) == 0)
+    {
+        return E_INVALIDARG;
+    }
+    CPendingOtpChallenge *pPending = new (std::nothrow) CPendingOtpChallenge(mfaFactor);
+    if (pPending == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    HRESULT hr = SHStrDupW(pszUserName, &pPending->_pszUserName);
+    if (SUCCEEDED(hr) && pszUserSid != nullptr)
+    {
+        hr = SHStrDupW(pszUserSid, &pPending->_pszUserSid);
+    }
+    if (SUCCEEDED(hr))
+    {
+        pPending->_hDone = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+        hr = (pPending->_hDone != nullptr) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (SUCCEEDED(hr))
+    {
+        // The work item holds its own reference until the request completes.
+        pPending->AddRef();
+        if (!QueueUserWorkItem(s_ThreadProc, pPending, WT_EXECUTELONGFUNCTION))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            pPending->Release();
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *ppPending = pPending;
+    }
+    else
+    {
+        pPending->Release();
+    }
+    return hr;
+}
+
+DWORD CPendingOtpChallenge::SpeculativeChannels(MFA_FACTOR mfaFactor)
+{
+    return OtpChannelsForFactor(mfaFactor) & ~OTP_CHANNEL_PUSH;
+}
+
+ULONG CPendingOtpChallenge::AddRef()
+{
+    return InterlockedIncrement(&_cRef);
+}
+
+ULONG CPendingOtpChallenge::Release()
+{
+    long cRef = InterlockedDecrement(&_cRef);
+    if (!cRef)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+bool CPendingOtpChallenge::IsFor(_In_ PCWSTR pszUserName, MFA_FACTOR mfaFactor) const
+{
+    return mfaFactor == _mfaFactor && CompareStringOrdinal(pszUserName, -1, _pszUserName, -1, TRUE) == CSTR_EQUAL;
+}
+
+HRESULT CPendingOtpChallenge::Wait(_Out_ OTP_DELIVERY *pDelivery)
+{
+    ZeroMemory(pDelivery, sizeof(*pDelivery));
+
+    // Resolve, connect, send and receive each get the configured timeout.
+    DWORD dwTimeoutMs = c_dwDefaultTimeoutMs;
+    CConfigSnapshot *pSnapshot;
+    if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+    {
+        dwTimeoutMs = pSnapshot->OtpTimeout(c_dwDefaultTimeoutMs);
+        pSnapshot->Release();
+    }
+    if (WaitForSingleObject(_hDone, 4 * dwTimeoutMs) != WAIT_OBJECT_0)
+    {
+        return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+
+    if (InterlockedExchange(&_fClaimed, TRUE) != FALSE)
+    {
+        return E_ABORT;
+    }
+    if (SUCCEEDED(_hr))
+    {
+        *pDelivery = _delivery;
+        SecureZeroMemory(&_delivery, sizeof(_delivery));
+    }
+    return _hr;
+}
+
+void CPendingOtpChallenge::Cancel()
+{
+    InterlockedExchange(&_fCancelled, TRUE);
+    if (WaitForSingleObject(_hDone, 0) == WAIT_OBJECT_0 && InterlockedExchange(&_fClaimed, TRUE) == FALSE)
+    {
+        CancelOtpDelivery(&_delivery);
+    }
+}
+
+DWORD WINAPI CPendingOtpChallenge::s_ThreadProc(_In_ LPVOID lpParameter)
+{
+    CPendingOtpChallenge *pPending = static_cast<CPendingOtpChallenge *>(lpParameter);
+    HRESULT hr = E_ABORT;
+    if (!pPending->_fCancelled)
+    {
+        hr = DeliverOtpChallenge(pPending->_pszUserName, pPending->_pszUserSid, SpeculativeChannels(pPending->_mfaFactor), &pPending->_delivery);
+    }
+    pPending->_hr = hr;
+    SetEvent(pPending->_hDone);
+
+    // Cancelled while the challenges were going out: nobody will answer them.
+    if (pPending->_fCancelled && InterlockedExchange(&pPending->_fClaimed, TRUE) == FALSE)
+    {
+        CancelOtpDelivery(&pPending->_delivery);
+    }
+    pPending->Release();
+    return 0;
+}
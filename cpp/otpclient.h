@@ -0,0 +1,153 @@
+#pragma once
+
+#include "helpers.h"
+#include "configsnapshot.h"
+#include "mfapolicy.h"
+#include "otpresponse.h"
+
+// SendQuick OTP client.
+//
+// Challenges are requested and codes verified over HTTP(S) against the gateways listed in
+// Otp\Servers:
+//
+//   POST <url>/otp/request   user=<account>&channel=sms|email|push|totp
+//   POST <url>/otp/verify    challenge=<id>&code=<code>
+//   POST <url>/otp/status    challenge=<id>
+//   POST <url>/otp/cancel    challenge=<id>
+//   POST <url>/otp/wait      challenge=<id>[&challenge=<id>...]&hold=<seconds>
+//
+// All answer with a JSON object whose "status" is "ok", "denied" or "expired", or "pending" for a
+// push approval not yet given; a request also carries "challenge" and "expiry" (seconds). A wait
+// is held open until one of its challenges is answered, and names that one in "challenge". A
+// "message", when present, is logged with refusals; otpresponse.h parses the answers. The
+// optional Otp\ApiKey value is sent as X-Api-Key.
+//
+// Challenges go to the gateway serverselect ranks best and fail over to the next one when it does
+// not answer; codes are verified where they were issued.
+//
+// With Otp\HedgePercentile set (1-99), a verification still outstanding after that percentile of
+// recent verification round trips is sent again to the next best gateway, and the first to
+// accept the code wins; the other request is cancelled. This relies on the gateways sharing
+// challenge state, as a SendQuick cluster does, and on a code being accepted at most once.
+//
+// Every process keeps one WinHTTP session and one connection handle per gateway, so requests
+// after the first reuse a kept-alive (and already TLS-negotiated) socket from the session's
+// pool. Calls are synchronous and bounded by Otp\TimeoutMs; keep them off the UI thread where
+// the caller can.
+
+struct OTP_CHALLENGE
+{
+    wchar_t     szChallengeId[c_cchMaxChallengeId];
+    wchar_t     szServerUrl[c_cchMaxOtpServerUrl];  // Codes are verified where they were issued.
+    ULONGLONG   ullExpires;                         // FILETIME in UTC.
+};
+
+// Asks a gateway to send pszUserName a challenge on pszChannel ("sms", "email", "push" or "totp").
+HRESULT RequestOtpChallenge(_In_ PCWSTR pszUserName, _In_ PCWSTR pszChannel, _Out_ OTP_CHALLENGE *pChallenge);
+
+// Returns S_OK when the gateway accepts pszCode, E_ACCESSDENIED when it does not, and
+// HRESULT_FROM_WIN32(ERROR_TIMEOUT) when the challenge has expired.
+HRESULT VerifyOtpCode(_In_ const OTP_CHALLENGE *pChallenge, _In_ PCWSTR pszCode);
+
+// Returns S_OK once the push approval for pChallenge has been given, E_PENDING while it has not,
+// E_ACCESSDENIED when it was rejected and HRESULT_FROM_WIN32(ERROR_TIMEOUT) when it has expired.
+HRESULT CheckOtpApproval(_In_ const OTP_CHALLENGE *pChallenge);
+
+// Push approvals are watched over a single long poll per process: every pending approval rides
+// the same /otp/wait, which is restarted whenever one is added or removed, so they all share one
+// kept-alive connection. An approval signals PE_APPROVAL_RECEIVED, and the provider then submits
+// the approved tile without the user typing anything.
+
+// Starts watching the push approval for pChallenge.
+HRESULT WatchOtpApproval(_In_ const OTP_CHALLENGE *pChallenge);
+
+// Stops watching it.
+void UnwatchOtpApproval(_In_ const OTP_CHALLENGE *pChallenge);
+
+// What the watcher has heard for pChallenge, as CheckOtpApproval returns it, without asking the
+// gateway; HRESULT_FROM_WIN32(ERROR_NOT_FOUND) when it is not being watched.
+HRESULT GetWatchedOtpApproval(_In_ const OTP_CHALLENGE *pChallenge);
+
+// Tells the gateway to drop pChallenge: its code stops working and a push prompt is withdrawn.
+HRESULT CancelOtpChallenge(_In_ const OTP_CHALLENGE *pChallenge);
+
+// The channels a challenge can be delivered on, as Otp\Channels bits.
+enum OTP_CHANNEL_FLAGS
+{
+    OTP_CHANNEL_SMS     = 0x1,
+    OTP_CHANNEL_EMAIL   = 0x2,
+    OTP_CHANNEL_PUSH    = 0x4,
+    OTP_CHANNEL_APP     = 0x8,      // Authenticator app codes checked by the gateway.
+};
+
+const DWORD c_cOtpChannels = 4;
+
+// One second factor delivered on one or more channels at once; see otpdelivery.h. Its
+// challenges only answer for the user they were sent to.
+struct OTP_DELIVERY
+{
+    DWORD           dwChannels;                     // OTP_CHANNEL_* bits whose challenge is live.
+    DWORD           dwShared;                       // Of those, the ones other credentials may have joined; see otpinflight.h.
+    OTP_CHALLENGE   rgChallenges[c_cOtpChannels];   // By channel, in OTP_CHANNEL_* bit order.
+    wchar_t         szUserName[CREDUI_MAX_USERNAME_LENGTH + 1];     // The user challenged, as NormalizeAccountName leaves it.
+    wchar_t         szUserSid[SECURITY_MAX_SID_STRING_CHARACTERS];  // Their SID; empty when it was not known, and then nothing is shared.
+};
+
+struct OTP_HEDGE_COUNTERS
+{
+    DWORD       cVerifies;      // Codes sent to a gateway for verification.
+    DWORD       cHedged;        // Of those, sent to a second gateway as well.
+    DWORD       cHedgeWins;     // Of those, accepted by the second gateway first.
+    ULONGLONG   ullSavedMs;     // Estimated latency the hedge wins saved, in total.
+};
+
+// Process-wide counts since the DLL was loaded.
+void GetOtpHedgeCounters(_Out_ OTP_HEDGE_COUNTERS *pCounters);
+
+// A challenge delivered on the thread pool ahead of the submit, so the code is already on its way
+// while the user is still typing the password. Push approvals are held back: they must not reach
+// the device before the password does.
+class CPendingOtpChallenge
+{
+public:
+    // Queues the delivery for pszUserName. With pszUserSid, it joins a challenge another process
+    // has in flight for the user instead of sending a new one.
+    static HRESULT Start(_In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid, MFA_FACTOR mfaFactor, _Outptr_ CPendingOtpChallenge **ppPending);
+
+    // The channels Start delivers on for mfaFactor; 0 when none can go out ahead of the submit.
+    static DWORD SpeculativeChannels(MFA_FACTOR mfaFactor);
+
+    ULONG AddRef();
+    ULONG Release();
+
+    // Whether the request was made for this user and factor.
+    bool IsFor(_In_ PCWSTR pszUserName, MFA_FACTOR mfaFactor) const;
+
+    // Waits for the delivery to complete and returns what DeliverOtpChallenge returned. The wait
+    // is bounded by Otp\TimeoutMs, like the requests themselves.
+    HRESULT Wait(_Out_ OTP_DELIVERY *pDelivery);
+
+    // Drops the delivery if it has not gone out yet. Challenges already sent, and not taken over by
+    // Wait, are cancelled at the gateway.
+    void Cancel();
+
+private:
+    CPendingOtpChallenge(MFA_FACTOR mfaFactor);
+    ~CPendingOtpChallenge();
+
+    static DWORD WINAPI s_ThreadProc(_In_ LPVOID lpParameter);
+
+    long                            _cRef;
+    volatile long                   _fCancelled;
+    volatile long                   _fClaimed;          // Set by whichever of Wait and Cancel takes _delivery.
+    HANDLE                          _hDone;
+    PWSTR                           _pszUserName;
+    PWSTR                           _pszUserSid;
+    MFA_FACTOR                      _mfaFactor;
+    HRESULT                         _hr;
+    OTP_DELIVERY                    _delivery;
+};
+
+// Opens the connection to the gateway the next request will go to, in the background, so the first real request does
+// not pay for the TCP and TLS handshakes.
+void PrewarmOtpConnection();
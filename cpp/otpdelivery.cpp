@@ -0,0 +1,733 @@
+#include "otpdelivery.h"
+#include <new>
+#include "accountcache.h"
+#include "dll.h"
+#include "otpinflight.h"
+#include "providerevents.h"
+#include "utils.h"
+
+namespace
+{
+    const DWORD c_dwDefaultTimeoutMs = 5000;
+    const DWORD c_cchMaxCallText = 512;
+
+    // A push approval answers only the prompt it was sent for.
+    const DWORD c_dwShareableChannels = OTP_CHANNEL_SMS | OTP_CHANNEL_EMAIL | OTP_CHANNEL_APP;
+
+    // The index into OTP_DELIVERY::rgChallenges of a single OTP_CHANNEL_* bit.
+    DWORD ChannelIndex(DWORD dwChannel)
+    {
+        DWORD iChannel = 0;
+        while ((dwChannel >>= 1) != 0)
+        {
+            iChannel++;
+        }
+        return iChannel;
+    }
+
+    struct OTP_CHANNEL_BATCH;
+
+    // One channel's send or answer check, run on the thread pool.
+    struct OTP_CHANNEL_CALL
+    {
+        OTP_CHANNEL_BATCH   *pBatch;
+        DWORD               dwChannel;
+        OTP_CHALLENGE       challenge;
+        HRESULT             hr;
+        HANDLE              hDone;
+    };
+
+    // The calls made together for one delivery. The caller and every running call hold a
+    // reference, so a call the caller has stopped waiting for still has somewhere to finish.
+    struct OTP_CHANNEL_BATCH
+    {
+        volatile long       cRef;
+        bool                fSend;
+        wchar_t             szText[c_cchMaxCallText];   // The user name to send to, or the code to check.
+        DWORD               cCalls;
+        OTP_CHANNEL_CALL    rgCalls[c_cOtpChannels];
+    };
+
+    void ReleaseBatch(_In_ OTP_CHANNEL_BATCH *pBatch)
+    {
+        if (InterlockedDecrement(&pBatch->cRef) == 0)
+        {
+            for (DWORD i = 0; i < pBatch->cCalls; i++)
+            {
+                if (pBatch->rgCalls[i].hDone != nullptr)
+                {
+                    CloseHandle(pBatch->rgCalls[i].hDone);
+                }
+            }
+            SecureZeroMemory(pBatch->szText, sizeof(pBatch->szText));
+            SecureZeroMemory(pBatch->rgCalls, sizeof(pBatch->rgCalls));
+            delete pBatch;
+        }
+    }
+
+    // A batch with one call per bit in dwChannels, checking pDelivery's challenges unless fSend.
+    HRESULT CreateBatch(bool fSend, _In_ PCWSTR pszText, DWORD dwChannels, _In_ const OTP_DELIVERY *pDelivery, _Outptr_ OTP_CHANNEL_BATCH **ppBatch)
+    {
+        *ppBatch = nullptr;
+        OTP_CHANNEL_BATCH *pBatch = new (std::nothrow) OTP_CHANNEL_BATCH();
+        if (pBatch == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+        pBatch->cRef = 1;
+        pBatch->fSend = fSend;
+        HRESULT hr = StringCchCopyW(pBatch->szText, ARRAYSIZE(pBatch->szText), pszText);
+        for (DWORD iChannel = 0; SUCCEEDED(hr) && iChannel < c_cOtpChannels; iChannel++)
+        {
+            DWORD dwChannel = 1u << iChannel;
+            if (dwChannels & dwChannel)
+            {
+                OTP_CHANNEL_CALL *pCall = &pBatch->rgCalls[pBatch->cCalls++];
+                pCall->pBatch = pBatch;
+                pCall->dwChannel = dwChannel;
+                pCall->hr = E_PENDING;
+                if (!fSend)
+                {
+                    pCall->challenge = pDelivery->rgChallenges[iChannel];
+                }
+            }
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            *ppBatch = pBatch;
+        }
+        else
+        {
+            ReleaseBatch(pBatch);
+        }
+        return hr;
+    }
+
+    HRESULT RunCall(_Inout_ OTP_CHANNEL_CALL *pCall, bool fSend, _In_ PCWSTR pszText)
+    {
+        return fSend ? COtpChannels::Send(pCall->dwChannel, pszText, &pCall->challenge)
+                     : COtpChannels::Answer(pCall->dwChannel, &pCall->challenge, (*pszText != L'\0') ? pszText : nullptr);
+    }
+
+    DWORD WINAPI CallThreadProc(_In_ LPVOID lpParameter)
+    {
+        OTP_CHANNEL_CALL *pCall = static_cast<OTP_CHANNEL_CALL *>(lpParameter);
+        OTP_CHANNEL_BATCH *pBatch = pCall->pBatch;
+        pCall->hr = RunCall(pCall, pBatch->fSend, pBatch->szText);
+        SetEvent(pCall->hDone);
+        ReleaseBatch(pBatch);
+        DllRelease();
+        return 0;
+    }
+
+    // Runs every call in pBatch at once and waits for all of them or, with fFirstAccepted, for the
+    // first to return S_OK, whose index is returned; otherwise returns cCalls. rghr gets each
+    // call's result, or HRESULT_FROM_WIN32(ERROR_WINHTTP_TIMEOUT) for calls still out when the
+    // wait ends. A single call runs on the caller's thread.
+    DWORD RunBatch(_In_ OTP_CHANNEL_BATCH *pBatch, bool fFirstAccepted, _Out_writes_(c_cOtpChannels) HRESULT *rghr)
+    {
+        if (pBatch->cCalls == 1)
+        {
+            rghr[0] = pBatch->rgCalls[0].hr = RunCall(&pBatch->rgCalls[0], pBatch->fSend, pBatch->szText);
+            return (fFirstAccepted && rghr[0] == S_OK) ? 0 : pBatch->cCalls;
+        }
+
+        DWORD dwTimeoutMs = c_dwDefaultTimeoutMs;
+        CConfigSnapshot *pSnapshot;
+        if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+        {
+            dwTimeoutMs = pSnapshot->OtpTimeout(c_dwDefaultTimeoutMs);
+            pSnapshot->Release();
+        }
+
+        bool rgfDone[c_cOtpChannels] = {};
+        for (DWORD i = 0; i < pBatch->cCalls; i++)
+        {
+            OTP_CHANNEL_CALL *pCall = &pBatch->rgCalls[i];
+            rghr[i] = HRESULT_FROM_WIN32(ERROR_WINHTTP_TIMEOUT);
+            pCall->hDone = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+            HRESULT hr = (pCall->hDone != nullptr) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+            if (SUCCEEDED(hr))
+            {
+                InterlockedIncrement(&pBatch->cRef);
+                DllAddRef();
+                if (!QueueUserWorkItem(CallThreadProc, pCall, WT_EXECUTELONGFUNCTION))
+                {
+                    hr = HRESULT_FROM_WIN32(GetLastError());
+                    DllRelease();
+                    InterlockedDecrement(&pBatch->cRef);
+                }
+            }
+            if (FAILED(hr))
+            {
+                rghr[i] = hr;
+                rgfDone[i] = true;
+            }
+        }
+
+        // The same bound CPendingOtpChallenge::Wait puts on a single request.
+        ULONGLONG ullDeadline = GetTickCount64() + 4ull * dwTimeoutMs;
+        for (;;)
+        {
+            HANDLE rghPending[c_cOtpChannels];
+            DWORD cPending = 0;
+            for (DWORD i = 0; i < pBatch->cCalls; i++)
+            {
+                if (!rgfDone[i] && WaitForSingleObject(pBatch->rgCalls[i].hDone, 0) == WAIT_OBJECT_0)
+                {
+                    rgfDone[i] = true;
+                    rghr[i] = pBatch->rgCalls[i].hr;
+                    if (fFirstAccepted && rghr[i] == S_OK)
+                    {
+                        return i;
+                    }
+                }
+                if (!rgfDone[i])
+                {
+                    rghPending[cPending++] = pBatch->rgCalls[i].hDone;
+                }
+            }
+
+            ULONGLONG ullNow = GetTickCount64();
+            if (cPending == 0 || ullNow >= ullDeadline)
+            {
+                break;
+            }
+            WaitForMultipleObjects(cPending, rghPending, FALSE, static_cast<DWORD>(ullDeadline - ullNow));
+        }
+        return pBatch->cCalls;
+    }
+
+    // Drops one channel's challenge from pDelivery.
+    void ForgetChallenge(_Inout_ OTP_DELIVERY *pDelivery, DWORD dwChannel)
+    {
+        OTP_CHALLENGE *pChallenge = &pDelivery->rgChallenges[ChannelIndex(dwChannel)];
+        if (dwChannel == OTP_CHANNEL_PUSH && (pDelivery->dwChannels & OTP_CHANNEL_PUSH))
+        {
+            UnwatchOtpApproval(pChallenge);
+        }
+        pDelivery->dwChannels &= ~dwChannel;
+        pDelivery->dwShared &= ~dwChannel;
+        SecureZeroMemory(pChallenge, sizeof(*pChallenge));
+    }
+
+    DWORD WINAPI CancelThreadProc(_In_ LPVOID lpParameter)
+    {
+        OTP_DELIVERY *pDelivery = static_cast<OTP_DELIVERY *>(lpParameter);
+        for (DWORD iChannel = 0; iChannel < c_cOtpChannels; iChannel++)
+        {
+            if (pDelivery->dwChannels & (1u << iChannel))
+            {
+                CancelOtpChallenge(&pDelivery->rgChallenges[iChannel]);
+            }
+        }
+        SecureZeroMemory(pDelivery, sizeof(*pDelivery));
+        delete pDelivery;
+        DllRelease();
+        return 0;
+    }
+
+    // Stops watching pDelivery's push approval and cancels its challenges in dwCancel at the
+    // gateway, in the background, then empties it.
+    void WithdrawDelivery(_Inout_ OTP_DELIVERY *pDelivery, DWORD dwCancel)
+    {
+        if (pDelivery->dwChannels & OTP_CHANNEL_PUSH)
+        {
+            UnwatchOtpApproval(&pDelivery->rgChallenges[ChannelIndex(OTP_CHANNEL_PUSH)]);
+        }
+        dwCancel &= pDelivery->dwChannels;
+        if (dwCancel != 0)
+        {
+            OTP_DELIVERY *pCopy = new (std::nothrow) OTP_DELIVERY(*pDelivery);
+            if (pCopy != nullptr)
+            {
+                pCopy->dwChannels = dwCancel;
+                DllAddRef();
+                if (!QueueUserWorkItem(CancelThreadProc, pCopy, WT_EXECUTELONGFUNCTION))
+                {
+                    DllRelease();
+                    SecureZeroMemory(pCopy, sizeof(*pCopy));
+                    delete pCopy;
+                }
+            }
+        }
+        SecureZeroMemory(pDelivery, sizeof(*pDelivery));
+    }
+
+    void LogDelivery(_In_z_ LPCWSTR context, DWORD dwChannels, HRESULT hr)
+    {
+        wchar_t buffer[128] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[OTP] %s channels=0x%X hr=0x%08X", context, dwChannels, hr)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+}
+
+DWORD OtpChannelsForFactor(MFA_FACTOR mfaFactor)
+{
+    DWORD dwChannels;
+    switch (mfaFactor)
+    {
+    case MFA_FACTOR_OTP:
+        dwChannels = OTP_CHANNEL_SMS;
+        break;
+    case MFA_FACTOR_PUSH:
+        dwChannels = OTP_CHANNEL_PUSH;
+        break;
+    case MFA_FACTOR_TOTP:
+        return OTP_CHANNEL_APP;
+    default:
+        return 0;
+    }
+
+    CConfigSnapshot *pSnapshot;
+    if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+    {
+        dwChannels |= pSnapshot->OtpChannels(0) & (OTP_CHANNEL_SMS | OTP_CHANNEL_EMAIL | OTP_CHANNEL_PUSH);
+        pSnapshot->Release();
+    }
+    return dwChannels;
+}
+
+HRESULT DeliverOtpChallenge(_In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid, DWORD dwChannels, _Inout_ OTP_DELIVERY *pDelivery)
+{
+    if (pDelivery->dwChannels == 0)
+    {
+        pDelivery->dwShared = 0;
+        pDelivery->szUserSid[0] = L'\0';
+        HRESULT hr = NormalizeAccountName(pszUserName, pDelivery->szUserName, ARRAYSIZE(pDelivery->szUserName));
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+    else if (!IsOtpDeliveryFor(pDelivery, pszUserName, pszUserSid))
+    {
+        LogDelivery(L"challenge is for another user", pDelivery->dwChannels, E_ACCESSDENIED);
+        return E_ACCESSDENIED;
+    }
+
+    dwChannels &= ~pDelivery->dwChannels;
+    if (dwChannels == 0)
+    {
+        return (pDelivery->dwChannels != 0) ? S_OK : E_INVALIDARG;
+    }
+
+    if (pszUserSid != nullptr && pDelivery->szUserSid[0] == L'\0' &&
+        FAILED(StringCchCopyW(pDelivery->szUserSid, ARRAYSIZE(pDelivery->szUserSid), pszUserSid)))
+    {
+        pDelivery->szUserSid[0] = L'\0';
+    }
+    DWORD dwShareable = (pDelivery->szUserSid[0] != L'\0') ? (dwChannels & c_dwShareableChannels) : 0;
+
+    // Join what another process already has on its way; the rest is claimed and sent from here.
+    DWORD dwClaimed = 0;
+    for (DWORD iChannel = 0; iChannel < c_cOtpChannels; iChannel++)
+    {
+        DWORD dwChannel = 1u << iChannel;
+        if (dwShareable & dwChannel)
+        {
+            if (JoinOtpChallenge(pDelivery->szUserSid, dwChannel, &pDelivery->rgChallenges[iChannel]) == S_OK)
+            {
+                pDelivery->dwChannels |= dwChannel;
+                pDelivery->dwShared |= dwChannel;
+                dwChannels &= ~dwChannel;
+            }
+            else
+            {
+                dwClaimed |= dwChannel;
+            }
+        }
+    }
+
+    HRESULT hr = S_OK;
+    if (dwChannels != 0)
+    {
+        OTP_CHANNEL_BATCH *pBatch;
+        hr = CreateBatch(true, pszUserName, dwChannels, pDelivery, &pBatch);
+        if (SUCCEEDED(hr))
+        {
+            HRESULT rghr[c_cOtpChannels];
+            RunBatch(pBatch, false, rghr);
+            for (DWORD i = 0; i < pBatch->cCalls; i++)
+            {
+                DWORD dwChannel = pBatch->rgCalls[i].dwChannel;
+                const OTP_CHALLENGE *pChallenge = SUCCEEDED(rghr[i]) ? &pBatch->rgCalls[i].challenge : nullptr;
+                if ((dwClaimed & dwChannel) && PublishOtpChallenge(pDelivery->szUserSid, dwChannel, pChallenge) && pChallenge != nullptr)
+                {
+                    pDelivery->dwShared |= dwChannel;
+                }
+                dwClaimed &= ~dwChannel;
+
+                if (pChallenge != nullptr)
+                {
+                    pDelivery->rgChallenges[ChannelIndex(dwChannel)] = *pChallenge;
+                    pDelivery->dwChannels |= dwChannel;
+                    if (dwChannel == OTP_CHANNEL_PUSH)
+                    {
+                        WatchOtpApproval(pChallenge);
+                    }
+                }
+                else if (SUCCEEDED(hr))
+                {
+                    hr = rghr[i];
+                }
+            }
+            ReleaseBatch(pBatch);
+        }
+    }
+
+    // Claims for sends that never went out.
+    for (DWORD iChannel = 0; iChannel < c_cOtpChannels; iChannel++)
+    {
+        if (dwClaimed & (1u << iChannel))
+        {
+            PublishOtpChallenge(pDelivery->szUserSid, 1u << iChannel, nullptr);
+        }
+    }
+    if (pDelivery->dwChannels != 0)
+    {
+        hr = S_OK;
+    }
+    LogDelivery(L"challenge delivered", pDelivery->dwChannels, hr);
+    return hr;
+}
+
+bool IsOtpDeliveryFor(_In_ const OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid)
+{
+    wchar_t szUserName[ARRAYSIZE(pDelivery->szUserName)];
+    if (pDelivery->szUserName[0] == L'\0' ||
+        FAILED(NormalizeAccountName(pszUserName, szUserName, ARRAYSIZE(szUserName))) ||
+        CompareStringOrdinal(szUserName, -1, pDelivery->szUserName, -1, FALSE) != CSTR_EQUAL)
+    {
+        return false;
+    }
+
+    // A name can be given to another account once the first is deleted.
+    return pszUserSid == nullptr || *pszUserSid == L'\0' || pDelivery->szUserSid[0] == L'\0' ||
+           CompareStringOrdinal(pszUserSid, -1, pDelivery->szUserSid, -1, TRUE) == CSTR_EQUAL;
+}
+
+HRESULT AnswerOtpDelivery(_Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid, _In_opt_ PCWSTR pszCode)
+{
+    if (pDelivery->dwChannels != 0 && !IsOtpDeliveryFor(pDelivery, pszUserName, pszUserSid))
+    {
+        LogDelivery(L"answer from another user refused", pDelivery->dwChannels, E_ACCESSDENIED);
+        return E_ACCESSDENIED;
+    }
+
+    // Expired challenges cannot be answered; drop them without asking the gateway.
+    FILETIME ftNow;
+    GetSystemTimeAsFileTime(&ftNow);
+    ULONGLONG ullNow = (static_cast<ULONGLONG>(ftNow.dwHighDateTime) << 32) | ftNow.dwLowDateTime;
+    for (DWORD iChannel = 0; iChannel < c_cOtpChannels; iChannel++)
+    {
+        if ((pDelivery->dwChannels & (1u << iChannel)) && ullNow >= pDelivery->rgChallenges[iChannel].ullExpires)
+        {
+            ForgetChallenge(pDelivery, 1u << iChannel);
+        }
+    }
+    if (pDelivery->dwChannels == 0)
+    {
+        return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+
+    bool fCode = (pszCode != nullptr && *pszCode != L'\0');
+    OTP_CHANNEL_BATCH *pBatch;
+    HRESULT hr = CreateBatch(false, fCode ? pszCode : L"", pDelivery->dwChannels, pDelivery, &pBatch);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    HRESULT rghr[c_cOtpChannels];
+    DWORD iWinner = RunBatch(pBatch, true, rghr);
+    if (iWinner < pBatch->cCalls)
+    {
+        // The rest are moot now, here and in any process that joined them; withdraw them so their
+        // codes and prompts go dead.
+        DWORD dwWinner = pBatch->rgCalls[iWinner].dwChannel;
+        for (DWORD iChannel = 0; iChannel < c_cOtpChannels; iChannel++)
+        {
+            if (pDelivery->dwShared & (1u << iChannel))
+            {
+                RetireOtpChallenge(pDelivery->szUserSid, 1u << iChannel, &pDelivery->rgChallenges[iChannel]);
+            }
+        }
+        ForgetChallenge(pDelivery, dwWinner);
+        WithdrawDelivery(pDelivery, pDelivery->dwChannels);
+        LogDelivery(L"answered", dwWinner, S_OK);
+    }
+    else
+    {
+        bool fDenied = false;
+        bool fPending = false;
+        HRESULT hrFailure = S_OK;
+        for (DWORD i = 0; i < pBatch->cCalls; i++)
+        {
+            DWORD dwChannel = pBatch->rgCalls[i].dwChannel;
+            if (rghr[i] == HRESULT_FROM_WIN32(ERROR_TIMEOUT))
+            {
+                ForgetChallenge(pDelivery, dwChannel);
+            }
+            else if (rghr[i] == E_ACCESSDENIED)
+            {
+                fDenied = true;
+            }
+            else if (rghr[i] == E_PENDING)
+            {
+                fPending = true;
+            }
+            else if (SUCCEEDED(hrFailure))
+            {
+                hrFailure = FAILED(rghr[i]) ? rghr[i] : E_UNEXPECTED;
+            }
+        }
+
+        // A typed code the gateway could not check is reported as such, even while a push is
+        // still waiting, so the caller can fall back to offline codes.
+        if (pDelivery->dwChannels == 0)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+        }
+        else if (fDenied)
+        {
+            hr = E_ACCESSDENIED;
+        }
+        else if (fPending && (!fCode || SUCCEEDED(hrFailure)))
+        {
+            hr = E_PENDING;
+        }
+        else
+        {
+            hr = FAILED(hrFailure) ? hrFailure : E_UNEXPECTED;
+        }
+    }
+    ReleaseBatch(pBatch);
+    return hr;
+}
+
+HRESULT GetOtpDeliveryApproval(_In_ const OTP_DELIVERY *pDelivery)
+{
+    return (pDelivery->dwChannels & OTP_CHANNEL_PUSH) ? GetWatchedOtpApproval(&pDelivery->rgChallenges[ChannelIndex(OTP_CHANNEL_PUSH)])
+                                                      : HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+}
+
+void CancelOtpDelivery(_Inout_ OTP_DELIVERY *pDelivery)
+{
+    WithdrawDelivery(pDelivery, pDelivery->dwChannels & ~pDelivery->dwShared);
+}
+
+COtpSubmit::COtpSubmit(bool fAnswer) :
+    _cRef(1),
+    _fAnswer(fAnswer),
+    _fDone(FALSE),
+    _fCancelled(FALSE),
+    _fClaimed(FALSE),
+    _pszUserName(nullptr),
+    _pszUserSid(nullptr),
+    _pszCode(nullptr),
+    _dwChannels(0),
+    _pPending(nullptr),
+    _hr(E_PENDING)
+{
+    DllAddRef();
+    ZeroMemory(&_delivery, sizeof(_delivery));
+}
+
+COtpSubmit::~COtpSubmit()
+{
+    if (_pPending != nullptr)
+    {
+        _pPending->Cancel();
+        _pPending->Release();
+    }
+    if (_pszCode != nullptr)
+    {
+        SecureZeroMemory(_pszCode, wcslen(_pszCode) * sizeof(wchar_t));
+    }
+    SecureZeroMemory(&_delivery, sizeof(_delivery));
+    CoTaskMemFree(_pszUserName);
+    CoTaskMemFree(_pszUserSid);
+    CoTaskMemFree(_pszCode);
+    DllRelease();
+}
+
+HRESULT COtpSubmit::StartAnswer(_Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid,
+                                _In_opt_ PCWSTR pszCode, _Outptr_ COtpSubmit **ppSubmit)
+{
+    *ppSubmit = nullptr;
+    COtpSubmit *pSubmit = new (std::nothrow) COtpSubmit(true);
+    if (pSubmit == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+    HRESULT hr = (pszCode != nullptr) ? SHStrDupW(pszCode, &pSubmit->_pszCode) : S_OK;
+    if (FAILED(hr))
+    {
+        pSubmit->Release();
+        return hr;
+    }
+    return s_Start(pSubmit, pDelivery, pszUserName, pszUserSid, ppSubmit);
+}
+
+HRESULT COtpSubmit::StartDelivery(_Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid,
+                                  DWORD dwChannels, _In_opt_ CPendingOtpChallenge *pPending, _Outptr_ COtpSubmit **ppSubmit)
+{
+    *ppSubmit = nullptr;
+    COtpSubmit *pSubmit = new (std::nothrow) COtpSubmit(false);
+    if (pSubmit == nullptr)
+    {
+        if (pPending != nullptr)
+        {
+            pPending->Cancel();
+            pPending->Release();
+        }
+        return E_OUTOFMEMORY;
+    }
+    pSubmit->_dwChannels = dwChannels;
+    pSubmit->_pPending = pPending;
+    return s_Start(pSubmit, pDelivery, pszUserName, pszUserSid, ppSubmit);
+}
+
+// Moves the delivery into pSubmit and queues it, or hands the delivery back when it cannot be
+// queued. Consumes the caller's reference to pSubmit.
+HRESULT COtpSubmit::s_Start(_In_ COtpSubmit *pSubmit, _Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName,
+                            _In_opt_ PCWSTR pszUserSid, _Outptr_ COtpSubmit **ppSubmit)
+{
+    HRESULT hr = SHStrDupW(pszUserName, &pSubmit->_pszUserName);
+    if (SUCCEEDED(hr) && pszUserSid != nullptr)
+    {
+        hr = SHStrDupW(pszUserSid, &pSubmit->_pszUserSid);
+    }
+    if (SUCCEEDED(hr))
+    {
+        pSubmit->_delivery = *pDelivery;
+        SecureZeroMemory(pDelivery, sizeof(*pDelivery));
+
+        // The work item holds its own reference until the call completes.
+        pSubmit->AddRef();
+        if (!QueueUserWorkItem(s_ThreadProc, pSubmit, WT_EXECUTELONGFUNCTION))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            *pDelivery = pSubmit->_delivery;
+            SecureZeroMemory(&pSubmit->_delivery, sizeof(pSubmit->_delivery));
+            pSubmit->Release();
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *ppSubmit = pSubmit;
+    }
+    else
+    {
+        pSubmit->Release();
+    }
+    return hr;
+}
+
+ULONG COtpSubmit::AddRef()
+{
+    return InterlockedIncrement(&_cRef);
+}
+
+ULONG COtpSubmit::Release()
+{
+    long cRef = InterlockedDecrement(&_cRef);
+    if (!cRef)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+bool COtpSubmit::IsAnswer() const
+{
+    return _fAnswer;
+}
+
+bool COtpSubmit::IsDone() const
+{
+    return ReadAcquire(&_fDone) != FALSE;
+}
+
+HRESULT COtpSubmit::TakeResult(_Out_ OTP_DELIVERY *pDelivery)
+{
+    ZeroMemory(pDelivery, sizeof(*pDelivery));
+    if (!IsDone() || InterlockedExchange(&_fClaimed, TRUE) != FALSE)
+    {
+        return E_ABORT;
+    }
+    *pDelivery = _delivery;
+    SecureZeroMemory(&_delivery, sizeof(_delivery));
+    return _hr;
+}
+
+void COtpSubmit::Cancel()
+{
+    InterlockedExchange(&_fCancelled, TRUE);
+    if (IsDone() && InterlockedExchange(&_fClaimed, TRUE) == FALSE)
+    {
+        CancelOtpDelivery(&_delivery);
+    }
+}
+
+DWORD WINAPI COtpSubmit::s_ThreadProc(_In_ LPVOID lpParameter)
+{
+    COtpSubmit *pSubmit = static_cast<COtpSubmit *>(lpParameter);
+    HRESULT hr = E_ABORT;
+    if (pSubmit->_fAnswer)
+    {
+        if (!pSubmit->_fCancelled)
+        {
+            hr = AnswerOtpDelivery(&pSubmit->_delivery, pSubmit->_pszUserName, pSubmit->_pszUserSid, pSubmit->_pszCode);
+        }
+    }
+    else
+    {
+        if (pSubmit->_pPending != nullptr)
+        {
+            OTP_DELIVERY delivery;
+            if (!pSubmit->_fCancelled && SUCCEEDED(pSubmit->_pPending->Wait(&delivery)))
+            {
+                if (pSubmit->_delivery.dwChannels == 0)
+                {
+                    pSubmit->_delivery = delivery;
+                }
+                else
+                {
+                    CancelOtpDelivery(&delivery);
+                }
+            }
+            SecureZeroMemory(&delivery, sizeof(delivery));
+            pSubmit->_pPending->Cancel();
+            pSubmit->_pPending->Release();
+            pSubmit->_pPending = nullptr;
+        }
+        if (!pSubmit->_fCancelled)
+        {
+            // Also adds the channels held back from the speculative delivery, push in particular.
+            hr = DeliverOtpChallenge(pSubmit->_pszUserName, pSubmit->_pszUserSid, pSubmit->_dwChannels, &pSubmit->_delivery);
+        }
+    }
+    pSubmit->_hr = hr;
+    InterlockedExchange(&pSubmit->_fDone, TRUE);
+
+    // Cancelled while the gateway was busy: nobody will pick the result up.
+    if (pSubmit->_fCancelled)
+    {
+        if (InterlockedExchange(&pSubmit->_fClaimed, TRUE) == FALSE)
+        {
+            CancelOtpDelivery(&pSubmit->_delivery);
+        }
+    }
+    else
+    {
+        SignalProviderEvent(PE_OTP_CHECKED);
+    }
+    pSubmit->Release();
+    return 0;
+}
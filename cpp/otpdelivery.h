@@ -0,0 +1,212 @@
+#pragma once
+
+#include "otpclient.h"
+
+// Second-factor delivery across channels.
+//
+// Some carriers hold a text back for half a minute or more. Otp\Channels lets policy send the
+// challenge on several channels at once (a text, an email and a push approval), on top of the
+// one the user's MFA factor calls for. The user answers whichever arrives first; the challenges
+// on the other channels are then cancelled, so their codes stop working and the push prompt is
+// withdrawn.
+//
+// Each channel is a class deriving from COtpChannel<T>. The base supplies what every channel
+// shares and reaches the channel's own hooks through its template argument, and
+// COtpChannelDispatch resolves a channel bit to its class at compile time, so no call goes
+// through a vtable. Adding a channel means giving it an OTP_CHANNEL_* bit, writing its class and
+// listing it in COtpChannels.
+//
+// Given the user's SID, a code challenge that another process already has in flight for the
+// user is joined rather than sent again (see otpinflight.h), and one this process sends is
+// published for others to join. Push approvals are never shared: approving one prompt must not
+// answer another.
+
+template <class TChannel>
+class COtpChannel
+{
+public:
+    // Asks the gateway to send pszUserName a challenge on this channel.
+    static HRESULT Send(_In_ PCWSTR pszUserName, _Out_ OTP_CHALLENGE *pChallenge)
+    {
+        return RequestOtpChallenge(pszUserName, TChannel::Name(), pChallenge);
+    }
+
+    // Checks whether the user has answered on this channel: S_OK when the answer is accepted,
+    // E_PENDING when there is nothing to check yet, otherwise what the gateway said.
+    static HRESULT Answer(_In_ const OTP_CHALLENGE *pChallenge, _In_opt_ PCWSTR pszCode)
+    {
+        return TChannel::CheckAnswer(pChallenge, pszCode);
+    }
+};
+
+// A channel whose answer is a code the user types.
+template <class TChannel>
+class COtpCodeChannel : public COtpChannel<TChannel>
+{
+public:
+    static HRESULT CheckAnswer(_In_ const OTP_CHALLENGE *pChallenge, _In_opt_ PCWSTR pszCode)
+    {
+        return (pszCode != nullptr && *pszCode != L'\0') ? VerifyOtpCode(pChallenge, pszCode) : E_PENDING;
+    }
+};
+
+class COtpSmsChannel : public COtpCodeChannel<COtpSmsChannel>
+{
+public:
+    static const DWORD c_dwFlag = OTP_CHANNEL_SMS;
+    static PCWSTR Name() { return L"sms"; }
+};
+
+class COtpEmailChannel : public COtpCodeChannel<COtpEmailChannel>
+{
+public:
+    static const DWORD c_dwFlag = OTP_CHANNEL_EMAIL;
+    static PCWSTR Name() { return L"email"; }
+};
+
+class COtpAppChannel : public COtpCodeChannel<COtpAppChannel>
+{
+public:
+    static const DWORD c_dwFlag = OTP_CHANNEL_APP;
+    static PCWSTR Name() { return L"totp"; }
+};
+
+// A channel answered by approving a prompt on the user's device; any code typed is ignored. An
+// answer the approval watcher has already seen needs no round trip.
+class COtpPushChannel : public COtpChannel<COtpPushChannel>
+{
+public:
+    static const DWORD c_dwFlag = OTP_CHANNEL_PUSH;
+    static PCWSTR Name() { return L"push"; }
+
+    static HRESULT CheckAnswer(_In_ const OTP_CHALLENGE *pChallenge, _In_opt_ PCWSTR)
+    {
+        HRESULT hr = GetWatchedOtpApproval(pChallenge);
+        return (hr == S_OK || hr == E_ACCESSDENIED) ? hr : CheckOtpApproval(pChallenge);
+    }
+};
+
+// Resolves an OTP_CHANNEL_* bit to the first listed channel class that has it.
+template <class... TChannels>
+struct COtpChannelDispatch;
+
+template <>
+struct COtpChannelDispatch<>
+{
+    static HRESULT Send(DWORD, _In_ PCWSTR, _Out_ OTP_CHALLENGE *)
+    {
+        return E_INVALIDARG;
+    }
+
+    static HRESULT Answer(DWORD, _In_ const OTP_CHALLENGE *, _In_opt_ PCWSTR)
+    {
+        return E_INVALIDARG;
+    }
+};
+
+template <class TChannel, class... TRest>
+struct COtpChannelDispatch<TChannel, TRest...>
+{
+    static HRESULT Send(DWORD dwChannel, _In_ PCWSTR pszUserName, _Out_ OTP_CHALLENGE *pChallenge)
+    {
+        return (dwChannel == TChannel::c_dwFlag) ? TChannel::Send(pszUserName, pChallenge)
+                                                 : COtpChannelDispatch<TRest...>::Send(dwChannel, pszUserName, pChallenge);
+    }
+
+    static HRESULT Answer(DWORD dwChannel, _In_ const OTP_CHALLENGE *pChallenge, _In_opt_ PCWSTR pszCode)
+    {
+        return (dwChannel == TChannel::c_dwFlag) ? TChannel::Answer(pChallenge, pszCode)
+                                                 : COtpChannelDispatch<TRest...>::Answer(dwChannel, pChallenge, pszCode);
+    }
+};
+
+typedef COtpChannelDispatch<COtpSmsChannel, COtpEmailChannel, COtpPushChannel, COtpAppChannel> COtpChannels;
+
+// The channels to deliver mfaFactor's challenge on: the factor's own channel, plus whatever
+// Otp\Channels adds. App codes are never raced, since there is nothing to deliver.
+DWORD OtpChannelsForFactor(MFA_FACTOR mfaFactor);
+
+// Sends pszUserName a challenge on each channel in dwChannels that pDelivery does not have live
+// yet, all at once, and adds those that went out; a push approval is watched from then on.
+// With pszUserSid, challenges in flight elsewhere are joined instead. An empty pDelivery is
+// bound to the user; one with live challenges for somebody else is left alone, and
+// E_ACCESSDENIED returned. Returns S_OK when pDelivery has at least one live challenge
+// afterwards, and the first failure otherwise.
+HRESULT DeliverOtpChallenge(_In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid, DWORD dwChannels, _Inout_ OTP_DELIVERY *pDelivery);
+
+// Whether pDelivery's challenges went to pszUserName: the normalized names must match, and so
+// must the SIDs when both are known.
+bool IsOtpDeliveryFor(_In_ const OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid);
+
+// Checks pszCode, or with no code a push approval, that pszUserName submitted against every live
+// channel at once. The first to accept wins: S_OK, with the other channels cancelled, shared ones
+// included, and pDelivery emptied. Otherwise expired channels are dropped, and the result is
+// E_ACCESSDENIED when any channel refused, E_PENDING when one is still waiting for its answer,
+// HRESULT_FROM_WIN32(ERROR_TIMEOUT) when none is left, or the gateway's error. A delivery that
+// is not for pszUserName is E_ACCESSDENIED without asking the gateway.
+HRESULT AnswerOtpDelivery(_Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid, _In_opt_ PCWSTR pszCode);
+
+// S_OK when the approval watcher has seen pDelivery's push approved, so the submit will go
+// through without a code.
+HRESULT GetOtpDeliveryApproval(_In_ const OTP_DELIVERY *pDelivery);
+
+// Cancels pDelivery's live challenges at the gateway, in the background, and empties it. Shared
+// challenges are left to expire, since another credential may still be waiting on them.
+void CancelOtpDelivery(_Inout_ OTP_DELIVERY *pDelivery);
+
+// The gateway side of a second-factor submit, run on the thread pool so LogonUI's thread never
+// waits on the network: answering a delivery, or delivering the challenge after taking over the
+// one requested while the password was typed. The delivery moves into the call while it runs and
+// comes back through TakeResult. PE_OTP_CHECKED is signaled once it is done, and the provider
+// then submits the tile again to pick up the result.
+class COtpSubmit
+{
+public:
+    // Checks pszCode, or with no code a push approval, against *pDelivery (see AnswerOtpDelivery).
+    // *pDelivery is emptied until TakeResult hands it back.
+    static HRESULT StartAnswer(_Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid,
+                               _In_opt_ PCWSTR pszCode, _Outptr_ COtpSubmit **ppSubmit);
+
+    // Takes over pPending's delivery, when there is one, then sends pszUserName whatever else of
+    // dwChannels is not live yet (see DeliverOtpChallenge). pPending is the call's from then on,
+    // even when it cannot be started. *pDelivery is emptied until TakeResult hands it back.
+    static HRESULT StartDelivery(_Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid,
+                                 DWORD dwChannels, _In_opt_ CPendingOtpChallenge *pPending, _Outptr_ COtpSubmit **ppSubmit);
+
+    ULONG AddRef();
+    ULONG Release();
+
+    // Whether this call answers a delivery rather than sending one.
+    bool IsAnswer() const;
+
+    // Whether the result is in.
+    bool IsDone() const;
+
+    // Hands the delivery back once the call is done, and returns what AnswerOtpDelivery or
+    // DeliverOtpChallenge returned; E_ABORT when it is not done, was cancelled or was taken.
+    HRESULT TakeResult(_Out_ OTP_DELIVERY *pDelivery);
+
+    // Abandons the call. Its challenges are cancelled at the gateway as soon as it is done.
+    void Cancel();
+
+private:
+    COtpSubmit(bool fAnswer);
+    ~COtpSubmit();
+
+    static HRESULT s_Start(_In_ COtpSubmit *pSubmit, _Inout_ OTP_DELIVERY *pDelivery, _In_ PCWSTR pszUserName,
+                           _In_opt_ PCWSTR pszUserSid, _Outptr_ COtpSubmit **ppSubmit);
+    static DWORD WINAPI s_ThreadProc(_In_ LPVOID lpParameter);
+
+    long                            _cRef;
+    bool                            _fAnswer;
+    volatile long                   _fDone;
+    volatile long                   _fCancelled;
+    volatile long                   _fClaimed;          // Set by whichever of TakeResult and Cancel takes _delivery.
+    PWSTR                           _pszUserName;
+    PWSTR                           _pszUserSid;
+    PWSTR                           _pszCode;
+    DWORD                           _dwChannels;
+    CPendingOtpChallenge            *_pPending;
+    HRESULT                         _hr;
+    OTP_DELIVERY                    _delivery;
+};
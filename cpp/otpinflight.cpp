@@ -0,0 +1,242 @@
+#include "otpinflight.h"
+#include "sharedtable.h"
+#include "utils.h"
+
+namespace
+{
+    const DWORD c_dwDefaultTimeoutMs = 5000;
+    const DWORD c_dwJoinPollMs = 50;
+    const DWORD c_cSharedSlots = 64;
+    const DWORD c_cLocalSlots = 16;
+
+    // A challenge this close to its expiry is not handed out: the user could not type its code in
+    // time. Its entry expires this much early.
+    const ULONGLONG c_ullMinJoinLifetime = 30 * c_ullSharedTableTicksPerSecond;
+
+    enum INFLIGHT_STATE
+    {
+        IFS_SENDING = 1,        // Claimed; the challenge is on its way.
+        IFS_ISSUED  = 2,        // The gateway has issued the challenge.
+    };
+
+    struct INFLIGHT_ENTRY
+    {
+        BYTE            bState;         // IFS_*
+        BYTE            bChannel;       // OTP_CHANNEL_* bit.
+        WORD            wReserved;
+        DWORD           dwProcessId;    // The sender.
+        wchar_t         szUserSid[SECURITY_MAX_SID_STRING_CHARACTERS];
+        OTP_CHALLENGE   challenge;      // Set once IFS_ISSUED.
+    };
+
+    INIT_ONCE s_initTables = INIT_ONCE_STATIC_INIT;
+    CSharedTable *s_pSharedTable = nullptr;
+    CSharedTable *s_pLocalTable = nullptr;  // Used when this process cannot write the shared one.
+
+    BOOL CALLBACK OpenInFlightTables(PINIT_ONCE, PVOID, PVOID *)
+    {
+        if (FAILED(CSharedTable::Open(L"otpinflight", c_cSharedSlots, sizeof(INFLIGHT_ENTRY), &s_pSharedTable)))
+        {
+            s_pSharedTable = nullptr;
+        }
+        if (s_pSharedTable == nullptr || !s_pSharedTable->IsWritable())
+        {
+            if (FAILED(CSharedTable::Open(nullptr, c_cLocalSlots, sizeof(INFLIGHT_ENTRY), &s_pLocalTable)))
+            {
+                s_pLocalTable = nullptr;
+            }
+        }
+        return TRUE;
+    }
+
+    // The table this process claims and publishes in.
+    CSharedTable *WritableTable()
+    {
+        InitOnceExecuteOnce(&s_initTables, OpenInFlightTables, nullptr, nullptr);
+        return (s_pLocalTable != nullptr) ? s_pLocalTable : s_pSharedTable;
+    }
+
+    ULONGLONG HashString(ULONGLONG ullHash, _In_ PCWSTR psz)
+    {
+        for (PCWSTR pch = psz; *pch != L'\0'; pch++)
+        {
+            ullHash = (ullHash ^ *pch) * 0x100000001B3ull;
+        }
+        return ullHash;
+    }
+
+    // The user, the channel and the gateway cluster. Processes with different Otp\Servers do not
+    // share challenges.
+    ULONGLONG InFlightKey(_In_ PCWSTR pszUserSid, DWORD dwChannel)
+    {
+        ULONGLONG ullHash = HashString(0xCBF29CE484222325ull ^ dwChannel, pszUserSid);
+        CConfigSnapshot *pSnapshot;
+        if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+        {
+            DWORD cServers;
+            const CONFIG_OTP_SERVER *rgServers = pSnapshot->OtpServers(&cServers);
+            if (cServers != 0)
+            {
+                ullHash = HashString(ullHash, rgServers[0].szUrl);
+            }
+            pSnapshot->Release();
+        }
+        return ullHash;
+    }
+
+    // Reads the entry for pszUserSid and dwChannel from the shared table, then from the local one,
+    // and returns its state; 0 when there is none. The table key is only a hash, so the SID and
+    // channel stored in the entry have to match as well.
+    BYTE ReadEntry(ULONGLONG ullKey, _In_ PCWSTR pszUserSid, DWORD dwChannel, _Out_ INFLIGHT_ENTRY *pEntry)
+    {
+        CSharedTable *rgpTables[] = { s_pSharedTable, s_pLocalTable };
+        for (CSharedTable *pTable : rgpTables)
+        {
+            DWORD cbEntry;
+            if (pTable != nullptr &&
+                pTable->Read(ullKey, pEntry, sizeof(*pEntry), &cbEntry, nullptr) &&
+                cbEntry == sizeof(*pEntry) &&
+                pEntry->bChannel == dwChannel &&
+                (pEntry->bState == IFS_SENDING || pEntry->bState == IFS_ISSUED))
+            {
+                pEntry->szUserSid[ARRAYSIZE(pEntry->szUserSid) - 1] = L'\0';
+                pEntry->challenge.szChallengeId[ARRAYSIZE(pEntry->challenge.szChallengeId) - 1] = L'\0';
+                pEntry->challenge.szServerUrl[ARRAYSIZE(pEntry->challenge.szServerUrl) - 1] = L'\0';
+                if (CompareStringOrdinal(pEntry->szUserSid, -1, pszUserSid, -1, TRUE) == CSTR_EQUAL)
+                {
+                    return pEntry->bState;
+                }
+            }
+        }
+        SecureZeroMemory(pEntry, sizeof(*pEntry));
+        return 0;
+    }
+
+    HRESULT InitEntry(BYTE bState, _In_ PCWSTR pszUserSid, DWORD dwChannel, _Out_ INFLIGHT_ENTRY *pEntry)
+    {
+        ZeroMemory(pEntry, sizeof(*pEntry));
+        pEntry->bState = bState;
+        pEntry->bChannel = static_cast<BYTE>(dwChannel);
+        pEntry->dwProcessId = GetCurrentProcessId();
+        return StringCchCopyW(pEntry->szUserSid, ARRAYSIZE(pEntry->szUserSid), pszUserSid);
+    }
+
+    void LogInFlight(_In_z_ LPCWSTR context, DWORD dwChannel, DWORD dwProcessId)
+    {
+        wchar_t buffer[128] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[OTP] %s channel=0x%X process=%u", context, dwChannel, dwProcessId)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+}
+
+HRESULT JoinOtpChallenge(_In_ PCWSTR pszUserSid, DWORD dwChannel, _Out_ OTP_CHALLENGE *pChallenge)
+{
+    ZeroMemory(pChallenge, sizeof(*pChallenge));
+    CSharedTable *pWritable = WritableTable();
+    INFLIGHT_ENTRY claim;
+    if (*pszUserSid == L'\0' || FAILED(InitEntry(IFS_SENDING, pszUserSid, dwChannel, &claim)))
+    {
+        return S_FALSE;
+    }
+
+    // A claim lasts as long as CPendingOtpChallenge::Wait gives a send, and so does our wait on
+    // somebody else's.
+    DWORD dwTimeoutMs = c_dwDefaultTimeoutMs;
+    CConfigSnapshot *pSnapshot;
+    if (SUCCEEDED(GetConfigSnapshot(&pSnapshot)))
+    {
+        dwTimeoutMs = pSnapshot->OtpTimeout(c_dwDefaultTimeoutMs);
+        pSnapshot->Release();
+    }
+    ULONGLONG ullClaimTtl = 4ull * dwTimeoutMs * (c_ullSharedTableTicksPerSecond / 1000);
+    ULONGLONG ullDeadline = GetTickCount64() + 4ull * dwTimeoutMs;
+
+    ULONGLONG ullKey = InFlightKey(pszUserSid, dwChannel);
+    bool fClaimLost = false;
+    HRESULT hr = S_FALSE;
+    for (;;)
+    {
+        INFLIGHT_ENTRY entry;
+        BYTE bState = ReadEntry(ullKey, pszUserSid, dwChannel, &entry);
+        if (bState == IFS_ISSUED)
+        {
+            *pChallenge = entry.challenge;
+            LogInFlight(L"joined challenge", dwChannel, entry.dwProcessId);
+            hr = S_OK;
+            SecureZeroMemory(&entry, sizeof(entry));
+            break;
+        }
+        if (bState == 0)
+        {
+            // Losing the claim means another sender got there first; its entry is read on the next
+            // pass. Losing it with no entry to show for it means the slot is stuck, so send anyway.
+            if (pWritable == nullptr || fClaimLost ||
+                pWritable->Insert(ullKey, &claim, sizeof(claim), GetSharedTableTime() + ullClaimTtl))
+            {
+                break;
+            }
+            fClaimLost = true;
+            continue;
+        }
+        if (GetTickCount64() >= ullDeadline)
+        {
+            // The sender is stuck; do not wait on it any longer.
+            LogInFlight(L"claimed send timed out", dwChannel, entry.dwProcessId);
+            break;
+        }
+        Sleep(c_dwJoinPollMs);
+    }
+    return hr;
+}
+
+bool PublishOtpChallenge(_In_ PCWSTR pszUserSid, DWORD dwChannel, _In_opt_ const OTP_CHALLENGE *pChallenge)
+{
+    CSharedTable *pWritable = WritableTable();
+    INFLIGHT_ENTRY entry;
+    if (pWritable == nullptr || *pszUserSid == L'\0' ||
+        FAILED(InitEntry(IFS_ISSUED, pszUserSid, dwChannel, &entry)))
+    {
+        return false;
+    }
+
+    bool fPublished = false;
+    ULONGLONG ullKey = InFlightKey(pszUserSid, dwChannel);
+    if (pChallenge != nullptr)
+    {
+        entry.challenge = *pChallenge;
+        ULONGLONG ullExpires = pChallenge->ullExpires - c_ullMinJoinLifetime;
+        fPublished = (pChallenge->ullExpires > c_ullMinJoinLifetime) &&
+                     pWritable->Write(ullKey, &entry, sizeof(entry), ullExpires);
+    }
+    else
+    {
+        // Only our own claim is dropped; an expiry in the past frees the slot.
+        INFLIGHT_ENTRY current;
+        if (ReadEntry(ullKey, pszUserSid, dwChannel, &current) == IFS_SENDING && current.dwProcessId == entry.dwProcessId)
+        {
+            entry.bState = IFS_SENDING;
+            pWritable->Write(ullKey, &entry, sizeof(entry), 1);
+        }
+    }
+    SecureZeroMemory(&entry, sizeof(entry));
+    return fPublished;
+}
+
+void RetireOtpChallenge(_In_ PCWSTR pszUserSid, DWORD dwChannel, _In_ const OTP_CHALLENGE *pChallenge)
+{
+    CSharedTable *pWritable = WritableTable();
+    if (pWritable == nullptr || *pszUserSid == L'\0')
+    {
+        return;
+    }
+    ULONGLONG ullKey = InFlightKey(pszUserSid, dwChannel);
+    INFLIGHT_ENTRY entry;
+    if (ReadEntry(ullKey, pszUserSid, dwChannel, &entry) == IFS_ISSUED &&
+        CompareStringOrdinal(entry.challenge.szChallengeId, -1, pChallenge->szChallengeId, -1, FALSE) == CSTR_EQUAL)
+    {
+        pWritable->Write(ullKey, &entry, sizeof(entry), 1);
+    }
+    SecureZeroMemory(&entry, sizeof(entry));
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "otpclient.h"
+
+// Second-factor challenges in flight, shared across processes.
+//
+// LogonUI, CredUI and consent.exe each load their own copy of the provider. A user who has two
+// of them asking at once, such as a UAC prompt raised over a CredUI prompt, would otherwise be
+// sent one text per process, and only the last would work. Every challenge a process sends is
+// therefore published in a CSharedTable until it expires. The key is the user's SID, the channel
+// and the gateway cluster, which is the first of Otp\Servers. A process about to send a
+// challenge looks there first and joins a live one instead.
+//
+// The table takes no lock. The sender claims the send with CSharedTable::Insert, so when two
+// processes race for the same user only one of them sends. The other polls the entry until the
+// sender publishes the challenge or drops the claim. A claim lasts only as long as a send can
+// take, so a sender that dies holds the others back for no longer than that.
+//
+// Only SYSTEM and Administrators can write the shared table. CredUI in a user's session joins
+// what LogonUI and consent.exe publish, but keeps the challenges it sends in a private table.
+
+// Returns S_OK with the challenge when one is live for pszUserSid on dwChannel, waiting for a
+// send another process has claimed. Returns S_FALSE when the caller is to send it; the send is
+// claimed, and PublishOtpChallenge must follow.
+HRESULT JoinOtpChallenge(_In_ PCWSTR pszUserSid, DWORD dwChannel, _Out_ OTP_CHALLENGE *pChallenge);
+
+// Publishes the challenge sent after JoinOtpChallenge returned S_FALSE or, with nullptr after a
+// failed send, drops the claim. Returns whether the challenge is now in a table, where other
+// credentials may join it.
+bool PublishOtpChallenge(_In_ PCWSTR pszUserSid, DWORD dwChannel, _In_opt_ const OTP_CHALLENGE *pChallenge);
+
+// Removes pChallenge from the table once it has been answered or cancelled, unless another
+// challenge has replaced it there.
+void RetireOtpChallenge(_In_ PCWSTR pszUserSid, DWORD dwChannel, _In_ const OTP_CHALLENGE *pChallenge);
@@ -0,0 +1,520 @@
+#include "otpresponse.h"
+#include <string.h>
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#include <intrin.h>
+#define OTP_RESPONSE_SSE2
+#endif
+
+namespace
+{
+    // Deeper nesting than this in a skipped value fails the parse.
+    const DWORD c_cMaxSkipDepth = 32;
+    const size_t c_cchMaxFieldName = 16;
+    const size_t c_cchMaxScalar = 24;
+
+    struct FIELD_NAME
+    {
+        PCSTR       pszName;
+        DWORD       dwField;
+    };
+
+    const FIELD_NAME c_rgFields[] =
+    {
+        { "status",     ORF_STATUS },
+        { "challenge",  ORF_CHALLENGE },
+        { "expiry",     ORF_EXPIRY },
+        { "message",    ORF_MESSAGE },
+    };
+
+    bool IsWhitespace(char ch)
+    {
+        return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+    }
+
+    bool IsScalarChar(char ch)
+    {
+        return (ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') || ch == '-' || ch == '+' || ch == '.';
+    }
+
+    DWORD SkipWhitespace(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, DWORD ich)
+    {
+        while (ich < cbBody && IsWhitespace(pchBody[ich]))
+        {
+            ich++;
+        }
+        return ich;
+    }
+
+    // The index of the first quote, backslash or control character at or after ich, or cbBody.
+    // These are the only bytes inside a string that need a look.
+    DWORD ScanString(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, DWORD ich)
+    {
+#ifdef OTP_RESPONSE_SSE2
+        const __m128i vQuote = _mm_set1_epi8('"');
+        const __m128i vBackslash = _mm_set1_epi8('\\');
+        const __m128i vControl = _mm_set1_epi8(0x1F);
+        for (; cbBody - ich >= sizeof(__m128i); ich += sizeof(__m128i))
+        {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pchBody + ich));
+            // min(v, 0x1F) == v exactly when v <= 0x1F, unsigned.
+            __m128i vHit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, vQuote), _mm_cmpeq_epi8(v, vBackslash)),
+                                        _mm_cmpeq_epi8(_mm_min_epu8(v, vControl), v));
+            int iMask = _mm_movemask_epi8(vHit);
+            if (iMask != 0)
+            {
+                unsigned long iBit;
+                _BitScanForward(&iBit, static_cast<unsigned long>(iMask));
+                return ich + iBit;
+            }
+        }
+#endif
+        for (; ich < cbBody; ich++)
+        {
+            BYTE b = static_cast<BYTE>(pchBody[ich]);
+            if (b == '"' || b == '\\' || b < 0x20)
+            {
+                break;
+            }
+        }
+        return ich;
+    }
+
+    // Appends up to what still fits in pszValue, keeping room for the terminator. With no buffer
+    // the bytes are only counted as dropped.
+    void AppendBytes(_Inout_updates_opt_(cchValue) char *pszValue, size_t cchValue, _Inout_ size_t *pcch,
+                     _In_reads_(cchAppend) const char *pchAppend, size_t cchAppend, _Inout_ bool *pfTruncated)
+    {
+        size_t cchCopy = 0;
+        if (pszValue != nullptr && cchValue > *pcch + 1)
+        {
+            cchCopy = min(cchAppend, cchValue - *pcch - 1);
+            CopyMemory(pszValue + *pcch, pchAppend, cchCopy);
+            *pcch += cchCopy;
+        }
+        if (cchCopy < cchAppend && pszValue != nullptr)
+        {
+            *pfTruncated = true;
+        }
+    }
+
+    bool ReadHex4(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, DWORD ich, _Out_ DWORD *pdwValue)
+    {
+        *pdwValue = 0;
+        if (cbBody - ich < 4)
+        {
+            return false;
+        }
+        for (DWORD i = 0; i < 4; i++)
+        {
+            char ch = pchBody[ich + i];
+            DWORD dwDigit;
+            if (ch >= '0' && ch <= '9')
+            {
+                dwDigit = ch - '0';
+            }
+            else if (ch >= 'a' && ch <= 'f')
+            {
+                dwDigit = ch - 'a' + 10;
+            }
+            else if (ch >= 'A' && ch <= 'F')
+            {
+                dwDigit = ch - 'A' + 10;
+            }
+            else
+            {
+                return false;
+            }
+            *pdwValue = (*pdwValue << 4) | dwDigit;
+        }
+        return true;
+    }
+
+    // Decodes the \u escape whose hex digits start at *pich, with the low half of a surrogate pair
+    // when one follows, into UTF-8. NUL and unpaired surrogates are refused.
+    bool ReadUnicodeEscape(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Inout_ DWORD *pich,
+                           _Out_writes_(4) char *rgchUtf8, _Out_ size_t *pcchUtf8)
+    {
+        *pcchUtf8 = 0;
+        DWORD dwCodePoint;
+        if (!ReadHex4(pchBody, cbBody, *pich, &dwCodePoint) || dwCodePoint == 0 || (dwCodePoint >= 0xDC00 && dwCodePoint <= 0xDFFF))
+        {
+            return false;
+        }
+        *pich += 4;
+        if (dwCodePoint >= 0xD800 && dwCodePoint <= 0xDBFF)
+        {
+            DWORD dwLow;
+            if (cbBody - *pich < 2 || pchBody[*pich] != '\\' || pchBody[*pich + 1] != 'u' ||
+                !ReadHex4(pchBody, cbBody, *pich + 2, &dwLow) || dwLow < 0xDC00 || dwLow > 0xDFFF)
+            {
+                return false;
+            }
+            *pich += 6;
+            dwCodePoint = 0x10000 + ((dwCodePoint - 0xD800) << 10) + (dwLow - 0xDC00);
+        }
+
+        if (dwCodePoint < 0x80)
+        {
+            rgchUtf8[0] = static_cast<char>(dwCodePoint);
+            *pcchUtf8 = 1;
+        }
+        else if (dwCodePoint < 0x800)
+        {
+            rgchUtf8[0] = static_cast<char>(0xC0 | (dwCodePoint >> 6));
+            rgchUtf8[1] = static_cast<char>(0x80 | (dwCodePoint & 0x3F));
+            *pcchUtf8 = 2;
+        }
+        else if (dwCodePoint < 0x10000)
+        {
+            rgchUtf8[0] = static_cast<char>(0xE0 | (dwCodePoint >> 12));
+            rgchUtf8[1] = static_cast<char>(0x80 | ((dwCodePoint >> 6) & 0x3F));
+            rgchUtf8[2] = static_cast<char>(0x80 | (dwCodePoint & 0x3F));
+            *pcchUtf8 = 3;
+        }
+        else
+        {
+            rgchUtf8[0] = static_cast<char>(0xF0 | (dwCodePoint >> 18));
+            rgchUtf8[1] = static_cast<char>(0x80 | ((dwCodePoint >> 12) & 0x3F));
+            rgchUtf8[2] = static_cast<char>(0x80 | ((dwCodePoint >> 6) & 0x3F));
+            rgchUtf8[3] = static_cast<char>(0x80 | (dwCodePoint & 0x3F));
+            *pcchUtf8 = 4;
+        }
+        return true;
+    }
+
+    // Reads the string whose opening quote is at *pich and moves past its closing one. Escapes are
+    // decoded into pszValue, when given; *pfTruncated says whether the string did not fit.
+    bool ReadString(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Inout_ DWORD *pich,
+                    _Out_writes_opt_z_(cchValue) char *pszValue, size_t cchValue, _Out_ bool *pfTruncated)
+    {
+        *pfTruncated = false;
+        size_t cch = 0;
+        DWORD ich = *pich + 1;
+        for (;;)
+        {
+            DWORD ichStop = ScanString(pchBody, cbBody, ich);
+            AppendBytes(pszValue, cchValue, &cch, pchBody + ich, ichStop - ich, pfTruncated);
+            if (ichStop >= cbBody || pchBody[ichStop] != '\\')
+            {
+                // The end of the body, or a raw control character, is as bad as a missing quote.
+                if (ichStop >= cbBody || pchBody[ichStop] != '"')
+                {
+                    return false;
+                }
+                ich = ichStop + 1;
+                break;
+            }
+
+            if (cbBody - ichStop < 2)
+            {
+                return false;
+            }
+            ich = ichStop + 2;
+            char rgchDecoded[4];
+            size_t cchDecoded = 1;
+            switch (pchBody[ichStop + 1])
+            {
+            case '"':
+            case '\\':
+            case '/':
+                rgchDecoded[0] = pchBody[ichStop + 1];
+                break;
+            case 'b':
+                rgchDecoded[0] = '\b';
+                break;
+            case 'f':
+                rgchDecoded[0] = '\f';
+                break;
+            case 'n':
+                rgchDecoded[0] = '\n';
+                break;
+            case 'r':
+                rgchDecoded[0] = '\r';
+                break;
+            case 't':
+                rgchDecoded[0] = '\t';
+                break;
+            case 'u':
+                if (!ReadUnicodeEscape(pchBody, cbBody, &ich, rgchDecoded, &cchDecoded))
+                {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+            }
+            AppendBytes(pszValue, cchValue, &cch, rgchDecoded, cchDecoded, pfTruncated);
+        }
+
+        if (pszValue != nullptr && cchValue > 0)
+        {
+            pszValue[cch] = '\0';
+        }
+        *pich = ich;
+        return true;
+    }
+
+    // Reads a number or a literal such as true or null.
+    bool ReadScalar(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Inout_ DWORD *pich,
+                    _Out_writes_opt_z_(cchValue) char *pszValue, size_t cchValue, _Out_ bool *pfTruncated)
+    {
+        *pfTruncated = false;
+        DWORD ichStart = *pich;
+        DWORD ich = ichStart;
+        while (ich < cbBody && IsScalarChar(pchBody[ich]))
+        {
+            ich++;
+        }
+        if (ich == ichStart)
+        {
+            return false;
+        }
+        size_t cch = 0;
+        AppendBytes(pszValue, cchValue, &cch, pchBody + ichStart, ich - ichStart, pfTruncated);
+        if (pszValue != nullptr && cchValue > 0)
+        {
+            pszValue[cch] = '\0';
+        }
+        *pich = ich;
+        return true;
+    }
+
+    // Reads a string or a scalar.
+    bool ReadValue(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Inout_ DWORD *pich,
+                   _Out_writes_opt_z_(cchValue) char *pszValue, size_t cchValue, _Out_ bool *pfQuoted, _Out_ bool *pfTruncated)
+    {
+        *pfQuoted = (*pich < cbBody && pchBody[*pich] == '"');
+        return *pfQuoted ? ReadString(pchBody, cbBody, pich, pszValue, cchValue, pfTruncated)
+                         : ReadScalar(pchBody, cbBody, pich, pszValue, cchValue, pfTruncated);
+    }
+
+    // Skips one value of any kind. Nested objects and arrays are only checked for balance.
+    bool SkipValue(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Inout_ DWORD *pich)
+    {
+        DWORD ich = *pich;
+        DWORD cDepth = 0;
+        do
+        {
+            ich = SkipWhitespace(pchBody, cbBody, ich);
+            if (ich >= cbBody)
+            {
+                return false;
+            }
+            char ch = pchBody[ich];
+            bool fTruncated;
+            if (ch == '{' || ch == '[')
+            {
+                if (++cDepth > c_cMaxSkipDepth)
+                {
+                    return false;
+                }
+                ich++;
+            }
+            else if (ch == '}' || ch == ']')
+            {
+                if (cDepth-- == 0)
+                {
+                    return false;
+                }
+                ich++;
+            }
+            else if (ch == ',' || ch == ':')
+            {
+                if (cDepth == 0)
+                {
+                    return false;
+                }
+                ich++;
+            }
+            else if (!(ch == '"' ? ReadString(pchBody, cbBody, &ich, nullptr, 0, &fTruncated)
+                                 : ReadScalar(pchBody, cbBody, &ich, nullptr, 0, &fTruncated)))
+            {
+                return false;
+            }
+        } while (cDepth > 0);
+        *pich = ich;
+        return true;
+    }
+
+    OTP_RESPONSE_STATUS StatusFromName(_In_ PCSTR pszStatus)
+    {
+        if (strcmp(pszStatus, "ok") == 0)
+        {
+            return ORS_OK;
+        }
+        if (strcmp(pszStatus, "denied") == 0)
+        {
+            return ORS_DENIED;
+        }
+        if (strcmp(pszStatus, "expired") == 0)
+        {
+            return ORS_EXPIRED;
+        }
+        if (strcmp(pszStatus, "pending") == 0)
+        {
+            return ORS_PENDING;
+        }
+        return ORS_OTHER;
+    }
+
+    // A whole number of seconds; at most ten digits, so it cannot overflow.
+    bool SecondsFromText(_In_ PCSTR pszValue, _Out_ ULONGLONG *pullSeconds)
+    {
+        *pullSeconds = 0;
+        size_t cch = 0;
+        for (PCSTR pch = pszValue; *pch != '\0'; pch++, cch++)
+        {
+            if (*pch < '0' || *pch > '9' || cch >= 10)
+            {
+                return false;
+            }
+            *pullSeconds = *pullSeconds * 10 + (*pch - '0');
+        }
+        return cch > 0;
+    }
+
+    // Reads the value of one field we use into pResponse.
+    bool ReadField(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Inout_ DWORD *pich, DWORD dwField, _Inout_ OTP_RESPONSE *pResponse)
+    {
+        bool fQuoted;
+        bool fTruncated;
+        char szScalar[c_cchMaxScalar];
+        switch (dwField)
+        {
+        case ORF_STATUS:
+            if (!ReadValue(pchBody, cbBody, pich, szScalar, ARRAYSIZE(szScalar), &fQuoted, &fTruncated) || !fQuoted)
+            {
+                return false;
+            }
+            pResponse->status = fTruncated ? ORS_OTHER : StatusFromName(szScalar);
+            break;
+
+        case ORF_CHALLENGE:
+            if (!ReadValue(pchBody, cbBody, pich, pResponse->szChallengeId, ARRAYSIZE(pResponse->szChallengeId), &fQuoted, &fTruncated) ||
+                fTruncated || pResponse->szChallengeId[0] == '\0')
+            {
+                return false;
+            }
+            break;
+
+        case ORF_EXPIRY:
+            if (!ReadValue(pchBody, cbBody, pich, szScalar, ARRAYSIZE(szScalar), &fQuoted, &fTruncated))
+            {
+                return false;
+            }
+            if (fTruncated || !SecondsFromText(szScalar, &pResponse->ullExpirySeconds))
+            {
+                pResponse->ullExpirySeconds = 0;
+                dwField = 0;
+            }
+            break;
+
+        case ORF_MESSAGE:
+            if (*pich < cbBody && pchBody[*pich] == '"')
+            {
+                if (!ReadString(pchBody, cbBody, pich, pResponse->szMessage, ARRAYSIZE(pResponse->szMessage), &fTruncated))
+                {
+                    return false;
+                }
+            }
+            else if (!SkipValue(pchBody, cbBody, pich))
+            {
+                return false;
+            }
+            else
+            {
+                dwField = 0;
+            }
+            break;
+
+        default:
+            return SkipValue(pchBody, cbBody, pich);
+        }
+        pResponse->dwFields |= dwField;
+        return true;
+    }
+}
+
+HRESULT ParseOtpResponse(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Out_ OTP_RESPONSE *pResponse)
+{
+    ZeroMemory(pResponse, sizeof(*pResponse));
+
+    bool fValid = false;
+    DWORD ich = SkipWhitespace(pchBody, cbBody, 0);
+    if (ich < cbBody && pchBody[ich] == '{')
+    {
+        ich = SkipWhitespace(pchBody, cbBody, ich + 1);
+        fValid = (ich < cbBody && pchBody[ich] == '}');
+        while (!fValid && ich < cbBody && pchBody[ich] == '"')
+        {
+            char szName[c_cchMaxFieldName];
+            bool fTruncated;
+            if (!ReadString(pchBody, cbBody, &ich, szName, ARRAYSIZE(szName), &fTruncated))
+            {
+                break;
+            }
+            ich = SkipWhitespace(pchBody, cbBody, ich);
+            if (ich >= cbBody || pchBody[ich] != ':')
+            {
+                break;
+            }
+            ich = SkipWhitespace(pchBody, cbBody, ich + 1);
+
+            DWORD dwField = 0;
+            for (DWORD i = 0; !fTruncated && dwField == 0 && i < ARRAYSIZE(c_rgFields); i++)
+            {
+                dwField = (strcmp(szName, c_rgFields[i].pszName) == 0) ? c_rgFields[i].dwField : 0;
+            }
+            // A field given twice could mean one thing to us and another to the gateway.
+            if ((dwField & pResponse->dwFields) || !ReadField(pchBody, cbBody, &ich, dwField, pResponse))
+            {
+                break;
+            }
+
+            ich = SkipWhitespace(pchBody, cbBody, ich);
+            if (ich < cbBody && pchBody[ich] == ',')
+            {
+                ich = SkipWhitespace(pchBody, cbBody, ich + 1);
+            }
+            else
+            {
+                fValid = (ich < cbBody && pchBody[ich] == '}');
+                break;
+            }
+        }
+    }
+    if (fValid)
+    {
+        fValid = (SkipWhitespace(pchBody, cbBody, ich + 1) == cbBody);
+    }
+
+    if (!fValid)
+    {
+        SecureZeroMemory(pResponse, sizeof(*pResponse));
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    return S_OK;
+}
+
+HRESULT OtpResponseStatus(_In_ const OTP_RESPONSE *pResponse)
+{
+    if (!(pResponse->dwFields & ORF_STATUS))
+    {
+        return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+    switch (pResponse->status)
+    {
+    case ORS_OK:
+        return S_OK;
+    case ORS_DENIED:
+        return E_ACCESSDENIED;
+    case ORS_EXPIRED:
+        return HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    case ORS_PENDING:
+        return E_PENDING;
+    default:
+        return E_FAIL;
+    }
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <windows.h>
+
+// SendQuick response parsing.
+//
+// Gateway answers are small JSON objects (see otpclient.h). They are read in a single forward
+// pass, without allocating, into an OTP_RESPONSE: the fields we use are decoded into its fixed
+// buffers and everything else is skipped, nested values included. Nothing of the body is copied
+// anywhere else, so a response holding a challenge ID leaves no trace once the caller has wiped
+// its own buffer and the OTP_RESPONSE.
+//
+// String bodies are scanned 16 bytes at a time with SSE2 where the target has it, and a byte at a
+// time otherwise.
+//
+// Only Windows types are needed here, so the parser also builds outside the provider: see
+// tests/otpresponse_test.cpp, which runs it over the seed corpus in tests/otpresponse.
+
+const DWORD c_cchMaxChallengeId = 64;
+const DWORD c_cchMaxResponseMessage = 256;
+
+enum OTP_RESPONSE_STATUS
+{
+    ORS_NONE,
+    ORS_OK,
+    ORS_DENIED,
+    ORS_EXPIRED,
+    ORS_PENDING,
+    ORS_OTHER,          // A status we do not know.
+};
+
+enum OTP_RESPONSE_FIELDS
+{
+    ORF_STATUS      = 0x1,
+    ORF_CHALLENGE   = 0x2,
+    ORF_EXPIRY      = 0x4,
+    ORF_MESSAGE     = 0x8,
+};
+
+struct OTP_RESPONSE
+{
+    DWORD               dwFields;                           // ORF_* bits present.
+    OTP_RESPONSE_STATUS status;
+    ULONGLONG           ullExpirySeconds;
+    char                szChallengeId[c_cchMaxChallengeId]; // UTF-8.
+    char                szMessage[c_cchMaxResponseMessage]; // UTF-8, cut short when longer.
+};
+
+// Parses the JSON object in pchBody. Returns HRESULT_FROM_WIN32(ERROR_INVALID_DATA) when the body
+// is not a well-formed object, names a field we use twice, or has a challenge ID that is empty or
+// does not fit. An expiry that is not a whole number of seconds is left out.
+HRESULT ParseOtpResponse(_In_reads_bytes_(cbBody) const char *pchBody, DWORD cbBody, _Out_ OTP_RESPONSE *pResponse);
+
+// Maps the status to an HRESULT: S_OK, E_ACCESSDENIED, HRESULT_FROM_WIN32(ERROR_TIMEOUT) for
+// "expired" and E_PENDING; E_FAIL for a status we do not know, and
+// HRESULT_FROM_WIN32(ERROR_INVALID_DATA) when there is none.
+HRESULT OtpResponseStatus(_In_ const OTP_RESPONSE *pResponse);
@@ -0,0 +1,218 @@
+#include "providerevents.h"
+#include <iphlpapi.h>
+#include "utils.h"
+
+namespace
+{
+    // Advised event sources in this process. LogonUI hosts a single provider instance per
+    // scenario, so a small fixed table is plenty.
+    const DWORD c_cMaxEventSources = 8;
+
+    SRWLOCK s_srwEventSources = SRWLOCK_INIT;
+    CProviderEventSource *s_rgpEventSources[c_cMaxEventSources] = {};
+
+    bool RegisterEventSource(_In_ CProviderEventSource *pSource)
+    {
+        bool fRegistered = false;
+        AcquireSRWLockExclusive(&s_srwEventSources);
+        for (DWORD i = 0; i < c_cMaxEventSources && !fRegistered; i++)
+        {
+            if (s_rgpEventSources[i] == nullptr)
+            {
+                s_rgpEventSources[i] = pSource;
+                fRegistered = true;
+            }
+        }
+        ReleaseSRWLockExclusive(&s_srwEventSources);
+        return fRegistered;
+    }
+
+    void UnregisterEventSource(_In_ CProviderEventSource *pSource)
+    {
+        AcquireSRWLockExclusive(&s_srwEventSources);
+        for (DWORD i = 0; i < c_cMaxEventSources; i++)
+        {
+            if (s_rgpEventSources[i] == pSource)
+            {
+                s_rgpEventSources[i] = nullptr;
+            }
+        }
+        ReleaseSRWLockExclusive(&s_srwEventSources);
+    }
+}
+
+void SignalProviderEvent(PROVIDER_EVENT pe)
+{
+    AcquireSRWLockShared(&s_srwEventSources);
+    for (DWORD i = 0; i < c_cMaxEventSources; i++)
+    {
+        if (s_rgpEventSources[i] != nullptr)
+        {
+            s_rgpEventSources[i]->Signal(pe);
+        }
+    }
+    ReleaseSRWLockShared(&s_srwEventSources);
+}
+
+CProviderEventSource::CProviderEventSource() :
+    _pcpe(nullptr),
+    _upAdviseContext(0),
+    _hThread(nullptr),
+    _hStop(nullptr),
+    _hAddrChange(nullptr)
+{
+    ZeroMemory(_rghEvents, sizeof(_rghEvents));
+    ZeroMemory(&_olAddrChange, sizeof(_olAddrChange));
+}
+
+CProviderEventSource::~CProviderEventSource()
+{
+    UnAdvise();
+}
+
+HRESULT CProviderEventSource::Advise(_In_ ICredentialProviderEvents *pcpe, UINT_PTR upAdviseContext)
+{
+    UnAdvise();
+
+    HRESULT hr = S_OK;
+    _hStop = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    for (DWORD i = 0; i < PE_COUNT && _hStop != nullptr; i++)
+    {
+        _rghEvents[i] = CreateEventW(nullptr, FALSE, FALSE, nullptr);
+        if (_rghEvents[i] == nullptr)
+        {
+            break;
+        }
+    }
+    if (_hStop == nullptr || _rghEvents[PE_COUNT - 1] == nullptr)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        _pcpe = pcpe;
+        _pcpe->AddRef();
+        _upAdviseContext = upAdviseContext;
+
+        _hThread = CreateThread(nullptr, 0, s_WaitThreadProc, this, 0, nullptr);
+        if (_hThread == nullptr)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+        else if (!RegisterEventSource(this))
+        {
+            WriteLogMessage(L"[EVENTS] too many advised providers; only network events will be delivered");
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        UnAdvise();
+    }
+    return hr;
+}
+
+void CProviderEventSource::UnAdvise()
+{
+    UnregisterEventSource(this);
+
+    if (_hThread != nullptr)
+    {
+        SetEvent(_hStop);
+        WaitForSingleObject(_hThread, INFINITE);
+        CloseHandle(_hThread);
+        _hThread = nullptr;
+    }
+    if (_olAddrChange.hEvent != nullptr)
+    {
+        CancelIPChangeNotify(&_olAddrChange);
+        ZeroMemory(&_olAddrChange, sizeof(_olAddrChange));
+        _hAddrChange = nullptr;
+    }
+    for (DWORD i = 0; i < PE_COUNT; i++)
+    {
+        if (_rghEvents[i] != nullptr)
+        {
+            CloseHandle(_rghEvents[i]);
+            _rghEvents[i] = nullptr;
+        }
+    }
+    if (_hStop != nullptr)
+    {
+        CloseHandle(_hStop);
+        _hStop = nullptr;
+    }
+    if (_pcpe != nullptr)
+    {
+        _pcpe->Release();
+        _pcpe = nullptr;
+    }
+    _upAdviseContext = 0;
+}
+
+void CProviderEventSource::Signal(PROVIDER_EVENT pe)
+{
+    if (pe < PE_COUNT && _rghEvents[pe] != nullptr)
+    {
+        SetEvent(_rghEvents[pe]);
+    }
+}
+
+// Asks the IP stack to signal PE_NETWORK_RESTORED the next time an address is added or removed.
+void CProviderEventSource::_ArmAddressChangeNotification()
+{
+    _olAddrChange.hEvent = _rghEvents[PE_NETWORK_RESTORED];
+    DWORD dwErr = NotifyAddrChange(&_hAddrChange, &_olAddrChange);
+    if (dwErr != ERROR_IO_PENDING)
+    {
+        ZeroMemory(&_olAddrChange, sizeof(_olAddrChange));
+        _hAddrChange = nullptr;
+    }
+}
+
+DWORD WINAPI CProviderEventSource::s_WaitThreadProc(_In_ LPVOID pvParam)
+{
+    static_cast<CProviderEventSource *>(pvParam)->_WaitLoop();
+    return 0;
+}
+
+void CProviderEventSource::_WaitLoop()
+{
+    HANDLE rgh[1 + PE_COUNT] = { _hStop };
+    CopyMemory(&rgh[1], _rghEvents, sizeof(_rghEvents));
+
+    // Armed here rather than in Advise so iphlpapi is loaded off LogonUI's thread.
+    _ArmAddressChangeNotification();
+
+    for (;;)
+    {
+        DWORD dwWait = WaitForMultipleObjects(ARRAYSIZE(rgh), rgh, FALSE, INFINITE);
+        if (dwWait == WAIT_OBJECT_0 || dwWait == WAIT_FAILED)
+        {
+            break;
+        }
+
+        // Events that arrive together only need one re-enumeration. The address change
+        // notification completes once, so it is re-armed every time it fires.
+        DWORD dwEvent = dwWait - WAIT_OBJECT_0 - 1;
+        do
+        {
+            if (dwEvent == PE_NETWORK_RESTORED && _olAddrChange.hEvent != nullptr)
+            {
+                _ArmAddressChangeNotification();
+            }
+            dwEvent = WaitForMultipleObjects(PE_COUNT, _rghEvents, FALSE, 0) - WAIT_OBJECT_0;
+        } while (dwEvent < PE_COUNT);
+
+        HRESULT hr = _pcpe->CredentialsChanged(_upAdviseContext);
+        if (FAILED(hr))
+        {
+            wchar_t buffer[96] = {};
+            if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[EVENTS] CredentialsChanged hr=0x%08X", hr)))
+            {
+                WriteLogMessage(buffer);
+            }
+        }
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "helpers.h"
+
+// Out-of-band events that should make LogonUI re-enumerate our tiles.
+enum PROVIDER_EVENT
+{
+    PE_CONFIG_CHANGED       = 0,
+    PE_APPROVAL_RECEIVED    = 1,
+    PE_NETWORK_RESTORED     = 2,
+    PE_OTP_CHECKED          = 3,
+    PE_COUNT                = 4,    // Note: keep PE_COUNT last.
+};
+
+// Wakes every advised provider in this process. Safe to call from any thread.
+void SignalProviderEvent(PROVIDER_EVENT pe);
+
+// Owns the wait thread that turns PROVIDER_EVENTs into ICredentialProviderEvents::CredentialsChanged
+// calls for one provider between its Advise and UnAdvise. The thread sleeps in
+// WaitForMultipleObjects, so nothing polls while no event is pending.
+class CProviderEventSource
+{
+public:
+    CProviderEventSource();
+    ~CProviderEventSource();
+
+    HRESULT Advise(_In_ ICredentialProviderEvents *pcpe, UINT_PTR upAdviseContext);
+    void UnAdvise();
+
+    // Only used by SignalProviderEvent.
+    void Signal(PROVIDER_EVENT pe);
+
+private:
+    static DWORD WINAPI s_WaitThreadProc(_In_ LPVOID pvParam);
+    void _WaitLoop();
+    void _ArmAddressChangeNotification();
+
+    ICredentialProviderEvents   *_pcpe;
+    UINT_PTR                    _upAdviseContext;
+    HANDLE                      _hThread;
+    HANDLE                      _hStop;
+    HANDLE                      _rghEvents[PE_COUNT];
+    HANDLE                      _hAddrChange;       // Owned by NotifyAddrChange.
+    OVERLAPPED                  _olAddrChange;
+};
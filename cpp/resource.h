@@ -8,3 +8,37 @@
 //
 
 #define IDB_TILE_IMAGE     101
+
+// Logon status messages shown by ReportResult. Keep these contiguous; the
+// string table is loaded once per process from IDS_LOGON_STATUS_FIRST on.
+#define IDS_LOGON_STATUS_FIRST              1000
+#define IDS_LOGON_BAD_CREDENTIALS           1000
+#define IDS_LOGON_ACCOUNT_RESTRICTED        1001
+#define IDS_LOGON_ACCOUNT_DISABLED          1002
+#define IDS_LOGON_ACCOUNT_EXPIRED           1003
+#define IDS_LOGON_ACCOUNT_LOCKED_OUT        1004
+#define IDS_LOGON_PASSWORD_EXPIRED          1005
+#define IDS_LOGON_PASSWORD_MUST_CHANGE      1006
+#define IDS_LOGON_INVALID_LOGON_HOURS       1007
+#define IDS_LOGON_INVALID_WORKSTATION       1008
+#define IDS_LOGON_NO_LOGON_SERVERS          1009
+#define IDS_LOGON_TYPE_NOT_GRANTED          1010
+#define IDS_LOGON_TIME_DIFFERENCE           1011
+#define IDS_LOGON_TRUST_FAILURE             1012
+#define IDS_LOGON_DOWNGRADE_DETECTED        1013
+#define IDS_LOGON_FIREWALL_FAILED           1014
+#define IDS_LOGON_STATUS_LAST               1014
+
+// Second factor prompts shown by GetSerialization.
+#define IDS_OTP_ENTER_CODE                  1100
+#define IDS_OTP_ENTER_APP_CODE              1101
+#define IDS_OTP_WRONG_CODE                  1102
+#define IDS_OTP_CODE_EXPIRED                1103
+#define IDS_OTP_GATEWAY_UNAVAILABLE         1104
+#define IDS_OTP_ENTER_OFFLINE_CODE          1105
+#define IDS_OTP_ENTER_BACKUP_CODE           1106
+#define IDS_OTP_APPROVE_PUSH                1107
+#define IDS_OTP_APPROVE_OR_ENTER_CODE       1108
+#define IDS_OTP_ENTER_CODE_ANY_CHANNEL      1109
+#define IDS_OTP_SENDING_CODE                1110
+#define IDS_OTP_CHECKING_CODE               1111
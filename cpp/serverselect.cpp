@@ -0,0 +1,345 @@
+#include "serverselect.h"
+#include "configsnapshot.h"
+#include "dll.h"
+#include "utils.h"
+#include "warmstart.h"
+
+namespace
+{
+    const DWORD c_cMaxServers = 16;
+    const double c_dblSmoothing = 0.2;
+    const double c_dblErrorPenalty = 4.0;
+    const double c_dblUnmeasuredMs = 1000.0;
+    const double c_dblTrialScore = 1e9;
+    const DWORD c_cFailuresToEject = 3;
+    const ULONGLONG c_ullTicksPerSecond = 10000000ull;
+    const ULONGLONG c_ullFirstEjection = 30 * c_ullTicksPerSecond;
+    const ULONGLONG c_ullMaxEjection = 300 * c_ullTicksPerSecond;
+    const ULONGLONG c_ullProbeInterval = 15 * c_ullTicksPerSecond;
+    const ULONGLONG c_ullProberIdle = 300 * c_ullTicksPerSecond;
+    const DWORD c_dwDefaultTimeoutMs = 5000;
+
+    enum BREAKER_STATE
+    {
+        BREAKER_CLOSED,         // In rotation.
+        BREAKER_OPEN,           // Ejected until ullReopen.
+        BREAKER_TRIAL,          // One request or probe is finding out whether it is back, until ullReopen.
+    };
+
+    struct OTP_SERVER_STATS
+    {
+        wchar_t         szUrl[c_cchMaxOtpServerUrl];
+        bool            fMeasured;
+        double          dblLatencyMs;       // EWMA over answered requests.
+        double          dblErrorRate;       // EWMA of failures, 0 to 1.
+        DWORD           cConsecutiveFailures;
+        BREAKER_STATE   state;
+        ULONGLONG       ullReopen;          // FILETIME in UTC. In trial, when the trial is given up.
+        ULONGLONG       ullEjectedFor;      // Length of the last ejection; doubles while it keeps failing.
+    };
+
+    SRWLOCK s_srwServers = SRWLOCK_INIT;
+    OTP_SERVER_STATS s_rgServers[c_cMaxServers] = {};
+    DWORD s_cServers = 0;
+    LONG s_lGeneration = -1;
+    ULONGLONG s_ullTrialTimeout = c_dwDefaultTimeoutMs * (c_ullTicksPerSecond / 1000);
+
+    PFN_PROBE_OTP_SERVER s_pfnProbe = nullptr;
+    INIT_ONCE s_initProber = INIT_ONCE_STATIC_INIT;
+    PTP_TIMER s_pProbeTimer = nullptr;
+    volatile LONG s_fProberArmed = FALSE;
+    volatile LONGLONG s_llLastSelect = 0;
+
+    ULONGLONG CurrentTime()
+    {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        return (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    }
+
+    void LogServerState(_In_ PCWSTR pszEvent, _In_ const OTP_SERVER_STATS &server)
+    {
+        wchar_t buffer[384] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[OTPSERVER] %s %s latency=%u ms errors=%u%% ejected for %I64u s",
+                                       server.szUrl, pszEvent, static_cast<DWORD>(server.dblLatencyMs), static_cast<DWORD>(server.dblErrorRate * 100),
+                                       server.ullEjectedFor / c_ullTicksPerSecond)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+
+    // Brings the table in line with Otp\Servers, keeping the statistics of gateways that stay.
+    // Called with s_srwServers held exclusively.
+    void SyncServers()
+    {
+        CConfigSnapshot *pSnapshot;
+        if (FAILED(GetConfigSnapshot(&pSnapshot)))
+        {
+            s_cServers = 0;
+            return;
+        }
+        if (pSnapshot->Generation() != s_lGeneration)
+        {
+            DWORD cConfigured;
+            const CONFIG_OTP_SERVER *rgConfigured = pSnapshot->OtpServers(&cConfigured);
+            OTP_SERVER_STATS rgServers[c_cMaxServers] = {};
+            DWORD cServers = 0;
+            for (DWORD i = 0; i < cConfigured && cServers < ARRAYSIZE(rgServers); i++)
+            {
+                OTP_SERVER_STATS &server = rgServers[cServers++];
+                StringCchCopyW(server.szUrl, ARRAYSIZE(server.szUrl), rgConfigured[i].szUrl);
+                for (DWORD j = 0; j < s_cServers; j++)
+                {
+                    if (wcscmp(s_rgServers[j].szUrl, server.szUrl) == 0)
+                    {
+                        server = s_rgServers[j];
+                        break;
+                    }
+                }
+            }
+            CopyMemory(s_rgServers, rgServers, sizeof(s_rgServers));
+            s_cServers = cServers;
+            s_lGeneration = pSnapshot->Generation();
+            s_ullTrialTimeout = pSnapshot->OtpTimeout(c_dwDefaultTimeoutMs) * (c_ullTicksPerSecond / 1000);
+        }
+        pSnapshot->Release();
+    }
+
+    // Whether an ejected gateway may be tried: its ejection is over, or its last trial has had a
+    // request timeout and still no outcome.
+    bool IsDueForTrial(_In_ const OTP_SERVER_STATS &server, ULONGLONG ullNow)
+    {
+        return (server.state == BREAKER_OPEN || server.state == BREAKER_TRIAL) && ullNow >= server.ullReopen;
+    }
+
+    // Lets an ejected gateway through for one trial once its time is up. Called with
+    // s_srwServers held exclusively.
+    bool TakeTrial(_Inout_ OTP_SERVER_STATS *pServer, ULONGLONG ullNow)
+    {
+        if (!IsDueForTrial(*pServer, ullNow))
+        {
+            return false;
+        }
+        if (pServer->state == BREAKER_TRIAL)
+        {
+            LogServerState(L"trial timed out", *pServer);
+        }
+        pServer->state = BREAKER_TRIAL;
+        pServer->ullReopen = ullNow + s_ullTrialTimeout;
+        return true;
+    }
+
+    VOID CALLBACK ProbeTimerProc(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER);
+
+    BOOL CALLBACK CreateProbeTimer(PINIT_ONCE, PVOID, PVOID *)
+    {
+        s_pProbeTimer = CreateThreadpoolTimer(ProbeTimerProc, nullptr, nullptr);
+        return TRUE;
+    }
+
+    void ArmProbeTimer()
+    {
+        FILETIME ftDue;
+        ULARGE_INTEGER uliDue;
+        uliDue.QuadPart = static_cast<ULONGLONG>(-static_cast<LONGLONG>(c_ullProbeInterval));
+        ftDue.dwLowDateTime = uliDue.LowPart;
+        ftDue.dwHighDateTime = uliDue.HighPart;
+        SetThreadpoolTimer(s_pProbeTimer, &ftDue, 0, 0);
+    }
+
+    // Keeps the prober running while gateways are being selected. The armed timer holds a
+    // reference on the DLL.
+    void EnsureProberArmed()
+    {
+        InterlockedExchange64(&s_llLastSelect, static_cast<LONGLONG>(CurrentTime()));
+        if (s_pfnProbe == nullptr ||
+            !InitOnceExecuteOnce(&s_initProber, CreateProbeTimer, nullptr, nullptr) || s_pProbeTimer == nullptr ||
+            InterlockedCompareExchange(&s_fProberArmed, TRUE, FALSE) != FALSE)
+        {
+            return;
+        }
+        DllAddRef();
+        ArmProbeTimer();
+    }
+
+    // Probes every gateway in rotation, and every ejected one whose time is up, one after the
+    // other; an ejected gateway is not probed before then.
+    VOID CALLBACK ProbeTimerProc(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER)
+    {
+        PFN_PROBE_OTP_SERVER pfnProbe = s_pfnProbe;
+        wchar_t rgszUrls[c_cMaxServers][c_cchMaxOtpServerUrl];
+        DWORD cUrls = 0;
+
+        AcquireSRWLockExclusive(&s_srwServers);
+        SyncServers();
+        ULONGLONG ullNow = CurrentTime();
+        for (DWORD i = 0; i < s_cServers && pfnProbe != nullptr; i++)
+        {
+            if (s_rgServers[i].state == BREAKER_CLOSED || TakeTrial(&s_rgServers[i], ullNow))
+            {
+                StringCchCopyW(rgszUrls[cUrls++], ARRAYSIZE(rgszUrls[0]), s_rgServers[i].szUrl);
+            }
+        }
+        ReleaseSRWLockExclusive(&s_srwServers);
+
+        for (DWORD i = 0; i < cUrls; i++)
+        {
+            DWORD dwLatencyMs = 0;
+            HRESULT hr = pfnProbe(rgszUrls[i], &dwLatencyMs);
+            ReportOtpServerResult(rgszUrls[i], SUCCEEDED(hr), dwLatencyMs);
+        }
+
+        if (s_pfnProbe != nullptr && CurrentTime() - static_cast<ULONGLONG>(s_llLastSelect) < c_ullProberIdle)
+        {
+            ArmProbeTimer();
+        }
+        else
+        {
+            InterlockedExchange(&s_fProberArmed, FALSE);
+            DllRelease();
+        }
+    }
+}
+
+void SetOtpServerProbe(_In_opt_ PFN_PROBE_OTP_SERVER pfnProbe)
+{
+    InterlockedExchangePointer(reinterpret_cast<PVOID volatile *>(&s_pfnProbe), reinterpret_cast<PVOID>(pfnProbe));
+}
+
+HRESULT SelectOtpServer(_In_reads_opt_(cExclude) const PCWSTR *rgpszExclude, DWORD cExclude, _Out_writes_(cchUrl) PWSTR pszUrl, size_t cchUrl)
+{
+    *pszUrl = L'\0';
+    wchar_t szWarmStartServer[c_cchMaxOtpServerUrl];
+    if (GetWarmStartServer(szWarmStartServer, ARRAYSIZE(szWarmStartServer)) != S_OK)
+    {
+        *szWarmStartServer = L'\0';
+    }
+
+    AcquireSRWLockExclusive(&s_srwServers);
+    SyncServers();
+
+    ULONGLONG ullNow = CurrentTime();
+    OTP_SERVER_STATS *pBest = nullptr;
+    double dblBestScore = 0;
+    bool fAnyCandidate = false;
+    for (DWORD i = 0; i < s_cServers; i++)
+    {
+        OTP_SERVER_STATS *pServer = &s_rgServers[i];
+        bool fExcluded = false;
+        for (DWORD j = 0; j < cExclude && !fExcluded; j++)
+        {
+            fExcluded = (wcscmp(pServer->szUrl, rgpszExclude[j]) == 0);
+        }
+        if (fExcluded)
+        {
+            continue;
+        }
+        fAnyCandidate = true;
+
+        // A gateway in rotation always beats one that is only due for a trial.
+        double dblScore;
+        if (pServer->state == BREAKER_CLOSED)
+        {
+            dblScore = pServer->fMeasured ? pServer->dblLatencyMs * (1 + c_dblErrorPenalty * pServer->dblErrorRate) :
+                       (wcscmp(pServer->szUrl, szWarmStartServer) == 0) ? 0 : c_dblUnmeasuredMs + i;
+        }
+        else if (IsDueForTrial(*pServer, ullNow))
+        {
+            dblScore = c_dblTrialScore + i;
+        }
+        else
+        {
+            continue;
+        }
+        if (pBest == nullptr || dblScore < dblBestScore)
+        {
+            pBest = pServer;
+            dblBestScore = dblScore;
+        }
+    }
+
+    HRESULT hr;
+    if (pBest != nullptr)
+    {
+        TakeTrial(pBest, ullNow);
+        hr = StringCchCopyW(pszUrl, cchUrl, pBest->szUrl);
+    }
+    else
+    {
+        hr = fAnyCandidate ? HRESULT_FROM_WIN32(ERROR_HOST_UNREACHABLE) : HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+    ReleaseSRWLockExclusive(&s_srwServers);
+
+    EnsureProberArmed();
+    return hr;
+}
+
+void ReportOtpServerResult(_In_ PCWSTR pszUrl, bool fAnswered, DWORD dwLatencyMs)
+{
+    bool fRecordGood = false;
+    AcquireSRWLockExclusive(&s_srwServers);
+    for (DWORD i = 0; i < s_cServers; i++)
+    {
+        OTP_SERVER_STATS &server = s_rgServers[i];
+        if (wcscmp(server.szUrl, pszUrl) != 0)
+        {
+            continue;
+        }
+
+        if (fAnswered)
+        {
+            server.dblLatencyMs = server.fMeasured ? server.dblLatencyMs + c_dblSmoothing * (dwLatencyMs - server.dblLatencyMs) : dwLatencyMs;
+            server.fMeasured = true;
+            server.dblErrorRate *= (1 - c_dblSmoothing);
+            server.cConsecutiveFailures = 0;
+            if (server.state != BREAKER_CLOSED)
+            {
+                server.state = BREAKER_CLOSED;
+                server.ullEjectedFor = 0;
+                LogServerState(L"back in rotation", server);
+            }
+            fRecordGood = true;
+        }
+        else
+        {
+            server.dblErrorRate += c_dblSmoothing * (1 - server.dblErrorRate);
+            server.cConsecutiveFailures++;
+            if (server.state == BREAKER_TRIAL ||
+                (server.state == BREAKER_CLOSED && server.cConsecutiveFailures >= c_cFailuresToEject))
+            {
+                server.ullEjectedFor = (server.ullEjectedFor == 0) ? c_ullFirstEjection :
+                                       (2 * server.ullEjectedFor < c_ullMaxEjection) ? 2 * server.ullEjectedFor : c_ullMaxEjection;
+                server.ullReopen = CurrentTime() + server.ullEjectedFor;
+                server.state = BREAKER_OPEN;
+                LogServerState(L"ejected", server);
+            }
+        }
+        break;
+    }
+    ReleaseSRWLockExclusive(&s_srwServers);
+
+    if (fRecordGood)
+    {
+        RecordWarmStartServer(pszUrl);
+    }
+}
+
+void ReportOtpServerNoResult(_In_ PCWSTR pszUrl)
+{
+    AcquireSRWLockExclusive(&s_srwServers);
+    for (DWORD i = 0; i < s_cServers; i++)
+    {
+        OTP_SERVER_STATS &server = s_rgServers[i];
+        if (wcscmp(server.szUrl, pszUrl) == 0)
+        {
+            if (server.state == BREAKER_TRIAL)
+            {
+                server.state = BREAKER_OPEN;
+                server.ullReopen = CurrentTime();
+                LogServerState(L"trial ended without an outcome", server);
+            }
+            break;
+        }
+    }
+    ReleaseSRWLockExclusive(&s_srwServers);
+}
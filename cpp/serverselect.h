@@ -0,0 +1,44 @@
+#pragma once
+
+#include "helpers.h"
+
+// Checks that pszUrl answers, returning its round-trip time. The default probe is the OTP
+// client's HEAD request; tests can install a fake that injects latency or failures.
+typedef HRESULT (*PFN_PROBE_OTP_SERVER)(_In_ PCWSTR pszUrl, _Out_ DWORD *pdwLatencyMs);
+
+// nullptr turns background probing off.
+void SetOtpServerProbe(_In_opt_ PFN_PROBE_OTP_SERVER pfnProbe);
+
+// OTP gateway selection.
+//
+// Each gateway in Otp\Servers keeps an EWMA of its latency and of its error rate, fed by every
+// real request and by a background prober. Requests go to the healthy gateway with the best
+// score, which is its latency weighted by its error rate. Until a gateway has been measured, the
+// one that last answered (from the warm-start state) comes first and the rest follow in
+// configuration order.
+//
+// A circuit breaker ejects a gateway after three consecutive failures. It stays out for 30
+// seconds, doubling on each failed retry up to five minutes; once that has passed, the next
+// request or probe is let through as a trial and its outcome closes or reopens the breaker. A
+// trial that ends without an outcome, or has none within the request timeout, leaves the
+// gateway due for another.
+// While every gateway is ejected, selection fails at once, so a logon never waits out a
+// timeout on a dead host.
+//
+// The prober runs on a thread pool timer every 15 seconds while gateways are in use, and stops
+// after five idle minutes.
+
+// Copies the URL of the gateway to use next. Gateways in rgpszExclude are skipped, so a caller
+// failing over does not land on a host it already tried. Returns
+// HRESULT_FROM_WIN32(ERROR_NOT_FOUND) when no other gateway is configured and
+// HRESULT_FROM_WIN32(ERROR_HOST_UNREACHABLE) when every other gateway is ejected.
+HRESULT SelectOtpServer(_In_reads_opt_(cExclude) const PCWSTR *rgpszExclude, DWORD cExclude, _Out_writes_(cchUrl) PWSTR pszUrl, size_t cchUrl);
+
+// Feeds the outcome of a request to pszUrl into its statistics. fAnswered is false for
+// transport failures and server errors; any other answer, a denied code included, counts as a
+// success for the gateway.
+void ReportOtpServerResult(_In_ PCWSTR pszUrl, bool fAnswered, DWORD dwLatencyMs);
+
+// Ends a request to pszUrl that says nothing about the gateway, such as one we cancelled or a
+// long poll the gateway held. If it was the gateway's trial, the next request takes another.
+void ReportOtpServerNoResult(_In_ PCWSTR pszUrl);
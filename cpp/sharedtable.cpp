@@ -0,0 +1,312 @@
+#include "sharedtable.h"
+#include <sddl.h>
+#include <new>
+#include "dll.h"
+#include "utils.h"
+
+struct SHARED_SLOT
+{
+    volatile LONG   lSequence;      // Odd while a writer owns the slot.
+    DWORD           cbValue;        // 0 while the slot has never been written.
+    ULONGLONG       ullKey;
+    ULONGLONG       ullExpires;
+    ULONGLONG       ullReserved;
+    // cbMaxValue bytes of value follow.
+};
+
+namespace
+{
+    struct SHARED_TABLE_HEADER
+    {
+        volatile LONG   lMagic;     // Written last by the creator.
+        DWORD           dwVersion;
+        DWORD           cSlots;
+        DWORD           cbSlot;
+        BYTE            rgbReserved[48];
+    };
+
+    const LONG c_lTableMagic = 0x54535153;         // "SQST"
+    const DWORD c_dwTableVersion = 1;
+    const DWORD c_cbCacheLine = 64;
+    const DWORD c_cProbes = 8;
+    const DWORD c_cReadRetries = 4;
+
+    // SYSTEM and Administrators may write; any authenticated user may read.
+    const wchar_t c_szSectionSddl[] = L"D:P(A;;GA;;;SY)(A;;GA;;;BA)(A;;GR;;;AU)";
+}
+
+ULONGLONG GetSharedTableTime()
+{
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+}
+
+CSharedTable::CSharedTable() :
+    _cRef(1),
+    _hSection(nullptr),
+    _pbView(nullptr),
+    _cSlots(0),
+    _cbSlot(0),
+    _cbMaxValue(0),
+    _fWritable(false)
+{
+    DllAddRef();
+}
+
+CSharedTable::~CSharedTable()
+{
+    if (_pbView != nullptr)
+    {
+        UnmapViewOfFile(_pbView);
+    }
+    if (_hSection != nullptr)
+    {
+        CloseHandle(_hSection);
+    }
+    DllRelease();
+}
+
+ULONG CSharedTable::AddRef()
+{
+    return InterlockedIncrement(&_cRef);
+}
+
+ULONG CSharedTable::Release()
+{
+    long cRef = InterlockedDecrement(&_cRef);
+    if (!cRef)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+HRESULT CSharedTable::Open(_In_opt_ PCWSTR pszName, DWORD cSlots, DWORD cbMaxValue, _Outptr_ CSharedTable **ppTable)
+{
+    *ppTable = nullptr;
+
+    CSharedTable *pTable = new (std::nothrow) CSharedTable();
+    if (pTable == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+    pTable->_cSlots = cSlots;
+    pTable->_cbMaxValue = cbMaxValue;
+    pTable->_cbSlot = (sizeof(SHARED_SLOT) + cbMaxValue + c_cbCacheLine - 1) & ~(c_cbCacheLine - 1);
+    ULONGLONG cbSection = sizeof(SHARED_TABLE_HEADER) + static_cast<ULONGLONG>(cSlots) * pTable->_cbSlot;
+
+    HRESULT hr = S_OK;
+    wchar_t szSection[64] = {};
+    if (pszName != nullptr)
+    {
+        hr = StringCchPrintfW(szSection, ARRAYSIZE(szSection), L"Global\\sqcp.%s", pszName);
+    }
+    if (SUCCEEDED(hr) && pszName != nullptr)
+    {
+        SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, FALSE };
+        if (ConvertStringSecurityDescriptorToSecurityDescriptorW(c_szSectionSddl, SDDL_REVISION_1, &sa.lpSecurityDescriptor, nullptr))
+        {
+            pTable->_hSection = CreateFileMappingW(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, static_cast<DWORD>(cbSection >> 32), static_cast<DWORD>(cbSection), szSection);
+            pTable->_fWritable = (pTable->_hSection != nullptr);
+            LocalFree(sa.lpSecurityDescriptor);
+        }
+        if (pTable->_hSection == nullptr)
+        {
+            pTable->_hSection = OpenFileMappingW(FILE_MAP_READ, FALSE, szSection);
+        }
+    }
+    if (SUCCEEDED(hr) && pTable->_hSection == nullptr)
+    {
+        pTable->_hSection = CreateFileMappingW(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, static_cast<DWORD>(cbSection >> 32), static_cast<DWORD>(cbSection), nullptr);
+        pTable->_fWritable = true;
+        if (pTable->_hSection == nullptr)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    if (SUCCEEDED(hr))
+    {
+        pTable->_pbView = static_cast<BYTE *>(MapViewOfFile(pTable->_hSection, pTable->_fWritable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, static_cast<SIZE_T>(cbSection)));
+        if (pTable->_pbView == nullptr)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+        }
+    }
+    if (SUCCEEDED(hr))
+    {
+        // The first writer lays out the header. A section created by a build with a different
+        // geometry is not used.
+        SHARED_TABLE_HEADER *pHeader = reinterpret_cast<SHARED_TABLE_HEADER *>(pTable->_pbView);
+        if (pTable->_fWritable && ReadAcquire(&pHeader->lMagic) == 0)
+        {
+            pHeader->dwVersion = c_dwTableVersion;
+            pHeader->cSlots = cSlots;
+            pHeader->cbSlot = pTable->_cbSlot;
+            InterlockedCompareExchange(&pHeader->lMagic, c_lTableMagic, 0);
+        }
+        if (ReadAcquire(&pHeader->lMagic) == c_lTableMagic &&
+            (pHeader->dwVersion != c_dwTableVersion || pHeader->cSlots != cSlots || pHeader->cbSlot != pTable->_cbSlot))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *ppTable = pTable;
+    }
+    else
+    {
+        pTable->Release();
+    }
+    return hr;
+}
+
+SHARED_SLOT *CSharedTable::_SlotAt(DWORD iSlot) const
+{
+    return reinterpret_cast<SHARED_SLOT *>(_pbView + sizeof(SHARED_TABLE_HEADER) + static_cast<SIZE_T>(iSlot) * _cbSlot);
+}
+
+bool CSharedTable::Read(ULONGLONG ullKey,
+                        _Out_writes_bytes_to_(cbBuffer, *pcbValue) void *pvBuffer,
+                        DWORD cbBuffer,
+                        _Out_ DWORD *pcbValue,
+                        _Out_opt_ ULONGLONG *pullExpires) const
+{
+    *pcbValue = 0;
+    if (pullExpires != nullptr)
+    {
+        *pullExpires = 0;
+    }
+
+    ULONGLONG ullNow = GetSharedTableTime();
+    DWORD iHome = static_cast<DWORD>(ullKey % _cSlots);
+    for (DWORD iProbe = 0; iProbe < c_cProbes && iProbe < _cSlots; iProbe++)
+    {
+        const SHARED_SLOT *pSlot = _SlotAt((iHome + iProbe) % _cSlots);
+        for (DWORD iRetry = 0; iRetry < c_cReadRetries; iRetry++)
+        {
+            LONG lSequence = ReadAcquire(&pSlot->lSequence);
+            if (lSequence & 1)
+            {
+                YieldProcessor();
+                continue;
+            }
+            if (pSlot->ullKey != ullKey)
+            {
+                break;
+            }
+
+            ULONGLONG ullExpires = pSlot->ullExpires;
+            DWORD cbValue = pSlot->cbValue;
+            if (cbValue == 0 || cbValue > _cbMaxValue || cbValue > cbBuffer)
+            {
+                break;
+            }
+            CopyMemory(pvBuffer, pSlot + 1, cbValue);
+            MemoryBarrier();
+            if (ReadAcquire(&pSlot->lSequence) != lSequence)
+            {
+                continue;
+            }
+
+            if (ullExpires <= ullNow)
+            {
+                return false;
+            }
+            *pcbValue = cbValue;
+            if (pullExpires != nullptr)
+            {
+                *pullExpires = ullExpires;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CSharedTable::Write(ULONGLONG ullKey, _In_reads_bytes_(cbValue) const void *pvValue, DWORD cbValue, ULONGLONG ullExpires)
+{
+    if (!_fWritable || cbValue == 0 || cbValue > _cbMaxValue)
+    {
+        return false;
+    }
+
+    // Pick the slot: same key, then empty or expired, then the one that expires first.
+    DWORD iHome = static_cast<DWORD>(ullKey % _cSlots);
+    SHARED_SLOT *pVictim = nullptr;
+    for (DWORD iProbe = 0; iProbe < c_cProbes && iProbe < _cSlots; iProbe++)
+    {
+        SHARED_SLOT *pSlot = _SlotAt((iHome + iProbe) % _cSlots);
+        if (pSlot->ullKey == ullKey)
+        {
+            pVictim = pSlot;
+            break;
+        }
+        // Empty slots expire at 0, so this also prefers empty over expired over live.
+        if (pVictim == nullptr || pSlot->ullExpires < pVictim->ullExpires)
+        {
+            pVictim = pSlot;
+        }
+    }
+
+    // Another writer owning the slot drops the caller's value rather than waiting on it.
+    return _Store(pVictim, ReadAcquire(&pVictim->lSequence), ullKey, pvValue, cbValue, ullExpires);
+}
+
+bool CSharedTable::Insert(ULONGLONG ullKey, _In_reads_bytes_(cbValue) const void *pvValue, DWORD cbValue, ULONGLONG ullExpires)
+{
+    if (!_fWritable || cbValue == 0 || cbValue > _cbMaxValue)
+    {
+        return false;
+    }
+
+    // Same choice of slot as Write, except that a live entry with the key ends it, and so does a
+    // slot another writer holds: it may be storing this very key, and claiming another slot
+    // would leave two winners. Each slot's sequence is read before its contents, so the
+    // compare-exchange on the victim also fails if anyone wrote it after we looked.
+    ULONGLONG ullNow = GetSharedTableTime();
+    DWORD iHome = static_cast<DWORD>(ullKey % _cSlots);
+    SHARED_SLOT *pVictim = nullptr;
+    LONG lVictimSequence = 0;
+    for (DWORD iProbe = 0; iProbe < c_cProbes && iProbe < _cSlots; iProbe++)
+    {
+        SHARED_SLOT *pSlot = _SlotAt((iHome + iProbe) % _cSlots);
+        LONG lSequence = ReadAcquire(&pSlot->lSequence);
+        if (lSequence & 1)
+        {
+            return false;
+        }
+        if (pSlot->ullKey == ullKey)
+        {
+            if (pSlot->cbValue != 0 && pSlot->ullExpires > ullNow)
+            {
+                return false;
+            }
+            pVictim = pSlot;
+            lVictimSequence = lSequence;
+            break;
+        }
+        if (pVictim == nullptr || pSlot->ullExpires < pVictim->ullExpires)
+        {
+            pVictim = pSlot;
+            lVictimSequence = lSequence;
+        }
+    }
+    return (pVictim != nullptr) && _Store(pVictim, lVictimSequence, ullKey, pvValue, cbValue, ullExpires);
+}
+
+bool CSharedTable::_Store(_Inout_ SHARED_SLOT *pSlot, LONG lSequence, ULONGLONG ullKey, _In_reads_bytes_(cbValue) const void *pvValue, DWORD cbValue, ULONGLONG ullExpires)
+{
+    if ((lSequence & 1) || InterlockedCompareExchange(&pSlot->lSequence, lSequence + 1, lSequence) != lSequence)
+    {
+        return false;
+    }
+    pSlot->ullKey = ullKey;
+    pSlot->ullExpires = ullExpires;
+    pSlot->cbValue = cbValue;
+    CopyMemory(pSlot + 1, pvValue, cbValue);
+    InterlockedIncrement(&pSlot->lSequence);
+    return true;
+}
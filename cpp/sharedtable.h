@@ -0,0 +1,71 @@
+#pragma once
+
+#include "helpers.h"
+
+struct SHARED_SLOT;
+
+// Fixed-size hash table in a named, pagefile-backed section shared by every process that
+// hosts us (LogonUI, CredUI, consent). Keys are 64-bit hashes; callers keep the full key inside
+// the value and confirm it after a read.
+//
+// Every slot carries a sequence number. Writers take a slot by moving its sequence from even to
+// odd with a compare-exchange, write, then make it even again. Readers copy the slot and retry
+// if the sequence was odd or changed under them, so readers never block and never see a torn
+// value. A writer that dies mid-update leaves its slot odd; that slot is skipped until the
+// section is recreated.
+//
+// The section is only writable by SYSTEM and Administrators. Other processes map it read-only.
+// When it cannot be opened at all, they get a private table.
+class CSharedTable
+{
+public:
+    // pszName names the section under Global\; nullptr opens a table private to this process.
+    static HRESULT Open(_In_opt_ PCWSTR pszName, DWORD cSlots, DWORD cbMaxValue, _Outptr_ CSharedTable **ppTable);
+
+    ULONG AddRef();
+    ULONG Release();
+
+    bool IsWritable() const
+    {
+        return _fWritable;
+    }
+
+    // Copies the value stored under ullKey. Entries past their expiry are not returned.
+    bool Read(ULONGLONG ullKey,
+              _Out_writes_bytes_to_(cbBuffer, *pcbValue) void *pvBuffer,
+              DWORD cbBuffer,
+              _Out_ DWORD *pcbValue,
+              _Out_opt_ ULONGLONG *pullExpires) const;
+
+    // Stores a value. It replaces an entry with the same key, an empty or expired slot, or
+    // otherwise the probed entry that expires first. ullExpires is a FILETIME in UTC.
+    bool Write(ULONGLONG ullKey, _In_reads_bytes_(cbValue) const void *pvValue, DWORD cbValue, ULONGLONG ullExpires);
+
+    // Stores a value only if no live entry has ullKey. Returns false when one does, or when
+    // another writer took the slot first or holds one the key could be in; either way the caller
+    // reads the winner's entry. A slot left odd by a dead writer makes inserts near it fail
+    // without an entry to read.
+    bool Insert(ULONGLONG ullKey, _In_reads_bytes_(cbValue) const void *pvValue, DWORD cbValue, ULONGLONG ullExpires);
+
+private:
+    CSharedTable();
+    ~CSharedTable();
+
+    SHARED_SLOT *_SlotAt(DWORD iSlot) const;
+    // Takes pSlot if its sequence is still lSequence and writes the entry into it.
+    bool _Store(_Inout_ SHARED_SLOT *pSlot, LONG lSequence, ULONGLONG ullKey, _In_reads_bytes_(cbValue) const void *pvValue, DWORD cbValue, ULONGLONG ullExpires);
+
+    long                    _cRef;
+    HANDLE                  _hSection;
+    BYTE                    *_pbView;
+    DWORD                   _cSlots;
+    DWORD                   _cbSlot;
+    DWORD                   _cbMaxValue;
+    bool                    _fWritable;
+};
+
+// Current UTC time as a FILETIME, the unit of CSharedTable expiries.
+ULONGLONG GetSharedTableTime();
+
+// FILETIME ticks per second.
+const ULONGLONG c_ullSharedTableTicksPerSecond = 10000000ull;
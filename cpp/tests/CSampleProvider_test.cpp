@@ -0,0 +1,604 @@
+// Tests for tile enumeration in the provider (CSampleProvider.cpp) over a fake user array of up to
+// a thousand users: one slot per user, credentials created only for the tiles GetCredentialAt is
+// asked for, the array read once in SetUserArray and never during enumeration, pooled credentials
+// picked back up, and a benchmark of GetCredentialCount as the array grows.
+//
+// The user metadata cache (usercache.cpp) and the event source (providerevents.cpp) are the real
+// ones. CSampleCredential is replaced by the stub below, which records what the provider asks of
+// it; no MFA policy or config snapshot is deployed, and the warm-start names come from the table
+// below. So this builds on Linux against the headers in tests/shim, under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/CSampleProvider_test.cpp cpp/CSampleProvider.cpp
+//       cpp/usercache.cpp cpp/providerevents.cpp -o CSampleProvider_test -lpthread
+//   ./CSampleProvider_test
+
+#include <windows.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../CSampleProvider.h"
+#include "../CSampleCredential.h"
+#include "../accountcache.h"
+#include "../configsnapshot.h"
+#include "../groupcache.h"
+#include "../utils.h"
+#include "../warmstart.h"
+
+HRESULT CSample_CreateInstance(_In_ REFIID riid, _Outptr_ void **ppv);
+
+namespace
+{
+    const DWORD c_rgcUsers[] = { 1, 10, 100, 1000 };
+    const int c_cRounds = 201;
+
+    int s_cFailures = 0;
+    long s_cDllRefs = 0;
+    long s_cCredentials = 0;
+    long s_cInitialized = 0;
+    long s_cReused = 0;
+
+    std::mutex s_mutexWarmStart;
+    std::map<std::wstring, std::wstring> s_mapWarmStartNames;   // SID to display name.
+    HANDLE s_hWarmStartGate = nullptr;                          // The name lookups wait while it is reset.
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // Polls fn for up to dwMs.
+    bool WaitFor(const std::function<bool()> &fn, DWORD dwMs = 5000)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwMs);
+        while (!fn())
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                return false;
+            }
+            Sleep(1);
+        }
+        return true;
+    }
+
+    std::wstring UserSid(DWORD iUser)
+    {
+        return L"S-1-5-21-1004336348-1177238915-682003330-" + std::to_wstring(1000 + iUser);
+    }
+
+    std::wstring UserName(DWORD iUser)
+    {
+        return L"LAB\\user" + std::to_wstring(iUser);
+    }
+
+    HRESULT DupString(const std::wstring &str, _Outptr_ PWSTR *ppsz)
+    {
+        *ppsz = static_cast<PWSTR>(CoTaskMemAlloc((str.size() + 1) * sizeof(wchar_t)));
+        if (*ppsz == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+        CopyMemory(*ppsz, str.c_str(), (str.size() + 1) * sizeof(wchar_t));
+        return S_OK;
+    }
+
+    class CFakeUser : public ICredentialProviderUser
+    {
+    public:
+        CFakeUser(DWORD iUser, bool fDisplayName) :
+            _strSid(UserSid(iUser)),
+            _strName(UserName(iUser)),
+            _fDisplayName(fDisplayName)
+        {
+        }
+
+        IFACEMETHODIMP QueryInterface(REFIID, void **ppv)
+        {
+            *ppv = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        // Owned by the array.
+        IFACEMETHODIMP_(ULONG) AddRef()
+        {
+            return 2;
+        }
+
+        IFACEMETHODIMP_(ULONG) Release()
+        {
+            return 1;
+        }
+
+        IFACEMETHODIMP GetSid(PWSTR *ppszSid)
+        {
+            return DupString(_strSid, ppszSid);
+        }
+
+        IFACEMETHODIMP GetProviderID(GUID *pguidProviderID)
+        {
+            *pguidProviderID = GUID();
+            return S_OK;
+        }
+
+        IFACEMETHODIMP GetStringValue(REFPROPERTYKEY key, PWSTR *ppszValue)
+        {
+            *ppszValue = nullptr;
+            if (IsEqualPropertyKey(key, PKEY_Identity_QualifiedUserName))
+            {
+                return DupString(_strName, ppszValue);
+            }
+            if (IsEqualPropertyKey(key, PKEY_Identity_DisplayName) && _fDisplayName)
+            {
+                return DupString(L"User " + _strName.substr(_strName.find(L'\\') + 1), ppszValue);
+            }
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+
+    private:
+        std::wstring _strSid;
+        std::wstring _strName;
+        bool _fDisplayName;
+    };
+
+    // Stands in for the ICredentialProviderUserArray LogonUI hands the provider. Counts every
+    // user handed out, so reads during enumeration show up.
+    class CFakeUserArray : public ICredentialProviderUserArray
+    {
+    public:
+        // Every user has a display name unless fDisplayNames is false.
+        CFakeUserArray(DWORD cUsers, bool fDisplayNames = true) :
+            _cGetAt(0)
+        {
+            for (DWORD i = 0; i < cUsers; i++)
+            {
+                _vecUsers.emplace_back(i, fDisplayNames);
+            }
+        }
+
+        IFACEMETHODIMP QueryInterface(REFIID, void **ppv)
+        {
+            *ppv = nullptr;
+            return E_NOINTERFACE;
+        }
+
+        // Lives on the test's stack; the provider does not keep it.
+        IFACEMETHODIMP_(ULONG) AddRef()
+        {
+            return 2;
+        }
+
+        IFACEMETHODIMP_(ULONG) Release()
+        {
+            return 1;
+        }
+
+        IFACEMETHODIMP GetCount(DWORD *pdwUserCount)
+        {
+            *pdwUserCount = static_cast<DWORD>(_vecUsers.size());
+            return S_OK;
+        }
+
+        IFACEMETHODIMP GetAt(DWORD dwIndex, ICredentialProviderUser **ppUser)
+        {
+            *ppUser = nullptr;
+            if (dwIndex >= _vecUsers.size())
+            {
+                return E_INVALIDARG;
+            }
+            _cGetAt++;
+            *ppUser = &_vecUsers[dwIndex];
+            return S_OK;
+        }
+
+        DWORD GetAtCalls() const
+        {
+            return _cGetAt;
+        }
+
+    private:
+        std::vector<CFakeUser> _vecUsers;
+        DWORD _cGetAt;
+    };
+
+    // A provider set up for CPUS_LOGON over pUsers, the way LogonUI does it.
+    struct TEST_PROVIDER
+    {
+        ICredentialProvider *pcp;
+
+        explicit TEST_PROVIDER(_In_ ICredentialProviderUserArray *pUsers, CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus = CPUS_LOGON) :
+            pcp(nullptr)
+        {
+            if (SUCCEEDED(CSample_CreateInstance(IID_PPV_ARGS(&pcp))))
+            {
+                ICredentialProviderSetUserArray *pcpsua;
+                pcp->SetUsageScenario(cpus, 0);
+                if (SUCCEEDED(pcp->QueryInterface(IID_PPV_ARGS(&pcpsua))))
+                {
+                    pcpsua->SetUserArray(pUsers);
+                    pcpsua->Release();
+                }
+            }
+        }
+
+        ~TEST_PROVIDER()
+        {
+            if (pcp != nullptr)
+            {
+                pcp->Release();
+            }
+        }
+
+        DWORD Count()
+        {
+            DWORD cCredentials = 0;
+            DWORD dwDefault;
+            BOOL fAutoLogon;
+            if (FAILED(pcp->GetCredentialCount(&cCredentials, &dwDefault, &fAutoLogon)))
+            {
+                return 0;
+            }
+            return cCredentials;
+        }
+
+        // The SID of the user the credential at dwIndex was created for, or L"" for none.
+        std::wstring CredentialSid(DWORD dwIndex)
+        {
+            std::wstring strSid;
+            ICredentialProviderCredential *pcpc;
+            if (SUCCEEDED(pcp->GetCredentialAt(dwIndex, &pcpc)))
+            {
+                ICredentialProviderCredential2 *pcpc2;
+                if (SUCCEEDED(pcpc->QueryInterface(IID_PPV_ARGS(&pcpc2))))
+                {
+                    PWSTR pszSid;
+                    if (pcpc2->GetUserSid(&pszSid) == S_OK)
+                    {
+                        strSid = pszSid;
+                        CoTaskMemFree(pszSid);
+                    }
+                    pcpc2->Release();
+                }
+                pcpc->Release();
+            }
+            return strSid;
+        }
+    };
+
+    // The array is read in SetUserArray; enumeration sizes a slot per user and creates none.
+    void TestLazy()
+    {
+        const char *pszTest = "Lazy";
+        CFakeUserArray users(1000);
+        TEST_PROVIDER provider(&users);
+        Check(provider.pcp != nullptr, pszTest, "the provider is created");
+        Check(users.GetAtCalls() == 1000, pszTest, "SetUserArray reads every user once");
+
+        long cInitialized = s_cInitialized;
+        Check(provider.Count() == 1000, pszTest, "a tile for every user");
+        Check(s_cInitialized == cInitialized, pszTest, "GetCredentialCount creates no credential");
+        Check(users.GetAtCalls() == 1000, pszTest, "nor reads the array");
+
+        Check(provider.CredentialSid(737) == UserSid(737), pszTest, "GetCredentialAt binds its tile to its user");
+        Check(s_cInitialized == cInitialized + 1, pszTest, "and creates only that credential");
+        Check(provider.CredentialSid(737) == UserSid(737), pszTest, "asking again returns the same tile");
+        Check(provider.CredentialSid(0) == UserSid(0), pszTest, "the first tile");
+        Check(provider.CredentialSid(999) == UserSid(999), pszTest, "the last tile");
+        Check(s_cInitialized == cInitialized + 3, pszTest, "one credential per tile asked for");
+        Check(users.GetAtCalls() == 1000, pszTest, "none of which reads the array");
+
+        ICredentialProviderCredential *pcpc;
+        Check(provider.pcp->GetCredentialAt(1000, &pcpc) == E_INVALIDARG && pcpc == nullptr, pszTest, "no tile past the last user");
+    }
+
+    // Another scenario cycle over the same users picks the credentials that were asked for back up
+    // from the pool instead of creating them again.
+    void TestPool()
+    {
+        const char *pszTest = "Pool";
+        CFakeUserArray users(1000);
+        TEST_PROVIDER provider(&users);
+        provider.Count();
+        provider.CredentialSid(5);
+        provider.CredentialSid(6);
+
+        long cInitialized = s_cInitialized;
+        long cReused = s_cReused;
+        provider.pcp->SetUsageScenario(CPUS_LOGON, 0);
+        Check(provider.Count() == 1000, pszTest, "the tiles are enumerated again");
+        Check(provider.CredentialSid(6) == UserSid(6), pszTest, "the tile keeps its user");
+        Check(provider.CredentialSid(7) == UserSid(7), pszTest, "a tile not asked for before");
+        Check(s_cReused == cReused + 1, pszTest, "the pooled credential is reused");
+        Check(s_cInitialized == cInitialized + 1, pszTest, "only the new one is created");
+
+        // A credential from another scenario is not reused.
+        provider.pcp->SetUsageScenario(CPUS_UNLOCK_WORKSTATION, 0);
+        Check(provider.Count() == 1000, pszTest, "unlock enumerates the same users");
+        Check(provider.CredentialSid(6) == UserSid(6), pszTest, "the unlock tile");
+        Check(s_cReused == cReused + 1 && s_cInitialized == cInitialized + 2, pszTest, "is created for unlock");
+    }
+
+    // Display names the array lacks are filled in by the worker; GetCredentialCount then sees
+    // the cache's generation move and enumerates again, still without reading the array.
+    void TestResolvedNames()
+    {
+        const char *pszTest = "ResolvedNames";
+        {
+            std::lock_guard<std::mutex> lock(s_mutexWarmStart);
+            s_mapWarmStartNames[UserSid(3)] = L"Lab User Three";
+        }
+        ResetEvent(s_hWarmStartGate);
+        CFakeUserArray users(10, false);
+        TEST_PROVIDER provider(&users);
+        Check(provider.Count() == 10, pszTest, "the tiles do not wait for the names");
+        Check(provider.CredentialSid(3) == UserSid(3), pszTest, "nor does a credential");
+
+        long cInitialized = s_cInitialized;
+        Check(provider.Count() == 10 && s_cInitialized == cInitialized, pszTest, "nothing is rebuilt while the lookup is out");
+        SetEvent(s_hWarmStartGate);
+        Check(WaitFor([&provider, cInitialized]()
+              {
+                  provider.Count();
+                  provider.CredentialSid(3);
+                  return s_cInitialized > cInitialized;
+              }), pszTest, "the tile is rebuilt once the name is found");
+        Check(users.GetAtCalls() == 10, pszTest, "without reading the array again");
+    }
+
+    double MedianMicroseconds(std::vector<double> &vecSamples)
+    {
+        std::sort(vecSamples.begin(), vecSamples.end());
+        return vecSamples[vecSamples.size() / 2];
+    }
+
+    // Times GetCredentialCount after each SetUsageScenario, as LogonUI calls it, for arrays of one
+    // to a thousand users. It sizes the slots and recycles the previous ones, but creates nothing,
+    // so the time stays flat where creating every credential would grow with the users.
+    void TestBenchmark()
+    {
+        const char *pszTest = "Benchmark";
+        double rgdMedian[ARRAYSIZE(c_rgcUsers)] = {};
+        for (size_t iSize = 0; iSize < ARRAYSIZE(c_rgcUsers); iSize++)
+        {
+            DWORD cUsers = c_rgcUsers[iSize];
+            CFakeUserArray users(cUsers);
+            TEST_PROVIDER provider(&users);
+            long cInitialized = s_cInitialized;
+
+            std::vector<double> vecSamples;
+            for (int iRound = 0; iRound < c_cRounds; iRound++)
+            {
+                provider.pcp->SetUsageScenario(CPUS_LOGON, 0);
+                auto start = std::chrono::steady_clock::now();
+                DWORD cCredentials = provider.Count();
+                vecSamples.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+                if (cCredentials != cUsers)
+                {
+                    Check(false, pszTest, "a tile for every user");
+                    break;
+                }
+            }
+            rgdMedian[iSize] = MedianMicroseconds(vecSamples);
+            Check(s_cInitialized == cInitialized, pszTest, "no credential is created");
+            Check(users.GetAtCalls() == cUsers, pszTest, "the array is only read in SetUserArray");
+            fprintf(stderr, "GetCredentialCount, %4u users: median %.1f us over %d rounds\n", cUsers, rgdMedian[iSize], c_cRounds);
+        }
+
+        // What is left per user is walking the slots: a few nanoseconds each, some tens under the
+        // sanitizers. Reading a user from the array or creating a credential costs microseconds.
+        double dPerUser = (rgdMedian[ARRAYSIZE(c_rgcUsers) - 1] - rgdMedian[0]) / (c_rgcUsers[ARRAYSIZE(c_rgcUsers) - 1] - c_rgcUsers[0]);
+        Check(dPerUser < 0.25, pszTest, "each user adds less than a quarter of a microsecond");
+    }
+}
+
+HRESULT WriteLogMessage(_In_z_ PCWSTR)
+{
+    return S_OK;
+}
+
+void DllAddRef()
+{
+    InterlockedIncrement(&s_cDllRefs);
+}
+
+void DllRelease()
+{
+    InterlockedDecrement(&s_cDllRefs);
+}
+
+void DllRecordFirstCredentialCount()
+{
+}
+
+HRESULT FieldDescriptorCoAllocCopy(_In_ const CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR &, _Outptr_result_nullonfailure_ CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR **ppcpfd)
+{
+    *ppcpfd = nullptr;
+    return E_NOTIMPL;
+}
+
+HRESULT RetrieveCachedNegotiateAuthPackage(_Out_ ULONG *pulAuthPackage)
+{
+    *pulAuthPackage = 0;
+    return E_NOTIMPL;
+}
+
+HRESULT GetWarmStartUserNames(_In_ PCWSTR pszUserSid, _Outptr_result_maybenull_ PWSTR *ppszQualifiedUserName, _Outptr_result_maybenull_ PWSTR *ppszDisplayName)
+{
+    *ppszQualifiedUserName = nullptr;
+    *ppszDisplayName = nullptr;
+    WaitForSingleObject(s_hWarmStartGate, INFINITE);
+    std::lock_guard<std::mutex> lock(s_mutexWarmStart);
+    auto it = s_mapWarmStartNames.find(pszUserSid);
+    if (it == s_mapWarmStartNames.end())
+    {
+        return S_FALSE;
+    }
+    return DupString(it->second, ppszDisplayName);
+}
+
+void RecordWarmStartUserNames(_In_ PCWSTR, _In_ PCWSTR, _In_ PCWSTR)
+{
+}
+
+bool GetWarmStartMfaFactor(_In_ PCWSTR, DWORD, _Out_ MFA_FACTOR *pmfaFactor)
+{
+    *pmfaFactor = MFA_FACTOR_NONE;
+    return false;
+}
+
+HRESULT GetAccountNameForSid(_In_ PCWSTR, bool, _Outptr_result_maybenull_ PWSTR *ppszAccountName)
+{
+    *ppszAccountName = nullptr;
+    return S_FALSE;
+}
+
+HRESULT GetUserGroupHashes(_In_ PCWSTR, bool, _Out_writes_to_(cMax, *pcGroups) ULONGLONG *, DWORD, _Out_ DWORD *pcGroups)
+{
+    *pcGroups = 0;
+    return S_FALSE;
+}
+
+LONG GetUserGroupGeneration()
+{
+    return 0;
+}
+
+HRESULT GetConfigSnapshot(_Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    *ppSnapshot = nullptr;
+    return E_FAIL;
+}
+
+ULONG CConfigSnapshot::Release()
+{
+    return 0;
+}
+
+HRESULT GetMfaPolicyIndex(_Outptr_ CMfaPolicyIndex **ppIndex)
+{
+    *ppIndex = nullptr;
+    return HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND);
+}
+
+ULONG CMfaPolicyIndex::Release()
+{
+    return 0;
+}
+
+DWORD CMfaPolicyIndex::Checksum() const
+{
+    return 0;
+}
+
+MFA_FACTOR CMfaPolicyIndex::DecideForSidString(_In_ PCWSTR, _In_reads_opt_(cGroups) const ULONGLONG *, DWORD) const
+{
+    return MFA_FACTOR_NONE;
+}
+
+// The credential records the user it was bound to and counts what the provider asks of it;
+// everything LogonUI would call afterwards is not reached by these tests.
+const QITAB CSampleCredential::c_rgqit[] =
+{
+    QITABENT(CSampleCredential, ICredentialProviderCredential),
+    QITABENT(CSampleCredential, ICredentialProviderCredential2),
+    QITABENT(CSampleCredential, ICredentialProviderCredentialWithFieldOptions),
+    {0},
+};
+
+CSampleCredential::CSampleCredential() :
+    _cpus(CPUS_INVALID),
+    _pszUserSid(nullptr),
+    _mfaFactor(MFA_FACTOR_NONE)
+{
+    InterlockedIncrement(&s_cCredentials);
+}
+
+CSampleCredential::~CSampleCredential()
+{
+    CoTaskMemFree(_pszUserSid);
+    InterlockedDecrement(&s_cCredentials);
+}
+
+HRESULT CSampleCredential::Initialize(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus,
+                                      _In_ CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR const *,
+                                      _In_ FIELD_STATE_PAIR const *,
+                                      _In_opt_ const USER_METADATA *pUser)
+{
+    InterlockedIncrement(&s_cInitialized);
+    _cpus = cpus;
+    return (pUser != nullptr && *pUser->pszSid != L'\0') ? DupString(pUser->pszSid, &_pszUserSid) : S_OK;
+}
+
+HRESULT CSampleCredential::ResetForReuse()
+{
+    InterlockedIncrement(&s_cReused);
+    return S_OK;
+}
+
+HRESULT CSampleCredential::SetRemoteCredentials(_In_ PCWSTR, _In_ PCWSTR)
+{
+    return E_NOTIMPL;
+}
+
+void CSampleCredential::SetMfaFactor(MFA_FACTOR mfaFactor)
+{
+    _mfaFactor = mfaFactor;
+}
+
+bool CSampleCredential::IsSecondFactorReady() const
+{
+    return false;
+}
+
+HRESULT CSampleCredential::GetUserSid(_Outptr_result_nullonfailure_ PWSTR *ppszSid)
+{
+    *ppszSid = nullptr;
+    return (_pszUserSid != nullptr) ? DupString(_pszUserSid, ppszSid) : S_FALSE;
+}
+
+HRESULT CSampleCredential::Advise(_In_ ICredentialProviderCredentialEvents *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::UnAdvise() { return E_NOTIMPL; }
+HRESULT CSampleCredential::SetSelected(_Out_ BOOL *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::SetDeselected() { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetFieldState(DWORD, _Out_ CREDENTIAL_PROVIDER_FIELD_STATE *, _Out_ CREDENTIAL_PROVIDER_FIELD_INTERACTIVE_STATE *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetStringValue(DWORD, _Outptr_result_nullonfailure_ PWSTR *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetBitmapValue(DWORD, _Outptr_result_nullonfailure_ HBITMAP *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetCheckboxValue(DWORD, _Out_ BOOL *, _Outptr_result_nullonfailure_ PWSTR *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetComboBoxValueCount(DWORD, _Out_ DWORD *, _Out_ DWORD *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetComboBoxValueAt(DWORD, DWORD, _Outptr_result_nullonfailure_ PWSTR *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetSubmitButtonValue(DWORD, _Out_ DWORD *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::SetStringValue(DWORD, _In_ PCWSTR) { return E_NOTIMPL; }
+HRESULT CSampleCredential::SetCheckboxValue(DWORD, BOOL) { return E_NOTIMPL; }
+HRESULT CSampleCredential::SetComboBoxSelectedValue(DWORD, DWORD) { return E_NOTIMPL; }
+HRESULT CSampleCredential::CommandLinkClicked(DWORD) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetSerialization(_Out_ CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE *, _Out_ CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION *,
+                                            _Outptr_result_maybenull_ PWSTR *, _Out_ CREDENTIAL_PROVIDER_STATUS_ICON *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::ReportResult(NTSTATUS, NTSTATUS, _Outptr_result_maybenull_ PWSTR *, _Out_ CREDENTIAL_PROVIDER_STATUS_ICON *) { return E_NOTIMPL; }
+HRESULT CSampleCredential::GetFieldOptions(DWORD, _Out_ CREDENTIAL_PROVIDER_CREDENTIAL_FIELD_OPTIONS *) { return E_NOTIMPL; }
+
+int main()
+{
+    s_hWarmStartGate = CreateEventW(nullptr, TRUE, TRUE, nullptr);
+
+    TestLazy();
+    TestPool();
+    TestResolvedNames();
+    TestBenchmark();
+
+    // The name resolution workers hold the caches, and the caches hold the DLL.
+    Check(WaitFor([]() { return s_cDllRefs == 0; }), "Main", "every provider and cache is released");
+    Check(s_cCredentials == 0, "Main", "every credential is released");
+    CloseHandle(s_hWarmStartGate);
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,419 @@
+// Tests for the provider filter policy and its result cache (filterpolicy.cpp).
+//
+// The config snapshot is replaced by the one below, which serves whatever rules and exclusive
+// slots the test last set, so this builds on Linux against the headers in tests/shim, under the
+// sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/filterpolicy_test.cpp cpp/filterpolicy.cpp cpp/guid.cpp
+//       -o filterpolicy_test
+//   ./filterpolicy_test
+//
+// Every decision is checked against a plain reimplementation of the policy that filterpolicy.h
+// and Filter\ExclusiveSlots describe, with a linear rule search in place of the binary one.
+
+#include <windows.h>
+#include <stdio.h>
+#include <algorithm>
+#include <random>
+#include <vector>
+#include "../filterpolicy.h"
+#include "../configsnapshot.h"
+#include "../guid.h"
+
+#ifndef CPF_REMOTE_SESSION
+#define CPF_REMOTE_SESSION 0x1
+#endif
+#ifndef CPF_REMOTE_CONNECTION
+#define CPF_REMOTE_CONNECTION 0x2
+#endif
+
+// What the stub snapshot serves. configsnapshot.h only declares this, so the test lays it out.
+struct CONFIG_SETTINGS
+{
+    bool    fExclusiveSlots;
+    DWORD   dwExclusiveSlots;
+};
+
+namespace
+{
+    // Logon, unlock and change password remote, and CredUI both ways.
+    const DWORD c_dwDefaultExclusiveSlots = 0xEA;
+
+    const CREDENTIAL_PROVIDER_USAGE_SCENARIO c_rgcpus[] =
+    {
+        CPUS_INVALID, CPUS_LOGON, CPUS_UNLOCK_WORKSTATION, CPUS_CHANGE_PASSWORD, CPUS_CREDUI, CPUS_PLAP,
+    };
+    const DWORD c_rgdwFlags[] = { 0, CPF_REMOTE_SESSION, CPF_REMOTE_CONNECTION, CPF_REMOTE_SESSION | CPF_REMOTE_CONNECTION, 0x100 };
+
+    bool s_fConfig = false;
+    LONG s_lGeneration = 0;
+    CONFIG_SETTINGS s_settings = {};
+    std::vector<CONFIG_FILTER_RULE> s_vecRules;
+
+    int s_cFailures = 0;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // Swaps in a new configuration, as a registry change would. Sorts the rules the way the
+    // compiler stores them.
+    void SetConfig(bool fConfig, bool fExclusiveSlots, DWORD dwExclusiveSlots, std::vector<CONFIG_FILTER_RULE> vecRules)
+    {
+        std::sort(vecRules.begin(), vecRules.end(), [](const CONFIG_FILTER_RULE &a, const CONFIG_FILTER_RULE &b)
+        {
+            return memcmp(&a.clsid, &b.clsid, sizeof(GUID)) < 0;
+        });
+        s_fConfig = fConfig;
+        s_settings.fExclusiveSlots = fExclusiveSlots;
+        s_settings.dwExclusiveSlots = dwExclusiveSlots;
+        s_vecRules = vecRules;
+        s_lGeneration++;
+    }
+
+    GUID RandomGuid(std::mt19937 &rng)
+    {
+        GUID guid;
+        BYTE *pb = reinterpret_cast<BYTE *>(&guid);
+        for (size_t i = 0; i < sizeof(guid); i++)
+        {
+            pb[i] = static_cast<BYTE>(rng());
+        }
+        return guid;
+    }
+
+    DWORD ReferenceSlot(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus, DWORD dwFlags)
+    {
+        DWORD dwRemote = (dwFlags & (CPF_REMOTE_SESSION | CPF_REMOTE_CONNECTION)) ? 1 : 0;
+        switch (cpus)
+        {
+        case CPUS_LOGON: return 1u << (0 + dwRemote);
+        case CPUS_UNLOCK_WORKSTATION: return 1u << (2 + dwRemote);
+        case CPUS_CHANGE_PASSWORD: return 1u << (4 + dwRemote);
+        case CPUS_CREDUI: return 1u << (6 + dwRemote);
+        default: return 0;
+        }
+    }
+
+    BOOL ReferenceAllow(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus, DWORD dwFlags, const GUID &clsid)
+    {
+        DWORD dwSlot = ReferenceSlot(cpus, dwFlags);
+        if (IsEqualGUID(clsid, CLSID_CSample))
+        {
+            return dwSlot != 0;
+        }
+        if (dwSlot == 0)
+        {
+            return TRUE;
+        }
+        DWORD dwExclusiveSlots = c_dwDefaultExclusiveSlots;
+        if (s_fConfig && s_settings.fExclusiveSlots)
+        {
+            dwExclusiveSlots = s_settings.dwExclusiveSlots;
+        }
+        if (dwExclusiveSlots & dwSlot)
+        {
+            return FALSE;
+        }
+        for (const CONFIG_FILTER_RULE &rule : s_vecRules)
+        {
+            if (s_fConfig && IsEqualGUID(rule.clsid, clsid))
+            {
+                return (rule.dwDenySlots & dwSlot) == 0;
+            }
+        }
+        return TRUE;
+    }
+
+    // Runs FilterProviders over every scenario and flag combination and checks each decision.
+    void CheckAllScenarios(const char *pszTest, const std::vector<GUID> &vecProviders)
+    {
+        for (CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus : c_rgcpus)
+        {
+            for (DWORD dwFlags : c_rgdwFlags)
+            {
+                std::vector<BOOL> vecAllow(vecProviders.size(), 2);
+                DWORD cBlocked = FilterProviders(cpus, dwFlags, vecProviders.data(), vecAllow.data(), static_cast<DWORD>(vecProviders.size()));
+                DWORD cExpectedBlocked = 0;
+                bool fMatch = true;
+                for (size_t i = 0; i < vecProviders.size(); i++)
+                {
+                    BOOL fExpected = ReferenceAllow(cpus, dwFlags, vecProviders[i]);
+                    fMatch = fMatch && (vecAllow[i] == fExpected);
+                    cExpectedBlocked += fExpected ? 0 : 1;
+                }
+                if (!fMatch || cBlocked != cExpectedBlocked)
+                {
+                    fprintf(stderr, "  scenario %d, flags 0x%x\n", static_cast<int>(cpus), dwFlags);
+                    Check(fMatch, pszTest, "a provider got the wrong decision");
+                    Check(cBlocked == cExpectedBlocked, pszTest, "blocked count does not match the decisions");
+                }
+            }
+        }
+    }
+
+    // With no configuration, or one that sets nothing, the built-in policy holds: only our
+    // provider in CredUI and remote sessions, everyone locally.
+    void TestDefaults()
+    {
+        std::mt19937 rng(1);
+        std::vector<GUID> vecProviders = { CLSID_CSample, RandomGuid(rng), RandomGuid(rng), CLSID_CSampleFilter };
+
+        SetConfig(false, false, 0, {});
+        CheckAllScenarios("Defaults/no config", vecProviders);
+
+        SetConfig(true, false, 0, {});
+        CheckAllScenarios("Defaults/empty config", vecProviders);
+
+        BOOL rgbAllow[4];
+        Check(FilterProviders(CPUS_LOGON, 0, vecProviders.data(), rgbAllow, 4) == 0, "Defaults", "local logon blocks nobody");
+        Check(FilterProviders(CPUS_CREDUI, 0, vecProviders.data(), rgbAllow, 4) == 3, "Defaults", "CredUI shows only ours");
+        Check(rgbAllow[0] && !rgbAllow[1], "Defaults", "CredUI shows only ours");
+        Check(FilterProviders(CPUS_PLAP, CPF_REMOTE_SESSION, vecProviders.data(), rgbAllow, 4) == 1 && !rgbAllow[0],
+              "Defaults", "an unknown scenario hides only ours");
+    }
+
+    // ExclusiveSlots replaces the default outright, including with zero.
+    void TestExclusiveSlots()
+    {
+        std::mt19937 rng(2);
+        std::vector<GUID> vecProviders = { RandomGuid(rng), CLSID_CSample, RandomGuid(rng) };
+        for (DWORD dwExclusiveSlots : { 0x00u, 0x01u, 0x55u, 0xAAu, 0xFFu, 0xFFFFFF00u })
+        {
+            SetConfig(true, true, dwExclusiveSlots, {});
+            CheckAllScenarios("ExclusiveSlots", vecProviders);
+        }
+
+        BOOL rgbAllow[3];
+        SetConfig(true, true, 0, {});
+        Check(FilterProviders(CPUS_CREDUI, CPF_REMOTE_SESSION, vecProviders.data(), rgbAllow, 3) == 0,
+              "ExclusiveSlots", "zero opens CredUI to everyone");
+    }
+
+    // Rules hide a provider in their slots only, and only that provider. Rule tables of every size
+    // up to a few hundred, looked up for listed and unlisted providers alike.
+    void TestRules()
+    {
+        std::mt19937 rng(3);
+        for (DWORD cRules : { 1u, 2u, 3u, 7u, 8u, 9u, 64u, 300u })
+        {
+            std::vector<CONFIG_FILTER_RULE> vecRules;
+            std::vector<GUID> vecProviders = { CLSID_CSample };
+            for (DWORD i = 0; i < cRules; i++)
+            {
+                CONFIG_FILTER_RULE rule = { RandomGuid(rng), static_cast<DWORD>(rng()) & 0xFF };
+                vecRules.push_back(rule);
+                vecProviders.push_back(rule.clsid);
+                if (i % 3 == 0)
+                {
+                    // A neighbour in memcmp order that has no rule.
+                    GUID guid = rule.clsid;
+                    guid.Data4[7] ^= 1;
+                    vecProviders.push_back(guid);
+                }
+            }
+            // Our own provider is ruled by the policy, never by a rule naming it.
+            CONFIG_FILTER_RULE ruleOurs = { CLSID_CSample, 0xFF };
+            vecRules.push_back(ruleOurs);
+
+            std::shuffle(vecProviders.begin(), vecProviders.end(), rng);
+            SetConfig(true, true, 0x80, vecRules);
+            CheckAllScenarios("Rules", vecProviders);
+            SetConfig(true, false, 0, vecRules);
+            CheckAllScenarios("Rules/default exclusive", vecProviders);
+        }
+
+        // The extremes of the GUID order.
+        GUID guidLow = {};
+        GUID guidHigh;
+        memset(&guidHigh, 0xFF, sizeof(guidHigh));
+        std::vector<CONFIG_FILTER_RULE> vecRules = { { guidLow, 0x01 }, { guidHigh, 0x04 } };
+        SetConfig(true, true, 0, vecRules);
+        std::vector<GUID> vecProviders = { guidHigh, guidLow, CLSID_CSample };
+        BOOL rgbAllow[3];
+        Check(FilterProviders(CPUS_LOGON, 0, vecProviders.data(), rgbAllow, 3) == 1 && rgbAllow[0] && !rgbAllow[1],
+              "Rules", "the lowest GUID is found");
+        Check(FilterProviders(CPUS_UNLOCK_WORKSTATION, 0, vecProviders.data(), rgbAllow, 3) == 1 && !rgbAllow[0] && rgbAllow[1],
+              "Rules", "the highest GUID is found");
+    }
+
+    // Results are memoized per (scenario, flags, provider list) until the generation changes.
+    void TestCache()
+    {
+        const char *pszTest = "Cache";
+        std::mt19937 rng(4);
+        GUID guidHidden = RandomGuid(rng);
+        GUID guidShown = RandomGuid(rng);
+        std::vector<CONFIG_FILTER_RULE> vecRules = { { guidHidden, 0x01 } };
+        SetConfig(true, true, 0, vecRules);
+
+        FILTER_CACHE_STATS before;
+        FILTER_CACHE_STATS after;
+        GUID rgclsid[2] = { guidHidden, guidShown };
+        BOOL rgbAllow[2];
+
+        GetFilterCacheStats(&before);
+        FilterProviders(CPUS_LOGON, 0, rgclsid, rgbAllow, 2);
+        FilterProviders(CPUS_LOGON, 0, rgclsid, rgbAllow, 2);
+        GetFilterCacheStats(&after);
+        Check(after.cMisses - before.cMisses == 1 && after.cHits - before.cHits == 1, pszTest, "a repeated call is a hit");
+        Check(!rgbAllow[0] && rgbAllow[1], pszTest, "a hit returns the stored decisions");
+
+        // rgbAllow is positional, so the same providers in another order are another entry.
+        GUID rgclsidSwapped[2] = { guidShown, guidHidden };
+        GetFilterCacheStats(&before);
+        FilterProviders(CPUS_LOGON, 0, rgclsidSwapped, rgbAllow, 2);
+        GetFilterCacheStats(&after);
+        Check(after.cMisses - before.cMisses == 1, pszTest, "another order misses");
+        Check(rgbAllow[0] && !rgbAllow[1], pszTest, "another order gets its own decisions");
+
+        // So are other flags, and a shorter list with the same prefix.
+        GetFilterCacheStats(&before);
+        FilterProviders(CPUS_LOGON, CPF_REMOTE_CONNECTION, rgclsid, rgbAllow, 2);
+        FilterProviders(CPUS_LOGON, 0, rgclsid, rgbAllow, 1);
+        GetFilterCacheStats(&after);
+        Check(after.cMisses - before.cMisses == 2, pszTest, "other flags or a prefix miss");
+
+        // A new configuration takes effect on the next call.
+        vecRules[0].dwDenySlots = 0;
+        SetConfig(true, true, 0, vecRules);
+        GetFilterCacheStats(&before);
+        Check(FilterProviders(CPUS_LOGON, 0, rgclsid, rgbAllow, 2) == 0 && rgbAllow[0], pszTest, "a new generation is not served stale results");
+        GetFilterCacheStats(&after);
+        Check(after.cMisses - before.cMisses == 1, pszTest, "a new generation misses");
+
+        // More distinct lists than there are entries: the oldest goes, the results stay right.
+        SetConfig(true, true, 0x40, vecRules);
+        std::vector<std::vector<GUID>> vecLists;
+        for (int i = 0; i < 12; i++)
+        {
+            vecLists.push_back({ RandomGuid(rng), guidHidden });
+        }
+        for (int iPass = 0; iPass < 2; iPass++)
+        {
+            GetFilterCacheStats(&before);
+            for (const std::vector<GUID> &vecList : vecLists)
+            {
+                BOOL rgbList[2] = { 2, 2 };
+                FilterProviders(CPUS_CREDUI, 0, vecList.data(), rgbList, 2);
+                Check(rgbList[0] == ReferenceAllow(CPUS_CREDUI, 0, vecList[0]) && rgbList[1] == ReferenceAllow(CPUS_CREDUI, 0, vecList[1]),
+                      pszTest, "evicted entries are recomputed correctly");
+            }
+            GetFilterCacheStats(&after);
+            Check(after.cMisses - before.cMisses == 12, pszTest, "twelve lists cycle through eight entries");
+        }
+
+        // Failing to load a snapshot is generation 0 with the defaults; that is cached as well.
+        SetConfig(false, false, 0, {});
+        GetFilterCacheStats(&before);
+        FilterProviders(CPUS_CREDUI, 0, rgclsid, rgbAllow, 2);
+        FilterProviders(CPUS_CREDUI, 0, rgclsid, rgbAllow, 2);
+        GetFilterCacheStats(&after);
+        Check(after.cMisses - before.cMisses == 1 && after.cHits - before.cHits == 1, pszTest, "the defaults are cached");
+        Check(!rgbAllow[0] && !rgbAllow[1], pszTest, "the defaults apply without a snapshot");
+
+        // An empty list is answered but never stored.
+        GetFilterCacheStats(&before);
+        Check(FilterProviders(CPUS_LOGON, 0, nullptr, nullptr, 0) == 0, pszTest, "an empty list blocks nothing");
+        FilterProviders(CPUS_LOGON, 0, nullptr, nullptr, 0);
+        GetFilterCacheStats(&after);
+        Check(after.cMisses - before.cMisses == 2, pszTest, "an empty list is not cached");
+    }
+
+    // Random configurations against random provider lists.
+    void TestRandom()
+    {
+        std::mt19937 rng(5);
+        for (int iRound = 0; iRound < 200; iRound++)
+        {
+            std::vector<CONFIG_FILTER_RULE> vecRules;
+            std::vector<GUID> vecProviders;
+            DWORD cRules = rng() % 20;
+            for (DWORD i = 0; i < cRules; i++)
+            {
+                CONFIG_FILTER_RULE rule = { RandomGuid(rng), static_cast<DWORD>(rng()) };
+                vecRules.push_back(rule);
+                if (rng() % 2)
+                {
+                    vecProviders.push_back(rule.clsid);
+                }
+            }
+            for (DWORD i = rng() % 5; i > 0; i--)
+            {
+                vecProviders.push_back(RandomGuid(rng));
+            }
+            if (rng() % 2)
+            {
+                vecProviders.push_back(CLSID_CSample);
+            }
+            std::shuffle(vecProviders.begin(), vecProviders.end(), rng);
+            SetConfig(rng() % 4 != 0, rng() % 2 != 0, rng() & 0xFF, vecRules);
+            CheckAllScenarios("Random", vecProviders);
+        }
+    }
+}
+
+// The stub snapshot.
+
+CConfigSnapshot::CConfigSnapshot(LONG lGeneration, _In_ const BYTE *pbImage, bool fMapped) :
+    _cRef(1), _lGeneration(lGeneration), _pbImage(pbImage), _fMapped(fMapped),
+    _pSettings(reinterpret_cast<const CONFIG_SETTINGS *>(pbImage)),
+    _rgFilterRules(s_vecRules.data()), _cFilterRules(static_cast<DWORD>(s_vecRules.size())),
+    _rgOtpServers(nullptr), _cOtpServers(0)
+{
+}
+
+CConfigSnapshot::~CConfigSnapshot()
+{
+}
+
+ULONG CConfigSnapshot::Release()
+{
+    long cRef = --_cRef;
+    if (cRef == 0)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+DWORD CConfigSnapshot::FilterExclusiveSlots(DWORD dwDefault) const
+{
+    return _pSettings->fExclusiveSlots ? _pSettings->dwExclusiveSlots : dwDefault;
+}
+
+const CONFIG_FILTER_RULE *CConfigSnapshot::FilterRules(_Out_ DWORD *pcRules) const
+{
+    *pcRules = _cFilterRules;
+    return _rgFilterRules;
+}
+
+HRESULT CConfigSnapshot::Load(LONG lGeneration, _Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    *ppSnapshot = new CConfigSnapshot(lGeneration, reinterpret_cast<const BYTE *>(&s_settings), false);
+    return S_OK;
+}
+
+HRESULT GetConfigSnapshot(_Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    *ppSnapshot = nullptr;
+    return s_fConfig ? CConfigSnapshot::Load(s_lGeneration, ppSnapshot) : E_FAIL;
+}
+
+int main()
+{
+    TestDefaults();
+    TestExclusiveSlots();
+    TestRules();
+    TestCache();
+    TestRandom();
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
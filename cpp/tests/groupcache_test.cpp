@@ -0,0 +1,468 @@
+// Tests for the group membership cache (groupcache.cpp) against a fake directory: positive and
+// negative caching, background expansion and refresh, the pending-expansion limit, hash
+// collisions between users, and a restricted process reading what the writers cached.
+//
+// The cache goes through the shared table in sharedtable.cpp, whose section is an mmap-backed
+// view of a file in a scratch directory (see CreateFileMappingW in tests/shim). HashSid,
+// SignalProviderEvent and the logging are replaced by the stubs below, so this builds on Linux
+// against the headers in tests/shim, under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/groupcache_test.cpp cpp/groupcache.cpp cpp/sharedtable.cpp
+//       -o groupcache_test -lpthread
+//   ./groupcache_test
+
+#include <windows.h>
+#include <sddl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../groupcache.h"
+#include "../mfapolicy.h"
+#include "../providerevents.h"
+#include "../utils.h"
+#include "../Dll.h"
+
+namespace
+{
+    const ULONGLONG c_ullPositiveTtlSeconds = 30 * 60;
+    const ULONGLONG c_ullNegativeTtlSeconds = 2 * 60;
+
+    int s_cFailures = 0;
+    long s_cDllRefs = 0;
+    long s_cBaselineRefs = 0;
+    long s_cConfigChanged = 0;
+
+    // The fake directory, keyed by SID string. Expansions of unknown users fail.
+    struct FAKE_USER
+    {
+        HRESULT                 hr;
+        std::vector<ULONGLONG>  vecGroups;
+    };
+    std::mutex s_mutexDirectory;
+    std::map<std::string, FAKE_USER> s_mapDirectory;
+    std::map<std::string, int> s_mapExpansions;
+    HANDLE s_hGate = nullptr;      // Expansions wait on this while it is reset.
+    long s_cWaiting = 0;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    std::string SidBytes(PSID psid)
+    {
+        return std::string(static_cast<const char *>(psid), GetLengthSid(psid));
+    }
+
+    std::string SidBytes(PCWSTR pszSid)
+    {
+        PSID psid;
+        if (!ConvertStringSidToSidW(pszSid, &psid))
+        {
+            return std::string();
+        }
+        std::string strSid = SidBytes(psid);
+        LocalFree(psid);
+        return strSid;
+    }
+
+    void SetUser(PCWSTR pszSid, HRESULT hr, const std::vector<ULONGLONG> &vecGroups)
+    {
+        std::lock_guard<std::mutex> lock(s_mutexDirectory);
+        s_mapDirectory[SidBytes(pszSid)] = { hr, vecGroups };
+    }
+
+    int Expansions(PCWSTR pszSid)
+    {
+        std::lock_guard<std::mutex> lock(s_mutexDirectory);
+        return s_mapExpansions[SidBytes(pszSid)];
+    }
+
+    HRESULT FakeResolve(_In_ PSID psidUser,
+                        _Out_writes_to_(cMax, *pcGroups) ULONGLONG *rgullGroupHashes,
+                        DWORD cMax,
+                        _Out_ DWORD *pcGroups)
+    {
+        *pcGroups = 0;
+        InterlockedIncrement(&s_cWaiting);
+        WaitForSingleObject(s_hGate, INFINITE);
+        InterlockedDecrement(&s_cWaiting);
+
+        std::lock_guard<std::mutex> lock(s_mutexDirectory);
+        s_mapExpansions[SidBytes(psidUser)]++;
+        auto it = s_mapDirectory.find(SidBytes(psidUser));
+        if (it == s_mapDirectory.end())
+        {
+            return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+        }
+        if (FAILED(it->second.hr))
+        {
+            return it->second.hr;
+        }
+        if (it->second.vecGroups.size() > cMax)
+        {
+            return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+        }
+        std::copy(it->second.vecGroups.begin(), it->second.vecGroups.end(), rgullGroupHashes);
+        *pcGroups = static_cast<DWORD>(it->second.vecGroups.size());
+        return S_OK;
+    }
+
+    HRESULT Lookup(PCWSTR pszSid, bool fWait, std::vector<ULONGLONG> *pvecGroups, DWORD cMax = c_cMaxCachedGroups)
+    {
+        std::vector<ULONGLONG> vecGroups(cMax + 1, 0xDEADull);
+        DWORD cGroups = 0xFFFFFFFF;
+        HRESULT hr = GetUserGroupHashes(pszSid, fWait, vecGroups.data(), cMax, &cGroups);
+        if (cGroups > cMax)
+        {
+            cGroups = cMax + 1;
+        }
+        vecGroups.resize(cGroups);
+        *pvecGroups = vecGroups;
+        return hr;
+    }
+
+    // Whether pszSid is cached with exactly vecExpected, sorted.
+    bool Cached(PCWSTR pszSid, std::vector<ULONGLONG> vecExpected)
+    {
+        std::sort(vecExpected.begin(), vecExpected.end());
+        std::vector<ULONGLONG> vecGroups;
+        return Lookup(pszSid, false, &vecGroups) == S_OK && vecGroups == vecExpected;
+    }
+
+    bool NotCached(PCWSTR pszSid)
+    {
+        std::vector<ULONGLONG> vecGroups;
+        return Lookup(pszSid, false, &vecGroups) == S_FALSE && vecGroups.empty();
+    }
+
+    // Waits for every expansion queued on the thread pool to finish.
+    bool WaitForExpansions()
+    {
+        for (int i = 0; i < 5000; i++)
+        {
+            if (s_cDllRefs == s_cBaselineRefs)
+            {
+                return true;
+            }
+            Sleep(1);
+        }
+        fprintf(stderr, "  expansions did not finish\n");
+        return false;
+    }
+
+    void AdvanceSeconds(ULONGLONG cSeconds)
+    {
+        ShimAdvanceTicks(cSeconds * 1000);
+    }
+
+    // Expanding on the caller's thread, and what is cached from it.
+    void TestWait()
+    {
+        const char *pszTest = "Wait";
+        PCWSTR pszUser = L"S-1-5-21-1-2-3-1001";
+        SetUser(pszUser, S_OK, { 50, 30, 90, 10 });
+        LONG lGeneration = GetUserGroupGeneration();
+
+        std::vector<ULONGLONG> vecGroups;
+        Check(Lookup(pszUser, true, &vecGroups) == S_OK, pszTest, "expanded on the caller's thread");
+        Check(vecGroups == std::vector<ULONGLONG>({ 10, 30, 50, 90 }), pszTest, "the groups come back sorted");
+        Check(Cached(pszUser, { 10, 30, 50, 90 }) && Expansions(pszUser) == 1, pszTest, "and are cached");
+        Check(Lookup(pszUser, true, &vecGroups) == S_OK && Expansions(pszUser) == 1, pszTest, "waiting on a cached user does not expand again");
+        Check(Lookup(pszUser, false, &vecGroups, 3) == S_FALSE && vecGroups.empty(), pszTest, "a caller with too little room gets none");
+        Check(GetUserGroupGeneration() == lGeneration && s_cConfigChanged == 0, pszTest, "the caller that waited needs no rebuild");
+
+        PCWSTR pszLoner = L"S-1-5-21-1-2-3-1002";
+        SetUser(pszLoner, S_OK, {});
+        Check(Lookup(pszLoner, true, &vecGroups) == S_OK && vecGroups.empty(), pszTest, "a user in no groups is known");
+        Check(Cached(pszLoner, {}), pszTest, "and cached");
+
+        Check(FAILED(Lookup(L"not a SID", false, &vecGroups)) && vecGroups.empty(), pszTest, "a malformed SID fails");
+    }
+
+    // Lookups that miss queue an expansion and move the generation once it lands.
+    void TestBackground()
+    {
+        const char *pszTest = "Background";
+        PCWSTR pszUser = L"S-1-5-21-1-2-3-2001";
+        SetUser(pszUser, S_OK, { 7, 5 });
+        LONG lGeneration = GetUserGroupGeneration();
+        long cConfigChanged = s_cConfigChanged;
+
+        ResetEvent(s_hGate);
+        for (int i = 0; i < 5; i++)
+        {
+            Check(NotCached(pszUser), pszTest, "a miss returns at once");
+        }
+        SetEvent(s_hGate);
+        Check(WaitForExpansions(), pszTest, "the expansion finishes");
+        Check(Expansions(pszUser) == 1, pszTest, "one expansion per user at a time");
+        Check(Cached(pszUser, { 5, 7 }), pszTest, "the expansion is cached");
+        Check(GetUserGroupGeneration() == lGeneration + 1, pszTest, "the generation moves");
+        Check(s_cConfigChanged == cConfigChanged + 1, pszTest, "and tiles are told to rebuild");
+
+        // Only c_cMaxPendingResolves expansions are in flight; the rest are dropped until the
+        // next lookup.
+        std::vector<std::wstring> vecUsers;
+        for (int i = 0; i < 20; i++)
+        {
+            vecUsers.push_back(L"S-1-5-21-1-2-3-" + std::to_wstring(2100 + i));
+            SetUser(vecUsers.back().c_str(), S_OK, { static_cast<ULONGLONG>(i) });
+        }
+        ResetEvent(s_hGate);
+        for (const std::wstring &strUser : vecUsers)
+        {
+            NotCached(strUser.c_str());
+        }
+        for (int i = 0; i < 5000 && s_cWaiting < 16; i++)
+        {
+            Sleep(1);
+        }
+        Sleep(20);
+        Check(s_cWaiting == 16, pszTest, "sixteen expansions in flight at most");
+        SetEvent(s_hGate);
+        WaitForExpansions();
+        int cCached = 0;
+        for (const std::wstring &strUser : vecUsers)
+        {
+            cCached += NotCached(strUser.c_str()) ? 0 : 1;
+        }
+        Check(cCached == 16, pszTest, "the dropped ones are not cached");
+        WaitForExpansions();
+        cCached = 0;
+        for (int i = 0; i < 20; i++)
+        {
+            cCached += Cached(vecUsers[i].c_str(), { static_cast<ULONGLONG>(i) }) ? 1 : 0;
+        }
+        Check(cCached == 20, pszTest, "and are queued again by the next lookup");
+    }
+
+    // Failures are cached for two minutes, refreshed after three quarters of that.
+    void TestNegative()
+    {
+        const char *pszTest = "Negative";
+        PCWSTR pszUser = L"S-1-5-21-1-2-3-3001";
+        SetUser(pszUser, HRESULT_FROM_WIN32(ERROR_TIMEOUT), {});
+        std::vector<ULONGLONG> vecGroups;
+        Check(Lookup(pszUser, true, &vecGroups) == S_FALSE && vecGroups.empty(), pszTest, "a failed expansion has no groups");
+        Check(Lookup(pszUser, true, &vecGroups) == S_FALSE && Expansions(pszUser) == 1, pszTest, "and is not retried at once");
+
+        SetUser(pszUser, S_OK, { 42 });
+        LONG lGeneration = GetUserGroupGeneration();
+        long cConfigChanged = s_cConfigChanged;
+        AdvanceSeconds(c_ullNegativeTtlSeconds * 3 / 4 - 1);
+        Check(NotCached(pszUser), pszTest, "the failure is still cached");
+        WaitForExpansions();
+        Check(Expansions(pszUser) == 1, pszTest, "and not refreshed yet");
+        AdvanceSeconds(1);
+        Check(NotCached(pszUser), pszTest, "the lookup that finds it due still has no groups");
+        Check(WaitForExpansions() && Expansions(pszUser) == 2, pszTest, "but queues a refresh");
+        Check(Cached(pszUser, { 42 }), pszTest, "which finds the groups");
+        Check(GetUserGroupGeneration() == lGeneration + 1, pszTest, "the generation moves for a user first cached as a failure");
+        Check(s_cConfigChanged == cConfigChanged + 1, pszTest, "and tiles are told to rebuild");
+
+        // A user in more groups than fit is cached as unresolved, never truncated.
+        PCWSTR pszCrowded = L"S-1-5-21-1-2-3-3002";
+        std::vector<ULONGLONG> vecMany;
+        for (DWORD i = 0; i < c_cMaxCachedGroups + 1; i++)
+        {
+            vecMany.push_back(1000 + i);
+        }
+        SetUser(pszCrowded, S_OK, vecMany);
+        Check(Lookup(pszCrowded, true, &vecGroups) == S_FALSE && vecGroups.empty(), pszTest, "too many groups are none");
+        vecMany.pop_back();
+        SetUser(pszCrowded, S_OK, vecMany);
+        AdvanceSeconds(c_ullNegativeTtlSeconds);
+        Check(Lookup(pszCrowded, true, &vecGroups) == S_OK && vecGroups == vecMany, pszTest, "c_cMaxCachedGroups fit");
+    }
+
+    // Groups are refreshed in the background after three quarters of their lifetime, and gone
+    // once it is over.
+    void TestRefresh()
+    {
+        const char *pszTest = "Refresh";
+        PCWSTR pszUser = L"S-1-5-21-1-2-3-4001";
+        SetUser(pszUser, S_OK, { 1, 2 });
+        std::vector<ULONGLONG> vecGroups;
+        Check(Lookup(pszUser, true, &vecGroups) == S_OK, pszTest, "expand");
+        SetUser(pszUser, S_OK, { 1, 2, 3 });
+        LONG lGeneration = GetUserGroupGeneration();
+
+        AdvanceSeconds(c_ullPositiveTtlSeconds * 3 / 4 - 1);
+        Check(Cached(pszUser, { 1, 2 }), pszTest, "cached until the refresh");
+        Check(WaitForExpansions() && Expansions(pszUser) == 1, pszTest, "which is not due yet");
+        AdvanceSeconds(1);
+        Check(Cached(pszUser, { 1, 2 }), pszTest, "the cached groups are served while the refresh runs");
+        Check(WaitForExpansions() && Expansions(pszUser) == 2, pszTest, "the refresh is queued");
+        Check(Cached(pszUser, { 1, 2, 3 }), pszTest, "and replaces them");
+        Check(GetUserGroupGeneration() == lGeneration, pszTest, "a refresh does not rebuild tiles");
+
+        AdvanceSeconds(c_ullPositiveTtlSeconds);
+        Check(NotCached(pszUser), pszTest, "gone once expired");
+        Check(WaitForExpansions() && Cached(pszUser, { 1, 2, 3 }), pszTest, "and expanded again");
+        Check(GetUserGroupGeneration() == lGeneration + 1, pszTest, "which rebuilds tiles");
+    }
+
+    // Users whose SIDs hash alike share a key; neither ever sees the other's groups.
+    void TestCollision()
+    {
+        const char *pszTest = "Collision";
+        PCWSTR pszFirst = L"S-1-5-21-1-2-3-5001";
+        PCWSTR pszSecond = L"S-1-5-21-1-2-3-1005001";
+        SetUser(pszFirst, S_OK, { 11 });
+        SetUser(pszSecond, S_OK, { 22 });
+        std::vector<ULONGLONG> vecGroups;
+        Check(Lookup(pszFirst, true, &vecGroups) == S_OK && vecGroups == std::vector<ULONGLONG>({ 11 }), pszTest, "the first user");
+        Check(NotCached(pszSecond), pszTest, "the second user does not get the first one's entry");
+        Check(WaitForExpansions() && Cached(pszSecond, { 22 }), pszTest, "and is expanded");
+        Check(NotCached(pszFirst), pszTest, "taking over the key");
+        Check(WaitForExpansions() && Cached(pszFirst, { 11 }), pszTest, "and back");
+    }
+
+    // Without a fake, groups come from Authz, and there is no directory here.
+    void TestDefaultResolver()
+    {
+        const char *pszTest = "DefaultResolver";
+        PCWSTR pszUser = L"S-1-5-21-1-2-3-6001";
+        SetUser(pszUser, S_OK, { 1 });
+        SetUserGroupResolver(nullptr);
+        std::vector<ULONGLONG> vecGroups;
+        Check(Lookup(pszUser, true, &vecGroups) == S_FALSE && Expansions(pszUser) == 0, pszTest, "Authz is used");
+        SetUserGroupResolver(FakeResolve);
+        Check(NotCached(pszUser) && WaitForExpansions() && Expansions(pszUser) == 0, pszTest, "and its failure is cached");
+    }
+
+    // A process that cannot write the shared section reads what the writers cached, and keeps
+    // what it expands to itself. Runs in a child forked before any lookup; fdGo tells it when
+    // the parent has cached the user of TestWait, and fdDone when it is finished. Returns its
+    // failure count.
+    int RestrictedProcess(int fdGo, int fdDone)
+    {
+        const char *pszTest = "RestrictedProcess";
+        ShimRestrictedProcess() = true;
+        s_cFailures = 0;
+        char ch;
+        if (read(fdGo, &ch, 1) != 1)
+        {
+            return 1;
+        }
+
+        Check(Cached(L"S-1-5-21-1-2-3-1001", { 10, 30, 50, 90 }), pszTest, "the writers' entries are seen");
+        Check(Expansions(L"S-1-5-21-1-2-3-1001") == 0, pszTest, "without expanding");
+
+        PCWSTR pszUser = L"S-1-5-21-1-2-3-7001";
+        SetUser(pszUser, S_OK, { 70 });
+        std::vector<ULONGLONG> vecGroups;
+        Check(Lookup(pszUser, true, &vecGroups) == S_OK && vecGroups == std::vector<ULONGLONG>({ 70 }), pszTest, "expansions still work");
+        Check(Cached(pszUser, { 70 }) && Expansions(pszUser) == 1, pszTest, "and are cached privately");
+
+        ch = (write(fdDone, "x", 1) == 1) ? 0 : 1;
+        return s_cFailures + ch;
+    }
+}
+
+// FNV-1a over the SID, except that a last subauthority over a million hashes as if it were a
+// million less, so tests can make users collide.
+ULONGLONG HashSid(_In_ PSID psid)
+{
+    std::string strSid = SidBytes(psid);
+    DWORD dwLast = 0;
+    if (strSid.size() >= 12)
+    {
+        memcpy(&dwLast, &strSid[strSid.size() - 4], sizeof(dwLast));
+        dwLast = (dwLast > 1000000) ? dwLast - 1000000 : dwLast;
+        memcpy(&strSid[strSid.size() - 4], &dwLast, sizeof(dwLast));
+    }
+    ULONGLONG ullHash = 14695981039346656037ull;
+    for (char ch : strSid)
+    {
+        ullHash = (ullHash ^ static_cast<BYTE>(ch)) * 1099511628211ull;
+    }
+    return ullHash;
+}
+
+void SignalProviderEvent(PROVIDER_EVENT pe)
+{
+    if (pe == PE_CONFIG_CHANGED)
+    {
+        InterlockedIncrement(&s_cConfigChanged);
+    }
+}
+
+HRESULT WriteLogMessage(_In_z_ PCWSTR)
+{
+    return S_OK;
+}
+
+void DllAddRef()
+{
+    InterlockedIncrement(&s_cDllRefs);
+}
+
+void DllRelease()
+{
+    InterlockedDecrement(&s_cDllRefs);
+}
+
+int main()
+{
+    char szRoot[] = "/tmp/groupcache_test.XXXXXX";
+    if (mkdtemp(szRoot) == nullptr)
+    {
+        fprintf(stderr, "cannot create a scratch directory\n");
+        return 2;
+    }
+    ShimFileRoot() = szRoot;
+    s_hGate = CreateEventW(nullptr, TRUE, TRUE, nullptr);
+    SetUserGroupResolver(FakeResolve);
+
+    // The child has to open the tables itself, so it is forked before the first lookup.
+    int rgfdGo[2];
+    int rgfdDone[2];
+    if (pipe(rgfdGo) != 0 || pipe(rgfdDone) != 0)
+    {
+        fprintf(stderr, "cannot create pipes\n");
+        return 2;
+    }
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        _exit(RestrictedProcess(rgfdGo[0], rgfdDone[1]));
+    }
+
+    TestWait();
+    s_cBaselineRefs = s_cDllRefs;
+
+    char ch = 0;
+    int nStatus = 0;
+    Check(pid > 0 && write(rgfdGo[1], "x", 1) == 1 && read(rgfdDone[0], &ch, 1) == 1 &&
+          waitpid(pid, &nStatus, 0) == pid && WIFEXITED(nStatus) && WEXITSTATUS(nStatus) == 0,
+          "Main", "a restricted process reads the cache");
+    Check(NotCached(L"S-1-5-21-1-2-3-7001"), "Main", "what the restricted process cached stays with it");
+    WaitForExpansions();
+
+    TestBackground();
+    TestNegative();
+    TestRefresh();
+    TestCollision();
+    TestDefaultResolver();
+
+    Check(WaitForExpansions(), "Main", "no expansion is left behind");
+    CloseHandle(s_hGate);
+    DeleteFileW(L"C:\\Global.sqcp.groups");
+    rmdir(szRoot);
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+// Replays latency distributions through the hedge delay arithmetic (hedgedelay.cpp).
+//
+// Nothing here needs Windows but a few types, so this builds on Linux against the headers in
+// tests/shim, under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/hedgedelay_test.cpp cpp/hedgedelay.cpp -o hedgedelay_test
+//   ./hedgedelay_test cpp/tests/hedgedelay
+//
+// Each .txt file in the directory holds verification round trips in milliseconds, one per line,
+// in the order they came in; lines starting with # are comments. They are fed to the ring one at
+// a time, as RecordVerifySample does. After every sample the sorted copy, the delay at several
+// percentiles and the saving estimate are checked against a plain reimplementation over the
+// last c_cLatencySamples round trips. At the end, expected.txt says what each distribution comes
+// to:
+//
+//   name  p50  p90  p95  p99  hedged
+//
+// tab-separated, where pNN is the hedge delay at that percentile over the final ring, and hedged
+// is how many round trips took longer than the p95 delay in force when they were sent.
+//
+// Run with -p to print the results instead of checking them; review every line before it goes
+// into expected.txt.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+#include "../hedgedelay.h"
+
+namespace
+{
+    const DWORD c_rgdwPercentiles[] = { 50, 90, 95, 99 };
+    const DWORD c_dwHedgedPercentile = 95;
+
+    int s_cFailures = 0;
+
+    void Fail(const std::string &strName, const std::string &strWhat)
+    {
+        fprintf(stderr, "FAIL %s: %s\n", strName.c_str(), strWhat.c_str());
+        s_cFailures++;
+    }
+
+    bool ReadLines(const std::string &strPath, std::vector<std::string> *pvecLines)
+    {
+        pvecLines->clear();
+        FILE *pFile = fopen(strPath.c_str(), "r");
+        if (pFile == nullptr)
+        {
+            return false;
+        }
+        char szLine[512];
+        while (fgets(szLine, sizeof(szLine), pFile) != nullptr)
+        {
+            std::string strLine(szLine);
+            while (!strLine.empty() && (strLine.back() == '\n' || strLine.back() == '\r'))
+            {
+                strLine.pop_back();
+            }
+            if (!strLine.empty() && strLine[0] != '#')
+            {
+                pvecLines->push_back(strLine);
+            }
+        }
+        fclose(pFile);
+        return true;
+    }
+
+    // The hedge delay as hedgedelay.h describes it, over the round trips in the window.
+    DWORD ReferenceDelayMs(const std::vector<DWORD> &vecSorted, DWORD dwPercentile)
+    {
+        if (vecSorted.size() < c_cMinLatencySamples)
+        {
+            return c_dwDefaultHedgeDelayMs;
+        }
+        DWORD dwDelayMs = vecSorted[(vecSorted.size() - 1) * dwPercentile / 100];
+        return std::max(dwDelayMs, c_dwMinHedgeDelayMs);
+    }
+
+    DWORD ReferenceSavedMs(const std::vector<DWORD> &vecSorted, DWORD dwDelayMs, DWORD dwWinMs)
+    {
+        ULONGLONG ullTail = 0;
+        DWORD cTail = 0;
+        for (DWORD dwSample : vecSorted)
+        {
+            if (dwSample > dwDelayMs)
+            {
+                ullTail += dwSample;
+                cTail++;
+            }
+        }
+        DWORD dwTailMs = (cTail > 0) ? static_cast<DWORD>(ullTail / cTail) : 0;
+        return (dwTailMs > dwWinMs) ? dwTailMs - dwWinMs : 0;
+    }
+
+    // Checks the ring against the window after every sample, and returns the expected.txt line.
+    std::string Replay(const std::string &strName, const std::vector<DWORD> &vecLatencies)
+    {
+        LATENCY_RING ring = {};
+        std::deque<DWORD> dequeWindow;
+        DWORD cHedged = 0;
+        DWORD rgdwSorted[c_cLatencySamples];
+        for (size_t iSample = 0; iSample < vecLatencies.size(); iSample++)
+        {
+            DWORD cSorted = SortLatencySamples(&ring, rgdwSorted);
+            DWORD dwDelayMs = ComputeHedgeDelayMs(rgdwSorted, cSorted, c_dwHedgedPercentile);
+            if (vecLatencies[iSample] > dwDelayMs)
+            {
+                cHedged++;
+            }
+
+            AddLatencySample(&ring, vecLatencies[iSample]);
+            dequeWindow.push_back(vecLatencies[iSample]);
+            if (dequeWindow.size() > c_cLatencySamples)
+            {
+                dequeWindow.pop_front();
+            }
+
+            std::vector<DWORD> vecSorted(dequeWindow.begin(), dequeWindow.end());
+            std::sort(vecSorted.begin(), vecSorted.end());
+            std::string strAt = " after sample " + std::to_string(iSample + 1);
+            cSorted = SortLatencySamples(&ring, rgdwSorted);
+            if (std::vector<DWORD>(rgdwSorted, rgdwSorted + cSorted) != vecSorted)
+            {
+                Fail(strName, "ring does not hold the last round trips" + strAt);
+                continue;
+            }
+            for (DWORD dwPercentile = 0; dwPercentile <= 100; dwPercentile++)
+            {
+                if (ComputeHedgeDelayMs(rgdwSorted, cSorted, dwPercentile) != ReferenceDelayMs(vecSorted, dwPercentile))
+                {
+                    Fail(strName, "delay at p" + std::to_string(dwPercentile) + strAt);
+                }
+            }
+            dwDelayMs = ComputeHedgeDelayMs(rgdwSorted, cSorted, c_dwHedgedPercentile);
+            for (DWORD dwWinMs : { 0u, dwDelayMs / 2, dwDelayMs, 2 * dwDelayMs, 10000u })
+            {
+                if (EstimateHedgeSavedMs(rgdwSorted, cSorted, dwDelayMs, dwWinMs) != ReferenceSavedMs(vecSorted, dwDelayMs, dwWinMs))
+                {
+                    Fail(strName, "saving for a hedge won after " + std::to_string(dwWinMs) + " ms" + strAt);
+                }
+            }
+        }
+
+        DWORD cSorted = SortLatencySamples(&ring, rgdwSorted);
+        std::string strResult;
+        for (DWORD dwPercentile : c_rgdwPercentiles)
+        {
+            strResult += std::to_string(ComputeHedgeDelayMs(rgdwSorted, cSorted, dwPercentile)) + "\t";
+        }
+        return strResult + std::to_string(cHedged);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool fPrint = false;
+    std::string strDir = "cpp/tests/hedgedelay";
+    for (int iArg = 1; iArg < argc; iArg++)
+    {
+        if (strcmp(argv[iArg], "-p") == 0)
+        {
+            fPrint = true;
+        }
+        else
+        {
+            strDir = argv[iArg];
+        }
+    }
+
+    std::vector<std::string> vecExpected;
+    if (!ReadLines(strDir + "/expected.txt", &vecExpected))
+    {
+        fprintf(stderr, "cannot read %s/expected.txt\n", strDir.c_str());
+        return 2;
+    }
+
+    int cDistributions = 0;
+    for (const std::string &strLine : vecExpected)
+    {
+        size_t ichTab = strLine.find('\t');
+        std::string strName = strLine.substr(0, ichTab);
+        std::string strExpected = (ichTab == std::string::npos) ? std::string() : strLine.substr(ichTab + 1);
+
+        std::vector<std::string> vecLines;
+        if (!ReadLines(strDir + "/" + strName + ".txt", &vecLines))
+        {
+            Fail(strName, "cannot read " + strDir + "/" + strName + ".txt");
+            continue;
+        }
+        std::vector<DWORD> vecLatencies;
+        for (const std::string &strSample : vecLines)
+        {
+            vecLatencies.push_back(static_cast<DWORD>(strtoul(strSample.c_str(), nullptr, 10)));
+        }
+
+        std::string strResult = Replay(strName, vecLatencies);
+        if (fPrint)
+        {
+            printf("%s\t%s\n", strName.c_str(), strResult.c_str());
+        }
+        else if (strResult != strExpected)
+        {
+            Fail(strName, "result differs\n  expected: " + strExpected + "\n  actual:   " + strResult);
+        }
+        cDistributions++;
+    }
+
+    fprintf(stderr, "%d distributions, %d failures\n", cDistributions, s_cFailures);
+    return (s_cFailures == 0 && cDistributions != 0) ? 0 : 1;
+}
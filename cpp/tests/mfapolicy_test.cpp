@@ -0,0 +1,623 @@
+// Tests for the per-user MFA policy index (mfapolicy.cpp): the source parser, the perfect hash
+// the builder lays out, and the order in which Decide weighs users, groups and the default.
+//
+// The index goes through BuildMfaPolicyIndexW and GetMfaPolicyIndex as in production, into a
+// scratch directory that stands in for C:. ReplaceFileContents and MapTrustedFile are replaced by
+// the plain versions below, without the ACL checks, so this builds on Linux against the headers
+// in tests/shim, under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/mfapolicy_test.cpp cpp/mfapolicy.cpp -o mfapolicy_test
+//   ./mfapolicy_test
+//
+// Every decision is checked against a plain reimplementation of the precedence in mfapolicy.h.
+
+#include <windows.h>
+#include <sddl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+#include "../mfapolicy.h"
+#include "../utils.h"
+#include "../Dll.h"
+
+namespace
+{
+    const wchar_t c_szSourceFile[] = L"C:\\policy.txt";
+    const char *c_rgpszFactors[] = { "exempt", "otp", "totp", "push" };
+
+    int s_cFailures = 0;
+    long s_cDllRefs = 0;
+    DWORD s_cReplaced = 0;
+    std::wstring s_strLastLog;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // A policy as the source file states it, and what the index should make of it.
+    struct POLICY
+    {
+        MFA_FACTOR                                          defaultFactor;
+        std::vector<std::pair<std::wstring, MFA_FACTOR>>    users;
+        std::vector<std::pair<std::wstring, MFA_FACTOR>>    groups;     // In source order.
+
+        std::string Source() const
+        {
+            std::string strSource = std::string("default ") + c_rgpszFactors[defaultFactor] + "\n";
+            for (const auto &user : users)
+            {
+                strSource += "user " + std::string(user.first.begin(), user.first.end()) + " " + c_rgpszFactors[user.second] + "\n";
+            }
+            for (const auto &group : groups)
+            {
+                strSource += "group " + std::string(group.first.begin(), group.first.end()) + " " + c_rgpszFactors[group.second] + "\n";
+            }
+            return strSource;
+        }
+
+        // vecGroups is the user's membership, or nullptr when it is not known.
+        MFA_FACTOR Decide(const std::wstring &strUser, const std::vector<std::wstring> *pvecGroups) const
+        {
+            for (const auto &user : users)
+            {
+                if (user.first == strUser)
+                {
+                    return user.second;
+                }
+            }
+            if (pvecGroups == nullptr)
+            {
+                return StrongestGroup();
+            }
+            for (const auto &group : groups)
+            {
+                if (std::find(pvecGroups->begin(), pvecGroups->end(), group.first) != pvecGroups->end())
+                {
+                    return group.second;
+                }
+            }
+            return defaultFactor;
+        }
+
+        MFA_FACTOR StrongestGroup() const
+        {
+            MFA_FACTOR factor = defaultFactor;
+            for (const auto &group : groups)
+            {
+                factor = std::max(factor, group.second);
+            }
+            return factor;
+        }
+
+        MFA_FACTOR Strongest() const
+        {
+            MFA_FACTOR factor = StrongestGroup();
+            for (const auto &user : users)
+            {
+                factor = std::max(factor, user.second);
+            }
+            return factor;
+        }
+    };
+
+    std::vector<BYTE> SidBytes(const std::wstring &strSid)
+    {
+        PSID psid;
+        if (!ConvertStringSidToSidW(strSid.c_str(), &psid))
+        {
+            return std::vector<BYTE>();
+        }
+        const BYTE *pb = static_cast<const BYTE *>(psid);
+        std::vector<BYTE> vecSid(pb, pb + GetLengthSid(psid));
+        LocalFree(psid);
+        return vecSid;
+    }
+
+    std::vector<ULONGLONG> GroupHashes(const std::vector<std::wstring> &vecGroups)
+    {
+        std::vector<ULONGLONG> vecHashes;
+        for (const std::wstring &strGroup : vecGroups)
+        {
+            std::vector<BYTE> vecSid = SidBytes(strGroup);
+            vecHashes.push_back(HashSid(vecSid.data()));
+        }
+        return vecHashes;
+    }
+
+    // An empty membership is still a known one; data() of an empty vector may be null.
+    const ULONGLONG *Membership(const std::vector<ULONGLONG> &vecHashes)
+    {
+        static const ULONGLONG s_ullNone = 0;
+        return vecHashes.empty() ? &s_ullNone : vecHashes.data();
+    }
+
+    std::wstring RandomSid(std::mt19937 &rng)
+    {
+        // Mostly domain accounts, some with fewer subauthorities, so lengths differ as well.
+        switch (rng() % 8)
+        {
+        case 0: return L"S-1-5-" + std::to_wstring(rng() % 100);
+        case 1: return L"S-1-5-32-" + std::to_wstring(rng() % 1000);
+        default:
+            return L"S-1-5-21-" + std::to_wstring(rng()) + L"-" + std::to_wstring(rng()) + L"-" + std::to_wstring(rng()) +
+                   L"-" + std::to_wstring(rng() % 200000);
+        }
+    }
+
+    // Writes the source and runs the rundll32 entry point on it. Returns the hr it logged.
+    HRESULT Build(const std::string &strSource)
+    {
+        std::string strPath = ShimFilePath(c_szSourceFile);
+        FILE *pFile = fopen(strPath.c_str(), "wb");
+        if (pFile == nullptr)
+        {
+            return E_FAIL;
+        }
+        fwrite(strSource.data(), 1, strSource.size(), pFile);
+        fclose(pFile);
+
+        wchar_t szCmdLine[64];
+        swprintf(szCmdLine, ARRAYSIZE(szCmdLine), L"\"%ls\"", c_szSourceFile);
+        s_strLastLog.clear();
+        BuildMfaPolicyIndexW(nullptr, nullptr, szCmdLine, 0);
+        size_t ich = s_strLastLog.rfind(L"hr=0x");
+        return (ich == std::wstring::npos) ? E_UNEXPECTED : static_cast<HRESULT>(wcstoul(s_strLastLog.c_str() + ich + 5, nullptr, 16));
+    }
+
+    // Builds the policy and returns the index for it, or nullptr.
+    CMfaPolicyIndex *BuildAndLoad(const char *pszTest, const POLICY &policy)
+    {
+        CMfaPolicyIndex *pIndex = nullptr;
+        HRESULT hr = Build(policy.Source());
+        Check(SUCCEEDED(hr), pszTest, "the policy builds");
+        if (SUCCEEDED(hr))
+        {
+            hr = GetMfaPolicyIndex(&pIndex);
+            Check(SUCCEEDED(hr), pszTest, "the index loads");
+        }
+        return SUCCEEDED(hr) ? pIndex : nullptr;
+    }
+
+    // Checks every user and group of the policy, a few strangers, and random memberships.
+    void CheckPolicy(const char *pszTest, const CMfaPolicyIndex *pIndex, const POLICY &policy, std::mt19937 &rng)
+    {
+        std::vector<std::wstring> vecGroups;
+        for (const auto &group : policy.groups)
+        {
+            vecGroups.push_back(group.first);
+        }
+        std::vector<std::wstring> vecUsers;
+        for (const auto &user : policy.users)
+        {
+            vecUsers.push_back(user.first);
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            vecUsers.push_back(RandomSid(rng));
+            vecGroups.push_back(RandomSid(rng));
+        }
+
+        Check(pIndex->StrongestFactor() == policy.Strongest(), pszTest, "StrongestFactor");
+        DWORD cWrong = 0;
+        for (const std::wstring &strUser : vecUsers)
+        {
+            std::vector<BYTE> vecSid = SidBytes(strUser);
+            std::vector<std::wstring> vecMember;
+            for (DWORD i = rng() % 5; i > 0 && !vecGroups.empty(); i--)
+            {
+                vecMember.push_back(vecGroups[rng() % vecGroups.size()]);
+            }
+            std::vector<ULONGLONG> vecHashes = GroupHashes(vecMember);
+
+            MFA_FACTOR expected = policy.Decide(strUser, &vecMember);
+            cWrong += (pIndex->Decide(vecSid.data(), Membership(vecHashes), static_cast<DWORD>(vecHashes.size())) != expected) ? 1 : 0;
+            cWrong += (pIndex->DecideForSidString(strUser.c_str(), Membership(vecHashes), static_cast<DWORD>(vecHashes.size())) != expected) ? 1 : 0;
+            cWrong += (pIndex->Decide(vecSid.data(), nullptr, 0) != policy.Decide(strUser, nullptr)) ? 1 : 0;
+        }
+        if (cWrong != 0)
+        {
+            fprintf(stderr, "  %u wrong decision(s)\n", cWrong);
+            Check(false, pszTest, "decisions match the reference");
+        }
+    }
+
+    void TestNoIndex()
+    {
+        CMfaPolicyIndex *pIndex;
+        Check(GetMfaPolicyIndex(&pIndex) == HRESULT_FROM_WIN32(ERROR_FILE_NOT_FOUND) && pIndex == nullptr,
+              "NoIndex", "nothing deployed is an error, not an empty policy");
+    }
+
+    // Every user is found through one bucket and one slot, and nobody else is, for user counts
+    // around the bucket and slot rounding and up to the sizes the index is meant for.
+    void TestPerfectHash()
+    {
+        const char *pszTest = "PerfectHash";
+        std::mt19937 rng(1);
+        for (DWORD cUsers : { 0u, 1u, 2u, 3u, 4u, 5u, 7u, 8u, 9u, 17u, 100u, 1000u, 25000u })
+        {
+            POLICY policy = { MFA_FACTOR_OTP, {}, {} };
+            std::set<std::wstring> setSids;
+            while (setSids.size() < cUsers)
+            {
+                setSids.insert(RandomSid(rng));
+            }
+            for (const std::wstring &strSid : setSids)
+            {
+                // Never the default, so a miss cannot pass for a hit.
+                MFA_FACTOR factors[] = { MFA_FACTOR_NONE, MFA_FACTOR_TOTP, MFA_FACTOR_PUSH };
+                policy.users.push_back(std::make_pair(strSid, factors[rng() % 3]));
+            }
+
+            CMfaPolicyIndex *pIndex = BuildAndLoad(pszTest, policy);
+            if (pIndex == nullptr)
+            {
+                continue;
+            }
+            DWORD cMissed = 0;
+            for (const auto &user : policy.users)
+            {
+                std::vector<BYTE> vecSid = SidBytes(user.first);
+                cMissed += (pIndex->Decide(vecSid.data(), nullptr, 0) != user.second) ? 1 : 0;
+            }
+            DWORD cFalseHits = 0;
+            for (int i = 0; i < 2000; i++)
+            {
+                std::wstring strSid = RandomSid(rng);
+                if (setSids.count(strSid) == 0)
+                {
+                    std::vector<BYTE> vecSid = SidBytes(strSid);
+                    cFalseHits += (pIndex->Decide(vecSid.data(), nullptr, 0) != MFA_FACTOR_OTP) ? 1 : 0;
+                }
+            }
+            if (cMissed != 0 || cFalseHits != 0)
+            {
+                fprintf(stderr, "  %u users: %u missed, %u strangers matched\n", cUsers, cMissed, cFalseHits);
+                Check(false, pszTest, "every user and only users are found");
+            }
+            pIndex->Release();
+        }
+    }
+
+    // A user's own entry, then the first listed group the user is in, then the default; what is
+    // not known yet counts as the strongest it could be.
+    void TestPrecedence()
+    {
+        const char *pszTest = "Precedence";
+        const std::wstring strExempt = L"S-1-5-21-1-2-3-1001";
+        const std::wstring strPush = L"S-1-5-21-1-2-3-1002";
+        const std::wstring strPlain = L"S-1-5-21-1-2-3-1003";
+        const std::wstring strTotpGroup = L"S-1-5-21-1-2-3-513";
+        const std::wstring strExemptGroup = L"S-1-5-21-1-2-3-514";
+        const std::wstring strPushGroup = L"S-1-5-21-1-2-3-515";
+        POLICY policy =
+        {
+            MFA_FACTOR_OTP,
+            { { strExempt, MFA_FACTOR_NONE }, { strPush, MFA_FACTOR_PUSH } },
+            { { strTotpGroup, MFA_FACTOR_TOTP }, { strExemptGroup, MFA_FACTOR_NONE }, { strPushGroup, MFA_FACTOR_PUSH } },
+        };
+        CMfaPolicyIndex *pIndex = BuildAndLoad(pszTest, policy);
+        if (pIndex == nullptr)
+        {
+            return;
+        }
+
+        struct
+        {
+            const std::wstring                  *pstrUser;
+            std::vector<std::wstring>           vecGroups;
+            MFA_FACTOR                          expected;
+            const char                          *pszWhat;
+        }
+        c_rgCases[] =
+        {
+            { &strExempt, { strPushGroup }, MFA_FACTOR_NONE, "a user's own entry beats a stronger group" },
+            { &strPush, {}, MFA_FACTOR_PUSH, "a user's own entry beats the default" },
+            { &strPlain, { strExemptGroup, strTotpGroup }, MFA_FACTOR_TOTP, "the group listed first in the source wins, not the first in the token" },
+            { &strPlain, { strPushGroup, strExemptGroup }, MFA_FACTOR_NONE, "an earlier weaker group beats a later stronger one" },
+            { &strPlain, { L"S-1-5-21-9-9-9-513" }, MFA_FACTOR_OTP, "no matching group is the default" },
+            { &strPlain, {}, MFA_FACTOR_OTP, "no groups is the default" },
+        };
+        for (const auto &testCase : c_rgCases)
+        {
+            std::vector<BYTE> vecSid = SidBytes(*testCase.pstrUser);
+            std::vector<ULONGLONG> vecHashes = GroupHashes(testCase.vecGroups);
+            Check(pIndex->Decide(vecSid.data(), Membership(vecHashes), static_cast<DWORD>(vecHashes.size())) == testCase.expected, pszTest, testCase.pszWhat);
+        }
+
+        std::vector<BYTE> vecExempt = SidBytes(strExempt);
+        std::vector<BYTE> vecPlain = SidBytes(strPlain);
+        Check(pIndex->Decide(vecExempt.data(), nullptr, 0) == MFA_FACTOR_NONE, pszTest, "a user's own entry needs no groups");
+        Check(pIndex->Decide(vecPlain.data(), nullptr, 0) == MFA_FACTOR_PUSH, pszTest, "unknown groups are the strongest group");
+        Check(pIndex->DecideForSidString(L"not a SID", nullptr, 0) == MFA_FACTOR_PUSH, pszTest, "an unknown user is StrongestFactor");
+        Check(pIndex->DecideForSidString(strExempt.c_str(), nullptr, 0) == MFA_FACTOR_NONE, pszTest, "a SID string finds the user");
+        pIndex->Release();
+
+        // StrongestFactor counts users; a decision without groups does not.
+        POLICY policyUsers =
+        {
+            MFA_FACTOR_NONE,
+            { { strPush, MFA_FACTOR_PUSH } },
+            { { strTotpGroup, MFA_FACTOR_OTP } },
+        };
+        pIndex = BuildAndLoad(pszTest, policyUsers);
+        if (pIndex != nullptr)
+        {
+            Check(pIndex->StrongestFactor() == MFA_FACTOR_PUSH, pszTest, "StrongestFactor includes users");
+            Check(pIndex->Decide(vecPlain.data(), nullptr, 0) == MFA_FACTOR_OTP, pszTest, "unknown groups leave users out");
+            Check(pIndex->DecideForSidString(L"S-1-x", nullptr, 0) == MFA_FACTOR_PUSH, pszTest, "a malformed SID is StrongestFactor");
+            pIndex->Release();
+        }
+
+        POLICY policyEmpty = { MFA_FACTOR_NONE, {}, {} };
+        pIndex = BuildAndLoad(pszTest, policyEmpty);
+        if (pIndex != nullptr)
+        {
+            Check(pIndex->StrongestFactor() == MFA_FACTOR_NONE && pIndex->Decide(vecPlain.data(), nullptr, 0) == MFA_FACTOR_NONE,
+                  pszTest, "an empty policy exempts everyone");
+            pIndex->Release();
+        }
+    }
+
+    void TestRandom()
+    {
+        std::mt19937 rng(2);
+        for (int iRound = 0; iRound < 100; iRound++)
+        {
+            POLICY policy = { static_cast<MFA_FACTOR>(rng() % 4), {}, {} };
+            std::set<std::wstring> setSids;
+            for (DWORD i = rng() % 50; i > 0; i--)
+            {
+                std::wstring strSid = RandomSid(rng);
+                if (setSids.insert(strSid).second)
+                {
+                    policy.users.push_back(std::make_pair(strSid, static_cast<MFA_FACTOR>(rng() % 4)));
+                }
+            }
+            for (DWORD i = rng() % 20; i > 0; i--)
+            {
+                std::wstring strSid = RandomSid(rng);
+                if (setSids.insert(strSid).second)
+                {
+                    policy.groups.push_back(std::make_pair(strSid, static_cast<MFA_FACTOR>(rng() % 4)));
+                }
+            }
+            CMfaPolicyIndex *pIndex = BuildAndLoad("Random", policy);
+            if (pIndex != nullptr)
+            {
+                CheckPolicy("Random", pIndex, policy, rng);
+                pIndex->Release();
+            }
+        }
+    }
+
+    // What the parser accepts, and that a source it rejects leaves the deployed index alone.
+    void TestSource()
+    {
+        const char *pszTest = "Source";
+        const std::wstring strUser = L"S-1-5-21-7-7-7-1001";
+        const std::wstring strGroup = L"S-1-5-21-7-7-7-513";
+        std::vector<BYTE> vecUser = SidBytes(strUser);
+        std::vector<BYTE> vecOther = SidBytes(L"S-1-5-21-7-7-7-1002");
+        std::vector<ULONGLONG> vecGroup = GroupHashes({ strGroup });
+
+        // BOM, CRLF, tabs, comments, blank lines, any case and no final newline.
+        HRESULT hr = Build("\xEF\xBB\xBF# MFA policy\r\n"
+                           "\r\n"
+                           "DEFAULT\tTotp   # everyone else\r\n"
+                           "  User S-1-5-21-7-7-7-1001 EXEMPT\r\n"
+                           "group\tS-1-5-21-7-7-7-513\tPush");
+        Check(SUCCEEDED(hr), pszTest, "a well-formed source builds");
+        CMfaPolicyIndex *pIndex = nullptr;
+        if (SUCCEEDED(hr) && SUCCEEDED(GetMfaPolicyIndex(&pIndex)))
+        {
+            Check(pIndex->Decide(vecUser.data(), vecGroup.data(), 1) == MFA_FACTOR_NONE, pszTest, "user line");
+            Check(pIndex->Decide(vecOther.data(), vecGroup.data(), 1) == MFA_FACTOR_PUSH, pszTest, "group line");
+            Check(pIndex->Decide(vecOther.data(), vecGroup.data(), 0) == MFA_FACTOR_TOTP, pszTest, "default line");
+        }
+        if (pIndex == nullptr)
+        {
+            return;
+        }
+        DWORD dwChecksum = pIndex->Checksum();
+        DWORD cReplaced = s_cReplaced;
+
+        struct
+        {
+            const char  *pszSource;
+            HRESULT     hrExpected;
+            const char  *pszWhat;
+        }
+        c_rgBad[] =
+        {
+            { "default strict\n", HRESULT_FROM_WIN32(ERROR_INVALID_DATA), "an unknown policy" },
+            { "user S-1-5-21-7-7-7-1001\n", HRESULT_FROM_WIN32(ERROR_INVALID_DATA), "a missing policy" },
+            { "user S-1-5-21-7-7-7-1001 otp extra\n", HRESULT_FROM_WIN32(ERROR_INVALID_DATA), "a token too many" },
+            { "member S-1-5-21-7-7-7-1001 otp\n", HRESULT_FROM_WIN32(ERROR_INVALID_DATA), "an unknown keyword" },
+            { "user alice otp\n", HRESULT_FROM_WIN32(ERROR_INVALID_SID), "a user that is not a SID" },
+            { "group S-1-5-21-7-7-7-513-x push\n", HRESULT_FROM_WIN32(ERROR_INVALID_SID), "a group that is not a SID" },
+            { "user S-1-5-21-7-7-7-1001 otp\nuser S-1-5-21-7-7-7-1001 push\n", HRESULT_FROM_WIN32(ERROR_DUP_NAME), "a user listed twice" },
+            { "group S-1-5-21-7-7-7-513 otp\ngroup S-1-5-21-7-7-7-513 otp\n", HRESULT_FROM_WIN32(ERROR_DUP_NAME), "a group listed twice" },
+            { "default otp\n\xC3\x28\n", HRESULT_FROM_WIN32(ERROR_NO_UNICODE_TRANSLATION), "invalid UTF-8" },
+        };
+        for (const auto &bad : c_rgBad)
+        {
+            hr = Build(bad.pszSource);
+            if (hr != bad.hrExpected)
+            {
+                fprintf(stderr, "  hr=0x%08X\n", static_cast<unsigned>(hr));
+                Check(false, pszTest, bad.pszWhat);
+            }
+        }
+        Check(s_cReplaced == cReplaced, pszTest, "a rejected source is never written");
+        pIndex->Release();
+        if (SUCCEEDED(GetMfaPolicyIndex(&pIndex)))
+        {
+            Check(pIndex->Checksum() == dwChecksum, pszTest, "a rejected source leaves the index in place");
+            pIndex->Release();
+        }
+
+        // An empty file is an empty policy.
+        hr = Build("");
+        Check(SUCCEEDED(hr), pszTest, "an empty source builds");
+    }
+
+    // A rebuilt file is picked up on the next call; a damaged one is not, and the index already
+    // loaded stays in force.
+    void TestReload()
+    {
+        const char *pszTest = "Reload";
+        std::mt19937 rng(3);
+        POLICY policy = { MFA_FACTOR_TOTP, { { RandomSid(rng), MFA_FACTOR_PUSH } }, { { RandomSid(rng), MFA_FACTOR_NONE } } };
+        CMfaPolicyIndex *pIndex = BuildAndLoad(pszTest, policy);
+        if (pIndex == nullptr)
+        {
+            return;
+        }
+        DWORD dwChecksum = pIndex->Checksum();
+        pIndex->Release();
+
+        std::string strIndex = ShimFilePath(L"C:\\ProgramData\\sqcp\\mfapolicy.bin");
+        FILE *pFile = fopen(strIndex.c_str(), "r+b");
+        Check(pFile != nullptr, pszTest, "the index is where GetMfaPolicyIndex looks");
+        if (pFile == nullptr)
+        {
+            return;
+        }
+        fseek(pFile, -1, SEEK_END);
+        int ch = fgetc(pFile);
+        fseek(pFile, -1, SEEK_END);
+        fputc(ch ^ 0x01, pFile);
+        fclose(pFile);
+        struct timespec rgts[2] = { { 0, UTIME_OMIT }, { 2000000000 + static_cast<time_t>(s_cReplaced), 0 } };
+        utimensat(AT_FDCWD, strIndex.c_str(), rgts, 0);
+
+        if (SUCCEEDED(GetMfaPolicyIndex(&pIndex)))
+        {
+            Check(pIndex->Checksum() == dwChecksum, pszTest, "a damaged file keeps the loaded index");
+            pIndex->Release();
+        }
+        else
+        {
+            Check(false, pszTest, "a damaged file keeps the loaded index");
+        }
+
+        policy.defaultFactor = MFA_FACTOR_OTP;
+        pIndex = BuildAndLoad(pszTest, policy);
+        if (pIndex != nullptr)
+        {
+            Check(pIndex->Checksum() != dwChecksum, pszTest, "a rebuilt file is picked up");
+            CheckPolicy(pszTest, pIndex, policy, rng);
+            pIndex->Release();
+        }
+    }
+}
+
+// Stand-ins for utils.cpp and Dll.cpp.
+
+HRESULT WriteLogMessage(_In_z_ PCWSTR pszMessage)
+{
+    s_strLastLog = pszMessage;
+    return S_OK;
+}
+
+// Writes the file whole and gives it a last-write time of its own, since two rebuilds within
+// the file system's timestamp granularity would otherwise look like one.
+HRESULT ReplaceFileContents(_In_z_ PCWSTR pszPath, _In_reads_bytes_(cb) const void *pv, DWORD cb, _In_opt_ PSECURITY_DESCRIPTOR)
+{
+    std::wstring strTemp = std::wstring(pszPath) + L".tmp";
+    HANDLE hFile = CreateFileW(strTemp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    DWORD cbWritten = 0;
+    BOOL fWritten = WriteFile(hFile, pv, cb, &cbWritten, nullptr) && cbWritten == cb;
+    CloseHandle(hFile);
+    if (!fWritten || !MoveFileExW(strTemp.c_str(), pszPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        return E_FAIL;
+    }
+    s_cReplaced++;
+    struct timespec rgts[2] = { { 0, UTIME_OMIT }, { 1000000000 + static_cast<time_t>(s_cReplaced), 0 } };
+    utimensat(AT_FDCWD, ShimFilePath(pszPath).c_str(), rgts, 0);
+    return S_OK;
+}
+
+HRESULT MapTrustedFile(_In_z_ PCWSTR pszPath, DWORD cbMax, _Outptr_result_bytebuffer_(*pcb) const BYTE **ppb, _Out_ DWORD *pcb)
+{
+    *ppb = nullptr;
+    *pcb = 0;
+    HANDLE hFile = CreateFileW(pszPath, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+    HRESULT hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    LARGE_INTEGER liSize = {};
+    if (GetFileSizeEx(hFile, &liSize) && liSize.QuadPart > 0 && liSize.QuadPart <= cbMax)
+    {
+        HANDLE hMapping = CreateFileMappingW(hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (hMapping != nullptr)
+        {
+            *ppb = static_cast<const BYTE *>(MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0));
+            *pcb = static_cast<DWORD>(liSize.QuadPart);
+            hr = (*ppb != nullptr) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+            CloseHandle(hMapping);
+        }
+    }
+    CloseHandle(hFile);
+    return hr;
+}
+
+void DllAddRef()
+{
+    InterlockedIncrement(&s_cDllRefs);
+}
+
+void DllRelease()
+{
+    InterlockedDecrement(&s_cDllRefs);
+}
+
+int main()
+{
+    char szRoot[] = "/tmp/mfapolicy_test.XXXXXX";
+    if (mkdtemp(szRoot) == nullptr)
+    {
+        fprintf(stderr, "cannot create a scratch directory\n");
+        return 2;
+    }
+    ShimFileRoot() = szRoot;
+    CreateDirectoryW(L"C:\\ProgramData", nullptr);
+    CreateDirectoryW(L"C:\\ProgramData\\sqcp", nullptr);
+
+    TestNoIndex();
+    TestPerfectHash();
+    TestPrecedence();
+    TestRandom();
+    TestSource();
+    TestReload();
+
+    // GetMfaPolicyIndex holds on to the current index; every one it replaced is gone.
+    Check(s_cDllRefs == 1, "Main", "replaced indexes are released");
+
+    DeleteFileW(c_szSourceFile);
+    DeleteFileW(L"C:\\ProgramData\\sqcp\\mfapolicy.bin");
+    rmdir((std::string(szRoot) + "/ProgramData/sqcp").c_str());
+    rmdir((std::string(szRoot) + "/ProgramData").c_str());
+    rmdir(szRoot);
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,580 @@
+// Tests for the push approval watcher in the OTP client (otpclient.cpp) against a local stand-in
+// for the SendQuick gateway that answers approvals after a scripted delay: delivery of an
+// approval, several pending approvals sharing one long poll, denials, unwatching, expiry, the
+// watch limit, and a gateway that is down or does not hold requests.
+//
+// Requests go through the WinHTTP shim in tests/shim/winhttp.h, which hands them to the
+// stand-in on the calling thread; a cancelled long poll shows up there as its abort event. The
+// gateway selection, the config snapshot, the delivery layer and the provider events are
+// replaced by the stubs below, so this builds on Linux against the headers in tests/shim, under
+// the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/otpclient_test.cpp cpp/otpclient.cpp cpp/otpresponse.cpp
+//       cpp/hedgedelay.cpp -o otpclient_test -lpthread
+//   ./otpclient_test
+
+#include <windows.h>
+#include <winhttp.h>
+#include <stdio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "../otpclient.h"
+#include "../otpdelivery.h"
+#include "../providerevents.h"
+#include "../serverselect.h"
+#include "../utils.h"
+#include "../Dll.h"
+
+namespace
+{
+    typedef std::chrono::steady_clock CLOCK;
+
+    const wchar_t c_szGatewayUrl[] = L"https://gw.example:8443/sq";
+    const ULONGLONG c_ullExpirySeconds = 300;
+
+    int s_cFailures = 0;
+    std::atomic<long> s_cDllRefs(0);
+    std::atomic<int> s_cAnsweredReports(0);
+    std::atomic<int> s_cFailedReports(0);
+
+    std::mutex s_mutexEvents;
+    std::vector<CLOCK::time_point> s_vecApprovalSignals;
+    std::vector<std::wstring> s_vecLog;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // Polls fn for up to dwMs.
+    bool WaitFor(const std::function<bool()> &fn, DWORD dwMs = 5000)
+    {
+        CLOCK::time_point deadline = CLOCK::now() + std::chrono::milliseconds(dwMs);
+        while (!fn())
+        {
+            if (CLOCK::now() >= deadline)
+            {
+                return false;
+            }
+            Sleep(1);
+        }
+        return true;
+    }
+
+    size_t ApprovalSignals()
+    {
+        std::lock_guard<std::mutex> lock(s_mutexEvents);
+        return s_vecApprovalSignals.size();
+    }
+
+    size_t Logged(PCWSTR pszPrefix)
+    {
+        std::lock_guard<std::mutex> lock(s_mutexEvents);
+        return std::count_if(s_vecLog.begin(), s_vecLog.end(), [pszPrefix](const std::wstring &str)
+        {
+            return str.compare(0, wcslen(pszPrefix), pszPrefix) == 0;
+        });
+    }
+
+    // The stand-in gateway. A challenge stays pending until the answer a test scripted for it
+    // falls due; /otp/wait holds until one of the challenges it names is answered, the hold runs
+    // out or the client closes the request.
+    struct STANDIN_CHALLENGE
+    {
+        std::string         strStatus;      // Empty while nothing is scripted.
+        CLOCK::time_point   due;
+    };
+
+    struct STANDIN_GATEWAY
+    {
+        std::mutex                                  mutex;
+        std::map<std::string, STANDIN_CHALLENGE>    mapChallenges;
+        int                                         cIssued = 0;
+        int                                         cWaits = 0;
+        int                                         cWaitsInFlight = 0;
+        int                                         cMaxWaitsInFlight = 0;
+        int                                         cAborted = 0;
+        std::vector<std::string>                    vecLastWait;    // The challenges the last /otp/wait named.
+        std::string                                 strLastHold;
+        DWORD                                       dwLastReceiveTimeoutMs = 0;
+        bool                                        fWrongHost = false;
+        bool                                        fDown = false;          // Answers everything with 500.
+        bool                                        fNoHold = false;        // Answers /otp/wait as pending at once.
+    };
+    STANDIN_GATEWAY s_gateway;
+
+    // Splits a form body into its fields; a repeated name keeps every value.
+    std::multimap<std::string, std::string> ParseForm(const std::string &strBody)
+    {
+        std::multimap<std::string, std::string> mapFields;
+        size_t ich = 0;
+        while (ich < strBody.size())
+        {
+            size_t ichEnd = strBody.find('&', ich);
+            if (ichEnd == std::string::npos)
+            {
+                ichEnd = strBody.size();
+            }
+            std::string strField = strBody.substr(ich, ichEnd - ich);
+            size_t ichEquals = strField.find('=');
+            if (ichEquals != std::string::npos)
+            {
+                mapFields.insert(std::make_pair(strField.substr(0, ichEquals), strField.substr(ichEquals + 1)));
+            }
+            ich = ichEnd + 1;
+        }
+        return mapFields;
+    }
+
+    // The scripted answer for strChallenge if it has fallen due, else empty.
+    std::string DueStatus(const std::string &strChallenge)
+    {
+        auto it = s_gateway.mapChallenges.find(strChallenge);
+        if (it == s_gateway.mapChallenges.end())
+        {
+            return "expired";
+        }
+        return (!it->second.strStatus.empty() && CLOCK::now() >= it->second.due) ? it->second.strStatus : std::string();
+    }
+
+    DWORD StandInWait(const SHIM_HTTP_REQUEST &request, const std::multimap<std::string, std::string> &mapFields, std::string *pstrResponse)
+    {
+        std::vector<std::string> vecChallenges;
+        auto range = mapFields.equal_range("challenge");
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            vecChallenges.push_back(it->second);
+        }
+        auto itHold = mapFields.find("hold");
+
+        std::unique_lock<std::mutex> lock(s_gateway.mutex);
+        s_gateway.cWaits++;
+        s_gateway.cWaitsInFlight++;
+        s_gateway.cMaxWaitsInFlight = max(s_gateway.cMaxWaitsInFlight, s_gateway.cWaitsInFlight);
+        s_gateway.vecLastWait = vecChallenges;
+        s_gateway.strLastHold = (itHold != mapFields.end()) ? itHold->second : std::string();
+        s_gateway.dwLastReceiveTimeoutMs = request.dwReceiveTimeoutMs;
+
+        DWORD dwStatusCode = 0;
+        CLOCK::time_point deadline = CLOCK::now() + std::chrono::seconds(atoi(s_gateway.strLastHold.c_str()));
+        while (dwStatusCode == 0)
+        {
+            if (s_gateway.fDown)
+            {
+                dwStatusCode = 500;
+                break;
+            }
+            for (const std::string &strChallenge : vecChallenges)
+            {
+                std::string strStatus = DueStatus(strChallenge);
+                if (!strStatus.empty())
+                {
+                    *pstrResponse = "{\"status\":\"" + strStatus + "\",\"challenge\":\"" + strChallenge + "\"}";
+                    dwStatusCode = 200;
+                    break;
+                }
+            }
+            if (dwStatusCode == 0 && (s_gateway.fNoHold || CLOCK::now() >= deadline))
+            {
+                *pstrResponse = "{\"status\":\"pending\"}";
+                dwStatusCode = 200;
+            }
+            if (dwStatusCode == 0)
+            {
+                lock.unlock();
+                bool fAborted = (WaitForSingleObject(request.hAbort, 5) == WAIT_OBJECT_0);
+                lock.lock();
+                if (fAborted)
+                {
+                    s_gateway.cAborted++;
+                    break;
+                }
+            }
+        }
+        s_gateway.cWaitsInFlight--;
+        return dwStatusCode;
+    }
+
+    DWORD StandInGateway(const SHIM_HTTP_REQUEST &request, std::string *pstrResponse)
+    {
+        if (request.strHost != L"gw.example" || request.nPort != 8443 || !request.fSecure)
+        {
+            std::lock_guard<std::mutex> lock(s_gateway.mutex);
+            s_gateway.fWrongHost = true;
+            return 0;
+        }
+        if (request.strVerb == L"HEAD")
+        {
+            return 200;
+        }
+
+        std::multimap<std::string, std::string> mapFields = ParseForm(request.strBody);
+        if (request.strPath == L"/sq/otp/wait")
+        {
+            return StandInWait(request, mapFields, pstrResponse);
+        }
+
+        std::lock_guard<std::mutex> lock(s_gateway.mutex);
+        if (s_gateway.fDown)
+        {
+            return 500;
+        }
+        auto itChallenge = mapFields.find("challenge");
+        if (request.strPath == L"/sq/otp/request")
+        {
+            std::string strChallenge = "push-" + std::to_string(++s_gateway.cIssued);
+            s_gateway.mapChallenges[strChallenge] = STANDIN_CHALLENGE();
+            *pstrResponse = "{\"status\":\"ok\",\"challenge\":\"" + strChallenge + "\",\"expiry\":" + std::to_string(c_ullExpirySeconds) + "}";
+        }
+        else if (request.strPath == L"/sq/otp/status" && itChallenge != mapFields.end())
+        {
+            std::string strStatus = DueStatus(itChallenge->second);
+            *pstrResponse = "{\"status\":\"" + (strStatus.empty() ? std::string("pending") : strStatus) + "\"}";
+        }
+        else if (request.strPath == L"/sq/otp/cancel" && itChallenge != mapFields.end())
+        {
+            s_gateway.mapChallenges.erase(itChallenge->second);
+            *pstrResponse = "{\"status\":\"ok\"}";
+        }
+        else
+        {
+            return 404;
+        }
+        return 200;
+    }
+
+    // Scripts the gateway's answer for pChallenge, dwDelayMs from now.
+    CLOCK::time_point Answer(const OTP_CHALLENGE *pChallenge, const char *pszStatus, DWORD dwDelayMs)
+    {
+        char szChallenge[c_cchMaxChallengeId];
+        WideCharToMultiByte(CP_UTF8, 0, pChallenge->szChallengeId, -1, szChallenge, sizeof(szChallenge), nullptr, nullptr);
+        std::lock_guard<std::mutex> lock(s_gateway.mutex);
+        STANDIN_CHALLENGE &challenge = s_gateway.mapChallenges[szChallenge];
+        challenge.strStatus = pszStatus;
+        challenge.due = CLOCK::now() + std::chrono::milliseconds(dwDelayMs);
+        return challenge.due;
+    }
+
+    std::string Narrow(const OTP_CHALLENGE *pChallenge)
+    {
+        char szChallenge[c_cchMaxChallengeId];
+        WideCharToMultiByte(CP_UTF8, 0, pChallenge->szChallengeId, -1, szChallenge, sizeof(szChallenge), nullptr, nullptr);
+        return szChallenge;
+    }
+
+    // Whether the long poll in flight names exactly these challenges.
+    bool Polling(std::vector<const OTP_CHALLENGE *> vecChallenges)
+    {
+        std::vector<std::string> vecExpected;
+        for (const OTP_CHALLENGE *pChallenge : vecChallenges)
+        {
+            vecExpected.push_back(Narrow(pChallenge));
+        }
+        std::sort(vecExpected.begin(), vecExpected.end());
+        std::lock_guard<std::mutex> lock(s_gateway.mutex);
+        std::vector<std::string> vecPolled = s_gateway.vecLastWait;
+        std::sort(vecPolled.begin(), vecPolled.end());
+        return s_gateway.cWaitsInFlight == 1 && vecPolled == vecExpected;
+    }
+
+    int Waits()
+    {
+        std::lock_guard<std::mutex> lock(s_gateway.mutex);
+        return s_gateway.cWaits;
+    }
+
+    // The watcher holds a DLL reference while it runs.
+    bool WatcherStopped()
+    {
+        return WaitFor([]() { return s_cDllRefs == 0; });
+    }
+
+    HRESULT RequestPush(PCWSTR pszUserName, OTP_CHALLENGE *pChallenge)
+    {
+        return RequestOtpChallenge(pszUserName, L"push", pChallenge);
+    }
+
+    // An approval given after a delay completes the watch, and is signalled, without any
+    // round trip beyond the long poll.
+    void TestApproval()
+    {
+        const char *pszTest = "Approval";
+        OTP_CHALLENGE challenge;
+        Check(RequestPush(L"alice", &challenge) == S_OK && wcscmp(challenge.szServerUrl, c_szGatewayUrl) == 0, pszTest, "the challenge is issued");
+        Check(GetWatchedOtpApproval(&challenge) == HRESULT_FROM_WIN32(ERROR_NOT_FOUND), pszTest, "nothing is watched yet");
+
+        int cAnsweredReports = s_cAnsweredReports;
+        Check(WatchOtpApproval(&challenge) == S_OK, pszTest, "the approval is watched");
+        Check(WaitFor([&challenge]() { return Polling({ &challenge }); }), pszTest, "a long poll names it");
+        {
+            std::lock_guard<std::mutex> lock(s_gateway.mutex);
+            Check(s_gateway.strLastHold == "25" && s_gateway.dwLastReceiveTimeoutMs > 25000, pszTest, "the poll asks to be held and waits for it");
+        }
+        Check(GetWatchedOtpApproval(&challenge) == E_PENDING, pszTest, "it is pending");
+        Check(WatchOtpApproval(&challenge) == S_OK && Waits() == 1, pszTest, "watching it again changes nothing");
+
+        CLOCK::time_point due = Answer(&challenge, "ok", 300);
+        Check(WaitFor([]() { return ApprovalSignals() == 1; }), pszTest, "the approval is signalled");
+        Check(GetWatchedOtpApproval(&challenge) == S_OK, pszTest, "and recorded");
+        {
+            std::lock_guard<std::mutex> lock(s_mutexEvents);
+            Check(!s_vecApprovalSignals.empty() && s_vecApprovalSignals.back() - due < std::chrono::milliseconds(100), pszTest,
+                  "within 100 ms of the gateway answering");
+        }
+        Check(Logged(L"[OTP] push answered hr=0x00000000") == 1, pszTest, "and logged");
+        Check(WatcherStopped() && Waits() == 1, pszTest, "the watcher stops once nothing is pending");
+        Check(s_cAnsweredReports == cAnsweredReports, pszTest, "a held poll is not reported as a latency");
+
+        UnwatchOtpApproval(&challenge);
+        Check(GetWatchedOtpApproval(&challenge) == HRESULT_FROM_WIN32(ERROR_NOT_FOUND), pszTest, "unwatching forgets it");
+    }
+
+    // Every pending approval in the process rides the same long poll.
+    void TestShared()
+    {
+        const char *pszTest = "Shared";
+        OTP_CHALLENGE rgChallenges[3];
+        PCWSTR rgpszUsers[] = { L"alice", L"bob", L"carol" };
+        int cWaits = Waits();
+        size_t cSignals = ApprovalSignals();
+        for (DWORD i = 0; i < ARRAYSIZE(rgChallenges); i++)
+        {
+            Check(RequestPush(rgpszUsers[i], &rgChallenges[i]) == S_OK && WatchOtpApproval(&rgChallenges[i]) == S_OK, pszTest, "a challenge is watched");
+        }
+        Check(WaitFor([&rgChallenges]() { return Polling({ &rgChallenges[0], &rgChallenges[1], &rgChallenges[2] }); }), pszTest,
+              "one long poll names all three");
+
+        Answer(&rgChallenges[1], "ok", 50);
+        Check(WaitFor([&rgChallenges]() { return Polling({ &rgChallenges[0], &rgChallenges[2] }); }), pszTest,
+              "after one is approved, the poll names the other two");
+        Answer(&rgChallenges[2], "denied", 50);
+        Check(WaitFor([&rgChallenges]() { return Polling({ &rgChallenges[0] }); }), pszTest, "after one is denied, the last");
+        Answer(&rgChallenges[0], "ok", 50);
+        Check(WaitFor([cSignals]() { return ApprovalSignals() == cSignals + 2; }), pszTest, "both approvals are signalled");
+        Check(WatcherStopped(), pszTest, "the watcher stops");
+
+        Check(GetWatchedOtpApproval(&rgChallenges[0]) == S_OK &&
+              GetWatchedOtpApproval(&rgChallenges[1]) == S_OK &&
+              GetWatchedOtpApproval(&rgChallenges[2]) == E_ACCESSDENIED, pszTest, "each answer is recorded against its challenge");
+        Check(ApprovalSignals() == cSignals + 2, pszTest, "a denial is not signalled");
+        {
+            std::lock_guard<std::mutex> lock(s_gateway.mutex);
+            Check(s_gateway.cMaxWaitsInFlight == 1, pszTest, "there was never more than one long poll");
+            Check(s_gateway.cWaits - cWaits <= 6, pszTest, "a poll is only restarted when the set changes");
+        }
+        for (OTP_CHALLENGE &challenge : rgChallenges)
+        {
+            UnwatchOtpApproval(&challenge);
+        }
+    }
+
+    // Unwatching the last pending approval ends the poll in flight and the watcher.
+    void TestUnwatch()
+    {
+        const char *pszTest = "Unwatch";
+        OTP_CHALLENGE challenge;
+        Check(RequestPush(L"alice", &challenge) == S_OK && WatchOtpApproval(&challenge) == S_OK, pszTest, "the approval is watched");
+        Check(WaitFor([&challenge]() { return Polling({ &challenge }); }), pszTest, "it is polled");
+
+        int cAborted;
+        {
+            std::lock_guard<std::mutex> lock(s_gateway.mutex);
+            cAborted = s_gateway.cAborted;
+        }
+        int cWaits = Waits();
+        UnwatchOtpApproval(&challenge);
+        Check(WaitFor([cAborted]() { std::lock_guard<std::mutex> lock(s_gateway.mutex); return s_gateway.cAborted == cAborted + 1; }), pszTest,
+              "the poll in flight is closed");
+        Check(WatcherStopped() && Waits() == cWaits, pszTest, "and the watcher stops without polling again");
+        Check(GetWatchedOtpApproval(&challenge) == HRESULT_FROM_WIN32(ERROR_NOT_FOUND), pszTest, "it is forgotten");
+
+        // The submit can still ask the gateway itself.
+        Answer(&challenge, "ok", 0);
+        Check(CheckOtpApproval(&challenge) == S_OK, pszTest, "the status check answers without the watcher");
+    }
+
+    // Sixteen approvals can be watched at once; expired ones give up their place.
+    void TestLimitAndExpiry()
+    {
+        const char *pszTest = "LimitAndExpiry";
+        OTP_CHALLENGE rgChallenges[17];
+        for (OTP_CHALLENGE &challenge : rgChallenges)
+        {
+            Check(RequestPush(L"alice", &challenge) == S_OK, pszTest, "the challenge is issued");
+        }
+        bool fWatched = true;
+        for (DWORD i = 0; i < 16; i++)
+        {
+            fWatched = fWatched && WatchOtpApproval(&rgChallenges[i]) == S_OK;
+        }
+        Check(fWatched, pszTest, "sixteen are watched");
+        Check(WatchOtpApproval(&rgChallenges[16]) == HRESULT_FROM_WIN32(ERROR_TOO_MANY_OPEN_FILES), pszTest, "the seventeenth is refused");
+
+        ShimAdvanceTicks((c_ullExpirySeconds + 1) * 1000);
+        Check(GetWatchedOtpApproval(&rgChallenges[0]) == HRESULT_FROM_WIN32(ERROR_TIMEOUT), pszTest, "an expired approval reads as timed out");
+
+        OTP_CHALLENGE challenge;
+        Check(RequestPush(L"bob", &challenge) == S_OK && WatchOtpApproval(&challenge) == S_OK, pszTest, "an expired approval's place is reused");
+        Check(WaitFor([&challenge]() { return Polling({ &challenge }); }), pszTest, "and only the live one is polled");
+
+        for (OTP_CHALLENGE &challengeOld : rgChallenges)
+        {
+            UnwatchOtpApproval(&challengeOld);
+        }
+        UnwatchOtpApproval(&challenge);
+        Check(WatcherStopped(), pszTest, "the watcher stops");
+    }
+
+    // A gateway that fails, or answers a poll at once, is retried after a pause rather than in a
+    // loop, and the answer still arrives once it recovers.
+    void TestBackoff(bool fDown)
+    {
+        const char *pszTest = fDown ? "GatewayDown" : "NoHold";
+        int cFailedReports = s_cFailedReports;
+        size_t cLogged = Logged(L"[OTP] push watch failed");
+        size_t cSignals = ApprovalSignals();
+        OTP_CHALLENGE challenge;
+        Check(RequestPush(L"alice", &challenge) == S_OK, pszTest, "the challenge is issued");
+        {
+            std::lock_guard<std::mutex> lock(s_gateway.mutex);
+            (fDown ? s_gateway.fDown : s_gateway.fNoHold) = true;
+        }
+        int cWaits = Waits();
+        Check(WatchOtpApproval(&challenge) == S_OK, pszTest, "the approval is watched");
+        Check(WaitFor([cWaits]() { return Waits() == cWaits + 1; }), pszTest, "it is polled");
+        Sleep(1000);
+        Check(Waits() == cWaits + 1, pszTest, "and not polled again straight away");
+        Check(Logged(L"[OTP] push watch failed") == cLogged + 1, pszTest, "the failure is logged");
+        Check(s_cFailedReports == cFailedReports + (fDown ? 1 : 0), pszTest, "only a failed gateway is reported as failed");
+
+        {
+            std::lock_guard<std::mutex> lock(s_gateway.mutex);
+            s_gateway.fDown = false;
+            s_gateway.fNoHold = false;
+        }
+        Answer(&challenge, "ok", 0);
+        Check(WaitFor([cSignals]() { return ApprovalSignals() == cSignals + 1; }), pszTest, "the approval arrives after the pause");
+        Check(GetWatchedOtpApproval(&challenge) == S_OK, pszTest, "and is recorded");
+        UnwatchOtpApproval(&challenge);
+        Check(WatcherStopped(), pszTest, "the watcher stops");
+    }
+}
+
+// One gateway, and the selection's reports counted.
+
+HRESULT SelectOtpServer(_In_reads_opt_(cExclude) const PCWSTR *, DWORD cExclude, _Out_writes_(cchUrl) PWSTR pszUrl, size_t cchUrl)
+{
+    if (cExclude > 0)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+    return StringCchCopyW(pszUrl, cchUrl, c_szGatewayUrl);
+}
+
+void ReportOtpServerResult(_In_ PCWSTR, bool fAnswered, DWORD)
+{
+    (fAnswered ? s_cAnsweredReports : s_cFailedReports)++;
+}
+
+void ReportOtpServerNoResult(_In_ PCWSTR)
+{
+}
+
+void SetOtpServerProbe(_In_opt_ PFN_PROBE_OTP_SERVER)
+{
+}
+
+// No config: defaults apply.
+
+HRESULT GetConfigSnapshot(_Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    *ppSnapshot = nullptr;
+    return E_FAIL;
+}
+
+ULONG CConfigSnapshot::Release()
+{
+    return 0;
+}
+
+DWORD CConfigSnapshot::OtpTimeout(DWORD dwDefault) const
+{
+    return dwDefault;
+}
+
+DWORD CConfigSnapshot::OtpHedgePercentile(DWORD dwDefault) const
+{
+    return dwDefault;
+}
+
+// The speculative delivery is not exercised here.
+
+DWORD OtpChannelsForFactor(MFA_FACTOR)
+{
+    return 0;
+}
+
+HRESULT DeliverOtpChallenge(_In_ PCWSTR, _In_opt_ PCWSTR, DWORD, _Inout_ OTP_DELIVERY *)
+{
+    return E_NOTIMPL;
+}
+
+void CancelOtpDelivery(_Inout_ OTP_DELIVERY *)
+{
+}
+
+void SignalProviderEvent(PROVIDER_EVENT pe)
+{
+    if (pe == PE_APPROVAL_RECEIVED)
+    {
+        std::lock_guard<std::mutex> lock(s_mutexEvents);
+        s_vecApprovalSignals.push_back(CLOCK::now());
+    }
+}
+
+HRESULT WriteLogMessage(_In_z_ PCWSTR message)
+{
+    std::lock_guard<std::mutex> lock(s_mutexEvents);
+    s_vecLog.push_back(message);
+    return S_OK;
+}
+
+void DllAddRef()
+{
+    s_cDllRefs++;
+}
+
+void DllRelease()
+{
+    s_cDllRefs--;
+}
+
+int main()
+{
+    ShimHttpHandler() = StandInGateway;
+
+    TestApproval();
+    size_t cHandles = ShimHttpOpenHandles();
+    TestShared();
+    TestUnwatch();
+    TestLimitAndExpiry();
+    TestBackoff(true);
+    TestBackoff(false);
+
+    Check(ShimHttpOpenHandles() == cHandles, "Main", "every request handle is closed");
+    Check(!s_gateway.fWrongHost, "Main", "every request went to the configured gateway");
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
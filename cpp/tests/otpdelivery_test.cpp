@@ -0,0 +1,426 @@
+// Tests for binding a second-factor delivery to its user, and for running the submit's gateway
+// calls off the caller's thread (otpdelivery.cpp).
+//
+// The gateway calls, the config snapshot, the in-flight table and the account cache are
+// replaced by the stubs below, so this builds on Linux against the headers in tests/shim,
+// under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/otpdelivery_test.cpp cpp/otpdelivery.cpp -o otpdelivery_test
+//   ./otpdelivery_test
+//
+// The stub gateway sends every challenge, accepts the code 123456 and nothing else, and counts
+// what it was asked to do, so a test can tell a refusal made here from one the gateway made.
+
+#include <windows.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include "../otpdelivery.h"
+#include "../accountcache.h"
+#include "../otpinflight.h"
+#include "../providerevents.h"
+#include "../utils.h"
+#include "../Dll.h"
+
+namespace
+{
+    const wchar_t c_szAliceSid[] = L"S-1-5-21-1000-2000-3000-1104";
+    const wchar_t c_szBobSid[] = L"S-1-5-21-1000-2000-3000-1105";
+    const wchar_t c_szGoodCode[] = L"123456";
+
+    std::atomic<int> s_cRequests(0);
+    std::atomic<int> s_cVerifies(0);
+    std::atomic<int> s_cCancels(0);
+    std::atomic<long> s_cDllRefs(0);
+    std::atomic<int> s_cOtpChecked(0);
+
+    int s_cFailures = 0;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // Waits for the cancels the delivery hands to the thread pool.
+    void WaitForWorkItems()
+    {
+        for (int i = 0; i < 500 && s_cDllRefs != 0; i++)
+        {
+            Sleep(10);
+        }
+    }
+
+    // Waits for a submit call to finish on the thread pool.
+    bool WaitForSubmit(COtpSubmit *pSubmit)
+    {
+        for (int i = 0; i < 500 && !pSubmit->IsDone(); i++)
+        {
+            Sleep(10);
+        }
+        return pSubmit->IsDone();
+    }
+
+    void TestSameUser()
+    {
+        const char *pszTest = "same user";
+        OTP_DELIVERY delivery = {};
+        Check(DeliverOtpChallenge(L"alice", c_szAliceSid, OTP_CHANNEL_SMS, &delivery) == S_OK, pszTest, "delivery failed");
+        Check(wcscmp(delivery.szUserName, L"ALICE") == 0, pszTest, "user name not normalized");
+        Check(IsOtpDeliveryFor(&delivery, L" Alice ", c_szAliceSid), pszTest, "normalized name not matched");
+        Check(IsOtpDeliveryFor(&delivery, L"alice", nullptr), pszTest, "missing SID refused");
+
+        int cVerifies = s_cVerifies;
+        Check(AnswerOtpDelivery(&delivery, L"Alice", c_szAliceSid, c_szGoodCode) == S_OK, pszTest, "code refused");
+        Check(s_cVerifies == cVerifies + 1, pszTest, "gateway not asked");
+        Check(delivery.dwChannels == 0, pszTest, "delivery not emptied");
+    }
+
+    void TestOtherUserAnswers()
+    {
+        const char *pszTest = "other user answers";
+        OTP_DELIVERY delivery = {};
+        Check(DeliverOtpChallenge(L"alice", c_szAliceSid, OTP_CHANNEL_SMS, &delivery) == S_OK, pszTest, "delivery failed");
+
+        int cVerifies = s_cVerifies;
+        Check(!IsOtpDeliveryFor(&delivery, L"bob", c_szBobSid), pszTest, "other user matched");
+        Check(AnswerOtpDelivery(&delivery, L"bob", c_szBobSid, c_szGoodCode) == E_ACCESSDENIED, pszTest, "other user's code accepted");
+        Check(AnswerOtpDelivery(&delivery, L"bob", nullptr, c_szGoodCode) == E_ACCESSDENIED, pszTest, "other user without a SID accepted");
+        Check(s_cVerifies == cVerifies, pszTest, "gateway asked for another user");
+        Check(delivery.dwChannels == OTP_CHANNEL_SMS, pszTest, "challenge dropped");
+
+        // The challenged user can still answer it.
+        Check(AnswerOtpDelivery(&delivery, L"alice", c_szAliceSid, c_szGoodCode) == S_OK, pszTest, "challenged user refused");
+    }
+
+    void TestReusedName()
+    {
+        const char *pszTest = "reused name";
+        OTP_DELIVERY delivery = {};
+        Check(DeliverOtpChallenge(L"alice", c_szAliceSid, OTP_CHANNEL_SMS, &delivery) == S_OK, pszTest, "delivery failed");
+
+        int cVerifies = s_cVerifies;
+        Check(AnswerOtpDelivery(&delivery, L"alice", c_szBobSid, c_szGoodCode) == E_ACCESSDENIED, pszTest, "other SID accepted");
+        Check(s_cVerifies == cVerifies, pszTest, "gateway asked for another SID");
+        CancelOtpDelivery(&delivery);
+        WaitForWorkItems();
+    }
+
+    void TestDeliverToOtherUser()
+    {
+        const char *pszTest = "deliver to other user";
+        OTP_DELIVERY delivery = {};
+        Check(DeliverOtpChallenge(L"alice", c_szAliceSid, OTP_CHANNEL_SMS, &delivery) == S_OK, pszTest, "delivery failed");
+
+        int cRequests = s_cRequests;
+        Check(DeliverOtpChallenge(L"bob", c_szBobSid, OTP_CHANNEL_SMS | OTP_CHANNEL_EMAIL, &delivery) == E_ACCESSDENIED, pszTest,
+              "delivery to other user allowed");
+        Check(s_cRequests == cRequests, pszTest, "challenge sent to other user");
+        Check(wcscmp(delivery.szUserName, L"ALICE") == 0 && delivery.dwChannels == OTP_CHANNEL_SMS, pszTest, "delivery rebound");
+
+        // Once the delivery is withdrawn it can go to somebody else.
+        int cCancels = s_cCancels;
+        CancelOtpDelivery(&delivery);
+        WaitForWorkItems();
+        Check(s_cCancels == cCancels + 1, pszTest, "challenge not cancelled");
+        Check(!IsOtpDeliveryFor(&delivery, L"alice", c_szAliceSid), pszTest, "empty delivery matched");
+        Check(DeliverOtpChallenge(L"bob", c_szBobSid, OTP_CHANNEL_SMS, &delivery) == S_OK, pszTest, "delivery after cancel failed");
+        Check(wcscmp(delivery.szUserName, L"BOB") == 0, pszTest, "delivery not rebound");
+        Check(AnswerOtpDelivery(&delivery, L"alice", c_szAliceSid, c_szGoodCode) == E_ACCESSDENIED, pszTest, "previous user accepted");
+        Check(AnswerOtpDelivery(&delivery, L"bob", c_szBobSid, c_szGoodCode) == S_OK, pszTest, "new user refused");
+    }
+
+    // Several channels go out, and are answered, on the thread pool.
+    void TestChannelRace()
+    {
+        const char *pszTest = "channel race";
+        OTP_DELIVERY delivery = {};
+        Check(DeliverOtpChallenge(L"alice", nullptr, OTP_CHANNEL_SMS | OTP_CHANNEL_EMAIL, &delivery) == S_OK, pszTest, "delivery failed");
+        Check(delivery.dwChannels == (OTP_CHANNEL_SMS | OTP_CHANNEL_EMAIL), pszTest, "channels missing");
+        Check(delivery.szUserSid[0] == L'\0', pszTest, "SID made up");
+
+        int cVerifies = s_cVerifies;
+        Check(AnswerOtpDelivery(&delivery, L"bob", c_szBobSid, c_szGoodCode) == E_ACCESSDENIED, pszTest, "other user's code accepted");
+        Check(s_cVerifies == cVerifies, pszTest, "gateway asked for another user");
+        Check(AnswerOtpDelivery(&delivery, L"alice", c_szAliceSid, L"654321") == E_ACCESSDENIED, pszTest, "wrong code accepted");
+        Check(s_cVerifies == cVerifies + 2, pszTest, "wrong code not checked on both channels");
+
+        int cCancels = s_cCancels;
+        Check(AnswerOtpDelivery(&delivery, L"alice", c_szAliceSid, c_szGoodCode) == S_OK, pszTest, "code refused");
+        WaitForWorkItems();
+        Check(delivery.dwChannels == 0, pszTest, "delivery not emptied");
+        Check(s_cCancels == cCancels + 1, pszTest, "losing channel not cancelled");
+    }
+
+    // The code is checked on the thread pool, and the delivery comes back with the result.
+    void TestSubmitAnswer()
+    {
+        const char *pszTest = "submit answer";
+        OTP_DELIVERY delivery = {};
+        Check(DeliverOtpChallenge(L"alice", c_szAliceSid, OTP_CHANNEL_SMS, &delivery) == S_OK, pszTest, "delivery failed");
+
+        int cChecked = s_cOtpChecked;
+        COtpSubmit *pSubmit;
+        Check(COtpSubmit::StartAnswer(&delivery, L"alice", c_szAliceSid, L"654321", &pSubmit) == S_OK, pszTest, "not started");
+        Check(delivery.dwChannels == 0, pszTest, "delivery not moved");
+        Check(pSubmit->IsAnswer(), pszTest, "not an answer");
+        Check(WaitForSubmit(pSubmit), pszTest, "not done");
+        Check(s_cOtpChecked == cChecked + 1, pszTest, "provider not signaled");
+        Check(pSubmit->TakeResult(&delivery) == E_ACCESSDENIED, pszTest, "wrong code accepted");
+        Check(delivery.dwChannels == OTP_CHANNEL_SMS, pszTest, "delivery not handed back");
+        OTP_DELIVERY deliveryAgain;
+        Check(pSubmit->TakeResult(&deliveryAgain) == E_ABORT && deliveryAgain.dwChannels == 0, pszTest, "result taken twice");
+        pSubmit->Release();
+
+        // The handed-back delivery answers the next try.
+        Check(COtpSubmit::StartAnswer(&delivery, L"alice", c_szAliceSid, c_szGoodCode, &pSubmit) == S_OK, pszTest, "not restarted");
+        Check(WaitForSubmit(pSubmit), pszTest, "not done again");
+        Check(pSubmit->TakeResult(&delivery) == S_OK, pszTest, "code refused");
+        Check(delivery.dwChannels == 0, pszTest, "delivery not emptied");
+        pSubmit->Release();
+    }
+
+    // The speculative delivery is taken over, and only what it held back is sent.
+    void TestSubmitDelivery()
+    {
+        const char *pszTest = "submit delivery";
+        CPendingOtpChallenge *pPending;
+        Check(CPendingOtpChallenge::Start(L"alice", c_szAliceSid, MFA_FACTOR_OTP, &pPending) == S_OK, pszTest, "pending not started");
+
+        int cRequests = s_cRequests;
+        OTP_DELIVERY delivery = {};
+        COtpSubmit *pSubmit;
+        Check(COtpSubmit::StartDelivery(&delivery, L"alice", c_szAliceSid, OTP_CHANNEL_SMS | OTP_CHANNEL_PUSH, pPending, &pSubmit) == S_OK,
+              pszTest, "not started");
+        Check(!pSubmit->IsAnswer(), pszTest, "not a delivery");
+        Check(WaitForSubmit(pSubmit), pszTest, "not done");
+        Check(pSubmit->TakeResult(&delivery) == S_OK, pszTest, "delivery failed");
+        Check(delivery.dwChannels == (OTP_CHANNEL_SMS | OTP_CHANNEL_PUSH), pszTest, "channels missing");
+        Check(s_cRequests == cRequests + 1, pszTest, "taken-over channel sent again");
+        pSubmit->Release();
+        CancelOtpDelivery(&delivery);
+        WaitForWorkItems();
+    }
+
+    // A call abandoned before its result is taken withdraws what it sent.
+    void TestSubmitCancelled()
+    {
+        const char *pszTest = "submit cancelled";
+        OTP_DELIVERY delivery = {};
+        COtpSubmit *pSubmit;
+        Check(COtpSubmit::StartDelivery(&delivery, L"alice", c_szAliceSid, OTP_CHANNEL_SMS, nullptr, &pSubmit) == S_OK, pszTest, "not started");
+        Check(WaitForSubmit(pSubmit), pszTest, "not done");
+
+        int cCancels = s_cCancels;
+        pSubmit->Cancel();
+        pSubmit->Release();
+        WaitForWorkItems();
+        Check(s_cCancels == cCancels + 1, pszTest, "challenge not cancelled");
+    }
+}
+
+// The speculative delivery, made up front.
+
+CPendingOtpChallenge::CPendingOtpChallenge(MFA_FACTOR mfaFactor) :
+    _cRef(1),
+    _fCancelled(FALSE),
+    _fClaimed(FALSE),
+    _hDone(nullptr),
+    _pszUserName(nullptr),
+    _pszUserSid(nullptr),
+    _mfaFactor(mfaFactor),
+    _hr(E_PENDING)
+{
+    ZeroMemory(&_delivery, sizeof(_delivery));
+}
+
+CPendingOtpChallenge::~CPendingOtpChallenge()
+{
+    CoTaskMemFree(_pszUserName);
+}
+
+HRESULT CPendingOtpChallenge::Start(_In_ PCWSTR pszUserName, _In_opt_ PCWSTR pszUserSid, MFA_FACTOR mfaFactor, _Outptr_ CPendingOtpChallenge **ppPending)
+{
+    CPendingOtpChallenge *pPending = new CPendingOtpChallenge(mfaFactor);
+    SHStrDupW(pszUserName, &pPending->_pszUserName);
+    pPending->_hr = DeliverOtpChallenge(pszUserName, pszUserSid, SpeculativeChannels(mfaFactor), &pPending->_delivery);
+    *ppPending = pPending;
+    return S_OK;
+}
+
+DWORD CPendingOtpChallenge::SpeculativeChannels(MFA_FACTOR mfaFactor)
+{
+    return OtpChannelsForFactor(mfaFactor) & ~OTP_CHANNEL_PUSH;
+}
+
+ULONG CPendingOtpChallenge::Release()
+{
+    long cRef = InterlockedDecrement(&_cRef);
+    if (!cRef)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+HRESULT CPendingOtpChallenge::Wait(_Out_ OTP_DELIVERY *pDelivery)
+{
+    ZeroMemory(pDelivery, sizeof(*pDelivery));
+    if (InterlockedExchange(&_fClaimed, TRUE) != FALSE)
+    {
+        return E_ABORT;
+    }
+    *pDelivery = _delivery;
+    return _hr;
+}
+
+void CPendingOtpChallenge::Cancel()
+{
+    if (InterlockedExchange(&_fClaimed, TRUE) == FALSE)
+    {
+        CancelOtpDelivery(&_delivery);
+    }
+}
+
+void SignalProviderEvent(PROVIDER_EVENT pe)
+{
+    if (pe == PE_OTP_CHECKED)
+    {
+        s_cOtpChecked++;
+    }
+}
+
+// The gateway.
+
+HRESULT RequestOtpChallenge(_In_ PCWSTR pszUserName, _In_ PCWSTR pszChannel, _Out_ OTP_CHALLENGE *pChallenge)
+{
+    s_cRequests++;
+    ZeroMemory(pChallenge, sizeof(*pChallenge));
+    swprintf(pChallenge->szChallengeId, ARRAYSIZE(pChallenge->szChallengeId), L"%ls/%ls", pszUserName, pszChannel);
+    wcscpy(pChallenge->szServerUrl, L"https://gateway.test");
+    FILETIME ftNow;
+    GetSystemTimeAsFileTime(&ftNow);
+    pChallenge->ullExpires = ((static_cast<ULONGLONG>(ftNow.dwHighDateTime) << 32) | ftNow.dwLowDateTime) + 300ull * 10000000;
+    return S_OK;
+}
+
+HRESULT VerifyOtpCode(_In_ const OTP_CHALLENGE *, _In_ PCWSTR pszCode)
+{
+    s_cVerifies++;
+    return (wcscmp(pszCode, c_szGoodCode) == 0) ? S_OK : E_ACCESSDENIED;
+}
+
+HRESULT CheckOtpApproval(_In_ const OTP_CHALLENGE *)
+{
+    return E_PENDING;
+}
+
+HRESULT WatchOtpApproval(_In_ const OTP_CHALLENGE *)
+{
+    return S_OK;
+}
+
+void UnwatchOtpApproval(_In_ const OTP_CHALLENGE *)
+{
+}
+
+HRESULT GetWatchedOtpApproval(_In_ const OTP_CHALLENGE *)
+{
+    return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+}
+
+HRESULT CancelOtpChallenge(_In_ const OTP_CHALLENGE *)
+{
+    s_cCancels++;
+    return S_OK;
+}
+
+// Nothing in flight elsewhere.
+
+HRESULT JoinOtpChallenge(_In_ PCWSTR, DWORD, _Out_ OTP_CHALLENGE *)
+{
+    return S_FALSE;
+}
+
+bool PublishOtpChallenge(_In_ PCWSTR, DWORD, _In_opt_ const OTP_CHALLENGE *)
+{
+    return false;
+}
+
+void RetireOtpChallenge(_In_ PCWSTR, DWORD, _In_ const OTP_CHALLENGE *)
+{
+}
+
+// No config: defaults apply.
+
+HRESULT GetConfigSnapshot(_Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    *ppSnapshot = nullptr;
+    return E_FAIL;
+}
+
+ULONG CConfigSnapshot::Release()
+{
+    return 0;
+}
+
+DWORD CConfigSnapshot::OtpTimeout(DWORD dwDefault) const
+{
+    return dwDefault;
+}
+
+DWORD CConfigSnapshot::OtpChannels(DWORD dwDefault) const
+{
+    return dwDefault;
+}
+
+HRESULT NormalizeAccountName(_In_ PCWSTR pszAccountName, _Out_writes_(cchNormalized) PWSTR pszNormalized, size_t cchNormalized)
+{
+    std::wstring str(pszAccountName);
+    size_t ichFirst = str.find_first_not_of(L' ');
+    if (ichFirst == std::wstring::npos)
+    {
+        return E_INVALIDARG;
+    }
+    str = str.substr(ichFirst, str.find_last_not_of(L' ') - ichFirst + 1);
+    for (wchar_t &ch : str)
+    {
+        ch = static_cast<wchar_t>(towupper(ch));
+    }
+    return StringCchCopyW(pszNormalized, cchNormalized, str.c_str());
+}
+
+HRESULT WriteLogMessage(_In_z_ PCWSTR)
+{
+    return S_OK;
+}
+
+void DllAddRef()
+{
+    s_cDllRefs++;
+}
+
+void DllRelease()
+{
+    s_cDllRefs--;
+}
+
+int main()
+{
+    TestSameUser();
+    TestOtherUserAnswers();
+    TestReusedName();
+    TestDeliverToOtherUser();
+    TestChannelRace();
+    TestSubmitAnswer();
+    TestSubmitDelivery();
+    TestSubmitCancelled();
+    WaitForWorkItems();
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,327 @@
+// Seed corpus runner for the gateway response parser (otpresponse.cpp).
+//
+// The parser needs nothing from Windows but a few types, so this builds on Linux against the
+// headers in tests/shim, under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -fsanitize=address,undefined -I cpp/tests/shim
+//       cpp/tests/otpresponse_test.cpp cpp/otpresponse.cpp -o otpresponse_test
+//   ./otpresponse_test cpp/tests/otpresponse
+//
+// Add -U__SSE2__ to run the byte-at-a-time scanner instead of the SSE2 one.
+// On Windows, build the same two files without the shim.
+//
+// Every body in corpus/ is listed in expected.txt with what ParseOtpResponse makes of it:
+//
+//   name  result  fields  status  expiry  challenge  message
+//
+// tab-separated, where result is "ok" or "invalid", fields is the ORF_* bits in hex, expiry is
+// in seconds and the strings are C-escaped. Each body is parsed from a heap buffer of exactly its
+// size, so ASan sees any read past the end, and again at every offset within 16 bytes so the
+// SSE2 loads straddle the buffer edges differently. Then every prefix of it and a fixed set of
+// byte mutations are parsed and checked for only leaving terminated strings behind.
+//
+// Run with -p to print the results for the corpus instead of checking them; review every line
+// before it goes into expected.txt.
+//
+// Run with -b to measure throughput instead: the whole corpus, and a body the size of the
+// client's response buffer that is one long string, are parsed over and over and reported in
+// MB/s. Build with -O2 and without the sanitizers for that, once as is and once with -U__SSE2__,
+// to compare the two scanners.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "../otpresponse.h"
+
+namespace
+{
+    const char c_szOk[] = "ok";
+    const char c_szInvalid[] = "invalid";
+
+    const char *s_rgpszStatus[] = { "none", "ok", "denied", "expired", "pending", "other" };
+
+    // Bytes that steer the parser, swapped into every position of every seed.
+    const char c_rgchMutations[] = { '"', '\\', '{', '}', '[', ']', ',', ':', 'u', '0', 'D', '\0', '\x1F', '\x80', '\xFF' };
+
+    // How long each benchmark parses for.
+    const double c_dblBenchSeconds = 1.0;
+
+    // The size of the client's response buffer (c_cbMaxResponse in otpclient.cpp).
+    const DWORD c_cbBenchBody = 4096;
+
+    int s_cFailures = 0;
+
+    void Fail(const std::string &strName, const char *pszWhat, const std::string &strDetail)
+    {
+        fprintf(stderr, "FAIL %s: %s\n  %s\n", strName.c_str(), pszWhat, strDetail.c_str());
+        s_cFailures++;
+    }
+
+    bool ReadFileBytes(const std::string &strPath, std::vector<char> *pvecBytes)
+    {
+        pvecBytes->clear();
+        FILE *pFile = fopen(strPath.c_str(), "rb");
+        if (pFile == nullptr)
+        {
+            return false;
+        }
+        char rgch[4096];
+        size_t cch;
+        while ((cch = fread(rgch, 1, sizeof(rgch), pFile)) != 0)
+        {
+            pvecBytes->insert(pvecBytes->end(), rgch, rgch + cch);
+        }
+        fclose(pFile);
+        return true;
+    }
+
+    // Parses cbBody bytes placed ibOffset bytes into a heap block that ends right after them.
+    HRESULT ParseAt(const char *pchBody, DWORD cbBody, DWORD ibOffset, OTP_RESPONSE *pResponse)
+    {
+        char *pchBlock = static_cast<char *>(malloc(ibOffset + cbBody + 1));
+        if (pchBlock == nullptr)
+        {
+            abort();
+        }
+        memset(pchBlock, 'x', ibOffset);
+        if (cbBody != 0)
+        {
+            memcpy(pchBlock + ibOffset, pchBody, cbBody);
+        }
+        HRESULT hr = ParseOtpResponse(pchBlock + ibOffset, cbBody, pResponse);
+        free(pchBlock);
+        return hr;
+    }
+
+    void AppendEscaped(const char *psz, std::string *pstr)
+    {
+        for (const char *pch = psz; *pch != '\0'; pch++)
+        {
+            unsigned char b = static_cast<unsigned char>(*pch);
+            if (b == '\\')
+            {
+                *pstr += "\\\\";
+            }
+            else if (b < 0x20 || b >= 0x7F)
+            {
+                char szHex[8];
+                snprintf(szHex, sizeof(szHex), "\\x%02X", b);
+                *pstr += szHex;
+            }
+            else
+            {
+                *pstr += static_cast<char>(b);
+            }
+        }
+    }
+
+    // The expected.txt line for a parse, without the name.
+    std::string FormatResult(HRESULT hr, const OTP_RESPONSE &response)
+    {
+        std::string str;
+        if (hr == HRESULT_FROM_WIN32(ERROR_INVALID_DATA))
+        {
+            return c_szInvalid;
+        }
+        if (hr != S_OK)
+        {
+            char szHr[16];
+            snprintf(szHr, sizeof(szHr), "0x%08X", static_cast<unsigned>(hr));
+            return szHr;
+        }
+        char szFields[64];
+        snprintf(szFields, sizeof(szFields), "%s\t0x%X\t%s\t%llu\t", c_szOk, static_cast<unsigned>(response.dwFields),
+                 (response.status < ARRAYSIZE(s_rgpszStatus)) ? s_rgpszStatus[response.status] : "?",
+                 static_cast<unsigned long long>(response.ullExpirySeconds));
+        str = szFields;
+        AppendEscaped(response.szChallengeId, &str);
+        str += '\t';
+        AppendEscaped(response.szMessage, &str);
+        return str;
+    }
+
+    // What any parse, of any input, must leave behind.
+    void CheckInvariants(const std::string &strName, HRESULT hr, const OTP_RESPONSE &response)
+    {
+        if (hr != S_OK && hr != HRESULT_FROM_WIN32(ERROR_INVALID_DATA))
+        {
+            Fail(strName, "unexpected result", FormatResult(hr, response));
+        }
+        if (memchr(response.szChallengeId, '\0', sizeof(response.szChallengeId)) == nullptr ||
+            memchr(response.szMessage, '\0', sizeof(response.szMessage)) == nullptr)
+        {
+            Fail(strName, "unterminated string", "");
+        }
+        if (hr == S_OK && ((response.dwFields & ORF_CHALLENGE) != 0) == (response.szChallengeId[0] == '\0'))
+        {
+            Fail(strName, "challenge ID does not match its field bit", FormatResult(hr, response));
+        }
+        if (hr == S_OK && (response.dwFields & ~(ORF_STATUS | ORF_CHALLENGE | ORF_EXPIRY | ORF_MESSAGE)) != 0)
+        {
+            Fail(strName, "unknown field bits", FormatResult(hr, response));
+        }
+    }
+
+    void RunSeed(const std::string &strName, const std::vector<char> &vecBody, const std::string *pstrExpected, bool fPrint)
+    {
+        const char *pchBody = vecBody.empty() ? "" : vecBody.data();
+        DWORD cbBody = static_cast<DWORD>(vecBody.size());
+
+        OTP_RESPONSE response;
+        HRESULT hr = ParseAt(pchBody, cbBody, 0, &response);
+        std::string strResult = FormatResult(hr, response);
+        CheckInvariants(strName, hr, response);
+        if (fPrint)
+        {
+            printf("%s\t%s\n", strName.c_str(), strResult.c_str());
+        }
+        else if (strResult != *pstrExpected)
+        {
+            Fail(strName, "result differs", "expected: " + *pstrExpected + "\n  actual:   " + strResult);
+        }
+
+        for (DWORD ibOffset = 1; ibOffset < 16; ibOffset++)
+        {
+            HRESULT hrShifted = ParseAt(pchBody, cbBody, ibOffset, &response);
+            if (FormatResult(hrShifted, response) != strResult)
+            {
+                Fail(strName, "result depends on alignment", "offset " + std::to_string(ibOffset));
+            }
+        }
+
+        for (DWORD cb = 0; cb < cbBody; cb++)
+        {
+            HRESULT hrPrefix = ParseAt(pchBody, cb, 0, &response);
+            CheckInvariants(strName + " prefix " + std::to_string(cb), hrPrefix, response);
+        }
+
+        std::vector<char> vecMutated(vecBody);
+        for (DWORD ich = 0; ich < cbBody; ich++)
+        {
+            for (char chMutation : c_rgchMutations)
+            {
+                vecMutated[ich] = chMutation;
+                HRESULT hrMutated = ParseAt(vecMutated.data(), cbBody, 0, &response);
+                CheckInvariants(strName + " mutation at " + std::to_string(ich), hrMutated, response);
+            }
+            vecMutated[ich] = vecBody[ich];
+        }
+    }
+
+    // Parses every body in vecBodies, in turn, for c_dblBenchSeconds and prints the rate.
+    void RunBenchmark(const char *pszName, const std::vector<std::vector<char>> &vecBodies)
+    {
+        typedef std::chrono::steady_clock Clock;
+        unsigned long long cbParsed = 0;
+        DWORD dwSink = 0;
+        double dblSeconds = 0;
+        Clock::time_point tpStart = Clock::now();
+        do
+        {
+            for (const std::vector<char> &vecBody : vecBodies)
+            {
+                OTP_RESPONSE response;
+                HRESULT hr = ParseOtpResponse(vecBody.empty() ? "" : vecBody.data(), static_cast<DWORD>(vecBody.size()), &response);
+                dwSink += static_cast<DWORD>(hr) ^ response.dwFields;
+                cbParsed += vecBody.size();
+            }
+            dblSeconds = std::chrono::duration<double>(Clock::now() - tpStart).count();
+        } while (dblSeconds < c_dblBenchSeconds);
+
+        printf("%-24s %10.1f MB/s  (sink %08X)\n", pszName, cbParsed / dblSeconds / 1e6, static_cast<unsigned>(dwSink));
+    }
+
+    void RunBenchmarks(const std::vector<std::vector<char>> &vecCorpus)
+    {
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+        printf("scanner: SSE2\n");
+#else
+        printf("scanner: byte at a time\n");
+#endif
+        RunBenchmark("corpus", vecCorpus);
+
+        // Nearly every byte goes through ScanString.
+        std::string strBody = "{\"status\":\"ok\",\"message\":\"";
+        strBody.append(c_cbBenchBody - strBody.size() - 2, 'm');
+        strBody += "\"}";
+        RunBenchmark("long string", std::vector<std::vector<char>>(1, std::vector<char>(strBody.begin(), strBody.end())));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bool fPrint = false;
+    bool fBench = false;
+    std::string strDir = "cpp/tests/otpresponse";
+    for (int iArg = 1; iArg < argc; iArg++)
+    {
+        if (strcmp(argv[iArg], "-p") == 0)
+        {
+            fPrint = true;
+        }
+        else if (strcmp(argv[iArg], "-b") == 0)
+        {
+            fBench = true;
+        }
+        else
+        {
+            strDir = argv[iArg];
+        }
+    }
+
+    std::vector<char> vecExpected;
+    if (!ReadFileBytes(strDir + "/expected.txt", &vecExpected))
+    {
+        fprintf(stderr, "cannot read %s/expected.txt\n", strDir.c_str());
+        return 2;
+    }
+
+    int cSeeds = 0;
+    std::vector<std::vector<char>> vecCorpus;
+    std::string strExpected(vecExpected.begin(), vecExpected.end());
+    size_t ichLine = 0;
+    while (ichLine < strExpected.size())
+    {
+        size_t ichEnd = strExpected.find('\n', ichLine);
+        if (ichEnd == std::string::npos)
+        {
+            ichEnd = strExpected.size();
+        }
+        std::string strLine = strExpected.substr(ichLine, ichEnd - ichLine);
+        ichLine = ichEnd + 1;
+        if (strLine.empty() || strLine[0] == '#')
+        {
+            continue;
+        }
+
+        size_t ichTab = strLine.find('\t');
+        std::string strName = strLine.substr(0, ichTab);
+        std::string strResult = (ichTab == std::string::npos) ? std::string() : strLine.substr(ichTab + 1);
+        std::vector<char> vecBody;
+        if (!ReadFileBytes(strDir + "/corpus/" + strName, &vecBody))
+        {
+            Fail(strName, "cannot read seed", strDir + "/corpus/" + strName);
+            continue;
+        }
+        if (fBench)
+        {
+            vecCorpus.push_back(vecBody);
+        }
+        else
+        {
+            RunSeed(strName, vecBody, &strResult, fPrint);
+        }
+        cSeeds++;
+    }
+
+    if (fBench)
+    {
+        RunBenchmarks(vecCorpus);
+    }
+
+    fprintf(stderr, "%d seeds, %d failures\n", cSeeds, s_cFailures);
+    return (s_cFailures == 0 && cSeeds != 0) ? 0 : 1;
+}
@@ -0,0 +1,353 @@
+// Tests for the provider event source (providerevents.cpp) against a fake event sink: delivery
+// and its latency, coalescing while LogonUI is still busy with the last re-enumeration, address
+// change notifications and their re-arming, UnAdvise and re-Advise, more providers than the
+// source table holds, and a sink that fails.
+//
+// The wait thread is a real thread (see CreateThread in tests/shim), and address changes come
+// from ShimChangeAddress in tests/shim/iphlpapi.h. The logging is replaced by the stub below, so
+// this builds on Linux against the headers in tests/shim, under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/providerevents_test.cpp cpp/providerevents.cpp
+//       -o providerevents_test -lpthread
+//   ./providerevents_test
+
+#include <windows.h>
+#include <iphlpapi.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../providerevents.h"
+#include "../utils.h"
+
+namespace
+{
+    int s_cFailures = 0;
+
+    std::mutex s_mutexLog;
+    std::vector<std::wstring> s_vecLog;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // Polls fn for up to dwMs.
+    bool WaitFor(const std::function<bool()> &fn, DWORD dwMs = 5000)
+    {
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwMs);
+        while (!fn())
+        {
+            if (std::chrono::steady_clock::now() >= deadline)
+            {
+                return false;
+            }
+            Sleep(1);
+        }
+        return true;
+    }
+
+    size_t Logged(PCWSTR pszPrefix)
+    {
+        std::lock_guard<std::mutex> lock(s_mutexLog);
+        return std::count_if(s_vecLog.begin(), s_vecLog.end(), [pszPrefix](const std::wstring &str)
+        {
+            return str.compare(0, wcslen(pszPrefix), pszPrefix) == 0;
+        });
+    }
+
+    // Stands in for LogonUI: counts its references and records each CredentialsChanged call.
+    // While the gate is reset, calls block inside the sink, as a slow re-enumeration would.
+    class CFakeSink : public ICredentialProviderEvents
+    {
+    public:
+        CFakeSink() :
+            _cRef(1),
+            _hr(S_OK),
+            _cInside(0),
+            _hGate(CreateEventW(nullptr, TRUE, TRUE, nullptr))
+        {
+        }
+
+        ~CFakeSink()
+        {
+            CloseHandle(_hGate);
+        }
+
+        HRESULT STDMETHODCALLTYPE QueryInterface(REFIID, void **ppv) override
+        {
+            *ppv = nullptr;
+            return E_NOTIMPL;
+        }
+
+        ULONG STDMETHODCALLTYPE AddRef() override
+        {
+            return InterlockedIncrement(&_cRef);
+        }
+
+        ULONG STDMETHODCALLTYPE Release() override
+        {
+            return InterlockedDecrement(&_cRef);
+        }
+
+        HRESULT STDMETHODCALLTYPE CredentialsChanged(UINT_PTR upAdviseContext) override
+        {
+            InterlockedIncrement(&_cInside);
+            WaitForSingleObject(_hGate, INFINITE);
+            std::lock_guard<std::mutex> lock(_mutex);
+            _vecContexts.push_back(upAdviseContext);
+            _vecTimes.push_back(std::chrono::steady_clock::now());
+            InterlockedDecrement(&_cInside);
+            return _hr;
+        }
+
+        LONG Refs() const { return _cRef; }
+        LONG Inside() const { return _cInside; }
+        void SetResult(HRESULT hr) { _hr = hr; }
+        void Hold() { ResetEvent(_hGate); }
+        void Let() { SetEvent(_hGate); }
+
+        size_t Calls()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _vecContexts.size();
+        }
+
+        bool AllWith(UINT_PTR upAdviseContext)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return std::all_of(_vecContexts.begin(), _vecContexts.end(), [upAdviseContext](UINT_PTR up)
+            {
+                return up == upAdviseContext;
+            });
+        }
+
+        std::chrono::steady_clock::time_point LastCall()
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _vecTimes.back();
+        }
+
+        // Whether the source calls again within dwMs; used to show that nothing else is coming.
+        bool Quiet(size_t cCalls, DWORD dwMs = 100)
+        {
+            return !WaitFor([this, cCalls]() { return Calls() != cCalls; }, dwMs);
+        }
+
+    private:
+        LONG                    _cRef;
+        HRESULT                 _hr;
+        LONG                    _cInside;
+        HANDLE                  _hGate;
+        std::mutex              _mutex;
+        std::vector<UINT_PTR>   _vecContexts;
+        std::vector<std::chrono::steady_clock::time_point> _vecTimes;
+    };
+
+    // Signals pe and waits for the sink to be called once more.
+    bool Deliver(PROVIDER_EVENT pe, CFakeSink *pSink)
+    {
+        size_t cCalls = pSink->Calls();
+        SignalProviderEvent(pe);
+        return WaitFor([pSink, cCalls]() { return pSink->Calls() == cCalls + 1; }) && pSink->Quiet(cCalls + 1);
+    }
+
+    // Every event reaches the sink with its context, quickly, and only once.
+    void TestAdvise()
+    {
+        const char *pszTest = "Advise";
+        CFakeSink sink;
+        CProviderEventSource source;
+
+        Check(source.Advise(&sink, 0x1234) == S_OK && sink.Refs() == 2, pszTest, "Advise holds the sink");
+        Check(sink.Quiet(0), pszTest, "nothing is delivered before an event");
+        for (DWORD pe = 0; pe < PE_COUNT; pe++)
+        {
+            Check(Deliver(static_cast<PROVIDER_EVENT>(pe), &sink), pszTest, "each event is delivered once");
+        }
+        Check(sink.AllWith(0x1234), pszTest, "with the advise context");
+
+        std::vector<long long> vecLatencies;
+        for (int i = 0; i < 21; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            if (!Deliver(PE_APPROVAL_RECEIVED, &sink))
+            {
+                break;
+            }
+            vecLatencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(sink.LastCall() - start).count());
+        }
+        std::sort(vecLatencies.begin(), vecLatencies.end());
+        Check(vecLatencies.size() == 21 && vecLatencies[10] < 100000, pszTest, "the median delivery takes under 100 ms");
+
+        size_t cCalls = sink.Calls();
+        source.UnAdvise();
+        Check(sink.Refs() == 1, pszTest, "UnAdvise releases the sink");
+        SignalProviderEvent(PE_CONFIG_CHANGED);
+        Check(sink.Quiet(cCalls), pszTest, "and nothing is delivered after it");
+        source.UnAdvise();
+        Check(sink.Refs() == 1, pszTest, "a second UnAdvise does nothing");
+    }
+
+    // Events that arrive while the sink is still busy come out as one more call.
+    void TestCoalesce()
+    {
+        const char *pszTest = "Coalesce";
+        CFakeSink sink;
+        CProviderEventSource source;
+        Check(source.Advise(&sink, 7) == S_OK, pszTest, "Advise");
+
+        sink.Hold();
+        SignalProviderEvent(PE_OTP_CHECKED);
+        Check(WaitFor([&sink]() { return sink.Inside() == 1; }), pszTest, "the first event reaches the sink");
+        for (int i = 0; i < 3; i++)
+        {
+            for (DWORD pe = 0; pe < PE_COUNT; pe++)
+            {
+                SignalProviderEvent(static_cast<PROVIDER_EVENT>(pe));
+            }
+        }
+        sink.Let();
+        Check(WaitFor([&sink]() { return sink.Calls() == 2; }) && sink.Quiet(2), pszTest, "the rest make one more call");
+
+        // The sink is released even if UnAdvise comes while it is inside a call.
+        sink.Hold();
+        SignalProviderEvent(PE_CONFIG_CHANGED);
+        Check(WaitFor([&sink]() { return sink.Inside() == 1; }), pszTest, "a call is in progress");
+        std::thread unadvise([&source]() { source.UnAdvise(); });
+        Sleep(20);
+        Check(sink.Refs() == 2, pszTest, "UnAdvise waits for the call");
+        sink.Let();
+        unadvise.join();
+        Check(sink.Calls() == 3 && sink.Refs() == 1, pszTest, "and then releases the sink");
+    }
+
+    // An address change is delivered, and the notification is re-armed for the next one.
+    void TestNetwork()
+    {
+        const char *pszTest = "Network";
+        CFakeSink sink;
+        CProviderEventSource source;
+        Check(source.Advise(&sink, 9) == S_OK, pszTest, "Advise");
+        Check(WaitFor([]() { return ShimPendingAddrChanges() == 1; }), pszTest, "the wait thread asks for address changes");
+
+        for (size_t i = 1; i <= 3; i++)
+        {
+            Check(ShimChangeAddress() == 1, pszTest, "an address changes");
+            Check(WaitFor([&sink, i]() { return sink.Calls() == i; }) && sink.Quiet(i), pszTest, "it is delivered once");
+            Check(WaitFor([]() { return ShimPendingAddrChanges() == 1; }), pszTest, "and the notification is re-armed");
+        }
+
+        // PE_NETWORK_RESTORED from inside the process shares the event; it must not leave a second
+        // request behind.
+        Check(Deliver(PE_NETWORK_RESTORED, &sink) && ShimPendingAddrChanges() == 1, pszTest, "a signaled network event re-arms once");
+
+        source.UnAdvise();
+        Check(ShimPendingAddrChanges() == 0, pszTest, "UnAdvise cancels the notification");
+    }
+
+    // A source advised again drops the old sink and reports to the new one.
+    void TestReAdvise()
+    {
+        const char *pszTest = "ReAdvise";
+        CFakeSink sinkOld;
+        CFakeSink sinkNew;
+        CProviderEventSource source;
+        Check(source.Advise(&sinkOld, 1) == S_OK && Deliver(PE_CONFIG_CHANGED, &sinkOld), pszTest, "the first sink is called");
+
+        Check(source.Advise(&sinkNew, 2) == S_OK, pszTest, "Advise again");
+        Check(sinkOld.Refs() == 1 && sinkNew.Refs() == 2, pszTest, "the old sink is released");
+        Check(Deliver(PE_CONFIG_CHANGED, &sinkNew) && sinkNew.AllWith(2), pszTest, "the new sink is called with the new context");
+        Check(sinkOld.Calls() == 1, pszTest, "and the old one is not");
+        Check(WaitFor([]() { return ShimPendingAddrChanges() == 1; }), pszTest, "only one address notification is pending");
+    }
+
+    // Past the table's eight sources, a provider only hears about address changes.
+    void TestTooMany()
+    {
+        const char *pszTest = "TooMany";
+        const size_t c_cSources = 9;
+        std::vector<CFakeSink> vecSinks(c_cSources);
+        std::vector<CProviderEventSource> vecSources(c_cSources);
+        size_t cLogged = Logged(L"[EVENTS] too many advised providers");
+
+        bool fAdvised = true;
+        for (size_t i = 0; i < c_cSources; i++)
+        {
+            fAdvised = fAdvised && (vecSources[i].Advise(&vecSinks[i], i) == S_OK);
+        }
+        Check(fAdvised, pszTest, "every source advises");
+        Check(Logged(L"[EVENTS] too many advised providers") == cLogged + 1, pszTest, "the ninth is logged");
+
+        SignalProviderEvent(PE_CONFIG_CHANGED);
+        Check(WaitFor([&vecSinks]()
+              {
+                  return std::all_of(vecSinks.begin(), vecSinks.end() - 1, [](CFakeSink &sink) { return sink.Calls() == 1; });
+              }), pszTest, "the first eight get the event");
+        Check(vecSinks.back().Quiet(0), pszTest, "the ninth does not");
+
+        Check(WaitFor([c_cSources]() { return ShimPendingAddrChanges() == c_cSources; }), pszTest, "all nine ask for address changes");
+        ShimChangeAddress();
+        Check(WaitFor([&vecSinks]() { return vecSinks.back().Calls() == 1; }), pszTest, "the ninth gets address changes");
+
+        // Once one leaves, the table has room again.
+        vecSources[0].UnAdvise();
+        vecSources.back().UnAdvise();
+        Check(vecSources.back().Advise(&vecSinks.back(), 99) == S_OK, pszTest, "the ninth advises again");
+        Check(Deliver(PE_OTP_CHECKED, &vecSinks.back()), pszTest, "and now gets every event");
+
+        for (CProviderEventSource &source : vecSources)
+        {
+            source.UnAdvise();
+        }
+        Check(std::all_of(vecSinks.begin(), vecSinks.end(), [](CFakeSink &sink) { return sink.Refs() == 1; }), pszTest, "every sink is released");
+    }
+
+    // A failing CredentialsChanged is logged, and later events are still delivered.
+    void TestFailingSink()
+    {
+        const char *pszTest = "FailingSink";
+        CFakeSink sink;
+        CProviderEventSource source;
+        Check(source.Advise(&sink, 3) == S_OK, pszTest, "Advise");
+
+        size_t cLogged = Logged(L"[EVENTS] CredentialsChanged hr=0x80004005");
+        sink.SetResult(E_FAIL);
+        Check(Deliver(PE_CONFIG_CHANGED, &sink), pszTest, "the failing call is made");
+        Check(WaitFor([cLogged]() { return Logged(L"[EVENTS] CredentialsChanged hr=0x80004005") == cLogged + 1; }), pszTest, "and logged");
+
+        sink.SetResult(S_OK);
+        Check(Deliver(PE_CONFIG_CHANGED, &sink), pszTest, "the next event still arrives");
+    }
+}
+
+HRESULT WriteLogMessage(_In_z_ PCWSTR message)
+{
+    std::lock_guard<std::mutex> lock(s_mutexLog);
+    s_vecLog.push_back(message);
+    return S_OK;
+}
+
+int main()
+{
+    TestAdvise();
+    TestCoalesce();
+    TestNetwork();
+    TestReAdvise();
+    TestTooMany();
+    TestFailingSink();
+
+    Check(ShimPendingAddrChanges() == 0, "Main", "no address notification is left behind");
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,810 @@
+// Tests for OTP gateway selection (serverselect.cpp): the latency and error EWMAs behind the
+// score, the circuit breaker, its trials, and the background prober.
+//
+// The config snapshot and the warm-start state are replaced by the stubs below, the clock is
+// moved with ShimAdvanceTicks and the probe timer is fired with ShimFireTimers, so this builds on
+// Linux against the headers in tests/shim, under the sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/serverselect_test.cpp cpp/serverselect.cpp -o serverselect_test
+//   ./serverselect_test
+//
+// The scenarios spell out what serverselect.h promises. The random run then drives selections,
+// reports, probes, configuration changes and the clock in any order, and checks every selection
+// against a plain reimplementation of the same state machine.
+
+#include <windows.h>
+#include <stdio.h>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+#include "../serverselect.h"
+#include "../configsnapshot.h"
+#include "../warmstart.h"
+#include "../utils.h"
+#include "../Dll.h"
+
+// What the stub snapshot serves. configsnapshot.h only declares this, so the test lays it out.
+struct CONFIG_SETTINGS
+{
+    std::vector<CONFIG_OTP_SERVER>  vecServers;
+    DWORD                           dwTimeoutMs;
+};
+
+namespace
+{
+    const DWORD c_dwDefaultTimeoutMs = 5000;
+    const ULONGLONG c_ullFirstEjectionMs = 30000;
+    const ULONGLONG c_ullMaxEjectionMs = 300000;
+    const ULONGLONG c_ullProberIdleMs = 300000;
+
+    LONG s_lGeneration = 0;
+    CONFIG_SETTINGS s_settings = { {}, 0 };
+    std::wstring s_strWarmStart;
+    long s_cDllRefs = 0;
+
+    // What the fake probe answers for each gateway, and how often it was asked.
+    struct PROBE_ANSWER
+    {
+        bool    fAnswered;
+        DWORD   dwLatencyMs;
+    };
+    std::map<std::wstring, PROBE_ANSWER> s_mapProbeAnswers;
+    std::map<std::wstring, int> s_mapProbes;
+
+    int s_cFailures = 0;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // Swaps in a new Otp\Servers and Otp\Timeout, as a registry change would. Selection picks it
+    // up on its next call.
+    void SetServers(const std::vector<std::wstring> &vecUrls, DWORD dwTimeoutMs = 0)
+    {
+        s_settings.vecServers.clear();
+        for (const std::wstring &strUrl : vecUrls)
+        {
+            CONFIG_OTP_SERVER server = {};
+            wcsncpy(server.szUrl, strUrl.c_str(), ARRAYSIZE(server.szUrl) - 1);
+            s_settings.vecServers.push_back(server);
+        }
+        s_settings.dwTimeoutMs = dwTimeoutMs;
+        s_lGeneration++;
+    }
+
+    HRESULT Select(std::wstring *pstrUrl, const std::vector<std::wstring> &vecExclude = {})
+    {
+        std::vector<PCWSTR> vecpszExclude;
+        for (const std::wstring &strUrl : vecExclude)
+        {
+            vecpszExclude.push_back(strUrl.c_str());
+        }
+        wchar_t szUrl[c_cchMaxOtpServerUrl];
+        HRESULT hr = SelectOtpServer(vecpszExclude.data(), static_cast<DWORD>(vecpszExclude.size()), szUrl, ARRAYSIZE(szUrl));
+        *pstrUrl = szUrl;
+        return hr;
+    }
+
+    // Reports only reach the gateways the last selection saw, so a test that reports before it
+    // selects starts with a selection that picks up its configuration.
+    void UseServers(const std::vector<std::wstring> &vecUrls)
+    {
+        SetServers(vecUrls);
+        std::wstring strUrl;
+        Select(&strUrl);
+    }
+
+    // Whether the next selection, skipping vecExclude, lands on strExpected.
+    bool Selects(const std::wstring &strExpected, const std::vector<std::wstring> &vecExclude = {})
+    {
+        std::wstring strUrl;
+        HRESULT hr = Select(&strUrl, vecExclude);
+        if (FAILED(hr) || strUrl != strExpected)
+        {
+            fprintf(stderr, "  expected %ls, selected %ls hr=0x%08X\n", strExpected.c_str(), strUrl.c_str(), static_cast<unsigned>(hr));
+            return false;
+        }
+        return true;
+    }
+
+    bool SelectFails(HRESULT hrExpected, const std::vector<std::wstring> &vecExclude = {})
+    {
+        std::wstring strUrl;
+        HRESULT hr = Select(&strUrl, vecExclude);
+        if (hr != hrExpected || !strUrl.empty())
+        {
+            fprintf(stderr, "  expected hr=0x%08X, selected %ls hr=0x%08X\n", static_cast<unsigned>(hrExpected), strUrl.c_str(), static_cast<unsigned>(hr));
+            return false;
+        }
+        return true;
+    }
+
+    void Fail(const std::wstring &strUrl, DWORD cTimes = 1)
+    {
+        for (DWORD i = 0; i < cTimes; i++)
+        {
+            ReportOtpServerResult(strUrl.c_str(), false, 0);
+        }
+    }
+
+    void Answer(const std::wstring &strUrl, DWORD dwLatencyMs)
+    {
+        ReportOtpServerResult(strUrl.c_str(), true, dwLatencyMs);
+    }
+
+    HRESULT FakeProbe(_In_ PCWSTR pszUrl, _Out_ DWORD *pdwLatencyMs)
+    {
+        s_mapProbes[pszUrl]++;
+        auto it = s_mapProbeAnswers.find(pszUrl);
+        bool fAnswered = (it == s_mapProbeAnswers.end()) || it->second.fAnswered;
+        *pdwLatencyMs = (it == s_mapProbeAnswers.end()) ? 50 : it->second.dwLatencyMs;
+        return fAnswered ? S_OK : HRESULT_FROM_WIN32(ERROR_TIMEOUT);
+    }
+
+    const HRESULT c_hrUnreachable = HRESULT_FROM_WIN32(ERROR_HOST_UNREACHABLE);
+    const HRESULT c_hrNotFound = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+
+    // Until a gateway is measured, the warm-start gateway comes first, then configuration order.
+    void TestUnmeasuredOrder()
+    {
+        const char *pszTest = "UnmeasuredOrder";
+        std::wstring a = L"https://order-a", b = L"https://order-b", c = L"https://order-c";
+        SetServers({ a, b, c });
+        s_strWarmStart.clear();
+        Check(Selects(a), pszTest, "configuration order without a warm start");
+        Check(Selects(b, { a }), pszTest, "the next one when the first is excluded");
+        s_strWarmStart = b;
+        Check(Selects(b), pszTest, "the warm-start gateway first");
+        Check(Selects(a, { b }), pszTest, "then configuration order");
+        s_strWarmStart = L"https://gone";
+        Check(Selects(a), pszTest, "a warm-start gateway no longer configured is ignored");
+
+        // A measured gateway slower than the unmeasured weight loses to an unmeasured one, but
+        // not to the warm-start gateway's place at the front.
+        Answer(a, 1500);
+        Check(Selects(b), pszTest, "an unmeasured gateway beats a slow measured one");
+        s_strWarmStart = c;
+        Check(Selects(c), pszTest, "the warm-start gateway beats every measured one");
+        s_strWarmStart.clear();
+
+        Check(SelectFails(c_hrNotFound, { a, b, c }), pszTest, "nothing left to fail over to");
+        SetServers({});
+        Check(SelectFails(c_hrNotFound), pszTest, "no gateways configured");
+    }
+
+    // Latency and errors are EWMAs with a smoothing of 0.2; the score is latency times one plus
+    // four times the error rate.
+    void TestScore()
+    {
+        const char *pszTest = "Score";
+        std::wstring a = L"https://score-a", b = L"https://score-b", c = L"https://score-c";
+        UseServers({ a, b, c });
+        s_strWarmStart.clear();
+        Answer(a, 100);
+        Answer(b, 60);
+        Answer(c, 5000);
+        Check(Selects(b), pszTest, "the fastest gateway");
+
+        // b: error rate 0.2, score 60 * 1.8 = 108 against a's 100.
+        Fail(b);
+        Check(Selects(a), pszTest, "one failure weighs the fast gateway down");
+        // b: error rate 0.16, score 60 * 1.64 = 98.4.
+        Answer(b, 60);
+        Check(Selects(b), pszTest, "answers let the error rate decay");
+
+        // The first answer sets the latency; later ones move it a fifth of the way.
+        // c: 5000 * 0.8 = 4000, then 3200, 2560, ... below 98.4 after 18 answers.
+        for (int i = 0; i < 17; i++)
+        {
+            Answer(c, 0);
+        }
+        Check(Selects(b), pszTest, "the latency average moves by a fifth per answer");
+        Answer(c, 0);
+        Check(Selects(c), pszTest, "the latency average crosses over on the eighteenth answer");
+
+        // c is at 5000 * 0.8^18, about 90; a moves to 100 * 0.8 + 10 * 0.2 = 82.
+        Answer(a, 10);
+        Check(Selects(a), pszTest, "a fast answer moves the average ahead");
+    }
+
+    // Three consecutive failures eject a gateway for 30 s, doubling on each failed trial up to
+    // five minutes. A gateway in rotation always beats one due for a trial.
+    void TestBreaker()
+    {
+        const char *pszTest = "Breaker";
+        std::wstring a = L"https://breaker-a", b = L"https://breaker-b";
+        UseServers({ a, b });
+        s_strWarmStart.clear();
+        Answer(a, 10);
+        Answer(b, 500);
+
+        Fail(a, 2);
+        Answer(a, 10);
+        Fail(a, 2);
+        Check(Selects(a), pszTest, "failures that are not consecutive do not eject");
+        Fail(a);
+        Check(Selects(b), pszTest, "the third consecutive failure ejects");
+        Check(SelectFails(c_hrUnreachable, { b }), pszTest, "an ejected gateway is not selected");
+
+        // Failures reported while ejected, from requests already in flight, change nothing.
+        ShimAdvanceTicks(20000);
+        Fail(a);
+        ShimAdvanceTicks(9500);
+        Check(SelectFails(c_hrUnreachable, { b }), pszTest, "ejected for 30 s");
+        ShimAdvanceTicks(500);
+        Check(Selects(b), pszTest, "a gateway in rotation beats one due for a trial");
+        Check(Selects(a, { b }), pszTest, "due for a trial after 30 s");
+        Check(SelectFails(c_hrUnreachable, { b }), pszTest, "one trial at a time");
+
+        ULONGLONG ullEjectedForMs = c_ullFirstEjectionMs;
+        for (int i = 0; i < 6; i++)
+        {
+            Fail(a);
+            ullEjectedForMs = std::min(2 * ullEjectedForMs, c_ullMaxEjectionMs);
+            ShimAdvanceTicks(ullEjectedForMs - 500);
+            Check(SelectFails(c_hrUnreachable, { b }), pszTest, "a failed trial doubles the ejection, up to five minutes");
+            ShimAdvanceTicks(500);
+            Check(Selects(a, { b }), pszTest, "due again once the doubled ejection is over");
+        }
+
+        Answer(a, 10);
+        Check(Selects(a), pszTest, "a good trial puts the gateway back");
+        Fail(a, 3);
+        ShimAdvanceTicks(c_ullFirstEjectionMs - 500);
+        Check(SelectFails(c_hrUnreachable, { b }), pszTest, "back in rotation resets the ejection");
+        ShimAdvanceTicks(500);
+        Check(Selects(a, { b }), pszTest, "to 30 s");
+        Answer(a, 10);
+    }
+
+    // Regression for gateways stuck in the trial state: a trial whose request is cancelled, or
+    // never reports at all, must not keep the gateway out for good.
+    void TestStalledTrial()
+    {
+        const char *pszTest = "StalledTrial";
+        std::wstring a = L"https://trial-a";
+        UseServers({ a });
+        s_strWarmStart.clear();
+
+        Fail(a, 3);
+        ShimAdvanceTicks(c_ullFirstEjectionMs);
+        Check(Selects(a), pszTest, "the trial is taken");
+        ReportOtpServerNoResult(a.c_str());
+        Check(Selects(a), pszTest, "a trial that ended without an outcome is due again at once");
+
+        // Nobody reports: the trial is given up after one request timeout.
+        Check(SelectFails(c_hrUnreachable), pszTest, "the trial is in flight");
+        ShimAdvanceTicks(c_dwDefaultTimeoutMs - 500);
+        Check(SelectFails(c_hrUnreachable), pszTest, "the trial has a request timeout");
+        ShimAdvanceTicks(500);
+        Check(Selects(a), pszTest, "a trial without an outcome is given up after Otp\\Timeout");
+
+        // The timeout follows the configuration.
+        SetServers({ a }, 2000);
+        ShimAdvanceTicks(c_dwDefaultTimeoutMs);
+        Check(Selects(a), pszTest, "the abandoned trial is due again");
+        ShimAdvanceTicks(1500);
+        Check(SelectFails(c_hrUnreachable), pszTest, "a configured timeout is not over early");
+        ShimAdvanceTicks(500);
+        Check(Selects(a), pszTest, "a trial lasts the configured Otp\\Timeout");
+
+        // A late outcome for an abandoned trial still counts.
+        Answer(a, 10);
+        Check(Selects(a), pszTest, "a late answer puts the gateway back");
+
+        // Without a trial, a request that says nothing changes nothing.
+        ReportOtpServerNoResult(a.c_str());
+        Fail(a, 2);
+        ReportOtpServerNoResult(a.c_str());
+        Check(Selects(a), pszTest, "no result is not a failure");
+        Fail(a);
+        Check(SelectFails(c_hrUnreachable), pszTest, "nor does it break a run of failures");
+        ReportOtpServerNoResult(a.c_str());
+        Check(SelectFails(c_hrUnreachable), pszTest, "nor does it end an ejection");
+        ShimAdvanceTicks(c_ullFirstEjectionMs);
+        Check(Selects(a), pszTest, "the ejection runs its course");
+        Answer(a, 10);
+    }
+
+    // Probes run while gateways are being selected, stop after five idle minutes, and treat
+    // ejected gateways as requests do.
+    void TestProber()
+    {
+        const char *pszTest = "Prober";
+        std::wstring a = L"https://probe-a", b = L"https://probe-b";
+        SetServers({ a, b });
+        s_strWarmStart.clear();
+        s_mapProbes.clear();
+        s_mapProbeAnswers.clear();
+
+        Check(Selects(a), pszTest, "selection without a prober");
+        Check(ShimFireTimers() == 0 && s_cDllRefs == 0, pszTest, "nothing armed without a probe");
+
+        SetOtpServerProbe(FakeProbe);
+        Check(Selects(a), pszTest, "selection arms the prober");
+        Check(s_cDllRefs == 1, pszTest, "the armed timer holds the DLL");
+        s_mapProbeAnswers[a] = { true, 300 };
+        s_mapProbeAnswers[b] = { true, 40 };
+        Check(ShimFireTimers() == 1, pszTest, "the prober fires");
+        Check(s_mapProbes[a] == 1 && s_mapProbes[b] == 1, pszTest, "every gateway in rotation is probed");
+        Check(Selects(b), pszTest, "probes feed the latency");
+        Check(s_strWarmStart == b, pszTest, "a good probe is remembered for the warm start");
+
+        s_mapProbeAnswers[b] = { false, 0 };
+        ShimFireTimers();
+        ShimFireTimers();
+        ShimFireTimers();
+        Check(Selects(a), pszTest, "failed probes eject");
+        ShimFireTimers();
+        Check(s_mapProbes[b] == 4, pszTest, "an ejected gateway is not probed");
+        ShimAdvanceTicks(c_ullFirstEjectionMs);
+        s_mapProbeAnswers[b] = { true, 40 };
+        Check(Selects(a), pszTest, "the prober keeps running while selections come in");
+        ShimFireTimers();
+        Check(s_mapProbes[b] == 5, pszTest, "an ejected gateway is probed once it is due");
+        Check(Selects(b), pszTest, "a good trial probe puts it back");
+
+        // A trial taken by a request is not probed over.
+        Fail(b, 3);
+        ShimAdvanceTicks(c_ullFirstEjectionMs);
+        Check(Selects(b, { a }), pszTest, "a request takes the trial");
+        ShimFireTimers();
+        Check(s_mapProbes[b] == 5, pszTest, "the prober leaves a trial in flight alone");
+        Answer(b, 40);
+
+        // Idle: the last selection was more than five minutes ago.
+        ShimAdvanceTicks(c_ullProberIdleMs - 500);
+        Check(ShimFireTimers() == 1 && s_cDllRefs == 1, pszTest, "busy within five minutes");
+        ShimAdvanceTicks(500);
+        Check(ShimFireTimers() == 1 && s_cDllRefs == 0, pszTest, "the prober stops after five idle minutes");
+        Check(ShimFireTimers() == 0, pszTest, "and stays stopped");
+        Check(Selects(b) && s_cDllRefs == 1, pszTest, "the next selection starts it again");
+
+        SetOtpServerProbe(nullptr);
+        int cProbes = s_mapProbes[a];
+        Check(ShimFireTimers() == 1 && s_cDllRefs == 0 && s_mapProbes[a] == cProbes, pszTest, "turning probing off stops the prober");
+        Check(Selects(b) && s_cDllRefs == 0, pszTest, "and selection does not start it again");
+    }
+
+    // A configuration change keeps what is known about gateways that stay.
+    void TestConfigChange()
+    {
+        const char *pszTest = "ConfigChange";
+        std::wstring a = L"https://config-a", b = L"https://config-b", c = L"https://config-c";
+        UseServers({ a, b });
+        s_strWarmStart.clear();
+        Answer(a, 900);
+        Answer(b, 800);
+        Fail(a, 3);
+        Check(Selects(b), pszTest, "before the change");
+
+        SetServers({ c, b, a });
+        Check(Selects(b), pszTest, "a measured gateway keeps its score across a change");
+        Check(Selects(c, { b }), pszTest, "an ejected gateway stays ejected across a change");
+
+        SetServers({ c, b });
+        SetServers({ c, b, a });
+        Check(Selects(b), pszTest, "reloads in between are not seen");
+        Check(Selects(c, { b }), pszTest, "a gateway that was never removed keeps its state");
+
+        SetServers({ c });
+        Check(Selects(c), pszTest, "removed gateways are forgotten");
+        SetServers({ a, c });
+        Check(Selects(a), pszTest, "a gateway added back starts fresh");
+
+        // Reports for gateways that are not configured are dropped.
+        Answer(L"https://unknown", 1);
+        Fail(L"https://unknown", 3);
+        ReportOtpServerNoResult(L"https://unknown");
+        Check(Selects(a), pszTest, "unknown gateways are ignored");
+    }
+
+    // The reference state machine, in milliseconds of the shim clock.
+    enum MODEL_STATE
+    {
+        MODEL_CLOSED,
+        MODEL_OPEN,
+        MODEL_TRIAL,
+    };
+
+    struct MODEL_SERVER
+    {
+        std::wstring    strUrl;
+        bool            fMeasured;
+        double          dblLatencyMs;
+        double          dblErrorRate;
+        DWORD           cConsecutiveFailures;
+        MODEL_STATE     state;
+        ULONGLONG       ullReopenMs;
+        ULONGLONG       ullEjectedForMs;
+    };
+
+    struct MODEL
+    {
+        std::vector<MODEL_SERVER>   vecServers;
+        LONG                        lGeneration;
+        ULONGLONG                   ullTrialTimeoutMs;
+        ULONGLONG                   ullNowMs;
+        ULONGLONG                   ullLastSelectMs;
+        bool                        fProbe;
+        bool                        fArmed;
+        std::wstring                strWarmStart;
+
+        void Sync()
+        {
+            if (lGeneration == s_lGeneration)
+            {
+                return;
+            }
+            std::vector<MODEL_SERVER> vecNew;
+            for (const CONFIG_OTP_SERVER &configured : s_settings.vecServers)
+            {
+                MODEL_SERVER server = { configured.szUrl, false, 0, 0, 0, MODEL_CLOSED, 0, 0 };
+                for (const MODEL_SERVER &old : vecServers)
+                {
+                    if (old.strUrl == server.strUrl)
+                    {
+                        server = old;
+                        break;
+                    }
+                }
+                vecNew.push_back(server);
+            }
+            vecServers = vecNew;
+            lGeneration = s_lGeneration;
+            ullTrialTimeoutMs = (s_settings.dwTimeoutMs != 0) ? s_settings.dwTimeoutMs : c_dwDefaultTimeoutMs;
+        }
+
+        bool IsDue(const MODEL_SERVER &server) const
+        {
+            return server.state != MODEL_CLOSED && ullNowMs >= server.ullReopenMs;
+        }
+
+        bool TakeTrial(MODEL_SERVER *pServer)
+        {
+            if (!IsDue(*pServer))
+            {
+                return false;
+            }
+            pServer->state = MODEL_TRIAL;
+            pServer->ullReopenMs = ullNowMs + ullTrialTimeoutMs;
+            return true;
+        }
+
+        HRESULT Select(const std::vector<std::wstring> &vecExclude, std::wstring *pstrUrl)
+        {
+            pstrUrl->clear();
+            Sync();
+            MODEL_SERVER *pBest = nullptr;
+            double dblBestScore = 0;
+            bool fAnyCandidate = false;
+            for (size_t i = 0; i < vecServers.size(); i++)
+            {
+                MODEL_SERVER &server = vecServers[i];
+                if (std::find(vecExclude.begin(), vecExclude.end(), server.strUrl) != vecExclude.end())
+                {
+                    continue;
+                }
+                fAnyCandidate = true;
+                double dblScore;
+                if (server.state == MODEL_CLOSED)
+                {
+                    dblScore = server.fMeasured ? server.dblLatencyMs * (1 + 4.0 * server.dblErrorRate) :
+                               (server.strUrl == strWarmStart) ? 0 : 1000.0 + i;
+                }
+                else if (IsDue(server))
+                {
+                    dblScore = 1e9 + i;
+                }
+                else
+                {
+                    continue;
+                }
+                if (pBest == nullptr || dblScore < dblBestScore)
+                {
+                    pBest = &server;
+                    dblBestScore = dblScore;
+                }
+            }
+            ullLastSelectMs = ullNowMs;
+            fArmed = fArmed || fProbe;
+            if (pBest == nullptr)
+            {
+                return fAnyCandidate ? c_hrUnreachable : c_hrNotFound;
+            }
+            TakeTrial(pBest);
+            *pstrUrl = pBest->strUrl;
+            return S_OK;
+        }
+
+        void Report(const std::wstring &strUrl, bool fAnswered, DWORD dwLatencyMs)
+        {
+            for (MODEL_SERVER &server : vecServers)
+            {
+                if (server.strUrl != strUrl)
+                {
+                    continue;
+                }
+                if (fAnswered)
+                {
+                    server.dblLatencyMs = server.fMeasured ? server.dblLatencyMs + 0.2 * (dwLatencyMs - server.dblLatencyMs) : dwLatencyMs;
+                    server.fMeasured = true;
+                    server.dblErrorRate *= (1 - 0.2);
+                    server.cConsecutiveFailures = 0;
+                    if (server.state != MODEL_CLOSED)
+                    {
+                        server.state = MODEL_CLOSED;
+                        server.ullEjectedForMs = 0;
+                    }
+                    strWarmStart = strUrl;
+                }
+                else
+                {
+                    server.dblErrorRate += 0.2 * (1 - server.dblErrorRate);
+                    server.cConsecutiveFailures++;
+                    if (server.state == MODEL_TRIAL || (server.state == MODEL_CLOSED && server.cConsecutiveFailures >= 3))
+                    {
+                        server.ullEjectedForMs = (server.ullEjectedForMs == 0) ? c_ullFirstEjectionMs : std::min(2 * server.ullEjectedForMs, c_ullMaxEjectionMs);
+                        server.ullReopenMs = ullNowMs + server.ullEjectedForMs;
+                        server.state = MODEL_OPEN;
+                    }
+                }
+                break;
+            }
+        }
+
+        void ReportNoResult(const std::wstring &strUrl)
+        {
+            for (MODEL_SERVER &server : vecServers)
+            {
+                if (server.strUrl == strUrl)
+                {
+                    if (server.state == MODEL_TRIAL)
+                    {
+                        server.state = MODEL_OPEN;
+                        server.ullReopenMs = ullNowMs;
+                    }
+                    break;
+                }
+            }
+        }
+
+        void FireTimer()
+        {
+            if (!fArmed)
+            {
+                return;
+            }
+            Sync();
+            std::vector<std::wstring> vecProbed;
+            for (MODEL_SERVER &server : vecServers)
+            {
+                if (fProbe && (server.state == MODEL_CLOSED || TakeTrial(&server)))
+                {
+                    vecProbed.push_back(server.strUrl);
+                }
+            }
+            for (const std::wstring &strUrl : vecProbed)
+            {
+                auto it = s_mapProbeAnswers.find(strUrl);
+                Report(strUrl, it == s_mapProbeAnswers.end() || it->second.fAnswered, (it == s_mapProbeAnswers.end()) ? 50 : it->second.dwLatencyMs);
+            }
+            fArmed = fProbe && ullNowMs - ullLastSelectMs < c_ullProberIdleMs;
+        }
+    };
+
+    void TestRandom()
+    {
+        const char *pszTest = "Random";
+        std::mt19937 rng(1);
+        std::vector<std::wstring> vecPool;
+        for (int i = 0; i < 6; i++)
+        {
+            vecPool.push_back(L"https://random-" + std::to_wstring(i));
+        }
+
+        // Start from a known state: no prober, no gateways the model has not seen.
+        SetOtpServerProbe(nullptr);
+        ShimFireTimers();
+        SetServers({ vecPool[0], vecPool[1], vecPool[2] });
+        s_strWarmStart.clear();
+        s_mapProbeAnswers.clear();
+        MODEL model = { {}, -1, c_dwDefaultTimeoutMs, 0, 0, false, false, std::wstring() };
+
+        DWORD cSelections = 0;
+        DWORD cMismatches = 0;
+        for (int iStep = 0; iStep < 20000 && cMismatches < 10; iStep++)
+        {
+            // Whatever URL an event names, sometimes one no longer configured.
+            const std::wstring &strUrl = vecPool[rng() % vecPool.size()];
+            DWORD dwEvent = rng() % 100;
+            if (dwEvent < 35)
+            {
+                std::vector<std::wstring> vecExclude;
+                for (const std::wstring &strPool : vecPool)
+                {
+                    if (rng() % 4 == 0)
+                    {
+                        vecExclude.push_back(strPool);
+                    }
+                }
+                std::wstring strActual;
+                std::wstring strExpected;
+                HRESULT hrActual = Select(&strActual, vecExclude);
+                HRESULT hrExpected = model.Select(vecExclude, &strExpected);
+                cSelections++;
+                if (hrActual != hrExpected || strActual != strExpected)
+                {
+                    fprintf(stderr, "  step %d: expected %ls hr=0x%08X, selected %ls hr=0x%08X\n", iStep,
+                            strExpected.c_str(), static_cast<unsigned>(hrExpected), strActual.c_str(), static_cast<unsigned>(hrActual));
+                    cMismatches++;
+                }
+            }
+            else if (dwEvent < 55)
+            {
+                bool fAnswered = rng() % 3 != 0;
+                DWORD dwLatencyMs = 10 + rng() % 2000;
+                ReportOtpServerResult(strUrl.c_str(), fAnswered, dwLatencyMs);
+                model.Report(strUrl, fAnswered, dwLatencyMs);
+            }
+            else if (dwEvent < 62)
+            {
+                ReportOtpServerNoResult(strUrl.c_str());
+                model.ReportNoResult(strUrl);
+            }
+            else if (dwEvent < 80)
+            {
+                // Whole half seconds, so no step ever lands within the real time that passes
+                // between two calls of a deadline.
+                ULONGLONG ullMs = 500 * (1 + rng() % ((rng() % 4 == 0) ? 700 : 20));
+                ShimAdvanceTicks(ullMs);
+                model.ullNowMs += ullMs;
+            }
+            else if (dwEvent < 90)
+            {
+                s_mapProbeAnswers[strUrl] = { rng() % 3 != 0, static_cast<DWORD>(10 + rng() % 2000) };
+                ShimFireTimers();
+                model.FireTimer();
+            }
+            else if (dwEvent < 93)
+            {
+                model.fProbe = !model.fProbe;
+                SetOtpServerProbe(model.fProbe ? FakeProbe : nullptr);
+            }
+            else if (dwEvent < 96)
+            {
+                std::vector<std::wstring> vecUrls;
+                for (const std::wstring &strPool : vecPool)
+                {
+                    if (rng() % 2 == 0)
+                    {
+                        vecUrls.insert(vecUrls.begin() + rng() % (vecUrls.size() + 1), strPool);
+                    }
+                }
+                SetServers(vecUrls, (rng() % 2 == 0) ? 0 : 1000 * (1 + rng() % 10));
+            }
+            else
+            {
+                s_strWarmStart = (rng() % 2 == 0) ? std::wstring() : strUrl;
+                model.strWarmStart = s_strWarmStart;
+            }
+
+            if (s_cDllRefs != (model.fArmed ? 1 : 0))
+            {
+                fprintf(stderr, "  step %d: prober %s\n", iStep, model.fArmed ? "should be armed" : "should have stopped");
+                cMismatches++;
+                model.fArmed = (s_cDllRefs != 0);
+            }
+            if (s_strWarmStart != model.strWarmStart)
+            {
+                fprintf(stderr, "  step %d: warm start is %ls, expected %ls\n", iStep, s_strWarmStart.c_str(), model.strWarmStart.c_str());
+                cMismatches++;
+                model.strWarmStart = s_strWarmStart;
+            }
+        }
+        Check(cMismatches == 0, pszTest, "every selection matches the reference");
+        Check(cSelections > 5000, pszTest, "enough selections were made");
+
+        SetOtpServerProbe(nullptr);
+        ShimFireTimers();
+    }
+}
+
+// The stub snapshot.
+
+CConfigSnapshot::CConfigSnapshot(LONG lGeneration, _In_ const BYTE *pbImage, bool fMapped) :
+    _cRef(1), _lGeneration(lGeneration), _pbImage(pbImage), _fMapped(fMapped),
+    _pSettings(reinterpret_cast<const CONFIG_SETTINGS *>(pbImage)),
+    _rgFilterRules(nullptr), _cFilterRules(0),
+    _rgOtpServers(_pSettings->vecServers.data()), _cOtpServers(static_cast<DWORD>(_pSettings->vecServers.size()))
+{
+}
+
+CConfigSnapshot::~CConfigSnapshot()
+{
+    delete _pSettings;
+}
+
+ULONG CConfigSnapshot::Release()
+{
+    long cRef = --_cRef;
+    if (cRef == 0)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+DWORD CConfigSnapshot::OtpTimeout(DWORD dwDefault) const
+{
+    return (_pSettings->dwTimeoutMs != 0) ? _pSettings->dwTimeoutMs : dwDefault;
+}
+
+const CONFIG_OTP_SERVER *CConfigSnapshot::OtpServers(_Out_ DWORD *pcServers) const
+{
+    *pcServers = _cOtpServers;
+    return _rgOtpServers;
+}
+
+HRESULT CConfigSnapshot::Load(LONG lGeneration, _Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    *ppSnapshot = new CConfigSnapshot(lGeneration, reinterpret_cast<const BYTE *>(new CONFIG_SETTINGS(s_settings)), false);
+    return S_OK;
+}
+
+HRESULT GetConfigSnapshot(_Outptr_ CConfigSnapshot **ppSnapshot)
+{
+    return CConfigSnapshot::Load(s_lGeneration, ppSnapshot);
+}
+
+// The warm start remembers the last gateway that answered.
+
+HRESULT GetWarmStartServer(_Out_writes_(cchServer) PWSTR pszServer, size_t cchServer)
+{
+    if (s_strWarmStart.empty())
+    {
+        return S_FALSE;
+    }
+    return StringCchCopyW(pszServer, cchServer, s_strWarmStart.c_str());
+}
+
+void RecordWarmStartServer(_In_ PCWSTR pszServer)
+{
+    s_strWarmStart = pszServer;
+}
+
+HRESULT WriteLogMessage(_In_z_ PCWSTR)
+{
+    return S_OK;
+}
+
+void DllAddRef()
+{
+    InterlockedIncrement(&s_cDllRefs);
+}
+
+void DllRelease()
+{
+    InterlockedDecrement(&s_cDllRefs);
+}
+
+int main()
+{
+    TestUnmeasuredOrder();
+    TestScore();
+    TestBreaker();
+    TestStalledTrial();
+    TestProber();
+    TestConfigChange();
+    TestRandom();
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,665 @@
+// Tests for the seqlocked table shared between provider processes (sharedtable.cpp): reads,
+// writes and inserts, probing and eviction, expiry, and readers racing writers.
+//
+// Sections are mmap-backed views of files in a scratch directory (see CreateFileMappingW in
+// tests/shim), so two opens of the same name are two views of the same pages, and a forked
+// process sees them too. This builds on Linux against the headers in tests/shim, under the
+// sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/sharedtable_test.cpp cpp/sharedtable.cpp -o sharedtable_test -lpthread
+//   ./sharedtable_test
+//
+// Single-threaded runs are checked against a plain reimplementation of the probing rules in
+// sharedtable.h. The threaded runs check what the seqlock promises: a reader never sees a torn
+// value, a slot held by a writer is skipped rather than waited on, and of several inserts of one
+// key exactly one wins.
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <atomic>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../sharedtable.h"
+#include "../Dll.h"
+
+namespace
+{
+    const DWORD c_cProbes = 8;
+
+    int s_cFailures = 0;
+    long s_cDllRefs = 0;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    // An expiry cSeconds from now. Tests only move the clock in whole seconds, and less than a
+    // second of real time passes between a write and the checks on it, so an entry written
+    // with In(n) is live n - 1 seconds later and gone n seconds later.
+    ULONGLONG In(LONGLONG cSeconds)
+    {
+        return GetSharedTableTime() + cSeconds * static_cast<LONGLONG>(c_ullSharedTableTicksPerSecond);
+    }
+
+    void AdvanceSeconds(ULONGLONG cSeconds)
+    {
+        ShimAdvanceTicks(cSeconds * 1000);
+    }
+
+    CSharedTable *OpenTable(PCWSTR pszName, DWORD cSlots, DWORD cbMaxValue)
+    {
+        CSharedTable *pTable = nullptr;
+        HRESULT hr = CSharedTable::Open(pszName, cSlots, cbMaxValue, &pTable);
+        if (FAILED(hr))
+        {
+            fprintf(stderr, "  cannot open %ls: hr=0x%08X\n", (pszName != nullptr) ? pszName : L"(private)", static_cast<unsigned>(hr));
+        }
+        return pTable;
+    }
+
+    bool Put(CSharedTable *pTable, ULONGLONG ullKey, const std::string &strValue, ULONGLONG ullExpires)
+    {
+        return pTable->Write(ullKey, strValue.data(), static_cast<DWORD>(strValue.size()), ullExpires);
+    }
+
+    bool Add(CSharedTable *pTable, ULONGLONG ullKey, const std::string &strValue, ULONGLONG ullExpires)
+    {
+        return pTable->Insert(ullKey, strValue.data(), static_cast<DWORD>(strValue.size()), ullExpires);
+    }
+
+    // Whether ullKey reads back as strValue; an empty strValue expects a miss.
+    bool Holds(const CSharedTable *pTable, ULONGLONG ullKey, const std::string &strValue)
+    {
+        char rgch[256];
+        DWORD cbValue = 0xFFFFFFFF;
+        bool fFound = pTable->Read(ullKey, rgch, sizeof(rgch), &cbValue, nullptr);
+        if (!fFound)
+        {
+            return strValue.empty() && cbValue == 0;
+        }
+        return std::string(rgch, cbValue) == strValue;
+    }
+
+    void TestPrivateTable()
+    {
+        const char *pszTest = "PrivateTable";
+        CSharedTable *pTable = OpenTable(nullptr, 16, 32);
+        if (pTable == nullptr)
+        {
+            Check(false, pszTest, "open");
+            return;
+        }
+        Check(pTable->IsWritable(), pszTest, "a private table is writable");
+        Check(Holds(pTable, 42, ""), pszTest, "an empty table holds nothing");
+        Check(Holds(pTable, 0, ""), pszTest, "not even key 0, which empty slots carry");
+
+        ULONGLONG ullExpires = In(10);
+        Check(Put(pTable, 42, "forty-two", ullExpires), pszTest, "write");
+        Check(Holds(pTable, 42, "forty-two"), pszTest, "read back");
+        char rgch[32];
+        DWORD cbValue;
+        ULONGLONG ullRead;
+        Check(pTable->Read(42, rgch, sizeof(rgch), &cbValue, &ullRead) && ullRead == ullExpires, pszTest, "the expiry is read back");
+        Check(!pTable->Read(42, rgch, 8, &cbValue, &ullRead) && cbValue == 0 && ullRead == 0, pszTest, "a short buffer is a miss");
+        Check(Holds(pTable, 42 + 16, ""), pszTest, "another key in the same home slot misses");
+
+        Check(Put(pTable, 42, "replaced", In(10)), pszTest, "write the same key");
+        Check(Holds(pTable, 42, "replaced"), pszTest, "the same key is replaced in place");
+
+        Check(!Put(pTable, 43, "", In(10)), pszTest, "empty values are refused");
+        Check(!Put(pTable, 43, std::string(33, 'x'), In(10)), pszTest, "values over cbMaxValue are refused");
+        Check(Put(pTable, 43, std::string(32, 'x'), In(10)), pszTest, "values of cbMaxValue are stored");
+        Check(Holds(pTable, 43, std::string(32, 'x')), pszTest, "and read back whole");
+
+        Check(!Add(pTable, 42, "second", In(10)), pszTest, "insert over a live entry loses");
+        Check(Holds(pTable, 42, "replaced"), pszTest, "and leaves it alone");
+        Check(Add(pTable, 44, "first", In(5)), pszTest, "insert of a new key");
+
+        AdvanceSeconds(4);
+        Check(Holds(pTable, 44, "first"), pszTest, "live until its expiry");
+        AdvanceSeconds(1);
+        Check(Holds(pTable, 44, ""), pszTest, "gone at its expiry");
+        Check(Add(pTable, 44, "again", In(5)), pszTest, "insert over an expired entry");
+        Check(Holds(pTable, 44, "again"), pszTest, "takes its place");
+        Check(Put(pTable, 44, "past", In(-1)), pszTest, "write with an expiry in the past");
+        Check(Holds(pTable, 44, ""), pszTest, "is the way to drop an entry");
+        Check(Holds(pTable, 42, "replaced"), pszTest, "other entries are untouched");
+
+        pTable->Release();
+    }
+
+    // Keys with the same home slot fill the next c_cProbes slots; beyond that, the entry that
+    // expires first makes room.
+    void TestProbing()
+    {
+        const char *pszTest = "Probing";
+        const DWORD cSlots = 16;
+        CSharedTable *pTable = OpenTable(nullptr, cSlots, 16);
+        if (pTable == nullptr)
+        {
+            Check(false, pszTest, "open");
+            return;
+        }
+
+        // Home slot 14, so the probe sequence wraps around the end of the table.
+        std::vector<ULONGLONG> vecKeys;
+        for (DWORD i = 0; i < c_cProbes + 3; i++)
+        {
+            vecKeys.push_back(14 + i * cSlots);
+        }
+        for (DWORD i = 0; i < c_cProbes; i++)
+        {
+            Check(Put(pTable, vecKeys[i], "v" + std::to_string(i), In(100 + i)), pszTest, "fill the probe window");
+        }
+        for (DWORD i = 0; i < c_cProbes; i++)
+        {
+            Check(Holds(pTable, vecKeys[i], "v" + std::to_string(i)), pszTest, "every colliding key is found");
+        }
+        // Key 0's window starts inside this one and still has free slots past it.
+        Check(Put(pTable, 0, "zero", In(10)), pszTest, "a key whose window overlaps");
+        Check(Holds(pTable, 0, "zero") && Holds(pTable, vecKeys[0], "v0"), pszTest, "takes a free slot rather than evict");
+
+        Check(Put(pTable, vecKeys[c_cProbes], "new", In(500)), pszTest, "one colliding key too many");
+        Check(Holds(pTable, vecKeys[0], ""), pszTest, "evicts the entry that expires first");
+        Check(Holds(pTable, vecKeys[c_cProbes], "new"), pszTest, "and takes its slot");
+
+        Check(Put(pTable, vecKeys[1], "v1", In(1000)), pszTest, "refresh the oldest one left");
+        Check(Put(pTable, vecKeys[c_cProbes + 1], "newer", In(50)), pszTest, "another colliding key");
+        Check(Holds(pTable, vecKeys[1], "v1") && Holds(pTable, vecKeys[2], ""), pszTest, "evicts by expiry, not by age");
+
+        // An expired entry goes before a live one, even a live one expiring sooner.
+        Check(Put(pTable, vecKeys[3], "v3", In(-1)), pszTest, "expire one");
+        Check(Put(pTable, vecKeys[c_cProbes + 2], "newest", In(2000)), pszTest, "one more colliding key");
+        Check(Holds(pTable, vecKeys[c_cProbes + 1], "newer"), pszTest, "the live entry expiring first stays");
+        Check(Holds(pTable, vecKeys[c_cProbes + 2], "newest"), pszTest, "the expired slot is reused");
+
+        // Insert makes room the same way.
+        Check(Add(pTable, vecKeys[0], "back", In(3000)), pszTest, "insert into a full window");
+        Check(Holds(pTable, vecKeys[0], "back") && Holds(pTable, vecKeys[c_cProbes + 1], ""), pszTest, "evicts the entry that expires first");
+
+        pTable->Release();
+    }
+
+    // The table as sharedtable.h describes it, in seconds of the shim clock.
+    struct MODEL_SLOT
+    {
+        ULONGLONG           ullKey;
+        LONGLONG            llExpires;
+        std::string         strValue;
+    };
+
+    struct MODEL
+    {
+        std::vector<MODEL_SLOT>     vecSlots;
+        DWORD                       cbMaxValue;
+        LONGLONG                    llNow;
+
+        bool Read(ULONGLONG ullKey, DWORD cbBuffer, std::string *pstrValue, LONGLONG *pllExpires) const
+        {
+            pstrValue->clear();
+            *pllExpires = 0;
+            DWORD cSlots = static_cast<DWORD>(vecSlots.size());
+            for (DWORD iProbe = 0; iProbe < c_cProbes && iProbe < cSlots; iProbe++)
+            {
+                const MODEL_SLOT &slot = vecSlots[(ullKey % cSlots + iProbe) % cSlots];
+                if (slot.ullKey != ullKey || slot.strValue.empty() || slot.strValue.size() > cbBuffer)
+                {
+                    continue;
+                }
+                if (slot.llExpires <= llNow)
+                {
+                    return false;
+                }
+                *pstrValue = slot.strValue;
+                *pllExpires = slot.llExpires;
+                return true;
+            }
+            return false;
+        }
+
+        bool Store(ULONGLONG ullKey, const std::string &strValue, LONGLONG llExpires, bool fInsert)
+        {
+            if (strValue.empty() || strValue.size() > cbMaxValue)
+            {
+                return false;
+            }
+            DWORD cSlots = static_cast<DWORD>(vecSlots.size());
+            MODEL_SLOT *pVictim = nullptr;
+            for (DWORD iProbe = 0; iProbe < c_cProbes && iProbe < cSlots; iProbe++)
+            {
+                MODEL_SLOT &slot = vecSlots[(ullKey % cSlots + iProbe) % cSlots];
+                if (slot.ullKey == ullKey)
+                {
+                    if (fInsert && !slot.strValue.empty() && slot.llExpires > llNow)
+                    {
+                        return false;
+                    }
+                    pVictim = &slot;
+                    break;
+                }
+                if (pVictim == nullptr || slot.llExpires < pVictim->llExpires)
+                {
+                    pVictim = &slot;
+                }
+            }
+            *pVictim = { ullKey, llExpires, strValue };
+            return true;
+        }
+    };
+
+    void TestRandom()
+    {
+        const char *pszTest = "Random";
+        std::mt19937 rng(1);
+        const DWORD c_rgcSlots[] = { 1, 5, 16 };
+        const DWORD cbMaxValue = 24;
+        const LONGLONG llTicksPerSecond = static_cast<LONGLONG>(c_ullSharedTableTicksPerSecond);
+
+        for (DWORD cSlots : c_rgcSlots)
+        {
+            CSharedTable *pTable = OpenTable(nullptr, cSlots, cbMaxValue);
+            if (pTable == nullptr)
+            {
+                Check(false, pszTest, "open");
+                continue;
+            }
+            // Expiries count whole seconds from here; see In.
+            ULONGLONG ullBase = GetSharedTableTime();
+            MODEL model = { std::vector<MODEL_SLOT>(cSlots, MODEL_SLOT{ 0, -(static_cast<LONGLONG>(ullBase) / llTicksPerSecond) - 1, std::string() }), cbMaxValue, 0 };
+
+            // A few keys per home slot, so windows overlap and wrap; 0 as well, which empty slots carry.
+            std::vector<ULONGLONG> vecKeys = { 0 };
+            for (DWORD i = 0; i < 12; i++)
+            {
+                vecKeys.push_back((rng() % 4) + cSlots * (rng() % 5) + ((i % 3 == 0) ? cSlots - 2 : 0));
+            }
+
+            DWORD cMismatches = 0;
+            DWORD cHits = 0;
+            for (int iStep = 0; iStep < 20000 && cMismatches < 10; iStep++)
+            {
+                ULONGLONG ullKey = vecKeys[rng() % vecKeys.size()];
+                DWORD dwEvent = rng() % 100;
+                if (dwEvent < 40)
+                {
+                    std::string strValue(rng() % (cbMaxValue + 2), 'a' + static_cast<char>(rng() % 26));
+                    if (!strValue.empty())
+                    {
+                        strValue[0] = static_cast<char>(iStep);
+                    }
+                    LONGLONG llExpires = model.llNow + static_cast<LONGLONG>(rng() % 40) - 3;
+                    ULONGLONG ullExpires = ullBase + llExpires * llTicksPerSecond;
+                    bool fInsert = (dwEvent < 15);
+                    bool fActual = fInsert ? Add(pTable, ullKey, strValue, ullExpires) : Put(pTable, ullKey, strValue, ullExpires);
+                    if (fActual != model.Store(ullKey, strValue, llExpires, fInsert))
+                    {
+                        fprintf(stderr, "  %u slots, step %d: %s of key %llu returned %d\n", cSlots, iStep, fInsert ? "insert" : "write",
+                                static_cast<unsigned long long>(ullKey), fActual);
+                        cMismatches++;
+                    }
+                }
+                else if (dwEvent < 90)
+                {
+                    DWORD cbBuffer = 1 + rng() % (cbMaxValue + 4);
+                    char rgch[cbMaxValue + 4];
+                    DWORD cbValue;
+                    ULONGLONG ullExpires;
+                    bool fActual = pTable->Read(ullKey, rgch, cbBuffer, &cbValue, &ullExpires);
+                    std::string strExpected;
+                    LONGLONG llExpires;
+                    bool fExpected = model.Read(ullKey, cbBuffer, &strExpected, &llExpires);
+                    if (fActual != fExpected ||
+                        (fActual && (std::string(rgch, cbValue) != strExpected || ullExpires != ullBase + llExpires * llTicksPerSecond)))
+                    {
+                        fprintf(stderr, "  %u slots, step %d: read of key %llu found %d, expected %d\n", cSlots, iStep,
+                                static_cast<unsigned long long>(ullKey), fActual, fExpected);
+                        cMismatches++;
+                    }
+                    cHits += fActual ? 1 : 0;
+                }
+                else
+                {
+                    DWORD cSeconds = 1 + rng() % 8;
+                    AdvanceSeconds(cSeconds);
+                    model.llNow += cSeconds;
+                }
+            }
+            Check(cMismatches == 0, pszTest, "every operation matches the reference");
+            Check(cHits > 500, pszTest, "enough reads hit");
+            Check(GetSharedTableTime() - ullBase < (model.llNow + 1) * c_ullSharedTableTicksPerSecond, pszTest, "less than a second of real time passed");
+            pTable->Release();
+        }
+    }
+
+    // A process outside the section's DACL: it maps the section read-only and sees what the
+    // writers stored, and keeps its own writes in a private table. Returns its failure count.
+    int RestrictedProcess()
+    {
+        const char *pszTest = "RestrictedProcess";
+        ShimRestrictedProcess() = true;
+        s_cFailures = 0;
+
+        CSharedTable *pTable = OpenTable(L"shared", 16, 32);
+        if (pTable == nullptr)
+        {
+            Check(false, pszTest, "open the existing section");
+            return s_cFailures;
+        }
+        Check(!pTable->IsWritable(), pszTest, "the section is read-only");
+        Check(Holds(pTable, 7, "from the writer"), pszTest, "the writer's entries are seen");
+        Check(!Put(pTable, 8, "mine", In(100)) && !Add(pTable, 8, "mine", In(100)), pszTest, "writes are refused");
+        pTable->Release();
+
+        pTable = OpenTable(L"absent", 16, 32);
+        if (pTable == nullptr)
+        {
+            Check(false, pszTest, "open a section nobody created");
+            return s_cFailures;
+        }
+        Check(pTable->IsWritable(), pszTest, "a section that cannot be opened falls back to a private table");
+        Check(Put(pTable, 8, "mine", In(100)) && Holds(pTable, 8, "mine"), pszTest, "which takes writes");
+        pTable->Release();
+        Check(OpenFileMappingW(FILE_MAP_READ, FALSE, L"Global\\sqcp.absent") == nullptr, pszTest, "and is not shared");
+        return s_cFailures;
+    }
+
+    void TestSharedSection()
+    {
+        const char *pszTest = "SharedSection";
+        CSharedTable *pFirst = OpenTable(L"shared", 16, 32);
+        CSharedTable *pSecond = OpenTable(L"shared", 16, 32);
+        if (pFirst == nullptr || pSecond == nullptr)
+        {
+            Check(false, pszTest, "open twice");
+            return;
+        }
+        Check(pFirst->IsWritable() && pSecond->IsWritable(), pszTest, "writers map the section for writing");
+        Check(Put(pFirst, 7, "from the writer", In(100)), pszTest, "write through one view");
+        Check(Holds(pSecond, 7, "from the writer"), pszTest, "read through the other");
+        Check(!Add(pSecond, 7, "second", In(100)), pszTest, "insert sees the other view's entry");
+
+        CSharedTable *pOther = nullptr;
+        Check(CSharedTable::Open(L"shared", 8, 32, &pOther) == HRESULT_FROM_WIN32(ERROR_REVISION_MISMATCH) && pOther == nullptr,
+              pszTest, "a different geometry is refused");
+        Check(FAILED(CSharedTable::Open(L"shared", 16, 200, &pOther)) && pOther == nullptr, pszTest, "a larger one too");
+
+        fflush(stderr);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            _exit(RestrictedProcess());
+        }
+        int nStatus = 0;
+        Check(pid > 0 && waitpid(pid, &nStatus, 0) == pid && WIFEXITED(nStatus) && WEXITSTATUS(nStatus) == 0,
+              pszTest, "a restricted process reads the section");
+
+        pFirst->Release();
+        pSecond->Release();
+    }
+
+    // The head of SHARED_SLOT, enough to stand in for a writer that stopped mid-update.
+    struct SLOT_HEAD
+    {
+        volatile LONG   lSequence;
+        DWORD           cbValue;
+        ULONGLONG       ullKey;
+    };
+
+    // Finds the slot holding ullKey through a view of the section file of its own.
+    SLOT_HEAD *FindSlot(BYTE *pbSection, size_t cbSection, ULONGLONG ullKey)
+    {
+        for (size_t ib = FIELD_OFFSET(SLOT_HEAD, ullKey); ib + sizeof(ullKey) <= cbSection; ib += sizeof(ullKey))
+        {
+            if (memcmp(pbSection + ib, &ullKey, sizeof(ullKey)) == 0)
+            {
+                return reinterpret_cast<SLOT_HEAD *>(pbSection + ib - FIELD_OFFSET(SLOT_HEAD, ullKey));
+            }
+        }
+        return nullptr;
+    }
+
+    // A slot left odd, as by a writer that died mid-update, is skipped: nobody waits on it, and
+    // nobody stores the key it may hold anywhere else.
+    void TestStuckSlot()
+    {
+        const char *pszTest = "StuckSlot";
+        const ULONGLONG ullKey = 0x5EC1F00D5EC1F00Dull;
+        const ULONGLONG ullNeighbour = ullKey + 16;
+        CSharedTable *pTable = OpenTable(L"stuck", 16, 32);
+        int fd = open((std::string(ShimFileRoot()) + "/Global.sqcp.stuck").c_str(), O_RDWR);
+        struct stat st;
+        BYTE *pbSection = (fd >= 0 && fstat(fd, &st) == 0) ?
+                          static_cast<BYTE *>(mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) : nullptr;
+        if (pTable == nullptr || pbSection == nullptr || pbSection == MAP_FAILED)
+        {
+            Check(false, pszTest, "open the section twice");
+            return;
+        }
+
+        Check(Put(pTable, ullKey, "held", In(100)), pszTest, "write");
+        SLOT_HEAD *pSlot = FindSlot(pbSection, static_cast<size_t>(st.st_size), ullKey);
+        if (pSlot == nullptr)
+        {
+            Check(false, pszTest, "find the slot");
+            return;
+        }
+        InterlockedIncrement(&pSlot->lSequence);
+        Check(Holds(pTable, ullKey, ""), pszTest, "a reader does not wait on a held slot");
+        Check(!Put(pTable, ullKey, "other", In(100)), pszTest, "nor does a writer");
+        Check(!Add(pTable, ullKey, "other", In(100)), pszTest, "an insert does not claim the key past a held slot");
+        Check(!Add(pTable, ullNeighbour, "neighbour", In(100)), pszTest, "nor any key whose window holds it");
+        Check(Put(pTable, ullNeighbour, "neighbour", In(100)), pszTest, "a write of another key goes past it");
+        Check(Holds(pTable, ullNeighbour, "neighbour"), pszTest, "and so does the read");
+
+        InterlockedIncrement(&pSlot->lSequence);
+        Check(Holds(pTable, ullKey, "held"), pszTest, "the slot is back once its writer finishes");
+        Check(!Add(pTable, ullKey, "other", In(100)), pszTest, "and the key is taken");
+
+        munmap(pbSection, static_cast<size_t>(st.st_size));
+        close(fd);
+        pTable->Release();
+    }
+
+    // The value a writer stores for ullKey on its nth write: the key, n, then bytes derived from
+    // both, of a length that varies with n. A reader can tell a torn copy from a whole one.
+    std::string Stamp(ULONGLONG ullKey, DWORD n)
+    {
+        std::string strValue(12 + n % 180, '\0');
+        memcpy(&strValue[0], &ullKey, sizeof(ullKey));
+        memcpy(&strValue[8], &n, sizeof(n));
+        for (size_t i = 12; i < strValue.size(); i++)
+        {
+            strValue[i] = static_cast<char>(n * 31 + i + ullKey);
+        }
+        return strValue;
+    }
+
+    // Writers on one view and readers on another hammer a table with more keys than slots.
+    void TestTornReads()
+    {
+        const char *pszTest = "TornReads";
+        const DWORD c_cWriters = 2;
+        const DWORD c_cReaders = 2;
+        const DWORD c_cWrites = 100000;
+        CSharedTable *pWriterView = OpenTable(L"hammer", 4, 200);
+        CSharedTable *pReaderView = OpenTable(L"hammer", 4, 200);
+        if (pWriterView == nullptr || pReaderView == nullptr)
+        {
+            Check(false, pszTest, "open twice");
+            return;
+        }
+
+        std::atomic<DWORD> cWritersDone(0);
+        std::atomic<DWORD> cWrites(0);
+        std::atomic<DWORD> cReads(0);
+        std::atomic<DWORD> cTorn(0);
+        std::vector<std::thread> vecThreads;
+        for (DWORD iWriter = 0; iWriter < c_cWriters; iWriter++)
+        {
+            vecThreads.emplace_back([&, iWriter]()
+            {
+                ULONGLONG ullExpires = In(3600);
+                for (DWORD n = iWriter; n < c_cWrites; n += c_cWriters)
+                {
+                    ULONGLONG ullKey = 1 + n % 6;
+                    cWrites += Put(pWriterView, ullKey, Stamp(ullKey, n), ullExpires) ? 1 : 0;
+                }
+                cWritersDone++;
+            });
+        }
+        for (DWORD iReader = 0; iReader < c_cReaders; iReader++)
+        {
+            vecThreads.emplace_back([&]()
+            {
+                char rgch[200];
+                for (DWORD n = 0; cWritersDone < c_cWriters; n++)
+                {
+                    ULONGLONG ullKey = 1 + n % 6;
+                    DWORD cbValue;
+                    if (pReaderView->Read(ullKey, rgch, sizeof(rgch), &cbValue, nullptr))
+                    {
+                        DWORD nStamp = 0;
+                        if (cbValue >= 12)
+                        {
+                            memcpy(&nStamp, rgch + 8, sizeof(nStamp));
+                        }
+                        cTorn += (cbValue < 12 || std::string(rgch, cbValue) != Stamp(ullKey, nStamp)) ? 1 : 0;
+                        cReads++;
+                    }
+                }
+            });
+        }
+        for (std::thread &thread : vecThreads)
+        {
+            thread.join();
+        }
+
+        Check(cTorn == 0, pszTest, "no reader sees a torn value");
+        Check(cWrites > c_cWrites / 2, pszTest, "most writes go through");
+        Check(cReads > 0, pszTest, "readers find entries while writers run");
+        pWriterView->Release();
+        pReaderView->Release();
+    }
+
+    // Several views insert the same new key at once, round after round.
+    void TestInsertRace()
+    {
+        const char *pszTest = "InsertRace";
+        const DWORD c_cInserters = 4;
+        const DWORD c_cRounds = 2000;
+        std::vector<CSharedTable *> vecViews;
+        for (DWORD i = 0; i < c_cInserters; i++)
+        {
+            CSharedTable *pView = OpenTable(L"race", 16, 64);
+            if (pView == nullptr)
+            {
+                Check(false, pszTest, "open");
+                return;
+            }
+            vecViews.push_back(pView);
+        }
+
+        std::atomic<DWORD> iRound(0);
+        std::atomic<DWORD> cDone(0);
+        std::atomic<DWORD> cWins(0);
+        std::vector<std::thread> vecThreads;
+        for (DWORD iInserter = 0; iInserter < c_cInserters; iInserter++)
+        {
+            vecThreads.emplace_back([&, iInserter]()
+            {
+                for (DWORD i = 1; i <= c_cRounds; i++)
+                {
+                    while (iRound < i)
+                    {
+                        std::this_thread::yield();
+                    }
+                    cWins += Add(vecViews[iInserter], i, Stamp(i, iInserter), In(3600)) ? 1 : 0;
+                    cDone++;
+                }
+            });
+        }
+
+        DWORD cRoundsWithOneWinner = 0;
+        DWORD cRoundsReadBack = 0;
+        char rgch[64];
+        for (DWORD i = 1; i <= c_cRounds; i++)
+        {
+            cWins = 0;
+            iRound = i;
+            while (cDone < i * c_cInserters)
+            {
+                std::this_thread::yield();
+            }
+            cRoundsWithOneWinner += (cWins == 1) ? 1 : 0;
+
+            DWORD cbValue;
+            DWORD nWinner = 0;
+            if (vecViews[0]->Read(i, rgch, sizeof(rgch), &cbValue, nullptr) && cbValue >= 12)
+            {
+                memcpy(&nWinner, rgch + 8, sizeof(nWinner));
+                cRoundsReadBack += (std::string(rgch, cbValue) == Stamp(i, nWinner)) ? 1 : 0;
+            }
+        }
+        for (std::thread &thread : vecThreads)
+        {
+            thread.join();
+        }
+
+        Check(cRoundsWithOneWinner == c_cRounds, pszTest, "exactly one insert of a key wins");
+        Check(cRoundsReadBack == c_cRounds, pszTest, "and the key reads back as the winner's value");
+        for (CSharedTable *pView : vecViews)
+        {
+            pView->Release();
+        }
+    }
+}
+
+void DllAddRef()
+{
+    InterlockedIncrement(&s_cDllRefs);
+}
+
+void DllRelease()
+{
+    InterlockedDecrement(&s_cDllRefs);
+}
+
+int main()
+{
+    char szRoot[] = "/tmp/sharedtable_test.XXXXXX";
+    if (mkdtemp(szRoot) == nullptr)
+    {
+        fprintf(stderr, "cannot create a scratch directory\n");
+        return 2;
+    }
+    ShimFileRoot() = szRoot;
+
+    TestPrivateTable();
+    TestProbing();
+    TestRandom();
+    TestSharedSection();
+    TestStuckSlot();
+    TestTornReads();
+    TestInsertRace();
+
+    Check(s_cDllRefs == 0, "Main", "every table is released");
+
+    for (PCWSTR pszName : { L"shared", L"stuck", L"hammer", L"race" })
+    {
+        DeleteFileW((std::wstring(L"C:\\Global.sqcp.") + pszName).c_str());
+    }
+    rmdir(szRoot);
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <windows.h>
+#include <ntsecapi.h>
+
+// There is no directory here: Authz cannot build a context for anyone, so code that expands
+// group membership through it always gets ERROR_NOT_SUPPORTED. Tests install their own resolver.
+
+typedef struct _SID_AND_ATTRIBUTES
+{
+    PSID    Sid;
+    DWORD   Attributes;
+} SID_AND_ATTRIBUTES;
+
+typedef struct _TOKEN_GROUPS
+{
+    DWORD               GroupCount;
+    SID_AND_ATTRIBUTES  Groups[1];
+} TOKEN_GROUPS;
+
+typedef void *AUTHZ_RESOURCE_MANAGER_HANDLE;
+typedef void *AUTHZ_CLIENT_CONTEXT_HANDLE;
+
+#define AUTHZ_RM_FLAG_NO_AUDIT  0x1
+#define ERROR_NOT_SUPPORTED     50L
+
+enum AUTHZ_CONTEXT_INFORMATION_CLASS
+{
+    AuthzContextInfoGroupsSids = 2,
+};
+
+inline BOOL AuthzInitializeResourceManager(DWORD, PVOID, PVOID, PVOID, PCWSTR, AUTHZ_RESOURCE_MANAGER_HANDLE *phResourceManager)
+{
+    *phResourceManager = nullptr;
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+inline BOOL AuthzInitializeContextFromSid(DWORD, PSID, AUTHZ_RESOURCE_MANAGER_HANDLE, PLARGE_INTEGER, LUID, PVOID, AUTHZ_CLIENT_CONTEXT_HANDLE *phContext)
+{
+    *phContext = nullptr;
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+inline BOOL AuthzGetInformationFromContext(AUTHZ_CLIENT_CONTEXT_HANDLE, AUTHZ_CONTEXT_INFORMATION_CLASS, DWORD, PDWORD pcbSize, PVOID)
+{
+    *pcbSize = 0;
+    SetLastError(ERROR_NOT_SUPPORTED);
+    return FALSE;
+}
+
+inline BOOL AuthzFreeContext(AUTHZ_CLIENT_CONTEXT_HANDLE)
+{
+    return TRUE;
+}
+
+inline BOOL AuthzFreeResourceManager(AUTHZ_RESOURCE_MANAGER_HANDLE)
+{
+    return TRUE;
+}
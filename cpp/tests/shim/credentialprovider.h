@@ -0,0 +1,188 @@
+#pragma once
+
+#include <windows.h>
+#include <unknwn.h>
+#include <propkey.h>
+
+// The parts of credentialprovider.h that the sources declare against. Of the user array and
+// user interfaces, only the methods the sources call are declared.
+
+// MSVC accepts the string literals common.h puts in LPWSTR field labels, and the {0} that ends
+// a QITAB or a field descriptor left without its GUID; g++ would reject them in every file that
+// includes this.
+#pragma GCC diagnostic ignored "-Wwrite-strings"
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+
+typedef void *HBITMAP;
+
+enum CREDENTIAL_PROVIDER_USAGE_SCENARIO
+{
+    CPUS_INVALID = 0,
+    CPUS_LOGON,
+    CPUS_UNLOCK_WORKSTATION,
+    CPUS_CHANGE_PASSWORD,
+    CPUS_CREDUI,
+    CPUS_PLAP,
+};
+
+enum CREDENTIAL_PROVIDER_FIELD_TYPE
+{
+    CPFT_INVALID = 0,
+    CPFT_LARGE_TEXT,
+    CPFT_SMALL_TEXT,
+    CPFT_COMMAND_LINK,
+    CPFT_EDIT_TEXT,
+    CPFT_PASSWORD_TEXT,
+    CPFT_TILE_IMAGE,
+    CPFT_CHECKBOX,
+    CPFT_COMBOBOX,
+    CPFT_SUBMIT_BUTTON,
+};
+
+enum CREDENTIAL_PROVIDER_FIELD_STATE
+{
+    CPFS_HIDDEN = 0,
+    CPFS_DISPLAY_IN_SELECTED_TILE,
+    CPFS_DISPLAY_IN_DESELECTED_TILE,
+    CPFS_DISPLAY_IN_BOTH,
+};
+
+enum CREDENTIAL_PROVIDER_FIELD_INTERACTIVE_STATE
+{
+    CPFIS_NONE = 0,
+    CPFIS_READONLY,
+    CPFIS_DISABLED,
+    CPFIS_FOCUSED,
+};
+
+enum CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE
+{
+    CPGSR_NO_CREDENTIAL_NOT_FINISHED = 0,
+    CPGSR_NO_CREDENTIAL_FINISHED,
+    CPGSR_RETURN_CREDENTIAL_FINISHED,
+    CPGSR_RETURN_NO_CREDENTIAL_FINISHED,
+};
+
+enum CREDENTIAL_PROVIDER_STATUS_ICON
+{
+    CPSI_NONE = 0,
+    CPSI_ERROR,
+    CPSI_WARNING,
+    CPSI_SUCCESS,
+};
+
+enum CREDENTIAL_PROVIDER_CREDENTIAL_FIELD_OPTIONS
+{
+    CPCFO_NONE = 0,
+    CPCFO_ENABLE_PASSWORD_REVEAL = 0x1,
+    CPCFO_IS_EMAIL_ADDRESS = 0x2,
+    CPCFO_ENABLE_TOUCH_KEYBOARD_AUTO_INVOKE = 0x4,
+    CPCFO_NUMBERS_ONLY = 0x8,
+    CPCFO_SHOW_ENGLISH_KEYBOARD = 0x10,
+};
+
+struct CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR
+{
+    DWORD                           dwFieldID;
+    CREDENTIAL_PROVIDER_FIELD_TYPE  cpft;
+    LPWSTR                          pszLabel;
+    GUID                            guidFieldType;
+};
+
+struct CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION
+{
+    ULONG   ulAuthenticationPackage;
+    CLSID   clsidCredentialProvider;
+    ULONG   cbSerialization;
+    BYTE    *rgbSerialization;
+};
+
+#define CREDENTIAL_PROVIDER_NO_DEFAULT  ((DWORD)-1)
+
+static const GUID CPFG_CREDENTIAL_PROVIDER_LOGO = { 0x2d837775, 0xf6cd, 0x464e, { 0xa7, 0x45, 0x48, 0x2f, 0xd0, 0xb4, 0x74, 0x93 } };
+static const GUID CPFG_CREDENTIAL_PROVIDER_LABEL = { 0x286bbff3, 0xbad4, 0x438f, { 0xb0, 0x07, 0x79, 0xb7, 0x26, 0x7c, 0x3d, 0x48 } };
+
+struct ICredentialProviderCredentialEvents;
+struct ICredentialProviderCredentialEvents2;
+
+struct ICredentialProviderEvents : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE CredentialsChanged(UINT_PTR upAdviseContext) = 0;
+};
+
+struct ICredentialProviderCredential : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE Advise(ICredentialProviderCredentialEvents *pcpce) = 0;
+    virtual HRESULT STDMETHODCALLTYPE UnAdvise() = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetSelected(BOOL *pbAutoLogon) = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetDeselected() = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetFieldState(DWORD dwFieldID, CREDENTIAL_PROVIDER_FIELD_STATE *pcpfs, CREDENTIAL_PROVIDER_FIELD_INTERACTIVE_STATE *pcpfis) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetStringValue(DWORD dwFieldID, PWSTR *ppwsz) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetBitmapValue(DWORD dwFieldID, HBITMAP *phbmp) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetCheckboxValue(DWORD dwFieldID, BOOL *pbChecked, PWSTR *ppwszLabel) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetSubmitButtonValue(DWORD dwFieldID, DWORD *pdwAdjacentTo) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetComboBoxValueCount(DWORD dwFieldID, DWORD *pcItems, DWORD *pdwSelectedItem) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetComboBoxValueAt(DWORD dwFieldID, DWORD dwItem, PWSTR *ppwszItem) = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetStringValue(DWORD dwFieldID, PCWSTR pwz) = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetCheckboxValue(DWORD dwFieldID, BOOL bChecked) = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetComboBoxSelectedValue(DWORD dwFieldID, DWORD dwSelectedItem) = 0;
+    virtual HRESULT STDMETHODCALLTYPE CommandLinkClicked(DWORD dwFieldID) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetSerialization(CREDENTIAL_PROVIDER_GET_SERIALIZATION_RESPONSE *pcpgsr,
+                                                       CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION *pcpcs,
+                                                       PWSTR *ppwszOptionalStatusText,
+                                                       CREDENTIAL_PROVIDER_STATUS_ICON *pcpsiOptionalStatusIcon) = 0;
+    virtual HRESULT STDMETHODCALLTYPE ReportResult(NTSTATUS ntsStatus,
+                                                   NTSTATUS ntsSubstatus,
+                                                   PWSTR *ppwszOptionalStatusText,
+                                                   CREDENTIAL_PROVIDER_STATUS_ICON *pcpsiOptionalStatusIcon) = 0;
+};
+
+struct ICredentialProviderCredential2 : ICredentialProviderCredential
+{
+    virtual HRESULT STDMETHODCALLTYPE GetUserSid(PWSTR *ppszSid) = 0;
+};
+
+struct ICredentialProviderCredentialWithFieldOptions : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE GetFieldOptions(DWORD dwFieldID, CREDENTIAL_PROVIDER_CREDENTIAL_FIELD_OPTIONS *pcpcfo) = 0;
+};
+
+struct ICredentialProviderUser : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE GetSid(PWSTR *ppszSid) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetProviderID(GUID *pguidProviderID) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetStringValue(REFPROPERTYKEY key, PWSTR *ppszValue) = 0;
+};
+
+struct ICredentialProviderUserArray : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE GetCount(DWORD *pdwUserCount) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetAt(DWORD dwIndex, ICredentialProviderUser **ppUser) = 0;
+};
+
+struct ICredentialProvider : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE SetUsageScenario(CREDENTIAL_PROVIDER_USAGE_SCENARIO cpus, DWORD dwFlags) = 0;
+    virtual HRESULT STDMETHODCALLTYPE SetSerialization(CREDENTIAL_PROVIDER_CREDENTIAL_SERIALIZATION const *pcpcs) = 0;
+    virtual HRESULT STDMETHODCALLTYPE Advise(ICredentialProviderEvents *pcpe, UINT_PTR upAdviseContext) = 0;
+    virtual HRESULT STDMETHODCALLTYPE UnAdvise() = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetFieldDescriptorCount(DWORD *pdwCount) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetFieldDescriptorAt(DWORD dwIndex, CREDENTIAL_PROVIDER_FIELD_DESCRIPTOR **ppcpfd) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetCredentialCount(DWORD *pdwCount, DWORD *pdwDefault, BOOL *pbAutoLogonWithDefault) = 0;
+    virtual HRESULT STDMETHODCALLTYPE GetCredentialAt(DWORD dwIndex, ICredentialProviderCredential **ppcpc) = 0;
+};
+
+struct ICredentialProviderSetUserArray : IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE SetUserArray(ICredentialProviderUserArray *users) = 0;
+};
+
+// The IIDs only need to be distinct from each other here.
+SHIM_DECLARE_IID(ICredentialProviderEvents, 0x34201e5a, 0xa787, 0x41a3, 0xa5, 0xa4, 0xbd, 0x6d, 0xcf, 0x2a, 0x85, 0x4e);
+SHIM_DECLARE_IID(ICredentialProviderCredential, 0x63913a93, 0x40c1, 0x481a, 0x81, 0x8d, 0x40, 0x72, 0xff, 0x8c, 0x70, 0xcc);
+SHIM_DECLARE_IID(ICredentialProviderCredential2, 0xfd672c54, 0x40ea, 0x4d6e, 0x9b, 0x49, 0xcf, 0xb1, 0xa7, 0x50, 0x7b, 0xd7);
+SHIM_DECLARE_IID(ICredentialProviderCredentialWithFieldOptions, 0xdbc6fb30, 0xc843, 0x49e3, 0xa6, 0x45, 0x57, 0x3e, 0x6f, 0x39, 0x44, 0x6a);
+SHIM_DECLARE_IID(ICredentialProviderUser, 0x13793285, 0x3ea6, 0x40fd, 0xb4, 0x20, 0x15, 0xf4, 0x7d, 0xa4, 0x1f, 0xbb);
+SHIM_DECLARE_IID(ICredentialProviderUserArray, 0x90c119ae, 0x0f18, 0x4520, 0xa1, 0xf1, 0x11, 0x43, 0x66, 0xa4, 0x0f, 0xe8);
+SHIM_DECLARE_IID(ICredentialProvider, 0xd27c3481, 0x5a1c, 0x45b2, 0x8a, 0xaa, 0xc2, 0x0e, 0xbb, 0xe8, 0x22, 0x9e);
+SHIM_DECLARE_IID(ICredentialProviderSetUserArray, 0x095c1484, 0x1c0c, 0x4388, 0x9c, 0x6d, 0x50, 0x0e, 0x61, 0xbf, 0x84, 0xbd);
@@ -0,0 +1,4 @@
+#pragma once
+
+// The sources include "dll.h"; the file is Dll.h, and Linux file names are case-sensitive.
+#include "../../Dll.h"
@@ -0,0 +1,13 @@
+#pragma once
+
+// The MSVC intrinsics otpresponse.cpp uses, for gcc and clang. See shim/windows.h.
+
+inline unsigned char _BitScanForward(unsigned long *pIndex, unsigned long ulMask)
+{
+    if (ulMask == 0)
+    {
+        return 0;
+    }
+    *pIndex = static_cast<unsigned long>(__builtin_ctzl(ulMask));
+    return 1;
+}
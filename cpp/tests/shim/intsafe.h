@@ -0,0 +1,5 @@
+#pragma once
+
+#include <windows.h>
+
+// Nothing from intsafe.h is needed by the sources built against this shim.
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <windows.h>
+
+// Address change notifications without an IP stack. A NotifyAddrChange request stays pending
+// until a test calls ShimChangeAddress, which completes every pending request once, the way a
+// real address change does; CancelIPChangeNotify withdraws one.
+
+#define ERROR_IO_PENDING        997L
+
+inline std::vector<OVERLAPPED *> &ShimAddrChangeRequests()
+{
+    static std::vector<OVERLAPPED *> s_vecRequests;
+    return s_vecRequests;
+}
+
+inline std::mutex &ShimAddrChangeMutex()
+{
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+
+inline DWORD NotifyAddrChange(HANDLE *phHandle, OVERLAPPED *pOverlapped)
+{
+    std::lock_guard<std::mutex> lock(ShimAddrChangeMutex());
+    std::vector<OVERLAPPED *> &vecRequests = ShimAddrChangeRequests();
+    if (std::find(vecRequests.begin(), vecRequests.end(), pOverlapped) == vecRequests.end())
+    {
+        vecRequests.push_back(pOverlapped);
+    }
+    *phHandle = pOverlapped->hEvent;
+    return ERROR_IO_PENDING;
+}
+
+inline BOOL CancelIPChangeNotify(OVERLAPPED *pOverlapped)
+{
+    std::lock_guard<std::mutex> lock(ShimAddrChangeMutex());
+    std::vector<OVERLAPPED *> &vecRequests = ShimAddrChangeRequests();
+    auto it = std::find(vecRequests.begin(), vecRequests.end(), pOverlapped);
+    if (it == vecRequests.end())
+    {
+        SetLastError(ERROR_NOT_FOUND);
+        return FALSE;
+    }
+    vecRequests.erase(it);
+    return TRUE;
+}
+
+// Completes the pending requests and returns how many there were.
+inline size_t ShimChangeAddress()
+{
+    std::lock_guard<std::mutex> lock(ShimAddrChangeMutex());
+    std::vector<OVERLAPPED *> vecRequests;
+    vecRequests.swap(ShimAddrChangeRequests());
+    for (OVERLAPPED *pOverlapped : vecRequests)
+    {
+        SetEvent(pOverlapped->hEvent);
+    }
+    return vecRequests.size();
+}
+
+// Requests still pending.
+inline size_t ShimPendingAddrChanges()
+{
+    std::lock_guard<std::mutex> lock(ShimAddrChangeMutex());
+    return ShimAddrChangeRequests().size();
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <windows.h>
+
+// The parts of ntsecapi.h that helpers.h declares against.
+
+typedef struct _UNICODE_STRING
+{
+    USHORT  Length;
+    USHORT  MaximumLength;
+    PWSTR   Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef struct _LUID
+{
+    DWORD   LowPart;
+    LONG    HighPart;
+} LUID;
+
+enum KERB_LOGON_SUBMIT_TYPE
+{
+    KerbInteractiveLogon = 2,
+    KerbWorkstationUnlockLogon = 7,
+};
+
+typedef struct _KERB_INTERACTIVE_LOGON
+{
+    KERB_LOGON_SUBMIT_TYPE  MessageType;
+    UNICODE_STRING          LogonDomainName;
+    UNICODE_STRING          UserName;
+    UNICODE_STRING          Password;
+} KERB_INTERACTIVE_LOGON;
+
+typedef struct _KERB_INTERACTIVE_UNLOCK_LOGON
+{
+    KERB_INTERACTIVE_LOGON  Logon;
+    LUID                    LogonId;
+} KERB_INTERACTIVE_UNLOCK_LOGON;
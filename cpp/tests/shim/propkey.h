@@ -0,0 +1,20 @@
+#pragma once
+
+#include <windows.h>
+
+// The identity property keys read from ICredentialProviderUser.
+
+struct PROPERTYKEY
+{
+    GUID    fmtid;
+    DWORD   pid;
+};
+typedef const PROPERTYKEY &REFPROPERTYKEY;
+
+inline bool IsEqualPropertyKey(REFPROPERTYKEY a, REFPROPERTYKEY b)
+{
+    return IsEqualGUID(a.fmtid, b.fmtid) && a.pid == b.pid;
+}
+
+static const PROPERTYKEY PKEY_Identity_DisplayName = { { 0x7d683fc9, 0xd155, 0x45a8, { 0xbb, 0x1f, 0x89, 0xd1, 0x9b, 0xcb, 0x79, 0x2f } }, 100 };
+static const PROPERTYKEY PKEY_Identity_QualifiedUserName = { { 0xda520e51, 0xf4e9, 0x4739, { 0xac, 0x82, 0x02, 0xe0, 0xa9, 0x5c, 0x90, 0x30 } }, 100 };
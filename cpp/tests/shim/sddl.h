@@ -0,0 +1,94 @@
+#pragma once
+
+#include <windows.h>
+
+// Only the S-R-I-S... form; the two-letter aliases such as BA are not supported.
+inline BOOL ConvertStringSidToSidW(PCWSTR pszSid, PSID *ppsid)
+{
+    *ppsid = nullptr;
+    ULONGLONG rgull[2 + SID_MAX_SUB_AUTHORITIES];
+    DWORD cParts = 0;
+    if ((pszSid[0] != L'S' && pszSid[0] != L's') || pszSid[1] != L'-')
+    {
+        SetLastError(ERROR_INVALID_SID);
+        return FALSE;
+    }
+    for (PCWSTR pch = pszSid + 2;; pch++)
+    {
+        if (cParts == ARRAYSIZE(rgull) || !iswdigit(*pch))
+        {
+            SetLastError(ERROR_INVALID_SID);
+            return FALSE;
+        }
+        ULONGLONG ullPart = 0;
+        for (; iswdigit(*pch); pch++)
+        {
+            ullPart = ullPart * 10 + static_cast<ULONGLONG>(*pch - L'0');
+            if (ullPart > 0xFFFFFFFFFFFFull)
+            {
+                SetLastError(ERROR_INVALID_SID);
+                return FALSE;
+            }
+        }
+        rgull[cParts++] = ullPart;
+        if (*pch == L'\0')
+        {
+            break;
+        }
+        if (*pch != L'-')
+        {
+            SetLastError(ERROR_INVALID_SID);
+            return FALSE;
+        }
+    }
+    if (cParts < 2 || rgull[0] != 1)
+    {
+        SetLastError(ERROR_INVALID_SID);
+        return FALSE;
+    }
+    for (DWORD i = 2; i < cParts; i++)
+    {
+        if (rgull[i] > 0xFFFFFFFFull)
+        {
+            SetLastError(ERROR_INVALID_SID);
+            return FALSE;
+        }
+    }
+
+    BYTE *pb = static_cast<BYTE *>(LocalAlloc(LPTR, 8 + 4 * (cParts - 2)));
+    pb[0] = 1;
+    pb[1] = static_cast<BYTE>(cParts - 2);
+    for (int i = 0; i < 6; i++)
+    {
+        pb[2 + i] = static_cast<BYTE>(rgull[1] >> (8 * (5 - i)));
+    }
+    for (DWORD i = 2; i < cParts; i++)
+    {
+        DWORD dwSubAuthority = static_cast<DWORD>(rgull[i]);
+        memcpy(pb + 8 + 4 * (i - 2), &dwSubAuthority, sizeof(dwSubAuthority));
+    }
+    *ppsid = pb;
+    return TRUE;
+}
+
+#define SDDL_REVISION_1         1
+
+// Nothing here enforces a DACL (see ShimRestrictedProcess), so the descriptor is only checked
+// for being there and handed back as an opaque LocalAlloc block.
+inline BOOL ConvertStringSecurityDescriptorToSecurityDescriptorW(PCWSTR pszSddl, DWORD dwRevision, PSECURITY_DESCRIPTOR *ppsd, ULONG *pcbsd)
+{
+    *ppsd = nullptr;
+    if (pszSddl == nullptr || pszSddl[0] == L'\0' || dwRevision != SDDL_REVISION_1)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    size_t cb = (wcslen(pszSddl) + 1) * sizeof(wchar_t);
+    *ppsd = LocalAlloc(LPTR, cb);
+    memcpy(*ppsd, pszSddl, cb);
+    if (pcbsd != nullptr)
+    {
+        *pcbsd = static_cast<ULONG>(cb);
+    }
+    return TRUE;
+}
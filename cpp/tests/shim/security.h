@@ -0,0 +1,5 @@
+#pragma once
+
+#include <windows.h>
+
+// Nothing from security.h is needed by the sources built against this shim.
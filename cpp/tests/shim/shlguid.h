@@ -0,0 +1,5 @@
+#pragma once
+
+#include <windows.h>
+
+// Nothing from shlguid.h is needed by the sources built against this shim.
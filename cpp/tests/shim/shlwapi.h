@@ -0,0 +1,33 @@
+#pragma once
+
+#include <windows.h>
+#include <unknwn.h>
+
+// QISearch and the table it walks, for the CComObject classes.
+
+struct QITAB
+{
+    const IID   *piid;
+    DWORD       dwOffset;
+};
+
+#define OFFSETOFCLASS(base, derived) \
+    (static_cast<DWORD>(reinterpret_cast<DWORD_PTR>(static_cast<base *>(reinterpret_cast<derived *>(8)))) - 8)
+#define QITABENT(Cthis, Ifoo)   { &IID_##Ifoo, OFFSETOFCLASS(Ifoo, Cthis) }
+
+// IID_IUnknown gets the first entry, as in Windows.
+inline HRESULT QISearch(void *that, const QITAB *pqit, REFIID riid, void **ppv)
+{
+    *ppv = nullptr;
+    for (const QITAB *pEntry = pqit; pEntry->piid != nullptr; pEntry++)
+    {
+        if (IsEqualGUID(riid, *pEntry->piid) || (pEntry == pqit && IsEqualGUID(riid, IID_IUnknown)))
+        {
+            IUnknown *punk = reinterpret_cast<IUnknown *>(static_cast<BYTE *>(that) + pEntry->dwOffset);
+            punk->AddRef();
+            *ppv = punk;
+            return S_OK;
+        }
+    }
+    return E_NOINTERFACE;
+}
@@ -0,0 +1,150 @@
+#pragma once
+
+#include <windows.h>
+
+// The StringCch* functions the provider uses, with their truncation and failure behavior.
+
+#define STRSAFE_E_INSUFFICIENT_BUFFER   ((HRESULT)0x8007007A)
+#define STRSAFE_E_INVALID_PARAMETER     ((HRESULT)0x80070057)
+#define STRSAFE_MAX_CCH                 2147483647
+
+inline HRESULT StringCchLengthW(PCWSTR psz, size_t cchMax, size_t *pcch)
+{
+    if (psz == nullptr || cchMax == 0 || cchMax > STRSAFE_MAX_CCH)
+    {
+        return STRSAFE_E_INVALID_PARAMETER;
+    }
+    size_t cch = 0;
+    while (cch < cchMax && psz[cch] != L'\0')
+    {
+        cch++;
+    }
+    if (cch == cchMax)
+    {
+        return STRSAFE_E_INVALID_PARAMETER;
+    }
+    if (pcch != nullptr)
+    {
+        *pcch = cch;
+    }
+    return S_OK;
+}
+
+inline HRESULT StringCchCopyNW(PWSTR pszDest, size_t cchDest, PCWSTR pszSrc, size_t cchToCopy)
+{
+    if (cchDest == 0 || cchDest > STRSAFE_MAX_CCH)
+    {
+        return STRSAFE_E_INVALID_PARAMETER;
+    }
+    size_t i = 0;
+    while (i < cchToCopy && pszSrc[i] != L'\0')
+    {
+        if (i == cchDest - 1)
+        {
+            pszDest[i] = L'\0';
+            return STRSAFE_E_INSUFFICIENT_BUFFER;
+        }
+        pszDest[i] = pszSrc[i];
+        i++;
+    }
+    pszDest[i] = L'\0';
+    return S_OK;
+}
+
+inline HRESULT StringCchCopyW(PWSTR pszDest, size_t cchDest, PCWSTR pszSrc)
+{
+    return StringCchCopyNW(pszDest, cchDest, pszSrc, STRSAFE_MAX_CCH);
+}
+
+inline HRESULT StringCchCatNW(PWSTR pszDest, size_t cchDest, PCWSTR pszSrc, size_t cchToAppend)
+{
+    size_t cch;
+    HRESULT hr = StringCchLengthW(pszDest, cchDest, &cch);
+    return SUCCEEDED(hr) ? StringCchCopyNW(pszDest + cch, cchDest - cch, pszSrc, cchToAppend) : hr;
+}
+
+inline HRESULT StringCchCatW(PWSTR pszDest, size_t cchDest, PCWSTR pszSrc)
+{
+    return StringCchCatNW(pszDest, cchDest, pszSrc, STRSAFE_MAX_CCH);
+}
+
+// %s and %c take wide arguments in the Microsoft wide printf family; glibc wants %ls and %lc.
+inline HRESULT StringCchVPrintfW(PWSTR pszDest, size_t cchDest, PCWSTR pszFormat, va_list args)
+{
+    if (cchDest == 0 || cchDest > STRSAFE_MAX_CCH)
+    {
+        return STRSAFE_E_INVALID_PARAMETER;
+    }
+    wchar_t szFormat[512];
+    size_t cchFormat = 0;
+    for (PCWSTR psz = pszFormat; *psz != L'\0' && cchFormat < ARRAYSIZE(szFormat) - 2; psz++)
+    {
+        szFormat[cchFormat++] = *psz;
+        if (*psz == L'%')
+        {
+            PCWSTR pszSpec = psz + 1;
+            while (wcschr(L"-+ #0123456789.*", *pszSpec) != nullptr && *pszSpec != L'\0')
+            {
+                pszSpec++;
+            }
+            if ((*pszSpec == L's' || *pszSpec == L'c') && pszSpec[-1] != L'l')
+            {
+                while (psz + 1 < pszSpec && cchFormat < ARRAYSIZE(szFormat) - 2)
+                {
+                    szFormat[cchFormat++] = *++psz;
+                }
+                szFormat[cchFormat++] = L'l';
+            }
+            else if (*pszSpec == L'%')
+            {
+                szFormat[cchFormat++] = *++psz;
+            }
+            else if (wcsncmp(pszSpec, L"I64", 3) == 0 && cchFormat < ARRAYSIZE(szFormat) - 3)
+            {
+                while (psz + 1 < pszSpec && cchFormat < ARRAYSIZE(szFormat) - 3)
+                {
+                    szFormat[cchFormat++] = *++psz;
+                }
+                szFormat[cchFormat++] = L'l';
+                szFormat[cchFormat++] = L'l';
+                psz = pszSpec + 2;
+            }
+        }
+    }
+    szFormat[cchFormat] = L'\0';
+
+    int cch = vswprintf(pszDest, cchDest, szFormat, args);
+    if (cch < 0 || static_cast<size_t>(cch) >= cchDest)
+    {
+        pszDest[cchDest - 1] = L'\0';
+        return STRSAFE_E_INSUFFICIENT_BUFFER;
+    }
+    return S_OK;
+}
+
+inline HRESULT StringCchPrintfW(PWSTR pszDest, size_t cchDest, PCWSTR pszFormat, ...)
+{
+    va_list args;
+    va_start(args, pszFormat);
+    HRESULT hr = StringCchVPrintfW(pszDest, cchDest, pszFormat, args);
+    va_end(args);
+    return hr;
+}
+
+inline HRESULT StringCchPrintfA(PSTR pszDest, size_t cchDest, PCSTR pszFormat, ...)
+{
+    if (cchDest == 0 || cchDest > STRSAFE_MAX_CCH)
+    {
+        return STRSAFE_E_INVALID_PARAMETER;
+    }
+    va_list args;
+    va_start(args, pszFormat);
+    int cch = vsnprintf(pszDest, cchDest, pszFormat, args);
+    va_end(args);
+    if (cch < 0 || static_cast<size_t>(cch) >= cchDest)
+    {
+        pszDest[cchDest - 1] = '\0';
+        return STRSAFE_E_INSUFFICIENT_BUFFER;
+    }
+    return S_OK;
+}
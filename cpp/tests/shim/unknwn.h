@@ -0,0 +1,33 @@
+#pragma once
+
+#include <windows.h>
+
+// The IUnknown vtable, plus what the sources use to name an interface's IID: IID_PPV_ARGS reads
+// it from the SHIM_IID specialization the shim header declaring the interface provides.
+
+#define IFACEMETHODIMP          __override HRESULT STDMETHODCALLTYPE
+#define IFACEMETHODIMP_(type)   __override type STDMETHODCALLTYPE
+#define _COM_Outptr_
+
+static const IID IID_IUnknown = { 0x00000000, 0x0000, 0x0000, { 0xc0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x46 } };
+
+struct IUnknown
+{
+    virtual HRESULT STDMETHODCALLTYPE QueryInterface(REFIID riid, void **ppv) = 0;
+    virtual ULONG STDMETHODCALLTYPE AddRef() = 0;
+    virtual ULONG STDMETHODCALLTYPE Release() = 0;
+};
+
+template <class T> struct SHIM_IID;
+
+#define SHIM_DECLARE_IID(I, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    static const IID IID_##I = { l, w1, w2, { b1, b2, b3, b4, b5, b6, b7, b8 } }; \
+    template <> struct SHIM_IID<struct I> { static REFIID Get() { return IID_##I; } }
+
+template <class T>
+inline REFIID ShimIidOf(T **)
+{
+    return SHIM_IID<T>::Get();
+}
+
+#define IID_PPV_ARGS(pp)        ShimIidOf(pp), reinterpret_cast<void **>(pp)
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <windows.h>
+
+#define CRED_MAX_USERNAME_LENGTH        (256 + 1 + 256)
+#define CREDUI_MAX_USERNAME_LENGTH      CRED_MAX_USERNAME_LENGTH
+#define CREDUI_MAX_PASSWORD_LENGTH      (512 / 2)
+#define CREDUI_MAX_DOMAIN_TARGET_LENGTH (256 + 1 + 80)
+
+// No serialization is ever unpacked by the tests built against this shim.
+inline BOOL CredUnPackAuthenticationBufferW(DWORD, PVOID, DWORD, LPWSTR, DWORD *, LPWSTR, DWORD *, LPWSTR, DWORD *)
+{
+    SetLastError(ERROR_INVALID_PARAMETER);
+    return FALSE;
+}
@@ -0,0 +1,1374 @@
+#pragma once
+
+// Just enough of windows.h for the portable parts of the provider to build with gcc or clang on
+// Linux, so the harnesses under tests/ can run them under the sanitizers. Only what those
+// sources use is here, and only with the behavior they rely on: handles are events, threads,
+// files and file mappings, and the thread pool is a thread per work item.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <wctype.h>
+#include <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Types.
+
+typedef uint8_t         BYTE;
+typedef uint8_t         UCHAR;
+typedef uint8_t         BOOLEAN;
+typedef uint16_t        WORD;
+typedef uint16_t        USHORT;
+typedef uint32_t        DWORD;
+typedef uint32_t        ULONG;
+typedef uint32_t        UINT;
+typedef int32_t         INT;
+typedef int32_t         BOOL;
+typedef long            LONG;
+typedef int64_t         LONGLONG;
+typedef int64_t         LONG64;
+typedef uint64_t        ULONGLONG;
+typedef uint64_t        DWORD64;
+typedef uintptr_t       ULONG_PTR;
+typedef uintptr_t       UINT_PTR;
+typedef uintptr_t       DWORD_PTR;
+typedef intptr_t        LONG_PTR;
+typedef size_t          SIZE_T;
+typedef int32_t         HRESULT;
+typedef int32_t         NTSTATUS;
+typedef char            CHAR;
+typedef wchar_t         WCHAR;
+typedef char            *PSTR;
+typedef const char      *PCSTR;
+typedef wchar_t         *PWSTR;
+typedef wchar_t         *LPWSTR;
+typedef const wchar_t   *PCWSTR;
+typedef const wchar_t   *LPCWSTR;
+typedef void            VOID;
+typedef void            *PVOID;
+typedef void            *LPVOID;
+typedef const void      *LPCVOID;
+typedef BYTE            *PBYTE;
+typedef DWORD           *PDWORD;
+typedef void            *HANDLE;
+typedef void            *HINSTANCE;
+typedef void            *HMODULE;
+typedef void            *HWND;
+typedef void            *HKEY;
+typedef void            *PSID;
+typedef void            *PSECURITY_DESCRIPTOR;
+typedef BYTE            byte;
+
+typedef struct _GUID
+{
+    uint32_t    Data1;
+    uint16_t    Data2;
+    uint16_t    Data3;
+    uint8_t     Data4[8];
+} GUID, IID, CLSID;
+typedef const GUID &REFGUID;
+typedef const IID &REFIID;
+
+inline bool IsEqualGUID(REFGUID a, REFGUID b)
+{
+    return memcmp(&a, &b, sizeof(GUID)) == 0;
+}
+
+// Declares the GUID; initguid.h makes it define it instead.
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) \
+    extern "C" const GUID name
+
+typedef struct _FILETIME
+{
+    DWORD   dwLowDateTime;
+    DWORD   dwHighDateTime;
+} FILETIME;
+
+typedef union _LARGE_INTEGER
+{
+    struct
+    {
+        DWORD   LowPart;
+        LONG    HighPart;
+    };
+    LONGLONG    QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef union _ULARGE_INTEGER
+{
+    struct
+    {
+        DWORD   LowPart;
+        DWORD   HighPart;
+    };
+    ULONGLONG   QuadPart;
+} ULARGE_INTEGER;
+
+typedef struct _SECURITY_ATTRIBUTES
+{
+    DWORD   nLength;
+    LPVOID  lpSecurityDescriptor;
+    BOOL    bInheritHandle;
+} SECURITY_ATTRIBUTES;
+
+typedef struct _OVERLAPPED
+{
+    ULONG_PTR   Internal;
+    ULONG_PTR   InternalHigh;
+    DWORD       Offset;
+    DWORD       OffsetHigh;
+    HANDLE      hEvent;
+} OVERLAPPED;
+
+#define TRUE                    1
+#define FALSE                   0
+#define WINAPI
+#define CALLBACK
+#define __cdecl
+#define STDMETHODCALLTYPE
+#define EXTERN_C                extern "C"
+#define UNREFERENCED_PARAMETER(p) ((void)(p))
+#define __override
+
+#define MAX_PATH                260
+#define MAX_COMPUTERNAME_LENGTH 15
+#define SECURITY_MAX_SID_SIZE   68
+#define SECURITY_MAX_SID_STRING_CHARACTERS 187
+#define INFINITE                0xFFFFFFFF
+#define MAXDWORD                0xFFFFFFFF
+
+// SAL annotations.
+
+#define _In_
+#define _In_z_
+#define _In_opt_
+#define _In_reads_(x)
+#define _In_reads_opt_(x)
+#define _In_reads_bytes_(x)
+#define _In_reads_bytes_opt_(x)
+#define _Inout_
+#define _Inout_opt_
+#define _Inout_updates_(x)
+#define _Inout_updates_opt_(x)
+#define _Inout_updates_z_(x)
+#define _Inout_updates_bytes_(x)
+#define _Out_
+#define _Out_opt_
+#define _Out_writes_(x)
+#define _Out_writes_opt_z_(x)
+#define _Out_writes_to_(x, y)
+#define _Out_writes_bytes_(x)
+#define _Out_writes_bytes_to_(x, y)
+#define _Outptr_
+#define _Outptr_result_maybenull_
+#define _Outptr_result_nullonfailure_
+#define _Outptr_result_bytebuffer_(x)
+#define _Outptr_result_buffer_maybenull_(x)
+#define _Deref_out_range_(x, y)
+
+// Results.
+
+#define S_OK                    ((HRESULT)0)
+#define S_FALSE                 ((HRESULT)1)
+#define E_FAIL                  ((HRESULT)0x80004005)
+#define E_ABORT                 ((HRESULT)0x80004004)
+#define E_NOTIMPL               ((HRESULT)0x80004001)
+#define E_NOINTERFACE           ((HRESULT)0x80004002)
+#define E_UNEXPECTED            ((HRESULT)0x8000FFFF)
+#define E_ACCESSDENIED          ((HRESULT)0x80070005)
+#define E_OUTOFMEMORY           ((HRESULT)0x8007000E)
+#define E_INVALIDARG            ((HRESULT)0x80070057)
+#define E_PENDING               ((HRESULT)0x8000000A)
+#define SUCCEEDED(hr)           (((HRESULT)(hr)) >= 0)
+#define FAILED(hr)              (((HRESULT)(hr)) < 0)
+#define HRESULT_FROM_WIN32(x)   ((HRESULT)(x) <= 0 ? ((HRESULT)(x)) : ((HRESULT)(((x) & 0x0000FFFF) | 0x80070000)))
+
+#define ERROR_SUCCESS           0L
+#define ERROR_FILE_NOT_FOUND    2L
+#define ERROR_PATH_NOT_FOUND    3L
+#define ERROR_TOO_MANY_OPEN_FILES 4L
+#define ERROR_ACCESS_DENIED     5L
+#define ERROR_INVALID_HANDLE    6L
+#define ERROR_NOT_ENOUGH_MEMORY 8L
+#define ERROR_INVALID_DATA      13L
+#define ERROR_OUTOFMEMORY       14L
+#define ERROR_HANDLE_EOF        38L
+#define ERROR_DUP_NAME          52L
+#define ERROR_FILE_EXISTS       80L
+#define ERROR_INVALID_PARAMETER 87L
+#define ERROR_INSUFFICIENT_BUFFER 122L
+#define ERROR_ALREADY_EXISTS    183L
+#define ERROR_FILE_TOO_LARGE    223L
+#define ERROR_NO_UNICODE_TRANSLATION 1113L
+#define ERROR_REVISION_MISMATCH 1306L
+#define ERROR_INVALID_SID       1337L
+#define ERROR_MORE_DATA         234L
+#define ERROR_NOT_FOUND         1168L
+#define ERROR_HOST_UNREACHABLE  1232L
+#define ERROR_TIMEOUT           1460L
+#define ERROR_WINHTTP_TIMEOUT   12002L
+
+// Memory.
+
+#define ARRAYSIZE(a)            (sizeof(a) / sizeof((a)[0]))
+#define FIELD_OFFSET(type, field) offsetof(type, field)
+#define ZeroMemory(p, cb)       memset((p), 0, (cb))
+#define CopyMemory(d, s, cb)    memcpy((d), (s), (cb))
+#define MoveMemory(d, s, cb)    memmove((d), (s), (cb))
+
+// Functions rather than the macros: the C++ library headers #undef min and max.
+template <typename T>
+inline T min(T a, T b)
+{
+    return (a < b) ? a : b;
+}
+
+template <typename T>
+inline T max(T a, T b)
+{
+    return (a < b) ? b : a;
+}
+
+inline void *SecureZeroMemory(void *pv, size_t cb)
+{
+    volatile BYTE *pb = static_cast<volatile BYTE *>(pv);
+    while (cb-- != 0)
+    {
+        *pb++ = 0;
+    }
+    return pv;
+}
+
+inline PVOID CoTaskMemAlloc(SIZE_T cb)
+{
+    return malloc(cb != 0 ? cb : 1);
+}
+
+inline void CoTaskMemFree(PVOID pv)
+{
+    free(pv);
+}
+
+inline HRESULT SHStrDupW(PCWSTR psz, PWSTR *ppsz)
+{
+    size_t cb = (wcslen(psz) + 1) * sizeof(wchar_t);
+    *ppsz = static_cast<PWSTR>(CoTaskMemAlloc(cb));
+    if (*ppsz == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+    memcpy(*ppsz, psz, cb);
+    return S_OK;
+}
+
+// Last error.
+
+inline DWORD &ShimLastError()
+{
+    static thread_local DWORD s_dwLastError = 0;
+    return s_dwLastError;
+}
+
+inline DWORD GetLastError()
+{
+    return ShimLastError();
+}
+
+inline void SetLastError(DWORD dwError)
+{
+    ShimLastError() = dwError;
+}
+
+// Interlocked.
+
+template <typename T>
+inline T InterlockedIncrement(volatile T *p)
+{
+    return __atomic_add_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+inline T InterlockedDecrement(volatile T *p)
+{
+    return __atomic_sub_fetch(p, 1, __ATOMIC_SEQ_CST);
+}
+
+template <typename T, typename U>
+inline T InterlockedExchange(volatile T *p, U value)
+{
+    return __atomic_exchange_n(p, static_cast<T>(value), __ATOMIC_SEQ_CST);
+}
+
+template <typename T, typename U>
+inline T InterlockedExchangeAdd(volatile T *p, U value)
+{
+    return __atomic_fetch_add(p, static_cast<T>(value), __ATOMIC_SEQ_CST);
+}
+
+template <typename T, typename U, typename V>
+inline T InterlockedCompareExchange(volatile T *p, U exchange, V comparand)
+{
+    T expected = static_cast<T>(comparand);
+    __atomic_compare_exchange_n(p, &expected, static_cast<T>(exchange), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
+
+template <typename T, typename U>
+inline T InterlockedExchange64(volatile T *p, U value)
+{
+    return InterlockedExchange(p, value);
+}
+
+template <typename T, typename U, typename V>
+inline T InterlockedCompareExchange64(volatile T *p, U exchange, V comparand)
+{
+    return InterlockedCompareExchange(p, exchange, comparand);
+}
+
+template <typename T, typename U>
+inline T InterlockedExchangeAdd64(volatile T *p, U value)
+{
+    return InterlockedExchangeAdd(p, value);
+}
+
+template <typename T>
+inline T *InterlockedCompareExchangePointer(T *volatile *p, T *exchange, T *comparand)
+{
+    T *expected = comparand;
+    __atomic_compare_exchange_n(p, &expected, exchange, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return expected;
+}
+
+inline PVOID InterlockedExchangePointer(PVOID volatile *p, PVOID value)
+{
+    return __atomic_exchange_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+inline void MemoryBarrier()
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+#define ReadAcquire(p)          __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define WriteRelease(p, v)      __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define YieldProcessor()        ((void)0)
+
+// Locks.
+
+typedef struct _SRWLOCK
+{
+    std::mutex *pMutex;
+} SRWLOCK, *PSRWLOCK;
+
+#define SRWLOCK_INIT            { nullptr }
+
+inline std::mutex *ShimSrwMutex(PSRWLOCK pLock)
+{
+    std::mutex *pMutex = __atomic_load_n(&pLock->pMutex, __ATOMIC_ACQUIRE);
+    if (pMutex == nullptr)
+    {
+        std::mutex *pNew = new std::mutex();
+        if (__atomic_compare_exchange_n(&pLock->pMutex, &pMutex, pNew, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            pMutex = pNew;
+        }
+        else
+        {
+            delete pNew;
+        }
+    }
+    return pMutex;
+}
+
+inline void InitializeSRWLock(PSRWLOCK pLock)
+{
+    pLock->pMutex = nullptr;
+}
+
+inline void AcquireSRWLockExclusive(PSRWLOCK pLock)
+{
+    ShimSrwMutex(pLock)->lock();
+}
+
+inline void ReleaseSRWLockExclusive(PSRWLOCK pLock)
+{
+    ShimSrwMutex(pLock)->unlock();
+}
+
+#define AcquireSRWLockShared    AcquireSRWLockExclusive
+#define ReleaseSRWLockShared    ReleaseSRWLockExclusive
+
+typedef struct _INIT_ONCE
+{
+    std::once_flag *pFlag;
+} INIT_ONCE, *PINIT_ONCE;
+
+#define INIT_ONCE_STATIC_INIT   { nullptr }
+
+typedef BOOL (CALLBACK *PINIT_ONCE_FN)(PINIT_ONCE, PVOID, PVOID *);
+
+inline BOOL InitOnceExecuteOnce(PINIT_ONCE pInitOnce, PINIT_ONCE_FN pfn, PVOID pvParameter, LPVOID *ppvContext)
+{
+    static std::mutex s_mutex;
+    std::lock_guard<std::mutex> lock(s_mutex);
+    if (pInitOnce->pFlag == nullptr)
+    {
+        pInitOnce->pFlag = reinterpret_cast<std::once_flag *>(1);
+        pfn(pInitOnce, pvParameter, ppvContext);
+    }
+    return TRUE;
+}
+
+// Time.
+
+inline ULONGLONG &ShimTickOffset()
+{
+    static ULONGLONG s_ullOffset = 0;
+    return s_ullOffset;
+}
+
+// Moves GetTickCount64 forward, so tests can step through timeouts without sleeping.
+inline void ShimAdvanceTicks(ULONGLONG ullMs)
+{
+    __atomic_add_fetch(&ShimTickOffset(), ullMs, __ATOMIC_SEQ_CST);
+}
+
+inline ULONGLONG GetTickCount64()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<ULONGLONG>(ts.tv_sec) * 1000 + static_cast<ULONGLONG>(ts.tv_nsec) / 1000000 +
+           __atomic_load_n(&ShimTickOffset(), __ATOMIC_SEQ_CST);
+}
+
+inline DWORD GetTickCount()
+{
+    return static_cast<DWORD>(GetTickCount64());
+}
+
+inline void GetSystemTimeAsFileTime(FILETIME *pft)
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ULONGLONG ull = (static_cast<ULONGLONG>(ts.tv_sec) + 11644473600ull) * 10000000ull + static_cast<ULONGLONG>(ts.tv_nsec) / 100 +
+                    __atomic_load_n(&ShimTickOffset(), __ATOMIC_SEQ_CST) * 10000ull;
+    pft->dwLowDateTime = static_cast<DWORD>(ull);
+    pft->dwHighDateTime = static_cast<DWORD>(ull >> 32);
+}
+
+inline LONG CompareFileTime(const FILETIME *pft1, const FILETIME *pft2)
+{
+    ULONGLONG ull1 = (static_cast<ULONGLONG>(pft1->dwHighDateTime) << 32) | pft1->dwLowDateTime;
+    ULONGLONG ull2 = (static_cast<ULONGLONG>(pft2->dwHighDateTime) << 32) | pft2->dwLowDateTime;
+    return (ull1 < ull2) ? -1 : (ull1 > ull2) ? 1 : 0;
+}
+
+inline void Sleep(DWORD dwMs)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(dwMs));
+}
+
+inline BOOL QueryPerformanceCounter(LARGE_INTEGER *pli)
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    pli->QuadPart = static_cast<LONGLONG>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    return TRUE;
+}
+
+inline BOOL QueryPerformanceFrequency(LARGE_INTEGER *pli)
+{
+    pli->QuadPart = 1000000000;
+    return TRUE;
+}
+
+// Handles. Every kernel object is a SHIM_OBJECT; waits and signals share one lock and one
+// condition variable, which is plenty for tests.
+
+#define INVALID_HANDLE_VALUE    (reinterpret_cast<HANDLE>(static_cast<intptr_t>(-1)))
+#define WAIT_OBJECT_0           0x00000000L
+#define WAIT_TIMEOUT            0x00000102L
+#define WAIT_FAILED             0xFFFFFFFF
+
+struct SHIM_OBJECT
+{
+    virtual ~SHIM_OBJECT() {}
+    virtual bool IsSignaled() const { return false; }
+    virtual void Acquire() {}
+};
+
+struct SHIM_WAIT
+{
+    std::mutex              mutex;
+    std::condition_variable cv;
+};
+
+inline SHIM_WAIT &ShimWait()
+{
+    static SHIM_WAIT s_wait;
+    return s_wait;
+}
+
+struct SHIM_EVENT : SHIM_OBJECT
+{
+    bool    fManualReset;
+    bool    fSignaled;
+
+    bool IsSignaled() const override { return fSignaled; }
+    void Acquire() override
+    {
+        if (!fManualReset)
+        {
+            fSignaled = false;
+        }
+    }
+};
+
+inline HANDLE CreateEventW(SECURITY_ATTRIBUTES *, BOOL fManualReset, BOOL fInitialState, PCWSTR)
+{
+    SHIM_EVENT *pEvent = new SHIM_EVENT();
+    pEvent->fManualReset = (fManualReset != FALSE);
+    pEvent->fSignaled = (fInitialState != FALSE);
+    return pEvent;
+}
+
+inline BOOL SetEvent(HANDLE h)
+{
+    {
+        std::lock_guard<std::mutex> lock(ShimWait().mutex);
+        static_cast<SHIM_EVENT *>(static_cast<SHIM_OBJECT *>(h))->fSignaled = true;
+    }
+    ShimWait().cv.notify_all();
+    return TRUE;
+}
+
+inline BOOL ResetEvent(HANDLE h)
+{
+    std::lock_guard<std::mutex> lock(ShimWait().mutex);
+    static_cast<SHIM_EVENT *>(static_cast<SHIM_OBJECT *>(h))->fSignaled = false;
+    return TRUE;
+}
+
+inline DWORD WaitForMultipleObjects(DWORD cHandles, const HANDLE *rgHandles, BOOL fWaitAll, DWORD dwMs)
+{
+    std::unique_lock<std::mutex> lock(ShimWait().mutex);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(dwMs);
+    for (;;)
+    {
+        DWORD cSignaled = 0;
+        DWORD iFirst = cHandles;
+        for (DWORD i = 0; i < cHandles; i++)
+        {
+            if (static_cast<SHIM_OBJECT *>(rgHandles[i])->IsSignaled())
+            {
+                cSignaled++;
+                iFirst = min(iFirst, i);
+            }
+        }
+        if (fWaitAll ? (cSignaled == cHandles) : (cSignaled != 0))
+        {
+            for (DWORD i = 0; i < cHandles; i++)
+            {
+                if (fWaitAll || i == iFirst)
+                {
+                    static_cast<SHIM_OBJECT *>(rgHandles[i])->Acquire();
+                }
+            }
+            return WAIT_OBJECT_0 + (fWaitAll ? 0 : iFirst);
+        }
+        if (dwMs == INFINITE)
+        {
+            ShimWait().cv.wait(lock);
+        }
+        else if (ShimWait().cv.wait_until(lock, deadline) == std::cv_status::timeout && std::chrono::steady_clock::now() >= deadline)
+        {
+            return WAIT_TIMEOUT;
+        }
+    }
+}
+
+inline DWORD WaitForSingleObject(HANDLE h, DWORD dwMs)
+{
+    return WaitForMultipleObjects(1, &h, FALSE, dwMs);
+}
+
+inline BOOL CloseHandle(HANDLE h)
+{
+    if (h == nullptr || h == INVALID_HANDLE_VALUE)
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+    delete static_cast<SHIM_OBJECT *>(h);
+    return TRUE;
+}
+
+// Threads. A thread's handle is signaled once its procedure returns; closing it detaches the
+// thread, as closing a thread handle does on Windows.
+
+struct SHIM_THREAD : SHIM_OBJECT
+{
+    bool        fDone = false;
+    std::thread thread;
+
+    bool IsSignaled() const override { return fDone; }
+    ~SHIM_THREAD() override
+    {
+        thread.detach();
+    }
+};
+
+typedef DWORD (WINAPI *LPTHREAD_START_ROUTINE)(LPVOID);
+
+inline HANDLE CreateThread(SECURITY_ATTRIBUTES *, SIZE_T, LPTHREAD_START_ROUTINE pfn, LPVOID pvParam, DWORD, DWORD *pdwThreadId)
+{
+    SHIM_THREAD *pThread = new SHIM_THREAD();
+    if (pdwThreadId != nullptr)
+    {
+        *pdwThreadId = 0;
+    }
+    // The handle may be closed as soon as fDone is set, so the thread does not touch it after.
+    pThread->thread = std::thread([pThread, pfn, pvParam]()
+    {
+        pfn(pvParam);
+        {
+            std::lock_guard<std::mutex> lock(ShimWait().mutex);
+            pThread->fDone = true;
+        }
+        ShimWait().cv.notify_all();
+    });
+    return pThread;
+}
+
+// Thread pool.
+
+#define WT_EXECUTEDEFAULT       0x00000000
+#define WT_EXECUTELONGFUNCTION  0x00000010
+
+inline BOOL QueueUserWorkItem(LPTHREAD_START_ROUTINE pfn, PVOID pvContext, ULONG)
+{
+    std::thread(pfn, pvContext).detach();
+    return TRUE;
+}
+
+// Thread pool timers never fire on their own; ShimFireTimers runs every armed one on the calling
+// thread, as if its due time had come, so tests decide when background work happens.
+
+typedef struct _TP_CALLBACK_INSTANCE *PTP_CALLBACK_INSTANCE;
+typedef struct _TP_CALLBACK_ENVIRON *PTP_CALLBACK_ENVIRON;
+typedef struct _TP_TIMER *PTP_TIMER;
+typedef VOID (CALLBACK *PTP_TIMER_CALLBACK)(PTP_CALLBACK_INSTANCE, PVOID, PTP_TIMER);
+
+struct _TP_TIMER
+{
+    PTP_TIMER_CALLBACK  pfn;
+    PVOID               pvContext;
+    bool                fArmed;
+};
+
+inline std::mutex &ShimTimerMutex()
+{
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+
+inline std::vector<PTP_TIMER> &ShimTimers()
+{
+    static std::vector<PTP_TIMER> s_timers;
+    return s_timers;
+}
+
+inline PTP_TIMER CreateThreadpoolTimer(PTP_TIMER_CALLBACK pfn, PVOID pvContext, PTP_CALLBACK_ENVIRON)
+{
+    PTP_TIMER pTimer = new _TP_TIMER();
+    pTimer->pfn = pfn;
+    pTimer->pvContext = pvContext;
+    pTimer->fArmed = false;
+    std::lock_guard<std::mutex> lock(ShimTimerMutex());
+    ShimTimers().push_back(pTimer);
+    return pTimer;
+}
+
+inline VOID SetThreadpoolTimer(PTP_TIMER pTimer, FILETIME *pftDue, DWORD, DWORD)
+{
+    std::lock_guard<std::mutex> lock(ShimTimerMutex());
+    pTimer->fArmed = (pftDue != nullptr);
+}
+
+inline BOOL IsThreadpoolTimerSet(PTP_TIMER pTimer)
+{
+    std::lock_guard<std::mutex> lock(ShimTimerMutex());
+    return pTimer->fArmed;
+}
+
+inline VOID CloseThreadpoolTimer(PTP_TIMER pTimer)
+{
+    std::lock_guard<std::mutex> lock(ShimTimerMutex());
+    ShimTimers().erase(std::find(ShimTimers().begin(), ShimTimers().end(), pTimer));
+    delete pTimer;
+}
+
+// Returns how many timers fired.
+inline DWORD ShimFireTimers()
+{
+    std::vector<PTP_TIMER> vecDue;
+    {
+        std::lock_guard<std::mutex> lock(ShimTimerMutex());
+        for (PTP_TIMER pTimer : ShimTimers())
+        {
+            if (pTimer->fArmed)
+            {
+                pTimer->fArmed = false;
+                vecDue.push_back(pTimer);
+            }
+        }
+    }
+    for (PTP_TIMER pTimer : vecDue)
+    {
+        pTimer->pfn(nullptr, pTimer->pvContext, pTimer);
+    }
+    return static_cast<DWORD>(vecDue.size());
+}
+
+inline DWORD GetCurrentProcessId()
+{
+    return 1;
+}
+
+// Files. Paths are narrowed to UTF-8 with '\\' as the separator turned into '/', and a drive
+// prefix such as C: is replaced by ShimFileRoot(), so a test can point the fixed paths the
+// sources use at a scratch directory. Handles are file descriptors; mappings keep their own.
+
+#define GENERIC_READ            0x80000000
+#define GENERIC_WRITE           0x40000000
+#define FILE_SHARE_READ         0x00000001
+#define FILE_SHARE_WRITE        0x00000002
+#define FILE_SHARE_DELETE       0x00000004
+#define CREATE_NEW              1
+#define CREATE_ALWAYS           2
+#define OPEN_EXISTING           3
+#define OPEN_ALWAYS             4
+#define FILE_ATTRIBUTE_NORMAL   0x00000080
+#define FILE_ATTRIBUTE_DIRECTORY 0x00000010
+#define MOVEFILE_REPLACE_EXISTING 0x00000001
+#define PAGE_READONLY           0x02
+#define PAGE_READWRITE          0x04
+#define FILE_MAP_WRITE          0x0002
+#define FILE_MAP_READ           0x0004
+
+typedef struct _WIN32_FILE_ATTRIBUTE_DATA
+{
+    DWORD       dwFileAttributes;
+    FILETIME    ftCreationTime;
+    FILETIME    ftLastAccessTime;
+    FILETIME    ftLastWriteTime;
+    DWORD       nFileSizeHigh;
+    DWORD       nFileSizeLow;
+} WIN32_FILE_ATTRIBUTE_DATA;
+
+enum GET_FILEEX_INFO_LEVELS
+{
+    GetFileExInfoStandard,
+};
+
+inline std::string &ShimFileRoot()
+{
+    static std::string s_strRoot(".");
+    return s_strRoot;
+}
+
+inline std::string ShimFilePath(PCWSTR pszPath)
+{
+    std::string strPath;
+    if (iswalpha(pszPath[0]) && pszPath[1] == L':')
+    {
+        strPath = ShimFileRoot();
+        pszPath += 2;
+    }
+    for (; *pszPath != L'\0'; pszPath++)
+    {
+        DWORD ch = static_cast<DWORD>(*pszPath);
+        if (ch == L'\\')
+        {
+            strPath += '/';
+        }
+        else if (ch < 0x80)
+        {
+            strPath += static_cast<char>(ch);
+        }
+        else if (ch < 0x800)
+        {
+            strPath += static_cast<char>(0xC0 | (ch >> 6));
+            strPath += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+        else if (ch < 0x10000)
+        {
+            strPath += static_cast<char>(0xE0 | (ch >> 12));
+            strPath += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+            strPath += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+        else
+        {
+            strPath += static_cast<char>(0xF0 | (ch >> 18));
+            strPath += static_cast<char>(0x80 | ((ch >> 12) & 0x3F));
+            strPath += static_cast<char>(0x80 | ((ch >> 6) & 0x3F));
+            strPath += static_cast<char>(0x80 | (ch & 0x3F));
+        }
+    }
+    return strPath;
+}
+
+inline void ShimSetErrno()
+{
+    switch (errno)
+    {
+    case ENOENT: SetLastError(ERROR_FILE_NOT_FOUND); break;
+    case ENOTDIR: SetLastError(ERROR_PATH_NOT_FOUND); break;
+    case EACCES: case EPERM: SetLastError(ERROR_ACCESS_DENIED); break;
+    case EEXIST: SetLastError(ERROR_ALREADY_EXISTS); break;
+    case ENOMEM: SetLastError(ERROR_NOT_ENOUGH_MEMORY); break;
+    default: SetLastError(ERROR_INVALID_PARAMETER); break;
+    }
+}
+
+inline FILETIME ShimFileTime(const struct timespec &ts)
+{
+    ULONGLONG ull = 116444736000000000ull + static_cast<ULONGLONG>(ts.tv_sec) * 10000000ull + static_cast<ULONGLONG>(ts.tv_nsec) / 100;
+    FILETIME ft = { static_cast<DWORD>(ull), static_cast<DWORD>(ull >> 32) };
+    return ft;
+}
+
+struct SHIM_FILE : SHIM_OBJECT
+{
+    int fd;
+
+    ~SHIM_FILE() override
+    {
+        close(fd);
+    }
+};
+
+inline HANDLE CreateFileW(PCWSTR pszPath, DWORD dwAccess, DWORD, SECURITY_ATTRIBUTES *, DWORD dwDisposition, DWORD, HANDLE)
+{
+    int oflags = ((dwAccess & GENERIC_WRITE) != 0) ? (((dwAccess & GENERIC_READ) != 0) ? O_RDWR : O_WRONLY) : O_RDONLY;
+    switch (dwDisposition)
+    {
+    case CREATE_NEW: oflags |= O_CREAT | O_EXCL; break;
+    case CREATE_ALWAYS: oflags |= O_CREAT | O_TRUNC; break;
+    case OPEN_ALWAYS: oflags |= O_CREAT; break;
+    default: break;
+    }
+    int fd = open(ShimFilePath(pszPath).c_str(), oflags | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        ShimSetErrno();
+        if (errno == EEXIST)
+        {
+            SetLastError(ERROR_FILE_EXISTS);
+        }
+        return INVALID_HANDLE_VALUE;
+    }
+    SHIM_FILE *pFile = new SHIM_FILE();
+    pFile->fd = fd;
+    return pFile;
+}
+
+inline int ShimFd(HANDLE h)
+{
+    return static_cast<SHIM_FILE *>(static_cast<SHIM_OBJECT *>(h))->fd;
+}
+
+inline BOOL ReadFile(HANDLE h, LPVOID pv, DWORD cb, DWORD *pcbRead, OVERLAPPED *)
+{
+    ssize_t cbRead = read(ShimFd(h), pv, cb);
+    if (cbRead < 0)
+    {
+        ShimSetErrno();
+        return FALSE;
+    }
+    *pcbRead = static_cast<DWORD>(cbRead);
+    return TRUE;
+}
+
+inline BOOL WriteFile(HANDLE h, LPCVOID pv, DWORD cb, DWORD *pcbWritten, OVERLAPPED *)
+{
+    ssize_t cbWritten = write(ShimFd(h), pv, cb);
+    if (cbWritten < 0)
+    {
+        ShimSetErrno();
+        return FALSE;
+    }
+    *pcbWritten = static_cast<DWORD>(cbWritten);
+    return TRUE;
+}
+
+inline BOOL GetFileSizeEx(HANDLE h, LARGE_INTEGER *pliSize)
+{
+    struct stat st;
+    if (fstat(ShimFd(h), &st) != 0)
+    {
+        ShimSetErrno();
+        return FALSE;
+    }
+    pliSize->QuadPart = st.st_size;
+    return TRUE;
+}
+
+inline BOOL FlushFileBuffers(HANDLE h)
+{
+    return fsync(ShimFd(h)) == 0;
+}
+
+inline BOOL GetFileAttributesExW(PCWSTR pszPath, GET_FILEEX_INFO_LEVELS, LPVOID pvInfo)
+{
+    struct stat st;
+    if (stat(ShimFilePath(pszPath).c_str(), &st) != 0)
+    {
+        ShimSetErrno();
+        return FALSE;
+    }
+    WIN32_FILE_ATTRIBUTE_DATA *pData = static_cast<WIN32_FILE_ATTRIBUTE_DATA *>(pvInfo);
+    pData->dwFileAttributes = S_ISDIR(st.st_mode) ? FILE_ATTRIBUTE_DIRECTORY : FILE_ATTRIBUTE_NORMAL;
+    pData->ftCreationTime = ShimFileTime(st.st_ctim);
+    pData->ftLastAccessTime = ShimFileTime(st.st_atim);
+    pData->ftLastWriteTime = ShimFileTime(st.st_mtim);
+    pData->nFileSizeHigh = static_cast<DWORD>(static_cast<ULONGLONG>(st.st_size) >> 32);
+    pData->nFileSizeLow = static_cast<DWORD>(st.st_size);
+    return TRUE;
+}
+
+inline BOOL CreateDirectoryW(PCWSTR pszPath, SECURITY_ATTRIBUTES *)
+{
+    if (mkdir(ShimFilePath(pszPath).c_str(), 0700) != 0)
+    {
+        ShimSetErrno();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+inline BOOL MoveFileExW(PCWSTR pszFrom, PCWSTR pszTo, DWORD dwFlags)
+{
+    std::string strTo = ShimFilePath(pszTo);
+    struct stat st;
+    if ((dwFlags & MOVEFILE_REPLACE_EXISTING) == 0 && stat(strTo.c_str(), &st) == 0)
+    {
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return FALSE;
+    }
+    if (rename(ShimFilePath(pszFrom).c_str(), strTo.c_str()) != 0)
+    {
+        ShimSetErrno();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+inline BOOL DeleteFileW(PCWSTR pszPath)
+{
+    if (unlink(ShimFilePath(pszPath).c_str()) != 0)
+    {
+        ShimSetErrno();
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// A mapping holds its own descriptor, so it outlives the file handle as on Windows. Views
+// remember their length for munmap.
+//
+// Sections backed by the pagefile are memfds when unnamed. Named ones are files in
+// ShimFileRoot(), so processes forked by a test share them; the name is used as the file name
+// with '\\' turned into '.'. A test sets ShimRestrictedProcess() in a process that should see
+// named sections as a user outside their DACL would: it cannot create them or map them for
+// writing, only open existing ones to read.
+
+struct SHIM_MAPPING : SHIM_OBJECT
+{
+    int         fd;
+    size_t      cb;
+    bool        fWritable;
+
+    ~SHIM_MAPPING() override
+    {
+        close(fd);
+    }
+};
+
+inline std::mutex &ShimViewMutex()
+{
+    static std::mutex s_mutex;
+    return s_mutex;
+}
+
+inline std::map<void *, size_t> &ShimViews()
+{
+    static std::map<void *, size_t> s_views;
+    return s_views;
+}
+
+inline bool &ShimRestrictedProcess()
+{
+    static bool s_fRestricted = false;
+    return s_fRestricted;
+}
+
+inline std::string ShimSectionPath(PCWSTR pszName)
+{
+    std::wstring strName(pszName);
+    std::replace(strName.begin(), strName.end(), L'\\', L'.');
+    return ShimFilePath((L"C:\\" + strName).c_str());
+}
+
+inline HANDLE ShimOpenSection(int fd, size_t cb, bool fWritable)
+{
+    SHIM_MAPPING *pMapping = new SHIM_MAPPING();
+    pMapping->fd = fd;
+    pMapping->cb = cb;
+    pMapping->fWritable = fWritable;
+    return pMapping;
+}
+
+// A named section that already exists keeps its size, as on Windows.
+inline HANDLE ShimCreateSection(DWORD dwProtect, size_t cb, PCWSTR pszName)
+{
+    if (pszName != nullptr && ShimRestrictedProcess())
+    {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return nullptr;
+    }
+    if (dwProtect != PAGE_READWRITE || cb == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return nullptr;
+    }
+    int fd = (pszName != nullptr) ? open(ShimSectionPath(pszName).c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600) : memfd_create("section", MFD_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || (st.st_size == 0 && ftruncate(fd, static_cast<off_t>(cb)) != 0))
+    {
+        ShimSetErrno();
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return nullptr;
+    }
+    SetLastError((st.st_size != 0) ? ERROR_ALREADY_EXISTS : ERROR_SUCCESS);
+    return ShimOpenSection(fd, (st.st_size != 0) ? static_cast<size_t>(st.st_size) : cb, true);
+}
+
+inline HANDLE CreateFileMappingW(HANDLE hFile, SECURITY_ATTRIBUTES *, DWORD dwProtect, DWORD dwMaxHigh, DWORD dwMaxLow, PCWSTR pszName)
+{
+    bool fWritable = (dwProtect == PAGE_READWRITE);
+    size_t cb = (static_cast<size_t>(dwMaxHigh) << 32) | dwMaxLow;
+    if (hFile == INVALID_HANDLE_VALUE)
+    {
+        return ShimCreateSection(dwProtect, cb, pszName);
+    }
+    struct stat st;
+    if (fstat(ShimFd(hFile), &st) != 0)
+    {
+        ShimSetErrno();
+        return nullptr;
+    }
+    if (cb == 0)
+    {
+        cb = static_cast<size_t>(st.st_size);
+    }
+    if (cb == 0)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return nullptr;
+    }
+    if (cb > static_cast<size_t>(st.st_size) && (!fWritable || ftruncate(ShimFd(hFile), static_cast<off_t>(cb)) != 0))
+    {
+        SetLastError(fWritable ? ERROR_NOT_ENOUGH_MEMORY : ERROR_INVALID_PARAMETER);
+        return nullptr;
+    }
+    return ShimOpenSection(dup(ShimFd(hFile)), cb, fWritable);
+}
+
+inline HANDLE OpenFileMappingW(DWORD dwAccess, BOOL, PCWSTR pszName)
+{
+    bool fWritable = (dwAccess & FILE_MAP_WRITE) != 0;
+    if (fWritable && ShimRestrictedProcess())
+    {
+        SetLastError(ERROR_ACCESS_DENIED);
+        return nullptr;
+    }
+    int fd = open(ShimSectionPath(pszName).c_str(), (fWritable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+            errno = ENOENT;
+        }
+        ShimSetErrno();
+        return nullptr;
+    }
+    return ShimOpenSection(fd, static_cast<size_t>(st.st_size), fWritable);
+}
+
+inline LPVOID MapViewOfFile(HANDLE hMapping, DWORD dwAccess, DWORD dwOffsetHigh, DWORD dwOffsetLow, SIZE_T cb)
+{
+    SHIM_MAPPING *pMapping = static_cast<SHIM_MAPPING *>(static_cast<SHIM_OBJECT *>(hMapping));
+    size_t ibOffset = (static_cast<size_t>(dwOffsetHigh) << 32) | dwOffsetLow;
+    bool fWrite = (dwAccess & FILE_MAP_WRITE) != 0;
+    if (cb == 0)
+    {
+        cb = (ibOffset < pMapping->cb) ? pMapping->cb - ibOffset : 0;
+    }
+    if ((fWrite && !pMapping->fWritable) || cb == 0 || ibOffset + cb > pMapping->cb)
+    {
+        SetLastError(fWrite ? ERROR_ACCESS_DENIED : ERROR_INVALID_PARAMETER);
+        return nullptr;
+    }
+    void *pv = mmap(nullptr, cb, fWrite ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, pMapping->fd, static_cast<off_t>(ibOffset));
+    if (pv == MAP_FAILED)
+    {
+        ShimSetErrno();
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> lock(ShimViewMutex());
+    ShimViews()[pv] = cb;
+    return pv;
+}
+
+inline BOOL UnmapViewOfFile(LPCVOID pv)
+{
+    size_t cb = 0;
+    {
+        std::lock_guard<std::mutex> lock(ShimViewMutex());
+        auto it = ShimViews().find(const_cast<void *>(pv));
+        if (it == ShimViews().end())
+        {
+            SetLastError(ERROR_INVALID_PARAMETER);
+            return FALSE;
+        }
+        cb = it->second;
+        ShimViews().erase(it);
+    }
+    return munmap(const_cast<void *>(pv), cb) == 0;
+}
+
+inline BOOL FlushViewOfFile(LPCVOID pv, SIZE_T cb)
+{
+    // msync wants a page-aligned start.
+    uintptr_t uStart = reinterpret_cast<uintptr_t>(pv) & ~static_cast<uintptr_t>(sysconf(_SC_PAGESIZE) - 1);
+    return msync(reinterpret_cast<void *>(uStart), reinterpret_cast<uintptr_t>(pv) + cb - uStart, MS_SYNC) == 0;
+}
+
+// Strings.
+
+#define CSTR_LESS_THAN          1
+#define CSTR_EQUAL              2
+#define CSTR_GREATER_THAN       3
+
+inline int CompareStringOrdinal(PCWSTR psz1, int cch1, PCWSTR psz2, int cch2, BOOL fIgnoreCase)
+{
+    size_t cchFirst = (cch1 < 0) ? wcslen(psz1) : static_cast<size_t>(cch1);
+    size_t cchSecond = (cch2 < 0) ? wcslen(psz2) : static_cast<size_t>(cch2);
+    for (size_t i = 0; i < cchFirst && i < cchSecond; i++)
+    {
+        wint_t ch1 = fIgnoreCase ? towupper(psz1[i]) : static_cast<wint_t>(psz1[i]);
+        wint_t ch2 = fIgnoreCase ? towupper(psz2[i]) : static_cast<wint_t>(psz2[i]);
+        if (ch1 != ch2)
+        {
+            return (ch1 < ch2) ? CSTR_LESS_THAN : CSTR_GREATER_THAN;
+        }
+    }
+    return (cchFirst < cchSecond) ? CSTR_LESS_THAN : (cchFirst > cchSecond) ? CSTR_GREATER_THAN : CSTR_EQUAL;
+}
+
+inline int _wcsicmp(PCWSTR psz1, PCWSTR psz2)
+{
+    return wcscasecmp(psz1, psz2);
+}
+
+inline int _wcsnicmp(PCWSTR psz1, PCWSTR psz2, size_t cch)
+{
+    return wcsncasecmp(psz1, psz2, cch);
+}
+
+inline int _stricmp(PCSTR psz1, PCSTR psz2)
+{
+    return strcasecmp(psz1, psz2);
+}
+
+inline PWSTR wcstok_s(PWSTR psz, PCWSTR pszDelimiters, PWSTR *ppszContext)
+{
+    return wcstok(psz, pszDelimiters, ppszContext);
+}
+
+#define CP_UTF8                 65001
+#define MB_ERR_INVALID_CHARS    0x00000008
+
+// wchar_t is 32 bits here, so every code point is one character, not a UTF-16 pair.
+inline int MultiByteToWideChar(UINT, DWORD, PCSTR psz, int cb, PWSTR pszWide, int cchWide)
+{
+    const BYTE *pb = reinterpret_cast<const BYTE *>(psz);
+    size_t cbText = (cb < 0) ? strlen(psz) + 1 : static_cast<size_t>(cb);
+    int cch = 0;
+    for (size_t i = 0; i < cbText;)
+    {
+        DWORD ch = pb[i];
+        size_t cbChar = (ch < 0x80) ? 1 : ((ch & 0xE0) == 0xC0) ? 2 : ((ch & 0xF0) == 0xE0) ? 3 : ((ch & 0xF8) == 0xF0) ? 4 : 0;
+        if (cbChar == 0 || i + cbChar > cbText)
+        {
+            SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+            return 0;
+        }
+        if (cbChar > 1)
+        {
+            ch &= 0x3F >> (cbChar - 1);
+            for (size_t j = 1; j < cbChar; j++)
+            {
+                if ((pb[i + j] & 0xC0) != 0x80)
+                {
+                    SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+                    return 0;
+                }
+                ch = (ch << 6) | (pb[i + j] & 0x3F);
+            }
+            static const DWORD c_rgchMin[] = { 0, 0, 0x80, 0x800, 0x10000 };
+            if (ch < c_rgchMin[cbChar] || ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+            {
+                SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+                return 0;
+            }
+        }
+        if (cchWide != 0)
+        {
+            if (cch >= cchWide)
+            {
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                return 0;
+            }
+            pszWide[cch] = static_cast<wchar_t>(ch);
+        }
+        cch++;
+        i += cbChar;
+    }
+    return cch;
+}
+
+#define WC_ERR_INVALID_CHARS    0x00000080
+
+inline int WideCharToMultiByte(UINT, DWORD, PCWSTR pszWide, int cchWide, PSTR psz, int cb, PCSTR, BOOL *)
+{
+    size_t cchText = (cchWide < 0) ? wcslen(pszWide) + 1 : static_cast<size_t>(cchWide);
+    int cbOut = 0;
+    for (size_t i = 0; i < cchText; i++)
+    {
+        DWORD ch = static_cast<DWORD>(pszWide[i]);
+        if (ch > 0x10FFFF || (ch >= 0xD800 && ch <= 0xDFFF))
+        {
+            SetLastError(ERROR_NO_UNICODE_TRANSLATION);
+            return 0;
+        }
+        BYTE rgb[4];
+        int cbChar;
+        if (ch < 0x80)
+        {
+            rgb[0] = static_cast<BYTE>(ch);
+            cbChar = 1;
+        }
+        else if (ch < 0x800)
+        {
+            rgb[0] = static_cast<BYTE>(0xC0 | (ch >> 6));
+            rgb[1] = static_cast<BYTE>(0x80 | (ch & 0x3F));
+            cbChar = 2;
+        }
+        else if (ch < 0x10000)
+        {
+            rgb[0] = static_cast<BYTE>(0xE0 | (ch >> 12));
+            rgb[1] = static_cast<BYTE>(0x80 | ((ch >> 6) & 0x3F));
+            rgb[2] = static_cast<BYTE>(0x80 | (ch & 0x3F));
+            cbChar = 3;
+        }
+        else
+        {
+            rgb[0] = static_cast<BYTE>(0xF0 | (ch >> 18));
+            rgb[1] = static_cast<BYTE>(0x80 | ((ch >> 12) & 0x3F));
+            rgb[2] = static_cast<BYTE>(0x80 | ((ch >> 6) & 0x3F));
+            rgb[3] = static_cast<BYTE>(0x80 | (ch & 0x3F));
+            cbChar = 4;
+        }
+        if (cb != 0)
+        {
+            if (cbOut + cbChar > cb)
+            {
+                SetLastError(ERROR_INSUFFICIENT_BUFFER);
+                return 0;
+            }
+            memcpy(psz + cbOut, rgb, cbChar);
+        }
+        cbOut += cbChar;
+    }
+    return cbOut;
+}
+
+// The registry is empty: every value reads as not set.
+
+typedef LONG LSTATUS;
+
+#define HKEY_LOCAL_MACHINE      (reinterpret_cast<HKEY>(static_cast<intptr_t>(0x80000002)))
+#define RRF_RT_REG_SZ           0x00000002
+#define RRF_RT_REG_DWORD        0x00000010
+
+inline LSTATUS RegGetValueW(HKEY, PCWSTR, PCWSTR, DWORD, DWORD *, PVOID, DWORD *)
+{
+    return ERROR_FILE_NOT_FOUND;
+}
+
+// Local memory and SIDs. A SID is laid out as on Windows: revision, subauthority count, a 48-bit
+// big-endian identifier authority, then the subauthorities.
+
+#define LMEM_FIXED              0x0000
+#define LMEM_ZEROINIT           0x0040
+#define LPTR                    (LMEM_FIXED | LMEM_ZEROINIT)
+#define SID_MAX_SUB_AUTHORITIES 15
+
+typedef void *HLOCAL;
+
+inline HLOCAL LocalAlloc(UINT, SIZE_T cb)
+{
+    return calloc(1, cb != 0 ? cb : 1);
+}
+
+inline HLOCAL LocalFree(HLOCAL h)
+{
+    free(h);
+    return nullptr;
+}
+
+inline BOOL IsValidSid(PSID psid)
+{
+    const BYTE *pb = static_cast<const BYTE *>(psid);
+    return pb != nullptr && pb[0] == 1 && pb[1] <= SID_MAX_SUB_AUTHORITIES;
+}
+
+inline DWORD GetLengthSid(PSID psid)
+{
+    return 8 + 4 * static_cast<const BYTE *>(psid)[1];
+}
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <windows.h>
+#include <functional>
+#include <memory>
+
+// WinHTTP without a network. Every request is answered in-process by the handler a test installs
+// in ShimHttpHandler(), which sees the host, port, verb, path and body and returns the status
+// code and body; returning 0 fails the request as an unreachable host would. A handler that holds
+// a request open, as a long poll does, waits on the request's hAbort: closing the request handle
+// from another thread sets it, and the blocked WinHttpReceiveResponse then fails with
+// ERROR_WINHTTP_OPERATION_CANCELLED, as it does on Windows.
+//
+// Handles are looked up in a table, so a handle another thread has closed fails with
+// ERROR_INVALID_HANDLE rather than pointing at freed memory.
+
+typedef void *HINTERNET;
+typedef WORD INTERNET_PORT;
+
+#define ERROR_WINHTTP_INVALID_URL           12005L
+#define ERROR_WINHTTP_OPERATION_CANCELLED   12017L
+#define ERROR_WINHTTP_CANNOT_CONNECT        12029L
+#define ERROR_WINHTTP_NOT_INITIALIZED       12172L
+
+#define HTTP_E_STATUS_UNEXPECTED            ((HRESULT)0x80190001)
+#define HTTP_E_STATUS_SERVER_ERROR          ((HRESULT)0x801901F4)
+#define HTTP_STATUS_OK                      200
+#define HTTP_STATUS_SERVER_ERROR            500
+
+#define WINHTTP_ACCESS_TYPE_DEFAULT_PROXY   0
+#define WINHTTP_NO_PROXY_NAME               nullptr
+#define WINHTTP_NO_PROXY_BYPASS             nullptr
+#define WINHTTP_NO_REFERER                  nullptr
+#define WINHTTP_DEFAULT_ACCEPT_TYPES        nullptr
+#define WINHTTP_HEADER_NAME_BY_INDEX        nullptr
+#define WINHTTP_NO_HEADER_INDEX             nullptr
+#define WINHTTP_OPTION_MAX_CONNS_PER_SERVER 73
+#define WINHTTP_FLAG_SECURE                 0x00800000
+#define WINHTTP_QUERY_STATUS_CODE           19
+#define WINHTTP_QUERY_FLAG_NUMBER           0x20000000
+
+#define INTERNET_SCHEME_HTTP                1
+#define INTERNET_SCHEME_HTTPS               2
+#define INTERNET_DEFAULT_HTTP_PORT          80
+#define INTERNET_DEFAULT_HTTPS_PORT         443
+
+typedef int INTERNET_SCHEME;
+
+// URL_COMPONENTS is filled in as { sizeof(components) } with the rest zeroed, which -Wextra
+// would otherwise reject in every file that includes this.
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+
+typedef struct _URL_COMPONENTS
+{
+    DWORD           dwStructSize;
+    LPWSTR          lpszScheme;
+    DWORD           dwSchemeLength;
+    INTERNET_SCHEME nScheme;
+    LPWSTR          lpszHostName;
+    DWORD           dwHostNameLength;
+    INTERNET_PORT   nPort;
+    LPWSTR          lpszUserName;
+    DWORD           dwUserNameLength;
+    LPWSTR          lpszPassword;
+    DWORD           dwPasswordLength;
+    LPWSTR          lpszUrlPath;
+    DWORD           dwUrlPathLength;
+    LPWSTR          lpszExtraInfo;
+    DWORD           dwExtraInfoLength;
+} URL_COMPONENTS;
+
+// What a handler is asked.
+struct SHIM_HTTP_REQUEST
+{
+    std::wstring    strHost;
+    INTERNET_PORT   nPort;
+    bool            fSecure;
+    std::wstring    strVerb;
+    std::wstring    strPath;
+    std::string     strBody;
+    DWORD           dwReceiveTimeoutMs;
+    HANDLE          hAbort;             // Set once the request handle is closed.
+};
+
+// Returns the status code and fills in the response body.
+typedef std::function<DWORD(const SHIM_HTTP_REQUEST &request, std::string *pstrResponse)> SHIM_HTTP_HANDLER;
+
+inline SHIM_HTTP_HANDLER &ShimHttpHandler()
+{
+    static SHIM_HTTP_HANDLER s_handler;
+    return s_handler;
+}
+
+struct SHIM_HINTERNET
+{
+    SHIM_HTTP_REQUEST   request;
+    DWORD               dwStatusCode = 0;
+    std::string         strResponse;
+    size_t              cbRead = 0;
+    bool                fReceived = false;
+
+    SHIM_HINTERNET()
+    {
+        request.nPort = 0;
+        request.fSecure = false;
+        request.dwReceiveTimeoutMs = 0;
+        request.hAbort = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    }
+
+    ~SHIM_HINTERNET()
+    {
+        CloseHandle(request.hAbort);
+    }
+};
+
+struct SHIM_HTTP_HANDLES
+{
+    std::mutex                                                  mutex;
+    std::map<uintptr_t, std::shared_ptr<SHIM_HINTERNET>>        mapHandles;
+    uintptr_t                                                   uNext = 0x1000;
+};
+
+inline SHIM_HTTP_HANDLES &ShimHttpHandles()
+{
+    static SHIM_HTTP_HANDLES s_handles;
+    return s_handles;
+}
+
+inline HINTERNET ShimHttpOpenHandle(const std::shared_ptr<SHIM_HINTERNET> &pHandle)
+{
+    SHIM_HTTP_HANDLES &handles = ShimHttpHandles();
+    std::lock_guard<std::mutex> lock(handles.mutex);
+    uintptr_t u = handles.uNext;
+    handles.uNext += 0x10;
+    handles.mapHandles[u] = pHandle;
+    return reinterpret_cast<HINTERNET>(u);
+}
+
+inline std::shared_ptr<SHIM_HINTERNET> ShimHttpFindHandle(HINTERNET h)
+{
+    SHIM_HTTP_HANDLES &handles = ShimHttpHandles();
+    std::lock_guard<std::mutex> lock(handles.mutex);
+    auto it = handles.mapHandles.find(reinterpret_cast<uintptr_t>(h));
+    if (it == handles.mapHandles.end())
+    {
+        SetLastError(ERROR_INVALID_HANDLE);
+        return nullptr;
+    }
+    return it->second;
+}
+
+// Handles not closed yet, of every kind.
+inline size_t ShimHttpOpenHandles()
+{
+    SHIM_HTTP_HANDLES &handles = ShimHttpHandles();
+    std::lock_guard<std::mutex> lock(handles.mutex);
+    return handles.mapHandles.size();
+}
+
+inline HINTERNET WinHttpOpen(PCWSTR, DWORD, PCWSTR, PCWSTR, DWORD)
+{
+    return ShimHttpOpenHandle(std::make_shared<SHIM_HINTERNET>());
+}
+
+inline BOOL WinHttpSetOption(HINTERNET h, DWORD, LPVOID, DWORD)
+{
+    return ShimHttpFindHandle(h) != nullptr;
+}
+
+inline HINTERNET WinHttpConnect(HINTERNET hSession, PCWSTR pszServerName, INTERNET_PORT nServerPort, DWORD)
+{
+    if (ShimHttpFindHandle(hSession) == nullptr)
+    {
+        return nullptr;
+    }
+    std::shared_ptr<SHIM_HINTERNET> pConnect = std::make_shared<SHIM_HINTERNET>();
+    pConnect->request.strHost = pszServerName;
+    pConnect->request.nPort = nServerPort;
+    return ShimHttpOpenHandle(pConnect);
+}
+
+inline HINTERNET WinHttpOpenRequest(HINTERNET hConnect, PCWSTR pszVerb, PCWSTR pszObjectName, PCWSTR, PCWSTR, PCWSTR *, DWORD dwFlags)
+{
+    std::shared_ptr<SHIM_HINTERNET> pConnect = ShimHttpFindHandle(hConnect);
+    if (pConnect == nullptr)
+    {
+        return nullptr;
+    }
+    std::shared_ptr<SHIM_HINTERNET> pRequest = std::make_shared<SHIM_HINTERNET>();
+    pRequest->request.strHost = pConnect->request.strHost;
+    pRequest->request.nPort = pConnect->request.nPort;
+    pRequest->request.fSecure = (dwFlags & WINHTTP_FLAG_SECURE) != 0;
+    pRequest->request.strVerb = (pszVerb != nullptr) ? pszVerb : L"GET";
+    pRequest->request.strPath = (pszObjectName != nullptr) ? pszObjectName : L"/";
+    return ShimHttpOpenHandle(pRequest);
+}
+
+inline BOOL WinHttpSetTimeouts(HINTERNET hRequest, int, int, int, int nReceiveTimeout)
+{
+    std::shared_ptr<SHIM_HINTERNET> pRequest = ShimHttpFindHandle(hRequest);
+    if (pRequest == nullptr)
+    {
+        return FALSE;
+    }
+    pRequest->request.dwReceiveTimeoutMs = static_cast<DWORD>(nReceiveTimeout);
+    return TRUE;
+}
+
+inline BOOL WinHttpSendRequest(HINTERNET hRequest, PCWSTR, DWORD, LPVOID pvOptional, DWORD cbOptional, DWORD, DWORD_PTR)
+{
+    std::shared_ptr<SHIM_HINTERNET> pRequest = ShimHttpFindHandle(hRequest);
+    if (pRequest == nullptr)
+    {
+        return FALSE;
+    }
+    if (pvOptional != nullptr)
+    {
+        pRequest->request.strBody.assign(static_cast<const char *>(pvOptional), cbOptional);
+    }
+    return TRUE;
+}
+
+inline BOOL WinHttpReceiveResponse(HINTERNET hRequest, LPVOID)
+{
+    std::shared_ptr<SHIM_HINTERNET> pRequest = ShimHttpFindHandle(hRequest);
+    if (pRequest == nullptr)
+    {
+        return FALSE;
+    }
+    DWORD dwStatusCode = ShimHttpHandler() ? ShimHttpHandler()(pRequest->request, &pRequest->strResponse) : 0;
+    if (WaitForSingleObject(pRequest->request.hAbort, 0) == WAIT_OBJECT_0)
+    {
+        SetLastError(ERROR_WINHTTP_OPERATION_CANCELLED);
+        return FALSE;
+    }
+    if (dwStatusCode == 0)
+    {
+        SetLastError(ERROR_WINHTTP_CANNOT_CONNECT);
+        return FALSE;
+    }
+    pRequest->dwStatusCode = dwStatusCode;
+    pRequest->fReceived = true;
+    return TRUE;
+}
+
+inline BOOL WinHttpQueryHeaders(HINTERNET hRequest, DWORD dwInfoLevel, PCWSTR, LPVOID pvBuffer, DWORD *pcbBuffer, DWORD *)
+{
+    std::shared_ptr<SHIM_HINTERNET> pRequest = ShimHttpFindHandle(hRequest);
+    if (pRequest == nullptr)
+    {
+        return FALSE;
+    }
+    if (dwInfoLevel != (WINHTTP_QUERY_STATUS_CODE | WINHTTP_QUERY_FLAG_NUMBER) || *pcbBuffer < sizeof(DWORD) || !pRequest->fReceived)
+    {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    *static_cast<DWORD *>(pvBuffer) = pRequest->dwStatusCode;
+    *pcbBuffer = sizeof(DWORD);
+    return TRUE;
+}
+
+inline BOOL WinHttpReadData(HINTERNET hRequest, LPVOID pvBuffer, DWORD cbToRead, DWORD *pcbRead)
+{
+    *pcbRead = 0;
+    std::shared_ptr<SHIM_HINTERNET> pRequest = ShimHttpFindHandle(hRequest);
+    if (pRequest == nullptr)
+    {
+        return FALSE;
+    }
+    size_t cbChunk = min(static_cast<size_t>(cbToRead), pRequest->strResponse.size() - pRequest->cbRead);
+    memcpy(pvBuffer, pRequest->strResponse.data() + pRequest->cbRead, cbChunk);
+    pRequest->cbRead += cbChunk;
+    *pcbRead = static_cast<DWORD>(cbChunk);
+    return TRUE;
+}
+
+inline BOOL WinHttpCloseHandle(HINTERNET h)
+{
+    std::shared_ptr<SHIM_HINTERNET> pHandle;
+    {
+        SHIM_HTTP_HANDLES &handles = ShimHttpHandles();
+        std::lock_guard<std::mutex> lock(handles.mutex);
+        auto it = handles.mapHandles.find(reinterpret_cast<uintptr_t>(h));
+        if (it == handles.mapHandles.end())
+        {
+            SetLastError(ERROR_INVALID_HANDLE);
+            return FALSE;
+        }
+        pHandle = it->second;
+        handles.mapHandles.erase(it);
+    }
+    SetEvent(pHandle->request.hAbort);
+    return TRUE;
+}
+
+// Splits scheme://host[:port][/path]; the scheme must be http or https.
+inline BOOL WinHttpCrackUrl(PCWSTR pszUrl, DWORD, DWORD, URL_COMPONENTS *pComponents)
+{
+    std::wstring strUrl(pszUrl);
+    size_t ichHost;
+    if (strUrl.compare(0, 8, L"https://") == 0)
+    {
+        pComponents->nScheme = INTERNET_SCHEME_HTTPS;
+        pComponents->nPort = INTERNET_DEFAULT_HTTPS_PORT;
+        ichHost = 8;
+    }
+    else if (strUrl.compare(0, 7, L"http://") == 0)
+    {
+        pComponents->nScheme = INTERNET_SCHEME_HTTP;
+        pComponents->nPort = INTERNET_DEFAULT_HTTP_PORT;
+        ichHost = 7;
+    }
+    else
+    {
+        SetLastError(ERROR_WINHTTP_INVALID_URL);
+        return FALSE;
+    }
+
+    size_t ichPath = strUrl.find(L'/', ichHost);
+    if (ichPath == std::wstring::npos)
+    {
+        ichPath = strUrl.size();
+    }
+    std::wstring strHost = strUrl.substr(ichHost, ichPath - ichHost);
+    std::wstring strPath = strUrl.substr(ichPath);
+    size_t ichPort = strHost.find(L':');
+    if (ichPort != std::wstring::npos)
+    {
+        pComponents->nPort = static_cast<INTERNET_PORT>(wcstoul(strHost.c_str() + ichPort + 1, nullptr, 10));
+        strHost.resize(ichPort);
+    }
+    if (strHost.empty() ||
+        (pComponents->lpszHostName != nullptr && strHost.size() >= pComponents->dwHostNameLength) ||
+        (pComponents->lpszUrlPath != nullptr && strPath.size() >= pComponents->dwUrlPathLength))
+    {
+        SetLastError(ERROR_WINHTTP_INVALID_URL);
+        return FALSE;
+    }
+    if (pComponents->lpszHostName != nullptr)
+    {
+        wcscpy(pComponents->lpszHostName, strHost.c_str());
+        pComponents->dwHostNameLength = static_cast<DWORD>(strHost.size());
+    }
+    if (pComponents->lpszUrlPath != nullptr)
+    {
+        wcscpy(pComponents->lpszUrlPath, strPath.c_str());
+        pComponents->dwUrlPathLength = static_cast<DWORD>(strPath.size());
+    }
+    return TRUE;
+}
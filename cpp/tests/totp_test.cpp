@@ -0,0 +1,442 @@
+// Tests for the TOTP code arithmetic (totpcore.cpp).
+//
+// totp.cpp keys the HMAC with BCrypt; here it is a plain SHA-1 and SHA-256 HMAC, keyed once like
+// the BCrypt object is, so this builds on Linux against the headers in tests/shim, under the
+// sanitizers:
+//
+//   g++ -std=c++14 -Wall -Wextra -Werror -Wno-unknown-pragmas -fsanitize=address,undefined
+//       -I cpp/tests/shim cpp/tests/totp_test.cpp cpp/totpcore.cpp -o totp_test
+//   ./totp_test
+//
+// The codes are checked against the RFC 4226 appendix D and RFC 6238 appendix B test vectors,
+// and the skew window and replay rules against codes computed the same way.
+//
+// Run with -b to measure how many verifications a second MatchTotpCode does with the default
+// window of one step either side; build with -O2 and without the sanitizers for that. The HMAC
+// here is not BCrypt's, so the numbers only compare changes to totpcore.cpp with each other.
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+#include "../totpcore.h"
+
+namespace
+{
+    int s_cFailures = 0;
+
+    void Check(bool fCondition, const char *pszTest, const char *pszWhat)
+    {
+        if (!fCondition)
+        {
+            fprintf(stderr, "FAIL %s: %s\n", pszTest, pszWhat);
+            s_cFailures++;
+        }
+    }
+
+    DWORD RotateLeft(DWORD dw, int cBits)
+    {
+        return (dw << cBits) | (dw >> (32 - cBits));
+    }
+
+    DWORD RotateRight(DWORD dw, int cBits)
+    {
+        return (dw >> cBits) | (dw << (32 - cBits));
+    }
+
+    DWORD ReadBigEndian(const BYTE *pb)
+    {
+        return (static_cast<DWORD>(pb[0]) << 24) | (static_cast<DWORD>(pb[1]) << 16) | (static_cast<DWORD>(pb[2]) << 8) | pb[3];
+    }
+
+    void WriteBigEndian(DWORD dw, BYTE *pb)
+    {
+        pb[0] = static_cast<BYTE>(dw >> 24);
+        pb[1] = static_cast<BYTE>(dw >> 16);
+        pb[2] = static_cast<BYTE>(dw >> 8);
+        pb[3] = static_cast<BYTE>(dw);
+    }
+
+    const DWORD c_cbBlock = 64;
+
+    // SHA-1 (FIPS 180-4) compression of one block.
+    void Sha1Block(DWORD *rgdwState, const BYTE *pbBlock)
+    {
+        DWORD rgdwW[80];
+        for (int i = 0; i < 16; i++)
+        {
+            rgdwW[i] = ReadBigEndian(pbBlock + 4 * i);
+        }
+        for (int i = 16; i < 80; i++)
+        {
+            rgdwW[i] = RotateLeft(rgdwW[i - 3] ^ rgdwW[i - 8] ^ rgdwW[i - 14] ^ rgdwW[i - 16], 1);
+        }
+        DWORD a = rgdwState[0], b = rgdwState[1], c = rgdwState[2], d = rgdwState[3], e = rgdwState[4];
+        for (int i = 0; i < 80; i++)
+        {
+            DWORD f, k;
+            if (i < 20)
+            {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            }
+            else if (i < 40)
+            {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            }
+            else if (i < 60)
+            {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            }
+            else
+            {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            DWORD t = RotateLeft(a, 5) + f + e + k + rgdwW[i];
+            e = d;
+            d = c;
+            c = RotateLeft(b, 30);
+            b = a;
+            a = t;
+        }
+        rgdwState[0] += a;
+        rgdwState[1] += b;
+        rgdwState[2] += c;
+        rgdwState[3] += d;
+        rgdwState[4] += e;
+    }
+
+    const DWORD c_rgdwSha256K[64] =
+    {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+
+    // SHA-256 (FIPS 180-4) compression of one block.
+    void Sha256Block(DWORD *rgdwState, const BYTE *pbBlock)
+    {
+        DWORD rgdwW[64];
+        for (int i = 0; i < 16; i++)
+        {
+            rgdwW[i] = ReadBigEndian(pbBlock + 4 * i);
+        }
+        for (int i = 16; i < 64; i++)
+        {
+            DWORD s0 = RotateRight(rgdwW[i - 15], 7) ^ RotateRight(rgdwW[i - 15], 18) ^ (rgdwW[i - 15] >> 3);
+            DWORD s1 = RotateRight(rgdwW[i - 2], 17) ^ RotateRight(rgdwW[i - 2], 19) ^ (rgdwW[i - 2] >> 10);
+            rgdwW[i] = rgdwW[i - 16] + s0 + rgdwW[i - 7] + s1;
+        }
+        DWORD rgdw[8];
+        memcpy(rgdw, rgdwState, sizeof(rgdw));
+        for (int i = 0; i < 64; i++)
+        {
+            DWORD s1 = RotateRight(rgdw[4], 6) ^ RotateRight(rgdw[4], 11) ^ RotateRight(rgdw[4], 25);
+            DWORD ch = (rgdw[4] & rgdw[5]) ^ (~rgdw[4] & rgdw[6]);
+            DWORD t1 = rgdw[7] + s1 + ch + c_rgdwSha256K[i] + rgdwW[i];
+            DWORD s0 = RotateRight(rgdw[0], 2) ^ RotateRight(rgdw[0], 13) ^ RotateRight(rgdw[0], 22);
+            DWORD maj = (rgdw[0] & rgdw[1]) ^ (rgdw[0] & rgdw[2]) ^ (rgdw[1] & rgdw[2]);
+            memmove(rgdw + 1, rgdw, 7 * sizeof(DWORD));
+            rgdw[4] += t1;
+            rgdw[0] = t1 + s0 + maj;
+        }
+        for (int i = 0; i < 8; i++)
+        {
+            rgdwState[i] += rgdw[i];
+        }
+    }
+
+    // HMAC-SHA-1 or HMAC-SHA-256 whose inner and outer pads are hashed once, when it is keyed,
+    // as BCryptCreateHash does for totp.cpp.
+    class CTestHmac : public ITotpHmac
+    {
+    public:
+        CTestHmac(bool fSha256, const char *pszSeed) : _fSha256(fSha256), _rgdwInner(), _rgdwOuter()
+        {
+            const DWORD rgdwSha1Init[] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+            const DWORD rgdwSha256Init[] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+            BYTE rgbInnerPad[c_cbBlock];
+            BYTE rgbOuterPad[c_cbBlock];
+            size_t cbSeed = strlen(pszSeed);
+            for (DWORD i = 0; i < c_cbBlock; i++)
+            {
+                BYTE bKey = (i < cbSeed) ? static_cast<BYTE>(pszSeed[i]) : 0;
+                rgbInnerPad[i] = bKey ^ 0x36;
+                rgbOuterPad[i] = bKey ^ 0x5c;
+            }
+            memcpy(_rgdwInner, fSha256 ? rgdwSha256Init : rgdwSha1Init, fSha256 ? sizeof(rgdwSha256Init) : sizeof(rgdwSha1Init));
+            memcpy(_rgdwOuter, _rgdwInner, sizeof(_rgdwInner));
+            _Block(_rgdwInner, rgbInnerPad);
+            _Block(_rgdwOuter, rgbOuterPad);
+        }
+
+        DWORD MacSize() const override
+        {
+            return _fSha256 ? 32 : 20;
+        }
+
+        // Only short messages, which fit in the block after the pad, are needed here.
+        HRESULT Compute(_In_reads_bytes_(cbMessage) const BYTE *pbMessage, DWORD cbMessage,
+                        _Out_writes_bytes_(c_cbMaxTotpMac) BYTE *pbMac) const override
+        {
+            if (cbMessage > c_cbBlock - 9)
+            {
+                return E_INVALIDARG;
+            }
+            BYTE rgbInner[c_cbMaxTotpMac];
+            _Finish(_rgdwInner, pbMessage, cbMessage, rgbInner);
+            _Finish(_rgdwOuter, rgbInner, MacSize(), pbMac);
+            return S_OK;
+        }
+
+    private:
+        void _Block(DWORD *rgdwState, const BYTE *pbBlock) const
+        {
+            if (_fSha256)
+            {
+                Sha256Block(rgdwState, pbBlock);
+            }
+            else
+            {
+                Sha1Block(rgdwState, pbBlock);
+            }
+        }
+
+        // Hashes pb, which follows one block already in rgdwState, as the last block.
+        void _Finish(const DWORD *rgdwState, const BYTE *pb, DWORD cb, BYTE *pbDigest) const
+        {
+            DWORD rgdw[8];
+            memcpy(rgdw, rgdwState, sizeof(rgdw));
+            BYTE rgbBlock[c_cbBlock] = {};
+            memcpy(rgbBlock, pb, cb);
+            rgbBlock[cb] = 0x80;
+            WriteBigEndian((c_cbBlock + cb) * 8, rgbBlock + c_cbBlock - 4);
+            _Block(rgdw, rgbBlock);
+            for (DWORD i = 0; i < MacSize() / 4; i++)
+            {
+                WriteBigEndian(rgdw[i], pbDigest + 4 * i);
+            }
+        }
+
+        bool    _fSha256;
+        DWORD   _rgdwInner[8];
+        DWORD   _rgdwOuter[8];
+    };
+
+    const char c_szRfcSeedSha1[] = "12345678901234567890";
+    const char c_szRfcSeedSha256[] = "12345678901234567890123456789012";
+
+    struct TEST_VECTOR
+    {
+        bool        fTime;
+        bool        fSha256;
+        BYTE        cDigits;
+        ULONGLONG   ullCounterOrTime;
+        DWORD       dwCode;
+    };
+
+    // RFC 4226 appendix D (HOTP, SHA-1, six digits) and RFC 6238 appendix B (TOTP, 30 second
+    // steps, eight digits), whose times are seconds since 1970.
+    const TEST_VECTOR c_rgTestVectors[] =
+    {
+        { false, false, 6, 0, 755224 },
+        { false, false, 6, 1, 287082 },
+        { false, false, 6, 2, 359152 },
+        { false, false, 6, 3, 969429 },
+        { false, false, 6, 4, 338314 },
+        { false, false, 6, 5, 254676 },
+        { false, false, 6, 6, 287922 },
+        { false, false, 6, 7, 162583 },
+        { false, false, 6, 8, 399871 },
+        { false, false, 6, 9, 520489 },
+        { true, false, 8, 59, 94287082 },
+        { true, false, 8, 1111111109, 7081804 },
+        { true, false, 8, 1111111111, 14050471 },
+        { true, false, 8, 1234567890, 89005924 },
+        { true, false, 8, 2000000000, 69279037 },
+        { true, false, 8, 20000000000, 65353130 },
+        { true, true, 8, 59, 46119246 },
+        { true, true, 8, 1111111109, 68084774 },
+        { true, true, 8, 1111111111, 67062674 },
+        { true, true, 8, 1234567890, 91819424 },
+        { true, true, 8, 2000000000, 90698825 },
+        { true, true, 8, 20000000000, 77737706 },
+    };
+
+    ULONGLONG UnixTime(ULONGLONG ullSeconds)
+    {
+        return c_ullTotpUnixEpoch + ullSeconds * c_ullTotpTicksPerSecond;
+    }
+
+    void FormatCode(DWORD dwCode, BYTE cDigits, wchar_t *pszCode, size_t cchCode)
+    {
+        swprintf(pszCode, cchCode, L"%0*u", static_cast<int>(cDigits), static_cast<unsigned>(dwCode));
+    }
+
+    void TestVectors()
+    {
+        const char *pszTest = "RFC vectors";
+        CTestHmac hmacSha1(false, c_szRfcSeedSha1);
+        CTestHmac hmacSha256(true, c_szRfcSeedSha256);
+        for (const TEST_VECTOR &vector : c_rgTestVectors)
+        {
+            const CTestHmac &hmac = vector.fSha256 ? hmacSha256 : hmacSha1;
+            ULONGLONG ullCounter = vector.fTime ? TotpTimeStep(UnixTime(vector.ullCounterOrTime), 30) : vector.ullCounterOrTime;
+            DWORD dwCode;
+            HRESULT hr = ComputeTotpCode(hmac, ullCounter, vector.cDigits, &dwCode);
+            if (hr != S_OK || dwCode != vector.dwCode)
+            {
+                fprintf(stderr, "FAIL %s: %s at %llu: got %0*u, expected %0*u\n", pszTest, vector.fSha256 ? "SHA-256" : "SHA-1",
+                        static_cast<unsigned long long>(vector.ullCounterOrTime), vector.cDigits, static_cast<unsigned>(dwCode),
+                        vector.cDigits, static_cast<unsigned>(vector.dwCode));
+                s_cFailures++;
+            }
+
+            // And the same code is accepted as typed.
+            wchar_t szCode[16];
+            FormatCode(vector.dwCode, vector.cDigits, szCode, ARRAYSIZE(szCode));
+            ULONGLONG ullMatched;
+            Check(MatchTotpCode(hmac, szCode, vector.cDigits, ullCounter, 1, 0, &ullMatched) == S_OK && ullMatched == ullCounter,
+                  pszTest, "vector code not matched");
+        }
+    }
+
+    void TestBase32()
+    {
+        const char *pszTest = "base32";
+        BYTE rgb[32];
+        DWORD cb;
+        // RFC 4648 section 10, and the RFC 4226 seed as authenticator apps are given it.
+        Check(DecodeBase32(L"MZXW6YTBOI======", rgb, sizeof(rgb), &cb) == S_OK && cb == 6 && memcmp(rgb, "foobar", 6) == 0,
+              pszTest, "foobar");
+        Check(DecodeBase32(L"gezd gnbv-gy3t qojq gezd gnbv gy3t qojq", rgb, sizeof(rgb), &cb) == S_OK && cb == 20 &&
+              memcmp(rgb, c_szRfcSeedSha1, 20) == 0, pszTest, "spaced lower-case seed");
+        Check(DecodeBase32(L"MZXW1", rgb, sizeof(rgb), &cb) == HRESULT_FROM_WIN32(ERROR_INVALID_DATA), pszTest, "digit 1 accepted");
+        Check(DecodeBase32(L"====", rgb, sizeof(rgb), &cb) == HRESULT_FROM_WIN32(ERROR_INVALID_DATA), pszTest, "empty seed accepted");
+        Check(DecodeBase32(L"MZXW6YTBOI", rgb, 5, &cb) == HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER), pszTest, "overflow not caught");
+    }
+
+    void TestParseCode()
+    {
+        const char *pszTest = "parse code";
+        DWORD dwCode;
+        Check(ParseTotpCode(L"012345", 6, &dwCode) && dwCode == 12345, pszTest, "leading zero");
+        Check(ParseTotpCode(L"94287082", 8, &dwCode) && dwCode == 94287082, pszTest, "eight digits");
+        Check(!ParseTotpCode(L"12345", 6, &dwCode), pszTest, "short code");
+        Check(!ParseTotpCode(L"1234567", 6, &dwCode), pszTest, "long code");
+        Check(!ParseTotpCode(L"12 456", 6, &dwCode), pszTest, "space");
+        Check(!ParseTotpCode(L"", 6, &dwCode), pszTest, "empty");
+    }
+
+    // One step either side of now, and nothing at or before the last step used.
+    void TestWindowAndReplay()
+    {
+        const char *pszTest = "window and replay";
+        CTestHmac hmac(false, c_szRfcSeedSha1);
+        ULONGLONG ullNow = TotpTimeStep(UnixTime(1234567890), 30);
+        wchar_t rgszCodes[5][16];
+        for (int i = 0; i < 5; i++)
+        {
+            DWORD dwCode;
+            ComputeTotpCode(hmac, ullNow - 2 + i, 6, &dwCode);
+            FormatCode(dwCode, 6, rgszCodes[i], ARRAYSIZE(rgszCodes[i]));
+        }
+
+        ULONGLONG ullMatched;
+        Check(MatchTotpCode(hmac, rgszCodes[2], 6, ullNow - 1, 3, 0, &ullMatched) == S_OK && ullMatched == ullNow, pszTest, "now refused");
+        Check(MatchTotpCode(hmac, rgszCodes[1], 6, ullNow - 1, 3, 0, &ullMatched) == S_OK && ullMatched == ullNow - 1, pszTest, "previous step refused");
+        Check(MatchTotpCode(hmac, rgszCodes[3], 6, ullNow - 1, 3, 0, &ullMatched) == S_OK && ullMatched == ullNow + 1, pszTest, "next step refused");
+        Check(MatchTotpCode(hmac, rgszCodes[0], 6, ullNow - 1, 3, 0, &ullMatched) == E_ACCESSDENIED, pszTest, "two steps back accepted");
+        Check(MatchTotpCode(hmac, rgszCodes[4], 6, ullNow - 1, 3, 0, &ullMatched) == E_ACCESSDENIED, pszTest, "two steps ahead accepted");
+
+        // Once a step is used, it and everything before it are refused.
+        Check(MatchTotpCode(hmac, rgszCodes[2], 6, ullNow - 1, 3, ullNow + 1, &ullMatched) == E_ACCESSDENIED, pszTest, "replay accepted");
+        Check(MatchTotpCode(hmac, rgszCodes[1], 6, ullNow - 1, 3, ullNow + 1, &ullMatched) == E_ACCESSDENIED, pszTest, "earlier step accepted");
+        Check(MatchTotpCode(hmac, rgszCodes[3], 6, ullNow - 1, 3, ullNow + 1, &ullMatched) == S_OK && ullMatched == ullNow + 1,
+              pszTest, "next step refused after use");
+
+        Check(MatchTotpCode(hmac, L"abcdef", 6, ullNow - 1, 3, 0, &ullMatched) == E_ACCESSDENIED, pszTest, "malformed code accepted");
+        Check(MatchTotpCode(hmac, L"", 6, ullNow - 1, 3, 0, &ullMatched) == E_ACCESSDENIED, pszTest, "empty code accepted");
+    }
+
+    // A code that turns up twice in the widest window (21 steps) matches at its first counter.
+    void TestFirstMatch()
+    {
+        const char *pszTest = "first match";
+        CTestHmac hmac(false, c_szRfcSeedSha1);
+        std::vector<ULONGLONG> vecLastSeen(1000000, ~0ull);
+        for (ULONGLONG ullCounter = 0; ullCounter < 1000000; ullCounter++)
+        {
+            DWORD dwCode;
+            ComputeTotpCode(hmac, ullCounter, 6, &dwCode);
+            ULONGLONG ullFirst = vecLastSeen[dwCode];
+            vecLastSeen[dwCode] = ullCounter;
+            if (ullFirst != ~0ull && ullCounter - ullFirst < 21)
+            {
+                wchar_t szCode[16];
+                FormatCode(dwCode, 6, szCode, ARRAYSIZE(szCode));
+                ULONGLONG ullMatched;
+                Check(MatchTotpCode(hmac, szCode, 6, ullFirst, 21, 0, &ullMatched) == S_OK && ullMatched == ullFirst, pszTest, "later counter matched");
+                return;
+            }
+        }
+        Check(false, pszTest, "no repeated code to check with");
+    }
+
+    void RunBenchmark(const char *pszName, bool fSha256, const char *pszSeed)
+    {
+        typedef std::chrono::steady_clock Clock;
+        CTestHmac hmac(fSha256, pszSeed);
+        ULONGLONG ullNow = TotpTimeStep(UnixTime(1234567890), 30);
+        DWORD dwCode;
+        ComputeTotpCode(hmac, ullNow, 6, &dwCode);
+        wchar_t szCode[16];
+        FormatCode(dwCode, 6, szCode, ARRAYSIZE(szCode));
+
+        unsigned long long cVerified = 0;
+        ULONGLONG ullSink = 0;
+        double dblSeconds = 0;
+        Clock::time_point tpStart = Clock::now();
+        do
+        {
+            for (int i = 0; i < 1000; i++)
+            {
+                ULONGLONG ullMatched;
+                MatchTotpCode(hmac, szCode, 6, ullNow - 1, 3, 0, &ullMatched);
+                ullSink += ullMatched;
+            }
+            cVerified += 1000;
+            dblSeconds = std::chrono::duration<double>(Clock::now() - tpStart).count();
+        } while (dblSeconds < 1.0);
+
+        printf("%-10s %12.0f verifications/s  (sink %llX)\n", pszName, cVerified / dblSeconds, static_cast<unsigned long long>(ullSink));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    {
+        RunBenchmark("SHA-1", false, c_szRfcSeedSha1);
+        RunBenchmark("SHA-256", true, c_szRfcSeedSha256);
+        return 0;
+    }
+
+    TestVectors();
+    TestBase32();
+    TestParseCode();
+    TestWindowAndReplay();
+    TestFirstMatch();
+
+    fprintf(stderr, "%d failures\n", s_cFailures);
+    return (s_cFailures == 0) ? 0 : 1;
+}
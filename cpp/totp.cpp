@@ -0,0 +1,567 @@
+#include "totp.h"
+#include <bcrypt.h>
+#include <sddl.h>
+#include <stdlib.h>
+#include <wincrypt.h>
+#include "totpcore.h"
+#include "utils.h"
+
+#ifndef NT_SUCCESS
+#define NT_SUCCESS(Status) (((NTSTATUS)(Status)) >= 0)
+#endif
+
+namespace
+{
+    const wchar_t c_szTotpKey[] = L"SOFTWARE\\sqcp\\Totp";
+    const wchar_t c_szUsedKey[] = L"SOFTWARE\\sqcp\\Totp\\Used";
+    const char c_szSealEntropy[] = "sqcp-totp-seed";
+
+    const BYTE c_bSeedVersion = 1;
+    const DWORD c_cbMaxSeed = 64;
+    const DWORD c_cbMaxSealedSeed = 1024;
+    const DWORD c_cbMaxHashObject = 1024;
+    const BYTE c_bMaxWindow = 10;
+    const DWORD c_cCachedVerifiers = 8;
+
+    enum TOTP_KIND : BYTE
+    {
+        TOTP_KIND_TIME      = 0,
+        TOTP_KIND_COUNTER   = 1,
+    };
+
+    enum TOTP_ALGORITHM : BYTE
+    {
+        TOTP_ALGORITHM_SHA1     = 0,
+        TOTP_ALGORITHM_SHA256   = 1,
+    };
+
+    // What SealTotpSeedW seals for one user.
+#pragma pack(push, 1)
+    struct TOTP_SEED_RECORD
+    {
+        BYTE        bVersion;
+        BYTE        bKind;
+        BYTE        bAlgorithm;
+        BYTE        cDigits;
+        WORD        wPeriod;
+        BYTE        bWindow;
+        BYTE        cbSeed;
+        BYTE        rgbSeed[c_cbMaxSeed];
+    };
+#pragma pack(pop)
+
+    // A user's keyed HMAC object, ready to be duplicated for each candidate code.
+    struct TOTP_VERIFIER
+    {
+        wchar_t             szSid[SECURITY_MAX_SID_STRING_CHARACTERS];
+        ULONGLONG           ullLastUse;
+        BCRYPT_HASH_HANDLE  hHmac;
+        DWORD               cbMac;
+        BYTE                bKind;
+        BYTE                cDigits;
+        BYTE                bWindow;
+        WORD                wPeriod;
+        BYTE                rgbHashObject[c_cbMaxHashObject];
+    };
+
+    INIT_ONCE s_initProviders = INIT_ONCE_STATIC_INIT;
+    BCRYPT_ALG_HANDLE s_rghAlgorithms[2] = {};
+    DWORD s_rgcbHashObject[2] = {};
+
+    SRWLOCK s_srwVerifiers = SRWLOCK_INIT;
+    TOTP_VERIFIER s_rgVerifiers[c_cCachedVerifiers] = {};
+    FILETIME s_ftSeedsWritten = {};
+
+    ULONGLONG CurrentTime()
+    {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        return (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    }
+
+    BOOL CALLBACK OpenProviders(PINIT_ONCE, PVOID, PVOID *)
+    {
+        const PCWSTR rgpszAlgorithms[] = { BCRYPT_SHA1_ALGORITHM, BCRYPT_SHA256_ALGORITHM };
+        for (DWORD i = 0; i < ARRAYSIZE(rgpszAlgorithms); i++)
+        {
+            DWORD cbResult;
+            if (!NT_SUCCESS(BCryptOpenAlgorithmProvider(&s_rghAlgorithms[i], rgpszAlgorithms[i], nullptr, BCRYPT_ALG_HANDLE_HMAC_FLAG)) ||
+                !NT_SUCCESS(BCryptGetProperty(s_rghAlgorithms[i], BCRYPT_OBJECT_LENGTH, reinterpret_cast<PUCHAR>(&s_rgcbHashObject[i]), sizeof(s_rgcbHashObject[i]), &cbResult, 0)) ||
+                s_rgcbHashObject[i] > c_cbMaxHashObject)
+            {
+                WriteLogMessage(L"[TOTP] HMAC providers unavailable");
+                return FALSE;
+            }
+        }
+        return TRUE;
+    }
+
+    // Whether the seeds were re-provisioned since the verifiers were built; drops them if so.
+    // Called with s_srwVerifiers held exclusively.
+    void DropStaleVerifiers()
+    {
+        HKEY hkey;
+        FILETIME ftWritten = {};
+        if (RegOpenKeyExW(HKEY_LOCAL_MACHINE, c_szTotpKey, 0, KEY_QUERY_VALUE, &hkey) == ERROR_SUCCESS)
+        {
+            RegQueryInfoKeyW(hkey, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, &ftWritten);
+            RegCloseKey(hkey);
+        }
+        if (CompareFileTime(&ftWritten, &s_ftSeedsWritten) != 0)
+        {
+            for (DWORD i = 0; i < ARRAYSIZE(s_rgVerifiers); i++)
+            {
+                if (s_rgVerifiers[i].hHmac != nullptr)
+                {
+                    BCryptDestroyHash(s_rgVerifiers[i].hHmac);
+                }
+                SecureZeroMemory(&s_rgVerifiers[i], sizeof(s_rgVerifiers[i]));
+            }
+            s_ftSeedsWritten = ftWritten;
+        }
+    }
+
+    HRESULT UnsealSeed(_In_ PCWSTR pszUserSid, _Out_ TOTP_SEED_RECORD *pRecord)
+    {
+        ZeroMemory(pRecord, sizeof(*pRecord));
+
+        BYTE rgbSealed[c_cbMaxSealedSeed];
+        DWORD cbSealed = sizeof(rgbSealed);
+        LONG lResult = RegGetValueW(HKEY_LOCAL_MACHINE, c_szTotpKey, pszUserSid, RRF_RT_REG_BINARY, nullptr, rgbSealed, &cbSealed);
+        if (lResult != ERROR_SUCCESS)
+        {
+            // A process outside SYSTEM and Administrators cannot open the key, and has no seeds.
+            return (lResult == ERROR_FILE_NOT_FOUND || lResult == ERROR_ACCESS_DENIED) ? HRESULT_FROM_WIN32(ERROR_NOT_FOUND) : HRESULT_FROM_WIN32(lResult);
+        }
+
+        DATA_BLOB blobSealed = { cbSealed, rgbSealed };
+        DATA_BLOB blobEntropy = { sizeof(c_szSealEntropy), reinterpret_cast<BYTE *>(const_cast<char *>(c_szSealEntropy)) };
+        DATA_BLOB blobRecord = {};
+        if (!CryptUnprotectData(&blobSealed, nullptr, &blobEntropy, nullptr, nullptr, CRYPTPROTECT_UI_FORBIDDEN, &blobRecord))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        HRESULT hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        if (blobRecord.cbData == sizeof(*pRecord))
+        {
+            CopyMemory(pRecord, blobRecord.pbData, sizeof(*pRecord));
+            if (pRecord->bVersion == c_bSeedVersion &&
+                pRecord->bKind <= TOTP_KIND_COUNTER &&
+                pRecord->bAlgorithm <= TOTP_ALGORITHM_SHA256 &&
+                pRecord->cDigits >= 6 && pRecord->cDigits <= 8 &&
+                pRecord->wPeriod > 0 &&
+                pRecord->bWindow <= c_bMaxWindow &&
+                pRecord->cbSeed > 0 && pRecord->cbSeed <= c_cbMaxSeed)
+            {
+                hr = S_OK;
+            }
+        }
+        SecureZeroMemory(blobRecord.pbData, blobRecord.cbData);
+        LocalFree(blobRecord.pbData);
+        if (FAILED(hr))
+        {
+            SecureZeroMemory(pRecord, sizeof(*pRecord));
+        }
+        return hr;
+    }
+
+    void DestroyVerifier(_Inout_ TOTP_VERIFIER *pVerifier)
+    {
+        if (pVerifier->hHmac != nullptr)
+        {
+            BCryptDestroyHash(pVerifier->hHmac);
+        }
+        SecureZeroMemory(pVerifier, sizeof(*pVerifier));
+    }
+
+    // Keys an empty verifier with record's seed. The providers must be open.
+    HRESULT KeyVerifier(_In_ const TOTP_SEED_RECORD &record, _Inout_ TOTP_VERIFIER *pVerifier)
+    {
+        // Creating the keyed object hashes the inner pad, and keeps the outer one, once.
+        NTSTATUS status = BCryptCreateHash(s_rghAlgorithms[record.bAlgorithm], &pVerifier->hHmac,
+                                           pVerifier->rgbHashObject, s_rgcbHashObject[record.bAlgorithm],
+                                           const_cast<PUCHAR>(record.rgbSeed), record.cbSeed, 0);
+        if (!NT_SUCCESS(status))
+        {
+            pVerifier->hHmac = nullptr;
+            return HRESULT_FROM_NT(status);
+        }
+        pVerifier->ullLastUse = CurrentTime();
+        pVerifier->cbMac = (record.bAlgorithm == TOTP_ALGORITHM_SHA256) ? 32 : 20;
+        pVerifier->bKind = record.bKind;
+        pVerifier->cDigits = record.cDigits;
+        pVerifier->bWindow = record.bWindow;
+        pVerifier->wPeriod = record.wPeriod;
+        return S_OK;
+    }
+
+    // Returns the cached verifier for pszUserSid, building it from the sealed seed on a miss by
+    // replacing the least recently used one. Called with s_srwVerifiers held exclusively.
+    HRESULT FindVerifier(_In_ PCWSTR pszUserSid, _Outptr_ TOTP_VERIFIER **ppVerifier)
+    {
+        *ppVerifier = nullptr;
+        TOTP_VERIFIER *pVictim = &s_rgVerifiers[0];
+        for (DWORD i = 0; i < ARRAYSIZE(s_rgVerifiers); i++)
+        {
+            TOTP_VERIFIER *pVerifier = &s_rgVerifiers[i];
+            if (pVerifier->hHmac != nullptr && CompareStringOrdinal(pVerifier->szSid, -1, pszUserSid, -1, TRUE) == CSTR_EQUAL)
+            {
+                pVerifier->ullLastUse = CurrentTime();
+                *ppVerifier = pVerifier;
+                return S_OK;
+            }
+            if (pVerifier->ullLastUse < pVictim->ullLastUse)
+            {
+                pVictim = pVerifier;
+            }
+        }
+
+        if (!InitOnceExecuteOnce(&s_initProviders, OpenProviders, nullptr, nullptr))
+        {
+            return E_UNEXPECTED;
+        }
+
+        TOTP_SEED_RECORD record;
+        HRESULT hr = UnsealSeed(pszUserSid, &record);
+        if (SUCCEEDED(hr))
+        {
+            DestroyVerifier(pVictim);
+            hr = KeyVerifier(record, pVictim);
+            if (SUCCEEDED(hr))
+            {
+                hr = StringCchCopyW(pVictim->szSid, ARRAYSIZE(pVictim->szSid), pszUserSid);
+            }
+            if (SUCCEEDED(hr))
+            {
+                *ppVerifier = pVictim;
+            }
+            else
+            {
+                DestroyVerifier(pVictim);
+            }
+        }
+        SecureZeroMemory(&record, sizeof(record));
+        return hr;
+    }
+
+    // A verifier's keyed HMAC object. Each MAC is computed on a copy of it.
+    class CVerifierHmac : public ITotpHmac
+    {
+    public:
+        explicit CVerifierHmac(_In_ const TOTP_VERIFIER *pVerifier) : _pVerifier(pVerifier)
+        {
+        }
+
+        DWORD MacSize() const override
+        {
+            return _pVerifier->cbMac;
+        }
+
+        HRESULT Compute(_In_reads_bytes_(cbMessage) const BYTE *pbMessage, DWORD cbMessage,
+                        _Out_writes_bytes_(c_cbMaxTotpMac) BYTE *pbMac) const override
+        {
+            BYTE rgbHashObject[c_cbMaxHashObject];
+            BCRYPT_HASH_HANDLE hHmac;
+            NTSTATUS status = BCryptDuplicateHash(_pVerifier->hHmac, &hHmac, rgbHashObject, sizeof(rgbHashObject), 0);
+            if (NT_SUCCESS(status))
+            {
+                status = BCryptHashData(hHmac, const_cast<PUCHAR>(pbMessage), cbMessage, 0);
+                if (NT_SUCCESS(status))
+                {
+                    status = BCryptFinishHash(hHmac, pbMac, _pVerifier->cbMac, 0);
+                }
+                BCryptDestroyHash(hHmac);
+            }
+            SecureZeroMemory(rgbHashObject, sizeof(rgbHashObject));
+            return NT_SUCCESS(status) ? S_OK : HRESULT_FROM_NT(status);
+        }
+
+    private:
+        const TOTP_VERIFIER *_pVerifier;
+    };
+
+    // The first counter (or time step) the user may still use.
+    ULONGLONG ReadNextCounter(_In_ PCWSTR pszUserSid)
+    {
+        ULONGLONG ullNext = 0;
+        DWORD cbData = sizeof(ullNext);
+        if (RegGetValueW(HKEY_LOCAL_MACHINE, c_szUsedKey, pszUserSid, RRF_RT_REG_QWORD, nullptr, &ullNext, &cbData) != ERROR_SUCCESS)
+        {
+            ullNext = 0;
+        }
+        return ullNext;
+    }
+
+    HRESULT WriteNextCounter(_In_ PCWSTR pszUserSid, ULONGLONG ullNext)
+    {
+        return HRESULT_FROM_WIN32(RegSetKeyValueW(HKEY_LOCAL_MACHINE, c_szUsedKey, pszUserSid, REG_QWORD, &ullNext, sizeof(ullNext)));
+    }
+
+    // Published test vectors: RFC 4226 appendix D (HOTP, SHA-1, six digits) and RFC 6238
+    // appendix B (TOTP, 30 second steps, eight digits), whose times are seconds since 1970.
+    struct TOTP_TEST_VECTOR
+    {
+        TOTP_KIND       kind;
+        TOTP_ALGORITHM  algorithm;
+        BYTE            cDigits;
+        ULONGLONG       ullCounterOrTime;
+        DWORD           dwCode;
+    };
+
+    const char c_szRfcSeedSha1[] = "12345678901234567890";
+    const char c_szRfcSeedSha256[] = "12345678901234567890123456789012";
+
+    const TOTP_TEST_VECTOR c_rgTestVectors[] =
+    {
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 0, 755224 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 1, 287082 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 2, 359152 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 3, 969429 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 4, 338314 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 5, 254676 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 6, 287922 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 7, 162583 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 8, 399871 },
+        { TOTP_KIND_COUNTER, TOTP_ALGORITHM_SHA1, 6, 9, 520489 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA1, 8, 59, 94287082 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA1, 8, 1111111109, 7081804 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA1, 8, 1111111111, 14050471 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA1, 8, 1234567890, 89005924 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA1, 8, 2000000000, 69279037 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA1, 8, 20000000000, 65353130 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA256, 8, 59, 46119246 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA256, 8, 1111111109, 68084774 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA256, 8, 1111111111, 67062674 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA256, 8, 1234567890, 91819424 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA256, 8, 2000000000, 90698825 },
+        { TOTP_KIND_TIME, TOTP_ALGORITHM_SHA256, 8, 20000000000, 77737706 },
+    };
+
+    // Runs one test vector through the same keying, time step and truncation as a real code.
+    HRESULT RunTestVector(_In_ const TOTP_TEST_VECTOR &vector, _Out_ DWORD *pdwCode)
+    {
+        *pdwCode = 0;
+        TOTP_SEED_RECORD record = {};
+        record.bVersion = c_bSeedVersion;
+        record.bKind = vector.kind;
+        record.bAlgorithm = vector.algorithm;
+        record.cDigits = vector.cDigits;
+        record.wPeriod = 30;
+        const char *pszSeed = (vector.algorithm == TOTP_ALGORITHM_SHA256) ? c_szRfcSeedSha256 : c_szRfcSeedSha1;
+        record.cbSeed = static_cast<BYTE>(strlen(pszSeed));
+        CopyMemory(record.rgbSeed, pszSeed, record.cbSeed);
+
+        TOTP_VERIFIER verifier = {};
+        HRESULT hr = KeyVerifier(record, &verifier);
+        if (SUCCEEDED(hr))
+        {
+            ULONGLONG ullCounter = (vector.kind == TOTP_KIND_TIME) ?
+                TotpTimeStep(c_ullTotpUnixEpoch + vector.ullCounterOrTime * c_ullTotpTicksPerSecond, verifier.wPeriod) :
+                vector.ullCounterOrTime;
+            hr = ComputeTotpCode(CVerifierHmac(&verifier), ullCounter, verifier.cDigits, pdwCode);
+        }
+        DestroyVerifier(&verifier);
+        return hr;
+    }
+
+    // Applies one SealTotpSeedW option to pRecord.
+    HRESULT ParseSeedOption(_In_ PCWSTR pszOption, _Inout_ TOTP_SEED_RECORD *pRecord)
+    {
+        if (_wcsicmp(pszOption, L"totp") == 0)
+        {
+            pRecord->bKind = TOTP_KIND_TIME;
+        }
+        else if (_wcsicmp(pszOption, L"hotp") == 0)
+        {
+            pRecord->bKind = TOTP_KIND_COUNTER;
+        }
+        else if (_wcsicmp(pszOption, L"sha1") == 0)
+        {
+            pRecord->bAlgorithm = TOTP_ALGORITHM_SHA1;
+        }
+        else if (_wcsicmp(pszOption, L"sha256") == 0)
+        {
+            pRecord->bAlgorithm = TOTP_ALGORITHM_SHA256;
+        }
+        else if (_wcsnicmp(pszOption, L"digits=", 7) == 0)
+        {
+            pRecord->cDigits = static_cast<BYTE>(wcstoul(pszOption + 7, nullptr, 10));
+        }
+        else if (_wcsnicmp(pszOption, L"period=", 7) == 0)
+        {
+            pRecord->wPeriod = static_cast<WORD>(wcstoul(pszOption + 7, nullptr, 10));
+        }
+        else if (_wcsnicmp(pszOption, L"window=", 7) == 0)
+        {
+            pRecord->bWindow = static_cast<BYTE>(wcstoul(pszOption + 7, nullptr, 10));
+        }
+        else
+        {
+            return E_INVALIDARG;
+        }
+        return S_OK;
+    }
+}
+
+HRESULT HasLocalTotpSeed(_In_ PCWSTR pszUserSid)
+{
+    if (*pszUserSid == L'\0')
+    {
+        return S_FALSE;
+    }
+    DWORD cbSealed = 0;
+    return (RegGetValueW(HKEY_LOCAL_MACHINE, c_szTotpKey, pszUserSid, RRF_RT_REG_BINARY, nullptr, nullptr, &cbSealed) == ERROR_SUCCESS) ? S_OK : S_FALSE;
+}
+
+HRESULT VerifyLocalTotpCode(_In_ PCWSTR pszUserSid, _In_ PCWSTR pszCode)
+{
+    if (*pszUserSid == L'\0')
+    {
+        return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+    }
+
+    AcquireSRWLockExclusive(&s_srwVerifiers);
+    DropStaleVerifiers();
+
+    TOTP_VERIFIER *pVerifier;
+    HRESULT hr = FindVerifier(pszUserSid, &pVerifier);
+    if (SUCCEEDED(hr))
+    {
+        ULONGLONG ullNext = ReadNextCounter(pszUserSid);
+        ULONGLONG ullFirst;
+        DWORD cCandidates = 2 * static_cast<DWORD>(pVerifier->bWindow) + 1;
+        if (pVerifier->bKind == TOTP_KIND_TIME)
+        {
+            ULONGLONG ullStep = TotpTimeStep(CurrentTime(), pVerifier->wPeriod);
+            ullFirst = ullStep - pVerifier->bWindow;
+        }
+        else
+        {
+            ullFirst = ullNext;
+        }
+
+        ULONGLONG ullMatched;
+        hr = MatchTotpCode(CVerifierHmac(pVerifier), pszCode, pVerifier->cDigits, ullFirst, cCandidates, ullNext, &ullMatched);
+        if (SUCCEEDED(hr))
+        {
+            hr = WriteNextCounter(pszUserSid, ullMatched + 1);
+        }
+    }
+    ReleaseSRWLockExclusive(&s_srwVerifiers);
+
+    wchar_t buffer[128] = {};
+    if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[TOTP] local code verified hr=0x%08X", hr)))
+    {
+        WriteLogMessage(buffer);
+    }
+    return hr;
+}
+
+EXTERN_C void CALLBACK SealTotpSeedW(HWND /*hwnd*/, HINSTANCE /*hinst*/, LPWSTR pszCmdLine, int /*nCmdShow*/)
+{
+    TOTP_SEED_RECORD record = {};
+    record.bVersion = c_bSeedVersion;
+    record.bKind = TOTP_KIND_TIME;
+    record.bAlgorithm = TOTP_ALGORITHM_SHA1;
+    record.cDigits = 6;
+    record.wPeriod = 30;
+    record.bWindow = 1;
+
+    PWSTR pszContext = nullptr;
+    PWSTR pszSid = wcstok_s(pszCmdLine, L" \t", &pszContext);
+    PWSTR pszSecret = (pszSid != nullptr) ? wcstok_s(nullptr, L" \t", &pszContext) : nullptr;
+    DWORD cbSeed = 0;
+    HRESULT hr = (pszSecret != nullptr) ? DecodeBase32(pszSecret, record.rgbSeed, sizeof(record.rgbSeed), &cbSeed) : E_INVALIDARG;
+    record.cbSeed = static_cast<BYTE>(cbSeed);
+    for (PWSTR pszOption = wcstok_s(nullptr, L" \t", &pszContext); pszOption != nullptr && SUCCEEDED(hr); pszOption = wcstok_s(nullptr, L" \t", &pszContext))
+    {
+        hr = ParseSeedOption(pszOption, &record);
+    }
+    if (SUCCEEDED(hr) &&
+        (record.cDigits < 6 || record.cDigits > 8 || record.wPeriod == 0 || record.bWindow > c_bMaxWindow))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    PSID psid = nullptr;
+    if (SUCCEEDED(hr) && !ConvertStringSidToSidW(pszSid, &psid))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    LocalFree(psid);
+
+    DATA_BLOB blobRecord = { sizeof(record), reinterpret_cast<BYTE *>(&record) };
+    DATA_BLOB blobEntropy = { sizeof(c_szSealEntropy), reinterpret_cast<BYTE *>(const_cast<char *>(c_szSealEntropy)) };
+    DATA_BLOB blobSealed = {};
+    if (SUCCEEDED(hr) &&
+        !CryptProtectData(&blobRecord, nullptr, &blobEntropy, nullptr, nullptr, CRYPTPROTECT_LOCAL_MACHINE | CRYPTPROTECT_UI_FORBIDDEN, &blobSealed))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    // Machine DPAPI lets any local account unseal the value, so only the key's DACL keeps the
+    // seeds private. Keys from before they were secured get the DACL put back on here.
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateSystemOnlyKey(c_szTotpKey);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateSystemOnlyKey(c_szUsedKey);
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = HRESULT_FROM_WIN32(RegSetKeyValueW(HKEY_LOCAL_MACHINE, c_szTotpKey, pszSid, REG_BINARY, blobSealed.pbData, blobSealed.cbData));
+    }
+    if (SUCCEEDED(hr))
+    {
+        hr = WriteNextCounter(pszSid, 0);
+    }
+    LocalFree(blobSealed.pbData);
+    SecureZeroMemory(&record, sizeof(record));
+    if (pszSecret != nullptr)
+    {
+        SecureZeroMemory(pszSecret, wcslen(pszSecret) * sizeof(wchar_t));
+    }
+
+    wchar_t buffer[160] = {};
+    if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[TOTP] seal seed for %s hr=0x%08X", (pszSid != nullptr) ? pszSid : L"(none)", hr)))
+    {
+        WriteLogMessage(buffer);
+    }
+}
+
+EXTERN_C void CALLBACK SelfTestTotpW(HWND /*hwnd*/, HINSTANCE /*hinst*/, LPWSTR /*pszCmdLine*/, int /*nCmdShow*/)
+{
+    HRESULT hr = InitOnceExecuteOnce(&s_initProviders, OpenProviders, nullptr, nullptr) ? S_OK : E_UNEXPECTED;
+    DWORD cPassed = 0;
+    for (DWORD i = 0; i < ARRAYSIZE(c_rgTestVectors) && SUCCEEDED(hr); i++)
+    {
+        DWORD dwCode;
+        hr = RunTestVector(c_rgTestVectors[i], &dwCode);
+        if (SUCCEEDED(hr) && dwCode == c_rgTestVectors[i].dwCode)
+        {
+            cPassed++;
+        }
+        else if (SUCCEEDED(hr))
+        {
+            wchar_t buffer[128] = {};
+            if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[TOTP] self-test vector %u: got %0*u, expected %0*u",
+                                           i, c_rgTestVectors[i].cDigits, dwCode, c_rgTestVectors[i].cDigits, c_rgTestVectors[i].dwCode)))
+            {
+                WriteLogMessage(buffer);
+            }
+        }
+    }
+    if (SUCCEEDED(hr) && cPassed != ARRAYSIZE(c_rgTestVectors))
+    {
+        hr = E_FAIL;
+    }
+
+    wchar_t buffer[96] = {};
+    if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[TOTP] self-test %u of %u vectors passed hr=0x%08X",
+                                   cPassed, static_cast<DWORD>(ARRAYSIZE(c_rgTestVectors)), hr)))
+    {
+        WriteLogMessage(buffer);
+    }
+}
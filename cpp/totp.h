@@ -0,0 +1,45 @@
+#pragma once
+
+#include "helpers.h"
+
+// Offline authenticator app codes (RFC 4226 HOTP and RFC 6238 TOTP).
+//
+// SendQuick provisions each user's app seed to the machine as well, so app codes can be checked
+// here while the gateway cannot be reached. Seeds live under HKLM\SOFTWARE\sqcp\Totp as one
+// REG_BINARY value per user SID, sealed with machine DPAPI; the last counter or time step each
+// user has used is kept next to them in Totp\Used, so no code is accepted twice. Any local
+// account can unseal a machine DPAPI blob, so both keys are readable by SYSTEM and Administrators
+// only; CredUI in a user's session cannot open them and treats every user as having no seed.
+//
+// A user's seed is unsealed once into a keyed BCrypt HMAC object that is kept for the life of the
+// process. Every candidate code then starts from a copy of that object, so the key schedule is
+// not redone per code. All codes in the skew window are computed and compared without an early
+// exit, on stack buffers only. The code arithmetic itself is in totpcore.h.
+
+// Returns S_OK when a seed is provisioned for pszUserSid and S_FALSE when not.
+HRESULT HasLocalTotpSeed(_In_ PCWSTR pszUserSid);
+
+// Returns S_OK when pszCode is valid for pszUserSid and has not been used, E_ACCESSDENIED when
+// it is not, and HRESULT_FROM_WIN32(ERROR_NOT_FOUND) when the user has no seed.
+HRESULT VerifyLocalTotpCode(_In_ PCWSTR pszUserSid, _In_ PCWSTR pszCode);
+
+// rundll32 entry point: rundll32 SampleV2CredentialProvider.dll,SealTotpSeed <SID> <secret> [options]
+//
+// <secret> is the base32 seed the authenticator app was enrolled with. Options, in any order:
+//
+//  totp | hotp                 Time or counter based (totp when omitted).
+//  sha1 | sha256               HMAC algorithm (sha1 when omitted).
+//  digits=<n>                  Code length, 6 to 8 (6 when omitted).
+//  period=<s>                  TOTP time step in seconds (30 when omitted).
+//  window=<n>                  TOTP steps accepted on either side of now; HOTP looks 2n
+//                              counters ahead (1 when omitted).
+//
+// Sealing a seed also resets the user's used counter. Results go to the log.
+EXTERN_C void CALLBACK SealTotpSeedW(HWND hwnd, HINSTANCE hinst, LPWSTR pszCmdLine, int nCmdShow);
+
+// rundll32 entry point: rundll32 SampleV2CredentialProvider.dll,SelfTestTotp
+//
+// Checks code generation against the RFC 4226 appendix D and RFC 6238 appendix B test vectors,
+// with the same HMAC keying, time steps and truncation as real codes. Touches no seed. Results go
+// to the log.
+EXTERN_C void CALLBACK SelfTestTotpW(HWND hwnd, HINSTANCE hinst, LPWSTR pszCmdLine, int nCmdShow);
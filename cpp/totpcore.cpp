@@ -0,0 +1,137 @@
+#include "totpcore.h"
+
+namespace
+{
+    const DWORD c_rgdwPowersOfTen[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+}
+
+HRESULT DecodeBase32(_In_ PCWSTR pszText, _Out_writes_bytes_to_(cbMax, *pcb) BYTE *pb, DWORD cbMax, _Out_ DWORD *pcb)
+{
+    *pcb = 0;
+    DWORD dwBuffer = 0;
+    DWORD cBits = 0;
+    for (; *pszText != L'\0'; pszText++)
+    {
+        wchar_t ch = *pszText;
+        DWORD dwValue;
+        if (ch >= L'a' && ch <= L'z')
+        {
+            dwValue = static_cast<DWORD>(ch - L'a');
+        }
+        else if (ch >= L'A' && ch <= L'Z')
+        {
+            dwValue = static_cast<DWORD>(ch - L'A');
+        }
+        else if (ch >= L'2' && ch <= L'7')
+        {
+            dwValue = static_cast<DWORD>(ch - L'2') + 26;
+        }
+        else if (ch == L'=' || ch == L' ' || ch == L'-')
+        {
+            continue;
+        }
+        else
+        {
+            return HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        }
+
+        dwBuffer = (dwBuffer << 5) | dwValue;
+        cBits += 5;
+        if (cBits >= 8)
+        {
+            if (*pcb >= cbMax)
+            {
+                return HRESULT_FROM_WIN32(ERROR_INSUFFICIENT_BUFFER);
+            }
+            cBits -= 8;
+            pb[(*pcb)++] = static_cast<BYTE>(dwBuffer >> cBits);
+        }
+    }
+    return (*pcb > 0) ? S_OK : HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+}
+
+bool ParseTotpCode(_In_ PCWSTR pszCode, BYTE cDigits, _Out_ DWORD *pdwCode)
+{
+    *pdwCode = 0;
+    DWORD i = 0;
+    for (; pszCode[i] != L'\0'; i++)
+    {
+        if (i >= cDigits || pszCode[i] < L'0' || pszCode[i] > L'9')
+        {
+            return false;
+        }
+        *pdwCode = *pdwCode * 10 + static_cast<DWORD>(pszCode[i] - L'0');
+    }
+    return i == cDigits;
+}
+
+ULONGLONG TotpTimeStep(ULONGLONG ullTime, WORD wPeriod)
+{
+    return (ullTime - c_ullTotpUnixEpoch) / c_ullTotpTicksPerSecond / wPeriod;
+}
+
+HRESULT ComputeTotpCode(_In_ const ITotpHmac &hmac, ULONGLONG ullCounter, BYTE cDigits, _Out_ DWORD *pdwCode)
+{
+    *pdwCode = 0;
+    DWORD cbMac = hmac.MacSize();
+    if (cDigits >= ARRAYSIZE(c_rgdwPowersOfTen) || cbMac < 20 || cbMac > c_cbMaxTotpMac)
+    {
+        return E_INVALIDARG;
+    }
+
+    BYTE rgbCounter[8];
+    BYTE rgbMac[c_cbMaxTotpMac];
+    for (int i = 7; i >= 0; i--)
+    {
+        rgbCounter[i] = static_cast<BYTE>(ullCounter);
+        ullCounter >>= 8;
+    }
+    HRESULT hr = hmac.Compute(rgbCounter, sizeof(rgbCounter), rgbMac);
+    if (SUCCEEDED(hr))
+    {
+        DWORD iOffset = rgbMac[cbMac - 1] & 0x0f;
+        DWORD dwBinary = (static_cast<DWORD>(rgbMac[iOffset] & 0x7f) << 24) |
+                         (static_cast<DWORD>(rgbMac[iOffset + 1]) << 16) |
+                         (static_cast<DWORD>(rgbMac[iOffset + 2]) << 8) |
+                         static_cast<DWORD>(rgbMac[iOffset + 3]);
+        *pdwCode = dwBinary % c_rgdwPowersOfTen[cDigits];
+    }
+    SecureZeroMemory(rgbMac, sizeof(rgbMac));
+    return hr;
+}
+
+HRESULT MatchTotpCode(_In_ const ITotpHmac &hmac, _In_ PCWSTR pszCode, BYTE cDigits, ULONGLONG ullFirst, DWORD cCandidates,
+                      ULONGLONG ullNext, _Out_ ULONGLONG *pullMatched)
+{
+    *pullMatched = 0;
+    DWORD dwTyped;
+    bool fWellFormed = ParseTotpCode(pszCode, cDigits, &dwTyped);
+    DWORD dwMatched = 0;
+    ULONGLONG ullMatched = 0;
+    HRESULT hr = S_OK;
+    for (DWORD i = 0; i < cCandidates && SUCCEEDED(hr); i++)
+    {
+        DWORD dwCode;
+        hr = ComputeTotpCode(hmac, ullFirst + i, cDigits, &dwCode);
+        DWORD dwDiff = dwCode ^ dwTyped;
+        DWORD dwEqual = ((dwDiff | (0u - dwDiff)) >> 31) - 1;
+        DWORD dwFirst = dwEqual & ~dwMatched;
+        ullMatched |= (ullFirst + i) & (static_cast<ULONGLONG>(dwFirst) | (static_cast<ULONGLONG>(dwFirst) << 32));
+        dwMatched |= dwEqual;
+        SecureZeroMemory(&dwCode, sizeof(dwCode));
+    }
+    SecureZeroMemory(&dwTyped, sizeof(dwTyped));
+
+    if (SUCCEEDED(hr))
+    {
+        if (fWellFormed && dwMatched != 0 && ullMatched >= ullNext)
+        {
+            *pullMatched = ullMatched;
+        }
+        else
+        {
+            hr = E_ACCESSDENIED;
+        }
+    }
+    return hr;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <windows.h>
+
+// The arithmetic of RFC 4226 HOTP and RFC 6238 TOTP codes, apart from where seeds are kept.
+//
+// Seeds are decoded from base32, codes parsed, MACs truncated and candidates matched against the
+// skew window and the last counter used here. The HMAC itself comes through ITotpHmac, so that
+// totp.cpp can key it with BCrypt once per user and the code in this file needs nothing from
+// Windows but a few types. It also builds outside the provider: see tests/totp_test.cpp, which
+// checks it against the RFC test vectors.
+
+const ULONGLONG c_ullTotpUnixEpoch = 116444736000000000ull;    // 1970-01-01 as a FILETIME.
+const ULONGLONG c_ullTotpTicksPerSecond = 10000000ull;
+const DWORD c_cbMaxTotpMac = 32;
+
+// HMAC under one user's seed.
+class ITotpHmac
+{
+public:
+    // The length of the MAC: 20 bytes for SHA-1, 32 for SHA-256.
+    virtual DWORD MacSize() const = 0;
+
+    // Computes HMAC(seed, pbMessage) into pbMac, which holds MacSize() bytes.
+    virtual HRESULT Compute(_In_reads_bytes_(cbMessage) const BYTE *pbMessage, DWORD cbMessage,
+                            _Out_writes_bytes_(c_cbMaxTotpMac) BYTE *pbMac) const = 0;
+
+protected:
+    ~ITotpHmac() {}
+};
+
+// RFC 4648 base32, case-insensitive, ignoring padding, spaces and dashes.
+HRESULT DecodeBase32(_In_ PCWSTR pszText, _Out_writes_bytes_to_(cbMax, *pcb) BYTE *pb, DWORD cbMax, _Out_ DWORD *pcb);
+
+// Parses exactly cDigits decimal digits; anything else cannot be a code.
+bool ParseTotpCode(_In_ PCWSTR pszCode, BYTE cDigits, _Out_ DWORD *pdwCode);
+
+// The RFC 6238 time step ullTime (a FILETIME in UTC) falls in.
+ULONGLONG TotpTimeStep(ULONGLONG ullTime, WORD wPeriod);
+
+// The cDigits (6 to 8) digit code for ullCounter: RFC 4226 dynamic truncation of
+// HMAC(seed, ullCounter).
+HRESULT ComputeTotpCode(_In_ const ITotpHmac &hmac, ULONGLONG ullCounter, BYTE cDigits, _Out_ DWORD *pdwCode);
+
+// Checks pszCode against the cCandidates counters (or time steps) from ullFirst on. Every
+// candidate is computed and compared the same way whether or not an earlier one matched, and the
+// first match is picked with masks rather than branches. Returns S_OK with the counter matched in
+// *pullMatched, or E_ACCESSDENIED when nothing matched or the match is before ullNext, the first
+// counter the user may still use: a replay.
+HRESULT MatchTotpCode(_In_ const ITotpHmac &hmac, _In_ PCWSTR pszCode, BYTE cDigits, ULONGLONG ullFirst, DWORD cCandidates,
+                      ULONGLONG ullNext, _Out_ ULONGLONG *pullMatched);
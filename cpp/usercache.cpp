@@ -0,0 +1,335 @@
+#include "usercache.h"
+#include <propkey.h>
+#include <new>
+#include "accountcache.h"
+#include "dll.h"
+#include "providerevents.h"
+#include "utils.h"
+#include "warmstart.h"
+
+// The users' strings: US_COUNT offsets per user into one string pool. Never changed once built,
+// so the worker and GetUser can read a table without a lock.
+struct USER_STRING_TABLE
+{
+    DWORD   *rgich;
+    PWSTR   pwzPool;
+};
+
+namespace
+{
+    enum USER_STRING
+    {
+        US_SID = 0,
+        US_QUALIFIED_USER_NAME,
+        US_DISPLAY_NAME,
+        US_COUNT,
+    };
+
+    void LogCacheHr(_In_z_ LPCWSTR context, HRESULT hr)
+    {
+        wchar_t buffer[128] = {};
+        if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"%s hr=0x%08X", context, hr)))
+        {
+            WriteLogMessage(buffer);
+        }
+    }
+
+    void FreeStringTable(_In_opt_ USER_STRING_TABLE *pTable)
+    {
+        if (pTable != nullptr)
+        {
+            CoTaskMemFree(pTable->rgich);
+            CoTaskMemFree(pTable->pwzPool);
+            delete pTable;
+        }
+    }
+
+    PCWSTR TableString(_In_ const USER_STRING_TABLE *pTable, DWORD iUser, USER_STRING us)
+    {
+        return &pTable->pwzPool[pTable->rgich[iUser * US_COUNT + us]];
+    }
+
+    // Copies cUsers * US_COUNT strings, by user, into one pool. Offset 0 always holds an empty
+    // string so a missing value reads back as L"".
+    HRESULT PackStringTable(_In_reads_(cUsers * US_COUNT) const PCWSTR *rgpsz, DWORD cUsers, _Outptr_ USER_STRING_TABLE **ppTable)
+    {
+        *ppTable = nullptr;
+        DWORD cStrings = cUsers * US_COUNT;
+        size_t cchPool = 1;
+        for (DWORD i = 0; i < cStrings; i++)
+        {
+            if (rgpsz[i] != nullptr)
+            {
+                cchPool += wcslen(rgpsz[i]) + 1;
+            }
+        }
+        if (cchPool > MAXDWORD / sizeof(wchar_t))
+        {
+            return E_OUTOFMEMORY;
+        }
+
+        USER_STRING_TABLE *pTable = new(std::nothrow) USER_STRING_TABLE();
+        if (pTable == nullptr)
+        {
+            return E_OUTOFMEMORY;
+        }
+        pTable->pwzPool = static_cast<PWSTR>(CoTaskMemAlloc(cchPool * sizeof(wchar_t)));
+        pTable->rgich = static_cast<DWORD *>(CoTaskMemAlloc((cStrings != 0 ? cStrings : 1) * sizeof(DWORD)));
+        if (pTable->pwzPool == nullptr || pTable->rgich == nullptr)
+        {
+            FreeStringTable(pTable);
+            return E_OUTOFMEMORY;
+        }
+
+        DWORD ich = 0;
+        pTable->pwzPool[ich++] = L'\0';
+        for (DWORD i = 0; i < cStrings; i++)
+        {
+            pTable->rgich[i] = 0;
+            if (rgpsz[i] != nullptr && *rgpsz[i] != L'\0')
+            {
+                size_t cch = wcslen(rgpsz[i]) + 1;
+                CopyMemory(&pTable->pwzPool[ich], rgpsz[i], cch * sizeof(wchar_t));
+                pTable->rgich[i] = ich;
+                ich += static_cast<DWORD>(cch);
+            }
+        }
+        *ppTable = pTable;
+        return S_OK;
+    }
+}
+
+CUserMetadataCache::CUserMetadataCache() :
+    _cRef(1),
+    _lGeneration(0),
+    _cUsers(0),
+    _rgguidProvider(nullptr),
+    _pStrings(nullptr),
+    _pStaleStrings(nullptr)
+{
+    DllAddRef();
+}
+
+CUserMetadataCache::~CUserMetadataCache()
+{
+    FreeStringTable(_pStrings);
+    FreeStringTable(_pStaleStrings);
+    CoTaskMemFree(_rgguidProvider);
+    DllRelease();
+}
+
+ULONG CUserMetadataCache::AddRef()
+{
+    return InterlockedIncrement(&_cRef);
+}
+
+ULONG CUserMetadataCache::Release()
+{
+    long cRef = InterlockedDecrement(&_cRef);
+    if (!cRef)
+    {
+        delete this;
+    }
+    return cRef;
+}
+
+// Creates the cache from what the array itself knows about its users, then fills in the rest
+// in the background.
+HRESULT CUserMetadataCache::CreateInstance(_In_ ICredentialProviderUserArray *pUserArray, _Outptr_ CUserMetadataCache **ppCache)
+{
+    *ppCache = nullptr;
+
+    CUserMetadataCache *pCache = new(std::nothrow) CUserMetadataCache();
+    if (pCache == nullptr)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    HRESULT hr = pCache->_ReadUserArray(pUserArray);
+    if (SUCCEEDED(hr) && pCache->_cUsers > 0)
+    {
+        pCache->AddRef(); // Owned by the worker.
+        if (!QueueUserWorkItem(s_ResolveThreadProc, pCache, WT_EXECUTELONGFUNCTION))
+        {
+            // The tiles still work with what the array gave us.
+            LogCacheHr(L"[USERCACHE] name resolution not started", HRESULT_FROM_WIN32(GetLastError()));
+            pCache->Release();
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        *ppCache = pCache;
+    }
+    else
+    {
+        pCache->Release();
+    }
+    return hr;
+}
+
+// Reads each user's provider ID, SID and names from the array. These are properties the user
+// objects already hold, so the calling thread does not wait on anything.
+HRESULT CUserMetadataCache::_ReadUserArray(_In_ ICredentialProviderUserArray *pUserArray)
+{
+    HRESULT hr = pUserArray->GetCount(&_cUsers);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+    USER_STRING_TABLE *pStrings;
+    if (_cUsers == 0)
+    {
+        hr = PackStringTable(nullptr, 0, &pStrings);
+        _pStrings = SUCCEEDED(hr) ? pStrings : nullptr;
+        return hr;
+    }
+
+    // Gather into temporary per-user strings first, then pack them into one pool.
+    DWORD cStrings = _cUsers * US_COUNT;
+    PWSTR *rgpsz = static_cast<PWSTR *>(CoTaskMemAlloc(cStrings * sizeof(*rgpsz)));
+    _rgguidProvider = static_cast<GUID *>(CoTaskMemAlloc(_cUsers * sizeof(*_rgguidProvider)));
+    if (rgpsz == nullptr || _rgguidProvider == nullptr)
+    {
+        CoTaskMemFree(rgpsz);
+        return E_OUTOFMEMORY;
+    }
+    ZeroMemory(rgpsz, cStrings * sizeof(*rgpsz));
+    ZeroMemory(_rgguidProvider, _cUsers * sizeof(*_rgguidProvider));
+
+    for (DWORD i = 0; i < _cUsers; i++)
+    {
+        ICredentialProviderUser *pUser = nullptr;
+        if (SUCCEEDED(pUserArray->GetAt(i, &pUser)))
+        {
+            PWSTR *rgpszUser = &rgpsz[i * US_COUNT];
+            pUser->GetProviderID(&_rgguidProvider[i]);
+            if (FAILED(pUser->GetSid(&rgpszUser[US_SID])))
+            {
+                rgpszUser[US_SID] = nullptr;
+            }
+            if (FAILED(pUser->GetStringValue(PKEY_Identity_QualifiedUserName, &rgpszUser[US_QUALIFIED_USER_NAME])))
+            {
+                rgpszUser[US_QUALIFIED_USER_NAME] = nullptr;
+            }
+            if (FAILED(pUser->GetStringValue(PKEY_Identity_DisplayName, &rgpszUser[US_DISPLAY_NAME])))
+            {
+                rgpszUser[US_DISPLAY_NAME] = nullptr;
+            }
+            pUser->Release();
+        }
+    }
+
+    hr = PackStringTable(rgpsz, _cUsers, &pStrings);
+    if (SUCCEEDED(hr))
+    {
+        _pStrings = pStrings;
+    }
+
+    for (DWORD i = 0; i < cStrings; i++)
+    {
+        CoTaskMemFree(rgpsz[i]);
+    }
+    CoTaskMemFree(rgpsz);
+    return hr;
+}
+
+DWORD WINAPI CUserMetadataCache::s_ResolveThreadProc(_In_ LPVOID pvParam)
+{
+    CUserMetadataCache *pCache = static_cast<CUserMetadataCache *>(pvParam);
+    if (pCache->_ResolveNames())
+    {
+        // The tiles were built without these names; have LogonUI ask again.
+        SignalProviderEvent(PE_CONFIG_CHANGED);
+    }
+    pCache->Release();
+    return 0;
+}
+
+// Fills in the names the array did not have, from the warm-start state or else the directory,
+// and records complete ones there for the next process. Returns whether a new table was swapped
+// in.
+bool CUserMetadataCache::_ResolveNames()
+{
+    const USER_STRING_TABLE *pStrings = _pStrings;
+    DWORD cStrings = _cUsers * US_COUNT;
+    PCWSTR *rgpsz = static_cast<PCWSTR *>(CoTaskMemAlloc(cStrings * sizeof(*rgpsz)));
+    PWSTR *rgpszFound = static_cast<PWSTR *>(CoTaskMemAlloc(cStrings * sizeof(*rgpszFound)));
+    if (rgpsz == nullptr || rgpszFound == nullptr)
+    {
+        CoTaskMemFree(rgpsz);
+        CoTaskMemFree(rgpszFound);
+        return false;
+    }
+    ZeroMemory(rgpszFound, cStrings * sizeof(*rgpszFound));
+
+    bool fFound = false;
+    for (DWORD i = 0; i < _cUsers; i++)
+    {
+        PCWSTR *rgpszUser = &rgpsz[i * US_COUNT];
+        PWSTR *rgpszUserFound = &rgpszFound[i * US_COUNT];
+        for (DWORD us = 0; us < US_COUNT; us++)
+        {
+            rgpszUser[us] = TableString(pStrings, i, static_cast<USER_STRING>(us));
+        }
+        if (*rgpszUser[US_SID] == L'\0')
+        {
+            continue;
+        }
+
+        bool fComplete = (*rgpszUser[US_QUALIFIED_USER_NAME] != L'\0' && *rgpszUser[US_DISPLAY_NAME] != L'\0');
+        if (!fComplete &&
+            GetWarmStartUserNames(rgpszUser[US_SID], &rgpszUserFound[US_QUALIFIED_USER_NAME], &rgpszUserFound[US_DISPLAY_NAME]) != S_OK &&
+            *rgpszUser[US_QUALIFIED_USER_NAME] == L'\0' &&
+            GetAccountNameForSid(rgpszUser[US_SID], true, &rgpszUserFound[US_QUALIFIED_USER_NAME]) != S_OK)
+        {
+            rgpszUserFound[US_QUALIFIED_USER_NAME] = nullptr;
+        }
+
+        // What the array had wins over what was found.
+        for (DWORD us = US_QUALIFIED_USER_NAME; us < US_COUNT; us++)
+        {
+            if (*rgpszUser[us] == L'\0' && rgpszUserFound[us] != nullptr && *rgpszUserFound[us] != L'\0')
+            {
+                rgpszUser[us] = rgpszUserFound[us];
+                fFound = true;
+            }
+        }
+        if (fComplete)
+        {
+            RecordWarmStartUserNames(rgpszUser[US_SID], rgpszUser[US_QUALIFIED_USER_NAME], rgpszUser[US_DISPLAY_NAME]);
+        }
+    }
+
+    USER_STRING_TABLE *pResolved = nullptr;
+    if (fFound && SUCCEEDED(PackStringTable(rgpsz, _cUsers, &pResolved)))
+    {
+        _pStaleStrings = static_cast<USER_STRING_TABLE *>(InterlockedExchangePointer(reinterpret_cast<PVOID volatile *>(&_pStrings), pResolved));
+        InterlockedIncrement(&_lGeneration);
+    }
+    LogCacheHr(L"[USERCACHE] name resolution finished", (pResolved != nullptr) ? S_OK : S_FALSE);
+
+    for (DWORD i = 0; i < cStrings; i++)
+    {
+        CoTaskMemFree(rgpszFound[i]);
+    }
+    CoTaskMemFree(rgpszFound);
+    CoTaskMemFree(rgpsz);
+    return pResolved != nullptr;
+}
+
+HRESULT CUserMetadataCache::GetUser(DWORD dwIndex, _Out_ USER_METADATA *pMetadata) const
+{
+    ZeroMemory(pMetadata, sizeof(*pMetadata));
+    const USER_STRING_TABLE *pStrings = _pStrings;
+    if (dwIndex >= _cUsers || pStrings == nullptr)
+    {
+        return E_INVALIDARG;
+    }
+
+    pMetadata->pszSid = TableString(pStrings, dwIndex, US_SID);
+    pMetadata->pszQualifiedUserName = TableString(pStrings, dwIndex, US_QUALIFIED_USER_NAME);
+    pMetadata->pszDisplayName = TableString(pStrings, dwIndex, US_DISPLAY_NAME);
+    pMetadata->guidProvider = _rgguidProvider[dwIndex];
+    return S_OK;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "helpers.h"
+
+// Identity metadata for one user, as read back from CUserMetadataCache. The strings are owned
+// by the cache and stay valid for as long as the caller holds a reference on it.
+struct USER_METADATA
+{
+    PCWSTR  pszSid;
+    PCWSTR  pszQualifiedUserName;
+    PCWSTR  pszDisplayName;
+    GUID    guidProvider;
+};
+
+struct USER_STRING_TABLE;
+
+// Snapshot of the identity metadata of every user in an ICredentialProviderUserArray.
+//
+// The users' SIDs, provider IDs and names are read from the array on the calling thread when
+// SetUserArray hands it to us, so the metadata is there from the start and enumeration never
+// waits for it. Only plain copies go to the thread pool worker, which does what can be slow:
+// names the array did not have come from the warm-start state or the directory, and fresh ones
+// are recorded for the next process. When the worker fills anything in, it swaps in a new table,
+// moves Generation on and signals PE_CONFIG_CHANGED so LogonUI enumerates again; when it has
+// nothing to add it stays quiet. The data is kept as offsets into a single string pool so a
+// thousand-user array is a handful of allocations, not thousands.
+class CUserMetadataCache
+{
+public:
+    static HRESULT CreateInstance(_In_ ICredentialProviderUserArray *pUserArray, _Outptr_ CUserMetadataCache **ppCache);
+
+    ULONG AddRef();
+    ULONG Release();
+
+    DWORD UserCount() const
+    {
+        return _cUsers;
+    }
+
+    // Increments every time the worker fills in metadata the array did not have.
+    LONG Generation() const
+    {
+        return _lGeneration;
+    }
+
+    HRESULT GetUser(DWORD dwIndex, _Out_ USER_METADATA *pMetadata) const;
+
+private:
+    CUserMetadataCache();
+    ~CUserMetadataCache();
+
+    static DWORD WINAPI s_ResolveThreadProc(_In_ LPVOID pvParam);
+    HRESULT _ReadUserArray(_In_ ICredentialProviderUserArray *pUserArray);
+    bool _ResolveNames();
+
+    long                        _cRef;
+    volatile LONG               _lGeneration;
+    DWORD                       _cUsers;
+    GUID                        *_rgguidProvider;
+    USER_STRING_TABLE *volatile _pStrings;          // Swapped at most once, by the worker.
+    USER_STRING_TABLE           *_pStaleStrings;    // The table it replaced; GetUser callers may still point into it.
+};
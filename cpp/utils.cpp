@@ -1,5 +1,8 @@
 ﻿#include "utils.h"
 
+#include <aclapi.h>
+#include <sddl.h>
+#include <strsafe.h>
 #include <string>
 #include <cwchar>
 
@@ -7,6 +10,91 @@ namespace
 {
     const wchar_t kLogDirectory[] = L"C:\\ProgramData\\sqcp";
     const wchar_t kLogFile[] = L"C:\\ProgramData\\sqcp\\sqcp.log";
+    const wchar_t kSystemOnlySddl[] = L"D:P(A;OICI;GA;;;SY)(A;OICI;GA;;;BA)";
+
+    INIT_ONCE g_initLogDirectory = INIT_ONCE_STATIC_INIT;
+
+    // Runs on the first log write rather than at load, and only once per process.
+    BOOL CALLBACK CreateLogDirectory(PINIT_ONCE, PVOID, PVOID *ppvContext)
+    {
+        DWORD createDirError = ERROR_SUCCESS;
+        if (!CreateDirectoryW(kLogDirectory, nullptr))
+        {
+            createDirError = GetLastError();
+            if (createDirError == ERROR_ALREADY_EXISTS)
+            {
+                createDirError = ERROR_SUCCESS;
+            }
+        }
+        *ppvContext = reinterpret_cast<PVOID>(static_cast<ULONG_PTR>(createDirError) << INIT_ONCE_CTX_RESERVED_BITS);
+        return TRUE;
+    }
+
+    bool IsTrustedFileOwner(HANDLE fileHandle)
+    {
+        PSID ownerSid = nullptr;
+        PSECURITY_DESCRIPTOR securityDescriptor = nullptr;
+        bool trusted = false;
+        if (GetSecurityInfo(fileHandle, SE_FILE_OBJECT, OWNER_SECURITY_INFORMATION, &ownerSid, nullptr, nullptr, nullptr, &securityDescriptor) == ERROR_SUCCESS)
+        {
+            trusted = IsWellKnownSid(ownerSid, WinLocalSystemSid) || IsWellKnownSid(ownerSid, WinBuiltinAdministratorsSid);
+            LocalFree(securityDescriptor);
+        }
+        return trusted;
+    }
+
+    // Replaces the DACL on the object behind handle with securityDescriptor's, protected from
+    // inheritance.
+    HRESULT ApplyProtectedDacl(HANDLE handle, SE_OBJECT_TYPE objectType, _In_ PSECURITY_DESCRIPTOR securityDescriptor)
+    {
+        BOOL daclPresent = FALSE;
+        BOOL daclDefaulted = FALSE;
+        PACL dacl = nullptr;
+        if (!GetSecurityDescriptorDacl(securityDescriptor, &daclPresent, &dacl, &daclDefaulted))
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        if (!daclPresent || dacl == nullptr)
+        {
+            return E_INVALIDARG;
+        }
+        return HRESULT_FROM_WIN32(SetSecurityInfo(handle, objectType, DACL_SECURITY_INFORMATION | PROTECTED_DACL_SECURITY_INFORMATION,
+                                                  nullptr, nullptr, dacl, nullptr));
+    }
+
+    // Creates directoryPath with securityDescriptor, or puts its DACL on the directory when it
+    // exists. Anybody may create directories under ProgramData, and the owner of one can always
+    // change its DACL back, so an existing directory must be owned by SYSTEM or Administrators.
+    HRESULT CreateProtectedDirectory(_In_z_ PCWSTR directoryPath, _In_ PSECURITY_DESCRIPTOR securityDescriptor)
+    {
+        SECURITY_ATTRIBUTES securityAttributes = { sizeof(securityAttributes), securityDescriptor, FALSE };
+        if (CreateDirectoryW(directoryPath, &securityAttributes))
+        {
+            return S_OK;
+        }
+        if (GetLastError() != ERROR_ALREADY_EXISTS)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        HANDLE directoryHandle = CreateFileW(directoryPath, READ_CONTROL | WRITE_DAC, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                             nullptr, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, nullptr);
+        if (directoryHandle == INVALID_HANDLE_VALUE)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+        BY_HANDLE_FILE_INFORMATION fileInformation = {};
+        HRESULT hr = HRESULT_FROM_WIN32(ERROR_ACCESS_DENIED);
+        if (GetFileInformationByHandle(directoryHandle, &fileInformation) &&
+            (fileInformation.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) &&
+            !(fileInformation.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) &&
+            IsTrustedFileOwner(directoryHandle))
+        {
+            hr = ApplyProtectedDacl(directoryHandle, SE_FILE_OBJECT, securityDescriptor);
+        }
+        CloseHandle(directoryHandle);
+        return hr;
+    }
 }
 
 HRESULT WriteLogMessage(_In_z_ PCWSTR message)
@@ -16,13 +104,12 @@ HRESULT WriteLogMessage(_In_z_ PCWSTR message)
         return E_INVALIDARG;
     }
 
-    if (!CreateDirectoryW(kLogDirectory, nullptr))
+    PVOID pvContext = nullptr;
+    InitOnceExecuteOnce(&g_initLogDirectory, CreateLogDirectory, nullptr, &pvContext);
+    DWORD createDirError = static_cast<DWORD>(reinterpret_cast<ULONG_PTR>(pvContext) >> INIT_ONCE_CTX_RESERVED_BITS);
+    if (createDirError != ERROR_SUCCESS)
     {
-        DWORD createDirError = GetLastError();
-        if (createDirError != ERROR_ALREADY_EXISTS)
-        {
-            return HRESULT_FROM_WIN32(createDirError);
-        }
+        return HRESULT_FROM_WIN32(createDirError);
     }
 
     HANDLE fileHandle = CreateFileW(
@@ -73,3 +160,170 @@ HRESULT WriteLogMessage(_In_z_ PCWSTR message)
     CloseHandle(fileHandle);
     return hr;
 }
+
+HRESULT ReplaceFileContents(_In_z_ PCWSTR pszPath, _In_reads_bytes_(cb) const void *pv, DWORD cb, _In_opt_ PSECURITY_DESCRIPTOR securityDescriptor)
+{
+    if (!CreateDirectoryW(kLogDirectory, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    wchar_t tempPath[MAX_PATH];
+    HRESULT hr = StringCchPrintfW(tempPath, ARRAYSIZE(tempPath), L"%s.%u.tmp", pszPath, GetCurrentProcessId());
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (securityDescriptor != nullptr)
+    {
+        // The rename keeps the temporary file's DACL, so it is set on creation; the directory is
+        // secured first so nobody can open the file in between.
+        wchar_t directoryPath[MAX_PATH];
+        hr = StringCchCopyW(directoryPath, ARRAYSIZE(directoryPath), pszPath);
+        PWSTR lastSeparator = SUCCEEDED(hr) ? wcsrchr(directoryPath, L'\\') : nullptr;
+        if (lastSeparator == nullptr)
+        {
+            return FAILED(hr) ? hr : E_INVALIDARG;
+        }
+        *lastSeparator = L'\0';
+        hr = CreateProtectedDirectory(directoryPath, securityDescriptor);
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+    }
+
+    SECURITY_ATTRIBUTES securityAttributes = { sizeof(securityAttributes), securityDescriptor, FALSE };
+    HANDLE fileHandle = CreateFileW(tempPath, GENERIC_WRITE, 0, (securityDescriptor != nullptr) ? &securityAttributes : nullptr,
+                                    CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (fileHandle == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    DWORD bytesWritten = 0;
+    BOOL writeResult = WriteFile(fileHandle, pv, cb, &bytesWritten, nullptr);
+    hr = (writeResult && bytesWritten == cb) ? S_OK : HRESULT_FROM_WIN32(GetLastError());
+    CloseHandle(fileHandle);
+
+    if (SUCCEEDED(hr) && !MoveFileExW(tempPath, pszPath, MOVEFILE_REPLACE_EXISTING))
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+    if (FAILED(hr))
+    {
+        DeleteFileW(tempPath);
+    }
+    return hr;
+}
+
+HRESULT CreateSystemOnlySecurityDescriptor(_Outptr_ PSECURITY_DESCRIPTOR *ppSecurityDescriptor)
+{
+    *ppSecurityDescriptor = nullptr;
+    return ConvertStringSecurityDescriptorToSecurityDescriptorW(kSystemOnlySddl, SDDL_REVISION_1, ppSecurityDescriptor, nullptr)
+        ? S_OK
+        : HRESULT_FROM_WIN32(GetLastError());
+}
+
+HRESULT CreateSystemOnlyKey(_In_z_ PCWSTR pszSubKey)
+{
+    PSECURITY_DESCRIPTOR securityDescriptor;
+    HRESULT hr = CreateSystemOnlySecurityDescriptor(&securityDescriptor);
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    SECURITY_ATTRIBUTES securityAttributes = { sizeof(securityAttributes), securityDescriptor, FALSE };
+    HKEY keyHandle = nullptr;
+    DWORD disposition = 0;
+    hr = HRESULT_FROM_WIN32(RegCreateKeyExW(HKEY_LOCAL_MACHINE, pszSubKey, 0, nullptr, REG_OPTION_NON_VOLATILE, READ_CONTROL | WRITE_DAC,
+                                            &securityAttributes, &keyHandle, &disposition));
+    if (SUCCEEDED(hr) && disposition == REG_OPENED_EXISTING_KEY)
+    {
+        // Keys written before they were secured inherited the HKLM\SOFTWARE DACL.
+        hr = ApplyProtectedDacl(keyHandle, SE_REGISTRY_KEY, securityDescriptor);
+    }
+    if (keyHandle != nullptr)
+    {
+        RegCloseKey(keyHandle);
+    }
+    LocalFree(securityDescriptor);
+    return hr;
+}
+
+namespace
+{
+    // Shared by MapTrustedFile and MapTrustedFileForUpdate. The file handle is only kept when
+    // phFile asks for it.
+    HRESULT MapTrustedFileView(_In_z_ PCWSTR pszPath, DWORD cbMax, bool writable, _Outptr_result_bytebuffer_(*pcb) BYTE **ppb, _Out_ DWORD *pcb, _Out_opt_ HANDLE *phFile)
+    {
+        *ppb = nullptr;
+        *pcb = 0;
+        if (phFile != nullptr)
+        {
+            *phFile = INVALID_HANDLE_VALUE;
+        }
+
+        // FILE_SHARE_DELETE lets ReplaceFileContents in another process rename a newer file over
+        // this one while it is still mapped here.
+        DWORD access = writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+        DWORD share = writable ? (FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE) : (FILE_SHARE_READ | FILE_SHARE_DELETE);
+        HANDLE fileHandle = CreateFileW(pszPath, access, share, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+        {
+            return HRESULT_FROM_WIN32(GetLastError());
+        }
+
+        HRESULT hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+        LARGE_INTEGER fileSize = {};
+        if (GetFileSizeEx(fileHandle, &fileSize) && fileSize.QuadPart > 0 && fileSize.QuadPart <= cbMax &&
+            IsTrustedFileOwner(fileHandle))
+        {
+            HANDLE mappingHandle = CreateFileMappingW(fileHandle, nullptr, writable ? PAGE_READWRITE : PAGE_READONLY, 0, 0, nullptr);
+            if (mappingHandle != nullptr)
+            {
+                BYTE *view = static_cast<BYTE *>(MapViewOfFile(mappingHandle, writable ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, 0));
+                if (view != nullptr)
+                {
+                    *ppb = view;
+                    *pcb = static_cast<DWORD>(fileSize.QuadPart);
+                    hr = S_OK;
+                }
+                else
+                {
+                    hr = HRESULT_FROM_WIN32(GetLastError());
+                }
+                CloseHandle(mappingHandle);
+            }
+            else
+            {
+                hr = HRESULT_FROM_WIN32(GetLastError());
+            }
+        }
+
+        if (SUCCEEDED(hr) && phFile != nullptr)
+        {
+            *phFile = fileHandle;
+        }
+        else
+        {
+            CloseHandle(fileHandle);
+        }
+        return hr;
+    }
+}
+
+HRESULT MapTrustedFile(_In_z_ PCWSTR pszPath, DWORD cbMax, _Outptr_result_bytebuffer_(*pcb) const BYTE **ppb, _Out_ DWORD *pcb)
+{
+    BYTE *view = nullptr;
+    HRESULT hr = MapTrustedFileView(pszPath, cbMax, false, &view, pcb, nullptr);
+    *ppb = view;
+    return hr;
+}
+
+HRESULT MapTrustedFileForUpdate(_In_z_ PCWSTR pszPath, DWORD cbMax, _Outptr_result_bytebuffer_(*pcb) BYTE **ppb, _Out_ DWORD *pcb, _Out_ HANDLE *phFile)
+{
+    return MapTrustedFileView(pszPath, cbMax, true, ppb, pcb, phFile);
+}
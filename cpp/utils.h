@@ -4,3 +4,28 @@
 
 // Writes a message to C:\ProgramData\sqcp\sqcp.log, creating the directory/file when missing.
 HRESULT WriteLogMessage(_In_z_ PCWSTR message);
+
+// Writes pv to a temporary file next to pszPath and renames it over pszPath, so readers only
+// ever open a complete file. Creates C:\ProgramData\sqcp when missing. With a security
+// descriptor, the file and the directory it is written to get its DACL instead of inheriting
+// one; the directory must then be owned by SYSTEM or Administrators.
+HRESULT ReplaceFileContents(_In_z_ PCWSTR pszPath, _In_reads_bytes_(cb) const void *pv, DWORD cb, _In_opt_ PSECURITY_DESCRIPTOR securityDescriptor = nullptr);
+
+// A security descriptor whose protected DACL gives SYSTEM and Administrators full access, passed
+// on to children, and nobody else anything. A blob sealed with machine DPAPI is only as private
+// as the place it is stored, since any local account can unseal one it can read. Free it with
+// LocalFree.
+HRESULT CreateSystemOnlySecurityDescriptor(_Outptr_ PSECURITY_DESCRIPTOR *ppSecurityDescriptor);
+
+// Creates HKLM\pszSubKey with the system-only DACL, or puts that DACL on it when it exists.
+HRESULT CreateSystemOnlyKey(_In_z_ PCWSTR pszSubKey);
+
+// Maps pszPath read-only if it is owned by SYSTEM or Administrators and is at most cbMax bytes.
+// Files under ProgramData can be created by any user, so anything that drives policy is only
+// read through here. The view is released with UnmapViewOfFile.
+HRESULT MapTrustedFile(_In_z_ PCWSTR pszPath, DWORD cbMax, _Outptr_result_bytebuffer_(*pcb) const BYTE **ppb, _Out_ DWORD *pcb);
+
+// Same as MapTrustedFile, but maps the file read-write and returns its handle in *phFile, so
+// changes made through the view can be made durable with FlushViewOfFile and FlushFileBuffers.
+// The caller closes the handle as well as unmapping the view.
+HRESULT MapTrustedFileForUpdate(_In_z_ PCWSTR pszPath, DWORD cbMax, _Outptr_result_bytebuffer_(*pcb) BYTE **ppb, _Out_ DWORD *pcb, _Out_ HANDLE *phFile);
@@ -0,0 +1,405 @@
+#include "warmstart.h"
+#include "dll.h"
+#include "utils.h"
+
+namespace
+{
+    const wchar_t c_szWarmStartFile[] = L"C:\\ProgramData\\sqcp\\warmstart.bin";
+
+    const DWORD c_dwWarmStartMagic = 0x53575153;    // "SQWS"
+    const WORD c_wWarmStartVersion = 1;
+    const DWORD c_cMaxWarmStartUsers = 16;
+    const DWORD c_cchMaxServer = 256;
+    const DWORD c_cchMaxDisplayName = 256;
+
+    const ULONGLONG c_ullTicksPerSecond = 10000000ull;
+    const ULONGLONG c_ullMaxNamesAge = 24 * 60 * 60 * c_ullTicksPerSecond;
+    // Boot times computed by two processes differ by clock adjustments made in between; two
+    // boots are never this close together.
+    const ULONGLONG c_ullBootTimeTolerance = 60 * c_ullTicksPerSecond;
+
+    const BYTE c_bFactorUnknown = 0xFF;
+
+    struct WARM_START_HEADER
+    {
+        DWORD       dwMagic;
+        WORD        wVersion;
+        WORD        cUsers;
+        DWORD       cbFile;
+        DWORD       dwChecksum;         // FNV-1a over every byte after the header.
+        ULONGLONG   ullBootTime;        // Boot ulAuthPackage was looked up in; 0 when not known.
+        ULONG       ulAuthPackage;
+        DWORD       dwConfigDigest;     // Policy the bMfaFactor of every user was decided under.
+        wchar_t     szLastGoodServer[c_cchMaxServer];
+    };
+
+    struct WARM_START_USER
+    {
+        wchar_t     szSid[SECURITY_MAX_SID_STRING_CHARACTERS];
+        wchar_t     szQualifiedUserName[CREDUI_MAX_USERNAME_LENGTH + 1];
+        wchar_t     szDisplayName[c_cchMaxDisplayName];
+        ULONGLONG   ullNamesFetched;    // When the names came from the directory; 0 if never.
+        ULONGLONG   ullLastLogon;       // 0 until the user logs on through us.
+        BYTE        bMfaFactor;         // MFA_FACTOR, or c_bFactorUnknown.
+        BYTE        rgbReserved[7];
+    };
+
+    // The file is the header followed by cUsers records, most recent logon first.
+    struct WARM_START_IMAGE
+    {
+        WARM_START_HEADER   header;
+        WARM_START_USER     rgUsers[c_cMaxWarmStartUsers];
+    };
+
+    INIT_ONCE s_initWarmStart = INIT_ONCE_STATIC_INIT;
+    SRWLOCK s_srwWarmStart = SRWLOCK_INIT;
+    WARM_START_IMAGE s_image = {};
+    volatile LONG s_lRefreshQueued = 0;
+
+    ULONGLONG CurrentTime()
+    {
+        FILETIME ft;
+        GetSystemTimeAsFileTime(&ft);
+        return (static_cast<ULONGLONG>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+    }
+
+    ULONGLONG CurrentBootTime()
+    {
+        return CurrentTime() - GetTickCount64() * (c_ullTicksPerSecond / 1000);
+    }
+
+    DWORD WarmStartChecksum(_In_reads_bytes_(cb) const BYTE *pb, DWORD cb)
+    {
+        DWORD dwHash = 0x811C9DC5;
+        for (DWORD i = 0; i < cb; i++)
+        {
+            dwHash = (dwHash ^ pb[i]) * 0x01000193;
+        }
+        return dwHash;
+    }
+
+    DWORD WarmStartFileSize(WORD cUsers)
+    {
+        return sizeof(WARM_START_HEADER) + cUsers * sizeof(WARM_START_USER);
+    }
+
+    bool IsValidWarmStart(_In_reads_bytes_(cbImage) const BYTE *pbImage, DWORD cbImage)
+    {
+        if (cbImage < sizeof(WARM_START_HEADER))
+        {
+            return false;
+        }
+        const WARM_START_HEADER *pHeader = reinterpret_cast<const WARM_START_HEADER *>(pbImage);
+        if (pHeader->dwMagic != c_dwWarmStartMagic ||
+            pHeader->wVersion != c_wWarmStartVersion ||
+            pHeader->cUsers > c_cMaxWarmStartUsers ||
+            pHeader->cbFile != cbImage ||
+            cbImage != WarmStartFileSize(pHeader->cUsers))
+        {
+            return false;
+        }
+        return pHeader->dwChecksum == WarmStartChecksum(pbImage + sizeof(*pHeader), cbImage - sizeof(*pHeader));
+    }
+
+    BOOL CALLBACK LoadWarmStart(PINIT_ONCE, PVOID, PVOID *)
+    {
+        // The file hands out an auth package ID, so one planted by a user is never read.
+        const BYTE *pbImage;
+        DWORD cbImage;
+        HRESULT hr = MapTrustedFile(c_szWarmStartFile, sizeof(s_image), &pbImage, &cbImage);
+        if (SUCCEEDED(hr))
+        {
+            if (IsValidWarmStart(pbImage, cbImage))
+            {
+                CopyMemory(&s_image, pbImage, cbImage);
+            }
+            else
+            {
+                WriteLogMessage(L"[WARMSTART] warmstart.bin failed validation and is ignored");
+            }
+            UnmapViewOfFile(pbImage);
+        }
+
+        // Strings are read back with a bounded copy, but make sure they are terminated.
+        WARM_START_HEADER &header = s_image.header;
+        header.szLastGoodServer[ARRAYSIZE(header.szLastGoodServer) - 1] = L'\0';
+        for (WORD i = 0; i < header.cUsers; i++)
+        {
+            WARM_START_USER &user = s_image.rgUsers[i];
+            user.szSid[ARRAYSIZE(user.szSid) - 1] = L'\0';
+            user.szQualifiedUserName[ARRAYSIZE(user.szQualifiedUserName) - 1] = L'\0';
+            user.szDisplayName[ARRAYSIZE(user.szDisplayName) - 1] = L'\0';
+        }
+        return TRUE;
+    }
+
+    void EnsureWarmStartLoaded()
+    {
+        InitOnceExecuteOnce(&s_initWarmStart, LoadWarmStart, nullptr, nullptr);
+    }
+
+    // Returns the index of the user's record, or cUsers when there is none. Caller holds the lock.
+    WORD FindWarmStartUser(_In_ PCWSTR pszUserSid)
+    {
+        WORD i = 0;
+        while (i < s_image.header.cUsers && _wcsicmp(s_image.rgUsers[i].szSid, pszUserSid) != 0)
+        {
+            i++;
+        }
+        return i;
+    }
+
+    // Returns the user's record, creating it in place of the least recent logon when the table is
+    // full. Caller holds the lock exclusively.
+    WARM_START_USER *AddWarmStartUser(_In_ PCWSTR pszUserSid)
+    {
+        WARM_START_HEADER &header = s_image.header;
+        size_t cchSid;
+        if (FAILED(StringCchLengthW(pszUserSid, ARRAYSIZE(s_image.rgUsers[0].szSid), &cchSid)))
+        {
+            return nullptr;
+        }
+
+        WORD iUser = FindWarmStartUser(pszUserSid);
+        if (iUser == header.cUsers)
+        {
+            if (header.cUsers < c_cMaxWarmStartUsers)
+            {
+                header.cUsers++;
+            }
+            else
+            {
+                iUser = 0;
+                for (WORD i = 1; i < header.cUsers; i++)
+                {
+                    if (s_image.rgUsers[i].ullLastLogon < s_image.rgUsers[iUser].ullLastLogon)
+                    {
+                        iUser = i;
+                    }
+                }
+            }
+
+            WARM_START_USER &user = s_image.rgUsers[iUser];
+            ZeroMemory(&user, sizeof(user));
+            user.bMfaFactor = c_bFactorUnknown;
+            CopyMemory(user.szSid, pszUserSid, (cchSid + 1) * sizeof(wchar_t));
+        }
+        return &s_image.rgUsers[iUser];
+    }
+
+    DWORD WINAPI RefreshThreadProc(_In_ LPVOID)
+    {
+        // Cleared before the copy, so changes made from here on queue another refresh.
+        InterlockedExchange(&s_lRefreshQueued, 0);
+        WARM_START_IMAGE *pImage = static_cast<WARM_START_IMAGE *>(CoTaskMemAlloc(sizeof(WARM_START_IMAGE)));
+        if (pImage != nullptr)
+        {
+            AcquireSRWLockShared(&s_srwWarmStart);
+            CopyMemory(pImage, &s_image, sizeof(*pImage));
+            ReleaseSRWLockShared(&s_srwWarmStart);
+
+            // Most recent logon first, so a reader scanning for a SID finds the likely tile soonest.
+            WARM_START_HEADER &header = pImage->header;
+            for (WORD i = 1; i < header.cUsers; i++)
+            {
+                WARM_START_USER user = pImage->rgUsers[i];
+                WORD j = i;
+                for (; j > 0 && pImage->rgUsers[j - 1].ullLastLogon < user.ullLastLogon; j--)
+                {
+                    pImage->rgUsers[j] = pImage->rgUsers[j - 1];
+                }
+                pImage->rgUsers[j] = user;
+            }
+
+            DWORD cbFile = WarmStartFileSize(header.cUsers);
+            header.dwMagic = c_dwWarmStartMagic;
+            header.wVersion = c_wWarmStartVersion;
+            header.cbFile = cbFile;
+            header.dwChecksum = WarmStartChecksum(reinterpret_cast<const BYTE *>(pImage) + sizeof(header), cbFile - sizeof(header));
+
+            // Only processes running as SYSTEM or an administrator can write the file.
+            HRESULT hr = ReplaceFileContents(c_szWarmStartFile, pImage, cbFile);
+            if (FAILED(hr))
+            {
+                wchar_t buffer[96] = {};
+                if (SUCCEEDED(StringCchPrintfW(buffer, ARRAYSIZE(buffer), L"[WARMSTART] unable to write warmstart.bin hr=0x%08X", hr)))
+                {
+                    WriteLogMessage(buffer);
+                }
+            }
+            CoTaskMemFree(pImage);
+        }
+        DllRelease();
+        return 0;
+    }
+}
+
+HRESULT RetrieveCachedNegotiateAuthPackage(_Out_ ULONG *pulAuthPackage)
+{
+    EnsureWarmStartLoaded();
+
+    ULONGLONG ullBootTime = CurrentBootTime();
+    bool fCached = false;
+    AcquireSRWLockShared(&s_srwWarmStart);
+    ULONGLONG ullCachedBoot = s_image.header.ullBootTime;
+    if (ullCachedBoot != 0 &&
+        (ullCachedBoot > ullBootTime ? ullCachedBoot - ullBootTime : ullBootTime - ullCachedBoot) < c_ullBootTimeTolerance)
+    {
+        *pulAuthPackage = s_image.header.ulAuthPackage;
+        fCached = true;
+    }
+    ReleaseSRWLockShared(&s_srwWarmStart);
+    if (fCached)
+    {
+        return S_OK;
+    }
+
+    HRESULT hr = RetrieveNegotiateAuthPackage(pulAuthPackage);
+    if (SUCCEEDED(hr))
+    {
+        AcquireSRWLockExclusive(&s_srwWarmStart);
+        s_image.header.ullBootTime = ullBootTime;
+        s_image.header.ulAuthPackage = *pulAuthPackage;
+        ReleaseSRWLockExclusive(&s_srwWarmStart);
+    }
+    return hr;
+}
+
+HRESULT GetWarmStartUserNames(_In_ PCWSTR pszUserSid,
+                              _Outptr_result_maybenull_ PWSTR *ppszQualifiedUserName,
+                              _Outptr_result_maybenull_ PWSTR *ppszDisplayName)
+{
+    *ppszQualifiedUserName = nullptr;
+    *ppszDisplayName = nullptr;
+    EnsureWarmStartLoaded();
+
+    HRESULT hr = S_FALSE;
+    ULONGLONG ullNow = CurrentTime();
+    AcquireSRWLockShared(&s_srwWarmStart);
+    WORD iUser = FindWarmStartUser(pszUserSid);
+    if (iUser < s_image.header.cUsers)
+    {
+        const WARM_START_USER &user = s_image.rgUsers[iUser];
+        if (user.ullNamesFetched != 0 && ullNow - user.ullNamesFetched < c_ullMaxNamesAge)
+        {
+            hr = SHStrDupW(user.szQualifiedUserName, ppszQualifiedUserName);
+            if (SUCCEEDED(hr))
+            {
+                hr = SHStrDupW(user.szDisplayName, ppszDisplayName);
+            }
+        }
+    }
+    ReleaseSRWLockShared(&s_srwWarmStart);
+
+    if (FAILED(hr))
+    {
+        CoTaskMemFree(*ppszQualifiedUserName);
+        *ppszQualifiedUserName = nullptr;
+    }
+    return hr;
+}
+
+void RecordWarmStartUserNames(_In_ PCWSTR pszUserSid, _In_ PCWSTR pszQualifiedUserName, _In_ PCWSTR pszDisplayName)
+{
+    EnsureWarmStartLoaded();
+
+    AcquireSRWLockExclusive(&s_srwWarmStart);
+    WARM_START_USER *pUser = AddWarmStartUser(pszUserSid);
+    if (pUser != nullptr)
+    {
+        // Names too long for the record are not cached rather than cached truncated.
+        if (SUCCEEDED(StringCchCopyW(pUser->szQualifiedUserName, ARRAYSIZE(pUser->szQualifiedUserName), pszQualifiedUserName)) &&
+            SUCCEEDED(StringCchCopyW(pUser->szDisplayName, ARRAYSIZE(pUser->szDisplayName), pszDisplayName)))
+        {
+            pUser->ullNamesFetched = CurrentTime();
+        }
+        else
+        {
+            pUser->ullNamesFetched = 0;
+        }
+    }
+    ReleaseSRWLockExclusive(&s_srwWarmStart);
+}
+
+bool GetWarmStartMfaFactor(_In_ PCWSTR pszUserSid, DWORD dwConfigDigest, _Out_ MFA_FACTOR *pmfaFactor)
+{
+    *pmfaFactor = MFA_FACTOR_NONE;
+    EnsureWarmStartLoaded();
+
+    bool fFound = false;
+    AcquireSRWLockShared(&s_srwWarmStart);
+    WORD iUser = FindWarmStartUser(pszUserSid);
+    if (s_image.header.dwConfigDigest == dwConfigDigest &&
+        iUser < s_image.header.cUsers &&
+        s_image.rgUsers[iUser].bMfaFactor <= MFA_FACTOR_PUSH)
+    {
+        *pmfaFactor = static_cast<MFA_FACTOR>(s_image.rgUsers[iUser].bMfaFactor);
+        fFound = true;
+    }
+    ReleaseSRWLockShared(&s_srwWarmStart);
+    return fFound;
+}
+
+HRESULT GetWarmStartServer(_Out_writes_(cchServer) PWSTR pszServer, size_t cchServer)
+{
+    EnsureWarmStartLoaded();
+
+    AcquireSRWLockShared(&s_srwWarmStart);
+    HRESULT hr = StringCchCopyW(pszServer, cchServer, s_image.header.szLastGoodServer);
+    ReleaseSRWLockShared(&s_srwWarmStart);
+    if (SUCCEEDED(hr) && *pszServer == L'\0')
+    {
+        hr = S_FALSE;
+    }
+    return hr;
+}
+
+void RecordWarmStartServer(_In_ PCWSTR pszServer)
+{
+    EnsureWarmStartLoaded();
+
+    AcquireSRWLockExclusive(&s_srwWarmStart);
+    StringCchCopyW(s_image.header.szLastGoodServer, ARRAYSIZE(s_image.header.szLastGoodServer), pszServer);
+    ReleaseSRWLockExclusive(&s_srwWarmStart);
+}
+
+void RefreshWarmStartAsync(_In_ PCWSTR pszUserSid, MFA_FACTOR mfaFactor)
+{
+    EnsureWarmStartLoaded();
+
+    DWORD dwConfigDigest = 0;
+    CMfaPolicyIndex *pMfaPolicy;
+    if (SUCCEEDED(GetMfaPolicyIndex(&pMfaPolicy)))
+    {
+        dwConfigDigest = pMfaPolicy->Checksum();
+        pMfaPolicy->Release();
+    }
+
+    AcquireSRWLockExclusive(&s_srwWarmStart);
+    if (s_image.header.dwConfigDigest != dwConfigDigest)
+    {
+        for (WORD i = 0; i < s_image.header.cUsers; i++)
+        {
+            s_image.rgUsers[i].bMfaFactor = c_bFactorUnknown;
+        }
+        s_image.header.dwConfigDigest = dwConfigDigest;
+    }
+    WARM_START_USER *pUser = (*pszUserSid != L'\0') ? AddWarmStartUser(pszUserSid) : nullptr;
+    if (pUser != nullptr)
+    {
+        pUser->ullLastLogon = CurrentTime();
+        pUser->bMfaFactor = static_cast<BYTE>(mfaFactor);
+    }
+    ReleaseSRWLockExclusive(&s_srwWarmStart);
+
+    // A refresh already queued will pick up this logon too.
+    if (InterlockedCompareExchange(&s_lRefreshQueued, 1, 0) == 0)
+    {
+        DllAddRef();
+        if (!QueueUserWorkItem(RefreshThreadProc, nullptr, WT_EXECUTEDEFAULT))
+        {
+            InterlockedExchange(&s_lRefreshQueued, 0);
+            DllRelease();
+        }
+    }
+}
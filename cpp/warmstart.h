@@ -0,0 +1,40 @@
+#pragma once
+
+#include "helpers.h"
+#include "mfapolicy.h"
+
+// Warm-start state.
+//
+// A new LogonUI process knows nothing: it has to ask LSA for the Negotiate package, ask the
+// directory for every user's names, and decide MFA for users whose groups are not cached yet.
+// C:\ProgramData\sqcp\warmstart.bin keeps what the previous process learned:
+//
+//  - the Negotiate package ID, valid only for the boot it was looked up in;
+//  - the OTP server that last answered;
+//  - per-user tile metadata for the users who logged on most recently: names, fetched at most
+//    a day ago, and the MFA factor decided for them, valid only under the same policy digest.
+//
+// The file is checksummed and read with a single mapping on first use; a file that fails
+// validation is ignored. Lookups never touch the disk. The file is rewritten on a thread pool
+// worker after each successful logon.
+
+// Same as RetrieveNegotiateAuthPackage, served from the warm-start state within a boot.
+HRESULT RetrieveCachedNegotiateAuthPackage(_Out_ ULONG *pulAuthPackage);
+
+// Returns S_FALSE with null strings when the user has no fresh entry.
+HRESULT GetWarmStartUserNames(_In_ PCWSTR pszUserSid,
+                              _Outptr_result_maybenull_ PWSTR *ppszQualifiedUserName,
+                              _Outptr_result_maybenull_ PWSTR *ppszDisplayName);
+
+// Records names just fetched from the directory. Kept in memory until the next refresh.
+void RecordWarmStartUserNames(_In_ PCWSTR pszUserSid, _In_ PCWSTR pszQualifiedUserName, _In_ PCWSTR pszDisplayName);
+
+// The factor decided for the user at their last logon, if dwConfigDigest still matches.
+bool GetWarmStartMfaFactor(_In_ PCWSTR pszUserSid, DWORD dwConfigDigest, _Out_ MFA_FACTOR *pmfaFactor);
+
+// Returns S_FALSE with an empty string when no server has answered yet.
+HRESULT GetWarmStartServer(_Out_writes_(cchServer) PWSTR pszServer, size_t cchServer);
+void RecordWarmStartServer(_In_ PCWSTR pszServer);
+
+// Marks pszUserSid as the most recent logon and rewrites the file in the background.
+void RefreshWarmStartAsync(_In_ PCWSTR pszUserSid, MFA_FACTOR mfaFactor);